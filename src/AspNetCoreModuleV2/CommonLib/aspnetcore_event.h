@@ -546,5 +546,101 @@ public:
                                  2 ); //Verbosity
         };
     };
+    //
+    // Event: mof class name ANCMForwardPhases,
+    // Description: Time of each forwarding phase, in microseconds
+    // EventTypeName: ANCM_REQUEST_FORWARD_PHASES
+    // EventType: 8
+    // EventLevel: 4
+    //
+    
+    class ANCM_REQUEST_FORWARD_PHASES
+    {
+    public:
+        static
+        HRESULT
+        RaiseEvent(
+            IHttpTraceContext * pHttpTraceContext,
+            LPCGUID    pContextId,
+            ULONG      QueueTime,
+            ULONG      ConnectTime,
+            ULONG      SendTime,
+            ULONG      FirstByteTime,
+            ULONG      BodyTime,
+            ULONG      ClientWriteTime
+        )
+        //
+        // Raise ANCM_REQUEST_FORWARD_PHASES Event
+        //
+        {
+            HTTP_TRACE_EVENT Event;
+            Event.pProviderGuid = WWWServerTraceProvider::GetProviderGuid();
+            Event.dwArea =  WWWServerTraceProvider::ANCM;
+            Event.pAreaGuid = ANCMEvents::GetAreaGuid();
+            Event.dwEvent = 8;
+            Event.pszEventName = L"ANCM_REQUEST_FORWARD_PHASES";
+            Event.dwEventVersion = 1;
+            Event.dwVerbosity = 4;
+            Event.cEventItems = 7;
+            Event.pActivityGuid = NULL;
+            Event.pRelatedActivityGuid = NULL;
+            Event.dwTimeStamp = 0;
+            Event.dwFlags = HTTP_TRACE_EVENT_FLAG_STATIC_DESCRIPTIVE_FIELDS;
+    
+            // pActivityGuid, pRelatedActivityGuid, Timestamp to be filled in by IIS
+    
+            HTTP_TRACE_EVENT_ITEM Items[ 7 ];
+            Items[ 0 ].pszName = L"ContextId";
+            Items[ 0 ].dwDataType = HTTP_TRACE_TYPE_LPCGUID; // mof type (object)
+            Items[ 0 ].pbData = (PBYTE) pContextId;
+            Items[ 0 ].cbData = 16;
+            Items[ 0 ].pszDataDescription = NULL;
+            Items[ 1 ].pszName = L"QueueTime";
+            Items[ 1 ].dwDataType = HTTP_TRACE_TYPE_ULONG; // mof type (uint32)
+            Items[ 1 ].pbData = (PBYTE) &QueueTime;
+            Items[ 1 ].cbData = 4;
+            Items[ 1 ].pszDataDescription = NULL;
+            Items[ 2 ].pszName = L"ConnectTime";
+            Items[ 2 ].dwDataType = HTTP_TRACE_TYPE_ULONG; // mof type (uint32)
+            Items[ 2 ].pbData = (PBYTE) &ConnectTime;
+            Items[ 2 ].cbData = 4;
+            Items[ 2 ].pszDataDescription = NULL;
+            Items[ 3 ].pszName = L"SendTime";
+            Items[ 3 ].dwDataType = HTTP_TRACE_TYPE_ULONG; // mof type (uint32)
+            Items[ 3 ].pbData = (PBYTE) &SendTime;
+            Items[ 3 ].cbData = 4;
+            Items[ 3 ].pszDataDescription = NULL;
+            Items[ 4 ].pszName = L"FirstByteTime";
+            Items[ 4 ].dwDataType = HTTP_TRACE_TYPE_ULONG; // mof type (uint32)
+            Items[ 4 ].pbData = (PBYTE) &FirstByteTime;
+            Items[ 4 ].cbData = 4;
+            Items[ 4 ].pszDataDescription = NULL;
+            Items[ 5 ].pszName = L"BodyTime";
+            Items[ 5 ].dwDataType = HTTP_TRACE_TYPE_ULONG; // mof type (uint32)
+            Items[ 5 ].pbData = (PBYTE) &BodyTime;
+            Items[ 5 ].cbData = 4;
+            Items[ 5 ].pszDataDescription = NULL;
+            Items[ 6 ].pszName = L"ClientWriteTime";
+            Items[ 6 ].dwDataType = HTTP_TRACE_TYPE_ULONG; // mof type (uint32)
+            Items[ 6 ].pbData = (PBYTE) &ClientWriteTime;
+            Items[ 6 ].cbData = 4;
+            Items[ 6 ].pszDataDescription = NULL;
+            Event.pEventItems = Items;
+            pHttpTraceContext->RaiseTraceEvent( &Event );
+            return S_OK;
+        };
+    
+        static
+        BOOL
+        IsEnabled( 
+            IHttpTraceContext *  pHttpTraceContext )
+        // Check if tracing for this event is enabled
+        {
+            return WWWServerTraceProvider::CheckTracingEnabled( 
+                                 pHttpTraceContext,
+                                 WWWServerTraceProvider::ANCM,
+                                 4 ); //Verbosity
+        };
+    };
 };
 #endif
@@ -15,6 +15,22 @@ class ConfigUtility
     #define CS_ASPNETCORE_HANDLER_VERSION                    L"handlerVersion"
     #define CS_ASPNETCORE_DEBUG_FILE                         L"debugFile"
     #define CS_ASPNETCORE_DEBUG_LEVEL                        L"debugLevel"
+    #define CS_ASPNETCORE_LOAD_BALANCING_POLICY              L"loadBalancingPolicy"
+    #define CS_ASPNETCORE_PARALLEL_PROCESS_STARTUP           L"parallelProcessStartup"
+    #define CS_ASPNETCORE_HOT_STANDBY_PROCESS                L"hotStandbyProcess"
+    #define CS_ASPNETCORE_RESPONSE_CACHE_SIZE                L"responseCacheSizeInMB"
+    #define CS_ASPNETCORE_REQUEST_COALESCING_TIMEOUT         L"requestCoalescingTimeoutInMS"
+    #define CS_ASPNETCORE_MAX_CONCURRENT_REQUESTS            L"maxConcurrentRequests"
+    #define CS_ASPNETCORE_MAX_QUEUED_REQUESTS                L"maxQueuedRequests"
+    #define CS_ASPNETCORE_REQUEST_QUEUE_TIMEOUT              L"requestQueueTimeoutInMS"
+    #define CS_ASPNETCORE_BACKEND_TRANSPORT                  L"backendTransport"
+    #define CS_ASPNETCORE_MAX_BACKEND_CONNECTIONS            L"maxBackendConnections"
+    #define CS_ASPNETCORE_MIN_IDLE_BACKEND_CONNECTIONS       L"minIdleBackendConnections"
+    #define CS_ASPNETCORE_BACKEND_CONNECTION_IDLE_TIMEOUT    L"backendConnectionIdleTimeoutInMS"
+    #define CS_ASPNETCORE_BACKEND_PROTOCOL                   L"backendProtocol"
+    #define CS_ASPNETCORE_H2C_CONNECTIONS                    L"h2cConnections"
+    #define CS_ASPNETCORE_WEBSOCKET_MAX_BUFFER_SIZE          L"webSocketMaxBufferSize"
+    #define CS_ASPNETCORE_WEBSOCKET_HIBERNATION              L"webSocketHibernation"
     #define CS_ASPNETCORE_HANDLER_SETTINGS_NAME              L"name"
     #define CS_ASPNETCORE_HANDLER_SETTINGS_VALUE             L"value"
 
@@ -40,6 +56,118 @@ public:
         return FindKeyValuePair(pElement, CS_ASPNETCORE_DEBUG_LEVEL, strDebugFile);
     }
 
+    static
+    HRESULT
+    FindLoadBalancingPolicy(IAppHostElement* pElement, STRU& strLoadBalancingPolicy)
+    {
+        return FindKeyValuePair(pElement, CS_ASPNETCORE_LOAD_BALANCING_POLICY, strLoadBalancingPolicy);
+    }
+
+    static
+    HRESULT
+    FindParallelProcessStartup(IAppHostElement* pElement, STRU& strParallelProcessStartup)
+    {
+        return FindKeyValuePair(pElement, CS_ASPNETCORE_PARALLEL_PROCESS_STARTUP, strParallelProcessStartup);
+    }
+
+    static
+    HRESULT
+    FindHotStandbyProcess(IAppHostElement* pElement, STRU& strHotStandbyProcess)
+    {
+        return FindKeyValuePair(pElement, CS_ASPNETCORE_HOT_STANDBY_PROCESS, strHotStandbyProcess);
+    }
+
+    static
+    HRESULT
+    FindResponseCacheSize(IAppHostElement* pElement, STRU& strResponseCacheSize)
+    {
+        return FindKeyValuePair(pElement, CS_ASPNETCORE_RESPONSE_CACHE_SIZE, strResponseCacheSize);
+    }
+
+    static
+    HRESULT
+    FindRequestCoalescingTimeout(IAppHostElement* pElement, STRU& strRequestCoalescingTimeout)
+    {
+        return FindKeyValuePair(pElement, CS_ASPNETCORE_REQUEST_COALESCING_TIMEOUT, strRequestCoalescingTimeout);
+    }
+
+    static
+    HRESULT
+    FindMaxConcurrentRequests(IAppHostElement* pElement, STRU& strMaxConcurrentRequests)
+    {
+        return FindKeyValuePair(pElement, CS_ASPNETCORE_MAX_CONCURRENT_REQUESTS, strMaxConcurrentRequests);
+    }
+
+    static
+    HRESULT
+    FindMaxQueuedRequests(IAppHostElement* pElement, STRU& strMaxQueuedRequests)
+    {
+        return FindKeyValuePair(pElement, CS_ASPNETCORE_MAX_QUEUED_REQUESTS, strMaxQueuedRequests);
+    }
+
+    static
+    HRESULT
+    FindRequestQueueTimeout(IAppHostElement* pElement, STRU& strRequestQueueTimeout)
+    {
+        return FindKeyValuePair(pElement, CS_ASPNETCORE_REQUEST_QUEUE_TIMEOUT, strRequestQueueTimeout);
+    }
+
+    static
+    HRESULT
+    FindBackendTransport(IAppHostElement* pElement, STRU& strBackendTransport)
+    {
+        return FindKeyValuePair(pElement, CS_ASPNETCORE_BACKEND_TRANSPORT, strBackendTransport);
+    }
+
+    static
+    HRESULT
+    FindMaxBackendConnections(IAppHostElement* pElement, STRU& strMaxBackendConnections)
+    {
+        return FindKeyValuePair(pElement, CS_ASPNETCORE_MAX_BACKEND_CONNECTIONS, strMaxBackendConnections);
+    }
+
+    static
+    HRESULT
+    FindMinIdleBackendConnections(IAppHostElement* pElement, STRU& strMinIdleBackendConnections)
+    {
+        return FindKeyValuePair(pElement, CS_ASPNETCORE_MIN_IDLE_BACKEND_CONNECTIONS, strMinIdleBackendConnections);
+    }
+
+    static
+    HRESULT
+    FindBackendConnectionIdleTimeout(IAppHostElement* pElement, STRU& strBackendConnectionIdleTimeout)
+    {
+        return FindKeyValuePair(pElement, CS_ASPNETCORE_BACKEND_CONNECTION_IDLE_TIMEOUT, strBackendConnectionIdleTimeout);
+    }
+
+    static
+    HRESULT
+    FindBackendProtocol(IAppHostElement* pElement, STRU& strBackendProtocol)
+    {
+        return FindKeyValuePair(pElement, CS_ASPNETCORE_BACKEND_PROTOCOL, strBackendProtocol);
+    }
+
+    static
+    HRESULT
+    FindH2cConnections(IAppHostElement* pElement, STRU& strH2cConnections)
+    {
+        return FindKeyValuePair(pElement, CS_ASPNETCORE_H2C_CONNECTIONS, strH2cConnections);
+    }
+
+    static
+    HRESULT
+    FindWebSocketMaxBufferSize(IAppHostElement* pElement, STRU& strWebSocketMaxBufferSize)
+    {
+        return FindKeyValuePair(pElement, CS_ASPNETCORE_WEBSOCKET_MAX_BUFFER_SIZE, strWebSocketMaxBufferSize);
+    }
+
+    static
+    HRESULT
+    FindWebSocketHibernation(IAppHostElement* pElement, STRU& strWebSocketHibernation)
+    {
+        return FindKeyValuePair(pElement, CS_ASPNETCORE_WEBSOCKET_HIBERNATION, strWebSocketHibernation);
+    }
+
 private:
     static
     HRESULT
@@ -0,0 +1,620 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#pragma once
+
+#include "sttimer.h"
+#include "percpu.h"
+
+//
+// TIMER_WHEEL keeps the timeouts of many objects on a hierarchical timing
+// wheel driven by a single threadpool timer, instead of a threadpool timer
+// per object.
+//
+// The wheel is split per processor. An entry is armed on the shard of the
+// processor that arms it and stays there until it fires or is cancelled,
+// so arming and cancelling are O(1) list operations under the lock of that
+// shard only, and requests on different processors do not serialize on one
+// lock. Cancelling an entry that is not armed does not take a lock.
+//
+// Each shard has LEVELS levels of SLOTS slots. Level 0 holds the entries
+// that expire within SLOTS ticks, one slot per tick, each higher level
+// covers SLOTS times the span of the one below and its slots are spread
+// over the lower levels as the wheel turns. Timeouts beyond the top level
+// are parked there and placed again when they come round.
+//
+// Callbacks run on the timer thread, one at a time and without any shard
+// lock held, so they may arm or cancel entries, their own included. The
+// timer is only running while entries are armed.
+//
+
+typedef
+VOID
+(*PFN_TIMER_WHEEL_CALLBACK)(
+    PVOID       pvContext
+);
+
+//
+// Embedded in the object that times out, set up once with
+// TIMER_WHEEL::InitializeEntry.
+//
+struct TIMER_WHEEL_ENTRY
+{
+    LIST_ENTRY                  listEntry;
+    ULONGLONG                   ullExpires;
+    PFN_TIMER_WHEEL_CALLBACK    pfnCallback;
+    PVOID                       pvContext;
+    //
+    // The shard the entry was last armed on.
+    //
+    PVOID                       pShard;
+    volatile BOOL               fArmed;
+};
+
+struct TIMER_WHEEL_COUNTERS
+{
+    ULONGLONG   cArmed;
+    ULONGLONG   cCancelled;
+    ULONGLONG   cFired;
+
+    DWORD       cPending;
+};
+
+class TIMER_WHEEL
+{
+public:
+
+    static const DWORD      TICK_MS = 10;
+    static const DWORD      LEVELS = 4;
+    static const DWORD      SLOT_BITS = 6;
+    static const DWORD      SLOTS = 1 << SLOT_BITS;
+    //
+    // About 46 hours at 10ms a tick.
+    //
+    static const ULONGLONG  MAX_TICKS = 1ull << (LEVELS * SLOT_BITS);
+
+    TIMER_WHEEL() :
+        m_pShards(NULL),
+        m_fDriveTimer(FALSE),
+        m_fTimerRunning(FALSE),
+        m_fAdvancing(FALSE),
+        m_pFiringEntry(NULL),
+        m_dwFiringThreadId(0)
+    {
+        InitializeSRWLock(&m_srwLock);
+    }
+
+    ~TIMER_WHEEL()
+    {
+        m_timer.CancelTimer();
+
+        if (m_pShards != NULL)
+        {
+            m_pShards->Dispose();
+            m_pShards = NULL;
+        }
+    }
+
+    static
+    VOID
+    InitializeEntry(
+        _Out_ TIMER_WHEEL_ENTRY *   pEntry,
+        PFN_TIMER_WHEEL_CALLBACK    pfnCallback,
+        PVOID                       pvContext
+    )
+    {
+        InitializeListHead(&pEntry->listEntry);
+        pEntry->ullExpires = 0;
+        pEntry->pfnCallback = pfnCallback;
+        pEntry->pvContext = pvContext;
+        pEntry->pShard = NULL;
+        pEntry->fArmed = FALSE;
+    }
+
+    //
+    // Creates the shards and the threadpool timer that turns the wheel, the
+    // timer is started by the first Arm. Without it the owner calls Advance
+    // itself.
+    //
+    HRESULT
+    Initialize(
+        BOOL    fDriveTimer = TRUE
+    )
+    {
+        HRESULT hr;
+
+        hr = PER_CPU<SHARD>::Create(
+                [] (SHARD * pShard)
+                {
+                    InitializeSRWLock(&pShard->srwLock);
+
+                    for (DWORD level = 0; level < LEVELS; level++)
+                    {
+                        for (DWORD slot = 0; slot < SLOTS; slot++)
+                        {
+                            InitializeListHead(&pShard->rgSlots[level][slot]);
+                        }
+                    }
+                },
+                &m_pShards);
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+
+        m_fDriveTimer = fDriveTimer;
+
+        if (!fDriveTimer)
+        {
+            return S_OK;
+        }
+
+        return m_timer.InitializeTimer(TimerCallback, this);
+    }
+
+    //
+    // Arms pEntry to fire dwTimeoutMs after ullNow, an entry that is armed
+    // already is moved. Returns TRUE if it was armed before.
+    //
+    BOOL
+    Arm(
+        _In_ TIMER_WHEEL_ENTRY *    pEntry,
+        DWORD                       dwTimeoutMs,
+        ULONGLONG                   ullNow
+    )
+    {
+        ULONGLONG   ullExpires = (ullNow + dwTimeoutMs + TICK_MS - 1) / TICK_MS;
+        SHARD *     pShard;
+
+        //
+        // An entry that is armed is moved on its own shard, unless it has
+        // just been handed to its callback.
+        //
+        if (pEntry->fArmed)
+        {
+            pShard = static_cast<SHARD *>(pEntry->pShard);
+
+            AcquireSRWLockExclusive(&pShard->srwLock);
+
+            if (pEntry->fArmed)
+            {
+                RemoveEntryList(&pEntry->listEntry);
+                pEntry->ullExpires = max(ullExpires, pShard->ullCurrentTick + 1);
+                InsertEntry(pShard, pEntry);
+                pShard->cArmed++;
+
+                ReleaseSRWLockExclusive(&pShard->srwLock);
+
+                return TRUE;
+            }
+
+            ReleaseSRWLockExclusive(&pShard->srwLock);
+        }
+
+        pShard = m_pShards->GetLocal();
+
+        AcquireSRWLockExclusive(&pShard->srwLock);
+
+        if (pShard->cPending++ == 0)
+        {
+            //
+            // Nothing is on the shard, it can skip the ticks that went by
+            // while it was empty.
+            //
+            pShard->ullCurrentTick = max(pShard->ullCurrentTick, ullNow / TICK_MS);
+        }
+
+        pEntry->ullExpires = max(ullExpires, pShard->ullCurrentTick + 1);
+        pEntry->pShard = pShard;
+        pEntry->fArmed = TRUE;
+        InsertEntry(pShard, pEntry);
+        pShard->cArmed++;
+
+        ReleaseSRWLockExclusive(&pShard->srwLock);
+
+        if (m_fDriveTimer && !m_fTimerRunning)
+        {
+            StartTimer();
+        }
+
+        return FALSE;
+    }
+
+    //
+    // Disarms pEntry. Returns TRUE if it was armed and its callback will not
+    // run, FALSE if it was not armed or its callback is already under way.
+    //
+    BOOL
+    Cancel(
+        _In_ TIMER_WHEEL_ENTRY *    pEntry
+    )
+    {
+        BOOL    fCancelled = FALSE;
+        SHARD * pShard;
+
+        //
+        // Entries are armed by their owner, and the owner cancelling one
+        // sees its own writes, so an entry that reads as not armed has been
+        // cancelled or handed to its callback already.
+        //
+        if (!pEntry->fArmed)
+        {
+            return FALSE;
+        }
+
+        pShard = static_cast<SHARD *>(pEntry->pShard);
+
+        AcquireSRWLockExclusive(&pShard->srwLock);
+
+        if (pEntry->fArmed)
+        {
+            RemoveEntryList(&pEntry->listEntry);
+            InitializeListHead(&pEntry->listEntry);
+            pEntry->fArmed = FALSE;
+            pShard->cPending--;
+            pShard->cCancelled++;
+            fCancelled = TRUE;
+        }
+
+        ReleaseSRWLockExclusive(&pShard->srwLock);
+
+        return fCancelled;
+    }
+
+    //
+    // Disarms pEntry and waits for a callback of it that is under way, for
+    // owners about to go away. Must not be called from another callback.
+    //
+    VOID
+    CancelAndWait(
+        _In_ TIMER_WHEEL_ENTRY *    pEntry
+    )
+    {
+        BOOL fFiring;
+
+        Cancel(pEntry);
+
+        for (;;)
+        {
+            AcquireSRWLockShared(&m_srwLock);
+            fFiring = m_pFiringEntry == pEntry &&
+                      m_dwFiringThreadId != GetCurrentThreadId();
+            ReleaseSRWLockShared(&m_srwLock);
+
+            if (!fFiring)
+            {
+                break;
+            }
+
+            Sleep(1);
+        }
+
+        //
+        // The callback may have armed it again.
+        //
+        Cancel(pEntry);
+    }
+
+    //
+    // Turns every shard up to ullNow and runs the callbacks of the entries
+    // that expired. Called by the timer every tick.
+    //
+    VOID
+    Advance(
+        ULONGLONG   ullNow
+    )
+    {
+        ULONGLONG   ullTick = ullNow / TICK_MS;
+
+        //
+        // A tick that comes while the previous one is still running its
+        // callbacks is dropped, the next one catches up.
+        //
+        if (InterlockedCompareExchange(&m_fAdvancing, TRUE, FALSE) != FALSE)
+        {
+            return;
+        }
+
+        m_pShards->ForEach(
+            [this, ullTick] (SHARD * pShard)
+            {
+                AdvanceShard(pShard, ullTick);
+            });
+
+        AcquireSRWLockExclusive(&m_srwLock);
+
+        //
+        // An Arm that finds the timer running after this has put its entry
+        // on a shard before QueryPending looks at it.
+        //
+        if (m_fTimerRunning)
+        {
+            m_fTimerRunning = FALSE;
+            MemoryBarrier();
+
+            if (QueryPending() != 0)
+            {
+                m_fTimerRunning = TRUE;
+            }
+            else
+            {
+                m_timer.SetTimer(0);
+            }
+        }
+
+        ReleaseSRWLockExclusive(&m_srwLock);
+
+        InterlockedExchange(&m_fAdvancing, FALSE);
+    }
+
+    VOID
+    QueryCounters(
+        _Out_ TIMER_WHEEL_COUNTERS *    pCounters
+    )
+    {
+        ZeroMemory(pCounters, sizeof(*pCounters));
+
+        m_pShards->ForEach(
+            [pCounters] (SHARD * pShard)
+            {
+                AcquireSRWLockShared(&pShard->srwLock);
+
+                pCounters->cArmed += pShard->cArmed;
+                pCounters->cCancelled += pShard->cCancelled;
+                pCounters->cFired += pShard->cFired;
+                pCounters->cPending += pShard->cPending;
+
+                ReleaseSRWLockShared(&pShard->srwLock);
+            });
+    }
+
+private:
+
+    struct SHARD
+    {
+        SRWLOCK         srwLock;
+        LIST_ENTRY      rgSlots[LEVELS][SLOTS];
+        ULONGLONG       ullCurrentTick;
+        DWORD           cPending;
+
+        ULONGLONG       cArmed;
+        ULONGLONG       cCancelled;
+        ULONGLONG       cFired;
+    };
+
+    VOID
+    AdvanceShard(
+        _In_ SHARD *    pShard,
+        ULONGLONG       ullTick
+    )
+    {
+        LIST_ENTRY          expired;
+        TIMER_WHEEL_ENTRY * pEntry;
+
+        InitializeListHead(&expired);
+
+        AcquireSRWLockExclusive(&pShard->srwLock);
+
+        if (pShard->cPending == 0)
+        {
+            pShard->ullCurrentTick = max(pShard->ullCurrentTick, ullTick);
+        }
+
+        while (pShard->ullCurrentTick < ullTick)
+        {
+            pShard->ullCurrentTick++;
+
+            //
+            // Each time a level wraps, the next slot of the level above is
+            // spread over the levels below.
+            //
+            for (DWORD level = 1;
+                 level < LEVELS && ((pShard->ullCurrentTick >> ((level - 1) * SLOT_BITS)) & (SLOTS - 1)) == 0;
+                 level++)
+            {
+                Cascade(pShard, level, (pShard->ullCurrentTick >> (level * SLOT_BITS)) & (SLOTS - 1));
+            }
+
+            ExpireSlot(pShard, &pShard->rgSlots[0][pShard->ullCurrentTick & (SLOTS - 1)], &expired);
+        }
+
+        //
+        // Expired entries stay armed until they are taken off the list, so
+        // they can still be cancelled or moved while earlier ones run.
+        //
+        while (!IsListEmpty(&expired))
+        {
+            pEntry = CONTAINING_RECORD(RemoveHeadList(&expired), TIMER_WHEEL_ENTRY, listEntry);
+            InitializeListHead(&pEntry->listEntry);
+            pShard->cPending--;
+            pShard->cFired++;
+
+            //
+            // Marked as firing before it reads as not armed, for
+            // CancelAndWait.
+            //
+            AcquireSRWLockExclusive(&m_srwLock);
+            m_pFiringEntry = pEntry;
+            m_dwFiringThreadId = GetCurrentThreadId();
+            ReleaseSRWLockExclusive(&m_srwLock);
+
+            pEntry->fArmed = FALSE;
+
+            ReleaseSRWLockExclusive(&pShard->srwLock);
+
+            //
+            // The entry may be gone once it has been called.
+            //
+            pEntry->pfnCallback(pEntry->pvContext);
+
+            AcquireSRWLockExclusive(&m_srwLock);
+            m_pFiringEntry = NULL;
+            ReleaseSRWLockExclusive(&m_srwLock);
+
+            AcquireSRWLockExclusive(&pShard->srwLock);
+        }
+
+        ReleaseSRWLockExclusive(&pShard->srwLock);
+    }
+
+    VOID
+    StartTimer(
+        VOID
+    )
+    {
+        AcquireSRWLockExclusive(&m_srwLock);
+
+        if (!m_fTimerRunning)
+        {
+            m_fTimerRunning = TRUE;
+            m_timer.SetTimer(TICK_MS, TICK_MS);
+        }
+
+        ReleaseSRWLockExclusive(&m_srwLock);
+    }
+
+    DWORD
+    QueryPending(
+        VOID
+    )
+    {
+        DWORD cPending = 0;
+
+        m_pShards->ForEach(
+            [&cPending] (SHARD * pShard)
+            {
+                AcquireSRWLockShared(&pShard->srwLock);
+                cPending += pShard->cPending;
+                ReleaseSRWLockShared(&pShard->srwLock);
+            });
+
+        return cPending;
+    }
+
+    static
+    VOID
+    InsertEntry(
+        _In_ SHARD *                pShard,
+        _In_ TIMER_WHEEL_ENTRY *    pEntry
+    )
+    {
+        ULONGLONG   ullExpires = max(pEntry->ullExpires, pShard->ullCurrentTick);
+        ULONGLONG   ullDelta = ullExpires - pShard->ullCurrentTick;
+        DWORD       level = 0;
+
+        if (ullDelta >= MAX_TICKS)
+        {
+            //
+            // Parked on the top level, ExpireSlot places it again.
+            //
+            ullDelta = MAX_TICKS - 1;
+            ullExpires = pShard->ullCurrentTick + ullDelta;
+        }
+
+        while (ullDelta >= (1ull << ((level + 1) * SLOT_BITS)))
+        {
+            level++;
+        }
+
+        InsertTailList(&pShard->rgSlots[level][(ullExpires >> (level * SLOT_BITS)) & (SLOTS - 1)],
+                       &pEntry->listEntry);
+    }
+
+    static
+    VOID
+    Cascade(
+        _In_ SHARD *    pShard,
+        DWORD           level,
+        ULONGLONG       slot
+    )
+    {
+        LIST_ENTRY  entries;
+
+        MoveList(&pShard->rgSlots[level][slot], &entries);
+
+        while (!IsListEmpty(&entries))
+        {
+            InsertEntry(pShard, CONTAINING_RECORD(RemoveHeadList(&entries), TIMER_WHEEL_ENTRY, listEntry));
+        }
+    }
+
+    static
+    VOID
+    ExpireSlot(
+        _In_ SHARD *        pShard,
+        _In_ LIST_ENTRY *   pSlot,
+        _In_ LIST_ENTRY *   pExpired
+    )
+    {
+        LIST_ENTRY          entries;
+        TIMER_WHEEL_ENTRY * pEntry;
+
+        MoveList(pSlot, &entries);
+
+        while (!IsListEmpty(&entries))
+        {
+            pEntry = CONTAINING_RECORD(RemoveHeadList(&entries), TIMER_WHEEL_ENTRY, listEntry);
+
+            if (pEntry->ullExpires > pShard->ullCurrentTick)
+            {
+                InsertEntry(pShard, pEntry);
+            }
+            else
+            {
+                InsertTailList(pExpired, &pEntry->listEntry);
+            }
+        }
+    }
+
+    static
+    VOID
+    MoveList(
+        _In_ LIST_ENTRY *   pFrom,
+        _Out_ LIST_ENTRY *  pTo
+    )
+    {
+        if (IsListEmpty(pFrom))
+        {
+            InitializeListHead(pTo);
+            return;
+        }
+
+        *pTo = *pFrom;
+        pTo->Flink->Blink = pTo;
+        pTo->Blink->Flink = pTo;
+        InitializeListHead(pFrom);
+    }
+
+    static
+    VOID
+    CALLBACK
+    TimerCallback(
+        _In_ PTP_CALLBACK_INSTANCE  Instance,
+        _In_ PVOID                  Context,
+        _In_ PTP_TIMER              Timer
+    )
+    {
+        UNREFERENCED_PARAMETER(Instance);
+        UNREFERENCED_PARAMETER(Timer);
+
+        static_cast<TIMER_WHEEL *>(Context)->Advance(GetTickCount64());
+    }
+
+    PER_CPU<SHARD> *        m_pShards;
+
+    //
+    // Guards the timer and the firing entry, Arm and Cancel only take the
+    // lock of a shard.
+    //
+    SRWLOCK                 m_srwLock;
+    BOOL                    m_fDriveTimer;
+    volatile BOOL           m_fTimerRunning;
+    volatile LONG           m_fAdvancing;
+    //
+    // The entry whose callback is running, for CancelAndWait.
+    //
+    TIMER_WHEEL_ENTRY *     m_pFiringEntry;
+    DWORD                   m_dwFiringThreadId;
+
+    STTIMER                 m_timer;
+};
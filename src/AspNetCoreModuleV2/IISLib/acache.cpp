@@ -82,22 +82,22 @@ ALLOC_CACHE_HANDLER::Initialize(
     m_cbSize = (m_cbSize + sizeof(LONG) - 1) & ~(sizeof(LONG) - 1);
 
 #if defined(_MSC_VER) && _MSC_VER >= 1600 // VC10
-    auto Init = [] (SLIST_HEADER* pHead)
+    auto Init = [] (FREE_LIST* pFreeList)
     {
-        InitializeSListHead(pHead);
+        InitializeSListHead(&pFreeList->ListHeader);
     };
 #else
     class Functor
     {
     public:
-        void operator()(SLIST_HEADER* pHead)
+        void operator()(FREE_LIST* pFreeList)
         {
-            InitializeSListHead(pHead);
+            InitializeSListHead(&pFreeList->ListHeader);
         }
     } Init;
 #endif
     
-    hr = PER_CPU<SLIST_HEADER>::Create(Init,
+    hr = PER_CPU<FREE_LIST>::Create(Init,
                                        &m_pFreeLists );
     if (FAILED(hr))
     {
@@ -161,8 +161,9 @@ ALLOC_CACHE_HANDLER::CleanupLookaside(
     //
 
 #if defined(_MSC_VER) && _MSC_VER >= 1600 // VC10
-    auto Predicate = [=] (SLIST_HEADER * pListHeader)
+    auto Predicate = [=] (FREE_LIST * pFreeList)
     {
+        SLIST_HEADER * pListHeader = &pFreeList->ListHeader;
         PSLIST_ENTRY pl;
         LONG NodesToDelete = QueryDepthSList( pListHeader );
 
@@ -183,8 +184,9 @@ ALLOC_CACHE_HANDLER::CleanupLookaside(
         explicit Functor(ALLOC_CACHE_HANDLER * pThis) : _pThis(pThis)
         {
         }
-        void operator()(SLIST_HEADER * pListHeader)
+        void operator()(FREE_LIST * pFreeList)
         {
+            SLIST_HEADER * pListHeader = &pFreeList->ListHeader;
             PSLIST_ENTRY pl;
             LONG NodesToDelete = QueryDepthSList( pListHeader );
 
@@ -212,14 +214,16 @@ ALLOC_CACHE_HANDLER::Alloc(
 )
 {
     LPVOID pMemory = NULL;
+    FREE_LIST * pFreeList = m_pFreeLists ->GetLocal();
 
     if ( m_nThreshold > 0 )
     {
-        SLIST_HEADER * pListHeader = m_pFreeLists ->GetLocal();
-        pMemory = (LPVOID) InterlockedPopEntrySList(pListHeader);  // get the real object
+        pMemory = (LPVOID) InterlockedPopEntrySList(&pFreeList->ListHeader);  // get the real object
 
         if (pMemory != NULL)
         {
+            pFreeList->cHits++;
+
             FREE_LIST_HEADER* pfl = (FREE_LIST_HEADER*) pMemory;
             //
             // If the signature is wrong then somebody's been scribbling
@@ -234,6 +238,7 @@ ALLOC_CACHE_HANDLER::Alloc(
         //
         // No free entry. Need to alloc a new object.
         //
+        pFreeList->cMisses++;
         pMemory = (LPVOID) ::HeapAlloc( sm_hHeap,
                                         0,
                                         m_cbSize );
@@ -297,7 +302,8 @@ ALLOC_CACHE_HANDLER::Free(
     //
     // Store the items in the alloc cache.
     //
-    SLIST_HEADER * pListHeader = m_pFreeLists ->GetLocal();
+    FREE_LIST * pFreeList = m_pFreeLists ->GetLocal();
+    SLIST_HEADER * pListHeader = &pFreeList->ListHeader;
 
     if ( QueryDepthSList(pListHeader) >= m_nThreshold )
     {
@@ -305,6 +311,7 @@ ALLOC_CACHE_HANDLER::Free(
         // Threshold for free entries is exceeded. Free the object to
         // process pool.
         //
+        pFreeList->cReleased++;
         ::HeapFree( sm_hHeap, 0, pMemory );
     }
     else
@@ -341,9 +348,9 @@ Return Value:
     if (m_pFreeLists  != NULL)
     {
 #if defined(_MSC_VER) && _MSC_VER >= 1600 // VC10
-        auto Predicate = [&Count] (SLIST_HEADER * pListHeader)
+        auto Predicate = [&Count] (FREE_LIST * pFreeList)
         {
-            Count += QueryDepthSList(pListHeader);
+            Count += QueryDepthSList(&pFreeList->ListHeader);
         };
 #else
         class Functor
@@ -352,9 +359,9 @@ Return Value:
             explicit Functor(DWORD& Count) : _Count(Count)
             {
             }
-            void operator()(SLIST_HEADER * pListHeader)
+            void operator()(FREE_LIST * pFreeList)
             {
-                _Count += QueryDepthSList(pListHeader);
+                _Count += QueryDepthSList(&pFreeList->ListHeader);
             }
         private:
             DWORD& _Count;
@@ -369,6 +376,33 @@ Return Value:
     return Count;
 }
 
+VOID
+ALLOC_CACHE_HANDLER::QueryCounters(
+    __out ALLOC_CACHE_COUNTERS * pCounters
+)
+/*++
+
+Description:
+
+    Aggregates the hit and miss counters of all lists, used to size
+    the threshold.
+
+--*/
+{
+    ZeroMemory(pCounters, sizeof(*pCounters));
+
+    if (m_pFreeLists != NULL)
+    {
+        m_pFreeLists->ForEach(
+            [pCounters] (FREE_LIST * pFreeList)
+            {
+                pCounters->cHits += pFreeList->cHits;
+                pCounters->cMisses += pFreeList->cMisses;
+                pCounters->cReleased += pFreeList->cReleased;
+            });
+    }
+}
+
 // static
 BOOL
 ALLOC_CACHE_HANDLER::IsPageheapEnabled(
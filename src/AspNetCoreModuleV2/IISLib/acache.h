@@ -5,6 +5,20 @@
 
 #include "percpu.h"
 
+struct ALLOC_CACHE_COUNTERS
+{
+    //
+    // Allocations served from the free lists and from the heap.
+    //
+    ULONGLONG   cHits;
+    ULONGLONG   cMisses;
+
+    //
+    // Frees that went back to the heap because the local list was full.
+    //
+    ULONGLONG   cReleased;
+};
+
 class ALLOC_CACHE_HANDLER
 {
 public:
@@ -33,9 +47,26 @@ public:
         __in LPVOID pMemory
     );
 
+    VOID
+    QueryCounters(
+        __out ALLOC_CACHE_COUNTERS * pCounters
+    );
 
 private:
 
+    struct FREE_LIST
+    {
+        SLIST_HEADER    ListHeader;
+
+        //
+        // Only updated by the owning processor and not interlocked, so they
+        // are hints under thread migration.
+        //
+        ULONGLONG       cHits;
+        ULONGLONG       cMisses;
+        ULONGLONG       cReleased;
+    };
+
     VOID
     CleanupLookaside(
         VOID
@@ -49,7 +80,7 @@ private:
     LONG                    m_nThreshold;
     DWORD                   m_cbSize;
 
-    PER_CPU<SLIST_HEADER> * m_pFreeLists;
+    PER_CPU<FREE_LIST> *    m_pFreeLists;
 
     //
     // Total heap allocations done over the lifetime.
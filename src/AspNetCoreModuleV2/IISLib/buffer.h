@@ -5,6 +5,43 @@
 
 #include <crtdbg.h>
 
+//
+// Opt-in allocator for BUFFER_T spills, and so for STRA/STRU growth. A
+// buffer spills to the process heap unless its owner hands it an allocator
+// with SetSpillAllocator before it first spills. The allocator must outlive
+// every buffer that was handed it.
+//
+class BUFFER_SPILL_ALLOCATOR
+{
+public:
+
+    virtual
+    PVOID
+    Alloc(
+        SIZE_T      cbSize
+    ) = 0;
+
+    virtual
+    PVOID
+    ReAlloc(
+        PVOID       pMemory,
+        SIZE_T      cbOldSize,
+        SIZE_T      cbNewSize,
+        bool        fZeroMemoryBeyondOldSize
+    ) = 0;
+
+    virtual
+    VOID
+    Free(
+        PVOID       pMemory
+    ) = 0;
+
+protected:
+
+    ~BUFFER_SPILL_ALLOCATOR()
+    {}
+};
+
 
 //
 // BUFFER_T class shouldn't be used directly. Use BUFFER specialization class instead.
@@ -22,7 +59,8 @@ public:
     BUFFER_T()
       : m_cbBuffer( sizeof(m_rgBuffer) ),
         m_fHeapAllocated( false ),
-        m_pBuffer(m_rgBuffer)
+        m_pBuffer(m_rgBuffer),
+        m_pSpillAllocator( NULL )
     /*++
         Description:
 
@@ -45,7 +83,8 @@ public:
         __in DWORD cbInit
     ) : m_pBuffer( pbInit ),
         m_cbBuffer( cbInit ),
-        m_fHeapAllocated( false )
+        m_fHeapAllocated( false ),
+        m_pSpillAllocator( NULL )
     /*++
         Description:
 
@@ -71,17 +110,77 @@ public:
     }
 
     ~BUFFER_T()
+    {
+        FreeMemory();
+    }
+
+    VOID
+    FreeMemory(
+        VOID
+    )
+    /*++
+        Description:
+
+            Frees the memory the buffer spilled to and goes back to the
+            inline buffer, not to a buffer given to the constructor.
+            The contents are lost.
+
+        Arguments:
+
+            None.
+
+        Returns:
+
+            None.
+
+    --*/
     {
         if( IsHeapAllocated() )
         {
             _ASSERTE( NULL != m_pBuffer );
-            HeapFree( GetProcessHeap(), 0, m_pBuffer );
-            m_pBuffer = NULL;
-            m_cbBuffer = 0;
+            if ( m_pSpillAllocator != NULL )
+            {
+                m_pSpillAllocator->Free( m_pBuffer );
+            }
+            else
+            {
+                HeapFree( GetProcessHeap(), 0, m_pBuffer );
+            }
+            m_pBuffer = m_rgBuffer;
+            m_cbBuffer = sizeof(m_rgBuffer);
             m_fHeapAllocated = false;
         }
     }
 
+    VOID
+    SetSpillAllocator(
+        BUFFER_SPILL_ALLOCATOR *    pAllocator
+    )
+    /*++
+        Description:
+
+            Makes the buffer spill to pAllocator instead of the process
+            heap, NULL goes back to the heap. It sticks across FreeMemory.
+            Only allowed while the buffer has not spilled, the memory it
+            holds is freed into the allocator it came from.
+
+        Arguments:
+
+            pAllocator - Allocator to spill to, must outlive the buffer.
+
+        Returns:
+
+            None.
+
+    --*/
+    {
+        _ASSERTE( !IsHeapAllocated() );
+        if( !IsHeapAllocated() )
+        {
+            m_pSpillAllocator = pAllocator;
+        }
+    }
+
     T*
     QueryPtr(
         VOID
@@ -145,11 +244,29 @@ public:
 
         if( IsHeapAllocated() )
         {
-            pNewMem = HeapReAlloc( GetProcessHeap(), dwHeapAllocFlags, m_pBuffer, cbNewSize );
+            if ( m_pSpillAllocator != NULL )
+            {
+                pNewMem = m_pSpillAllocator->ReAlloc( m_pBuffer, m_cbBuffer, cbNewSize, fZeroMemoryBeyondOldSize );
+            }
+            else
+            {
+                pNewMem = HeapReAlloc( GetProcessHeap(), dwHeapAllocFlags, m_pBuffer, cbNewSize );
+            }
         }
         else
         {
-            pNewMem = HeapAlloc( GetProcessHeap(), dwHeapAllocFlags, cbNewSize );
+            if ( m_pSpillAllocator != NULL )
+            {
+                pNewMem = m_pSpillAllocator->Alloc( cbNewSize );
+                if ( pNewMem != NULL && fZeroMemoryBeyondOldSize )
+                {
+                    ZeroMemory( reinterpret_cast<BYTE*>(pNewMem) + m_cbBuffer, cbNewSize - m_cbBuffer );
+                }
+            }
+            else
+            {
+                pNewMem = HeapAlloc( GetProcessHeap(), dwHeapAllocFlags, cbNewSize );
+            }
         }
 
         if( pNewMem == NULL )
@@ -206,6 +323,11 @@ private:
     //
     __field_bcount_full(m_cbBuffer)
     T*      m_pBuffer;
+
+    //
+    // Allocator the buffer spills to, NULL for the process heap.
+    //
+    BUFFER_SPILL_ALLOCATOR * m_pSpillAllocator;
 };
 
 //
@@ -0,0 +1,152 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#pragma once
+
+#include "rwlock.h"
+#include "percpu.h"
+
+//
+// EPOCH_DOMAIN lets read-mostly structures be walked without a lock.
+//
+// Readers bracket their walk with EnterRead/LeaveRead, which only touch a
+// counter in the current processor's cache line. Writers (serialized by the
+// structure's own lock) unlink nodes, then call Synchronize before freeing
+// them: Synchronize returns once every read section that could still see
+// the unlinked nodes has left.
+//
+// The domain flips between two reader counters per processor. Synchronize
+// flips twice so that a reader which sampled the epoch just before a flip
+// and incremented its counter just after is waited for as well.
+//
+
+class EPOCH_DOMAIN
+{
+public:
+
+    EPOCH_DOMAIN(
+        VOID
+    ) : _pReaders( NULL ),
+        _lEpoch( 0 )
+    {
+    }
+
+    ~EPOCH_DOMAIN()
+    {
+        if (_pReaders != NULL)
+        {
+            _pReaders->Dispose();
+            _pReaders = NULL;
+        }
+    }
+
+    HRESULT
+    Initialize(
+        VOID
+    )
+    {
+        HRESULT hr = S_OK;
+
+        hr = _syncLock.Init();
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+
+        return PER_CPU<EPOCH_READERS>::Create(
+                    [] (EPOCH_READERS * pReaders)
+                    {
+                        pReaders->_rgReaders[0] = 0;
+                        pReaders->_rgReaders[1] = 0;
+                    },
+                    &_pReaders);
+    }
+
+    //
+    // Returns the counter to pass to LeaveRead, the thread may move to
+    // another processor in between.
+    //
+    volatile LONG *
+    EnterRead(
+        VOID
+    )
+    {
+        volatile LONG * pReaders = &_pReaders->GetLocal()->_rgReaders[_lEpoch & 1];
+
+        //
+        // Full barrier, the walk that follows cannot be reordered before it.
+        //
+        InterlockedIncrement(pReaders);
+        return pReaders;
+    }
+
+    VOID
+    LeaveRead(
+        volatile LONG *     pReaders
+    )
+    {
+        InterlockedDecrement(pReaders);
+    }
+
+    VOID
+    Synchronize(
+        VOID
+    );
+
+private:
+
+    struct EPOCH_READERS
+    {
+        volatile LONG   _rgReaders[2];
+    };
+
+    EPOCH_DOMAIN(const EPOCH_DOMAIN &);
+    void operator=(const EPOCH_DOMAIN &);
+
+    PER_CPU<EPOCH_READERS> *    _pReaders;
+    volatile LONG               _lEpoch;
+    CWSDRWLock                  _syncLock;
+};
+
+inline
+VOID
+EPOCH_DOMAIN::Synchronize(
+    VOID
+)
+/*++
+  Waits until every read section entered before this call has left.
+  Must not be called from within a read section.
+--*/
+{
+    _syncLock.ExclusiveAcquire();
+
+    for (DWORD i=0; i<2; i++)
+    {
+        //
+        // InterlockedIncrement orders the caller's unlinks before the flip.
+        //
+        LONG lOld = InterlockedIncrement(&_lEpoch) - 1;
+        DWORD dwSpin = 0;
+
+        _pReaders->ForEach(
+            [lOld, &dwSpin] (EPOCH_READERS * pReaders)
+            {
+                while (pReaders->_rgReaders[lOld & 1] != 0)
+                {
+                    //
+                    // Read sections are short, yield before sleeping.
+                    //
+                    if (++dwSpin < 64)
+                    {
+                        YieldProcessor();
+                    }
+                    else if (!SwitchToThread())
+                    {
+                        Sleep(1);
+                    }
+                }
+            });
+    }
+
+    _syncLock.ExclusiveRelease();
+}
@@ -114,7 +114,7 @@ PER_CPU<T>::Create(
         //
         // Round to the next multiple of the cache line size.
         //
-        ObjectCacheLineSize = (sizeof(T) + CacheLineSize-1) & (CacheLineSize-1);
+        ObjectCacheLineSize = (sizeof(T) + CacheLineSize-1) & ~(CacheLineSize-1);
     }
     else
     {
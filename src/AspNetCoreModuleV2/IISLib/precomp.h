@@ -18,5 +18,6 @@
 #include "ntassert.h"
 #include "ahutil.h"
 #include "acache.h"
+#include "sizecache.h"
 //#include "base64.hxx"
 
@@ -0,0 +1,155 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#pragma once
+
+#include "listentry.h"
+#include "percpu.h"
+
+//
+// SHARDED_LIST_ENTRY links an object into a SHARDED_LIST, embedded in the
+// object like a LIST_ENTRY. It remembers the shard it went into, the
+// object may well be removed on another processor.
+//
+struct SHARDED_LIST_ENTRY
+{
+    LIST_ENTRY  ListEntry;
+    PVOID       pShard;
+};
+
+//
+// SHARDED_LIST is an intrusive doubly-linked list split per processor.
+//
+// Insert links an entry into the shard of the current processor and
+// Remove unlinks it from the shard it went into, each under that shard's
+// lock only, so objects coming and going at a high rate on many threads
+// do not serialize on one lock the way a single locked LIST_ENTRY does.
+//
+// ForEach still visits every entry, one shard after the other under the
+// shard's lock, for shutdown and diagnostics. Entries inserted or removed
+// in other shards while it runs may or may not be visited.
+//
+class SHARDED_LIST
+{
+public:
+
+    SHARDED_LIST(
+        VOID
+    ) : m_pShards( NULL )
+    {
+    }
+
+    ~SHARDED_LIST()
+    {
+        if (m_pShards != NULL)
+        {
+            m_pShards->Dispose();
+            m_pShards = NULL;
+        }
+    }
+
+    HRESULT
+    Initialize(
+        VOID
+    )
+    {
+        return PER_CPU<SHARD>::Create(
+                    [] (SHARD * pShard)
+                    {
+                        InitializeSRWLock(&pShard->srwLock);
+                        InitializeListHead(&pShard->listHead);
+                        pShard->cEntries = 0;
+                    },
+                    &m_pShards);
+    }
+
+    VOID
+    Insert(
+        SHARDED_LIST_ENTRY *    pEntry
+    )
+    {
+        SHARD * pShard = m_pShards->GetLocal();
+
+        pEntry->pShard = pShard;
+
+        AcquireSRWLockExclusive(&pShard->srwLock);
+        InsertTailList(&pShard->listHead, &pEntry->ListEntry);
+        pShard->cEntries++;
+        ReleaseSRWLockExclusive(&pShard->srwLock);
+    }
+
+    VOID
+    Remove(
+        SHARDED_LIST_ENTRY *    pEntry
+    )
+    {
+        SHARD * pShard = static_cast<SHARD *>(pEntry->pShard);
+
+        AcquireSRWLockExclusive(&pShard->srwLock);
+        RemoveEntryList(&pEntry->ListEntry);
+        pShard->cEntries--;
+        ReleaseSRWLockExclusive(&pShard->srwLock);
+
+        pEntry->pShard = NULL;
+    }
+
+    //
+    // Calls Function(SHARDED_LIST_ENTRY *) for every entry, under the
+    // shared lock of its shard: the function must not insert or remove.
+    //
+    template<typename FunctionForEach>
+    VOID
+    ForEach(
+        FunctionForEach Function
+    )
+    {
+        m_pShards->ForEach(
+            [&Function] (SHARD * pShard)
+            {
+                AcquireSRWLockShared(&pShard->srwLock);
+
+                for (PLIST_ENTRY pListEntry = pShard->listHead.Flink;
+                     pListEntry != &pShard->listHead;
+                     pListEntry = pListEntry->Flink)
+                {
+                    Function(CONTAINING_RECORD(pListEntry, SHARDED_LIST_ENTRY, ListEntry));
+                }
+
+                ReleaseSRWLockShared(&pShard->srwLock);
+            });
+    }
+
+    //
+    // The number of entries, summed without the locks; exact only while
+    // nothing is inserted or removed.
+    //
+    LONGLONG
+    QueryCount(
+        VOID
+    )
+    {
+        LONGLONG cEntries = 0;
+
+        m_pShards->ForEach(
+            [&cEntries] (SHARD * pShard)
+            {
+                cEntries += pShard->cEntries;
+            });
+
+        return cEntries;
+    }
+
+private:
+
+    struct SHARD
+    {
+        SRWLOCK         srwLock;
+        LIST_ENTRY      listHead;
+        volatile LONG   cEntries;
+    };
+
+    SHARDED_LIST(const SHARDED_LIST &);
+    void operator=(const SHARDED_LIST &);
+
+    PER_CPU<SHARD> *    m_pShards;
+};
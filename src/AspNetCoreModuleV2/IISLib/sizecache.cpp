@@ -0,0 +1,490 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#include "precomp.h"
+
+SIZE_CLASS_CACHE::SIZE_CLASS_CACHE(
+    VOID
+) : m_nMagazineDepth(0),
+    m_nDepotDepth(0),
+    m_hHeap(GetProcessHeap()),
+    m_pMagazines(NULL),
+    m_pDepot(NULL),
+    m_pTrimTimer(NULL),
+    m_fTrimming(FALSE),
+    m_cAllocsAtLastTrim(0),
+    m_cTrimmed(0)
+{
+}
+
+SIZE_CLASS_CACHE::~SIZE_CLASS_CACHE(
+    VOID
+)
+{
+    StopTrimTimer();
+
+    if (m_pMagazines != NULL)
+    {
+        m_pMagazines->ForEach(
+            [this] (MAGAZINES * pMagazines)
+            {
+                for (DWORD i = 0; i < SIZE_CLASSES; i++)
+                {
+                    FlushList(&pMagazines->rgFreeLists[i], 0);
+                }
+            });
+        m_pMagazines->Dispose();
+        m_pMagazines = NULL;
+    }
+
+    if (m_pDepot != NULL)
+    {
+        for (DWORD i = 0; i < SIZE_CLASSES; i++)
+        {
+            FlushList(&m_pDepot[i].FreeList, 0);
+        }
+        _aligned_free(m_pDepot);
+        m_pDepot = NULL;
+    }
+}
+
+HRESULT
+SIZE_CLASS_CACHE::Initialize(
+    LONG        nMagazineDepth,
+    LONG        nDepotDepth
+)
+/*++
+  Description:
+    nMagazineDepth is the number of free blocks of each class kept per
+    processor, nDepotDepth the number kept in the shared depot.
+--*/
+{
+    HRESULT hr = S_OK;
+
+    //
+    // Both are compared against QueryDepthSList return value (USHORT).
+    //
+    m_nMagazineDepth = min(nMagazineDepth, 0xffff);
+    m_nDepotDepth = min(nDepotDepth, 0xffff);
+
+    if (ALLOC_CACHE_HANDLER::IsPageheapEnabled())
+    {
+        //
+        // Let pageheap see every allocation and free.
+        //
+        m_nMagazineDepth = 0;
+        m_nDepotDepth = 0;
+    }
+
+    hr = PER_CPU<MAGAZINES>::Create(
+            [] (MAGAZINES * pMagazines)
+            {
+                for (DWORD i = 0; i < SIZE_CLASSES; i++)
+                {
+                    InitializeSListHead(&pMagazines->rgFreeLists[i]);
+                }
+            },
+            &m_pMagazines);
+    if (FAILED(hr))
+    {
+        goto Finished;
+    }
+
+    m_pDepot = static_cast<DEPOT *>(_aligned_malloc(sizeof(DEPOT) * SIZE_CLASSES,
+                                                    SYSTEM_CACHE_ALIGNMENT_SIZE));
+    if (m_pDepot == NULL)
+    {
+        hr = E_OUTOFMEMORY;
+        goto Finished;
+    }
+
+    for (DWORD i = 0; i < SIZE_CLASSES; i++)
+    {
+        InitializeSListHead(&m_pDepot[i].FreeList);
+    }
+
+Finished:
+
+    return hr;
+}
+
+SIZE_CLASS_CACHE::BLOCK_HEADER *
+SIZE_CLASS_CACHE::AllocBlock(
+    DWORD       dwClass
+)
+{
+    MAGAZINES *     pMagazines = m_pMagazines->GetLocal();
+    PSLIST_ENTRY    pEntry = NULL;
+    BLOCK_HEADER *  pHeader = NULL;
+
+    pMagazines->cAllocs++;
+
+    if (m_nMagazineDepth > 0)
+    {
+        pEntry = InterlockedPopEntrySList(&pMagazines->rgFreeLists[dwClass]);
+        if (pEntry != NULL)
+        {
+            pMagazines->cMagazineHits++;
+        }
+    }
+
+    if (pEntry == NULL && m_nDepotDepth > 0)
+    {
+        pEntry = InterlockedPopEntrySList(&m_pDepot[dwClass].FreeList);
+        if (pEntry != NULL)
+        {
+            pMagazines->cDepotHits++;
+        }
+    }
+
+    if (pEntry != NULL)
+    {
+        pHeader = reinterpret_cast<BLOCK_HEADER *>(pEntry) - 1;
+
+        //
+        // If the signature is wrong then somebody's been scribbling
+        // on memory that they've freed.
+        //
+        DBG_ASSERT(pHeader->dwSignature == FREE_SIGNATURE);
+        DBG_ASSERT(pHeader->dwClass == dwClass);
+        return pHeader;
+    }
+
+    pHeader = static_cast<BLOCK_HEADER *>(HeapAlloc(m_hHeap,
+                                                    0,
+                                                    sizeof(BLOCK_HEADER) + QueryClassSize(dwClass)));
+    if (pHeader != NULL)
+    {
+        pMagazines->cHeapAllocs++;
+        pHeader->dwClass = dwClass;
+    }
+
+    return pHeader;
+}
+
+PVOID
+SIZE_CLASS_CACHE::Alloc(
+    SIZE_T      cbSize
+)
+{
+    BLOCK_HEADER * pHeader = NULL;
+
+    if (cbSize > MAX_CLASS_SIZE)
+    {
+        MAGAZINES * pMagazines = m_pMagazines->GetLocal();
+        pMagazines->cAllocs++;
+
+        if (cbSize <= MAXSIZE_T - sizeof(BLOCK_HEADER))
+        {
+            pHeader = static_cast<BLOCK_HEADER *>(HeapAlloc(m_hHeap,
+                                                            0,
+                                                            sizeof(BLOCK_HEADER) + cbSize));
+        }
+        if (pHeader != NULL)
+        {
+            pMagazines->cHeapAllocs++;
+            pHeader->dwClass = LARGE_CLASS;
+        }
+    }
+    else
+    {
+        pHeader = AllocBlock(QuerySizeClass(cbSize));
+    }
+
+    if (pHeader == NULL)
+    {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+
+    pHeader->dwSignature = ALLOC_SIGNATURE;
+    pHeader->cbSize = cbSize;
+    return pHeader + 1;
+}
+
+VOID
+SIZE_CLASS_CACHE::FreeBlock(
+    BLOCK_HEADER *  pHeader
+)
+{
+    MAGAZINES *     pMagazines = m_pMagazines->GetLocal();
+    DWORD           dwClass = pHeader->dwClass;
+    PSLIST_ENTRY    pEntry = reinterpret_cast<PSLIST_ENTRY>(pHeader + 1);
+
+    pMagazines->cFrees++;
+
+    if (dwClass != LARGE_CLASS)
+    {
+        pHeader->dwSignature = FREE_SIGNATURE;
+
+        if (QueryDepthSList(&pMagazines->rgFreeLists[dwClass]) < m_nMagazineDepth)
+        {
+            InterlockedPushEntrySList(&pMagazines->rgFreeLists[dwClass], pEntry);
+            return;
+        }
+
+        //
+        // The local magazine is full, typically because this processor
+        // frees what another one allocated. Hand the block over.
+        //
+        if (QueryDepthSList(&m_pDepot[dwClass].FreeList) < m_nDepotDepth)
+        {
+            InterlockedPushEntrySList(&m_pDepot[dwClass].FreeList, pEntry);
+            pMagazines->cDepotFrees++;
+            return;
+        }
+    }
+
+    pMagazines->cHeapFrees++;
+    HeapFree(m_hHeap, 0, pHeader);
+}
+
+VOID
+SIZE_CLASS_CACHE::Free(
+    PVOID       pMemory
+)
+{
+    DBG_ASSERT(pMemory != NULL);
+
+    BLOCK_HEADER * pHeader = static_cast<BLOCK_HEADER *>(pMemory) - 1;
+
+    //
+    // Use the signature to check against double deletions and blocks
+    // that did not come from this allocator.
+    //
+    DBG_ASSERT(pHeader->dwSignature == ALLOC_SIGNATURE);
+
+    FreeBlock(pHeader);
+}
+
+PVOID
+SIZE_CLASS_CACHE::ReAlloc(
+    PVOID       pMemory,
+    SIZE_T      cbOldSize,
+    SIZE_T      cbNewSize,
+    bool        fZeroMemoryBeyondOldSize
+)
+/*++
+  Description:
+    Grows or shrinks a block, in place when the new size still fits the
+    block's class. On failure the original block is left untouched.
+--*/
+{
+    BLOCK_HEADER *  pHeader = static_cast<BLOCK_HEADER *>(pMemory) - 1;
+    PVOID           pNewMemory = NULL;
+
+    DBG_ASSERT(pHeader->dwSignature == ALLOC_SIGNATURE);
+
+    if (pHeader->dwClass != LARGE_CLASS &&
+        cbNewSize <= QueryClassSize(pHeader->dwClass))
+    {
+        pNewMemory = pMemory;
+    }
+    else if (pHeader->dwClass == LARGE_CLASS &&
+             cbNewSize > MAX_CLASS_SIZE &&
+             cbNewSize <= MAXSIZE_T - sizeof(BLOCK_HEADER))
+    {
+        pHeader = static_cast<BLOCK_HEADER *>(HeapReAlloc(m_hHeap,
+                                                          0,
+                                                          pHeader,
+                                                          sizeof(BLOCK_HEADER) + cbNewSize));
+        if (pHeader == NULL)
+        {
+            SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+            return NULL;
+        }
+        pNewMemory = pHeader + 1;
+    }
+    else
+    {
+        pNewMemory = Alloc(cbNewSize);
+        if (pNewMemory == NULL)
+        {
+            return NULL;
+        }
+
+        memcpy(pNewMemory, pMemory, min(cbOldSize, cbNewSize));
+        Free(pMemory);
+        pHeader = static_cast<BLOCK_HEADER *>(pNewMemory) - 1;
+    }
+
+    if (fZeroMemoryBeyondOldSize && cbNewSize > cbOldSize)
+    {
+        ZeroMemory(static_cast<BYTE *>(pNewMemory) + cbOldSize, cbNewSize - cbOldSize);
+    }
+
+    pHeader->cbSize = cbNewSize;
+    return pNewMemory;
+}
+
+LONG
+SIZE_CLASS_CACHE::FlushList(
+    SLIST_HEADER *  pListHeader,
+    LONG            nKeep
+)
+/*++
+  Description:
+    Returns all but nKeep blocks of the list to the heap.
+
+  Returns:
+    The number of blocks freed.
+--*/
+{
+    LONG nToFree = QueryDepthSList(pListHeader) - nKeep;
+    LONG nFreed = 0;
+
+    for (; nFreed < nToFree; nFreed++)
+    {
+        PSLIST_ENTRY pEntry = InterlockedPopEntrySList(pListHeader);
+        if (pEntry == NULL)
+        {
+            break;
+        }
+
+        BLOCK_HEADER * pHeader = reinterpret_cast<BLOCK_HEADER *>(pEntry) - 1;
+        DBG_ASSERT(pHeader->dwSignature == FREE_SIGNATURE);
+        HeapFree(m_hHeap, 0, pHeader);
+    }
+
+    return nFreed;
+}
+
+ULONGLONG
+SIZE_CLASS_CACHE::QueryTotalAllocs(
+    VOID
+)
+{
+    ULONGLONG cAllocs = 0;
+
+    m_pMagazines->ForEach(
+        [&cAllocs] (MAGAZINES * pMagazines)
+        {
+            cAllocs += pMagazines->cAllocs;
+        });
+
+    return cAllocs;
+}
+
+VOID
+SIZE_CLASS_CACHE::Trim(
+    VOID
+)
+/*++
+  Description:
+    Releases half of the depot, or everything that is cached if there has
+    not been a single allocation since the previous Trim.
+--*/
+{
+    LONG nFreed = 0;
+
+    if (InterlockedCompareExchange(&m_fTrimming, TRUE, FALSE) != FALSE)
+    {
+        //
+        // The timer and a direct caller raced, one trim is enough.
+        //
+        return;
+    }
+
+    ULONGLONG cAllocs = QueryTotalAllocs();
+    BOOL fIdle = (cAllocs == m_cAllocsAtLastTrim);
+    m_cAllocsAtLastTrim = cAllocs;
+
+    for (DWORD i = 0; i < SIZE_CLASSES; i++)
+    {
+        SLIST_HEADER * pDepot = &m_pDepot[i].FreeList;
+        nFreed += FlushList(pDepot, fIdle ? 0 : QueryDepthSList(pDepot) / 2);
+    }
+
+    if (fIdle)
+    {
+        //
+        // A thread that allocates right now just goes to the heap.
+        //
+        m_pMagazines->ForEach(
+            [this, &nFreed] (MAGAZINES * pMagazines)
+            {
+                for (DWORD i = 0; i < SIZE_CLASSES; i++)
+                {
+                    nFreed += FlushList(&pMagazines->rgFreeLists[i], 0);
+                }
+            });
+    }
+
+    InterlockedExchangeAdd64(&m_cTrimmed, nFreed);
+    InterlockedExchange(&m_fTrimming, FALSE);
+}
+
+// static
+VOID
+CALLBACK
+SIZE_CLASS_CACHE::TrimTimerCallback(
+    PTP_CALLBACK_INSTANCE,
+    PVOID                   Context,
+    PTP_TIMER
+)
+{
+    static_cast<SIZE_CLASS_CACHE *>(Context)->Trim();
+}
+
+HRESULT
+SIZE_CLASS_CACHE::StartTrimTimer(
+    DWORD       dwPeriodMs
+)
+{
+    ULARGE_INTEGER  ulDueTime;
+    FILETIME        ftDueTime;
+
+    DBG_ASSERT(m_pTrimTimer == NULL);
+
+    m_pTrimTimer = CreateThreadpoolTimer(TrimTimerCallback, this, NULL);
+    if (m_pTrimTimer == NULL)
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    //
+    // Relative due time in 100ns units.
+    //
+    ulDueTime.QuadPart = static_cast<ULONGLONG>(-static_cast<LONGLONG>(dwPeriodMs) * 10000);
+    ftDueTime.dwHighDateTime = ulDueTime.HighPart;
+    ftDueTime.dwLowDateTime = ulDueTime.LowPart;
+
+    SetThreadpoolTimer(m_pTrimTimer, &ftDueTime, dwPeriodMs, dwPeriodMs / 10);
+    return S_OK;
+}
+
+VOID
+SIZE_CLASS_CACHE::StopTrimTimer(
+    VOID
+)
+{
+    if (m_pTrimTimer != NULL)
+    {
+        SetThreadpoolTimer(m_pTrimTimer, NULL, 0, 0);
+        WaitForThreadpoolTimerCallbacks(m_pTrimTimer, TRUE);
+        CloseThreadpoolTimer(m_pTrimTimer);
+        m_pTrimTimer = NULL;
+    }
+}
+
+VOID
+SIZE_CLASS_CACHE::QueryCounters(
+    __out SIZE_CLASS_CACHE_COUNTERS *   pCounters
+)
+{
+    ZeroMemory(pCounters, sizeof(*pCounters));
+
+    m_pMagazines->ForEach(
+        [pCounters] (MAGAZINES * pMagazines)
+        {
+            pCounters->cAllocs += pMagazines->cAllocs;
+            pCounters->cMagazineHits += pMagazines->cMagazineHits;
+            pCounters->cDepotHits += pMagazines->cDepotHits;
+            pCounters->cHeapAllocs += pMagazines->cHeapAllocs;
+            pCounters->cFrees += pMagazines->cFrees;
+            pCounters->cDepotFrees += pMagazines->cDepotFrees;
+            pCounters->cHeapFrees += pMagazines->cHeapFrees;
+        });
+
+    pCounters->cTrimmed = m_cTrimmed;
+}
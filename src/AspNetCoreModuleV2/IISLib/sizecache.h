@@ -0,0 +1,213 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#pragma once
+
+#include "buffer.h"
+#include "percpu.h"
+
+//
+// SIZE_CLASS_CACHE is a general purpose allocator for the variable sized
+// buffers on the request path (entity buffers, header and string growth).
+//
+// Requests are rounded up to one of SIZE_CLASSES power of two classes. Each
+// processor keeps a magazine of free blocks per class (an SLIST, as in
+// ALLOC_CACHE_HANDLER), a block freed on one processor and allocated on
+// another travels through a shared depot per class. Only when both are
+// empty does the cache go to the heap. Requests larger than the largest
+// class go straight to the heap.
+//
+// Trim, called periodically by the trim timer or directly, returns half
+// of the depot to the heap and empties every list once the cache has been
+// idle for a whole trim period.
+//
+// The cache must outlive every block it handed out.
+//
+
+struct SIZE_CLASS_CACHE_COUNTERS
+{
+    ULONGLONG   cAllocs;
+    ULONGLONG   cMagazineHits;
+    ULONGLONG   cDepotHits;
+    ULONGLONG   cHeapAllocs;
+    ULONGLONG   cFrees;
+    ULONGLONG   cDepotFrees;
+    ULONGLONG   cHeapFrees;
+    ULONGLONG   cTrimmed;
+};
+
+class SIZE_CLASS_CACHE : public BUFFER_SPILL_ALLOCATOR
+{
+public:
+
+    static const DWORD      SIZE_CLASSES = 9;
+    static const DWORD      MIN_CLASS_SHIFT = 6;
+    static const SIZE_T     MIN_CLASS_SIZE = 1 << MIN_CLASS_SHIFT;
+    static const SIZE_T     MAX_CLASS_SIZE = MIN_CLASS_SIZE << (SIZE_CLASSES - 1);
+
+    SIZE_CLASS_CACHE(
+        VOID
+    );
+
+    virtual
+    ~SIZE_CLASS_CACHE(
+        VOID
+    );
+
+    HRESULT
+    Initialize(
+        LONG        nMagazineDepth,
+        LONG        nDepotDepth
+    );
+
+    PVOID
+    Alloc(
+        SIZE_T      cbSize
+    ) override;
+
+    PVOID
+    ReAlloc(
+        PVOID       pMemory,
+        SIZE_T      cbOldSize,
+        SIZE_T      cbNewSize,
+        bool        fZeroMemoryBeyondOldSize
+    ) override;
+
+    VOID
+    Free(
+        PVOID       pMemory
+    ) override;
+
+    VOID
+    Trim(
+        VOID
+    );
+
+    HRESULT
+    StartTrimTimer(
+        DWORD       dwPeriodMs
+    );
+
+    VOID
+    StopTrimTimer(
+        VOID
+    );
+
+    VOID
+    QueryCounters(
+        __out SIZE_CLASS_CACHE_COUNTERS *   pCounters
+    );
+
+    static
+    DWORD
+    QuerySizeClass(
+        SIZE_T      cbSize
+    )
+    {
+        DWORD dwHighBit = 0;
+
+        if (cbSize <= MIN_CLASS_SIZE)
+        {
+            return 0;
+        }
+
+        _BitScanReverse(&dwHighBit, static_cast<DWORD>(cbSize - 1));
+        return dwHighBit + 1 - MIN_CLASS_SHIFT;
+    }
+
+    static
+    SIZE_T
+    QueryClassSize(
+        DWORD       dwClass
+    )
+    {
+        return MIN_CLASS_SIZE << dwClass;
+    }
+
+private:
+
+    //
+    // Precedes every block. While the block is free its SLIST_ENTRY
+    // overlays the start of the user area, which the header keeps aligned.
+    //
+    struct DECLSPEC_ALIGN(16) BLOCK_HEADER
+    {
+        DWORD       dwSignature;
+        DWORD       dwClass;
+        SIZE_T      cbSize;
+    };
+
+    enum
+    {
+        ALLOC_SIGNATURE = (('S') | ('C' << 8) | ('c' << 16) | ('+' << 24)),
+        FREE_SIGNATURE = (('S') | ('C' << 8) | ('c' << 16) | (('$' << 24) | 0x80)),
+        LARGE_CLASS = SIZE_CLASSES,
+    };
+
+    struct MAGAZINES
+    {
+        SLIST_HEADER    rgFreeLists[SIZE_CLASSES];
+
+        //
+        // Only updated by the processor owning the magazines and not
+        // interlocked, so they are hints under thread migration.
+        //
+        ULONGLONG       cAllocs;
+        ULONGLONG       cMagazineHits;
+        ULONGLONG       cDepotHits;
+        ULONGLONG       cHeapAllocs;
+        ULONGLONG       cFrees;
+        ULONGLONG       cDepotFrees;
+        ULONGLONG       cHeapFrees;
+    };
+
+    struct DECLSPEC_ALIGN(SYSTEM_CACHE_ALIGNMENT_SIZE) DEPOT
+    {
+        SLIST_HEADER    FreeList;
+    };
+
+    SIZE_CLASS_CACHE(const SIZE_CLASS_CACHE &);
+    void operator=(const SIZE_CLASS_CACHE &);
+
+    BLOCK_HEADER *
+    AllocBlock(
+        DWORD       dwClass
+    );
+
+    VOID
+    FreeBlock(
+        BLOCK_HEADER *  pHeader
+    );
+
+    LONG
+    FlushList(
+        SLIST_HEADER *  pListHeader,
+        LONG            nKeep
+    );
+
+    ULONGLONG
+    QueryTotalAllocs(
+        VOID
+    );
+
+    static
+    VOID
+    CALLBACK
+    TrimTimerCallback(
+        PTP_CALLBACK_INSTANCE   Instance,
+        PVOID                   Context,
+        PTP_TIMER               Timer
+    );
+
+    LONG                    m_nMagazineDepth;
+    LONG                    m_nDepotDepth;
+    HANDLE                  m_hHeap;
+
+    PER_CPU<MAGAZINES> *    m_pMagazines;
+    DEPOT *                 m_pDepot;
+
+    PTP_TIMER               m_pTrimTimer;
+    volatile LONG           m_fTrimming;
+    ULONGLONG               m_cAllocsAtLastTrim;
+    volatile LONGLONG       m_cTrimmed;
+};
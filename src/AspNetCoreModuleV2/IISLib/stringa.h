@@ -359,6 +359,18 @@ public:
         __in DWORD      cch
     );
 
+    //
+    // Growth beyond the initial buffer comes from pAllocator rather than
+    // the process heap, see BUFFER_T::SetSpillAllocator.
+    //
+    VOID
+    SetSpillAllocator(
+        __in BUFFER_SPILL_ALLOCATOR *   pAllocator
+    )
+    {
+        m_Buff.SetSpillAllocator(pAllocator);
+    }
+
 private:
 
     //
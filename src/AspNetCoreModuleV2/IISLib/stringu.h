@@ -356,6 +356,18 @@ public:
         __out STRU *                 pstrExpandedString
     );
 
+    //
+    // Growth beyond the initial buffer comes from pAllocator rather than
+    // the process heap, see BUFFER_T::SetSpillAllocator.
+    //
+    VOID
+    SetSpillAllocator(
+        __in BUFFER_SPILL_ALLOCATOR *   pAllocator
+    )
+    {
+        m_Buff.SetSpillAllocator(pAllocator);
+    }
+
 private:
 
     //
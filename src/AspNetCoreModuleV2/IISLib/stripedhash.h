@@ -0,0 +1,1046 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#pragma once
+
+#include <crtdbg.h>
+#include <malloc.h>
+#include <new>
+#include "rwlock.h"
+#include "hashfn.h"
+
+//
+// STRIPED_HASH_TABLE has the same record contract as HASH_TABLE
+// (ReferenceRecord/DereferenceRecord/ExtractKey/CalcKeyHash/EqualKeys) but
+// is meant for tables that are looked up from every request.
+//
+// - The bucket array is guarded by an array of cache-line aligned locks
+//   (stripes) instead of one table lock. The bucket count and the stripe
+//   count are powers of two and the stripe count never exceeds the bucket
+//   count, so every bucket (before and after a resize) maps to exactly one
+//   stripe: stripe = hash & (stripes - 1).
+//
+// - The table doubles incrementally. Once a stripe goes over the load factor
+//   a second bucket array is published, and from then on every insert and
+//   delete migrates a few old buckets into it under that bucket's stripe
+//   lock. All stripes are held together only to publish and to retire a
+//   bucket array, which are pointer swaps.
+//
+
+template <class _Record>
+class STRIPED_HASH_NODE
+{
+    template <class _Record, class _Key>
+    friend class STRIPED_HASH_TABLE;
+
+    STRIPED_HASH_NODE(
+        _Record *       pRecord,
+        DWORD           dwHash
+    ) : _pNext (NULL),
+        _pRecord (pRecord),
+        _dwHash (dwHash)
+    {}
+
+    ~STRIPED_HASH_NODE()
+    {
+        _ASSERTE(_pRecord == NULL);
+    }
+
+ private:
+    // Next node in the bucket
+    STRIPED_HASH_NODE<_Record> *_pNext;
+
+    // actual record
+    _Record *           _pRecord;
+
+    // scrambled hash value
+    DWORD               _dwHash;
+};
+
+template <class _Record, class _Key>
+class STRIPED_HASH_TABLE
+{
+protected:
+    typedef BOOL
+    (PFN_DELETE_IF)(
+        _Record *           pRecord,
+        PVOID               pvContext
+    );
+
+    typedef VOID
+    (PFN_APPLY)(
+        _Record *           pRecord,
+        PVOID               pvContext
+    );
+
+public:
+    STRIPED_HASH_TABLE(
+        VOID
+    )
+      : _ppBuckets( NULL ),
+        _nBuckets( 0 ),
+        _ppNewBuckets( NULL ),
+        _nMigrateCursor( 0 ),
+        _nMigrated( 0 ),
+        _pStripes( NULL ),
+        _nStripes( 0 )
+    {
+    }
+
+    virtual
+    ~STRIPED_HASH_TABLE();
+
+    virtual
+    VOID
+    ReferenceRecord(
+        _Record *   pRecord
+    ) = 0;
+
+    virtual
+    VOID
+    DereferenceRecord(
+        _Record *   pRecord
+    ) = 0;
+
+    virtual
+    _Key
+    ExtractKey(
+        _Record *   pRecord
+    ) = 0;
+
+    virtual
+    DWORD
+    CalcKeyHash(
+        _Key        key
+    ) = 0;
+
+    virtual
+    BOOL
+    EqualKeys(
+        _Key        key1,
+        _Key        key2
+    ) = 0;
+
+    DWORD
+    Count(
+        VOID
+    ) const;
+
+    bool
+    IsInitialized(
+        VOID
+    ) const;
+
+    virtual
+    VOID
+    Clear();
+
+    HRESULT
+    Initialize(
+        DWORD           nBucketSize,
+        DWORD           nStripes = 0
+    );
+
+    virtual
+    VOID
+    FindKey(
+        _Key        key,
+        _Record **  ppRecord
+    );
+
+    virtual
+    HRESULT
+    InsertRecord(
+        _Record *   pRecord
+    );
+
+    virtual
+    VOID
+    DeleteKey(
+        _Key        key
+    );
+
+    virtual
+    VOID
+    DeleteIf(
+        PFN_DELETE_IF       pfnDeleteIf,
+        PVOID               pvContext
+    );
+
+    VOID
+    Apply(
+        PFN_APPLY           pfnApply,
+        PVOID               pvContext
+    );
+
+    DWORD
+    QueryBucketCount(
+        VOID
+    ) const
+    {
+        return _nBuckets;
+    }
+
+    BOOL
+    IsResizing(
+        VOID
+    ) const
+    {
+        return _ppNewBuckets != NULL;
+    }
+
+private:
+
+    struct DECLSPEC_CACHEALIGN STRIPE
+    {
+        CWSDRWLock      _lock;
+        //
+        // Items hashed to this stripe, only updated under _lock.
+        //
+        LONG            _nItems;
+    };
+
+    //
+    // Number of old buckets an insert or delete moves into the new
+    // bucket array while a resize is in progress.
+    //
+    static const DWORD      MIGRATE_BATCH = 4;
+
+    //
+    // Average number of items per bucket before the table doubles.
+    //
+    static const DWORD      MAX_LOAD_FACTOR = 2;
+
+    static const DWORD      MAX_BUCKETS = 0x40000000;
+
+    static
+    STRIPED_HASH_NODE<_Record> *
+    MigratedBucket(
+        VOID
+    )
+    {
+        //
+        // Left in an old bucket once its nodes moved to the new array.
+        //
+        return reinterpret_cast<STRIPED_HASH_NODE<_Record> *>(static_cast<ULONG_PTR>(1));
+    }
+
+    static
+    DWORD
+    RoundUpToPowerOfTwo(
+        DWORD       dwValue
+    )
+    {
+        DWORD dwResult = 1;
+        while (dwResult < dwValue && dwResult < MAX_BUCKETS)
+        {
+            dwResult <<= 1;
+        }
+        return dwResult;
+    }
+
+    DWORD
+    CalcScrambledHash(
+        _Key        key
+    )
+    {
+        //
+        // Buckets and stripes are picked from the low bits of the hash.
+        //
+        return HashRandomizeBits(CalcKeyHash(key));
+    }
+
+    STRIPE *
+    QueryStripe(
+        DWORD       dwHash
+    ) const
+    {
+        return _pStripes + (dwHash & (_nStripes - 1));
+    }
+
+    STRIPED_HASH_NODE<_Record> **
+    QueryBucket(
+        DWORD       dwHash
+    ) const
+    {
+        STRIPED_HASH_NODE<_Record> ** ppBucket = _ppBuckets + (dwHash & (_nBuckets - 1));
+        if (*ppBucket == MigratedBucket())
+        {
+            ppBucket = _ppNewBuckets + (dwHash & (2 * _nBuckets - 1));
+        }
+        return ppBucket;
+    }
+
+    __success(*ppNode != NULL && return != FALSE)
+    BOOL
+    FindNodeInternal(
+        _Key                            key,
+        DWORD                           dwHash,
+        __deref_out
+        STRIPED_HASH_NODE<_Record> **   ppNode,
+        __deref_opt_out
+        STRIPED_HASH_NODE<_Record> ***  pppPreviousNodeNextPointer = NULL
+    );
+
+    VOID
+    DeleteNode(
+        STRIPED_HASH_NODE<_Record> *    pNode
+    )
+    {
+        if (pNode->_pRecord != NULL)
+        {
+            DereferenceRecord(pNode->_pRecord);
+            pNode->_pRecord = NULL;
+        }
+
+        delete pNode;
+    }
+
+    VOID
+    AcquireAllStripesExclusive(
+        VOID
+    );
+
+    VOID
+    ReleaseAllStripesExclusive(
+        VOID
+    );
+
+    template<typename FunctionForEach>
+    VOID
+    ForEachStripeBucket(
+        DWORD               dwStripe,
+        FunctionForEach     Function
+    );
+
+    VOID
+    StartResizeIfNeeded(
+        STRIPE *            pStripe
+    );
+
+    VOID
+    HelpResize(
+        VOID
+    );
+
+    VOID
+    MigrateBucket(
+        DWORD               dwBucket
+    );
+
+    VOID
+    FinishResize(
+        VOID
+    );
+
+    STRIPED_HASH_NODE<_Record> ** volatile  _ppBuckets;
+    volatile DWORD                          _nBuckets;
+    //
+    // Non NULL while a resize is in progress, holds 2 * _nBuckets buckets.
+    //
+    STRIPED_HASH_NODE<_Record> ** volatile  _ppNewBuckets;
+    //
+    // Next old bucket to migrate and number of old buckets migrated.
+    //
+    volatile LONG                           _nMigrateCursor;
+    volatile LONG                           _nMigrated;
+
+    STRIPE *                                _pStripes;
+    DWORD                                   _nStripes;
+};
+
+template <class _Record, class _Key>
+HRESULT
+STRIPED_HASH_TABLE<_Record,_Key>::Initialize(
+    DWORD   nBuckets,
+    DWORD   nStripes
+)
+/*++
+  nBuckets - initial bucket count, rounded up to a power of two
+  nStripes - number of locks, rounded up to a power of two. When 0 it
+  is derived from the processor count (4 stripes per processor).
+--*/
+{
+    HRESULT hr = S_OK;
+
+    if ( nBuckets == 0 || nBuckets > MAX_BUCKETS )
+    {
+        hr = E_INVALIDARG;
+        goto Failed;
+    }
+
+    _ASSERTE(_ppBuckets == NULL );
+    if ( _ppBuckets != NULL )
+    {
+        hr = E_INVALIDARG;
+        goto Failed;
+    }
+
+    if (nStripes == 0)
+    {
+        SYSTEM_INFO SystemInfo = { };
+        GetSystemInfo(&SystemInfo);
+        nStripes = 4 * SystemInfo.dwNumberOfProcessors;
+    }
+    _nStripes = RoundUpToPowerOfTwo(min(nStripes, 1024UL));
+
+    //
+    // A bucket must never be shared by two stripes.
+    //
+    _nBuckets = max(RoundUpToPowerOfTwo(nBuckets), _nStripes);
+
+    _pStripes = (STRIPE *) _aligned_malloc(_nStripes * sizeof(STRIPE),
+                                           SYSTEM_CACHE_ALIGNMENT_SIZE);
+    if (_pStripes == NULL)
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_NOT_ENOUGH_MEMORY);
+        goto Failed;
+    }
+    ZeroMemory(_pStripes, _nStripes * sizeof(STRIPE));
+
+    for (DWORD i=0; i<_nStripes; i++)
+    {
+        new (&_pStripes[i]) STRIPE();
+        _pStripes[i]._nItems = 0;
+
+        hr = _pStripes[i]._lock.Init();
+        if ( FAILED( hr ) )
+        {
+            goto Failed;
+        }
+    }
+
+    _ppBuckets = (STRIPED_HASH_NODE<_Record> **)HeapAlloc(
+                            GetProcessHeap(),
+                            HEAP_ZERO_MEMORY,
+                            _nBuckets*sizeof(STRIPED_HASH_NODE<_Record> *));
+    if (_ppBuckets == NULL)
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_NOT_ENOUGH_MEMORY);
+        goto Failed;
+    }
+
+    return S_OK;
+
+Failed:
+
+    if (_pStripes != NULL)
+    {
+        for (DWORD i=0; i<_nStripes; i++)
+        {
+            _pStripes[i].~STRIPE();
+        }
+        _aligned_free(_pStripes);
+        _pStripes = NULL;
+    }
+    _nStripes = 0;
+    _nBuckets = 0;
+
+    return hr;
+}
+
+template <class _Record, class _Key>
+STRIPED_HASH_TABLE<_Record,_Key>::~STRIPED_HASH_TABLE()
+{
+    if (_ppBuckets == NULL)
+    {
+        return;
+    }
+
+    _ASSERTE(Count() == 0);
+
+    if (_ppNewBuckets != NULL)
+    {
+        HeapFree(GetProcessHeap(),
+                 0,
+                 _ppNewBuckets);
+        _ppNewBuckets = NULL;
+    }
+
+    HeapFree(GetProcessHeap(),
+             0,
+             _ppBuckets);
+    _ppBuckets = NULL;
+    _nBuckets = 0;
+
+    for (DWORD i=0; i<_nStripes; i++)
+    {
+        _pStripes[i].~STRIPE();
+    }
+    _aligned_free(_pStripes);
+    _pStripes = NULL;
+    _nStripes = 0;
+}
+
+template< class _Record, class _Key>
+DWORD
+STRIPED_HASH_TABLE<_Record,_Key>::Count() const
+{
+    //
+    // Snapshot, stripes are not locked.
+    //
+    LONG nItems = 0;
+    for (DWORD i=0; i<_nStripes; i++)
+    {
+        nItems += _pStripes[i]._nItems;
+    }
+    return static_cast<DWORD>(nItems);
+}
+
+template< class _Record, class _Key>
+bool
+STRIPED_HASH_TABLE<_Record,_Key>::IsInitialized(
+    VOID
+) const
+{
+    return _ppBuckets != NULL;
+}
+
+template <class _Record, class _Key>
+VOID
+STRIPED_HASH_TABLE<_Record,_Key>::AcquireAllStripesExclusive(
+    VOID
+)
+{
+    //
+    // Always in stripe order, a thread never holds more than one stripe
+    // otherwise.
+    //
+    for (DWORD i=0; i<_nStripes; i++)
+    {
+        _pStripes[i]._lock.ExclusiveAcquire();
+    }
+}
+
+template <class _Record, class _Key>
+VOID
+STRIPED_HASH_TABLE<_Record,_Key>::ReleaseAllStripesExclusive(
+    VOID
+)
+{
+    for (DWORD i=_nStripes; i>0; i--)
+    {
+        _pStripes[i-1]._lock.ExclusiveRelease();
+    }
+}
+
+template <class _Record, class _Key>
+template<typename FunctionForEach>
+VOID
+STRIPED_HASH_TABLE<_Record,_Key>::ForEachStripeBucket(
+    DWORD               dwStripe,
+    FunctionForEach     Function
+)
+/*++
+  Calls Function(STRIPED_HASH_NODE<_Record> ** ppBucket) for every bucket
+  owned by dwStripe, in both bucket arrays while a resize is in progress.
+
+  This routine must be called under the stripe's read or write lock
+--*/
+{
+    for (DWORD i=dwStripe; i<_nBuckets; i+=_nStripes)
+    {
+        if (_ppBuckets[i] != MigratedBucket())
+        {
+            Function(_ppBuckets + i);
+        }
+    }
+
+    if (_ppNewBuckets != NULL)
+    {
+        for (DWORD i=dwStripe; i<2*_nBuckets; i+=_nStripes)
+        {
+            Function(_ppNewBuckets + i);
+        }
+    }
+}
+
+template <class _Record, class _Key>
+VOID
+STRIPED_HASH_TABLE<_Record,_Key>::Clear()
+{
+    if ( _pStripes == NULL )
+    {
+        return;
+    }
+
+    for (DWORD s=0; s<_nStripes; s++)
+    {
+        STRIPE * pStripe = _pStripes + s;
+        STRIPED_HASH_NODE<_Record> *pDeletedNodes = NULL;
+
+        pStripe->_lock.ExclusiveAcquire();
+
+        ForEachStripeBucket(s,
+            [&pDeletedNodes] (STRIPED_HASH_NODE<_Record> ** ppBucket)
+            {
+                STRIPED_HASH_NODE<_Record> *pCurrent = *ppBucket;
+                STRIPED_HASH_NODE<_Record> *pNext;
+
+                *ppBucket = NULL;
+                while (pCurrent != NULL)
+                {
+                    pNext = pCurrent->_pNext;
+                    pCurrent->_pNext = pDeletedNodes;
+                    pDeletedNodes = pCurrent;
+                    pCurrent = pNext;
+                }
+            });
+
+        pStripe->_nItems = 0;
+        pStripe->_lock.ExclusiveRelease();
+
+        //
+        // Dereference outside of the stripe lock, as DeleteKey does.
+        //
+        while (pDeletedNodes != NULL)
+        {
+            STRIPED_HASH_NODE<_Record> *pNext = pDeletedNodes->_pNext;
+            DeleteNode(pDeletedNodes);
+            pDeletedNodes = pNext;
+        }
+    }
+}
+
+template <class _Record, class _Key>
+__success(*ppNode != NULL && return != FALSE)
+BOOL
+STRIPED_HASH_TABLE<_Record,_Key>::FindNodeInternal(
+    _Key                            key,
+    DWORD                           dwHash,
+    __deref_out
+    STRIPED_HASH_NODE<_Record> **   ppNode,
+    __deref_opt_out
+    STRIPED_HASH_NODE<_Record> ***  pppPreviousNodeNextPointer
+)
+/*++
+  Return value indicates whether the item is found
+  key, dwHash - key and scrambled hash for the node to find
+  ppNode - on successful return, the node found, on failed return, the first
+  node with hash value greater than the node to be found
+  pppPreviousNodeNextPointer - the pointer to previous node's _pNext
+
+  This routine must be called under the read or write lock of the stripe
+  owning dwHash
+--*/
+{
+    STRIPED_HASH_NODE<_Record> **ppPreviousNodeNextPointer;
+    STRIPED_HASH_NODE<_Record> *pNode;
+    BOOL fFound = FALSE;
+
+    ppPreviousNodeNextPointer = QueryBucket(dwHash);
+    pNode = *ppPreviousNodeNextPointer;
+    while (pNode != NULL)
+    {
+        if (pNode->_dwHash == dwHash)
+        {
+            if (EqualKeys(key,
+                          ExtractKey(pNode->_pRecord)))
+            {
+                fFound = TRUE;
+                break;
+            }
+        }
+        else if (pNode->_dwHash > dwHash)
+        {
+            break;
+        }
+
+        ppPreviousNodeNextPointer = &(pNode->_pNext);
+        pNode = *ppPreviousNodeNextPointer;
+    }
+
+    __analysis_assume( (pNode == NULL && fFound == FALSE) ||
+                       (pNode != NULL && fFound == TRUE ) );
+    *ppNode = pNode;
+    if (pppPreviousNodeNextPointer != NULL)
+    {
+        *pppPreviousNodeNextPointer = ppPreviousNodeNextPointer;
+    }
+    return fFound;
+}
+
+template <class _Record, class _Key>
+VOID
+STRIPED_HASH_TABLE<_Record,_Key>::FindKey(
+    _Key                key,
+    _Record **          ppRecord
+)
+{
+    STRIPED_HASH_NODE<_Record> *pNode;
+
+    *ppRecord = NULL;
+
+    DWORD dwHash = CalcScrambledHash(key);
+    STRIPE * pStripe = QueryStripe(dwHash);
+
+    pStripe->_lock.SharedAcquire();
+
+    if (FindNodeInternal(key, dwHash, &pNode) &&
+        pNode->_pRecord != NULL)
+    {
+        ReferenceRecord(pNode->_pRecord);
+        *ppRecord = pNode->_pRecord;
+    }
+
+    pStripe->_lock.SharedRelease();
+}
+
+template <class _Record, class _Key>
+HRESULT
+STRIPED_HASH_TABLE<_Record,_Key>::InsertRecord(
+    _Record *           pRecord
+)
+/*++
+  Inserts a node for this record under the write lock of its stripe.
+
+  Returns HRESULT_FROM_WIN32(ERROR_ALREADY_EXISTS) if the record already exists.
+  Never leak this error to the end user because "*file* already exists" may be confusing.
+--*/
+{
+    _Key key = ExtractKey(pRecord);
+    DWORD dwHash = CalcScrambledHash(key);
+    STRIPE * pStripe = QueryStripe(dwHash);
+    HRESULT hr = S_OK;
+    STRIPED_HASH_NODE<_Record> *    pNewNode;
+    STRIPED_HASH_NODE<_Record> *    pNextNode;
+    STRIPED_HASH_NODE<_Record> **   ppPreviousNodeNextPointer;
+
+    //
+    // Allocate outside of the stripe lock. Ownership of pRecord is not
+    // transferred to pNewNode until it is linked.
+    //
+    pNewNode = new STRIPED_HASH_NODE<_Record>(pRecord, dwHash);
+    if (pNewNode == NULL)
+    {
+        return HRESULT_FROM_WIN32(ERROR_NOT_ENOUGH_MEMORY);
+    }
+
+    pStripe->_lock.ExclusiveAcquire();
+
+    if (FindNodeInternal(key, dwHash, &pNextNode, &ppPreviousNodeNextPointer))
+    {
+        //
+        // We should never leak this error to the end user
+        // because "file already exists" may be confusing.
+        //
+        hr = HRESULT_FROM_WIN32(ERROR_ALREADY_EXISTS);
+    }
+    else
+    {
+        pNewNode->_pNext = pNextNode;
+        *ppPreviousNodeNextPointer = pNewNode;
+        pNewNode = NULL;
+
+        ReferenceRecord(pRecord);
+        pStripe->_nItems++;
+    }
+
+    pStripe->_lock.ExclusiveRelease();
+
+    if (pNewNode != NULL)
+    {
+        pNewNode->_pRecord = NULL;
+        DeleteNode(pNewNode);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        StartResizeIfNeeded(pStripe);
+        HelpResize();
+    }
+
+    return hr;
+}
+
+template <class _Record, class _Key>
+VOID
+STRIPED_HASH_TABLE<_Record,_Key>::DeleteKey(
+    _Key        key
+)
+{
+    STRIPED_HASH_NODE<_Record> *pNode;
+    STRIPED_HASH_NODE<_Record> **ppPreviousNodeNextPointer;
+    STRIPED_HASH_NODE<_Record> *pDeletedNode = NULL;
+
+    DWORD dwHash = CalcScrambledHash(key);
+    STRIPE * pStripe = QueryStripe(dwHash);
+
+    pStripe->_lock.ExclusiveAcquire();
+
+    if (FindNodeInternal(key, dwHash, &pNode, &ppPreviousNodeNextPointer))
+    {
+        *ppPreviousNodeNextPointer = pNode->_pNext;
+        pDeletedNode = pNode;
+        pStripe->_nItems--;
+    }
+
+    pStripe->_lock.ExclusiveRelease();
+
+    //
+    // Dereference outside of the stripe lock, the record may run arbitrary
+    // code when its last reference goes away.
+    //
+    if (pDeletedNode != NULL)
+    {
+        DeleteNode(pDeletedNode);
+    }
+
+    HelpResize();
+}
+
+template <class _Record, class _Key>
+VOID
+STRIPED_HASH_TABLE<_Record,_Key>::DeleteIf(
+    PFN_DELETE_IF               pfnDeleteIf,
+    PVOID                       pvContext
+)
+{
+    for (DWORD s=0; s<_nStripes; s++)
+    {
+        STRIPE * pStripe = _pStripes + s;
+        STRIPED_HASH_NODE<_Record> *pDeletedNodes = NULL;
+
+        pStripe->_lock.ExclusiveAcquire();
+
+        ForEachStripeBucket(s,
+            [pStripe, pfnDeleteIf, pvContext, &pDeletedNodes] (STRIPED_HASH_NODE<_Record> ** ppPreviousNodeNextPointer)
+            {
+                STRIPED_HASH_NODE<_Record> *pNode = *ppPreviousNodeNextPointer;
+                while (pNode != NULL)
+                {
+                    if (pfnDeleteIf(pNode->_pRecord, pvContext))
+                    {
+                        *ppPreviousNodeNextPointer = pNode->_pNext;
+                        pNode->_pNext = pDeletedNodes;
+                        pDeletedNodes = pNode;
+                        pStripe->_nItems--;
+                    }
+                    else
+                    {
+                        ppPreviousNodeNextPointer = &pNode->_pNext;
+                    }
+
+                    pNode = *ppPreviousNodeNextPointer;
+                }
+            });
+
+        pStripe->_lock.ExclusiveRelease();
+
+        //
+        // Dereference outside of the stripe lock, as DeleteKey does.
+        //
+        while (pDeletedNodes != NULL)
+        {
+            STRIPED_HASH_NODE<_Record> *pNext = pDeletedNodes->_pNext;
+            DeleteNode(pDeletedNodes);
+            pDeletedNodes = pNext;
+        }
+    }
+}
+
+template <class _Record, class _Key>
+VOID
+STRIPED_HASH_TABLE<_Record,_Key>::Apply(
+    PFN_APPLY                   pfnApply,
+    PVOID                       pvContext
+)
+{
+    for (DWORD s=0; s<_nStripes; s++)
+    {
+        STRIPE * pStripe = _pStripes + s;
+
+        pStripe->_lock.SharedAcquire();
+
+        ForEachStripeBucket(s,
+            [pfnApply, pvContext] (STRIPED_HASH_NODE<_Record> ** ppBucket)
+            {
+                for (STRIPED_HASH_NODE<_Record> *pNode = *ppBucket;
+                     pNode != NULL;
+                     pNode = pNode->_pNext)
+                {
+                    if (pNode->_pRecord != NULL)
+                    {
+                        pfnApply(pNode->_pRecord, pvContext);
+                    }
+                }
+            });
+
+        pStripe->_lock.SharedRelease();
+    }
+}
+
+template <class _Record, class _Key>
+VOID
+STRIPED_HASH_TABLE<_Record,_Key>::StartResizeIfNeeded(
+    STRIPE *            pStripe
+)
+/*++
+  Publishes a bucket array twice the current size once the stripe that
+  just grew is over the load factor. The stripe count is read without a
+  lock, it is only a hint and is checked again under all stripes.
+--*/
+{
+    DWORD nBuckets = _nBuckets;
+
+    if (static_cast<DWORD>(pStripe->_nItems) <= MAX_LOAD_FACTOR * (nBuckets / _nStripes) ||
+        _ppNewBuckets != NULL ||
+        nBuckets >= MAX_BUCKETS)
+    {
+        return;
+    }
+
+    STRIPED_HASH_NODE<_Record> ** ppNewBuckets = (STRIPED_HASH_NODE<_Record> **)HeapAlloc(
+                        GetProcessHeap(),
+                        HEAP_ZERO_MEMORY,
+                        2*nBuckets*sizeof(STRIPED_HASH_NODE<_Record> *));
+    if (ppNewBuckets == NULL)
+    {
+        //
+        // Keep going with the current size, the next insert will retry.
+        //
+        return;
+    }
+
+    AcquireAllStripesExclusive();
+
+    if (_ppNewBuckets == NULL && _nBuckets == nBuckets)
+    {
+        _nMigrateCursor = 0;
+        _nMigrated = 0;
+        _ppNewBuckets = ppNewBuckets;
+        ppNewBuckets = NULL;
+    }
+
+    ReleaseAllStripesExclusive();
+
+    if (ppNewBuckets != NULL)
+    {
+        //
+        // Another thread started the resize first.
+        //
+        HeapFree(GetProcessHeap(), 0, ppNewBuckets);
+    }
+}
+
+template <class _Record, class _Key>
+VOID
+STRIPED_HASH_TABLE<_Record,_Key>::HelpResize(
+    VOID
+)
+/*++
+  Moves up to MIGRATE_BATCH old buckets into the new bucket array. Buckets
+  are claimed through _nMigrateCursor so each is moved by a single thread.
+--*/
+{
+    if (_ppNewBuckets == NULL)
+    {
+        return;
+    }
+
+    for (DWORD i=0; i<MIGRATE_BATCH; i++)
+    {
+        LONG nBucket = InterlockedIncrement(&_nMigrateCursor) - 1;
+        if (static_cast<DWORD>(nBucket) >= _nBuckets)
+        {
+            break;
+        }
+
+        MigrateBucket(static_cast<DWORD>(nBucket));
+    }
+}
+
+template <class _Record, class _Key>
+VOID
+STRIPED_HASH_TABLE<_Record,_Key>::MigrateBucket(
+    DWORD               dwBucket
+)
+{
+    BOOL fMigrated = FALSE;
+    STRIPE * pStripe = QueryStripe(dwBucket);
+
+    pStripe->_lock.ExclusiveAcquire();
+
+    //
+    // The resize may have completed (and another one started) since the
+    // bucket was claimed, only the state seen under the lock counts.
+    //
+    if (_ppNewBuckets != NULL &&
+        dwBucket < _nBuckets &&
+        _ppBuckets[dwBucket] != MigratedBucket())
+    {
+        DWORD nNewBuckets = 2 * _nBuckets;
+        STRIPED_HASH_NODE<_Record> *pNode = _ppBuckets[dwBucket];
+        STRIPED_HASH_NODE<_Record> *pNextNode;
+        STRIPED_HASH_NODE<_Record> **ppNextPointer;
+        STRIPED_HASH_NODE<_Record> *pNewNextNode;
+
+        //
+        // Split the bucket into dwBucket and dwBucket + _nBuckets of the new
+        // array, make sure to keep the hashes in increasing order. Both new
+        // buckets belong to the stripe we hold.
+        //
+        while (pNode != NULL)
+        {
+            pNextNode = pNode->_pNext;
+
+            ppNextPointer = _ppNewBuckets + (pNode->_dwHash & (nNewBuckets - 1));
+            pNewNextNode = *ppNextPointer;
+            while (pNewNextNode != NULL &&
+                   pNewNextNode->_dwHash <= pNode->_dwHash)
+            {
+                ppNextPointer = &pNewNextNode->_pNext;
+                pNewNextNode = pNewNextNode->_pNext;
+            }
+            pNode->_pNext = pNewNextNode;
+            *ppNextPointer = pNode;
+
+            pNode = pNextNode;
+        }
+
+        _ppBuckets[dwBucket] = MigratedBucket();
+        fMigrated = TRUE;
+    }
+
+    pStripe->_lock.ExclusiveRelease();
+
+    if (fMigrated &&
+        static_cast<DWORD>(InterlockedIncrement(&_nMigrated)) == _nBuckets)
+    {
+        FinishResize();
+    }
+}
+
+template <class _Record, class _Key>
+VOID
+STRIPED_HASH_TABLE<_Record,_Key>::FinishResize(
+    VOID
+)
+/*++
+  Every old bucket has been migrated, retire the old bucket array. Readers
+  only look at the bucket arrays under a stripe lock, so holding all of them
+  guarantees nobody is still walking the old array.
+--*/
+{
+    STRIPED_HASH_NODE<_Record> ** ppOldBuckets = NULL;
+
+    AcquireAllStripesExclusive();
+
+    if (_ppNewBuckets != NULL &&
+        static_cast<DWORD>(_nMigrated) == _nBuckets)
+    {
+        ppOldBuckets = _ppBuckets;
+        _ppBuckets = _ppNewBuckets;
+        _nBuckets = 2 * _nBuckets;
+        _ppNewBuckets = NULL;
+        _nMigrateCursor = 0;
+        _nMigrated = 0;
+    }
+
+    ReleaseAllStripesExclusive();
+
+    if (ppOldBuckets != NULL)
+    {
+        HeapFree(GetProcessHeap(), 0, ppOldBuckets);
+    }
+}
@@ -6,6 +6,22 @@
 #include <crtdbg.h>
 #include "rwlock.h"
 #include "prime.h"
+#include "epoch.h"
+
+//
+// TREE_HASH_TABLE readers (FindKey, Apply) take no lock. Writers publish
+// fully built nodes with a single interlocked store and only unlink nodes
+// under the exclusive table lock; unlinked nodes (and records removed from
+// nodes that stay in the tree) are freed once the table's EPOCH_DOMAIN says
+// no reader can still be looking at them.
+//
+// A node has a bucket link for each of two bucket arrays. Rehashing links
+// the nodes into the new array through the link the current one does not
+// use, so readers of the current array never see a node move, and publishes
+// the new array with a single pointer swap. The old array is freed once no
+// reader can still be walking it, and only then may the next rehash reuse
+// its link.
+//
 
 template <class _Record>
 class TREE_HASH_NODE
@@ -14,8 +30,9 @@ class TREE_HASH_NODE
     friend class TREE_HASH_TABLE;
 
  private:
-    // Next node in the hash table look-aside
-    TREE_HASH_NODE<_Record> *_pNext;
+    // Next node in the hash table look-aside, one link per bucket array,
+    // walked without a lock
+    TREE_HASH_NODE<_Record> *_rgpNext[2];
 
     // links in the tree structure
     TREE_HASH_NODE *    _pParentNode;
@@ -28,6 +45,9 @@ class TREE_HASH_NODE
     // hash value
     PCWSTR              _pszPath;
     DWORD               _dwHash;
+
+    // Next node waiting for the end of the grace period once unlinked
+    TREE_HASH_NODE *    _pNextRetired;
 };
 
 template <class _Record>
@@ -49,8 +69,7 @@ protected:
 public:
     TREE_HASH_TABLE(
         BOOL    fCaseSensitive
-    ) : _ppBuckets( NULL ),
-        _nBuckets( 0 ),
+    ) : _pBuckets( NULL ),
         _nItems( 0 ),
         _fCaseSensitive( fCaseSensitive )
     {
@@ -134,8 +153,56 @@ public:
 
 private:
 
+    struct BUCKETS
+    {
+        DWORD                               _nBuckets;
+        // Which of the node links chains the buckets of this array
+        DWORD                               _iLink;
+        TREE_HASH_NODE<_Record> *   _rgpBuckets[ANYSIZE_ARRAY];
+    };
+
+    static
+    HRESULT
+    AllocateBuckets(
+        DWORD                       nBuckets,
+        DWORD                       iLink,
+        BUCKETS **                  ppBuckets
+    );
+
+    static
+    VOID
+    FreeBuckets(
+        BUCKETS *                   pBuckets
+    )
+    {
+        HeapFree(GetProcessHeap(),
+                 0,
+                 pBuckets);
+    }
+
+    static
+    TREE_HASH_NODE<_Record> **
+    QueryBucket(
+        BUCKETS *                   pBuckets,
+        DWORD                       dwHash
+    )
+    {
+        return pBuckets->_rgpBuckets + (dwHash % pBuckets->_nBuckets);
+    }
+
+    static
+    TREE_HASH_NODE<_Record> **
+    QueryNext(
+        BUCKETS *                   pBuckets,
+        TREE_HASH_NODE<_Record> *   pNode
+    )
+    {
+        return pNode->_rgpNext + pBuckets->_iLink;
+    }
+
     BOOL
     FindNodeInternal(
+        BUCKETS *                   pBuckets,
         PCWSTR                      pszKey,
         DWORD                       dwHash,
         TREE_HASH_NODE<_Record> **  ppNode,
@@ -179,7 +246,19 @@ private:
     VOID
     DeleteNodeInternal(
         TREE_HASH_NODE<_Record> **  ppPreviousNodeNextPointer,
-        TREE_HASH_NODE<_Record> *   pNode
+        TREE_HASH_NODE<_Record> *   pNode,
+        TREE_HASH_NODE<_Record> **  ppRetired
+    );
+
+    VOID
+    RetireRecordInternal(
+        TREE_HASH_NODE<_Record> *   pNode,
+        TREE_HASH_NODE<_Record> **  ppRetired
+    );
+
+    VOID
+    ReclaimRetired(
+        TREE_HASH_NODE<_Record> *   pRetired
     );
 
     VOID
@@ -187,11 +266,23 @@ private:
         VOID
     );
 
-    TREE_HASH_NODE<_Record> **  _ppBuckets;
-    DWORD                       _nBuckets;
+    //
+    // Replaced as a whole on rehash so readers always see a bucket count
+    // and a link that match the array.
+    //
+    BUCKETS * volatile          _pBuckets;
     DWORD                       _nItems;
     BOOL                        _fCaseSensitive;
+    //
+    // Serializes writers, readers only enter _epoch.
+    //
     CWSDRWLock                  _tableLock;
+    //
+    // Serializes rehashes up to the free of the old array, the next one
+    // relinks the nodes through the link readers of it may still follow.
+    //
+    CWSDRWLock                  _rehashLock;
+    EPOCH_DOMAIN                _epoch;
 };
 
 template <class _Record>
@@ -224,7 +315,9 @@ TREE_HASH_TABLE<_Record>::AllocateNode(
     memcpy(pNode+1, pszPath, (cchPath+1)*sizeof(WCHAR));
     pNode->_pszPath = (PCWSTR)(pNode+1);
     pNode->_dwHash = dwHash;
-    pNode->_pNext = pNode->_pNextSibling = pNode->_pFirstChild = NULL;
+    pNode->_rgpNext[0] = pNode->_rgpNext[1] = NULL;
+    pNode->_pNextSibling = pNode->_pFirstChild = NULL;
+    pNode->_pNextRetired = NULL;
     pNode->_pParentNode = pParentNode;
     pNode->_pRecord = pRecord;
 
@@ -232,6 +325,36 @@ TREE_HASH_TABLE<_Record>::AllocateNode(
     return S_OK;
 }
 
+template <class _Record>
+// static
+HRESULT
+TREE_HASH_TABLE<_Record>::AllocateBuckets(
+    DWORD                       nBuckets,
+    DWORD                       iLink,
+    BUCKETS **                  ppBuckets
+)
+{
+    if (nBuckets == 0 ||
+        nBuckets >= (0xffffffff - sizeof(BUCKETS))/sizeof(TREE_HASH_NODE<_Record> *))
+    {
+        return E_INVALIDARG;
+    }
+
+    BUCKETS * pBuckets = (BUCKETS *)HeapAlloc(
+                            GetProcessHeap(),
+                            HEAP_ZERO_MEMORY,
+                            sizeof(BUCKETS) + (nBuckets-1)*sizeof(TREE_HASH_NODE<_Record> *));
+    if (pBuckets == NULL)
+    {
+        return HRESULT_FROM_WIN32(ERROR_NOT_ENOUGH_MEMORY);
+    }
+    pBuckets->_nBuckets = nBuckets;
+    pBuckets->_iLink = iLink;
+
+    *ppBuckets = pBuckets;
+    return S_OK;
+}
+
 template <class _Record>
 HRESULT
 TREE_HASH_TABLE<_Record>::Initialize(
@@ -239,6 +362,7 @@ TREE_HASH_TABLE<_Record>::Initialize(
 )
 {
     HRESULT hr = S_OK;
+    BUCKETS * pBuckets = NULL;
 
     if ( nBuckets == 0 )
     {
@@ -252,35 +376,29 @@ TREE_HASH_TABLE<_Record>::Initialize(
         goto Failed;
     }
 
-    if (nBuckets >= 0xffffffff/sizeof(TREE_HASH_NODE<_Record> *))
+    hr = _rehashLock.Init();
+    if ( FAILED( hr ) )
     {
-        hr = E_INVALIDARG;
         goto Failed;
     }
 
-    _ppBuckets = (TREE_HASH_NODE<_Record> **)HeapAlloc(
-                            GetProcessHeap(),
-                            HEAP_ZERO_MEMORY,
-                            nBuckets*sizeof(TREE_HASH_NODE<_Record> *));
-    if (_ppBuckets == NULL)
+    hr = _epoch.Initialize();
+    if ( FAILED( hr ) )
     {
-        hr = HRESULT_FROM_WIN32(ERROR_NOT_ENOUGH_MEMORY);
         goto Failed;
     }
-    _nBuckets = nBuckets;
+
+    hr = AllocateBuckets(nBuckets, 0, &pBuckets);
+    if ( FAILED( hr ) )
+    {
+        goto Failed;
+    }
+    _pBuckets = pBuckets;
 
     return S_OK;
 
 Failed:
 
-    if (_ppBuckets)
-    {
-        HeapFree(GetProcessHeap(),
-                 0,
-                 _ppBuckets);
-        _ppBuckets = NULL;
-    }
-
     return hr;
 }
 
@@ -288,18 +406,15 @@ Failed:
 template <class _Record>
 TREE_HASH_TABLE<_Record>::~TREE_HASH_TABLE()
 {
-    if (_ppBuckets == NULL)
+    if (_pBuckets == NULL)
     {
         return;
     }
 
     _ASSERTE(_nItems == 0);
 
-    HeapFree(GetProcessHeap(),
-             0,
-             _ppBuckets);
-    _ppBuckets = NULL;
-    _nBuckets = 0;
+    FreeBuckets(_pBuckets);
+    _pBuckets = NULL;
 }
 
 template <class _Record>
@@ -307,29 +422,38 @@ VOID
 TREE_HASH_TABLE<_Record>::Clear()
 {
     TREE_HASH_NODE<_Record> *pCurrent;
-    TREE_HASH_NODE<_Record> *pNext;
+    TREE_HASH_NODE<_Record> *pRetired = NULL;
+
+    if (_pBuckets == NULL)
+    {
+        return;
+    }
 
     _tableLock.ExclusiveAcquire();
 
-    for (DWORD i=0; i<_nBuckets; i++)
+    BUCKETS * pBuckets = _pBuckets;
+    for (DWORD i=0; i<pBuckets->_nBuckets; i++)
     {
-        pCurrent = _ppBuckets[i];
-        _ppBuckets[i] = NULL;
+        pCurrent = pBuckets->_rgpBuckets[i];
+        pBuckets->_rgpBuckets[i] = NULL;
         while (pCurrent != NULL)
         {
-            pNext = pCurrent->_pNext;
-            DeleteNode(pCurrent);
-            pCurrent = pNext;
+            pCurrent->_pNextRetired = pRetired;
+            pRetired = pCurrent;
+            pCurrent = *QueryNext(pBuckets, pCurrent);
         }
     }
 
     _nItems = 0;
     _tableLock.ExclusiveRelease();
+
+    ReclaimRetired(pRetired);
 }
 
 template <class _Record>
 BOOL
 TREE_HASH_TABLE<_Record>::FindNodeInternal(
+    BUCKETS *               pBuckets,
     PCWSTR                  pszKey,
     DWORD                   dwHash,
     TREE_HASH_NODE<_Record> **   ppNode,
@@ -337,19 +461,22 @@ TREE_HASH_TABLE<_Record>::FindNodeInternal(
 )
 /*++
   Return value indicates whether the item is found
+  pBuckets - bucket array to search
   key, dwHash - key and hash for the node to find
   ppNode - on successful return, the node found, on failed return, the first
   node with hash value greater than the node to be found
-  pppPreviousNodeNextPointer - the pointer to previous node's _pNext
+  pppPreviousNodeNextPointer - the pointer to previous node's link in
+  pBuckets
 
-  This routine may be called under either read or write lock
+  This routine may be called under either read or write lock, or without a
+  lock from within an _epoch read section
 --*/
 {
     TREE_HASH_NODE<_Record> **ppPreviousNodeNextPointer;
     TREE_HASH_NODE<_Record> *pNode;
     BOOL fFound = FALSE;
 
-    ppPreviousNodeNextPointer = _ppBuckets + (dwHash % _nBuckets);
+    ppPreviousNodeNextPointer = QueryBucket(pBuckets, dwHash);
     pNode = *ppPreviousNodeNextPointer;
     while (pNode != NULL)
     {
@@ -370,7 +497,7 @@ TREE_HASH_TABLE<_Record>::FindNodeInternal(
             break;
         }
 
-        ppPreviousNodeNextPointer = &(pNode->_pNext);
+        ppPreviousNodeNextPointer = QueryNext(pBuckets, pNode);
         pNode = *ppPreviousNodeNextPointer;
     }
 
@@ -388,23 +515,32 @@ TREE_HASH_TABLE<_Record>::FindKey(
     PCWSTR              pszKey,
     _Record **          ppRecord
 )
+/*++
+  Lock free, nodes and records seen here stay allocated until the read
+  section is left. A rehash in the meantime leaves the array loaded here
+  as it is.
+--*/
 {
     TREE_HASH_NODE<_Record> *pNode;
+    _Record *pRecord;
 
     *ppRecord = NULL;
 
     DWORD dwHash = CalcHash(pszKey);
 
-    _tableLock.SharedAcquire();
+    volatile LONG * pReaders = _epoch.EnterRead();
 
-    if (FindNodeInternal(pszKey, dwHash, &pNode) &&
-        pNode->_pRecord != NULL)
+    if (FindNodeInternal(_pBuckets, pszKey, dwHash, &pNode))
     {
-        ReferenceRecord(pNode->_pRecord);
-        *ppRecord = pNode->_pRecord;
+        pRecord = pNode->_pRecord;
+        if (pRecord != NULL)
+        {
+            ReferenceRecord(pRecord);
+            *ppRecord = pRecord;
+        }
     }
 
-    _tableLock.SharedRelease();
+    _epoch.LeaveRead(pReaders);
 }
 
 template <class _Record>
@@ -422,12 +558,14 @@ TREE_HASH_TABLE<_Record>::AddNodeInternal(
   pParentNode - this will be the parent of the node being inserted
   ppNewNode - on successful return, the new node created and inserted
 
-  This function may be called under a read or write lock
+  This function may be called under a read or write lock. The node is fully
+  initialized before the interlocked store that makes it visible to readers
 --*/
 {
     TREE_HASH_NODE<_Record> *pNewNode;
     TREE_HASH_NODE<_Record> *pNextNode;
     TREE_HASH_NODE<_Record> **ppNextPointer;
+    BUCKETS * pBuckets = _pBuckets;
     HRESULT hr;
 
     //
@@ -452,7 +590,7 @@ TREE_HASH_TABLE<_Record>::AddNodeInternal(
         // Find the right place to add this node
         //
 
-        if (FindNodeInternal(pszPath, dwHash, &pNextNode, &ppNextPointer))
+        if (FindNodeInternal(pBuckets, pszPath, dwHash, &pNextNode, &ppNextPointer))
         {
             //
             // If node already there, record may still need updating
@@ -481,7 +619,7 @@ TREE_HASH_TABLE<_Record>::AddNodeInternal(
         //
         // If another node got inserted in betwen, we will have to retry
         //
-        pNewNode->_pNext = pNextNode;
+        *QueryNext(pBuckets, pNewNode) = pNextNode;
     } while (InterlockedCompareExchangePointer((PVOID *)ppNextPointer,
                                                pNewNode,
                                                pNextNode) != pNextNode);
@@ -557,7 +695,7 @@ TREE_HASH_TABLE<_Record>::InsertRecord(
             pszPartialPath[cchEnd] = L'\0';
 
             dwHash = CalcHash(pszPartialPath);
-            if (FindNodeInternal(pszPartialPath, dwHash, &pParentNode))
+            if (FindNodeInternal(_pBuckets, pszPartialPath, dwHash, &pParentNode))
             {
                 pszPartialPath[cchEnd] = pszKey[cchEnd];
                 break;
@@ -605,20 +743,28 @@ template <class _Record>
 VOID
 TREE_HASH_TABLE<_Record>::DeleteNodeInternal(
     TREE_HASH_NODE<_Record> **  ppNextPointer,
-    TREE_HASH_NODE<_Record> *   pNode
+    TREE_HASH_NODE<_Record> *   pNode,
+    TREE_HASH_NODE<_Record> **  ppRetired
 )
 /*++
   pNode is the node to be deleted
   ppNextPointer is the pointer to the previous node's next pointer pointing
   to this node
+  ppRetired receives pNode and its children, to be passed to ReclaimRetired
+  once the write lock is released
+
+  The links of pNode are left alone so that readers standing on pNode carry
+  on down the bucket.
 
   This function should be called under write-lock
 --*/
 {
+    BUCKETS * pBuckets = _pBuckets;
+
     //
     // First remove this node from hash table
     //
-    *ppNextPointer = pNode->_pNext;
+    *ppNextPointer = *QueryNext(pBuckets, pNode);
 
     //
     // Now fixup parent
@@ -642,21 +788,85 @@ TREE_HASH_TABLE<_Record>::DeleteNodeInternal(
     {
         pNextChild = pChild->_pNextSibling;
 
-        ppNextPointer = _ppBuckets + (pChild->_dwHash % _nBuckets);
+        ppNextPointer = QueryBucket(pBuckets, pChild->_dwHash);
         while (*ppNextPointer != pChild)
         {
-            ppNextPointer = &(*ppNextPointer)->_pNext;
+            ppNextPointer = QueryNext(pBuckets, *ppNextPointer);
         }
         pChild->_pParentNode = NULL;
-        DeleteNodeInternal(ppNextPointer, pChild);
+        DeleteNodeInternal(ppNextPointer, pChild, ppRetired);
 
         pChild = pNextChild;
     }
 
-    DeleteNode(pNode);
+    pNode->_pNextRetired = *ppRetired;
+    *ppRetired = pNode;
     _nItems--;
 }
 
+template <class _Record>
+VOID
+TREE_HASH_TABLE<_Record>::RetireRecordInternal(
+    TREE_HASH_NODE<_Record> *   pNode,
+    TREE_HASH_NODE<_Record> **  ppRetired
+)
+/*++
+  Takes the record off a node that stays in the tree. A reader may have
+  loaded the record already, so the table's reference is handed to a
+  detached node and dropped by ReclaimRetired.
+
+  This function should be called under write-lock
+--*/
+{
+    _Record * pRecord = pNode->_pRecord;
+    pNode->_pRecord = NULL;
+
+    TREE_HASH_NODE<_Record> *pDetached = (TREE_HASH_NODE<_Record> *)HeapAlloc(
+            GetProcessHeap(),
+            HEAP_ZERO_MEMORY,
+            sizeof(TREE_HASH_NODE<_Record>));
+    if (pDetached == NULL)
+    {
+        //
+        // Readers never take the table lock, wait for them right here.
+        //
+        _epoch.Synchronize();
+        DereferenceRecord(pRecord);
+        return;
+    }
+
+    pDetached->_pRecord = pRecord;
+    pDetached->_pNextRetired = *ppRetired;
+    *ppRetired = pDetached;
+}
+
+template <class _Record>
+VOID
+TREE_HASH_TABLE<_Record>::ReclaimRetired(
+    TREE_HASH_NODE<_Record> *   pRetired
+)
+/*++
+  Frees nodes unlinked by a writer once no reader can reach them. Must be
+  called outside of the table lock and outside of FindKey/Apply callbacks.
+--*/
+{
+    TREE_HASH_NODE<_Record> *pNext;
+
+    if (pRetired == NULL)
+    {
+        return;
+    }
+
+    _epoch.Synchronize();
+
+    while (pRetired != NULL)
+    {
+        pNext = pRetired->_pNextRetired;
+        DeleteNode(pRetired);
+        pRetired = pNext;
+    }
+}
+
 template <class _Record>
 VOID
 TREE_HASH_TABLE<_Record>::DeleteKey(
@@ -665,17 +875,20 @@ TREE_HASH_TABLE<_Record>::DeleteKey(
 {
     TREE_HASH_NODE<_Record> *pNode;
     TREE_HASH_NODE<_Record> **ppPreviousNodeNextPointer;
+    TREE_HASH_NODE<_Record> *pRetired = NULL;
 
     DWORD dwHash = CalcHash(pszKey);
 
     _tableLock.ExclusiveAcquire();
 
-    if (FindNodeInternal(pszKey, dwHash, &pNode, &ppPreviousNodeNextPointer))
+    if (FindNodeInternal(_pBuckets, pszKey, dwHash, &pNode, &ppPreviousNodeNextPointer))
     {
-        DeleteNodeInternal(ppPreviousNodeNextPointer, pNode);
+        DeleteNodeInternal(ppPreviousNodeNextPointer, pNode, &pRetired);
     }
 
     _tableLock.ExclusiveRelease();
+
+    ReclaimRetired(pRetired);
 }
 
 template <class _Record>
@@ -687,13 +900,15 @@ TREE_HASH_TABLE<_Record>::DeleteIf(
 {
     TREE_HASH_NODE<_Record> *pNode;
     TREE_HASH_NODE<_Record> **ppPreviousNodeNextPointer;
+    TREE_HASH_NODE<_Record> *pRetired = NULL;
     BOOL fDelete;
 
     _tableLock.ExclusiveAcquire();
 
-    for (DWORD i=0; i<_nBuckets; i++)
+    BUCKETS * pBuckets = _pBuckets;
+    for (DWORD i=0; i<pBuckets->_nBuckets; i++)
     {
-        ppPreviousNodeNextPointer = _ppBuckets + i;
+        ppPreviousNodeNextPointer = pBuckets->_rgpBuckets + i;
         pNode = *ppPreviousNodeNextPointer;
         while (pNode != NULL)
         {
@@ -718,17 +933,16 @@ TREE_HASH_TABLE<_Record>::DeleteIf(
             {
                 if (pNode->_pFirstChild == NULL)
                 {
-                    DeleteNodeInternal(ppPreviousNodeNextPointer, pNode);
+                    DeleteNodeInternal(ppPreviousNodeNextPointer, pNode, &pRetired);
                 }
                 else
                 {
-                    DereferenceRecord(pNode->_pRecord);
-                    pNode->_pRecord = NULL;
+                    RetireRecordInternal(pNode, &pRetired);
                 }
             }
             else
             {
-                ppPreviousNodeNextPointer = &pNode->_pNext;
+                ppPreviousNodeNextPointer = QueryNext(pBuckets, pNode);
             }
 
             pNode = *ppPreviousNodeNextPointer;
@@ -736,6 +950,8 @@ TREE_HASH_TABLE<_Record>::DeleteIf(
     }
 
     _tableLock.ExclusiveRelease();
+
+    ReclaimRetired(pRetired);
 }
 
 template <class _Record>
@@ -744,26 +960,34 @@ TREE_HASH_TABLE<_Record>::Apply(
     PFN_APPLY                   pfnApply,
     PVOID                       pvContext
 )
+/*++
+  Lock free like FindKey. Records deleted while the walk is in progress
+  may or may not be visited, pfnApply must not modify the table. The walk
+  stays on the array it started on across a rehash.
+--*/
 {
     TREE_HASH_NODE<_Record> *pNode;
+    _Record *pRecord;
 
-    _tableLock.SharedAcquire();
+    volatile LONG * pReaders = _epoch.EnterRead();
 
-    for (DWORD i=0; i<_nBuckets; i++)
+    BUCKETS * pBuckets = _pBuckets;
+    for (DWORD i=0; i<pBuckets->_nBuckets; i++)
     {
-        pNode = _ppBuckets[i];
+        pNode = pBuckets->_rgpBuckets[i];
         while (pNode != NULL)
         {
-            if (pNode->_pRecord != NULL)
+            pRecord = pNode->_pRecord;
+            if (pRecord != NULL)
             {
-                pfnApply(pNode->_pRecord, pvContext);
+                pfnApply(pRecord, pvContext);
             }
 
-            pNode = pNode->_pNext;
+            pNode = *QueryNext(pBuckets, pNode);
         }
     }
 
-    _tableLock.SharedRelease();
+    _epoch.LeaveRead(pReaders);
 }
 
 template <class _Record>
@@ -771,11 +995,15 @@ VOID
 TREE_HASH_TABLE<_Record>::RehashTableIfNeeded(
     VOID
 )
+/*++
+  Builds the new bucket array through the link the current one does not
+  use while readers go on walking the current one, then swaps it in.
+--*/
 {
-    TREE_HASH_NODE<_Record> **ppBuckets;
+    BUCKETS *pBuckets = NULL;
+    BUCKETS *pOldBuckets = NULL;
     DWORD nBuckets;
     TREE_HASH_NODE<_Record> *pNode;
-    TREE_HASH_NODE<_Record> *pNextNode;
     TREE_HASH_NODE<_Record> **ppNextPointer;
     TREE_HASH_NODE<_Record> *pNewNextNode;
     DWORD               nNewBuckets;
@@ -784,67 +1012,71 @@ TREE_HASH_TABLE<_Record>::RehashTableIfNeeded(
     // If number of items has become too many, we will double the hash table
     // size (we never reduce it however)
     //
-    if (_nItems <= PRIME::GetPrime(2*_nBuckets))
+    volatile LONG * pReaders = _epoch.EnterRead();
+    nBuckets = _pBuckets->_nBuckets;
+    _epoch.LeaveRead(pReaders);
+
+    if (_nItems <= PRIME::GetPrime(2*nBuckets))
     {
         return;
     }
 
+    _rehashLock.ExclusiveAcquire();
     _tableLock.ExclusiveAcquire();
 
-    nNewBuckets = PRIME::GetPrime(2*_nBuckets);
+    pOldBuckets = _pBuckets;
+    nNewBuckets = PRIME::GetPrime(2*pOldBuckets->_nBuckets);
 
-    if (_nItems <= nNewBuckets)
-    {
-        goto Finished;
-    }
-
-    nBuckets = nNewBuckets;
-    if (nBuckets >= 0xffffffff/sizeof(TREE_HASH_NODE<_Record> *))
-    {
-        goto Finished;
-    }
-    ppBuckets = (TREE_HASH_NODE<_Record> **)HeapAlloc(
-                        GetProcessHeap(),
-                        HEAP_ZERO_MEMORY,
-                        nBuckets*sizeof(TREE_HASH_NODE<_Record> *));
-    if (ppBuckets == NULL)
+    if (_nItems <= nNewBuckets ||
+        FAILED(AllocateBuckets(nNewBuckets, 1 - pOldBuckets->_iLink, &pBuckets)))
     {
+        pOldBuckets = NULL;
         goto Finished;
     }
 
     //
-    // Take out nodes from the old hash table and insert in the new one, make
-    // sure to keep the hashes in increasing order
+    // Link the nodes of the old hash table into the new one, make sure to
+    // keep the hashes in increasing order. The links of the old table are
+    // only read.
     //
-    for (DWORD i=0; i<_nBuckets; i++)
+    for (DWORD i=0; i<pOldBuckets->_nBuckets; i++)
     {
-        pNode = _ppBuckets[i];
+        pNode = pOldBuckets->_rgpBuckets[i];
         while (pNode != NULL)
         {
-            pNextNode = pNode->_pNext;
-
-            ppNextPointer = ppBuckets + (pNode->_dwHash % nBuckets);
+            ppNextPointer = QueryBucket(pBuckets, pNode->_dwHash);
             pNewNextNode = *ppNextPointer;
             while (pNewNextNode != NULL &&
                    pNewNextNode->_dwHash <= pNode->_dwHash)
             {
-                ppNextPointer = &pNewNextNode->_pNext;
-                pNewNextNode = pNewNextNode->_pNext;
+                ppNextPointer = QueryNext(pBuckets, pNewNextNode);
+                pNewNextNode = *ppNextPointer;
             }
-            pNode->_pNext = pNewNextNode;
+            *QueryNext(pBuckets, pNode) = pNewNextNode;
             *ppNextPointer = pNode;
 
-            pNode = pNextNode;
+            pNode = *QueryNext(pOldBuckets, pNode);
         }
     }
 
-    HeapFree(GetProcessHeap(), 0, _ppBuckets);
-    _ppBuckets = ppBuckets;
-    _nBuckets = nBuckets;
-    ppBuckets = NULL;
+    //
+    // Full barrier, the new links are in place before readers can load
+    // the array.
+    //
+    InterlockedExchangePointer((PVOID *)&_pBuckets, pBuckets);
 
 Finished:
 
     _tableLock.ExclusiveRelease();
-}
 
+    if (pOldBuckets != NULL)
+    {
+        //
+        // Readers that loaded the old array may still be walking it.
+        //
+        _epoch.Synchronize();
+        FreeBuckets(pOldBuckets);
+    }
+
+    _rehashLock.ExclusiveRelease();
+}
@@ -4,6 +4,7 @@
 #include "inprocessapplication.h"
 #include "inprocesshandler.h"
 #include "requesthandler_config.h"
+#include "requestsnapshot.h"
 
 extern bool g_fInProcessApplicationCreated;
 
@@ -86,6 +87,36 @@ Finished:
     return hr;
 }
 
+//
+// Everything http_get_raw_request and http_get_server_variable give, for
+// the headers and the server variables named in ppszServerVariables, in
+// one call, see REQUEST_SNAPSHOT_HEADER. With a buffer too small, returns
+// ERROR_INSUFFICIENT_BUFFER and the size it takes in pcbSnapshot.
+//
+EXTERN_C __MIDL_DECLSPEC_DLLEXPORT
+HRESULT
+http_get_request_snapshot(
+    _In_ IN_PROCESS_HANDLER* pInProcessHandler,
+    _In_reads_(cServerVariables) PCSTR* ppszServerVariables,
+    DWORD cServerVariables,
+    _Out_writes_bytes_opt_(cbBuffer) BYTE* pbBuffer,
+    DWORD cbBuffer,
+    _Out_ DWORD* pcbSnapshot
+)
+{
+    if (pcbSnapshot == NULL || (cServerVariables > 0 && ppszServerVariables == NULL))
+    {
+        return E_INVALIDARG;
+    }
+
+    REQUEST_SNAPSHOT_WRITER writer(pbBuffer, cbBuffer);
+
+    return writer.Write(pInProcessHandler->QueryHttpContext(),
+                        ppszServerVariables,
+                        cServerVariables,
+                        pcbSnapshot);
+}
+
 EXTERN_C __MIDL_DECLSPEC_DLLEXPORT
 HRESULT
 http_set_response_status_code(
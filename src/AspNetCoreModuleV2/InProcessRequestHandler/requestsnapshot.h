@@ -0,0 +1,194 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#pragma once
+
+#define REQUEST_SNAPSHOT_VERSION    1
+
+//
+// A request snapshot is what the managed server needs of a request to start
+// processing it, in one buffer it reads without calling back: the method,
+// the url, every header and the server variables it asked for.
+//
+// The buffer starts with REQUEST_SNAPSHOT_HEADER and goes on with records
+// packed one after the other, with no alignment, lengths in bytes:
+//
+//   verb             USHORT cb, bytes       empty unless Verb is HttpVerbUnknown
+//   raw url          USHORT cb, bytes
+//   path             USHORT cb, UTF-16      cooked, without the query string
+//   query string     USHORT cb, UTF-16      with the '?'
+//   known headers    cKnownHeaders x { USHORT HTTP_HEADER_ID, USHORT cb, bytes }
+//   unknown headers  cUnknownHeaders x { USHORT cb, name, USHORT cb, value }
+//   server variables cServerVariables x { USHORT index, DWORD cb, UTF-16 }
+//
+// A server variable is identified by its index in the names the caller
+// passed. Variables that are not set, or that fail to resolve, are left
+// out; the caller gets those one at a time if it cares why.
+//
+struct REQUEST_SNAPSHOT_HEADER
+{
+    DWORD   dwVersion;
+    DWORD   cbSnapshot;
+    DWORD   dwVerb;
+    USHORT  cKnownHeaders;
+    USHORT  cUnknownHeaders;
+    USHORT  cServerVariables;
+    USHORT  wReserved;
+};
+
+//
+// REQUEST_SNAPSHOT_WRITER writes the snapshot of a request into a buffer
+// the caller owns. When it does not fit, the buffer is left incomplete and
+// the size it takes is returned with ERROR_INSUFFICIENT_BUFFER, so a
+// second call with a buffer that large succeeds.
+//
+// CONTEXT is IHttpContext; anything with GetRequest()->GetRawHttpRequest()
+// and the wide GetServerVariable does, the tests drive it with a fake.
+//
+class REQUEST_SNAPSHOT_WRITER
+{
+public:
+
+    REQUEST_SNAPSHOT_WRITER(
+        _Out_writes_bytes_opt_(cbBuffer) BYTE * pbBuffer,
+        DWORD                                   cbBuffer
+    ) : m_pbBuffer(pbBuffer),
+        m_cbBuffer(pbBuffer == NULL ? 0 : cbBuffer),
+        m_cbSnapshot(0)
+    {
+    }
+
+    template<typename CONTEXT>
+    HRESULT
+    Write(
+        CONTEXT *                               pHttpContext,
+        _In_reads_(cServerVariables) PCSTR *    ppszServerVariables,
+        DWORD                                   cServerVariables,
+        _Out_ DWORD *                           pcbSnapshot
+    )
+    {
+        REQUEST_SNAPSHOT_HEADER     header = {};
+        const HTTP_REQUEST *        pRequest = pHttpContext->GetRequest()->GetRawHttpRequest();
+        const HTTP_COOKED_URL *     pCookedUrl = &pRequest->CookedUrl;
+        const HTTP_REQUEST_HEADERS *pHeaders = &pRequest->Headers;
+
+        *pcbSnapshot = 0;
+
+        if (cServerVariables > MAXWORD)
+        {
+            return E_INVALIDARG;
+        }
+
+        m_cbSnapshot = sizeof(header);
+        header.dwVersion = REQUEST_SNAPSHOT_VERSION;
+        header.dwVerb = pRequest->Verb;
+
+        if (pRequest->Verb == HttpVerbUnknown)
+        {
+            AppendRecord(pRequest->pUnknownVerb, pRequest->UnknownVerbLength);
+        }
+        else
+        {
+            AppendRecord(NULL, 0);
+        }
+
+        AppendRecord(pRequest->pRawUrl, pRequest->RawUrlLength);
+
+        //
+        // pAbsPath runs on into the query string, its length stops
+        // before it.
+        //
+        AppendRecord(pCookedUrl->pAbsPath,
+                     pCookedUrl->AbsPathLength);
+        AppendRecord(pCookedUrl->pQueryString,
+                     pCookedUrl->pQueryString == NULL ? 0 : pCookedUrl->QueryStringLength);
+
+        for (USHORT id = 0; id < HttpHeaderRequestMaximum; id++)
+        {
+            const HTTP_KNOWN_HEADER * pKnownHeader = &pHeaders->KnownHeaders[id];
+
+            if (pKnownHeader->RawValueLength > 0)
+            {
+                Append(&id, sizeof(id));
+                AppendRecord(pKnownHeader->pRawValue, pKnownHeader->RawValueLength);
+                header.cKnownHeaders++;
+            }
+        }
+
+        for (USHORT i = 0; i < pHeaders->UnknownHeaderCount; i++)
+        {
+            const HTTP_UNKNOWN_HEADER * pUnknownHeader = &pHeaders->pUnknownHeaders[i];
+
+            AppendRecord(pUnknownHeader->pName, pUnknownHeader->NameLength);
+            AppendRecord(pUnknownHeader->pRawValue, pUnknownHeader->RawValueLength);
+            header.cUnknownHeaders++;
+        }
+
+        for (USHORT i = 0; i < cServerVariables; i++)
+        {
+            PCWSTR  pszValue = NULL;
+            DWORD   cchValue = 0;
+            DWORD   cbValue;
+
+            if (FAILED(pHttpContext->GetServerVariable(ppszServerVariables[i], &pszValue, &cchValue)) ||
+                pszValue == NULL ||
+                cchValue == 0)
+            {
+                continue;
+            }
+
+            cbValue = cchValue * sizeof(WCHAR);
+            Append(&i, sizeof(i));
+            Append(&cbValue, sizeof(cbValue));
+            Append(pszValue, cbValue);
+            header.cServerVariables++;
+        }
+
+        header.cbSnapshot = m_cbSnapshot;
+        *pcbSnapshot = m_cbSnapshot;
+
+        if (m_cbSnapshot > m_cbBuffer)
+        {
+            return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+        }
+
+        memcpy(m_pbBuffer, &header, sizeof(header));
+        return S_OK;
+    }
+
+private:
+
+    //
+    // Copies what still fits and counts the rest, nothing more is copied
+    // once something did not.
+    //
+    VOID
+    Append(
+        _In_reads_bytes_(cbData) const VOID *   pvData,
+        DWORD                                   cbData
+    )
+    {
+        if (m_cbSnapshot <= m_cbBuffer && cbData <= m_cbBuffer - m_cbSnapshot)
+        {
+            memcpy(m_pbBuffer + m_cbSnapshot, pvData, cbData);
+        }
+        m_cbSnapshot += cbData;
+    }
+
+    VOID
+    AppendRecord(
+        _In_reads_bytes_opt_(cbData) const VOID *   pvData,
+        USHORT                                      cbData
+    )
+    {
+        Append(&cbData, sizeof(cbData));
+        if (cbData > 0)
+        {
+            Append(pvData, cbData);
+        }
+    }
+
+    BYTE *      m_pbBuffer;
+    DWORD       m_cbBuffer;
+    DWORD       m_cbSnapshot;
+};
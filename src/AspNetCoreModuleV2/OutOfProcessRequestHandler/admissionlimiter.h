@@ -0,0 +1,432 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#pragma once
+
+#include "timerwheel.h"
+
+//
+// ADMISSION_LIMITER caps the requests of an application that are in flight
+// to the backend. A request past the cap waits in a bounded queue until one
+// in flight leaves, and is shed with a 503 right away when the queue is
+// full or once it has waited for the queue timeout.
+//
+// The queue is served oldest first while it drains quickly. Once its oldest
+// request has waited more than half the timeout it is served newest first,
+// so that under overload the requests that still have a chance to be
+// answered in time go first and the stale ones time out.
+//
+// Admission takes no lock while nobody waits. The queue timeouts are kept
+// on a TIMER_WHEEL.
+//
+
+class ADMISSION_LIMITER;
+
+typedef
+VOID
+(*PFN_ADMISSION_COMPLETION)(
+    PVOID       pvContext,
+    BOOL        fAdmitted
+);
+
+//
+// Kept by a queued request. pfnCompletion is called once, when the request
+// is admitted or has timed out, and the waiter is not touched after that.
+//
+struct ADMISSION_WAITER
+{
+    LIST_ENTRY                  listEntry;
+    TIMER_WHEEL_ENTRY           timeoutEntry;
+    ADMISSION_LIMITER *         pLimiter;
+    PFN_ADMISSION_COMPLETION    pfnCompletion;
+    PVOID                       pvContext;
+    ULONGLONG                   ullQueued;
+    BOOL                        fQueued;
+    BOOL                        fAdmitted;
+};
+
+enum ADMISSION_RESULT
+{
+    ADMISSION_ADMITTED,
+    ADMISSION_QUEUED,
+    ADMISSION_REJECTED
+};
+
+#define ADMISSION_HISTOGRAM_BUCKETS     20
+
+struct ADMISSION_COUNTERS
+{
+    //
+    // Requests admitted on arrival, queued, admitted from the queue (newest
+    // first for cLifo of them), shed because the queue was full, and shed
+    // because they waited for the queue timeout.
+    //
+    ULONGLONG   cAdmitted;
+    ULONGLONG   cQueued;
+    ULONGLONG   cDequeued;
+    ULONGLONG   cLifo;
+    ULONGLONG   cRejected;
+    ULONGLONG   cTimedOut;
+
+    DWORD       cInFlight;
+    DWORD       cWaiting;
+
+    //
+    // Powers of two: bucket 0 counts 0, bucket i counts [2^(i-1), 2^i) and
+    // the last bucket everything above. rgQueueDepth is the queue length
+    // found by arriving requests, rgWaitTimeMs the time requests spent in
+    // the queue.
+    //
+    ULONGLONG   rgQueueDepth[ADMISSION_HISTOGRAM_BUCKETS];
+    ULONGLONG   rgWaitTimeMs[ADMISSION_HISTOGRAM_BUCKETS];
+};
+
+class ADMISSION_LIMITER
+{
+public:
+
+    ADMISSION_LIMITER() :
+        m_cMaxInFlight(0),
+        m_cMaxQueued(0),
+        m_dwQueueTimeoutMs(0),
+        m_pTimerWheel(NULL),
+        m_cInFlight(0),
+        m_cWaiting(0),
+        m_cAdmitted(0),
+        m_cQueued(0),
+        m_cDequeued(0),
+        m_cLifo(0),
+        m_cRejected(0),
+        m_cTimedOut(0)
+    {
+        InitializeSRWLock(&m_srwLock);
+        InitializeListHead(&m_queue);
+        ZeroMemory(m_rgQueueDepth, sizeof(m_rgQueueDepth));
+        ZeroMemory(m_rgWaitTimeMs, sizeof(m_rgWaitTimeMs));
+    }
+
+    ~ADMISSION_LIMITER()
+    {
+        DBG_ASSERT(IsListEmpty(&m_queue));
+    }
+
+    //
+    // pTimerWheel times the queue, without one queued requests wait until
+    // they are admitted.
+    //
+    HRESULT
+    Initialize(
+        DWORD           cMaxInFlight,
+        DWORD           cMaxQueued,
+        DWORD           dwQueueTimeoutMs,
+        _In_opt_ TIMER_WHEEL * pTimerWheel
+    )
+    {
+        if (cMaxInFlight == 0 || cMaxInFlight > LONG_MAX || cMaxQueued > LONG_MAX)
+        {
+            return E_INVALIDARG;
+        }
+
+        m_cMaxInFlight = cMaxInFlight;
+        m_cMaxQueued = cMaxQueued;
+        m_dwQueueTimeoutMs = dwQueueTimeoutMs;
+        m_pTimerWheel = pTimerWheel;
+        return S_OK;
+    }
+
+    static
+    VOID
+    InitializeWaiter(
+        _Out_ ADMISSION_WAITER *    pWaiter,
+        PFN_ADMISSION_COMPLETION    pfnCompletion,
+        PVOID                       pvContext
+    )
+    {
+        InitializeListHead(&pWaiter->listEntry);
+        TIMER_WHEEL::InitializeEntry(&pWaiter->timeoutEntry, QueueTimeoutCallback, pWaiter);
+        pWaiter->pLimiter = NULL;
+        pWaiter->pfnCompletion = pfnCompletion;
+        pWaiter->pvContext = pvContext;
+        pWaiter->ullQueued = 0;
+        pWaiter->fQueued = FALSE;
+        pWaiter->fAdmitted = FALSE;
+    }
+
+    //
+    // ADMISSION_ADMITTED: the request may go to the backend now and calls
+    // Leave when it is done with it. ADMISSION_QUEUED: pWaiter is called
+    // back later. ADMISSION_REJECTED: the request is to be shed.
+    //
+    ADMISSION_RESULT
+    Enter(
+        _In_ ADMISSION_WAITER *     pWaiter,
+        ULONGLONG                   ullNow
+    )
+    {
+        ADMISSION_RESULT result;
+
+        if (m_cWaiting == 0 && TryAcquireSlot())
+        {
+            InterlockedIncrement64(reinterpret_cast<LONGLONG *>(&m_cAdmitted));
+            return ADMISSION_ADMITTED;
+        }
+
+        AcquireSRWLockExclusive(&m_srwLock);
+
+        //
+        // Count the request as waiting before trying for a slot once more,
+        // a Leave that frees one after this sees it and admits it.
+        //
+        LONG cWaiting = InterlockedIncrement(&m_cWaiting);
+
+        if (TryAcquireSlot())
+        {
+            InterlockedDecrement(&m_cWaiting);
+            InterlockedIncrement64(reinterpret_cast<LONGLONG *>(&m_cAdmitted));
+            result = ADMISSION_ADMITTED;
+        }
+        else if (static_cast<DWORD>(cWaiting) > m_cMaxQueued)
+        {
+            InterlockedDecrement(&m_cWaiting);
+            m_rgQueueDepth[HistogramBucket(cWaiting - 1)]++;
+            m_cRejected++;
+            result = ADMISSION_REJECTED;
+        }
+        else
+        {
+            m_rgQueueDepth[HistogramBucket(cWaiting - 1)]++;
+            m_cQueued++;
+
+            pWaiter->pLimiter = this;
+            pWaiter->ullQueued = ullNow;
+            pWaiter->fQueued = TRUE;
+            pWaiter->fAdmitted = FALSE;
+            InsertTailList(&m_queue, &pWaiter->listEntry);
+
+            if (m_pTimerWheel != NULL && m_dwQueueTimeoutMs != 0)
+            {
+                m_pTimerWheel->Arm(&pWaiter->timeoutEntry, m_dwQueueTimeoutMs, ullNow);
+            }
+            result = ADMISSION_QUEUED;
+        }
+
+        ReleaseSRWLockExclusive(&m_srwLock);
+
+        return result;
+    }
+
+    //
+    // A request admitted by Enter or the queue is done with the backend,
+    // its slot goes to a queued request if there is one.
+    //
+    VOID
+    Leave(
+        ULONGLONG   ullNow
+    )
+    {
+        DBG_ASSERT(m_cInFlight > 0);
+        InterlockedDecrement(&m_cInFlight);
+
+        if (m_cWaiting != 0)
+        {
+            AdmitWaiters(ullNow);
+        }
+    }
+
+    VOID
+    QueryCounters(
+        _Out_ ADMISSION_COUNTERS *  pCounters
+    )
+    {
+        AcquireSRWLockShared(&m_srwLock);
+
+        pCounters->cAdmitted = m_cAdmitted;
+        pCounters->cQueued = m_cQueued;
+        pCounters->cDequeued = m_cDequeued;
+        pCounters->cLifo = m_cLifo;
+        pCounters->cRejected = m_cRejected;
+        pCounters->cTimedOut = m_cTimedOut;
+        pCounters->cInFlight = m_cInFlight;
+        pCounters->cWaiting = m_cWaiting;
+        memcpy(pCounters->rgQueueDepth, m_rgQueueDepth, sizeof(m_rgQueueDepth));
+        memcpy(pCounters->rgWaitTimeMs, m_rgWaitTimeMs, sizeof(m_rgWaitTimeMs));
+
+        ReleaseSRWLockShared(&m_srwLock);
+
+        //
+        // Requests admitted on arrival found nobody waiting.
+        //
+        pCounters->rgQueueDepth[0] += pCounters->cAdmitted;
+    }
+
+    //
+    // Writes the counters and the non-empty histogram buckets to the debug
+    // log.
+    //
+    VOID
+    Dump()
+    {
+        ADMISSION_COUNTERS counters;
+
+        QueryCounters(&counters);
+
+        DebugPrintf(ASPNETCORE_DEBUG_FLAG_INFO,
+            "ADMISSION_LIMITER: %I64u admitted, %I64u queued, %I64u dequeued, %I64u lifo, %I64u rejected, %I64u timed out, %u in flight, %u waiting",
+            counters.cAdmitted,
+            counters.cQueued,
+            counters.cDequeued,
+            counters.cLifo,
+            counters.cRejected,
+            counters.cTimedOut,
+            counters.cInFlight,
+            counters.cWaiting);
+
+        for (DWORD i = 0; i < ADMISSION_HISTOGRAM_BUCKETS; i++)
+        {
+            if (counters.rgQueueDepth[i] == 0 && counters.rgWaitTimeMs[i] == 0)
+            {
+                continue;
+            }
+
+            DebugPrintf(ASPNETCORE_DEBUG_FLAG_INFO,
+                "ADMISSION_LIMITER bucket %u (from %u): queue depth %I64u, wait time ms %I64u",
+                i,
+                i == 0 ? 0 : 1u << (i - 1),
+                counters.rgQueueDepth[i],
+                counters.rgWaitTimeMs[i]);
+        }
+    }
+
+    static
+    DWORD
+    HistogramBucket(
+        ULONGLONG   ullValue
+    )
+    {
+        DWORD bucket = 0;
+
+        while (ullValue != 0 && bucket < ADMISSION_HISTOGRAM_BUCKETS - 1)
+        {
+            ullValue >>= 1;
+            bucket++;
+        }
+        return bucket;
+    }
+
+private:
+
+    BOOL
+    TryAcquireSlot()
+    {
+        LONG cInFlight = m_cInFlight;
+
+        while (static_cast<DWORD>(cInFlight) < m_cMaxInFlight)
+        {
+            LONG cPrevious = InterlockedCompareExchange(&m_cInFlight, cInFlight + 1, cInFlight);
+            if (cPrevious == cInFlight)
+            {
+                return TRUE;
+            }
+            cInFlight = cPrevious;
+        }
+        return FALSE;
+    }
+
+    VOID
+    AdmitWaiters(
+        ULONGLONG   ullNow
+    )
+    {
+        LIST_ENTRY          admitted;
+        ADMISSION_WAITER *  pWaiter;
+
+        InitializeListHead(&admitted);
+
+        AcquireSRWLockExclusive(&m_srwLock);
+
+        while (!IsListEmpty(&m_queue) && TryAcquireSlot())
+        {
+            pWaiter = CONTAINING_RECORD(m_queue.Flink, ADMISSION_WAITER, listEntry);
+
+            if (m_dwQueueTimeoutMs != 0 &&
+                ullNow - pWaiter->ullQueued > m_dwQueueTimeoutMs / 2)
+            {
+                //
+                // The queue is backed up, serve the newest.
+                //
+                pWaiter = CONTAINING_RECORD(m_queue.Blink, ADMISSION_WAITER, listEntry);
+                m_cLifo++;
+            }
+
+            RemoveEntryList(&pWaiter->listEntry);
+            InterlockedDecrement(&m_cWaiting);
+            pWaiter->fQueued = FALSE;
+            pWaiter->fAdmitted = TRUE;
+            m_cDequeued++;
+            m_rgWaitTimeMs[HistogramBucket(ullNow - pWaiter->ullQueued)]++;
+
+            InsertTailList(&admitted, &pWaiter->listEntry);
+        }
+
+        ReleaseSRWLockExclusive(&m_srwLock);
+
+        while (!IsListEmpty(&admitted))
+        {
+            pWaiter = CONTAINING_RECORD(RemoveHeadList(&admitted), ADMISSION_WAITER, listEntry);
+
+            //
+            // If the timeout is firing already, its callback calls the
+            // waiter and finds it admitted.
+            //
+            if (m_pTimerWheel == NULL || m_dwQueueTimeoutMs == 0 ||
+                m_pTimerWheel->Cancel(&pWaiter->timeoutEntry))
+            {
+                pWaiter->pfnCompletion(pWaiter->pvContext, TRUE);
+            }
+        }
+    }
+
+    static
+    VOID
+    QueueTimeoutCallback(
+        PVOID       pvContext
+    )
+    {
+        ADMISSION_WAITER *  pWaiter = static_cast<ADMISSION_WAITER *>(pvContext);
+        ADMISSION_LIMITER * pLimiter = pWaiter->pLimiter;
+
+        AcquireSRWLockExclusive(&pLimiter->m_srwLock);
+
+        if (pWaiter->fQueued)
+        {
+            RemoveEntryList(&pWaiter->listEntry);
+            InterlockedDecrement(&pLimiter->m_cWaiting);
+            pWaiter->fQueued = FALSE;
+            pLimiter->m_cTimedOut++;
+            pLimiter->m_rgWaitTimeMs[HistogramBucket(pLimiter->m_dwQueueTimeoutMs)]++;
+        }
+
+        ReleaseSRWLockExclusive(&pLimiter->m_srwLock);
+
+        pWaiter->pfnCompletion(pWaiter->pvContext, pWaiter->fAdmitted);
+    }
+
+    DWORD                   m_cMaxInFlight;
+    DWORD                   m_cMaxQueued;
+    DWORD                   m_dwQueueTimeoutMs;
+    TIMER_WHEEL *           m_pTimerWheel;
+
+    SRWLOCK                 m_srwLock;
+    LIST_ENTRY              m_queue;
+    volatile LONG           m_cInFlight;
+    volatile LONG           m_cWaiting;
+
+    ULONGLONG               m_cAdmitted;
+    ULONGLONG               m_cQueued;
+    ULONGLONG               m_cDequeued;
+    ULONGLONG               m_cLifo;
+    ULONGLONG               m_cRejected;
+    ULONGLONG               m_cTimedOut;
+    ULONGLONG               m_rgQueueDepth[ADMISSION_HISTOGRAM_BUCKETS];
+    ULONGLONG               m_rgWaitTimeMs[ADMISSION_HISTOGRAM_BUCKETS];
+};
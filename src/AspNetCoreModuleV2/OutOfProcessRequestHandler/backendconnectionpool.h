@@ -0,0 +1,950 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#pragma once
+
+#include "localhttpconnection.h"
+#include "localsocketpoller.h"
+#include "timerwheel.h"
+
+//
+// BACKEND_CONNECTION_POOL keeps the connections of FORWARDING_HANDLER to
+// one backend process. A request takes an idle connection if there is one,
+// opens a new one while the pool is under its cap, and otherwise waits for
+// a connection to come back. Idle connections are handed out most recently
+// used first, so the ones left at the tail of the list are the ones that
+// idle out.
+//
+// Once the process is up the pool is filled to its minimum of idle
+// connections, so the first requests after a restart do not pay for the
+// connects. A TIMER_WHEEL entry closes connections idle past the idle
+// timeout, down to that minimum, and fills the pool back up to it.
+//
+// With a cap of 0 nothing is pooled: every request opens its own
+// connection and closes it afterwards.
+//
+// A request may wait without a thread: AcquireAsync queues it at the cap,
+// and a connection that comes back is handed to the first request queued,
+// or its slot is when the connection is not kept. A request that has its
+// connection waits for the socket on the LOCAL_SOCKET_POLLER of the pool.
+//
+
+//
+// A connection of the pool, on its idle list while no request holds it.
+//
+struct POOLED_CONNECTION
+{
+    LIST_ENTRY              listEntry;
+    ULONGLONG               ullIdleSince;
+    LOCAL_HTTP_CONNECTION   connection;
+};
+
+typedef
+VOID
+(*PFN_POOL_WAITER_CALLBACK)(
+    PVOID       pvContext
+);
+
+//
+// Kept by a request queued by AcquireAsync. pfnCallback is called once,
+// without the lock of the pool, when a connection or a slot is handed to
+// it or the pool shuts down. pConnection is the connection handed over,
+// NULL for a slot.
+//
+struct POOL_WAITER
+{
+    LIST_ENTRY                  listEntry;
+    PFN_POOL_WAITER_CALLBACK    pfnCallback;
+    PVOID                       pvContext;
+    POOLED_CONNECTION *         pConnection;
+    HRESULT                     hr;
+    BOOL                        fQueued;
+};
+
+struct BACKEND_POOL_COUNTERS
+{
+    //
+    // Connects made and failed, requests served by an idle connection,
+    // connections opened ahead of requests, closed for being idle too
+    // long, found closed by the backend while idle, and not kept after a
+    // request. Requests that waited for a connection, and that gave up.
+    //
+    ULONGLONG   cConnects;
+    ULONGLONG   cConnectFailures;
+    ULONGLONG   cReused;
+    ULONGLONG   cWarmed;
+    ULONGLONG   cEvicted;
+    ULONGLONG   cStale;
+    ULONGLONG   cDiscarded;
+    ULONGLONG   cWaits;
+    ULONGLONG   cWaitTimeouts;
+
+    DWORD       cIdle;
+    DWORD       cActive;
+};
+
+class BACKEND_CONNECTION_POOL
+{
+public:
+
+    BACKEND_CONNECTION_POOL() :
+        m_cRefs(1),
+        m_transport(LOCAL_TRANSPORT_TCP),
+        m_usPort(0),
+        m_dwTimeoutMs(0),
+        m_cbMaxHead(0),
+        m_cMinIdle(0),
+        m_cMaxConnections(0),
+        m_dwIdleTimeoutMs(0),
+        m_pTimerWheel(NULL),
+        m_fShutdown(FALSE),
+        m_fWarming(0),
+        m_cIdle(0),
+        m_cActive(0),
+        m_cConnects(0),
+        m_cConnectFailures(0),
+        m_cReused(0),
+        m_cWarmed(0),
+        m_cEvicted(0),
+        m_cStale(0),
+        m_cDiscarded(0),
+        m_cWaits(0),
+        m_cWaitTimeouts(0)
+    {
+        m_szPath[0] = '\0';
+        InitializeSRWLock(&m_srwLock);
+        InitializeConditionVariable(&m_connectionReleased);
+        InitializeListHead(&m_idleList);
+        InitializeListHead(&m_waiterList);
+        TIMER_WHEEL::InitializeEntry(&m_evictionTimer, EvictionTimerCallback, this);
+    }
+
+    VOID
+    ReferenceConnectionPool()
+    {
+        InterlockedIncrement(&m_cRefs);
+    }
+
+    VOID
+    DereferenceConnectionPool()
+    {
+        if (InterlockedDecrement(&m_cRefs) == 0)
+        {
+            delete this;
+        }
+    }
+
+    //
+    // pszPath is the socket of a LOCAL_TRANSPORT_UNIX_SOCKET backend,
+    // usPort the port of a TCP one. dwTimeoutMs bounds the sends and
+    // receives of a connection and how long a request waits for one.
+    // pTimerWheel drives idle eviction, without one connections stay open
+    // until they fail or the pool shuts down.
+    //
+    HRESULT
+    Initialize(
+        LOCAL_TRANSPORT         transport,
+        _In_opt_ PCSTR          pszPath,
+        USHORT                  usPort,
+        DWORD                   dwTimeoutMs,
+        DWORD                   cbMaxHead,
+        DWORD                   cMinIdle,
+        DWORD                   cMaxConnections,
+        DWORD                   dwIdleTimeoutMs,
+        _In_opt_ TIMER_WHEEL *  pTimerWheel
+    )
+    {
+        HRESULT hr;
+
+        if (transport == LOCAL_TRANSPORT_UNIX_SOCKET)
+        {
+            if (pszPath == NULL || strlen(pszPath) >= sizeof(m_szPath))
+            {
+                return HRESULT_FROM_WIN32(ERROR_BAD_PATHNAME);
+            }
+            memcpy(m_szPath, pszPath, strlen(pszPath) + 1);
+        }
+
+        if (cbMaxHead == 0 || cMaxConnections > LONG_MAX ||
+            (cMaxConnections != 0 && cMinIdle > cMaxConnections) ||
+            (cMaxConnections == 0 && cMinIdle != 0))
+        {
+            return E_INVALIDARG;
+        }
+
+        m_transport = transport;
+        m_usPort = usPort;
+        m_dwTimeoutMs = dwTimeoutMs;
+        m_cbMaxHead = cbMaxHead;
+        m_cMinIdle = cMinIdle;
+        m_cMaxConnections = cMaxConnections;
+        m_dwIdleTimeoutMs = dwIdleTimeoutMs;
+        m_pTimerWheel = pTimerWheel;
+
+        if (FAILED(hr = m_poller.Initialize()))
+        {
+            return hr;
+        }
+
+        if (m_pTimerWheel != NULL && m_cMaxConnections != 0 && m_dwIdleTimeoutMs != 0)
+        {
+            m_pTimerWheel->Arm(&m_evictionTimer, EvictionPeriod(), GetTickCount64());
+        }
+        return S_OK;
+    }
+
+    //
+    // Where the requests holding connections of the pool wait for them.
+    //
+    LOCAL_SOCKET_POLLER *
+    QueryPoller()
+    {
+        return &m_poller;
+    }
+
+    //
+    // Hands out a connection for one request, which goes back with Release.
+    // *pfReused is set when the connection was idle in the pool: the backend
+    // may have closed it in the meantime. Fails with ERROR_BUSY when the
+    // pool stays at its cap for the whole timeout.
+    //
+    HRESULT
+    Acquire(
+        _Outptr_ POOLED_CONNECTION **   ppConnection,
+        _Out_ BOOL *                    pfReused
+    )
+    {
+        HRESULT                 hr = S_OK;
+        LIST_ENTRY              staleList;
+        POOLED_CONNECTION *     pConnection = NULL;
+        ULONGLONG               ullStart = 0;
+        BOOL                    fWaited = FALSE;
+
+        *ppConnection = NULL;
+        *pfReused = FALSE;
+        InitializeListHead(&staleList);
+
+        AcquireSRWLockExclusive(&m_srwLock);
+
+        for (;;)
+        {
+            hr = TakeLocked(&staleList, &pConnection, pfReused);
+            if (hr != HRESULT_FROM_WIN32(ERROR_BUSY))
+            {
+                break;
+            }
+            hr = S_OK;
+
+            if (!fWaited)
+            {
+                fWaited = TRUE;
+                ullStart = GetTickCount64();
+                m_cWaits++;
+            }
+
+            DWORD dwWaitMs = INFINITE;
+            if (m_dwTimeoutMs != 0 && m_dwTimeoutMs != INFINITE)
+            {
+                ULONGLONG ullWaited = GetTickCount64() - ullStart;
+                if (ullWaited >= m_dwTimeoutMs)
+                {
+                    m_cWaitTimeouts++;
+                    hr = HRESULT_FROM_WIN32(ERROR_BUSY);
+                    break;
+                }
+                dwWaitMs = static_cast<DWORD>(m_dwTimeoutMs - ullWaited);
+            }
+
+            SleepConditionVariableSRW(&m_connectionReleased, &m_srwLock, dwWaitMs, 0);
+        }
+
+        ReleaseSRWLockExclusive(&m_srwLock);
+
+        DeleteConnections(&staleList);
+
+        if (FAILED(hr) || pConnection != NULL)
+        {
+            *ppConnection = pConnection;
+            return hr;
+        }
+
+        return ConnectSlot(ppConnection);
+    }
+
+    static
+    VOID
+    InitializeWaiter(
+        _Out_ POOL_WAITER *         pWaiter,
+        PFN_POOL_WAITER_CALLBACK    pfnCallback,
+        PVOID                       pvContext
+    )
+    {
+        InitializeListHead(&pWaiter->listEntry);
+        pWaiter->pfnCallback = pfnCallback;
+        pWaiter->pvContext = pvContext;
+        pWaiter->pConnection = NULL;
+        pWaiter->hr = S_OK;
+        pWaiter->fQueued = FALSE;
+    }
+
+    //
+    // Acquire without waiting for the pool: at the cap pWaiter is queued
+    // and the call fails with ERROR_IO_PENDING. Once it is called back the
+    // request takes the connection with CompleteWait. A request that gives
+    // up first takes its waiter back with CancelWait.
+    //
+    HRESULT
+    AcquireAsync(
+        _In_ POOL_WAITER *              pWaiter,
+        _Outptr_ POOLED_CONNECTION **   ppConnection,
+        _Out_ BOOL *                    pfReused
+    )
+    {
+        HRESULT                 hr;
+        LIST_ENTRY              staleList;
+        POOLED_CONNECTION *     pConnection = NULL;
+
+        *ppConnection = NULL;
+        *pfReused = FALSE;
+        InitializeListHead(&staleList);
+
+        DBG_ASSERT(!pWaiter->fQueued);
+
+        AcquireSRWLockExclusive(&m_srwLock);
+
+        hr = TakeLocked(&staleList, &pConnection, pfReused);
+        if (hr == HRESULT_FROM_WIN32(ERROR_BUSY))
+        {
+            pWaiter->pConnection = NULL;
+            pWaiter->hr = S_OK;
+            pWaiter->fQueued = TRUE;
+            InsertTailList(&m_waiterList, &pWaiter->listEntry);
+            m_cWaits++;
+            hr = HRESULT_FROM_WIN32(ERROR_IO_PENDING);
+        }
+
+        ReleaseSRWLockExclusive(&m_srwLock);
+
+        DeleteConnections(&staleList);
+
+        if (FAILED(hr) || pConnection != NULL)
+        {
+            *ppConnection = pConnection;
+            return hr;
+        }
+
+        return ConnectSlot(ppConnection);
+    }
+
+    //
+    // Takes what was handed to a waiter that has been called back. A slot
+    // is connected here, a connection handed over is reused.
+    //
+    HRESULT
+    CompleteWait(
+        _In_ POOL_WAITER *              pWaiter,
+        _Outptr_ POOLED_CONNECTION **   ppConnection,
+        _Out_ BOOL *                    pfReused
+    )
+    {
+        *ppConnection = NULL;
+        *pfReused = FALSE;
+
+        DBG_ASSERT(!pWaiter->fQueued);
+
+        if (FAILED(pWaiter->hr))
+        {
+            return pWaiter->hr;
+        }
+
+        if (pWaiter->pConnection != NULL)
+        {
+            *ppConnection = pWaiter->pConnection;
+            *pfReused = TRUE;
+            pWaiter->pConnection = NULL;
+            return S_OK;
+        }
+
+        return ConnectSlot(ppConnection);
+    }
+
+    //
+    // TRUE when pWaiter was still queued and is not called back. Otherwise
+    // its callback has been called or is about to be, and the request
+    // completes the wait and releases what it got.
+    //
+    BOOL
+    CancelWait(
+        _In_ POOL_WAITER *  pWaiter
+    )
+    {
+        BOOL fQueued;
+
+        AcquireSRWLockExclusive(&m_srwLock);
+
+        fQueued = pWaiter->fQueued;
+        if (fQueued)
+        {
+            RemoveEntryList(&pWaiter->listEntry);
+            pWaiter->fQueued = FALSE;
+            m_cWaitTimeouts++;
+        }
+
+        ReleaseSRWLockExclusive(&m_srwLock);
+
+        return fQueued;
+    }
+
+    //
+    // Gives back a connection from Acquire. fReuse is cleared when the
+    // request failed, the connection is only kept when it is at the end of
+    // a response and the backend keeps it open.
+    //
+    VOID
+    Release(
+        _In_ POOLED_CONNECTION *    pConnection,
+        BOOL                        fReuse,
+        ULONGLONG                   ullNow
+    )
+    {
+        POOLED_CONNECTION * pDiscarded = NULL;
+        POOL_WAITER *       pWaiter;
+
+        fReuse = fReuse && m_cMaxConnections != 0 && pConnection->connection.IsReusable();
+
+        AcquireSRWLockExclusive(&m_srwLock);
+
+        if (!fReuse || m_fShutdown)
+        {
+            if (m_cMaxConnections != 0)
+            {
+                m_cDiscarded++;
+            }
+            pDiscarded = pConnection;
+            pConnection = NULL;
+        }
+        pWaiter = PutBackLocked(&pConnection, ullNow);
+
+        ReleaseSRWLockExclusive(&m_srwLock);
+
+        NotifyPutBack(pWaiter);
+
+        delete pDiscarded;
+    }
+
+    //
+    // Opens connections until the pool has its minimum of idle ones, or is
+    // at its cap. Returns how many it opened.
+    //
+    DWORD
+    Warmup()
+    {
+        POOLED_CONNECTION * pConnection;
+        POOL_WAITER *       pWaiter;
+        DWORD               cWarmed = 0;
+
+        for (;;)
+        {
+            AcquireSRWLockExclusive(&m_srwLock);
+
+            if (m_fShutdown || m_cIdle >= m_cMinIdle ||
+                m_cIdle + m_cActive >= m_cMaxConnections)
+            {
+                ReleaseSRWLockExclusive(&m_srwLock);
+                break;
+            }
+            m_cActive++;
+
+            ReleaseSRWLockExclusive(&m_srwLock);
+
+            if (FAILED(Connect(&pConnection)))
+            {
+                ReleaseSlot();
+                break;
+            }
+
+            AcquireSRWLockExclusive(&m_srwLock);
+
+            //
+            // A request that queued meanwhile takes the connection.
+            //
+            pWaiter = PutBackLocked(&pConnection, GetTickCount64());
+            if (pWaiter == NULL && pConnection == NULL)
+            {
+                m_cWarmed++;
+                cWarmed++;
+            }
+
+            ReleaseSRWLockExclusive(&m_srwLock);
+
+            NotifyPutBack(pWaiter);
+
+            delete pConnection;
+        }
+
+        return cWarmed;
+    }
+
+    //
+    // Warmup on the threadpool, unless one is under way already.
+    //
+    VOID
+    StartWarmup()
+    {
+        if (m_cMinIdle == 0 ||
+            InterlockedCompareExchange(&m_fWarming, 1, 0) != 0)
+        {
+            return;
+        }
+
+        ReferenceConnectionPool();
+        if (!TrySubmitThreadpoolCallback(WarmupCallback, this, NULL))
+        {
+            InterlockedExchange(&m_fWarming, 0);
+            DereferenceConnectionPool();
+        }
+    }
+
+    //
+    // Closes the connections idle since dwIdleTimeoutMs before ullNow,
+    // keeping the minimum of idle ones. Returns how many it closed.
+    //
+    DWORD
+    EvictIdle(
+        ULONGLONG   ullNow
+    )
+    {
+        LIST_ENTRY          evictedList;
+        POOLED_CONNECTION * pConnection;
+        DWORD               cEvicted = 0;
+
+        InitializeListHead(&evictedList);
+
+        AcquireSRWLockExclusive(&m_srwLock);
+
+        while (m_cIdle > m_cMinIdle)
+        {
+            pConnection = CONTAINING_RECORD(m_idleList.Blink, POOLED_CONNECTION, listEntry);
+            if (ullNow - pConnection->ullIdleSince < m_dwIdleTimeoutMs)
+            {
+                break;
+            }
+
+            RemoveEntryList(&pConnection->listEntry);
+            InsertTailList(&evictedList, &pConnection->listEntry);
+            m_cIdle--;
+            m_cEvicted++;
+            cEvicted++;
+        }
+
+        ReleaseSRWLockExclusive(&m_srwLock);
+
+        DeleteConnections(&evictedList);
+
+        return cEvicted;
+    }
+
+    //
+    // Closes the idle connections and stops pooling: requests waiting for
+    // a connection fail, connections still held are closed when they come
+    // back.
+    //
+    VOID
+    Shutdown()
+    {
+        LIST_ENTRY      idleList;
+        LIST_ENTRY      waiterList;
+        POOL_WAITER *   pWaiter;
+
+        InitializeListHead(&idleList);
+        InitializeListHead(&waiterList);
+
+        AcquireSRWLockExclusive(&m_srwLock);
+
+        m_fShutdown = TRUE;
+        while (!IsListEmpty(&m_idleList))
+        {
+            InsertTailList(&idleList, RemoveHeadList(&m_idleList));
+        }
+        m_cIdle = 0;
+
+        while (!IsListEmpty(&m_waiterList))
+        {
+            pWaiter = CONTAINING_RECORD(RemoveHeadList(&m_waiterList), POOL_WAITER, listEntry);
+            pWaiter->fQueued = FALSE;
+            pWaiter->hr = HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED);
+            InsertTailList(&waiterList, &pWaiter->listEntry);
+        }
+
+        ReleaseSRWLockExclusive(&m_srwLock);
+
+        WakeAllConditionVariable(&m_connectionReleased);
+
+        while (!IsListEmpty(&waiterList))
+        {
+            pWaiter = CONTAINING_RECORD(RemoveHeadList(&waiterList), POOL_WAITER, listEntry);
+            InitializeListHead(&pWaiter->listEntry);
+            pWaiter->pfnCallback(pWaiter->pvContext);
+        }
+
+        if (m_pTimerWheel != NULL)
+        {
+            //
+            // A callback under way may have armed the entry again before it
+            // saw the pool shut down.
+            //
+            m_pTimerWheel->CancelAndWait(&m_evictionTimer);
+            m_pTimerWheel->Cancel(&m_evictionTimer);
+        }
+
+        //
+        // Requests waiting for their sockets are called back and fail.
+        //
+        m_poller.Shutdown();
+
+        DeleteConnections(&idleList);
+    }
+
+    VOID
+    QueryCounters(
+        _Out_ BACKEND_POOL_COUNTERS *   pCounters
+    )
+    {
+        AcquireSRWLockShared(&m_srwLock);
+
+        pCounters->cConnects = m_cConnects;
+        pCounters->cConnectFailures = m_cConnectFailures;
+        pCounters->cReused = m_cReused;
+        pCounters->cWarmed = m_cWarmed;
+        pCounters->cEvicted = m_cEvicted;
+        pCounters->cStale = m_cStale;
+        pCounters->cDiscarded = m_cDiscarded;
+        pCounters->cWaits = m_cWaits;
+        pCounters->cWaitTimeouts = m_cWaitTimeouts;
+        pCounters->cIdle = m_cIdle;
+        pCounters->cActive = m_cActive;
+
+        ReleaseSRWLockShared(&m_srwLock);
+    }
+
+    //
+    // Writes the counters to the debug log.
+    //
+    VOID
+    Dump()
+    {
+        BACKEND_POOL_COUNTERS counters;
+
+        QueryCounters(&counters);
+
+        DebugPrintf(ASPNETCORE_DEBUG_FLAG_INFO,
+            "BACKEND_CONNECTION_POOL: %I64u connects, %I64u connect failures, %I64u reused, %I64u warmed, %I64u evicted, %I64u stale, %I64u discarded, %I64u waits, %I64u wait timeouts, %u idle, %u active",
+            counters.cConnects,
+            counters.cConnectFailures,
+            counters.cReused,
+            counters.cWarmed,
+            counters.cEvicted,
+            counters.cStale,
+            counters.cDiscarded,
+            counters.cWaits,
+            counters.cWaitTimeouts,
+            counters.cIdle,
+            counters.cActive);
+    }
+
+private:
+
+    ~BACKEND_CONNECTION_POOL()
+    {
+        DBG_ASSERT(m_cActive == 0);
+        DBG_ASSERT(IsListEmpty(&m_waiterList));
+
+        if (m_pTimerWheel != NULL)
+        {
+            m_pTimerWheel->CancelAndWait(&m_evictionTimer);
+            m_pTimerWheel->Cancel(&m_evictionTimer);
+        }
+        DeleteConnections(&m_idleList);
+    }
+
+    DWORD
+    EvictionPeriod() const
+    {
+        return max(m_dwIdleTimeoutMs / 2, static_cast<DWORD>(1));
+    }
+
+    //
+    // With the lock held: S_OK with an idle connection in *ppConnection,
+    // S_FALSE with a slot taken to connect without the lock, ERROR_BUSY at
+    // the cap. Idle connections the backend closed go to pStaleList.
+    //
+    HRESULT
+    TakeLocked(
+        _Inout_ LIST_ENTRY *            pStaleList,
+        _Outptr_ POOLED_CONNECTION **   ppConnection,
+        _Out_ BOOL *                    pfReused
+    )
+    {
+        POOLED_CONNECTION * pConnection;
+
+        *ppConnection = NULL;
+        *pfReused = FALSE;
+
+        if (m_fShutdown)
+        {
+            return HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED);
+        }
+
+        while (!IsListEmpty(&m_idleList))
+        {
+            pConnection = CONTAINING_RECORD(RemoveHeadList(&m_idleList), POOLED_CONNECTION, listEntry);
+            m_cIdle--;
+
+            if (pConnection->connection.IsIdleAlive())
+            {
+                m_cActive++;
+                m_cReused++;
+                *ppConnection = pConnection;
+                *pfReused = TRUE;
+                return S_OK;
+            }
+
+            InsertTailList(pStaleList, &pConnection->listEntry);
+            m_cStale++;
+        }
+
+        if (m_cMaxConnections == 0 || m_cIdle + m_cActive < m_cMaxConnections)
+        {
+            m_cActive++;
+            return S_FALSE;
+        }
+
+        return HRESULT_FROM_WIN32(ERROR_BUSY);
+    }
+
+    //
+    // With the lock held, gives back the slot of *ppConnection, or of a
+    // connection not kept when it is NULL. The first request queued by
+    // AcquireAsync takes both, and is returned to be called back once the
+    // lock is released. Otherwise the connection goes idle unless the pool
+    // is shut down, *ppConnection is NULL when it was kept.
+    //
+    POOL_WAITER *
+    PutBackLocked(
+        _Inout_ POOLED_CONNECTION **    ppConnection,
+        ULONGLONG                       ullNow
+    )
+    {
+        POOL_WAITER *pWaiter;
+
+        if (!IsListEmpty(&m_waiterList))
+        {
+            pWaiter = CONTAINING_RECORD(RemoveHeadList(&m_waiterList), POOL_WAITER, listEntry);
+            pWaiter->fQueued = FALSE;
+            pWaiter->hr = S_OK;
+            pWaiter->pConnection = *ppConnection;
+            if (*ppConnection != NULL)
+            {
+                m_cReused++;
+            }
+            *ppConnection = NULL;
+            return pWaiter;
+        }
+
+        m_cActive--;
+        if (*ppConnection != NULL && !m_fShutdown)
+        {
+            (*ppConnection)->ullIdleSince = ullNow;
+            InsertHeadList(&m_idleList, &(*ppConnection)->listEntry);
+            m_cIdle++;
+            *ppConnection = NULL;
+        }
+        return NULL;
+    }
+
+    //
+    // Calls back the waiter PutBackLocked handed the slot to, or wakes a
+    // request blocked in Acquire.
+    //
+    VOID
+    NotifyPutBack(
+        _In_opt_ POOL_WAITER *  pWaiter
+    )
+    {
+        if (pWaiter != NULL)
+        {
+            InitializeListHead(&pWaiter->listEntry);
+            pWaiter->pfnCallback(pWaiter->pvContext);
+        }
+        else
+        {
+            WakeConditionVariable(&m_connectionReleased);
+        }
+    }
+
+    //
+    // Gives back a slot whose connect failed.
+    //
+    VOID
+    ReleaseSlot()
+    {
+        POOLED_CONNECTION * pConnection = NULL;
+        POOL_WAITER *       pWaiter;
+
+        AcquireSRWLockExclusive(&m_srwLock);
+        pWaiter = PutBackLocked(&pConnection, 0);
+        ReleaseSRWLockExclusive(&m_srwLock);
+
+        NotifyPutBack(pWaiter);
+    }
+
+    //
+    // Connects in a slot taken by TakeLocked or handed to a waiter.
+    //
+    HRESULT
+    ConnectSlot(
+        _Outptr_ POOLED_CONNECTION **   ppConnection
+    )
+    {
+        HRESULT hr;
+
+        if (FAILED(hr = Connect(ppConnection)))
+        {
+            ReleaseSlot();
+        }
+        return hr;
+    }
+
+    HRESULT
+    Connect(
+        _Outptr_ POOLED_CONNECTION **   ppConnection
+    )
+    {
+        HRESULT             hr;
+        POOLED_CONNECTION * pConnection;
+
+        *ppConnection = NULL;
+
+        pConnection = new POOLED_CONNECTION;
+        if (pConnection == NULL)
+        {
+            return E_OUTOFMEMORY;
+        }
+        InitializeListHead(&pConnection->listEntry);
+        pConnection->ullIdleSince = 0;
+
+        hr = pConnection->connection.Connect(m_transport,
+                                             m_transport == LOCAL_TRANSPORT_UNIX_SOCKET ? m_szPath : NULL,
+                                             m_usPort,
+                                             m_dwTimeoutMs,
+                                             m_cbMaxHead);
+        if (FAILED(hr))
+        {
+            InterlockedIncrement64(reinterpret_cast<LONGLONG *>(&m_cConnectFailures));
+            delete pConnection;
+            return hr;
+        }
+
+        InterlockedIncrement64(reinterpret_cast<LONGLONG *>(&m_cConnects));
+        *ppConnection = pConnection;
+        return S_OK;
+    }
+
+    static
+    VOID
+    DeleteConnections(
+        _In_ LIST_ENTRY *   pListHead
+    )
+    {
+        while (!IsListEmpty(pListHead))
+        {
+            delete CONTAINING_RECORD(RemoveHeadList(pListHead), POOLED_CONNECTION, listEntry);
+        }
+    }
+
+    static
+    VOID
+    EvictionTimerCallback(
+        PVOID       pvContext
+    )
+    {
+        BACKEND_CONNECTION_POOL *   pPool = static_cast<BACKEND_CONNECTION_POOL *>(pvContext);
+        ULONGLONG                   ullNow = GetTickCount64();
+        BOOL                        fShutdown;
+        BOOL                        fBelowMinIdle;
+
+        pPool->EvictIdle(ullNow);
+
+        AcquireSRWLockShared(&pPool->m_srwLock);
+        fShutdown = pPool->m_fShutdown;
+        fBelowMinIdle = pPool->m_cIdle < pPool->m_cMinIdle;
+        ReleaseSRWLockShared(&pPool->m_srwLock);
+
+        if (fShutdown)
+        {
+            return;
+        }
+
+        //
+        // Connections the backend closed are only found when they are
+        // handed out, so refill after failures and after bursts that took
+        // the idle ones.
+        //
+        if (fBelowMinIdle)
+        {
+            pPool->StartWarmup();
+        }
+
+        pPool->m_pTimerWheel->Arm(&pPool->m_evictionTimer, pPool->EvictionPeriod(), ullNow);
+    }
+
+    static
+    VOID
+    CALLBACK
+    WarmupCallback(
+        PTP_CALLBACK_INSTANCE   Instance,
+        PVOID                   pvContext
+    )
+    {
+        BACKEND_CONNECTION_POOL * pPool = static_cast<BACKEND_CONNECTION_POOL *>(pvContext);
+
+        CallbackMayRunLong(Instance);
+
+        pPool->Warmup();
+        InterlockedExchange(&pPool->m_fWarming, 0);
+        pPool->DereferenceConnectionPool();
+    }
+
+    volatile LONG           m_cRefs;
+
+    LOCAL_TRANSPORT         m_transport;
+    CHAR                    m_szPath[sizeof(sockaddr_un::sun_path)];
+    USHORT                  m_usPort;
+    DWORD                   m_dwTimeoutMs;
+    DWORD                   m_cbMaxHead;
+    DWORD                   m_cMinIdle;
+    DWORD                   m_cMaxConnections;
+    DWORD                   m_dwIdleTimeoutMs;
+    TIMER_WHEEL *           m_pTimerWheel;
+    TIMER_WHEEL_ENTRY       m_evictionTimer;
+    LOCAL_SOCKET_POLLER     m_poller;
+
+    SRWLOCK                 m_srwLock;
+    CONDITION_VARIABLE      m_connectionReleased;
+    LIST_ENTRY              m_idleList;
+    LIST_ENTRY              m_waiterList;
+    BOOL                    m_fShutdown;
+    volatile LONG           m_fWarming;
+    DWORD                   m_cIdle;
+    DWORD                   m_cActive;
+
+    ULONGLONG               m_cConnects;
+    ULONGLONG               m_cConnectFailures;
+    ULONGLONG               m_cReused;
+    ULONGLONG               m_cWarmed;
+    ULONGLONG               m_cEvicted;
+    ULONGLONG               m_cStale;
+    ULONGLONG               m_cDiscarded;
+    ULONGLONG               m_cWaits;
+    ULONGLONG               m_cWaitTimeouts;
+};
@@ -22,6 +22,7 @@ IHttpServer *       g_pHttpServer = NULL;
 HINSTANCE           g_hWinHttpModule;
 HINSTANCE           g_hAspNetCoreModule;
 HANDLE              g_hEventLog = NULL;
+TIMER_WHEEL *       g_pTimerWheel = NULL;
 
 VOID
 InitializeGlobalConfiguration(
@@ -200,6 +201,15 @@ EnsureOutOfProcessInitializtion()
         g_dwTlsIndex = TlsAlloc();
         FINISHED_LAST_ERROR_IF(g_dwTlsIndex == TLS_OUT_OF_INDEXES);
         FINISHED_IF_FAILED(ALLOC_CACHE_HANDLER::StaticInitialize());
+
+        //
+        // Request timeouts and the timers of the backend processes share
+        // one timing wheel.
+        //
+        g_pTimerWheel = new TIMER_WHEEL();
+        FINISHED_IF_NULL_ALLOC(g_pTimerWheel);
+        FINISHED_IF_FAILED(g_pTimerWheel->Initialize());
+
         FINISHED_IF_FAILED(FORWARDING_HANDLER::StaticInitialize(g_fEnableReferenceCountTracing));
         FINISHED_IF_FAILED(WEBSOCKET_HANDLER::StaticInitialize(g_fEnableReferenceCountTracing));
     }
@@ -228,6 +238,11 @@ BOOL APIENTRY DllMain(HMODULE hModule,
     case DLL_PROCESS_DETACH:
         g_fProcessDetach = TRUE;
         FORWARDING_HANDLER::StaticTerminate();
+        if (g_pTimerWheel != NULL)
+        {
+            delete g_pTimerWheel;
+            g_pTimerWheel = NULL;
+        }
         ALLOC_CACHE_HANDLER::StaticTerminate();
         DebugStop();
     default:
@@ -5,22 +5,37 @@
 #include "url_utility.h"
 #include "exceptions.h"
 
-// Just to be aware of the FORWARDING_HANDLER object size.
-C_ASSERT(sizeof(FORWARDING_HANDLER) <= 632);
+// Just to be aware of the FORWARDING_HANDLER object size. Every request,
+// websockets included, pays for it from sm_pAlloc, so larger state belongs
+// in a spill or a pool rather than inline.
+C_ASSERT(sizeof(FORWARDING_HANDLER) <= 1344);
 
 #define DEF_MAX_FORWARDS        32
-#define HEX_TO_ASCII(c) ((CHAR)(((c) < 10) ? ((c) + '0') : ((c) + 'a' - 10)))
 #define BUFFER_SIZE         (8192UL)
-#define ENTITY_BUFFER_SIZE  (6 + BUFFER_SIZE + 2)
+#define ENTITY_BUFFER_SIZE  BUFFER_SIZE
 
 #define FORWARDING_HANDLER_SIGNATURE        ((DWORD)'FHLR')
 #define FORWARDING_HANDLER_SIGNATURE_FREE   ((DWORD)'fhlr')
 
 STRA                        FORWARDING_HANDLER::sm_pStra502ErrorMsg;
 ALLOC_CACHE_HANDLER *       FORWARDING_HANDLER::sm_pAlloc = NULL;
+ALLOC_CACHE_HANDLER *       FORWARDING_HANDLER::sm_pEntityBufferAlloc = NULL;
+SIZE_CLASS_CACHE *          FORWARDING_HANDLER::sm_pSpillCache = NULL;
+ALLOC_CACHE_HANDLER *       FORWARDING_HANDLER::sm_pRequestBodyAlloc = NULL;
 TRACE_LOG *                 FORWARDING_HANDLER::sm_pTraceLog = NULL;
 PROTOCOL_CONFIG             FORWARDING_HANDLER::sm_ProtocolConfig;
-RESPONSE_HEADER_HASH *      FORWARDING_HANDLER::sm_pResponseHeaderHash = NULL;
+REQUEST_PHASE_LATENCY *     FORWARDING_HANDLER::sm_pPhaseLatency = NULL;
+
+static
+PCSTR
+GetRequestHeader(
+    PVOID       pvContext,
+    PCSTR       pszName,
+    USHORT *    pcchValue
+)
+{
+    return static_cast<IHttpRequest *>(pvContext)->GetHeader(pszName, pcchValue);
+}
 
 FORWARDING_HANDLER::FORWARDING_HANDLER(
     _In_ IHttpContext                  *pW3Context,
@@ -38,7 +53,35 @@ FORWARDING_HANDLER::FORWARDING_HANDLER(
     m_BytesToReceive(0),
     m_BytesToSend(0),
     m_fWebSocketEnabled(FALSE),
+    m_cEntityBuffers(0),
+    m_cEntityBuffersOwned(0),
+    m_cBytesBuffered(0),
     m_pWebSocket(NULL),
+    m_pEntityBuffer(NULL),
+    m_pCachedResponse(NULL),
+    m_pCacheWriter(NULL),
+    m_pFlight(NULL),
+    m_flightWaiter(),
+    m_fCoalesced(FALSE),
+    m_fAdmissionChecked(FALSE),
+    m_fAdmitted(FALSE),
+    m_dwRequestTimeoutMs(INFINITE),
+    m_ullTimeoutDeadline(0),
+    m_fRequestTimedOut(FALSE),
+    m_localStep(LOCAL_EXCHANGE_CONNECT),
+    m_localWait(LOCAL_WAIT_NONE),
+    m_fLocalWaitCancelled(FALSE),
+    m_pPooledConnection(NULL),
+    m_pStream(NULL),
+    m_fLocalReused(FALSE),
+    m_fLocalRetried(FALSE),
+    m_fLocalNoBody(FALSE),
+    m_fEndOfRequestBody(FALSE),
+    m_fLocalClientError(FALSE),
+    m_pbLocalSend(NULL),
+    m_cbLocalSend(0),
+    m_pbLocalReceive(NULL),
+    m_phaseClock(sm_pPhaseLatency),
     m_dwHandlers (1), // default http handler
     m_fDoneAsyncCompletion(FALSE),
     m_fHttpHandleInClose(FALSE),
@@ -46,7 +89,9 @@ FORWARDING_HANDLER::FORWARDING_HANDLER(
     m_fServerResetConn(FALSE),
     m_cRefs(1),
     m_pW3Context(pW3Context),
-    m_pApplication(pApplication)
+    m_pApplication(pApplication),
+    m_pServerProcess(NULL),
+    m_fOutstanding(FALSE)
 {
 #ifdef DEBUG
     DebugPrintf(ASPNETCORE_DEBUG_FLAG_INFO,
@@ -55,6 +100,14 @@ FORWARDING_HANDLER::FORWARDING_HANDLER(
 
     m_fWebSocketSupported = m_pApplication->QueryWebsocketStatus();
     InitializeSRWLock(&m_RequestLock);
+    TIMER_WHEEL::InitializeEntry(&m_timeoutEntry, RequestTimeoutCallback, this);
+    ADMISSION_LIMITER::InitializeWaiter(&m_admissionWaiter, AdmissionCompletionCallback, this);
+    BACKEND_CONNECTION_POOL::InitializeWaiter(&m_poolWaiter, LocalWaitCallback, this);
+    LOCAL_SOCKET_POLLER::InitializeWait(&m_socketWait, LocalWaitCallback, this);
+
+    m_bufHeaders.SetSpillAllocator(sm_pSpillCache);
+    m_buffEntityBuffers.SetSpillAllocator(sm_pSpillCache);
+    m_straLocalRequest.SetSpillAllocator(sm_pSpillCache);
 }
 
 FORWARDING_HANDLER::~FORWARDING_HANDLER(
@@ -65,6 +118,11 @@ FORWARDING_HANDLER::~FORWARDING_HANDLER(
     //
     m_Signature = FORWARDING_HANDLER_SIGNATURE_FREE;
 
+    //
+    // An armed timeout holds a reference.
+    //
+    DBG_ASSERT(!m_timeoutEntry.fArmed);
+
 #ifdef DEBUG
     DebugPrintf(ASPNETCORE_DEBUG_FLAG_INFO,
         "FORWARDING_HANDLER::~FORWARDING_HANDLER");
@@ -82,13 +140,38 @@ FORWARDING_HANDLER::~FORWARDING_HANDLER(
 
     RemoveRequest();
 
-    FreeResponseBuffers();
+    ReleaseResponseBuffers();
+
+    ReleaseRequestBody();
+
+    ReleaseResponseCapture();
+
+    ReleaseAdmission();
+
+    if (m_pCachedResponse != NULL)
+    {
+        m_pCachedResponse->DereferenceCacheEntry();
+        m_pCachedResponse = NULL;
+    }
+
+    if (m_flightWaiter.pEntry != NULL)
+    {
+        m_flightWaiter.pEntry->DereferenceCacheEntry();
+        m_flightWaiter.pEntry = NULL;
+    }
 
     if (m_pWebSocket)
     {
         m_pWebSocket->Terminate();
         m_pWebSocket = NULL;
     }
+
+    if (m_pServerProcess != NULL)
+    {
+        ReleaseOutstandingRequest();
+        m_pServerProcess->DereferenceServerProcess();
+        m_pServerProcess = NULL;
+    }
 }
 
 __override
@@ -100,7 +183,6 @@ FORWARDING_HANDLER::OnExecuteRequestHandler()
     BOOL                        fRequestLocked = FALSE;
     BOOL                        fHandleSet = FALSE;
     BOOL                        fFailedToStartKestrel = FALSE;
-    BOOL                        fSecure = FALSE;
     HINTERNET                   hConnect = NULL;
     IHttpRequest               *pRequest = m_pW3Context->GetRequest();
     IHttpResponse              *pResponse = m_pW3Context->GetResponse();
@@ -108,11 +190,10 @@ FORWARDING_HANDLER::OnExecuteRequestHandler()
     OUT_OF_PROCESS_APPLICATION *pApplication = NULL;
     PROTOCOL_CONFIG            *pProtocol = &sm_ProtocolConfig;
     SERVER_PROCESS             *pServerProcess = NULL;
+    BOOL                        fWebSocketUpgrade = FALSE;
 
     USHORT                      cchHostName = 0;
 
-    STACK_STRU(strDestination, 32);
-    STACK_STRU(strUrl, 2048);
     STACK_STRU(struEscapedUrl, 2048);
 
     //
@@ -140,6 +221,66 @@ FORWARDING_HANDLER::OnExecuteRequestHandler()
         goto Failure;
     }
 
+    //
+    // A request coming back from the admission queue has been through the
+    // response cache already.
+    //
+    if (pApplication->QueryResponseCache() != NULL && !m_fAdmissionChecked)
+    {
+        BOOL fServed = FALSE;
+        BOOL fWaiting = FALSE;
+
+        hr = ServeFromResponseCache(pApplication->QueryResponseCache(),
+                                    pApplication->QueryRequestCoalescer(),
+                                    &fServed,
+                                    &fWaiting);
+        if (FAILED_LOG(hr))
+        {
+            goto Failure;
+        }
+
+        if (fWaiting)
+        {
+            //
+            // Parked on an identical request, FlightCompletionCallback
+            // resumes this one once that has its response or timed out.
+            //
+            retVal = RQ_NOTIFICATION_PENDING;
+            goto Finished;
+        }
+
+        if (fServed)
+        {
+            //
+            // No backend involved, the response goes out with the request.
+            //
+            m_RequestStatus = FORWARDER_DONE;
+            retVal = RQ_NOTIFICATION_CONTINUE;
+            goto Finished;
+        }
+    }
+
+    if (pApplication->QueryAdmissionLimiter() != NULL && !m_fAdmissionChecked)
+    {
+        switch (EnterAdmissionQueue(pApplication->QueryAdmissionLimiter()))
+        {
+        case ADMISSION_QUEUED:
+            //
+            // AdmissionCompletionCallback resumes the request once it has
+            // a slot or has waited for the queue timeout.
+            //
+            retVal = RQ_NOTIFICATION_PENDING;
+            goto Finished;
+
+        case ADMISSION_REJECTED:
+            hr = HRESULT_FROM_WIN32(ERROR_BUSY);
+            goto Failure;
+
+        default:
+            break;
+        }
+    }
+
     hr = pApplication->GetProcess(&pServerProcess);
     if (FAILED_LOG(hr))
     {
@@ -154,25 +295,19 @@ FORWARDING_HANDLER::OnExecuteRequestHandler()
         goto Failure;
     }
 
-    if (pServerProcess->QueryWinHttpConnection() == NULL)
+    if (pServerProcess->QueryWinHttpConnection() == NULL &&
+        pServerProcess->QueryConnectionPool() == NULL)
     {
         hr = HRESULT_FROM_WIN32(ERROR_INVALID_HANDLE);
         goto Failure;
     }
 
-    hConnect = pServerProcess->QueryWinHttpConnection()->QueryHandle();
+    pServerProcess->ReferenceServerProcess();
+    pServerProcess->IncrementOutstandingRequests();
+    m_pServerProcess = pServerProcess;
+    m_fOutstanding = TRUE;
 
     m_pszOriginalHostHeader = pRequest->GetHeader(HttpHeaderHost, &cchHostName);
-    //
-    // parse original url
-    //
-    if (FAILED_LOG(hr = URL_UTILITY::SplitUrl(pRequest->GetRawHttpRequest()->CookedUrl.pFullUrl,
-        &fSecure,
-        &strDestination,
-        &strUrl)))
-    {
-        goto Failure;
-    }
 
     if (FAILED_LOG(hr = URL_UTILITY::EscapeAbsPath(pRequest, &struEscapedUrl)))
     {
@@ -192,20 +327,10 @@ FORWARDING_HANDLER::OnExecuteRequestHandler()
         PCSTR pszWebSocketHeader = pRequest->GetHeader("Upgrade", &cchHeader);
         if (cchHeader == 9 && _stricmp(pszWebSocketHeader, "websocket") == 0)
         {
-            m_fWebSocketEnabled = TRUE;
+            fWebSocketUpgrade = TRUE;
         }
     }
 
-    hr = CreateWinHttpRequest(pRequest,
-        pProtocol,
-        hConnect,
-        &struEscapedUrl,
-        pServerProcess);
-    if (FAILED_LOG(hr))
-    {
-        goto Failure;
-    }
-
     // Set client disconnect callback contract with IIS
     m_pDisconnect = static_cast<ASYNC_DISCONNECT_CONTEXT *>(
         pClientConnection->GetModuleContextContainer()->
@@ -232,6 +357,42 @@ FORWARDING_HANDLER::OnExecuteRequestHandler()
     m_pDisconnect->SetHandler(this);
     fHandleSet = TRUE;
 
+    if (pServerProcess->QueryConnectionPool() != NULL &&
+        (!fWebSocketUpgrade || pServerProcess->QueryWinHttpConnection() == NULL))
+    {
+        //
+        // Pooled connections or h2c streams, or a Unix domain socket which
+        // WinHTTP cannot reach. WebSocket upgrades are not relayed over
+        // them: over TCP they stay on WinHTTP, over a socket an upgrade
+        // goes as a plain request.
+        //
+        hr = StartLocalExchange(pProtocol, &struEscapedUrl);
+        if (FAILED_LOG(hr))
+        {
+            goto Failure;
+        }
+
+        //
+        // The exchange goes as far as it can without blocking, the
+        // completions posted by what it waits for resume it.
+        //
+        retVal = OnLocalExchangeCompletion(0, S_OK);
+        goto Finished;
+    }
+
+    hConnect = pServerProcess->QueryWinHttpConnection()->QueryHandle();
+    m_fWebSocketEnabled = fWebSocketUpgrade;
+
+    hr = CreateWinHttpRequest(pRequest,
+        pProtocol,
+        hConnect,
+        &struEscapedUrl,
+        pServerProcess);
+    if (FAILED_LOG(hr))
+    {
+        goto Failure;
+    }
+
     // require lock as client disconnect callback may happen
     AcquireSRWLockShared(&m_RequestLock);
     fRequestLocked = TRUE;
@@ -300,6 +461,14 @@ FORWARDING_HANDLER::OnExecuteRequestHandler()
             NULL);
     }
 
+    ArmRequestTimeout();
+
+    //
+    // WinHTTP takes a connection from its pool or opens one before it
+    // reports that the request is being sent.
+    //
+    m_phaseClock.Start(REQUEST_PHASE_CONNECT);
+
     if (!WinHttpSendRequest(m_hRequest,
         m_pszHeaders,
         m_cchHeaders,
@@ -334,6 +503,9 @@ FORWARDING_HANDLER::OnExecuteRequestHandler()
 
 Failure:
     m_RequestStatus = FORWARDER_DONE;
+    CancelRequestTimeout();
+    ReleaseAdmission();
+    ReleaseOutstandingRequest();
 
     //disable client disconnect callback
     RemoveRequest();
@@ -344,8 +516,12 @@ Failure:
     {
         pResponse->SetStatus(400, "Bad Request", 0, hr);
     }
-    else if (hr == E_APPLICATION_EXITING)
+    else if (hr == E_APPLICATION_EXITING || hr == HRESULT_FROM_WIN32(ERROR_BUSY))
     {
+        //
+        // Shed, the requests waiting on this one are forwarded on their own.
+        //
+        ReleaseResponseCapture();
         pResponse->SetStatus(503, "Service Unavailable", 0, S_OK, nullptr, TRUE);
     }
     else if (fFailedToStartKestrel && !m_pApplication->QueryConfig()->QueryDisableStartUpErrorPage())
@@ -426,6 +602,28 @@ REQUEST_NOTIFICATION_STATUS
     DBG_ASSERT(m_pW3Context != NULL);
     __analysis_assume(m_pW3Context != NULL);
 
+    if (m_RequestStatus == FORWARDER_WAITING_FOR_FLIGHT)
+    {
+        //
+        // No WinHTTP handle exists yet, nothing to lock.
+        //
+        return OnFlightCompletion();
+    }
+
+    if (m_RequestStatus == FORWARDER_WAITING_FOR_ADMISSION)
+    {
+        return OnAdmissionCompletion();
+    }
+
+    if (m_RequestStatus == FORWARDER_LOCAL_EXCHANGE)
+    {
+        //
+        // The exchange takes the lock itself, and resumes from the step it
+        // waited in.
+        //
+        return OnLocalExchangeCompletion(cbCompletion, hrCompletionStatus);
+    }
+
     //
     // Take a reference so that object does not go away as a result of
     // async completion.
@@ -474,7 +672,12 @@ REQUEST_NOTIFICATION_STATUS
             goto Failure;
         }
 
-        hr = m_pWebSocket->ProcessRequest(this, m_pW3Context, m_hRequest, &fWebSocketUpgraded);
+        hr = m_pWebSocket->ProcessRequest(this,
+                                          m_pW3Context,
+                                          m_hRequest,
+                                          m_pApplication->QueryConfig()->QueryWebSocketMaxBufferSize(),
+                                          m_pApplication->QueryConfig()->QueryWebSocketHibernation(),
+                                          &fWebSocketUpgraded);
         if (fWebSocketUpgraded)
         {
             // WinHttp WebSocket handle has been created, bump the counter so that remember to close it
@@ -506,6 +709,11 @@ REQUEST_NOTIFICATION_STATUS
         goto Finished;
     }
 
+    //
+    // A flush to the client has completed, if one was in progress.
+    //
+    m_phaseClock.StopClientWrite();
+
     //
     // Begins normal completion handling. There is already an exclusive acquired lock
     // for protecting the WinHTTP request handle from being closed.
@@ -580,6 +788,8 @@ Failure:
     // Reset status for consistency.
     //
     m_RequestStatus = FORWARDER_DONE;
+    CancelRequestTimeout();
+    ReleaseOutstandingRequest();
     if (!m_fHasError)
     {
         m_fHasError = TRUE;
@@ -740,14 +950,77 @@ HRESULT
         goto Finished;
     }
 
-    sm_pResponseHeaderHash = new RESPONSE_HEADER_HASH;
-    if (sm_pResponseHeaderHash == NULL)
+    //
+    // Every entity buffer has the same size, so a fixed-size per-CPU
+    // cache serves them without touching the heap once warmed up.
+    //
+    sm_pEntityBufferAlloc = new ALLOC_CACHE_HANDLER;
+    if (sm_pEntityBufferAlloc == NULL)
+    {
+        hr = E_OUTOFMEMORY;
+        goto Finished;
+    }
+
+    hr = sm_pEntityBufferAlloc->Initialize(ENTITY_BUFFER_SIZE,
+                                           32); // nThreshold
+    if (FAILED_LOG(hr))
+    {
+        goto Finished;
+    }
+
+    //
+    // Request bodies are batched in larger buffers, one per request that
+    // has a body, held only while the body is being sent.
+    //
+    sm_pRequestBodyAlloc = new ALLOC_CACHE_HANDLER;
+    if (sm_pRequestBodyAlloc == NULL)
+    {
+        hr = E_OUTOFMEMORY;
+        goto Finished;
+    }
+
+    hr = sm_pRequestBodyAlloc->Initialize(REQUEST_BODY_BATCH::BUFFER_SIZE,
+                                          8); // nThreshold
+    if (FAILED_LOG(hr))
+    {
+        goto Finished;
+    }
+
+    //
+    // The phase histograms of every forwarded request, per processor.
+    //
+    sm_pPhaseLatency = new REQUEST_PHASE_LATENCY;
+    if (sm_pPhaseLatency == NULL)
+    {
+        hr = E_OUTOFMEMORY;
+        goto Finished;
+    }
+
+    hr = sm_pPhaseLatency->Initialize();
+    if (FAILED_LOG(hr))
+    {
+        goto Finished;
+    }
+
+    //
+    // The buffers of each request that outgrow their inline storage spill
+    // to size classes instead of the process heap.
+    //
+    sm_pSpillCache = new SIZE_CLASS_CACHE;
+    if (sm_pSpillCache == NULL)
     {
         hr = E_OUTOFMEMORY;
         goto Finished;
     }
 
-    hr = sm_pResponseHeaderHash->Initialize();
+    hr = sm_pSpillCache->Initialize(32,     // nMagazineDepth
+                                    1024);  // nDepotDepth
+    if (FAILED_LOG(hr))
+    {
+        goto Finished;
+    }
+
+    hr = sm_pSpillCache->StartTrimTimer(30000);
     if (FAILED_LOG(hr))
     {
         goto Finished;
@@ -804,13 +1077,6 @@ FORWARDING_HANDLER::StaticTerminate()
 {
     sm_pStra502ErrorMsg.Reset();
 
-    if (sm_pResponseHeaderHash != NULL)
-    {
-        sm_pResponseHeaderHash->Clear();
-        delete sm_pResponseHeaderHash;
-        sm_pResponseHeaderHash = NULL;
-    }
-
     if (sm_pTraceLog != NULL)
     {
         DestroyRefTraceLog(sm_pTraceLog);
@@ -822,6 +1088,99 @@ FORWARDING_HANDLER::StaticTerminate()
         delete sm_pAlloc;
         sm_pAlloc = NULL;
     }
+
+    if (sm_pEntityBufferAlloc != NULL)
+    {
+        ALLOC_CACHE_COUNTERS counters;
+
+        //
+        // What the entity buffer cache threshold is sized from.
+        //
+        sm_pEntityBufferAlloc->QueryCounters(&counters);
+        DebugPrintf(ASPNETCORE_DEBUG_FLAG_INFO,
+            "Entity buffers: %I64u cache hits, %I64u cache misses, %I64u released to the heap",
+            counters.cHits,
+            counters.cMisses,
+            counters.cReleased);
+
+        delete sm_pEntityBufferAlloc;
+        sm_pEntityBufferAlloc = NULL;
+    }
+
+    if (sm_pRequestBodyAlloc != NULL)
+    {
+        delete sm_pRequestBodyAlloc;
+        sm_pRequestBodyAlloc = NULL;
+    }
+
+    if (sm_pPhaseLatency != NULL)
+    {
+        sm_pPhaseLatency->Dump();
+        delete sm_pPhaseLatency;
+        sm_pPhaseLatency = NULL;
+    }
+
+    if (sm_pSpillCache != NULL)
+    {
+        SIZE_CLASS_CACHE_COUNTERS counters;
+
+        //
+        // Only the buffers of requests spill to it, and every request is
+        // gone by now.
+        //
+        sm_pSpillCache->StopTrimTimer();
+
+        sm_pSpillCache->QueryCounters(&counters);
+        DebugPrintf(ASPNETCORE_DEBUG_FLAG_INFO,
+            "SIZE_CLASS_CACHE spills: %I64u allocs, %I64u magazine hits, %I64u depot hits, %I64u heap allocs, %I64u trimmed",
+            counters.cAllocs,
+            counters.cMagazineHits,
+            counters.cDepotHits,
+            counters.cHeapAllocs,
+            counters.cTrimmed);
+
+        delete sm_pSpillCache;
+        sm_pSpillCache = NULL;
+    }
+}
+
+// static
+VOID
+FORWARDING_HANDLER::QueryEntityBufferCounters(
+    _Out_ ALLOC_CACHE_COUNTERS *    pCounters
+)
+{
+    ZeroMemory(pCounters, sizeof(*pCounters));
+    if (sm_pEntityBufferAlloc != NULL)
+    {
+        sm_pEntityBufferAlloc->QueryCounters(pCounters);
+    }
+}
+
+// static
+VOID
+FORWARDING_HANDLER::QuerySpillCacheCounters(
+    _Out_ SIZE_CLASS_CACHE_COUNTERS *   pCounters
+)
+{
+    ZeroMemory(pCounters, sizeof(*pCounters));
+    if (sm_pSpillCache != NULL)
+    {
+        sm_pSpillCache->QueryCounters(pCounters);
+    }
+}
+
+// static
+VOID
+FORWARDING_HANDLER::QueryPhaseLatencyCounters(
+    _Out_ REQUEST_PHASE_LATENCY_COUNTERS *  pCounters
+)
+{
+    ZeroMemory(pCounters, sizeof(*pCounters));
+    if (sm_pPhaseLatency != NULL)
+    {
+        sm_pPhaseLatency->QueryCounters(pCounters);
+    }
 }
 
 // static
@@ -855,19 +1214,10 @@ FORWARDING_HANDLER::GetHeaders(
 )
 {
     HRESULT hr = S_OK;
-    PCSTR pszCurrentHeader;
-    PCSTR ppHeadersToBeRemoved;
-    PCSTR pszFinalHeader;
-    USHORT cchCurrentHeader;
-    DWORD cchFinalHeader;
-    BOOL  fSecure = FALSE;  // dummy. Used in SplitUrl. Value will not be used
-                            // as ANCM always use http protocol to communicate with backend
-    STRU  struDestination;
-    STRU  struUrl;
-    STACK_STRA(strTemp, 64);
-    HTTP_REQUEST_HEADERS *pHeaders;
+    FORWARDED_HEADER_VALUES values = {};
+    CHAR pszHandleStr[16] = { 0 };
     IHttpRequest *pRequest = m_pW3Context->GetRequest();
-    MULTISZA mszMsAspNetCoreHeaders;
+    const HTTP_REQUEST *pRawRequest = pRequest->GetRawHttpRequest();
 
     //
     // We historically set the host section in request url to the new host header
@@ -876,57 +1226,13 @@ FORWARDING_HANDLER::GetHeaders(
     //
     if (!pProtocol->QueryPreserveHostHeader())
     {
-        if (FAILED_LOG(hr = URL_UTILITY::SplitUrl(pRequest->GetRawHttpRequest()->CookedUrl.pFullUrl,
-            &fSecure,
-            &struDestination,
-            &struUrl)) ||
-            FAILED_LOG(hr = strTemp.CopyW(struDestination.QueryStr())) ||
-            FAILED_LOG(hr = pRequest->SetHeader(HttpHeaderHost,
-                strTemp.QueryStr(),
-                static_cast<USHORT>(strTemp.QueryCCH()),
-                TRUE))) // fReplace
-        {
-            return hr;
-        }
-    }
-    //
-    // Strip all headers starting with MS-ASPNETCORE.
-    // These headers are generated by the asp.net core module and
-    // passed to the process it creates.
-    //
-
-    pHeaders = &m_pW3Context->GetRequest()->GetRawHttpRequest()->Headers;
-    for (DWORD i = 0; i<pHeaders->UnknownHeaderCount; i++)
-    {
-        if (_strnicmp(pHeaders->pUnknownHeaders[i].pName, "MS-ASPNETCORE", 13) == 0)
-        {
-            mszMsAspNetCoreHeaders.Append(pHeaders->pUnknownHeaders[i].pName, (DWORD)pHeaders->pUnknownHeaders[i].NameLength);
-        }
-    }
-
-    ppHeadersToBeRemoved = mszMsAspNetCoreHeaders.First();
-
-    //
-    // iterate the list of headers to be removed and delete them from the request.
-    //
-
-    while (ppHeadersToBeRemoved != NULL)
-    {
-        m_pW3Context->GetRequest()->DeleteHeader(ppHeadersToBeRemoved);
-        ppHeadersToBeRemoved = mszMsAspNetCoreHeaders.Next(ppHeadersToBeRemoved);
+        values.pszHost = pRawRequest->CookedUrl.pHost;
+        values.cchHost = (pRawRequest->CookedUrl.pAbsPath != NULL) ?
+            static_cast<DWORD>(pRawRequest->CookedUrl.pAbsPath - pRawRequest->CookedUrl.pHost) :
+            pRawRequest->CookedUrl.HostLength / sizeof(WCHAR);
     }
 
-    if (pServerProcess->QueryGuid() != NULL)
-    {
-        hr = m_pW3Context->GetRequest()->SetHeader("MS-ASPNETCORE-TOKEN",
-            pServerProcess->QueryGuid(),
-            (USHORT)strlen(pServerProcess->QueryGuid()),
-            TRUE);
-        if (FAILED_LOG(hr))
-        {
-            return hr;
-        }
-    }
+    values.pszToken = pServerProcess->QueryGuid();
 
     if (fForwardWindowsAuthToken &&
         (_wcsicmp(m_pW3Context->GetUser()->GetAuthenticationType(), L"negotiate") == 0 ||
@@ -946,176 +1252,75 @@ FORWARDING_HANDLER::GetHeaders(
             //
             // set request header with target token value
             //
-            CHAR pszHandleStr[16] = { 0 };
             if (_ui64toa_s((UINT64)hTargetTokenHandle, pszHandleStr, 16, 16) != 0)
             {
                 hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
                 return hr;
             }
 
-            hr = m_pW3Context->GetRequest()->SetHeader("MS-ASPNETCORE-WINAUTHTOKEN",
-                pszHandleStr,
-                (USHORT)strlen(pszHandleStr),
-                TRUE);
-            if (FAILED_LOG(hr))
-            {
-                return hr;
-            }
+            values.pszWinAuthToken = pszHandleStr;
         }
     }
 
     if (!pProtocol->QueryXForwardedForName()->IsEmpty())
     {
-        strTemp.Reset();
-
-        pszCurrentHeader = pRequest->GetHeader(pProtocol->QueryXForwardedForName()->QueryStr(), &cchCurrentHeader);
-        if (pszCurrentHeader != NULL)
-        {
-            if (FAILED_LOG(hr = strTemp.Copy(pszCurrentHeader, cchCurrentHeader)) ||
-                FAILED_LOG(hr = strTemp.Append(", ", 2)))
-            {
-                return hr;
-            }
-        }
+        values.pszXForwardedForName = pProtocol->QueryXForwardedForName()->QueryStr();
+        values.fRemoteAddressIPv6 = pRawRequest->Address.pRemoteAddress->sa_family == AF_INET6;
 
         if (FAILED_LOG(hr = m_pW3Context->GetServerVariable("REMOTE_ADDR",
-            &pszFinalHeader,
-            &cchFinalHeader)))
+            &values.pszRemoteAddress,
+            &values.cchRemoteAddress)))
         {
             return hr;
         }
 
-        if (pRequest->GetRawHttpRequest()->Address.pRemoteAddress->sa_family == AF_INET6)
-        {
-            if (FAILED_LOG(hr = strTemp.Append("[", 1)) ||
-                FAILED_LOG(hr = strTemp.Append(pszFinalHeader, cchFinalHeader)) ||
-                FAILED_LOG(hr = strTemp.Append("]", 1)))
-            {
-                return hr;
-            }
-        }
-        else
+        if (pProtocol->QueryIncludePortInXForwardedFor())
         {
-            if (FAILED_LOG(hr = strTemp.Append(pszFinalHeader, cchFinalHeader)))
+            if (FAILED_LOG(hr = m_pW3Context->GetServerVariable("REMOTE_PORT",
+                &values.pszRemotePort,
+                &values.cchRemotePort)))
             {
                 return hr;
             }
         }
-
-        if (pProtocol->QueryIncludePortInXForwardedFor())
-        {
-            if (FAILED_LOG(hr = m_pW3Context->GetServerVariable("REMOTE_PORT",
-                &pszFinalHeader,
-                &cchFinalHeader)))
-            {
-                return hr;
-            }
-
-            if (FAILED_LOG(hr = strTemp.Append(":", 1)) ||
-                FAILED_LOG(hr = strTemp.Append(pszFinalHeader, cchFinalHeader)))
-            {
-                return hr;
-            }
-        }
-
-        if (FAILED_LOG(hr = pRequest->SetHeader(pProtocol->QueryXForwardedForName()->QueryStr(),
-            strTemp.QueryStr(),
-            static_cast<USHORT>(strTemp.QueryCCH()),
-            TRUE))) // fReplace
-        {
-            return hr;
-        }
-    }
+    }
 
     if (!pProtocol->QuerySslHeaderName()->IsEmpty())
     {
-        const HTTP_SSL_INFO *pSslInfo = pRequest->GetRawHttpRequest()->pSslInfo;
-        LPSTR pszScheme = "http";
-        if (pSslInfo != NULL)
-        {
-            pszScheme = "https";
-        }
-
-        strTemp.Reset();
-
-        pszCurrentHeader = pRequest->GetHeader(pProtocol->QuerySslHeaderName()->QueryStr(), &cchCurrentHeader);
-        if (pszCurrentHeader != NULL)
-        {
-            if (FAILED_LOG(hr = strTemp.Copy(pszCurrentHeader, cchCurrentHeader)) ||
-                FAILED_LOG(hr = strTemp.Append(", ", 2)))
-            {
-                return hr;
-            }
-        }
-
-        if (FAILED_LOG(hr = strTemp.Append(pszScheme)))
-        {
-            return hr;
-        }
-
-        if (FAILED_LOG(pRequest->SetHeader(pProtocol->QuerySslHeaderName()->QueryStr(),
-            strTemp.QueryStr(),
-            (USHORT)strTemp.QueryCCH(),
-            TRUE)))
-        {
-            return hr;
-        }
+        values.pszSslHeaderName = pProtocol->QuerySslHeaderName()->QueryStr();
+        values.pszScheme = (pRawRequest->pSslInfo != NULL) ? "https" : "http";
     }
 
     if (!pProtocol->QueryClientCertName()->IsEmpty())
     {
-        if (pRequest->GetRawHttpRequest()->pSslInfo == NULL ||
-            pRequest->GetRawHttpRequest()->pSslInfo->pClientCertInfo == NULL)
-        {
-            pRequest->DeleteHeader(pProtocol->QueryClientCertName()->QueryStr());
-        }
-        else
+        values.pszClientCertName = pProtocol->QueryClientCertName()->QueryStr();
+        if (pRawRequest->pSslInfo != NULL &&
+            pRawRequest->pSslInfo->pClientCertInfo != NULL)
         {
-            // Resize the buffer large enough to hold the encoded certificate info
-            if (FAILED_LOG(hr = strTemp.Resize(
-                1 + (pRequest->GetRawHttpRequest()->pSslInfo->pClientCertInfo->CertEncodedSize + 2) / 3 * 4)))
-            {
-                return hr;
-            }
-
-            Base64Encode(
-                pRequest->GetRawHttpRequest()->pSslInfo->pClientCertInfo->pCertEncoded,
-                pRequest->GetRawHttpRequest()->pSslInfo->pClientCertInfo->CertEncodedSize,
-                strTemp.QueryStr(),
-                strTemp.QuerySize(),
-                NULL);
-            strTemp.SyncWithBuffer();
-
-            if (FAILED_LOG(hr = pRequest->SetHeader(
-                pProtocol->QueryClientCertName()->QueryStr(),
-                strTemp.QueryStr(),
-                static_cast<USHORT>(strTemp.QueryCCH()),
-                TRUE))) // fReplace
-            {
-                return hr;
-            }
+            values.pbClientCert = pRawRequest->pSslInfo->pClientCertInfo->pCertEncoded;
+            values.cbClientCert = pRawRequest->pSslInfo->pClientCertInfo->CertEncodedSize;
         }
     }
 
     //
     // Remove the connection header
     //
-    if (!m_fWebSocketEnabled)
-    {
-        pRequest->DeleteHeader(HttpHeaderConnection);
-    }
+    values.fRemoveConnection = !m_fWebSocketEnabled;
 
     //
-    // Get all the headers to send to the client
+    // Write all the headers to send to the backend in one pass, the
+    // request itself is left as the client sent it.
     //
-    hr = m_pW3Context->GetServerVariable("ALL_RAW",
-        ppszHeaders,
-        pcchHeaders);
-    if (FAILED_LOG(hr))
+    if (FAILED_LOG(hr = REQUEST_HEADER_BUILDER::Build(&pRawRequest->Headers,
+        values,
+        &m_bufHeaders,
+        pcchHeaders)))
     {
         return hr;
     }
 
+    *ppszHeaders = m_bufHeaders.QueryPtr();
+
     return S_OK;
 }
 
@@ -1177,6 +1382,17 @@ FORWARDING_HANDLER::CreateWinHttpRequest(
         dwTimeout = pProtocol->QueryTimeout();
     }
 
+    //
+    // The timing wheel times each WinHTTP operation of the request, which
+    // leaves nothing for the WinHTTP timers to do. WebSocket upgrades keep
+    // the WinHTTP timers they always had.
+    //
+    if (g_pTimerWheel != NULL && dwTimeout != 0 && !m_fWebSocketEnabled)
+    {
+        m_dwRequestTimeoutMs = dwTimeout;
+        dwTimeout = INFINITE;
+    }
+
     if (!WinHttpSetTimeouts(m_hRequest,
                             dwTimeout, //resolve timeout
                             dwTimeout, // connect timeout
@@ -1374,6 +1590,16 @@ None
         dwHandlers = InterlockedDecrement(&m_dwHandlers);
     }
 
+    if (dwInternetStatus != WINHTTP_CALLBACK_STATUS_SENDING_REQUEST &&
+        dwInternetStatus != WINHTTP_CALLBACK_STATUS_REQUEST_SENT)
+    {
+        //
+        // The operation the timeout was armed for is over, the handler
+        // arms it again if it starts another one.
+        //
+        CancelRequestTimeout();
+    }
+
     if (m_fFinishRequest)
     {
         // Request was done by another thread, skip
@@ -1466,6 +1692,7 @@ None
         // This is a notification, not a completion.  This notifiation happens
         // during the Send Request operation.
         //
+        m_phaseClock.Next(REQUEST_PHASE_CONNECT, REQUEST_PHASE_SEND);
         fAnotherCompletionExpected = TRUE;
         break;
 
@@ -1531,10 +1758,20 @@ None
 
 Failure:
 
+    if (m_fRequestTimedOut)
+    {
+        //
+        // The handle was closed on the timeout, fail the request the way
+        // WinHTTP would have.
+        //
+        hr = HRESULT_FROM_WIN32(ERROR_WINHTTP_TIMEOUT);
+    }
+
     if (!m_fHasError)
     {
         m_RequestStatus = FORWARDER_DONE;
         m_fHasError = TRUE;
+        ReleaseOutstandingRequest();
 
         pResponse->DisableKernelCache();
         pResponse->GetRawHttpResponse()->EntityChunkCount = 0;
@@ -1624,6 +1861,34 @@ Finished:
         RemoveRequest();
         m_fFinishRequest = TRUE;
         fDoPostCompletion = TRUE;
+
+        //
+        // The whole response has been received, it can be cached and
+        // passed to the requests waiting on it.
+        //
+        if (m_pCacheWriter != NULL && !m_fHasError)
+        {
+            RESPONSE_CACHE_ENTRY *pEntry = NULL;
+
+            if (SUCCEEDED_LOG(m_pCacheWriter->Commit(GetTickCount64(), &pEntry)))
+            {
+                CompleteFlight(pEntry);
+                pEntry->DereferenceCacheEntry();
+            }
+        }
+        ReleaseResponseCapture();
+
+        //
+        // Done with the backend, the next queued request may go.
+        //
+        ReleaseAdmission();
+        ReleaseOutstandingRequest();
+
+        if (!m_fHasError)
+        {
+            RecordPhases();
+        }
+
         if (m_pWebSocket != NULL)
         {
             m_pWebSocket->Terminate();
@@ -1690,13 +1955,17 @@ Finished:
 HRESULT
 FORWARDING_HANDLER::OnWinHttpCompletionSendRequestOrWriteComplete(
     HINTERNET                   hRequest,
-    DWORD,
+    DWORD                       dwInternetStatus,
     __out BOOL *                pfClientError,
     __out BOOL *                pfAnotherCompletionExpected
 )
 {
     HRESULT hr = S_OK;
-    IHttpRequest *      pRequest = m_pW3Context->GetRequest();
+
+    if (dwInternetStatus == WINHTTP_CALLBACK_STATUS_SENDREQUEST_COMPLETE)
+    {
+        ReleaseRequestHeaders();
+    }
 
     //
     // completion for sending the initial request or request entity to
@@ -1705,78 +1974,51 @@ FORWARDING_HANDLER::OnWinHttpCompletionSendRequestOrWriteComplete(
     //
     if (m_BytesToReceive > 0)
     {
-        if (m_pEntityBuffer == NULL)
+        BOOL fEndOfBody;
+
+        if (m_requestBody.QueryBuffer() == NULL)
         {
-            m_pEntityBuffer = GetNewResponseBuffer(
-                ENTITY_BUFFER_SIZE);
-            if (m_pEntityBuffer == NULL)
+            BYTE *pBuffer = static_cast<BYTE *>(sm_pRequestBodyAlloc->Alloc());
+            if (pBuffer == NULL)
             {
                 hr = E_OUTOFMEMORY;
                 goto Finished;
             }
+
+            m_requestBody.Initialize(pBuffer,
+                                     REQUEST_BODY_BATCH::DATA_SIZE,
+                                     m_BytesToReceive == INFINITE);
         }
 
-        if (sm_pTraceLog != NULL)
+        hr = ReadRequestBody(&fEndOfBody);
+        if (FAILED_LOG(hr))
         {
-            WriteRefTraceLogEx(sm_pTraceLog,
-                m_cRefs,
-                this,
-                "Calling ReadEntityBody",
-                NULL,
-                NULL);
+            *pfClientError = TRUE;
+            goto Finished;
         }
-        hr = pRequest->ReadEntityBody(
-            m_pEntityBuffer + 6,
-            min(m_BytesToReceive, BUFFER_SIZE),
-            TRUE,       // fAsync
-            NULL,       // pcbBytesReceived
-            NULL);      // pfCompletionPending
-        if (hr == HRESULT_FROM_WIN32(ERROR_HANDLE_EOF))
-        {
-            DBG_ASSERT(m_BytesToReceive == 0 ||
-                m_BytesToReceive == INFINITE);
 
+        if (!fEndOfBody)
+        {
             //
-            // ERROR_HANDLE_EOF is not an error.
+            // ReadEntityBody will post a completion to IIS.
             //
-            hr = S_OK;
-
-            if (m_BytesToReceive == INFINITE)
-            {
-                m_BytesToReceive = 0;
-                m_cchLastSend = 5;
-
-                //
-                // WinHttpWriteData can operate asynchronously.
-                //
-                // Take reference so that object does not go away as a result of
-                // async completion.
-                //
-                //ReferenceForwardingHandler();
-                if (!WinHttpWriteData(m_hRequest,
-                    "0\r\n\r\n",
-                    5,
-                    NULL))
-                {
-                    hr = HRESULT_FROM_WIN32(GetLastError());
-                    //DereferenceForwardingHandler();
-                    goto Finished;
-                }
-                *pfAnotherCompletionExpected = TRUE;
+            *pfAnotherCompletionExpected = TRUE;
 
-                goto Finished;
-            }
-        }
-        else if (FAILED_LOG(hr))
-        {
-            *pfClientError = TRUE;
             goto Finished;
         }
-        else
+
+        if (m_BytesToReceive == INFINITE)
         {
             //
-            // ReadEntityBody will post a completion to IIS.
+            // Nothing is batched after a write, only the last chunk is left.
             //
+            m_BytesToReceive = 0;
+
+            hr = WriteRequestBody(TRUE);
+            if (FAILED_LOG(hr))
+            {
+                goto Finished;
+            }
             *pfAnotherCompletionExpected = TRUE;
 
             goto Finished;
@@ -1784,7 +2026,9 @@ FORWARDING_HANDLER::OnWinHttpCompletionSendRequestOrWriteComplete(
     }
 
     m_RequestStatus = FORWARDER_RECEIVING_RESPONSE;
+    m_phaseClock.Next(REQUEST_PHASE_SEND, REQUEST_PHASE_FIRST_BYTE);
 
+    ArmRequestTimeout();
     if (!WinHttpReceiveResponse(hRequest, NULL))
     {
         hr = HRESULT_FROM_WIN32(GetLastError());
@@ -1810,6 +2054,13 @@ FORWARDING_HANDLER::OnWinHttpCompletionStatusHeadersAvailable(
 
     UNREFERENCED_PARAMETER(pfAnotherCompletionExpected);
 
+    m_phaseClock.Next(REQUEST_PHASE_FIRST_BYTE, REQUEST_PHASE_BODY);
+
+    //
+    // The request body has been sent completely.
+    //
+    ReleaseRequestBody();
+
     //
     // Headers are available, read the status line and headers and pass
     // them on to the client
@@ -1889,6 +2140,14 @@ FORWARDING_HANDLER::OnWinHttpCompletionStatusHeadersAvailable(
     {
         m_RequestStatus = FORWARDER_RECEIVED_WEBSOCKET_RESPONSE;
 
+        //
+        // No more entity goes through this handler, the websocket
+        // handler has its own buffers. A websocket lives as long as its
+        // client wants, it does not count as backend load.
+        //
+        ReleaseResponseBuffers();
+        ReleaseOutstandingRequest();
+
         hr = m_pW3Context->GetResponse()->Flush(
             TRUE,
             TRUE,
@@ -1931,6 +2190,8 @@ FORWARDING_HANDLER::OnWinHttpCompletionStatusDataAvailable(
         }
 
         m_RequestStatus = FORWARDER_DONE;
+        m_phaseClock.Stop(REQUEST_PHASE_BODY);
+        ReleaseOutstandingRequest();
 
         goto Finished;
     }
@@ -1956,6 +2217,7 @@ FORWARDING_HANDLER::OnWinHttpCompletionStatusDataAvailable(
     // async completion.
     //
     //ReferenceForwardingHandler();
+    ArmRequestTimeout();
     if (!WinHttpReadData(hRequest,
         m_pEntityBuffer,
         min(m_BytesToSend, BUFFER_SIZE),
@@ -2008,6 +2270,8 @@ FORWARDING_HANDLER::OnWinHttpCompletionStatusReadComplete(
             }
 
             m_RequestStatus = FORWARDER_DONE;
+            m_phaseClock.Stop(REQUEST_PHASE_BODY);
+            ReleaseOutstandingRequest();
         }
     }
     else
@@ -2031,6 +2295,12 @@ FORWARDING_HANDLER::OnWinHttpCompletionStatusReadComplete(
         {
             goto Finished;
         }
+
+        if (m_pCacheWriter != NULL &&
+            !m_pCacheWriter->AppendBody(m_pEntityBuffer, dwStatusInformationLength))
+        {
+            ReleaseResponseCapture();
+        }
     }
 
     if (m_cBytesBuffered >= m_cMinBufferLimit)
@@ -2038,6 +2308,7 @@ FORWARDING_HANDLER::OnWinHttpCompletionStatusReadComplete(
         //
         // Always post a completion to resume the WinHTTP data pump.
         //
+        m_phaseClock.StartClientWrite();
         hr = pResponse->Flush(TRUE,     // fAsync
             TRUE,     // fMoreData
             NULL);    // pcbSent
@@ -2065,99 +2336,65 @@ FORWARDING_HANDLER::OnSendingRequest(
 )
 {
     HRESULT hr = S_OK;
+    BOOL    fEndOfBody = FALSE;
+    BOOL    fLastChunk = FALSE;
     //
     // This is a completion for a read from http.sys, abort in case
-    // of failure, if we read anything write it out over WinHTTP,
-    // but we have already reached EOF, now read the response
+    // of failure, if we read anything write it to WinHTTP as one batch,
+    // once we have reached EOF and sent everything, read the response
     //
     if (hrCompletionStatus == HRESULT_FROM_WIN32(ERROR_HANDLE_EOF))
     {
-        DBG_ASSERT(m_BytesToReceive == 0 || m_BytesToReceive == INFINITE);
-        if (m_BytesToReceive == INFINITE)
-        {
-            m_BytesToReceive = 0;
-            m_cchLastSend = 5; // "0\r\n\r\n"
-
-            if (!WinHttpWriteData(m_hRequest,
-                "0\r\n\r\n",
-                5,
-                NULL))
-            {
-                hr = HRESULT_FROM_WIN32(GetLastError());
-                goto Failure;
-            }
-        }
-        else
-        {
-            m_RequestStatus = FORWARDER_RECEIVING_RESPONSE;
-
-            if (!WinHttpReceiveResponse(m_hRequest, NULL))
-            {
-                hr = HRESULT_FROM_WIN32(GetLastError());
-                goto Failure;
-            }
-        }
+        fEndOfBody = TRUE;
     }
     else if (SUCCEEDED(hrCompletionStatus))
     {
-        DWORD cbOffset;
-
         if (m_BytesToReceive != INFINITE)
         {
             m_BytesToReceive -= cbCompletion;
-            cbOffset = 6;
         }
-        else
+
+        m_requestBody.OnRead(cbCompletion);
+
+        if (m_requestBody.IsEmpty() && m_BytesToReceive > 0)
         {
             //
-            // For chunk-encoded requests, need to re-chunk the entity body
-            // Add the CRLF just before and after the chunk data
+            // Nothing was read, ask again.
             //
-            m_pEntityBuffer[4] = '\r';
-            m_pEntityBuffer[5] = '\n';
-
-            m_pEntityBuffer[cbCompletion + 6] = '\r';
-            m_pEntityBuffer[cbCompletion + 7] = '\n';
-
-            if (cbCompletion < 0x10)
-            {
-                cbOffset = 3;
-                m_pEntityBuffer[3] = HEX_TO_ASCII(cbCompletion);
-                cbCompletion += 5;
-            }
-            else if (cbCompletion < 0x100)
-            {
-                cbOffset = 2;
-                m_pEntityBuffer[2] = HEX_TO_ASCII(cbCompletion >> 4);
-                m_pEntityBuffer[3] = HEX_TO_ASCII(cbCompletion & 0xf);
-                cbCompletion += 6;
-            }
-            else if (cbCompletion < 0x1000)
+            hr = ReadRequestBody(&fEndOfBody);
+            if (FAILED_LOG(hr))
             {
-                cbOffset = 1;
-                m_pEntityBuffer[1] = HEX_TO_ASCII(cbCompletion >> 8);
-                m_pEntityBuffer[2] = HEX_TO_ASCII((cbCompletion >> 4) & 0xf);
-                m_pEntityBuffer[3] = HEX_TO_ASCII(cbCompletion & 0xf);
-                cbCompletion += 7;
+                *pfClientError = TRUE;
+                goto Failure;
             }
-            else
-            {
-                DBG_ASSERT(cbCompletion < 0x10000);
 
-                cbOffset = 0;
-                m_pEntityBuffer[0] = HEX_TO_ASCII(cbCompletion >> 12);
-                m_pEntityBuffer[1] = HEX_TO_ASCII((cbCompletion >> 8) & 0xf);
-                m_pEntityBuffer[2] = HEX_TO_ASCII((cbCompletion >> 4) & 0xf);
-                m_pEntityBuffer[3] = HEX_TO_ASCII(cbCompletion & 0xf);
-                cbCompletion += 8;
+            if (!fEndOfBody)
+            {
+                goto Failure;
             }
         }
-        m_cchLastSend = cbCompletion;
+    }
+    else
+    {
+        hr = hrCompletionStatus;
+        *pfClientError = TRUE;
+        goto Failure;
+    }
 
-        if (!WinHttpWriteData(m_hRequest,
-            m_pEntityBuffer + cbOffset,
-            cbCompletion,
-            NULL))
+    if (fEndOfBody)
+    {
+        DBG_ASSERT(m_BytesToReceive == 0 || m_BytesToReceive == INFINITE);
+        fLastChunk = (m_BytesToReceive == INFINITE);
+        m_BytesToReceive = 0;
+    }
+
+    if (m_requestBody.IsEmpty() && !fLastChunk)
+    {
+        m_RequestStatus = FORWARDER_RECEIVING_RESPONSE;
+        m_phaseClock.Next(REQUEST_PHASE_SEND, REQUEST_PHASE_FIRST_BYTE);
+
+        ArmRequestTimeout();
+        if (!WinHttpReceiveResponse(m_hRequest, NULL))
         {
             hr = HRESULT_FROM_WIN32(GetLastError());
             goto Failure;
@@ -2165,9 +2402,15 @@ FORWARDING_HANDLER::OnSendingRequest(
     }
     else
     {
-        hr = hrCompletionStatus;
-        *pfClientError = TRUE;
-        goto Failure;
+        //
+        // Send what is batched, for a chunked body that has ended together
+        // with the last chunk.
+        //
+        hr = WriteRequestBody(fLastChunk);
+        if (FAILED_LOG(hr))
+        {
+            goto Failure;
+        }
     }
 
 Failure:
@@ -2208,6 +2451,7 @@ FORWARDING_HANDLER::OnReceivingResponse(
         //
         // No buffering enabled.
         //
+        ArmRequestTimeout();
         if (!WinHttpQueryDataAvailable(m_hRequest, NULL))
         {
             hr = HRESULT_FROM_WIN32(GetLastError());
@@ -2229,6 +2473,7 @@ FORWARDING_HANDLER::OnReceivingResponse(
             }
         }
 
+        ArmRequestTimeout();
         if (!WinHttpReadData(m_hRequest,
             m_pEntityBuffer,
             min(m_BytesToSend, BUFFER_SIZE),
@@ -2243,243 +2488,1588 @@ Failure:
     return hr;
 }
 
-BYTE *
-FORWARDING_HANDLER::GetNewResponseBuffer(
-    DWORD   dwBufferSize
+HRESULT
+FORWARDING_HANDLER::ReadRequestBody(
+    __out BOOL *                pfEndOfBody
 )
+/*++
+  Description:
+    Starts an async http.sys read into the request body batch, or sets
+    *pfEndOfBody if the body has already ended.
+--*/
 {
-    DWORD dwNeededSize = (m_cEntityBuffers + 1) * sizeof(BYTE *);
-    if (dwNeededSize > m_buffEntityBuffers.QuerySize() &&
-        !m_buffEntityBuffers.Resize(
-            max(dwNeededSize, m_buffEntityBuffers.QuerySize() * 2)))
+    HRESULT hr;
+    BYTE *  pbRead;
+    DWORD   cbRead;
+
+    *pfEndOfBody = FALSE;
+
+    m_requestBody.BeginRead(m_BytesToReceive, &pbRead, &cbRead);
+
+    if (sm_pTraceLog != NULL)
     {
-        return NULL;
+        WriteRefTraceLogEx(sm_pTraceLog,
+            m_cRefs,
+            this,
+            "Calling ReadEntityBody",
+            NULL,
+            NULL);
     }
-
-    BYTE *pBuffer = (BYTE *)HeapAlloc(GetProcessHeap(),
-        0, // dwFlags
-        dwBufferSize);
-    if (pBuffer == NULL)
+    hr = m_pW3Context->GetRequest()->ReadEntityBody(
+        pbRead,
+        cbRead,
+        TRUE,       // fAsync
+        NULL,       // pcbBytesReceived
+        NULL);      // pfCompletionPending
+    if (hr == HRESULT_FROM_WIN32(ERROR_HANDLE_EOF))
     {
-        return NULL;
+        DBG_ASSERT(m_BytesToReceive == 0 ||
+            m_BytesToReceive == INFINITE);
+
+        //
+        // ERROR_HANDLE_EOF is not an error.
+        //
+        *pfEndOfBody = TRUE;
+        hr = S_OK;
     }
 
-    m_buffEntityBuffers.QueryPtr()[m_cEntityBuffers] = pBuffer;
-    m_cEntityBuffers++;
+    return hr;
+}
 
-    return pBuffer;
+HRESULT
+FORWARDING_HANDLER::WriteRequestBody(
+    BOOL                        fLastChunk
+)
+/*++
+  Description:
+    Sends the request body batch with a single WinHttpWriteData.
+--*/
+{
+    BYTE *  pbWrite;
+    DWORD   cbWrite;
+
+    m_requestBody.Frame(fLastChunk, &pbWrite, &cbWrite);
+    m_cchLastSend = cbWrite;
+
+    //
+    // WinHttpWriteData can operate asynchronously, the batch stays
+    // untouched until its completion.
+    //
+    ArmRequestTimeout();
+    if (!WinHttpWriteData(m_hRequest,
+        pbWrite,
+        cbWrite,
+        NULL))
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    return S_OK;
 }
 
 VOID
-FORWARDING_HANDLER::FreeResponseBuffers()
+FORWARDING_HANDLER::ReleaseRequestBody()
 {
-    BYTE **pBuffers = m_buffEntityBuffers.QueryPtr();
-    for (DWORD i = 0; i<m_cEntityBuffers; i++)
+    if (m_requestBody.QueryBuffer() != NULL)
     {
-        HeapFree(GetProcessHeap(),
-            0, // dwFlags
-            pBuffers[i]);
+        sm_pRequestBodyAlloc->Free(m_requestBody.QueryBuffer());
+        m_requestBody.Initialize(NULL, 0, FALSE);
     }
-    m_cEntityBuffers = 0;
-    m_pEntityBuffer = NULL;
-    m_cBytesBuffered = 0;
 }
 
-HRESULT
-FORWARDING_HANDLER::SetStatusAndHeaders(
-    PCSTR           pszHeaders,
-    DWORD
+BOOL
+FORWARDING_HANDLER::IsAuthenticatedRequest(
+    _In_ const PROTOCOL_CONFIG * pProtocol
 )
+/*++
+  Description:
+    Whether the response to the request may depend on who sent it: it
+    carries credentials or cookies, IIS authenticated the user, or a
+    client certificate is forwarded to the backend.
+--*/
 {
-    HRESULT         hr;
-    IHttpResponse * pResponse = m_pW3Context->GetResponse();
     IHttpRequest *  pRequest = m_pW3Context->GetRequest();
-    STACK_STRA(strHeaderName, 128);
-    STACK_STRA(strHeaderValue, 2048);
-    DWORD           index = 0;
-    PSTR            pchNewline;
-    PCSTR           pchEndofHeaderValue;
-    BOOL            fServerHeaderPresent = FALSE;
-
-    _ASSERT(pszHeaders != NULL);
+    HTTP_REQUEST *  pRawRequest = pRequest->GetRawHttpRequest();
+    IHttpUser *     pUser = m_pW3Context->GetUser();
 
-    //
-    // The first line is the status line
-    //
-    PSTR pchStatus = const_cast<PSTR>(strchr(pszHeaders, ' '));
-    if (pchStatus == NULL)
+    if (pRequest->GetHeader(HttpHeaderAuthorization) != NULL ||
+        pRequest->GetHeader(HttpHeaderCookie) != NULL)
     {
-        return HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER);
+        return TRUE;
     }
-    while (*pchStatus == ' ')
+
+    if (pUser != NULL &&
+        pUser->GetAuthenticationType() != NULL &&
+        pUser->GetAuthenticationType()[0] != L'\0' &&
+        _wcsicmp(pUser->GetAuthenticationType(), L"anonymous") != 0)
+    {
+        return TRUE;
+    }
+
+    return !pProtocol->QueryClientCertName()->IsEmpty() &&
+           pRawRequest->pSslInfo != NULL &&
+           pRawRequest->pSslInfo->pClientCertInfo != NULL;
+}
+
+HRESULT
+FORWARDING_HANDLER::ServeFromResponseCache(
+    _In_ RESPONSE_CACHE *       pResponseCache,
+    _In_opt_ REQUEST_COALESCER * pCoalescer,
+    _Out_ BOOL *                pfServed,
+    _Out_ BOOL *                pfWaiting
+)
+/*++
+  Description:
+    Sends a fresh cached response for a GET request. On a miss it either
+    parks the request on an identical one already forwarded, or starts
+    capturing the response of the backend for the cache and for the
+    requests that park on this one.
+--*/
+{
+    HRESULT                 hr = S_OK;
+    IHttpRequest *          pRequest = m_pW3Context->GetRequest();
+    HTTP_REQUEST *          pRawRequest = pRequest->GetRawHttpRequest();
+    RESPONSE_CACHE_ENTRY *  pEntry = NULL;
+    CACHE_CONTROL           cacheControl;
+    PCSTR                   pszHeader;
+    USHORT                  cchHost = 0;
+    BOOL                    fAuthenticated = IsAuthenticatedRequest(&sm_ProtocolConfig);
+    STACK_STRA(strKey, 256);
+
+    *pfServed = FALSE;
+    *pfWaiting = FALSE;
+
+    //
+    // Requests with a body are always forwarded. Authenticated requests,
+    // and requests with cookies, are only answered with, and only store,
+    // responses marked public or with s-maxage.
+    //
+    if (pRawRequest->Verb != HttpVerbGET ||
+        pRequest->GetHeader(HttpHeaderContentLength) != NULL ||
+        pRequest->GetHeader(HttpHeaderTransferEncoding) != NULL)
+    {
+        goto Finished;
+    }
+
+    pszHeader = pRequest->GetHeader(HttpHeaderCacheControl);
+    if (pszHeader != NULL)
+    {
+        cacheControl.Parse(pszHeader);
+    }
+
+    //
+    // The same host and url over http and https are different resources.
+    //
+    pszHeader = pRequest->GetHeader(HttpHeaderHost, &cchHost);
+    if (FAILED_LOG(hr = strKey.Copy(pRawRequest->pSslInfo != NULL ? "GET https://" : "GET http://")) ||
+        FAILED_LOG(hr = strKey.Append(pszHeader != NULL ? pszHeader : "", cchHost)) ||
+        FAILED_LOG(hr = strKey.Append(pRawRequest->pRawUrl, pRawRequest->RawUrlLength)))
+    {
+        goto Finished;
+    }
+
+    pszHeader = pRequest->GetHeader(HttpHeaderPragma);
+    if (pszHeader != NULL)
+    {
+        cacheControl.ParsePragma(pszHeader);
+    }
+
+    if (!cacheControl.IsRequestBypass())
+    {
+        pEntry = pResponseCache->Lookup(strKey.QueryStr(),
+                                        strKey.QueryCCH(),
+                                        GetRequestHeader,
+                                        pRequest,
+                                        GetTickCount64(),
+                                        fAuthenticated);
+    }
+
+    if (pEntry != NULL)
+    {
+        hr = SendCachedResponse(pEntry);
+        if (SUCCEEDED(hr))
+        {
+            *pfServed = TRUE;
+        }
+        goto Finished;
+    }
+
+    //
+    // Authenticated requests and requests with cookies may be answered for
+    // their client only, they neither lead nor join a flight. A request
+    // that was released from a flight is forwarded on its own.
+    //
+    if (pCoalescer != NULL &&
+        !m_fCoalesced &&
+        !fAuthenticated)
+    {
+        m_fCoalesced = TRUE;
+
+        //
+        // The waiter holds a reference, and the status has to be set before
+        // the flight can complete.
+        //
+        m_flightWaiter.pfnCompletion = FlightCompletionCallback;
+        m_flightWaiter.pvContext = this;
+        m_RequestStatus = FORWARDER_WAITING_FOR_FLIGHT;
+        ReferenceRequestHandler();
+
+        if (pCoalescer->Join(strKey.QueryStr(),
+                             strKey.QueryCCH(),
+                             &m_flightWaiter,
+                             GetTickCount64(),
+                             &m_pFlight) == FLIGHT_WAIT)
+        {
+            *pfWaiting = TRUE;
+            goto Finished;
+        }
+
+        m_RequestStatus = FORWARDER_START;
+        DereferenceRequestHandler();
+    }
+
+    //
+    // Capturing is best effort, the request is forwarded either way.
+    //
+    m_pCacheWriter = new RESPONSE_CACHE_WRITER(pResponseCache);
+    if (m_pCacheWriter == NULL ||
+        FAILED_LOG(m_pCacheWriter->Initialize(strKey.QueryStr(), strKey.QueryCCH(), fAuthenticated)))
+    {
+        ReleaseResponseCapture();
+    }
+
+Finished:
+
+    return hr;
+}
+
+HRESULT
+FORWARDING_HANDLER::SendCachedResponse(
+    _In_ RESPONSE_CACHE_ENTRY * pEntry
+)
+/*++
+  Description:
+    Sets the status, headers and body of a captured response on the
+    response to the client, taking over the reference to pEntry.
+--*/
+{
+    HRESULT         hr = S_OK;
+    IHttpResponse * pResponse = m_pW3Context->GetResponse();
+
+    //
+    // The entry stays referenced until the handler goes away, the body is
+    // sent by reference from its blocks.
+    //
+    DBG_ASSERT(m_pCachedResponse == NULL);
+    m_pCachedResponse = pEntry;
+
+    if (FAILED_LOG(hr = pResponse->SetStatus(pEntry->QueryStatus(), pEntry->QueryReason())))
+    {
+        goto Finished;
+    }
+
+    pResponse->DeleteHeader("Server");
+
+    for (DWORD i = 0; i < pEntry->QueryHeaderCount(); i++)
+    {
+        const CACHED_HEADER *pHeader = pEntry->QueryHeader(i);
+
+        if (FAILED_LOG(hr = pResponse->SetHeader(pHeader->pszName,
+                pHeader->pszValue,
+                pHeader->cchValue,
+                FALSE))) // fReplace
+        {
+            goto Finished;
+        }
+    }
+
+    {
+        CHAR szAge[16];
+
+        _ultoa_s(pEntry->QueryAge(GetTickCount64()), szAge, 10);
+        if (FAILED_LOG(hr = pResponse->SetHeader("Age",
+                szAge,
+                static_cast<USHORT>(strlen(szAge)),
+                TRUE))) // fReplace
+        {
+            goto Finished;
+        }
+    }
+
+    for (DWORD i = 0; i < pEntry->QueryBlockCount(); i++)
+    {
+        HTTP_DATA_CHUNK Chunk;
+
+        Chunk.DataChunkType = HttpDataChunkFromMemory;
+        Chunk.FromMemory.pBuffer = pEntry->QueryBlock(i, &Chunk.FromMemory.BufferLength);
+        if (FAILED_LOG(hr = pResponse->WriteEntityChunkByReference(&Chunk)))
+        {
+            goto Finished;
+        }
+    }
+
+Finished:
+
+    return hr;
+}
+
+VOID
+FORWARDING_HANDLER::ReleaseResponseCapture()
+{
+    if (m_pCacheWriter != NULL)
+    {
+        delete m_pCacheWriter;
+        m_pCacheWriter = NULL;
+    }
+
+    //
+    // Requests waiting on this one are forwarded on their own.
+    //
+    CompleteFlight(NULL);
+}
+
+VOID
+FORWARDING_HANDLER::CompleteFlight(
+    _In_opt_ RESPONSE_CACHE_ENTRY * pEntry
+)
+{
+    if (m_pFlight != NULL)
+    {
+        static_cast<OUT_OF_PROCESS_APPLICATION *>(m_pApplication)->QueryRequestCoalescer()->Complete(m_pFlight, pEntry);
+        m_pFlight = NULL;
+    }
+}
+
+// static
+VOID
+FORWARDING_HANDLER::FlightCompletionCallback(
+    PVOID                       pvContext
+)
+{
+    FORWARDING_HANDLER *pHandler = static_cast<FORWARDING_HANDLER *>(pvContext);
+
+    pHandler->m_pW3Context->PostCompletion(0);
+    pHandler->DereferenceRequestHandler();
+}
+
+ADMISSION_RESULT
+FORWARDING_HANDLER::EnterAdmissionQueue(
+    _In_ ADMISSION_LIMITER *    pLimiter
+)
+/*++
+  Description:
+    Takes one of the in-flight slots of the application for the request,
+    or queues it for one. WebSocket requests hold their connection for a
+    long time and are let through without a slot.
+--*/
+{
+    ADMISSION_RESULT    result;
+    USHORT              cchHeader = 0;
+    PCSTR               pszUpgrade = m_pW3Context->GetRequest()->GetHeader("Upgrade", &cchHeader);
+
+    m_fAdmissionChecked = TRUE;
+
+    if (cchHeader == 9 && _stricmp(pszUpgrade, "websocket") == 0)
+    {
+        return ADMISSION_ADMITTED;
+    }
+
+    //
+    // The waiter holds a reference, and the status has to be set before
+    // the request can be admitted.
+    //
+    m_RequestStatus = FORWARDER_WAITING_FOR_ADMISSION;
+    ReferenceRequestHandler();
+
+    m_phaseClock.Start(REQUEST_PHASE_QUEUE);
+    result = pLimiter->Enter(&m_admissionWaiter, GetTickCount64());
+    if (result == ADMISSION_QUEUED)
+    {
+        return result;
+    }
+
+    m_phaseClock.Stop(REQUEST_PHASE_QUEUE);
+    m_RequestStatus = FORWARDER_START;
+    DereferenceRequestHandler();
+
+    if (result == ADMISSION_ADMITTED)
+    {
+        m_fAdmitted = TRUE;
+    }
+    return result;
+}
+
+REQUEST_NOTIFICATION_STATUS
+FORWARDING_HANDLER::OnAdmissionCompletion()
+/*++
+  Description:
+    Resumes a queued request, forwarding it if it got a slot and shedding
+    it if it waited for the queue timeout.
+--*/
+{
+    IHttpResponse * pResponse = m_pW3Context->GetResponse();
+
+    m_phaseClock.Stop(REQUEST_PHASE_QUEUE);
+
+    if (m_admissionWaiter.fAdmitted)
+    {
+        m_fAdmitted = TRUE;
+        m_RequestStatus = FORWARDER_START;
+        return OnExecuteRequestHandler();
+    }
+
+    m_RequestStatus = FORWARDER_DONE;
+    ReleaseResponseCapture();
+
+    pResponse->DisableKernelCache();
+    pResponse->GetRawHttpResponse()->EntityChunkCount = 0;
+    pResponse->SetStatus(503, "Service Unavailable", 0, S_OK, nullptr, TRUE);
+    return RQ_NOTIFICATION_FINISH_REQUEST;
+}
+
+VOID
+FORWARDING_HANDLER::ReleaseAdmission()
+{
+    if (InterlockedExchange(&m_fAdmitted, FALSE))
+    {
+        static_cast<OUT_OF_PROCESS_APPLICATION *>(m_pApplication)->QueryAdmissionLimiter()->Leave(GetTickCount64());
+    }
+}
+
+VOID
+FORWARDING_HANDLER::ReleaseRequestHeaders()
+/*++
+  Description:
+    Gives back the memory the forwarded headers spilled to once they have
+    been handed to WinHTTP or copied into the request head, instead of
+    holding it for the life of the request or websocket.
+--*/
+{
+    m_pszHeaders = NULL;
+    m_bufHeaders.FreeMemory();
+}
+
+VOID
+FORWARDING_HANDLER::ReleaseOutstandingRequest()
+/*++
+  Description:
+    Stops counting the request as outstanding on its process, once the
+    backend is done with it. The load balancer ranks processes by this
+    count, the time clients take to read responses is not backend load.
+--*/
+{
+    if (InterlockedExchange(&m_fOutstanding, FALSE))
+    {
+        m_pServerProcess->DecrementOutstandingRequests();
+    }
+}
+
+// static
+VOID
+FORWARDING_HANDLER::AdmissionCompletionCallback(
+    PVOID                       pvContext,
+    BOOL                        fAdmitted
+)
+{
+    FORWARDING_HANDLER *pHandler = static_cast<FORWARDING_HANDLER *>(pvContext);
+
+    UNREFERENCED_PARAMETER(fAdmitted);
+
+    pHandler->m_pW3Context->PostCompletion(0);
+    pHandler->DereferenceRequestHandler();
+}
+
+HRESULT
+FORWARDING_HANDLER::StartLocalExchange(
+    _In_ const PROTOCOL_CONFIG *    pProtocol,
+    _In_ STRU *                     pstrUrl
+)
+/*++
+  Description:
+    Builds the request head for a pooled backend connection or h2c stream
+    and sets the exchange up to start with the connect, which
+    OnLocalExchangeCompletion runs.
+--*/
+{
+    HRESULT         hr;
+    IHttpRequest *  pRequest = m_pW3Context->GetRequest();
+
+    hr = GetHeaders(pProtocol,
+                    m_pApplication->QueryConfig()->QueryForwardWindowsAuthToken(),
+                    m_pServerProcess,
+                    &m_pszHeaders,
+                    &m_cchHeaders);
+    if (FAILED_LOG(hr))
+    {
+        return hr;
+    }
+
+    //
+    // The headers were widened byte for byte, Latin-1 takes them back.
+    //
+    if (FAILED_LOG(hr = m_straLocalRequest.Copy(pRequest->GetHttpMethod())) ||
+        FAILED_LOG(hr = m_straLocalRequest.Append(" ", 1)) ||
+        FAILED_LOG(hr = m_straLocalRequest.AppendW(pstrUrl->QueryStr(), pstrUrl->QueryCCH())) ||
+        FAILED_LOG(hr = m_straLocalRequest.Append(" HTTP/1.1\r\n", 11)) ||
+        FAILED_LOG(hr = m_straLocalRequest.AppendW(m_pszHeaders, m_cchHeaders, 28591)) ||
+        FAILED_LOG(hr = m_straLocalRequest.Append("\r\n", 2)))
+    {
+        return hr;
+    }
+
+    ReleaseRequestHeaders();
+
+    PCSTR pszContentLength = pRequest->GetHeader(HttpHeaderContentLength);
+    if (pszContentLength != NULL)
+    {
+        m_BytesToReceive = atol(pszContentLength);
+        if (m_BytesToReceive == INFINITE)
+        {
+            return HRESULT_FROM_WIN32(WSAECONNRESET);
+        }
+    }
+    else if (pRequest->GetHeader(HttpHeaderTransferEncoding) != NULL)
+    {
+        m_BytesToReceive = INFINITE;
+    }
+
+    m_dwRequestTimeoutMs = m_pServerProcess->IsDebuggerAttached() ? INFINITE : pProtocol->QueryTimeout();
+
+    //FREB log
+    if (ANCMEvents::ANCM_REQUEST_FORWARD_START::IsEnabled(m_pW3Context->GetTraceContext()))
+    {
+        ANCMEvents::ANCM_REQUEST_FORWARD_START::RaiseEvent(
+            m_pW3Context->GetTraceContext(),
+            NULL);
+    }
+
+    m_RequestStatus = FORWARDER_LOCAL_EXCHANGE;
+    m_localStep = LOCAL_EXCHANGE_CONNECT;
+    m_fLocalNoBody = m_fEndOfRequestBody = (m_BytesToReceive == 0);
+    m_phaseClock.Start(REQUEST_PHASE_CONNECT);
+
+    return S_OK;
+}
+
+REQUEST_NOTIFICATION_STATUS
+FORWARDING_HANDLER::OnLocalExchangeCompletion(
+    DWORD                       cbCompletion,
+    HRESULT                     hrCompletionStatus
+)
+/*++
+  Description:
+    Takes the exchange over a pooled connection or h2c stream as far as it
+    goes without waiting, and finishes the request once it has ended. A
+    failure before the response headers gets an error response, one after
+    them can only reset the client connection. A request that found the
+    pool at its cap for the whole timeout gets a 503.
+--*/
+{
+    HRESULT                     hr;
+    REQUEST_NOTIFICATION_STATUS retVal = RQ_NOTIFICATION_FINISH_REQUEST;
+    BOOL                        fPending = FALSE;
+    IHttpResponse *             pResponse = m_pW3Context->GetResponse();
+
+    //
+    // Take a reference so that object does not go away as a result of
+    // async completion.
+    //
+    ReferenceRequestHandler();
+
+    //
+    // The timer and the client disconnect callback cancel the waits of
+    // the exchange under the lock.
+    //
+    AcquireLockExclusive();
+
+    hr = ContinueLocalExchange(cbCompletion, hrCompletionStatus, &fPending);
+    if (!fPending)
+    {
+        m_RequestStatus = FORWARDER_DONE;
+    }
+
+    ReleaseLockExclusive();
+
+    if (fPending)
+    {
+        retVal = RQ_NOTIFICATION_PENDING;
+        goto Finished;
+    }
+
+    m_dwHandlers = 0;
+    m_fDoneAsyncCompletion = TRUE;
+
+    //disable client disconnect callback
+    RemoveRequest();
+
+    if (SUCCEEDED(hr))
+    {
+        RecordPhases();
+        retVal = RQ_NOTIFICATION_CONTINUE;
+        goto Finished;
+    }
+
+    m_fHasError = TRUE;
+
+    // FREB log
+    if (ANCMEvents::ANCM_REQUEST_FORWARD_FAIL::IsEnabled(m_pW3Context->GetTraceContext()))
+    {
+        ANCMEvents::ANCM_REQUEST_FORWARD_FAIL::RaiseEvent(
+            m_pW3Context->GetTraceContext(),
+            NULL,
+            hr);
+    }
+
+    pResponse->DisableKernelCache();
+    pResponse->GetRawHttpResponse()->EntityChunkCount = 0;
+
+    if (m_fResponseHeadersReceivedAndSet)
+    {
+        if (!m_fLocalClientError)
+        {
+            pResponse->ResetConnection();
+        }
+    }
+    else if (m_fLocalClientError)
+    {
+        pResponse->SetStatus(400, "Bad Request", 0, HRESULT_FROM_WIN32(WSAECONNRESET));
+    }
+    else if (hr == HRESULT_FROM_WIN32(ERROR_BUSY))
+    {
+        pResponse->SetStatus(503, "Service Unavailable", 0, S_OK, nullptr, TRUE);
+    }
+    else
+    {
+        pResponse->SetStatus(502, "Bad Gateway", 3, hr);
+    }
+
+Finished:
+    DereferenceRequestHandler();
+    //
+    // Do not use this object after dereferencing it, it may be gone.
+    //
+
+    return retVal;
+}
+
+HRESULT
+FORWARDING_HANDLER::ContinueLocalExchange(
+    DWORD                       cbCompletion,
+    HRESULT                     hrCompletionStatus,
+    _Out_ BOOL *                pfPending
+)
+/*++
+  Description:
+    Runs the exchange from m_localStep, called with the lock held. The
+    request goes over an h2c stream, or a connection of the backend
+    connection pool when there is no stream to be had. Its body is read
+    from http.sys into the request body batch and sent a read at a time,
+    the response goes out whenever more than the minimum response buffer
+    has come in.
+
+    A step that would wait leaves a wait behind and returns with
+    *pfPending set: the pool hands over a connection, the socket poller
+    finds the socket ready, the stream gets a frame or send window, or
+    IIS completes a read or a flush of the client. Each posts the IIS
+    completion that resumes the exchange here with m_localWait saying
+    which of them it was. The waits on the backend are bounded by the
+    request timeout, OnRequestTimeout and TerminateRequest take them back.
+
+    A connection that was idle in the pool may have been closed by the
+    backend just before it was used, an h2c stream may be refused. The
+    request then goes again on another connection or stream, if nothing of
+    it could have been acted on.
+--*/
+{
+    HRESULT                     hr = S_OK;
+    IHttpRequest *              pRequest = m_pW3Context->GetRequest();
+    IHttpResponse *             pResponse = m_pW3Context->GetResponse();
+    BACKEND_CONNECTION_POOL *   pPool = m_pServerProcess->QueryConnectionPool();
+    H2_CHANNEL *                pChannel = m_pServerProcess->QueryH2Channel();
+    LOCAL_EXCHANGE_WAIT         wait = m_localWait;
+    HTTP_VERB                   verb = pRequest->GetRawHttpRequest()->Verb;
+    PSTR                        pszHead;
+    DWORD                       cchHead;
+    USHORT                      uStatus;
+    BYTE *                      pbData;
+    DWORD                       cbData;
+
+    *pfPending = FALSE;
+
+    m_localWait = LOCAL_WAIT_NONE;
+    if (wait != LOCAL_WAIT_NONE && wait != LOCAL_WAIT_CLIENT)
+    {
+        CancelRequestTimeout();
+    }
+
+    if (m_fLocalWaitCancelled)
+    {
+        m_fLocalWaitCancelled = FALSE;
+
+        if (m_fRequestTimedOut)
+        {
+            hr = HRESULT_FROM_WIN32(wait == LOCAL_WAIT_POOL ? ERROR_BUSY : ERROR_TIMEOUT);
+        }
+        else if (m_fClientDisconnected)
+        {
+            hr = HRESULT_FROM_WIN32(WSAECONNRESET);
+            m_fLocalClientError = TRUE;
+        }
+        else
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED);
+        }
+        goto Finished;
+    }
+
+    for (;;)
+    {
+        switch (m_localStep)
+        {
+        case LOCAL_EXCHANGE_CONNECT:
+            //
+            // Every h2c connection at its stream limit, or one that could
+            // not be opened, sends the request over HTTP/1.1.
+            //
+            if (wait == LOCAL_WAIT_POOL)
+            {
+                hr = pPool->CompleteWait(&m_poolWaiter, &m_pPooledConnection, &m_fLocalReused);
+            }
+            else if (pChannel != NULL && SUCCEEDED(pChannel->OpenStream(&m_pStream)))
+            {
+                m_pStream->SetEventCallback(LocalWaitCallback, this);
+                hr = S_OK;
+            }
+            else
+            {
+                m_pStream = NULL;
+
+                ReferenceRequestHandler();
+                hr = pPool->AcquireAsync(&m_poolWaiter, &m_pPooledConnection, &m_fLocalReused);
+                if (PendLocalWait(&hr, LOCAL_WAIT_POOL, FALSE))
+                {
+                    goto Pending;
+                }
+            }
+
+            if (FAILED_LOG(hr) ||
+                (m_pPooledConnection != NULL &&
+                 FAILED_LOG(hr = m_pPooledConnection->connection.SetNonBlocking())))
+            {
+                goto Finished;
+            }
+
+            m_phaseClock.Next(REQUEST_PHASE_CONNECT, REQUEST_PHASE_SEND);
+            m_pbLocalSend = reinterpret_cast<const BYTE *>(m_straLocalRequest.QueryStr());
+            m_cbLocalSend = m_straLocalRequest.QueryCCH();
+            m_localStep = LOCAL_EXCHANGE_SEND_HEAD;
+            break;
+
+        case LOCAL_EXCHANGE_SEND_HEAD:
+            if (m_pStream != NULL)
+            {
+                hr = m_pStream->SendHead(m_straLocalRequest.QueryStr(), m_straLocalRequest.QueryCCH(), m_fEndOfRequestBody);
+            }
+            else
+            {
+                ReferenceRequestHandler();
+                hr = SendLocalData();
+                if (PendLocalWait(&hr, LOCAL_WAIT_SOCKET, TRUE))
+                {
+                    goto Pending;
+                }
+            }
+
+            if (FAILED_LOG(hr))
+            {
+                //
+                // Nothing of the request body has been read yet.
+                //
+                if (!m_fLocalRetried &&
+                    (m_pStream != NULL ? m_pStream->IsRefused() : m_fLocalReused) &&
+                    hr == HRESULT_FROM_WIN32(ERROR_CONNECTION_ABORTED))
+                {
+                    ReconnectLocalExchange();
+                    break;
+                }
+                goto Finished;
+            }
+
+            if (m_fEndOfRequestBody)
+            {
+                m_phaseClock.Next(REQUEST_PHASE_SEND, REQUEST_PHASE_FIRST_BYTE);
+                m_localStep = LOCAL_EXCHANGE_RECEIVE_HEAD;
+                break;
+            }
+
+            pbData = static_cast<BYTE *>(sm_pRequestBodyAlloc->Alloc());
+            if (pbData == NULL)
+            {
+                hr = E_OUTOFMEMORY;
+                goto Finished;
+            }
+
+            //
+            // HTTP/2 frames the body itself.
+            //
+            m_requestBody.Initialize(pbData,
+                                     REQUEST_BODY_BATCH::DATA_SIZE,
+                                     m_BytesToReceive == INFINITE && m_pStream == NULL);
+            m_localStep = LOCAL_EXCHANGE_READ_BODY;
+            break;
+
+        case LOCAL_EXCHANGE_READ_BODY:
+            if (wait == LOCAL_WAIT_CLIENT)
+            {
+                hr = hrCompletionStatus;
+                cbData = cbCompletion;
+            }
+            else
+            {
+                m_requestBody.BeginRead(m_BytesToReceive, &pbData, &cbData);
+
+                hr = pRequest->ReadEntityBody(pbData,
+                                              cbData,
+                                              TRUE,     // fAsync
+                                              NULL,     // pcbBytesReceived
+                                              NULL);    // pfCompletionPending
+                if (SUCCEEDED(hr))
+                {
+                    m_localWait = LOCAL_WAIT_CLIENT;
+                    goto Pending;
+                }
+                cbData = 0;
+            }
+
+            if (hr == HRESULT_FROM_WIN32(ERROR_HANDLE_EOF))
+            {
+                hr = S_OK;
+                cbData = 0;
+            }
+            else if (FAILED_LOG(hr))
+            {
+                m_fLocalClientError = TRUE;
+                goto Finished;
+            }
+
+            if (cbData == 0 && m_BytesToReceive != INFINITE)
+            {
+                //
+                // The client went away before the whole body.
+                //
+                hr = HRESULT_FROM_WIN32(WSAECONNRESET);
+                m_fLocalClientError = TRUE;
+                goto Finished;
+            }
+
+            if (m_BytesToReceive != INFINITE)
+            {
+                m_BytesToReceive -= cbData;
+            }
+            m_requestBody.OnRead(cbData);
+            m_fEndOfRequestBody = (cbData == 0 || m_BytesToReceive == 0);
+
+            m_requestBody.Frame(m_fEndOfRequestBody, &pbData, &cbData);
+            m_pbLocalSend = pbData;
+            m_cbLocalSend = cbData;
+            m_localStep = LOCAL_EXCHANGE_SEND_BODY;
+            break;
+
+        case LOCAL_EXCHANGE_SEND_BODY:
+            ReferenceRequestHandler();
+            if (m_pStream != NULL)
+            {
+                //
+                // The end of the body is an empty frame when it has no data.
+                //
+                hr = m_pStream->SendBody(m_pbLocalSend, m_cbLocalSend, m_fEndOfRequestBody, &cbData);
+                m_pbLocalSend += cbData;
+                m_cbLocalSend -= cbData;
+                if (PendLocalWait(&hr, LOCAL_WAIT_STREAM, TRUE))
+                {
+                    goto Pending;
+                }
+            }
+            else
+            {
+                hr = SendLocalData();
+                if (PendLocalWait(&hr, LOCAL_WAIT_SOCKET, TRUE))
+                {
+                    goto Pending;
+                }
+            }
+
+            if (FAILED_LOG(hr))
+            {
+                goto Finished;
+            }
+
+            if (!m_fEndOfRequestBody)
+            {
+                m_localStep = LOCAL_EXCHANGE_READ_BODY;
+                break;
+            }
+
+            ReleaseRequestBody();
+            m_phaseClock.Next(REQUEST_PHASE_SEND, REQUEST_PHASE_FIRST_BYTE);
+            m_localStep = LOCAL_EXCHANGE_RECEIVE_HEAD;
+            break;
+
+        case LOCAL_EXCHANGE_RECEIVE_HEAD:
+            ReferenceRequestHandler();
+            if (m_pStream != NULL)
+            {
+                hr = m_pStream->ReceiveResponseHead(verb == HttpVerbHEAD, &pszHead, &cchHead, &uStatus);
+                if (PendLocalWait(&hr, LOCAL_WAIT_STREAM, FALSE))
+                {
+                    goto Pending;
+                }
+            }
+            else
+            {
+                hr = m_pPooledConnection->connection.ReceiveResponseHead(verb == HttpVerbHEAD, &pszHead, &cchHead, &uStatus);
+                if (PendLocalWait(&hr, LOCAL_WAIT_SOCKET, FALSE))
+                {
+                    goto Pending;
+                }
+            }
+
+            if (FAILED_LOG(hr))
+            {
+                //
+                // The backend may have seen the request, only one without a
+                // body and without side effects goes again. A refused stream
+                // was not seen, it goes again if its body was not read.
+                //
+                if (!m_fLocalRetried && m_fLocalNoBody &&
+                    hr == HRESULT_FROM_WIN32(ERROR_CONNECTION_ABORTED) &&
+                    (m_pStream != NULL ?
+                        m_pStream->IsRefused() :
+                        (m_fLocalReused &&
+                         !m_pPooledConnection->connection.IsResponseStarted() &&
+                         (verb == HttpVerbGET || verb == HttpVerbHEAD || verb == HttpVerbOPTIONS))))
+                {
+                    ReconnectLocalExchange();
+                    break;
+                }
+                goto Finished;
+            }
+
+            m_phaseClock.Next(REQUEST_PHASE_FIRST_BYTE, REQUEST_PHASE_BODY);
+
+            if (uStatus == 101)
+            {
+                //
+                // No upgrade was asked for.
+                //
+                hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+                goto Finished;
+            }
+
+            if (FAILED_LOG(hr = SetStatusAndHeaders(pszHead, cchHead)))
+            {
+                goto Finished;
+            }
+            m_localStep = LOCAL_EXCHANGE_RECEIVE_BODY;
+            break;
+
+        case LOCAL_EXCHANGE_RECEIVE_BODY:
+            //
+            // Stop relaying a long response to a client that has gone.
+            //
+            if (m_pW3Context->GetConnection() == NULL ||
+                !m_pW3Context->GetConnection()->IsConnected())
+            {
+                hr = HRESULT_FROM_WIN32(WSAECONNRESET);
+                m_fLocalClientError = TRUE;
+                goto Finished;
+            }
+
+            //
+            // A read that went pending keeps its buffer for the next try.
+            //
+            if (m_pbLocalReceive == NULL)
+            {
+                m_pbLocalReceive = GetNewResponseBuffer(ENTITY_BUFFER_SIZE);
+                if (m_pbLocalReceive == NULL)
+                {
+                    hr = E_OUTOFMEMORY;
+                    goto Finished;
+                }
+            }
+
+            ReferenceRequestHandler();
+            if (m_pStream != NULL)
+            {
+                hr = m_pStream->ReadBody(m_pbLocalReceive, ENTITY_BUFFER_SIZE, &cbData);
+                if (PendLocalWait(&hr, LOCAL_WAIT_STREAM, FALSE))
+                {
+                    goto Pending;
+                }
+            }
+            else
+            {
+                hr = m_pPooledConnection->connection.ReadBody(m_pbLocalReceive, ENTITY_BUFFER_SIZE, &cbData);
+                if (PendLocalWait(&hr, LOCAL_WAIT_SOCKET, FALSE))
+                {
+                    goto Pending;
+                }
+            }
+
+            if (FAILED_LOG(hr))
+            {
+                goto Finished;
+            }
+
+            if (cbData == 0)
+            {
+                //
+                // Whatever is buffered goes out with the end of the request.
+                // The whole response has been received, it can be cached and
+                // passed to the requests waiting on it.
+                //
+                m_phaseClock.Stop(REQUEST_PHASE_BODY);
+
+                if (m_pCacheWriter != NULL)
+                {
+                    RESPONSE_CACHE_ENTRY *pEntry = NULL;
+
+                    if (SUCCEEDED_LOG(m_pCacheWriter->Commit(GetTickCount64(), &pEntry)))
+                    {
+                        CompleteFlight(pEntry);
+                        pEntry->DereferenceCacheEntry();
+                    }
+                }
+                goto Finished;
+            }
+
+            pbData = m_pbLocalReceive;
+            m_pbLocalReceive = NULL;
+            m_cBytesBuffered += cbData;
+
+            {
+                HTTP_DATA_CHUNK Chunk;
+                Chunk.DataChunkType = HttpDataChunkFromMemory;
+                Chunk.FromMemory.pBuffer = pbData;
+                Chunk.FromMemory.BufferLength = cbData;
+                if (FAILED_LOG(hr = pResponse->WriteEntityChunkByReference(&Chunk)))
+                {
+                    goto Finished;
+                }
+            }
+
+            if (m_pCacheWriter != NULL &&
+                !m_pCacheWriter->AppendBody(pbData, cbData))
+            {
+                ReleaseResponseCapture();
+            }
+
+            if (m_cBytesBuffered >= m_cMinBufferLimit)
+            {
+                m_localStep = LOCAL_EXCHANGE_FLUSH;
+            }
+            break;
+
+        case LOCAL_EXCHANGE_FLUSH:
+            if (wait == LOCAL_WAIT_CLIENT)
+            {
+                hr = hrCompletionStatus;
+            }
+            else
+            {
+                m_phaseClock.StartClientWrite();
+                hr = pResponse->Flush(TRUE,     // fAsync
+                                      TRUE,     // fMoreData
+                                      NULL);    // pcbSent
+                if (SUCCEEDED(hr))
+                {
+                    m_localWait = LOCAL_WAIT_CLIENT;
+                    goto Pending;
+                }
+            }
+
+            if (FAILED_LOG(hr))
+            {
+                m_fLocalClientError = TRUE;
+                goto Finished;
+            }
+
+            m_phaseClock.StopClientWrite();
+            FreeResponseBuffers();
+            m_localStep = LOCAL_EXCHANGE_RECEIVE_BODY;
+            break;
+        }
+
+        //
+        // What was waited for has been taken in.
+        //
+        wait = LOCAL_WAIT_NONE;
+    }
+
+Pending:
+    *pfPending = TRUE;
+    return S_OK;
+
+Finished:
+    ReleaseResponseCapture();
+    ReleaseRequestBody();
+
+    //
+    // Done with the backend, the next queued request may go.
+    //
+    ReleaseAdmission();
+    ReleaseOutstandingRequest();
+
+    //
+    // The connection is kept for the next request only if this one went
+    // through to the end of its response.
+    //
+    if (m_pPooledConnection != NULL)
+    {
+        pPool->Release(m_pPooledConnection, SUCCEEDED(hr), GetTickCount64());
+        m_pPooledConnection = NULL;
+    }
+
+    //
+    // A stream that did not finish is cancelled on the backend.
+    //
+    if (m_pStream != NULL)
+    {
+        pChannel->CloseStream(m_pStream);
+        m_pStream = NULL;
+    }
+
+    return hr;
+}
+
+BOOL
+FORWARDING_HANDLER::PendLocalWait(
+    _Inout_ HRESULT *           phr,
+    LOCAL_EXCHANGE_WAIT         wait,
+    BOOL                        fWrite
+)
+/*++
+  Description:
+    Leaves the exchange waiting when the call before it went pending, on
+    the socket poller for a connection, with the request timeout armed.
+    The caller took a reference for the callback of the wait, which goes
+    again when there is nothing to wait for.
+--*/
+{
+    if (*phr != HRESULT_FROM_WIN32(ERROR_IO_PENDING) ||
+        (wait == LOCAL_WAIT_SOCKET &&
+         FAILED_LOG(*phr = m_pServerProcess->QueryConnectionPool()->QueryPoller()->Wait(
+             &m_socketWait,
+             m_pPooledConnection->connection.QuerySocket(),
+             fWrite))))
     {
-        pchStatus++;
+        DereferenceRequestHandler();
+        return FALSE;
     }
-    USHORT uStatus = static_cast<USHORT>(atoi(pchStatus));
 
-    if (m_fWebSocketEnabled && uStatus != 101)
+    m_localWait = wait;
+    ArmRequestTimeout();
+    return TRUE;
+}
+
+HRESULT
+FORWARDING_HANDLER::SendLocalData()
+{
+    HRESULT hr = S_OK;
+    DWORD   cbSent;
+
+    if (m_cbLocalSend != 0)
     {
-        //
-        // Expected 101 response.
-        //
+        hr = m_pPooledConnection->connection.Send(m_pbLocalSend, m_cbLocalSend, &cbSent);
+        m_pbLocalSend += cbSent;
+        m_cbLocalSend -= cbSent;
+    }
+    return hr;
+}
 
-        m_fWebSocketEnabled = FALSE;
+VOID
+FORWARDING_HANDLER::ReconnectLocalExchange()
+/*++
+  Description:
+    Gives up the connection or stream the request found closed or
+    refused, and starts it over on another.
+--*/
+{
+    if (m_pStream != NULL)
+    {
+        m_pServerProcess->QueryH2Channel()->CloseStream(m_pStream);
+        m_pStream = NULL;
+    }
+    else
+    {
+        m_pServerProcess->QueryConnectionPool()->Release(m_pPooledConnection, FALSE, GetTickCount64());
+        m_pPooledConnection = NULL;
     }
 
-    pchStatus = strchr(pchStatus, ' ');
-    if (pchStatus == NULL)
+    m_fLocalRetried = TRUE;
+    m_localStep = LOCAL_EXCHANGE_CONNECT;
+    m_phaseClock.Start(REQUEST_PHASE_CONNECT);
+}
+
+BOOL
+FORWARDING_HANDLER::CancelLocalWait()
+/*++
+  Description:
+    Takes back the wait of the exchange on the backend, called with the
+    lock held. The completion its callback would have posted is posted
+    here, and the exchange fails when it resumes. FALSE when there was no
+    such wait, or its callback has been called already.
+--*/
+{
+    BOOL fCancelled = FALSE;
+
+    switch (m_localWait)
     {
-        return HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER);
+    case LOCAL_WAIT_POOL:
+        fCancelled = m_pServerProcess->QueryConnectionPool()->CancelWait(&m_poolWaiter);
+        break;
+
+    case LOCAL_WAIT_SOCKET:
+        fCancelled = m_pServerProcess->QueryConnectionPool()->QueryPoller()->Cancel(&m_socketWait);
+        break;
+
+    case LOCAL_WAIT_STREAM:
+        fCancelled = m_pStream->CancelWait();
+        break;
+
+    default:
+        break;
     }
-    while (*pchStatus == ' ')
+
+    if (fCancelled)
     {
-        pchStatus++;
+        m_fLocalWaitCancelled = TRUE;
+        m_pW3Context->PostCompletion(0);
+        DereferenceRequestHandler();
     }
-    if (*pchStatus == '\r' || *pchStatus == '\n')
+    return fCancelled;
+}
+
+// static
+VOID
+FORWARDING_HANDLER::LocalWaitCallback(
+    PVOID                       pvContext
+)
+{
+    FORWARDING_HANDLER *pHandler = static_cast<FORWARDING_HANDLER *>(pvContext);
+
+    pHandler->m_pW3Context->PostCompletion(0);
+    pHandler->DereferenceRequestHandler();
+}
+
+VOID
+FORWARDING_HANDLER::RecordPhases()
+/*++
+  Description:
+    Records the client writes of a request that went through to the end
+    and reports the time of each of its phases to FREB.
+--*/
+{
+    m_phaseClock.Complete();
+
+    if (ANCMEvents::ANCM_REQUEST_FORWARD_PHASES::IsEnabled(m_pW3Context->GetTraceContext()))
     {
-        pchStatus--;
+        ANCMEvents::ANCM_REQUEST_FORWARD_PHASES::RaiseEvent(
+            m_pW3Context->GetTraceContext(),
+            NULL,
+            m_phaseClock.QueryMicroseconds(REQUEST_PHASE_QUEUE),
+            m_phaseClock.QueryMicroseconds(REQUEST_PHASE_CONNECT),
+            m_phaseClock.QueryMicroseconds(REQUEST_PHASE_SEND),
+            m_phaseClock.QueryMicroseconds(REQUEST_PHASE_FIRST_BYTE),
+            m_phaseClock.QueryMicroseconds(REQUEST_PHASE_BODY),
+            m_phaseClock.QueryMicroseconds(REQUEST_PHASE_CLIENT_WRITE));
     }
+}
+
+VOID
+FORWARDING_HANDLER::ArmRequestTimeout()
+/*++
+  Description:
+    Arms the request timeout for the WinHTTP operation about to start,
+    called with the request lock held. The armed timeout holds a reference
+    on the handler.
+--*/
+{
+    ULONGLONG ullNow;
 
-    pchNewline = strchr(pchStatus, '\n');
-    if (pchNewline == NULL)
+    if (m_dwRequestTimeoutMs == INFINITE)
     {
-        return HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER);
+        return;
     }
 
-    if (uStatus != 200)
+    ullNow = GetTickCount64();
+    m_ullTimeoutDeadline = ullNow + m_dwRequestTimeoutMs;
+
+    ReferenceRequestHandler();
+    if (g_pTimerWheel->Arm(&m_timeoutEntry, m_dwRequestTimeoutMs, ullNow))
     {
         //
-        // Skip over any spaces before the '\n'
+        // Moved, it holds a reference already.
         //
-        for (pchEndofHeaderValue = pchNewline - 1;
-            (pchEndofHeaderValue > pchStatus) &&
-            ((*pchEndofHeaderValue == ' ') ||
-            (*pchEndofHeaderValue == '\r'));
-            pchEndofHeaderValue--)
-        {
-        }
+        DereferenceRequestHandler();
+    }
+}
 
-        //
-        // Copy the status description
-        //
-        if (FAILED_LOG(hr = strHeaderValue.Copy(
-            pchStatus,
-            (DWORD)(pchEndofHeaderValue - pchStatus) + 1)) ||
-            FAILED_LOG(hr = pResponse->SetStatus(uStatus,
-                strHeaderValue.QueryStr(),
-                0,
-                S_OK,
-                NULL,
-                TRUE)))
-        {
-            return hr;
-        }
+VOID
+FORWARDING_HANDLER::CancelRequestTimeout()
+{
+    if (m_dwRequestTimeoutMs == INFINITE)
+    {
+        return;
     }
 
-    for (index = static_cast<DWORD>(pchNewline - pszHeaders) + 1;
-        pszHeaders[index] != '\r' && pszHeaders[index] != '\n' && pszHeaders[index] != '\0';
-        index = static_cast<DWORD>(pchNewline - pszHeaders) + 1)
+    m_ullTimeoutDeadline = 0;
+
+    if (g_pTimerWheel->Cancel(&m_timeoutEntry))
     {
-        //
-        // Find the ':' in Header : Value\r\n
-        //
-        PCSTR pchColon = strchr(pszHeaders + index, ':');
+        DereferenceRequestHandler();
+    }
+}
 
-        //
-        // Find the '\n' in Header : Value\r\n
-        //
-        pchNewline = const_cast<PSTR>(strchr(pszHeaders + index, '\n'));
+// static
+VOID
+FORWARDING_HANDLER::RequestTimeoutCallback(
+    PVOID                       pvContext
+)
+{
+    FORWARDING_HANDLER *pHandler = static_cast<FORWARDING_HANDLER *>(pvContext);
 
-        if (pchNewline == NULL)
-        {
-            return HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER);
-        }
+    pHandler->OnRequestTimeout();
+    pHandler->DereferenceRequestHandler();
+}
 
-        //
-        // Take care of header continuation
-        //
-        while (pchNewline[1] == ' ' ||
-            pchNewline[1] == '\t')
-        {
-            pchNewline = strchr(pchNewline + 1, '\n');
-        }
+VOID
+FORWARDING_HANDLER::OnRequestTimeout()
+/*++
+  Description:
+    Closes the WinHTTP handle of a request whose WinHTTP operation ran past
+    the timeout, its completions then fail the request with
+    ERROR_WINHTTP_TIMEOUT. A local exchange has its wait on the backend
+    taken back instead.
+--*/
+{
+    AcquireLockExclusive();
 
-        DBG_ASSERT(
-            (pchColon != NULL) && (pchColon < pchNewline));
-        if ((pchColon == NULL) || (pchColon >= pchNewline))
-        {
-            return HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER);
-        }
+    //
+    // A completion that raced with the timer has cancelled the timeout or
+    // armed it again for the next operation, only a deadline that has
+    // passed still counts.
+    //
+    if (m_ullTimeoutDeadline != 0 &&
+        GetTickCount64() >= m_ullTimeoutDeadline &&
+        (m_RequestStatus == FORWARDER_SENDING_REQUEST ||
+         m_RequestStatus == FORWARDER_RECEIVING_RESPONSE) &&
+        m_hRequest != NULL &&
+        !m_fHttpHandleInClose)
+    {
+        m_ullTimeoutDeadline = 0;
+        m_fRequestTimedOut = TRUE;
+        m_fHttpHandleInClose = TRUE;
+        WinHttpCloseHandle(m_hRequest);
+        m_hRequest = NULL;
+    }
+    else if (m_ullTimeoutDeadline != 0 &&
+             GetTickCount64() >= m_ullTimeoutDeadline &&
+             m_RequestStatus == FORWARDER_LOCAL_EXCHANGE &&
+             CancelLocalWait())
+    {
+        m_ullTimeoutDeadline = 0;
+        m_fRequestTimedOut = TRUE;
+    }
 
-        //
-        // Skip over any spaces before the ':'
-        //
-        PCSTR pchEndofHeaderName;
-        for (pchEndofHeaderName = pchColon - 1;
-            (pchEndofHeaderName >= pszHeaders + index) &&
-            (*pchEndofHeaderName == ' ');
-            pchEndofHeaderName--)
-        {
-        }
+    ReleaseLockExclusive();
+}
+
+REQUEST_NOTIFICATION_STATUS
+FORWARDING_HANDLER::OnFlightCompletion()
+/*++
+  Description:
+    Resumes a request parked on an identical one, with a copy of its
+    response, or by forwarding it after all if there is none for it.
+--*/
+{
+    HRESULT                 hr;
+    RESPONSE_CACHE_ENTRY *  pEntry = m_flightWaiter.pEntry;
+    IHttpResponse *         pResponse = m_pW3Context->GetResponse();
 
-        pchEndofHeaderName++;
+    m_flightWaiter.pEntry = NULL;
 
-        //
-        // Copy the header name
-        //
-        if (FAILED_LOG(hr = strHeaderName.Copy(
-            pszHeaders + index,
-            (DWORD)(pchEndofHeaderName - pszHeaders) - index)))
-        {
-            return hr;
-        }
+    if (pEntry != NULL &&
+        !pEntry->MatchesVary(GetRequestHeader, m_pW3Context->GetRequest()))
+    {
+        pEntry->DereferenceCacheEntry();
+        pEntry = NULL;
+    }
+
+    if (pEntry == NULL)
+    {
+        m_RequestStatus = FORWARDER_START;
+        return OnExecuteRequestHandler();
+    }
+
+    m_RequestStatus = FORWARDER_DONE;
+
+    hr = SendCachedResponse(pEntry);
+    if (FAILED_LOG(hr))
+    {
+        pResponse->DisableKernelCache();
+        pResponse->GetRawHttpResponse()->EntityChunkCount = 0;
+        pResponse->SetStatus(502, "Bad Gateway", 3, hr);
+        return RQ_NOTIFICATION_FINISH_REQUEST;
+    }
+
+    return RQ_NOTIFICATION_CONTINUE;
+}
+
+BYTE *
+FORWARDING_HANDLER::GetNewResponseBuffer(
+    DWORD   dwBufferSize
+)
+{
+    DBG_ASSERT(dwBufferSize <= ENTITY_BUFFER_SIZE);
+    UNREFERENCED_PARAMETER(dwBufferSize);
 
+    if (m_cEntityBuffers < m_cEntityBuffersOwned)
+    {
         //
-        // Skip over the ':' and any trailing spaces
+        // Reuse a buffer from an earlier send, the response has been
+        // flushed since then.
         //
-        for (index = static_cast<DWORD>(pchColon - pszHeaders) + 1;
-            pszHeaders[index] == ' ';
-            index++)
-        {
-        }
+        return m_buffEntityBuffers.QueryPtr()[m_cEntityBuffers++];
+    }
+
+    DWORD dwNeededSize = (m_cEntityBuffersOwned + 1) * sizeof(BYTE *);
+    if (dwNeededSize > m_buffEntityBuffers.QuerySize() &&
+        !m_buffEntityBuffers.Resize(
+            max(dwNeededSize, m_buffEntityBuffers.QuerySize() * 2)))
+    {
+        return NULL;
+    }
+
+    BYTE *pBuffer = (BYTE *)sm_pEntityBufferAlloc->Alloc();
+    if (pBuffer == NULL)
+    {
+        return NULL;
+    }
+
+    m_buffEntityBuffers.QueryPtr()[m_cEntityBuffersOwned] = pBuffer;
+    m_cEntityBuffersOwned++;
+    m_cEntityBuffers++;
+
+    return pBuffer;
+}
+
+VOID
+FORWARDING_HANDLER::FreeResponseBuffers()
+/*++
+  Description:
+    Called once the buffered entity has been flushed, the buffers stay
+    with the handler for the next send.
+--*/
+{
+    m_cEntityBuffers = 0;
+    m_pEntityBuffer = NULL;
+    m_cBytesBuffered = 0;
+}
+
+VOID
+FORWARDING_HANDLER::ReleaseResponseBuffers()
+/*++
+  Description:
+    Returns every buffer the handler owns to the per-CPU cache.
+--*/
+{
+    BYTE **pBuffers = m_buffEntityBuffers.QueryPtr();
+    for (DWORD i = 0; i<m_cEntityBuffersOwned; i++)
+    {
+        sm_pEntityBufferAlloc->Free(pBuffers[i]);
+    }
+    m_cEntityBuffersOwned = 0;
+    FreeResponseBuffers();
+}
+
+HRESULT
+FORWARDING_HANDLER::SetStatusAndHeaders(
+    PSTR            pszHeaders,
+    DWORD           cchHeaders
+)
+{
+    HRESULT         hr;
+    IHttpResponse * pResponse = m_pW3Context->GetResponse();
+    IHttpRequest *  pRequest = m_pW3Context->GetRequest();
+    RESPONSE_HEADER_TOKENIZER tokenizer(pszHeaders, cchHeaders);
+    USHORT          uStatus;
+    PCSTR           pszName;
+    DWORD           cchName;
+    PCSTR           pszValue;
+    DWORD           cchValue;
+    BOOL            fServerHeaderPresent = FALSE;
+
+    _ASSERT(pszHeaders != NULL);
+
+    //
+    // The first line is the status line
+    //
+    if (FAILED_LOG(hr = tokenizer.ParseStatusLine(&uStatus, &pszValue, &cchValue)))
+    {
+        return hr;
+    }
 
+    if (m_fWebSocketEnabled && uStatus != 101)
+    {
         //
-        // Skip over any spaces before the '\n'
+        // Expected 101 response.
         //
-        for (pchEndofHeaderValue = pchNewline - 1;
-            (pchEndofHeaderValue >= pszHeaders + index) &&
-            ((*pchEndofHeaderValue == ' ') ||
-            (*pchEndofHeaderValue == '\r'));
-            pchEndofHeaderValue--)
-        {
-        }
 
-        pchEndofHeaderValue++;
+        m_fWebSocketEnabled = FALSE;
+    }
+
+    //
+    // Only 200 responses are cached, and not when the headers are
+    // rewritten for the host of the request.
+    //
+    if (m_pCacheWriter != NULL &&
+        (uStatus != 200 ||
+         m_fWebSocketEnabled ||
+         m_fDoReverseRewriteHeaders ||
+         FAILED(m_pCacheWriter->SetStatus(uStatus, pszValue, GetRequestHeader, pRequest))))
+    {
+        ReleaseResponseCapture();
+    }
 
+    if (uStatus != 200)
+    {
         //
-        // Copy the header value
+        // The reason phrase is null terminated in place by the tokenizer
         //
-        if (pchEndofHeaderValue == pszHeaders + index)
-        {
-            strHeaderValue.Reset();
-        }
-        else if (FAILED_LOG(hr = strHeaderValue.Copy(
-            pszHeaders + index,
-            (DWORD)(pchEndofHeaderValue - pszHeaders) - index)))
+        if (FAILED_LOG(hr = pResponse->SetStatus(uStatus,
+                pszValue,
+                0,
+                S_OK,
+                NULL,
+                TRUE)))
         {
             return hr;
         }
+    }
 
+    while ((hr = tokenizer.NextHeader(&pszName, &cchName, &pszValue, &cchValue)) == S_OK)
+    {
         //
         // Do not pass the transfer-encoding:chunked, Connection, Date or
         // Server headers along
         //
-        DWORD headerIndex = sm_pResponseHeaderHash->GetIndex(strHeaderName.QueryStr());
+        DWORD headerIndex = RESPONSE_HEADER_HASH::GetIndex(pszName, cchName);
         if (headerIndex == UNKNOWN_INDEX)
         {
-            hr = pResponse->SetHeader(strHeaderName.QueryStr(),
-                strHeaderValue.QueryStr(),
-                static_cast<USHORT>(strHeaderValue.QueryCCH()),
+            hr = pResponse->SetHeader(pszName,
+                pszValue,
+                static_cast<USHORT>(cchValue),
                 FALSE); // fReplace
         }
         else
@@ -2487,7 +4077,7 @@ FORWARDING_HANDLER::SetStatusAndHeaders(
             switch (headerIndex)
             {
             case HttpHeaderTransferEncoding:
-                if (!strHeaderValue.Equals("chunked", TRUE))
+                if (_stricmp(pszValue, "chunked") != 0)
                 {
                     break;
                 }
@@ -2503,20 +4093,42 @@ FORWARDING_HANDLER::SetStatusAndHeaders(
             case HttpHeaderContentLength:
                 if (pRequest->GetRawHttpRequest()->Verb != HttpVerbHEAD)
                 {
-                    m_cContentLength = _atoi64(strHeaderValue.QueryStr());
+                    m_cContentLength = _atoi64(pszValue);
                 }
                 break;
             }
 
             hr = pResponse->SetHeader(static_cast<HTTP_HEADER_ID>(headerIndex),
-                strHeaderValue.QueryStr(),
-                static_cast<USHORT>(strHeaderValue.QueryCCH()),
+                pszValue,
+                static_cast<USHORT>(cchValue),
                 TRUE); // fReplace
         }
         if (FAILED_LOG(hr))
         {
             return hr;
         }
+
+        if (m_pCacheWriter != NULL &&
+            FAILED(m_pCacheWriter->AddHeader(pszName, cchName, pszValue, cchValue)))
+        {
+            ReleaseResponseCapture();
+        }
+    }
+
+    if (FAILED_LOG(hr))
+    {
+        return hr;
+    }
+
+    //
+    // A response that is not cached is still captured for the requests
+    // waiting on this one.
+    //
+    if (m_pCacheWriter != NULL &&
+        (!m_pCacheWriter->EndHeaders() ||
+         (!m_pCacheWriter->IsCacheable() && m_pFlight == NULL)))
+    {
+        ReleaseResponseCapture();
     }
 
     //
@@ -2761,6 +4373,14 @@ FORWARDING_HANDLER::TerminateRequest(
         m_fClientDisconnected = fClientInitiated;
     }
 
+    //
+    // A local exchange waiting on the backend would not find out.
+    //
+    if (m_RequestStatus == FORWARDER_LOCAL_EXCHANGE)
+    {
+        CancelLocalWait();
+    }
+
     if (fLocked)
     {
         ReleaseLockExclusive();
@@ -9,6 +9,9 @@ class OUT_OF_PROCESS_APPLICATION;
 enum FORWARDING_REQUEST_STATUS
 {
     FORWARDER_START,
+    FORWARDER_WAITING_FOR_FLIGHT,
+    FORWARDER_WAITING_FOR_ADMISSION,
+    FORWARDER_LOCAL_EXCHANGE,
     FORWARDER_SENDING_REQUEST,
     FORWARDER_RECEIVING_RESPONSE,
     FORWARDER_RECEIVED_WEBSOCKET_RESPONSE,
@@ -16,6 +19,30 @@ enum FORWARDING_REQUEST_STATUS
     FORWARDER_FINISH_REQUEST
 };
 
+//
+// Where an exchange over a pooled connection or an h2c stream is, and what
+// it waits for while FORWARDER_LOCAL_EXCHANGE.
+//
+enum LOCAL_EXCHANGE_STEP
+{
+    LOCAL_EXCHANGE_CONNECT,
+    LOCAL_EXCHANGE_SEND_HEAD,
+    LOCAL_EXCHANGE_READ_BODY,
+    LOCAL_EXCHANGE_SEND_BODY,
+    LOCAL_EXCHANGE_RECEIVE_HEAD,
+    LOCAL_EXCHANGE_RECEIVE_BODY,
+    LOCAL_EXCHANGE_FLUSH
+};
+
+enum LOCAL_EXCHANGE_WAIT
+{
+    LOCAL_WAIT_NONE,
+    LOCAL_WAIT_POOL,
+    LOCAL_WAIT_SOCKET,
+    LOCAL_WAIT_STREAM,
+    LOCAL_WAIT_CLIENT
+};
+
 
 class FORWARDING_HANDLER : public REQUEST_HANDLER
 {
@@ -67,6 +94,24 @@ public:
     VOID
     StaticTerminate();
 
+    static
+    VOID
+    QueryEntityBufferCounters(
+        _Out_ ALLOC_CACHE_COUNTERS *    pCounters
+    );
+
+    static
+    VOID
+    QuerySpillCacheCounters(
+        _Out_ SIZE_CLASS_CACHE_COUNTERS *   pCounters
+    );
+
+    static
+    VOID
+    QueryPhaseLatencyCounters(
+        _Out_ REQUEST_PHASE_LATENCY_COUNTERS *  pCounters
+    );
+
     VOID
     TerminateRequest(
         bool    fClientInitiated
@@ -139,6 +184,137 @@ private:
     HRESULT
     OnReceivingResponse();
 
+    HRESULT
+    ReadRequestBody(
+        _Out_ BOOL *                pfEndOfBody
+    );
+
+    HRESULT
+    WriteRequestBody(
+        BOOL                        fLastChunk
+    );
+
+    VOID
+    ReleaseRequestBody();
+
+    BOOL
+    IsAuthenticatedRequest(
+        _In_ const PROTOCOL_CONFIG * pProtocol
+    );
+
+    HRESULT
+    ServeFromResponseCache(
+        _In_ RESPONSE_CACHE *       pResponseCache,
+        _In_opt_ REQUEST_COALESCER * pCoalescer,
+        _Out_ BOOL *                pfServed,
+        _Out_ BOOL *                pfWaiting
+    );
+
+    HRESULT
+    SendCachedResponse(
+        _In_ RESPONSE_CACHE_ENTRY * pEntry
+    );
+
+    VOID
+    ReleaseResponseCapture();
+
+    REQUEST_NOTIFICATION_STATUS
+    OnFlightCompletion();
+
+    VOID
+    CompleteFlight(
+        _In_opt_ RESPONSE_CACHE_ENTRY * pEntry
+    );
+
+    static
+    VOID
+    FlightCompletionCallback(
+        PVOID                       pvContext
+    );
+
+    ADMISSION_RESULT
+    EnterAdmissionQueue(
+        _In_ ADMISSION_LIMITER *    pLimiter
+    );
+
+    REQUEST_NOTIFICATION_STATUS
+    OnAdmissionCompletion();
+
+    VOID
+    ReleaseAdmission();
+
+    VOID
+    ReleaseOutstandingRequest();
+
+    VOID
+    ReleaseRequestHeaders();
+
+    static
+    VOID
+    AdmissionCompletionCallback(
+        PVOID                       pvContext,
+        BOOL                        fAdmitted
+    );
+
+    HRESULT
+    StartLocalExchange(
+        _In_ const PROTOCOL_CONFIG *    pProtocol,
+        _In_ STRU *                     pstrUrl
+    );
+
+    REQUEST_NOTIFICATION_STATUS
+    OnLocalExchangeCompletion(
+        DWORD                       cbCompletion,
+        HRESULT                     hrCompletionStatus
+    );
+
+    HRESULT
+    ContinueLocalExchange(
+        DWORD                       cbCompletion,
+        HRESULT                     hrCompletionStatus,
+        _Out_ BOOL *                pfPending
+    );
+
+    BOOL
+    PendLocalWait(
+        _Inout_ HRESULT *           phr,
+        LOCAL_EXCHANGE_WAIT         wait,
+        BOOL                        fWrite
+    );
+
+    HRESULT
+    SendLocalData();
+
+    VOID
+    ReconnectLocalExchange();
+
+    BOOL
+    CancelLocalWait();
+
+    static
+    VOID
+    LocalWaitCallback(
+        PVOID                       pvContext
+    );
+
+    VOID
+    RecordPhases();
+
+    VOID
+    ArmRequestTimeout();
+
+    VOID
+    CancelRequestTimeout();
+
+    VOID
+    OnRequestTimeout();
+
+    static
+    VOID
+    RequestTimeoutCallback(
+        PVOID                       pvContext
+    );
+
     BYTE *
     GetNewResponseBuffer(
         DWORD   dwBufferSize
@@ -147,9 +323,12 @@ private:
     VOID
     FreeResponseBuffers();
 
+    VOID
+    ReleaseResponseBuffers();
+
     HRESULT
     SetStatusAndHeaders(
-        PCSTR               pszHeaders,
+        PSTR                pszHeaders,
         DWORD               cchHeaders
     );
 
@@ -207,6 +386,13 @@ private:
     PCSTR                               m_pszOriginalHostHeader;
     PCWSTR                              m_pszHeaders;
     //
+    // Forwarded request headers, m_pszHeaders points into it. Only small
+    // header sets fit inline, larger ones spill to sm_pSpillCache until the
+    // request has been sent.
+    //
+    static const SIZE_T                 INLINE_HEADERS_CCH = 256;
+    BUFFER_T<WCHAR, INLINE_HEADERS_CCH> m_bufHeaders;
+    //
     // Record the number of winhttp handles in use
     // release IIS pipeline only after all handles got closed
     //
@@ -215,7 +401,13 @@ private:
     DWORD                               m_BytesToReceive;
     DWORD                               m_BytesToSend;
     DWORD                               m_cchLastSend;
+    //
+    // Entity buffers form a ring owned by the handler: m_cEntityBuffers are
+    // in use by the current send, the rest of the m_cEntityBuffersOwned
+    // buffers in m_buffEntityBuffers are reused before going to the pool.
+    //
     DWORD                               m_cEntityBuffers;
+    DWORD                               m_cEntityBuffersOwned;
     DWORD                               m_cBytesBuffered;
     DWORD                               m_cMinBufferLimit;
     ULONGLONG                           m_cContentLength;
@@ -225,10 +417,77 @@ private:
     BYTE *                              m_pEntityBuffer;
     static const SIZE_T                 INLINE_ENTITY_BUFFERS = 8;
     BUFFER_T<BYTE*, INLINE_ENTITY_BUFFERS> m_buffEntityBuffers;
+    //
+    // Request body reads are collected here and sent in batches.
+    //
+    REQUEST_BODY_BATCH                  m_requestBody;
+    //
+    // The cached response being sent, or the capture of a response that
+    // may go into the response cache.
+    //
+    RESPONSE_CACHE_ENTRY *              m_pCachedResponse;
+    RESPONSE_CACHE_WRITER *             m_pCacheWriter;
+    //
+    // The flight this request leads, or the waiter it parks with on the
+    // flight of an identical request. A request is coalesced only once.
+    //
+    REQUEST_FLIGHT *                    m_pFlight;
+    FLIGHT_WAITER                       m_flightWaiter;
+    BOOL                                m_fCoalesced;
+    //
+    // The place of this request in the admission queue of the application.
+    // m_fAdmitted is set while it holds one of the in-flight slots, and a
+    // request goes through admission only once.
+    //
+    ADMISSION_WAITER                    m_admissionWaiter;
+    BOOL                                m_fAdmissionChecked;
+    volatile LONG                       m_fAdmitted;
+    //
+    // The request timeout, armed on the timing wheel while a WinHTTP
+    // operation is in progress. m_ullTimeoutDeadline is 0 when it is not.
+    //
+    TIMER_WHEEL_ENTRY                   m_timeoutEntry;
+    DWORD                               m_dwRequestTimeoutMs;
+    ULONGLONG                           m_ullTimeoutDeadline;
+    BOOL                                m_fRequestTimedOut;
+    //
+    // A request on a pooled backend connection or an h2c stream is
+    // exchanged a step at a time, see ContinueLocalExchange.
+    // m_straLocalRequest is the request head it sends, m_pbLocalSend and
+    // m_cbLocalSend what is left to send of the head or of a body frame,
+    // m_pbLocalReceive the buffer the response body is read into.
+    //
+    STRA                                m_straLocalRequest;
+    LOCAL_EXCHANGE_STEP                 m_localStep;
+    LOCAL_EXCHANGE_WAIT                 m_localWait;
+    BOOL                                m_fLocalWaitCancelled;
+    POOL_WAITER                         m_poolWaiter;
+    LOCAL_SOCKET_WAIT                   m_socketWait;
+    POOLED_CONNECTION *                 m_pPooledConnection;
+    H2_STREAM *                         m_pStream;
+    BOOL                                m_fLocalReused;
+    BOOL                                m_fLocalRetried;
+    BOOL                                m_fLocalNoBody;
+    BOOL                                m_fEndOfRequestBody;
+    BOOL                                m_fLocalClientError;
+    const BYTE *                        m_pbLocalSend;
+    DWORD                               m_cbLocalSend;
+    BYTE *                              m_pbLocalReceive;
+    //
+    // When each phase of the request started and how long it took, for
+    // the phase histograms of all requests in sm_pPhaseLatency.
+    //
+    REQUEST_PHASE_CLOCK                 m_phaseClock;
 
     static ALLOC_CACHE_HANDLER *        sm_pAlloc;
+    static ALLOC_CACHE_HANDLER *        sm_pEntityBufferAlloc;
+    static ALLOC_CACHE_HANDLER *        sm_pRequestBodyAlloc;
     static PROTOCOL_CONFIG              sm_ProtocolConfig;
-    static RESPONSE_HEADER_HASH *       sm_pResponseHeaderHash;
+    static REQUEST_PHASE_LATENCY *      sm_pPhaseLatency;
+    //
+    // Where the buffers of each request spill to, see the constructor.
+    //
+    static SIZE_CLASS_CACHE *           sm_pSpillCache;
     //
     // Reference cout tracing for debugging purposes.
     //
@@ -239,5 +498,13 @@ private:
     mutable LONG                        m_cRefs;
     IHttpContext*                       m_pW3Context;
     OUT_OF_PROCESS_APPLICATION*         m_pApplication;
+    //
+    // Process the request was forwarded to. m_fOutstanding is set while
+    // the request counts as outstanding on it, from when it is forwarded
+    // until the backend response is complete or upgraded to a websocket,
+    // not for the time the client takes to read it.
+    //
+    SERVER_PROCESS*                     m_pServerProcess;
+    volatile LONG                       m_fOutstanding;
     HTTP_MODULE_ID                      m_pModuleId;
 };
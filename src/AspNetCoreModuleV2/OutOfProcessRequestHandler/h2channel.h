@@ -0,0 +1,372 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#pragma once
+
+#include "h2connection.h"
+
+//
+// What an H2_CHANNEL has done, for tests and diagnostics. cSpilled counts
+// the streams that found every connection at the backend's stream limit
+// and went over HTTP/1.1 instead.
+//
+struct H2_CHANNEL_COUNTERS
+{
+    ULONGLONG   cConnects;
+    ULONGLONG   cConnectFailures;
+    ULONGLONG   cStreams;
+    ULONGLONG   cSpilled;
+    DWORD       cConnections;
+    DWORD       cActiveStreams;
+};
+
+//
+// H2_CHANNEL keeps a few h2c connections to one backend process and opens
+// the streams of FORWARDING_HANDLER on them, set with backendProtocol="h2c"
+// and h2cConnections. A connection is opened when there is none to use or
+// every open one is carrying requests, up to the limit, after which streams
+// go to the connection with the fewest. Connections the backend ends are
+// replaced on the next request.
+//
+// A backend that does not take prior knowledge h2c declines the channel
+// and every request goes over HTTP/1.1, see BACKEND_CONNECTION_POOL.
+//
+class H2_CHANNEL
+{
+public:
+
+    static const DWORD      MAX_CONNECTIONS = 16;
+
+    H2_CHANNEL() :
+        m_cRefs(1),
+        m_transport(LOCAL_TRANSPORT_TCP),
+        m_usPort(0),
+        m_dwTimeoutMs(0),
+        m_cbMaxHead(0),
+        m_cConnections(0),
+        m_fDeclined(FALSE),
+        m_fShutdown(FALSE),
+        m_cConnects(0),
+        m_cConnectFailures(0),
+        m_cStreams(0),
+        m_cSpilled(0)
+    {
+        InitializeSRWLock(&m_srwLock);
+        m_szPath[0] = '\0';
+        ZeroMemory(m_rgpConnections, sizeof(m_rgpConnections));
+    }
+
+    VOID
+    ReferenceChannel()
+    {
+        InterlockedIncrement(&m_cRefs);
+    }
+
+    VOID
+    DereferenceChannel()
+    {
+        if (InterlockedDecrement(&m_cRefs) == 0)
+        {
+            delete this;
+        }
+    }
+
+    HRESULT
+    Initialize(
+        LOCAL_TRANSPORT     transport,
+        _In_opt_ PCSTR      pszPath,
+        USHORT              usPort,
+        DWORD               dwTimeoutMs,
+        DWORD               cbMaxHead,
+        DWORD               cConnections
+    )
+    {
+        if (transport == LOCAL_TRANSPORT_UNIX_SOCKET)
+        {
+            if (pszPath == NULL || strlen(pszPath) >= sizeof(m_szPath))
+            {
+                return HRESULT_FROM_WIN32(ERROR_BAD_PATHNAME);
+            }
+            memcpy(m_szPath, pszPath, strlen(pszPath) + 1);
+        }
+
+        if (cbMaxHead == 0 || cConnections == 0 || cConnections > MAX_CONNECTIONS)
+        {
+            return E_INVALIDARG;
+        }
+
+        m_transport = transport;
+        m_usPort = usPort;
+        m_dwTimeoutMs = dwTimeoutMs;
+        m_cbMaxHead = cbMaxHead;
+        m_cConnections = cConnections;
+        return S_OK;
+    }
+
+    //
+    // Opens the first connection, ERROR_NOT_SUPPORTED when the backend
+    // does not speak h2c.
+    //
+    HRESULT
+    Probe()
+    {
+        HRESULT hr;
+
+        AcquireSRWLockExclusive(&m_srwLock);
+        hr = (m_rgpConnections[0] == NULL) ? Connect(0) : S_OK;
+        ReleaseSRWLockExclusive(&m_srwLock);
+        return hr;
+    }
+
+    //
+    // A stream for one request. ERROR_NOT_SUPPORTED once the backend has
+    // declined h2c, ERROR_BUSY when every connection is at its stream
+    // limit; the request goes over HTTP/1.1 then.
+    //
+    HRESULT
+    OpenStream(
+        _Out_ H2_STREAM **      ppStream
+    )
+    {
+        HRESULT     hr = HRESULT_FROM_WIN32(ERROR_BUSY);
+        DWORD       rgiOrder[MAX_CONNECTIONS];
+        DWORD       cOrder = 0;
+        DWORD       iEmpty = MAXDWORD;
+
+        *ppStream = NULL;
+
+        AcquireSRWLockExclusive(&m_srwLock);
+
+        if (m_fDeclined || m_fShutdown)
+        {
+            ReleaseSRWLockExclusive(&m_srwLock);
+            return HRESULT_FROM_WIN32(m_fDeclined ? ERROR_NOT_SUPPORTED : ERROR_OPERATION_ABORTED);
+        }
+
+        //
+        // Drop the connections that take no new streams, their open
+        // streams keep them until they are closed. The rest are tried
+        // with the least loaded first.
+        //
+        for (DWORD i = 0; i < m_cConnections; i++)
+        {
+            H2_CONNECTION *pConnection = m_rgpConnections[i];
+
+            if (pConnection != NULL && !pConnection->IsUsable())
+            {
+                pConnection->Retire();
+                pConnection->DereferenceConnection();
+                m_rgpConnections[i] = pConnection = NULL;
+            }
+
+            if (pConnection == NULL)
+            {
+                if (iEmpty == MAXDWORD)
+                {
+                    iEmpty = i;
+                }
+                continue;
+            }
+
+            DWORD cStreams = pConnection->QueryStreamCount();
+            DWORD iInsert = cOrder++;
+
+            while (iInsert > 0 && m_rgpConnections[rgiOrder[iInsert - 1]]->QueryStreamCount() > cStreams)
+            {
+                rgiOrder[iInsert] = rgiOrder[iInsert - 1];
+                iInsert--;
+            }
+            rgiOrder[iInsert] = i;
+        }
+
+        if (iEmpty != MAXDWORD &&
+            (cOrder == 0 || m_rgpConnections[rgiOrder[0]]->QueryStreamCount() != 0))
+        {
+            hr = Connect(iEmpty);
+            if (SUCCEEDED(hr))
+            {
+                memmove(rgiOrder + 1, rgiOrder, cOrder * sizeof(DWORD));
+                rgiOrder[0] = iEmpty;
+                cOrder++;
+            }
+            else if (m_fDeclined || cOrder == 0)
+            {
+                ReleaseSRWLockExclusive(&m_srwLock);
+                return hr;
+            }
+        }
+
+        for (DWORD i = 0; i < cOrder; i++)
+        {
+            hr = m_rgpConnections[rgiOrder[i]]->OpenStream(ppStream);
+            if (SUCCEEDED(hr))
+            {
+                break;
+            }
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            m_cStreams++;
+        }
+        else
+        {
+            m_cSpilled++;
+            hr = HRESULT_FROM_WIN32(ERROR_BUSY);
+        }
+
+        ReleaseSRWLockExclusive(&m_srwLock);
+        return hr;
+    }
+
+    VOID
+    CloseStream(
+        _In_ H2_STREAM *    pStream
+    )
+    {
+        //
+        // The stream holds a reference on its connection, which holds none
+        // on the channel.
+        //
+        pStream->m_pConnection->CloseStream(pStream);
+    }
+
+    BOOL
+    IsDeclined()
+    {
+        BOOL fDeclined;
+
+        AcquireSRWLockShared(&m_srwLock);
+        fDeclined = m_fDeclined;
+        ReleaseSRWLockShared(&m_srwLock);
+        return fDeclined;
+    }
+
+    //
+    // Ends every connection, the streams still open on them fail.
+    //
+    VOID
+    Shutdown()
+    {
+        H2_CONNECTION *rgpConnections[MAX_CONNECTIONS];
+
+        AcquireSRWLockExclusive(&m_srwLock);
+        m_fShutdown = TRUE;
+        memcpy(rgpConnections, m_rgpConnections, sizeof(rgpConnections));
+        ZeroMemory(m_rgpConnections, sizeof(m_rgpConnections));
+        ReleaseSRWLockExclusive(&m_srwLock);
+
+        for (DWORD i = 0; i < MAX_CONNECTIONS; i++)
+        {
+            if (rgpConnections[i] != NULL)
+            {
+                rgpConnections[i]->Shutdown();
+                rgpConnections[i]->DereferenceConnection();
+            }
+        }
+    }
+
+    VOID
+    QueryCounters(
+        _Out_ H2_CHANNEL_COUNTERS *     pCounters
+    )
+    {
+        AcquireSRWLockShared(&m_srwLock);
+        pCounters->cConnects = m_cConnects;
+        pCounters->cConnectFailures = m_cConnectFailures;
+        pCounters->cStreams = m_cStreams;
+        pCounters->cSpilled = m_cSpilled;
+        pCounters->cConnections = 0;
+        pCounters->cActiveStreams = 0;
+        for (DWORD i = 0; i < m_cConnections; i++)
+        {
+            if (m_rgpConnections[i] != NULL)
+            {
+                pCounters->cConnections++;
+                pCounters->cActiveStreams += m_rgpConnections[i]->QueryStreamCount();
+            }
+        }
+        ReleaseSRWLockShared(&m_srwLock);
+    }
+
+    //
+    // Writes the counters to the debug log.
+    //
+    VOID
+    Dump()
+    {
+        H2_CHANNEL_COUNTERS counters;
+
+        QueryCounters(&counters);
+
+        DebugPrintf(ASPNETCORE_DEBUG_FLAG_INFO,
+            "H2_CHANNEL: %I64u connects, %I64u connect failures, %I64u streams, %I64u spilled, %u connections, %u active streams",
+            counters.cConnects,
+            counters.cConnectFailures,
+            counters.cStreams,
+            counters.cSpilled,
+            counters.cConnections,
+            counters.cActiveStreams);
+    }
+
+private:
+
+    ~H2_CHANNEL()
+    {
+        for (DWORD i = 0; i < MAX_CONNECTIONS; i++)
+        {
+            if (m_rgpConnections[i] != NULL)
+            {
+                m_rgpConnections[i]->Shutdown();
+                m_rgpConnections[i]->DereferenceConnection();
+            }
+        }
+    }
+
+    //
+    // Opens the connection of slot i with m_srwLock held. Requests wait
+    // for it, it is one exchange with a process on this machine.
+    //
+    HRESULT
+    Connect(
+        DWORD       i
+    )
+    {
+        HRESULT hr;
+
+        hr = H2_CONNECTION::Create(m_transport,
+                                   m_transport == LOCAL_TRANSPORT_UNIX_SOCKET ? m_szPath : NULL,
+                                   m_usPort,
+                                   m_dwTimeoutMs,
+                                   m_cbMaxHead,
+                                   &m_rgpConnections[i]);
+        if (FAILED(hr))
+        {
+            m_cConnectFailures++;
+            if (hr == HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED))
+            {
+                m_fDeclined = TRUE;
+            }
+            return hr;
+        }
+
+        m_cConnects++;
+        return S_OK;
+    }
+
+    LONG                m_cRefs;
+    SRWLOCK             m_srwLock;
+    LOCAL_TRANSPORT     m_transport;
+    CHAR                m_szPath[sizeof(sockaddr_un::sun_path)];
+    USHORT              m_usPort;
+    DWORD               m_dwTimeoutMs;
+    DWORD               m_cbMaxHead;
+    DWORD               m_cConnections;
+    H2_CONNECTION *     m_rgpConnections[MAX_CONNECTIONS];
+    BOOL                m_fDeclined;
+    BOOL                m_fShutdown;
+    ULONGLONG           m_cConnects;
+    ULONGLONG           m_cConnectFailures;
+    ULONGLONG           m_cStreams;
+    ULONGLONG           m_cSpilled;
+};
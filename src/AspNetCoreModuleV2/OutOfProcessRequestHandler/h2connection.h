@@ -0,0 +1,2363 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#pragma once
+
+#include "localhttpconnection.h"
+#include "hpack.h"
+
+//
+// H2_CONNECTION is a cleartext HTTP/2 connection to a backend on this
+// machine, opened with prior knowledge (RFC 7540 3.4), that carries many
+// requests at once as H2_STREAMs. FORWARDING_HANDLER uses it through
+// H2_CHANNEL in place of one LOCAL_HTTP_CONNECTION per request in flight.
+//
+// The calls of a stream block like those of LOCAL_HTTP_CONNECTION and take
+// the same HTTP/1.1 text: SendHead turns the request head FORWARDING_HANDLER
+// builds into a header block, and ReceiveResponseHead returns the response
+// headers as a status line and header lines, so the rest of the handler
+// does not know which protocol carried the request.
+//
+// A stream given an event callback with SetEventCallback does not block:
+// a call that would wait returns HRESULT_FROM_WIN32(ERROR_IO_PENDING) and
+// the callback is called once the stream has something for it, after which
+// the call is made again. The callback is called with m_srwLock held, from
+// the reader thread or a thread that changes the send window, and is only
+// to post the work elsewhere.
+//
+// A reader thread per connection receives every frame and hands DATA and
+// headers to their streams. m_srwLock guards the streams, the flow control
+// windows and the state of the connection, and each stream waits on its
+// own condition variable. m_srwSendLock serializes frames on the socket,
+// and with them the HPACK encoder and the stream ids, which must go out in
+// order. m_srwSendLock may be taken with m_srwLock free only.
+//
+// Flow control: the backend may send up to STREAM_WINDOW_SIZE of a
+// response ahead of the handler, the stream window is credited as the
+// handler reads. The connection window is credited as frames come in, the
+// stream windows bound what is buffered. The request body waits for both
+// windows of the backend.
+//
+
+enum H2_FRAME_TYPE
+{
+    H2_FRAME_DATA = 0x0,
+    H2_FRAME_HEADERS = 0x1,
+    H2_FRAME_PRIORITY = 0x2,
+    H2_FRAME_RST_STREAM = 0x3,
+    H2_FRAME_SETTINGS = 0x4,
+    H2_FRAME_PUSH_PROMISE = 0x5,
+    H2_FRAME_PING = 0x6,
+    H2_FRAME_GOAWAY = 0x7,
+    H2_FRAME_WINDOW_UPDATE = 0x8,
+    H2_FRAME_CONTINUATION = 0x9
+};
+
+typedef
+VOID
+(*PFN_H2_STREAM_EVENT)(
+    PVOID       pvContext
+);
+
+enum H2_ERROR_CODE
+{
+    H2_NO_ERROR = 0x0,
+    H2_PROTOCOL_ERROR = 0x1,
+    H2_INTERNAL_ERROR = 0x2,
+    H2_FLOW_CONTROL_ERROR = 0x3,
+    H2_SETTINGS_TIMEOUT = 0x4,
+    H2_STREAM_CLOSED = 0x5,
+    H2_FRAME_SIZE_ERROR = 0x6,
+    H2_REFUSED_STREAM = 0x7,
+    H2_CANCEL = 0x8,
+    H2_COMPRESSION_ERROR = 0x9
+};
+
+class H2_CONNECTION;
+
+//
+// One request. A stream is opened by H2_CONNECTION::OpenStream, used by one
+// thread at a time and given back with H2_CONNECTION::CloseStream, which
+// cancels it on the backend unless both sides have ended it.
+//
+class H2_STREAM
+{
+    friend class H2_CONNECTION;
+    friend class H2_CHANNEL;
+
+public:
+
+    //
+    // Bounds each wait of the calls below, 0 and INFINITE wait forever.
+    //
+    VOID
+    SetTimeout(
+        DWORD       dwTimeoutMs
+    )
+    {
+        m_dwTimeoutMs = (dwTimeoutMs == 0) ? INFINITE : dwTimeoutMs;
+    }
+
+    //
+    // Makes the calls below return pending in place of waiting, see above.
+    // Set before the stream is used.
+    //
+    VOID
+    SetEventCallback(
+        PFN_H2_STREAM_EVENT     pfnEvent,
+        PVOID                   pvContext
+    )
+    {
+        m_pfnEvent = pfnEvent;
+        m_pvEvent = pvContext;
+    }
+
+    //
+    // TRUE when a pending call was still waiting and its callback will not
+    // be called. Otherwise the callback has been called or is about to be.
+    //
+    BOOL
+    CancelWait();
+
+    //
+    // Sends the request line and headers of pszHead as a HEADERS frame,
+    // which ends the request when there is no body.
+    //
+    HRESULT
+    SendHead(
+        _In_reads_(cchHead) PCSTR       pszHead,
+        DWORD                           cchHead,
+        BOOL                            fEndStream
+    );
+
+    //
+    // Sends body data as it fits in the flow control windows, fEndStream
+    // with the last of it, which may be empty. *pcbSent is how much went
+    // out, all of it unless the call failed or is pending.
+    //
+    HRESULT
+    SendBody(
+        _In_reads_bytes_(cbData) const VOID *   pvData,
+        DWORD                                   cbData,
+        BOOL                                    fEndStream,
+        _Out_ DWORD *                           pcbSent
+    );
+
+    //
+    // Waits for the response headers and returns them as HTTP/1.1 text,
+    // valid until the stream is closed. Interim 1xx responses are skipped.
+    // fNoBody is accepted for LOCAL_HTTP_CONNECTION compatibility, the
+    // backend ends the stream of a response to HEAD itself.
+    //
+    HRESULT
+    ReceiveResponseHead(
+        BOOL                fNoBody,
+        _Outptr_ PSTR *     ppszHead,
+        _Out_ DWORD *       pcchHead,
+        _Out_ USHORT *      puStatus
+    );
+
+    //
+    // Reads up to cbBuffer bytes of the response body, *pcbRead is 0 at
+    // its end. Trailers are dropped.
+    //
+    HRESULT
+    ReadBody(
+        _Out_writes_bytes_(cbBuffer) VOID *     pvBuffer,
+        DWORD                                   cbBuffer,
+        _Out_ DWORD *                           pcbRead
+    );
+
+    //
+    // The backend did not act on the request: it refused the stream, its
+    // GOAWAY did not cover it, or the request never went out. It can go
+    // again on another connection.
+    //
+    BOOL
+    IsRefused() const
+    {
+        return m_fRefused;
+    }
+
+    DWORD
+    QueryId() const
+    {
+        return m_dwId;
+    }
+
+private:
+
+    struct H2_DATA_CHUNK
+    {
+        LIST_ENTRY  listEntry;
+        DWORD       ibData;
+        DWORD       cbData;
+    };
+
+    H2_STREAM(
+        H2_CONNECTION *     pConnection
+    );
+
+    ~H2_STREAM();
+
+    HRESULT
+    Wait(
+        CONDITION_VARIABLE *    pCondition
+    );
+
+    VOID
+    Notify();
+
+    VOID
+    UnlistSendWait();
+
+    LIST_ENTRY          m_hashEntry;
+    H2_CONNECTION *     m_pConnection;
+    DWORD               m_dwId;
+    DWORD               m_dwTimeoutMs;
+    LONGLONG            m_llSendWindow;
+    LONGLONG            m_llReceiveWindow;
+    DWORD               m_cbUnacked;
+    CONDITION_VARIABLE  m_cvEvent;
+    PFN_H2_STREAM_EVENT m_pfnEvent;
+    PVOID               m_pvEvent;
+    BOOL                m_fWaiting;
+    //
+    // On the send window list of the connection while waiting for it.
+    //
+    LIST_ENTRY          m_sendWaitEntry;
+    BOOL                m_fSendWaitListed;
+    LIST_ENTRY          m_dataList;
+    CHAR *              m_pchHead;
+    DWORD               m_cchHead;
+    USHORT              m_uStatus;
+    BOOL                m_fHashed;
+    BOOL                m_fHeadReceived;
+    BOOL                m_fEndReceived;
+    BOOL                m_fEndSent;
+    BOOL                m_fReset;
+    BOOL                m_fRefused;
+    HRESULT             m_hrError;
+};
+
+class H2_CONNECTION
+{
+    friend class H2_STREAM;
+
+public:
+
+    //
+    // The largest frame either end sends, the default SETTINGS_MAX_FRAME_SIZE.
+    //
+    static const DWORD      MAX_FRAME_SIZE = 16384;
+    static const DWORD      FRAME_HEADER_SIZE = 9;
+
+    //
+    // What the backend may send ahead of the handler on one stream, and on
+    // the whole connection.
+    //
+    static const DWORD      STREAM_WINDOW_SIZE = 256 * 1024;
+    static const DWORD      CONNECTION_WINDOW_SIZE = 16 * 1024 * 1024;
+
+    static const BYTE       FLAG_END_STREAM = 0x1;
+    static const BYTE       FLAG_ACK = 0x1;
+    static const BYTE       FLAG_END_HEADERS = 0x4;
+    static const BYTE       FLAG_PADDED = 0x8;
+    static const BYTE       FLAG_PRIORITY = 0x20;
+
+    static const WORD       SETTINGS_HEADER_TABLE_SIZE = 0x1;
+    static const WORD       SETTINGS_ENABLE_PUSH = 0x2;
+    static const WORD       SETTINGS_MAX_CONCURRENT_STREAMS = 0x3;
+    static const WORD       SETTINGS_INITIAL_WINDOW_SIZE = 0x4;
+    static const WORD       SETTINGS_MAX_FRAME_SIZE = 0x5;
+    static const WORD       SETTINGS_MAX_HEADER_LIST_SIZE = 0x6;
+
+    //
+    // Connects and exchanges SETTINGS within dwTimeoutMs, then starts the
+    // reader thread. A backend that answers the connection preface with
+    // anything but SETTINGS does not speak h2c and the connect fails with
+    // ERROR_NOT_SUPPORTED. cbMaxHead caps the response headers.
+    //
+    static
+    HRESULT
+    Create(
+        LOCAL_TRANSPORT             transport,
+        _In_opt_ PCSTR              pszPath,
+        USHORT                      usPort,
+        DWORD                       dwTimeoutMs,
+        DWORD                       cbMaxHead,
+        _Out_ H2_CONNECTION **      ppConnection
+    )
+    {
+        HRESULT         hr;
+        H2_CONNECTION * pConnection;
+
+        *ppConnection = NULL;
+
+        pConnection = new H2_CONNECTION();
+        if (pConnection == NULL)
+        {
+            return E_OUTOFMEMORY;
+        }
+
+        if (FAILED(hr = pConnection->Initialize(cbMaxHead)) ||
+            FAILED(hr = pConnection->Handshake(transport, pszPath, usPort, dwTimeoutMs)) ||
+            FAILED(hr = pConnection->StartReader()))
+        {
+            pConnection->DereferenceConnection();
+            return hr;
+        }
+
+        *ppConnection = pConnection;
+        return S_OK;
+    }
+
+    VOID
+    ReferenceConnection()
+    {
+        InterlockedIncrement(&m_cRefs);
+    }
+
+    VOID
+    DereferenceConnection()
+    {
+        if (InterlockedDecrement(&m_cRefs) == 0)
+        {
+            delete this;
+        }
+    }
+
+    //
+    // A stream for one request, which holds a reference on the connection
+    // until it is closed. ERROR_BUSY when the backend allows no more
+    // streams at once.
+    //
+    HRESULT
+    OpenStream(
+        _Out_ H2_STREAM **      ppStream
+    )
+    {
+        H2_STREAM *pStream;
+
+        *ppStream = NULL;
+
+        AcquireSRWLockExclusive(&m_srwLock);
+        if (FAILED(m_hrFailure) || m_fGoingAway)
+        {
+            ReleaseSRWLockExclusive(&m_srwLock);
+            return HRESULT_FROM_WIN32(ERROR_CONNECTION_ABORTED);
+        }
+        if (m_cStreams >= m_cPeerMaxStreams)
+        {
+            ReleaseSRWLockExclusive(&m_srwLock);
+            return HRESULT_FROM_WIN32(ERROR_BUSY);
+        }
+        m_cStreams++;
+        ReleaseSRWLockExclusive(&m_srwLock);
+
+        pStream = new H2_STREAM(this);
+        if (pStream == NULL)
+        {
+            AcquireSRWLockExclusive(&m_srwLock);
+            m_cStreams--;
+            ReleaseSRWLockExclusive(&m_srwLock);
+            return E_OUTOFMEMORY;
+        }
+
+        ReferenceConnection();
+        *ppStream = pStream;
+        return S_OK;
+    }
+
+    VOID
+    CloseStream(
+        _In_ H2_STREAM *    pStream
+    )
+    {
+        BOOL    fCancel = FALSE;
+        BOOL    fShutdown;
+        DWORD   dwId = pStream->m_dwId;
+
+        AcquireSRWLockExclusive(&m_srwLock);
+        if (pStream->m_fHashed)
+        {
+            RemoveEntryList(&pStream->m_hashEntry);
+            pStream->m_fHashed = FALSE;
+            fCancel = SUCCEEDED(m_hrFailure) &&
+                      !pStream->m_fReset &&
+                      !(pStream->m_fEndSent && pStream->m_fEndReceived);
+        }
+        pStream->UnlistSendWait();
+        m_cStreams--;
+        fShutdown = m_fGoingAway && m_cStreams == 0;
+        ReleaseSRWLockExclusive(&m_srwLock);
+
+        delete pStream;
+
+        if (fCancel)
+        {
+            BYTE rgbPayload[4];
+
+            WriteUInt32(rgbPayload, H2_CANCEL);
+            AcquireSRWLockExclusive(&m_srwSendLock);
+            WriteFrame(H2_FRAME_RST_STREAM, 0, dwId, rgbPayload, sizeof(rgbPayload));
+            ReleaseSRWLockExclusive(&m_srwSendLock);
+        }
+
+        //
+        // The last stream of a connection going away ends it.
+        //
+        if (fShutdown)
+        {
+            m_socket.Shutdown();
+        }
+
+        DereferenceConnection();
+    }
+
+    //
+    // Takes no new streams, lets the open ones finish and closes once the
+    // last one is closed.
+    //
+    VOID
+    Retire()
+    {
+        BOOL fShutdown;
+
+        AcquireSRWLockExclusive(&m_srwLock);
+        m_fGoingAway = TRUE;
+        fShutdown = (m_cStreams == 0);
+        ReleaseSRWLockExclusive(&m_srwLock);
+
+        if (fShutdown)
+        {
+            m_socket.Shutdown();
+        }
+    }
+
+    //
+    // Sends GOAWAY, fails the open streams and waits for the reader thread
+    // to exit.
+    //
+    VOID
+    Shutdown()
+    {
+        BYTE rgbPayload[8];
+
+        AcquireSRWLockExclusive(&m_srwLock);
+        m_fGoingAway = TRUE;
+        ReleaseSRWLockExclusive(&m_srwLock);
+
+        WriteUInt32(rgbPayload, 0);
+        WriteUInt32(rgbPayload + 4, H2_NO_ERROR);
+        AcquireSRWLockExclusive(&m_srwSendLock);
+        WriteFrame(H2_FRAME_GOAWAY, 0, 0, rgbPayload, sizeof(rgbPayload));
+        ReleaseSRWLockExclusive(&m_srwSendLock);
+
+        m_socket.Shutdown();
+
+        if (m_hReaderThread != NULL)
+        {
+            WaitForSingleObject(m_hReaderThread, INFINITE);
+        }
+    }
+
+    //
+    // Open to new streams: not failed and not going away.
+    //
+    BOOL
+    IsUsable()
+    {
+        BOOL fUsable;
+
+        AcquireSRWLockShared(&m_srwLock);
+        fUsable = SUCCEEDED(m_hrFailure) && !m_fGoingAway;
+        ReleaseSRWLockShared(&m_srwLock);
+        return fUsable;
+    }
+
+    DWORD
+    QueryStreamCount()
+    {
+        DWORD cStreams;
+
+        AcquireSRWLockShared(&m_srwLock);
+        cStreams = m_cStreams;
+        ReleaseSRWLockShared(&m_srwLock);
+        return cStreams;
+    }
+
+private:
+
+    static const DWORD      STREAM_BUCKETS = 64;
+    static const DWORD      READ_BUFFER_SIZE = 2 * (FRAME_HEADER_SIZE + MAX_FRAME_SIZE);
+    static const DWORD      DEFAULT_WINDOW_SIZE = 65535;
+    static const DWORD      MAX_WINDOW_SIZE = 0x7fffffff;
+    static const DWORD      MAX_STREAM_ID = 0x7fffffff;
+
+    struct H2_FRAME_HEADER
+    {
+        DWORD       cbLength;
+        BYTE        type;
+        BYTE        flags;
+        DWORD       dwStreamId;
+    };
+
+    H2_CONNECTION() :
+        m_cRefs(1),
+        m_cStreams(0),
+        m_cPeerMaxStreams(MAXDWORD),
+        m_dwNextStreamId(1),
+        m_llSendWindow(DEFAULT_WINDOW_SIZE),
+        m_cbPeerInitialWindow(DEFAULT_WINDOW_SIZE),
+        m_cbReceiveUnacked(0),
+        m_fGoingAway(FALSE),
+        m_hrFailure(S_OK),
+        m_hReaderThread(NULL),
+        m_cbMaxHead(0),
+        m_pbSend(NULL),
+        m_pbBlock(NULL),
+        m_cbBlock(0),
+        m_pbRead(NULL),
+        m_ibRead(0),
+        m_cbRead(0),
+        m_pbHeaderBlock(NULL),
+        m_cbHeaderBlock(0),
+        m_dwHeaderStreamId(0),
+        m_bHeaderFlags(0),
+        m_pchResponseHead(NULL),
+        m_cchResponseHead(0),
+        m_uResponseStatus(0),
+        m_fResponseHeadTooLarge(FALSE)
+    {
+        InitializeSRWLock(&m_srwLock);
+        InitializeSRWLock(&m_srwSendLock);
+        InitializeConditionVariable(&m_cvSendWindow);
+        InitializeListHead(&m_sendWaitList);
+        for (DWORD i = 0; i < STREAM_BUCKETS; i++)
+        {
+            InitializeListHead(&m_rgStreamBuckets[i]);
+        }
+    }
+
+    ~H2_CONNECTION()
+    {
+        if (m_hReaderThread != NULL)
+        {
+            CloseHandle(m_hReaderThread);
+        }
+        delete[] m_pbSend;
+        delete[] m_pbBlock;
+        delete[] m_pbRead;
+        delete[] m_pbHeaderBlock;
+        delete[] m_pchResponseHead;
+    }
+
+    HRESULT
+    Initialize(
+        DWORD       cbMaxHead
+    )
+    {
+        HRESULT hr;
+
+        m_cbMaxHead = cbMaxHead;
+        m_pbSend = new BYTE[FRAME_HEADER_SIZE + MAX_FRAME_SIZE];
+        m_pbRead = new BYTE[READ_BUFFER_SIZE];
+        m_pbHeaderBlock = new BYTE[MaxHeaderBlockSize()];
+        m_pchResponseHead = new CHAR[cbMaxHead + 1];
+        if (m_pbSend == NULL || m_pbRead == NULL || m_pbHeaderBlock == NULL || m_pchResponseHead == NULL)
+        {
+            return E_OUTOFMEMORY;
+        }
+
+        if (FAILED(hr = m_encoder.Initialize(HPACK_UTILITY::DEFAULT_TABLE_SIZE)) ||
+            FAILED(hr = m_decoder.Initialize(HPACK_UTILITY::DEFAULT_TABLE_SIZE, cbMaxHead)))
+        {
+            return hr;
+        }
+        return S_OK;
+    }
+
+    //
+    // A compressed block may be somewhat larger than the headers it holds.
+    //
+    DWORD
+    MaxHeaderBlockSize() const
+    {
+        return 2 * m_cbMaxHead + MAX_FRAME_SIZE;
+    }
+
+    HRESULT
+    Handshake(
+        LOCAL_TRANSPORT     transport,
+        _In_opt_ PCSTR      pszPath,
+        USHORT              usPort,
+        DWORD               dwTimeoutMs
+    )
+    {
+        static const CHAR   s_szPreface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+        HRESULT             hr;
+        BYTE                rgbStart[sizeof(s_szPreface) - 1 + FRAME_HEADER_SIZE + 3 * 6 + FRAME_HEADER_SIZE + 4];
+        BYTE *              pb = rgbStart;
+        H2_FRAME_HEADER     header;
+        const BYTE *        pbPayload;
+
+        if (FAILED(hr = m_socket.Connect(transport, pszPath, usPort)) ||
+            FAILED(hr = m_socket.SetTimeout(dwTimeoutMs == INFINITE ? 0 : dwTimeoutMs)))
+        {
+            return hr;
+        }
+
+        //
+        // The preface, our SETTINGS and the connection window, in one send.
+        //
+        memcpy(pb, s_szPreface, sizeof(s_szPreface) - 1);
+        pb += sizeof(s_szPreface) - 1;
+        pb = WriteFrameHeader(pb, 3 * 6, H2_FRAME_SETTINGS, 0, 0);
+        pb = WriteSetting(pb, SETTINGS_ENABLE_PUSH, 0);
+        pb = WriteSetting(pb, SETTINGS_INITIAL_WINDOW_SIZE, STREAM_WINDOW_SIZE);
+        pb = WriteSetting(pb, SETTINGS_MAX_HEADER_LIST_SIZE, m_cbMaxHead);
+        pb = WriteFrameHeader(pb, 4, H2_FRAME_WINDOW_UPDATE, 0, 0);
+        WriteUInt32(pb, CONNECTION_WINDOW_SIZE - DEFAULT_WINDOW_SIZE);
+        pb += 4;
+
+        if (FAILED(hr = m_socket.Send(rgbStart, static_cast<DWORD>(pb - rgbStart))))
+        {
+            return hr;
+        }
+
+        //
+        // An HTTP/1.1 server answers with a status line or closes.
+        //
+        hr = ReceiveFrame(&header, &pbPayload);
+        if (hr == HRESULT_FROM_WIN32(ERROR_CONNECTION_ABORTED) ||
+            hr == HRESULT_FROM_WIN32(ERROR_INVALID_DATA) ||
+            (SUCCEEDED(hr) && (header.type != H2_FRAME_SETTINGS ||
+                               (header.flags & FLAG_ACK) != 0 ||
+                               header.dwStreamId != 0)))
+        {
+            return HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED);
+        }
+
+        if (FAILED(hr) ||
+            FAILED(hr = OnSettings(&header, pbPayload)) ||
+            FAILED(hr = m_socket.SetTimeout(0)))
+        {
+            return hr;
+        }
+        return S_OK;
+    }
+
+    HRESULT
+    StartReader()
+    {
+        ReferenceConnection();
+        m_hReaderThread = CreateThread(NULL, 0, ReaderThreadProc, this, 0, NULL);
+        if (m_hReaderThread == NULL)
+        {
+            HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+
+            DereferenceConnection();
+            return hr;
+        }
+        return S_OK;
+    }
+
+    static
+    DWORD
+    WINAPI
+    ReaderThreadProc(
+        LPVOID      pvContext
+    )
+    {
+        H2_CONNECTION *pConnection = static_cast<H2_CONNECTION *>(pvContext);
+
+        pConnection->Fail(pConnection->ReadFrames());
+        pConnection->DereferenceConnection();
+        return 0;
+    }
+
+    //
+    // Receives frames until the connection ends or breaks the protocol.
+    //
+    HRESULT
+    ReadFrames()
+    {
+        HRESULT             hr;
+        H2_FRAME_HEADER     header;
+        const BYTE *        pbPayload;
+
+        for (;;)
+        {
+            if (FAILED(hr = ReceiveFrame(&header, &pbPayload)))
+            {
+                return hr;
+            }
+
+            //
+            // Nothing may come between the frames of a header block.
+            //
+            if (m_dwHeaderStreamId != 0 &&
+                (header.type != H2_FRAME_CONTINUATION || header.dwStreamId != m_dwHeaderStreamId))
+            {
+                return GoAway(H2_PROTOCOL_ERROR);
+            }
+
+            switch (header.type)
+            {
+            case H2_FRAME_DATA:
+                hr = OnData(&header, pbPayload);
+                break;
+
+            case H2_FRAME_HEADERS:
+            case H2_FRAME_CONTINUATION:
+                hr = OnHeaders(&header, pbPayload);
+                break;
+
+            case H2_FRAME_RST_STREAM:
+                hr = OnResetStream(&header, pbPayload);
+                break;
+
+            case H2_FRAME_SETTINGS:
+                hr = OnSettings(&header, pbPayload);
+                break;
+
+            case H2_FRAME_PING:
+                hr = OnPing(&header, pbPayload);
+                break;
+
+            case H2_FRAME_GOAWAY:
+                hr = OnGoAway(&header, pbPayload);
+                break;
+
+            case H2_FRAME_WINDOW_UPDATE:
+                hr = OnWindowUpdate(&header, pbPayload);
+                break;
+
+            case H2_FRAME_PUSH_PROMISE:
+                //
+                // Push was disabled.
+                //
+                hr = GoAway(H2_PROTOCOL_ERROR);
+                break;
+
+            default:
+                //
+                // PRIORITY and unknown frames.
+                //
+                hr = S_OK;
+                break;
+            }
+
+            if (FAILED(hr))
+            {
+                return hr;
+            }
+        }
+    }
+
+    //
+    // The next frame, its payload is valid until the next call.
+    //
+    HRESULT
+    ReceiveFrame(
+        _Out_ H2_FRAME_HEADER *     pHeader,
+        _Out_ const BYTE **         ppbPayload
+    )
+    {
+        HRESULT         hr;
+        const BYTE *    pb;
+
+        if (FAILED(hr = FillRead(FRAME_HEADER_SIZE)))
+        {
+            return hr;
+        }
+
+        pb = m_pbRead + m_ibRead;
+        pHeader->cbLength = (pb[0] << 16) | (pb[1] << 8) | pb[2];
+        pHeader->type = pb[3];
+        pHeader->flags = pb[4];
+        pHeader->dwStreamId = ReadUInt32(pb + 5) & MAX_STREAM_ID;
+
+        if (pHeader->cbLength > MAX_FRAME_SIZE)
+        {
+            //
+            // Also what the status line of an HTTP/1.1 server looks like.
+            //
+            return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+        }
+
+        if (FAILED(hr = FillRead(FRAME_HEADER_SIZE + pHeader->cbLength)))
+        {
+            return hr;
+        }
+
+        *ppbPayload = m_pbRead + m_ibRead + FRAME_HEADER_SIZE;
+        m_ibRead += FRAME_HEADER_SIZE + pHeader->cbLength;
+        return S_OK;
+    }
+
+    //
+    // Buffers at least cbNeeded bytes from m_ibRead on.
+    //
+    HRESULT
+    FillRead(
+        DWORD       cbNeeded
+    )
+    {
+        HRESULT hr;
+        DWORD   cbReceived;
+
+        if (m_ibRead + cbNeeded > READ_BUFFER_SIZE)
+        {
+            memmove(m_pbRead, m_pbRead + m_ibRead, m_cbRead - m_ibRead);
+            m_cbRead -= m_ibRead;
+            m_ibRead = 0;
+        }
+
+        while (m_cbRead - m_ibRead < cbNeeded)
+        {
+            if (FAILED(hr = m_socket.Receive(m_pbRead + m_cbRead, READ_BUFFER_SIZE - m_cbRead, &cbReceived)))
+            {
+                return hr;
+            }
+            if (cbReceived == 0)
+            {
+                return HRESULT_FROM_WIN32(ERROR_CONNECTION_ABORTED);
+            }
+            m_cbRead += cbReceived;
+        }
+        return S_OK;
+    }
+
+    //
+    // Strips the padding of a DATA or HEADERS payload.
+    //
+    static
+    HRESULT
+    RemovePadding(
+        _In_ const H2_FRAME_HEADER *    pHeader,
+        _Inout_ const BYTE **           ppbPayload,
+        _Out_ DWORD *                   pcbPayload
+    )
+    {
+        DWORD cbPadding;
+
+        *pcbPayload = pHeader->cbLength;
+        if ((pHeader->flags & FLAG_PADDED) == 0)
+        {
+            return S_OK;
+        }
+
+        if (pHeader->cbLength == 0)
+        {
+            return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+        }
+
+        cbPadding = (*ppbPayload)[0];
+        if (cbPadding >= pHeader->cbLength)
+        {
+            return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+        }
+
+        (*ppbPayload)++;
+        *pcbPayload = pHeader->cbLength - 1 - cbPadding;
+        return S_OK;
+    }
+
+    HRESULT
+    OnData(
+        _In_ const H2_FRAME_HEADER *    pHeader,
+        const BYTE *                    pbPayload
+    )
+    {
+        DWORD                   cbData;
+        DWORD                   cbCredit = 0;
+        H2_STREAM *             pStream;
+        H2_STREAM::H2_DATA_CHUNK * pChunk = NULL;
+
+        if (pHeader->dwStreamId == 0 ||
+            FAILED(RemovePadding(pHeader, &pbPayload, &cbData)))
+        {
+            return GoAway(H2_PROTOCOL_ERROR);
+        }
+
+        if (cbData != 0)
+        {
+            pChunk = reinterpret_cast<H2_STREAM::H2_DATA_CHUNK *>(new BYTE[sizeof(H2_STREAM::H2_DATA_CHUNK) + cbData]);
+            if (pChunk == NULL)
+            {
+                return GoAway(H2_INTERNAL_ERROR);
+            }
+            pChunk->ibData = 0;
+            pChunk->cbData = cbData;
+            memcpy(pChunk + 1, pbPayload, cbData);
+        }
+
+        AcquireSRWLockExclusive(&m_srwLock);
+
+        pStream = FindStream(pHeader->dwStreamId);
+        if (pStream != NULL && pStream->m_fHeadReceived && !pStream->m_fEndReceived)
+        {
+            pStream->m_llReceiveWindow -= pHeader->cbLength;
+            if (pStream->m_llReceiveWindow < 0)
+            {
+                ReleaseSRWLockExclusive(&m_srwLock);
+                delete[] reinterpret_cast<BYTE *>(pChunk);
+                return GoAway(H2_FLOW_CONTROL_ERROR);
+            }
+
+            //
+            // The padding is credited with the data it came with.
+            //
+            pStream->m_cbUnacked += pHeader->cbLength - cbData;
+            if (pChunk != NULL)
+            {
+                InsertTailList(&pStream->m_dataList, &pChunk->listEntry);
+                pChunk = NULL;
+            }
+            if (pHeader->flags & FLAG_END_STREAM)
+            {
+                pStream->m_fEndReceived = TRUE;
+            }
+            WakeStream(pStream);
+        }
+
+        //
+        // Data of a stream that was cancelled still counts against the
+        // connection.
+        //
+        m_cbReceiveUnacked += pHeader->cbLength;
+        if (m_cbReceiveUnacked >= CONNECTION_WINDOW_SIZE / 2)
+        {
+            cbCredit = m_cbReceiveUnacked;
+            m_cbReceiveUnacked = 0;
+        }
+
+        ReleaseSRWLockExclusive(&m_srwLock);
+
+        delete[] reinterpret_cast<BYTE *>(pChunk);
+
+        return (cbCredit != 0) ? WriteWindowUpdate(0, cbCredit) : S_OK;
+    }
+
+    //
+    // A HEADERS frame starts a block, CONTINUATION frames add to it. The
+    // block is decoded whether or not its stream is still open, the HPACK
+    // tables of both ends must see it.
+    //
+    HRESULT
+    OnHeaders(
+        _In_ const H2_FRAME_HEADER *    pHeader,
+        const BYTE *                    pbPayload
+    )
+    {
+        DWORD cbFragment = pHeader->cbLength;
+
+        if (pHeader->type == H2_FRAME_HEADERS)
+        {
+            if (pHeader->dwStreamId == 0 ||
+                FAILED(RemovePadding(pHeader, &pbPayload, &cbFragment)))
+            {
+                return GoAway(H2_PROTOCOL_ERROR);
+            }
+
+            if (pHeader->flags & FLAG_PRIORITY)
+            {
+                if (cbFragment < 5)
+                {
+                    return GoAway(H2_PROTOCOL_ERROR);
+                }
+                pbPayload += 5;
+                cbFragment -= 5;
+            }
+
+            m_cbHeaderBlock = 0;
+            m_dwHeaderStreamId = pHeader->dwStreamId;
+            m_bHeaderFlags = pHeader->flags;
+        }
+        else if (m_dwHeaderStreamId == 0)
+        {
+            return GoAway(H2_PROTOCOL_ERROR);
+        }
+
+        if (cbFragment > MaxHeaderBlockSize() - m_cbHeaderBlock)
+        {
+            return GoAway(H2_INTERNAL_ERROR);
+        }
+        memcpy(m_pbHeaderBlock + m_cbHeaderBlock, pbPayload, cbFragment);
+        m_cbHeaderBlock += cbFragment;
+
+        if ((pHeader->flags & FLAG_END_HEADERS) == 0)
+        {
+            return S_OK;
+        }
+
+        return OnHeaderBlock();
+    }
+
+    HRESULT
+    OnHeaderBlock()
+    {
+        DWORD       dwStreamId = m_dwHeaderStreamId;
+        H2_STREAM * pStream;
+        CHAR *      pchHead = NULL;
+
+        m_dwHeaderStreamId = 0;
+        m_cchResponseHead = 0;
+        m_uResponseStatus = 0;
+        m_fResponseHeadTooLarge = FALSE;
+
+        if (FAILED(m_decoder.Decode(m_pbHeaderBlock, m_cbHeaderBlock, AddResponseHeader, this)))
+        {
+            return GoAway(H2_COMPRESSION_ERROR);
+        }
+
+        //
+        // A final response gets a copy of the head, trailers are dropped.
+        //
+        if (m_uResponseStatus >= 200 && !m_fResponseHeadTooLarge)
+        {
+            if (FAILED(AppendResponseHead("\r\n", 2)))
+            {
+                m_fResponseHeadTooLarge = TRUE;
+            }
+            else
+            {
+                pchHead = new CHAR[m_cchResponseHead + 1];
+                if (pchHead == NULL)
+                {
+                    return GoAway(H2_INTERNAL_ERROR);
+                }
+                memcpy(pchHead, m_pchResponseHead, m_cchResponseHead);
+                pchHead[m_cchResponseHead] = '\0';
+            }
+        }
+
+        AcquireSRWLockExclusive(&m_srwLock);
+
+        pStream = FindStream(dwStreamId);
+        if (pStream != NULL && !pStream->m_fEndReceived)
+        {
+            if (!pStream->m_fHeadReceived)
+            {
+                if (pchHead != NULL)
+                {
+                    pStream->m_pchHead = pchHead;
+                    pStream->m_cchHead = m_cchResponseHead;
+                    pStream->m_uStatus = m_uResponseStatus;
+                    pStream->m_fHeadReceived = TRUE;
+                    pchHead = NULL;
+                }
+                else if (m_fResponseHeadTooLarge || m_uResponseStatus < 100)
+                {
+                    pStream->m_hrError = HRESULT_FROM_WIN32(m_fResponseHeadTooLarge ? ERROR_INSUFFICIENT_BUFFER : ERROR_INVALID_DATA);
+                }
+            }
+
+            if (m_bHeaderFlags & FLAG_END_STREAM)
+            {
+                pStream->m_fEndReceived = TRUE;
+            }
+            WakeStream(pStream);
+        }
+
+        ReleaseSRWLockExclusive(&m_srwLock);
+
+        delete[] pchHead;
+        return S_OK;
+    }
+
+    //
+    // Turns the decoded fields into a status line and header lines. A
+    // block that does not fit is decoded to its end all the same.
+    //
+    static
+    HRESULT
+    AddResponseHeader(
+        PVOID       pvContext,
+        PCSTR       pszName,
+        DWORD       cchName,
+        PCSTR       pszValue,
+        DWORD       cchValue
+    )
+    {
+        H2_CONNECTION * pConnection = static_cast<H2_CONNECTION *>(pvContext);
+        HRESULT         hr = S_OK;
+
+        if (pConnection->m_fResponseHeadTooLarge)
+        {
+            return S_OK;
+        }
+
+        if (cchName == 7 && memcmp(pszName, ":status", 7) == 0)
+        {
+            PCSTR pszReason;
+
+            if (cchValue != 3 || pConnection->m_cchResponseHead != 0 ||
+                pszValue[0] < '1' || pszValue[0] > '5' ||
+                pszValue[1] < '0' || pszValue[1] > '9' ||
+                pszValue[2] < '0' || pszValue[2] > '9')
+            {
+                pConnection->m_uResponseStatus = 0;
+                return S_OK;
+            }
+
+            pConnection->m_uResponseStatus = static_cast<USHORT>((pszValue[0] - '0') * 100 + (pszValue[1] - '0') * 10 + (pszValue[2] - '0'));
+            pszReason = QueryReasonPhrase(pConnection->m_uResponseStatus);
+
+            if (FAILED(hr = pConnection->AppendResponseHead("HTTP/1.1 ", 9)) ||
+                FAILED(hr = pConnection->AppendResponseHead(pszValue, 3)) ||
+                FAILED(hr = pConnection->AppendResponseHead(" ", 1)) ||
+                FAILED(hr = pConnection->AppendResponseHead(pszReason, static_cast<DWORD>(strlen(pszReason)))) ||
+                FAILED(hr = pConnection->AppendResponseHead("\r\n", 2)))
+            {
+                pConnection->m_fResponseHeadTooLarge = TRUE;
+            }
+            return S_OK;
+        }
+
+        if (pConnection->m_cchResponseHead == 0 || (cchName != 0 && pszName[0] == ':'))
+        {
+            //
+            // Trailers have no status, other pseudo headers are dropped.
+            //
+            return S_OK;
+        }
+
+        if (FAILED(hr = pConnection->AppendResponseHead(pszName, cchName)) ||
+            FAILED(hr = pConnection->AppendResponseHead(": ", 2)) ||
+            FAILED(hr = pConnection->AppendResponseHead(pszValue, cchValue)) ||
+            FAILED(hr = pConnection->AppendResponseHead("\r\n", 2)))
+        {
+            pConnection->m_fResponseHeadTooLarge = TRUE;
+        }
+        return S_OK;
+    }
+
+    HRESULT
+    AppendResponseHead(
+        _In_reads_(cch) PCSTR       pch,
+        DWORD                       cch
+    )
+    {
+        if (cch > m_cbMaxHead - m_cchResponseHead)
+        {
+            return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+        }
+        memcpy(m_pchResponseHead + m_cchResponseHead, pch, cch);
+        m_cchResponseHead += cch;
+        return S_OK;
+    }
+
+    //
+    // HTTP/2 has no reason phrase, IIS sends the one the status line has.
+    //
+    static
+    PCSTR
+    QueryReasonPhrase(
+        USHORT      uStatus
+    )
+    {
+        switch (uStatus)
+        {
+        case 200: return "OK";
+        case 201: return "Created";
+        case 202: return "Accepted";
+        case 204: return "No Content";
+        case 206: return "Partial Content";
+        case 301: return "Moved Permanently";
+        case 302: return "Found";
+        case 303: return "See Other";
+        case 304: return "Not Modified";
+        case 307: return "Temporary Redirect";
+        case 308: return "Permanent Redirect";
+        case 400: return "Bad Request";
+        case 401: return "Unauthorized";
+        case 403: return "Forbidden";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 408: return "Request Timeout";
+        case 409: return "Conflict";
+        case 410: return "Gone";
+        case 412: return "Precondition Failed";
+        case 413: return "Payload Too Large";
+        case 415: return "Unsupported Media Type";
+        case 429: return "Too Many Requests";
+        case 500: return "Internal Server Error";
+        case 501: return "Not Implemented";
+        case 502: return "Bad Gateway";
+        case 503: return "Service Unavailable";
+        case 504: return "Gateway Timeout";
+        default:  return "";
+        }
+    }
+
+    HRESULT
+    OnResetStream(
+        _In_ const H2_FRAME_HEADER *    pHeader,
+        const BYTE *                    pbPayload
+    )
+    {
+        H2_STREAM * pStream;
+        DWORD       dwErrorCode;
+
+        if (pHeader->dwStreamId == 0 || pHeader->cbLength != 4)
+        {
+            return GoAway(pHeader->cbLength != 4 ? H2_FRAME_SIZE_ERROR : H2_PROTOCOL_ERROR);
+        }
+
+        dwErrorCode = ReadUInt32(pbPayload);
+
+        AcquireSRWLockExclusive(&m_srwLock);
+
+        pStream = FindStream(pHeader->dwStreamId);
+        if (pStream != NULL)
+        {
+            pStream->m_fReset = TRUE;
+            if (dwErrorCode == H2_REFUSED_STREAM)
+            {
+                pStream->m_fRefused = TRUE;
+            }
+
+            //
+            // A response that came in whole may be followed by NO_ERROR
+            // for a request body the backend does not want.
+            //
+            if (!pStream->m_fEndReceived && SUCCEEDED(pStream->m_hrError))
+            {
+                pStream->m_hrError = HRESULT_FROM_WIN32(ERROR_CONNECTION_ABORTED);
+            }
+            WakeStream(pStream);
+            WakeSendWindow();
+        }
+
+        ReleaseSRWLockExclusive(&m_srwLock);
+        return S_OK;
+    }
+
+    HRESULT
+    OnSettings(
+        _In_ const H2_FRAME_HEADER *    pHeader,
+        const BYTE *                    pbPayload
+    )
+    {
+        if (pHeader->dwStreamId != 0)
+        {
+            return GoAway(H2_PROTOCOL_ERROR);
+        }
+
+        if (pHeader->flags & FLAG_ACK)
+        {
+            return S_OK;
+        }
+
+        if (pHeader->cbLength % 6 != 0)
+        {
+            return GoAway(H2_FRAME_SIZE_ERROR);
+        }
+
+        for (DWORD ib = 0; ib < pHeader->cbLength; ib += 6)
+        {
+            WORD    wId = static_cast<WORD>((pbPayload[ib] << 8) | pbPayload[ib + 1]);
+            DWORD   dwValue = ReadUInt32(pbPayload + ib + 2);
+
+            switch (wId)
+            {
+            case SETTINGS_HEADER_TABLE_SIZE:
+                AcquireSRWLockExclusive(&m_srwSendLock);
+                m_encoder.SetMaxTableSize(dwValue);
+                ReleaseSRWLockExclusive(&m_srwSendLock);
+                break;
+
+            case SETTINGS_MAX_CONCURRENT_STREAMS:
+                AcquireSRWLockExclusive(&m_srwLock);
+                m_cPeerMaxStreams = dwValue;
+                ReleaseSRWLockExclusive(&m_srwLock);
+                break;
+
+            case SETTINGS_INITIAL_WINDOW_SIZE:
+                if (dwValue > MAX_WINDOW_SIZE)
+                {
+                    return GoAway(H2_FLOW_CONTROL_ERROR);
+                }
+                ApplyInitialWindowSize(dwValue);
+                break;
+
+            case SETTINGS_MAX_FRAME_SIZE:
+                //
+                // Frames sent are never larger than the default, which
+                // any value must allow.
+                //
+                if (dwValue < MAX_FRAME_SIZE || dwValue > 0xffffff)
+                {
+                    return GoAway(H2_PROTOCOL_ERROR);
+                }
+                break;
+
+            default:
+                break;
+            }
+        }
+
+        AcquireSRWLockExclusive(&m_srwSendLock);
+        HRESULT hr = WriteFrame(H2_FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+        ReleaseSRWLockExclusive(&m_srwSendLock);
+        return hr;
+    }
+
+    //
+    // A new initial window changes the send window of every open stream
+    // by the difference, which may leave it below zero.
+    //
+    VOID
+    ApplyInitialWindowSize(
+        DWORD       cbWindow
+    )
+    {
+        LONGLONG llDelta;
+
+        AcquireSRWLockExclusive(&m_srwLock);
+
+        llDelta = static_cast<LONGLONG>(cbWindow) - m_cbPeerInitialWindow;
+        m_cbPeerInitialWindow = cbWindow;
+        for (DWORD i = 0; i < STREAM_BUCKETS; i++)
+        {
+            for (LIST_ENTRY *pEntry = m_rgStreamBuckets[i].Flink; pEntry != &m_rgStreamBuckets[i]; pEntry = pEntry->Flink)
+            {
+                CONTAINING_RECORD(pEntry, H2_STREAM, m_hashEntry)->m_llSendWindow += llDelta;
+            }
+        }
+        WakeSendWindow();
+
+        ReleaseSRWLockExclusive(&m_srwLock);
+    }
+
+    HRESULT
+    OnPing(
+        _In_ const H2_FRAME_HEADER *    pHeader,
+        const BYTE *                    pbPayload
+    )
+    {
+        HRESULT hr;
+
+        if (pHeader->dwStreamId != 0 || pHeader->cbLength != 8)
+        {
+            return GoAway(pHeader->cbLength != 8 ? H2_FRAME_SIZE_ERROR : H2_PROTOCOL_ERROR);
+        }
+
+        if (pHeader->flags & FLAG_ACK)
+        {
+            return S_OK;
+        }
+
+        AcquireSRWLockExclusive(&m_srwSendLock);
+        hr = WriteFrame(H2_FRAME_PING, FLAG_ACK, 0, pbPayload, 8);
+        ReleaseSRWLockExclusive(&m_srwSendLock);
+        return hr;
+    }
+
+    //
+    // Streams past the last one the backend processes were refused, the
+    // ones up to it finish. No new streams are opened.
+    //
+    HRESULT
+    OnGoAway(
+        _In_ const H2_FRAME_HEADER *    pHeader,
+        const BYTE *                    pbPayload
+    )
+    {
+        DWORD dwLastStreamId;
+
+        if (pHeader->dwStreamId != 0 || pHeader->cbLength < 8)
+        {
+            return GoAway(H2_PROTOCOL_ERROR);
+        }
+
+        dwLastStreamId = ReadUInt32(pbPayload) & MAX_STREAM_ID;
+
+        AcquireSRWLockExclusive(&m_srwLock);
+
+        m_fGoingAway = TRUE;
+        for (DWORD i = 0; i < STREAM_BUCKETS; i++)
+        {
+            for (LIST_ENTRY *pEntry = m_rgStreamBuckets[i].Flink; pEntry != &m_rgStreamBuckets[i]; pEntry = pEntry->Flink)
+            {
+                H2_STREAM *pStream = CONTAINING_RECORD(pEntry, H2_STREAM, m_hashEntry);
+
+                if (pStream->m_dwId > dwLastStreamId)
+                {
+                    pStream->m_fRefused = TRUE;
+                    pStream->m_fReset = TRUE;
+                    pStream->m_hrError = HRESULT_FROM_WIN32(ERROR_CONNECTION_ABORTED);
+                    WakeStream(pStream);
+                }
+            }
+        }
+        WakeSendWindow();
+
+        ReleaseSRWLockExclusive(&m_srwLock);
+        return S_OK;
+    }
+
+    HRESULT
+    OnWindowUpdate(
+        _In_ const H2_FRAME_HEADER *    pHeader,
+        const BYTE *                    pbPayload
+    )
+    {
+        DWORD       cbIncrement;
+        HRESULT     hr = S_OK;
+
+        if (pHeader->cbLength != 4)
+        {
+            return GoAway(H2_FRAME_SIZE_ERROR);
+        }
+
+        cbIncrement = ReadUInt32(pbPayload) & MAX_WINDOW_SIZE;
+
+        AcquireSRWLockExclusive(&m_srwLock);
+
+        if (pHeader->dwStreamId == 0)
+        {
+            m_llSendWindow += cbIncrement;
+            if (cbIncrement == 0 || m_llSendWindow > MAX_WINDOW_SIZE)
+            {
+                hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+            }
+        }
+        else
+        {
+            H2_STREAM *pStream = FindStream(pHeader->dwStreamId);
+
+            //
+            // A stream with a bad update is only that stream's problem, it
+            // fails and is reset when closed.
+            //
+            if (pStream != NULL)
+            {
+                pStream->m_llSendWindow += cbIncrement;
+                if ((cbIncrement == 0 || pStream->m_llSendWindow > MAX_WINDOW_SIZE) &&
+                    SUCCEEDED(pStream->m_hrError))
+                {
+                    pStream->m_hrError = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+                    WakeStream(pStream);
+                }
+            }
+        }
+        WakeSendWindow();
+
+        ReleaseSRWLockExclusive(&m_srwLock);
+
+        return FAILED(hr) ? GoAway(H2_FLOW_CONTROL_ERROR) : S_OK;
+    }
+
+    //
+    // Tells the backend why the connection ends, the reader then fails
+    // it with ERROR_INVALID_DATA.
+    //
+    HRESULT
+    GoAway(
+        H2_ERROR_CODE   errorCode
+    )
+    {
+        BYTE rgbPayload[8];
+
+        WriteUInt32(rgbPayload, 0);
+        WriteUInt32(rgbPayload + 4, errorCode);
+
+        AcquireSRWLockExclusive(&m_srwSendLock);
+        WriteFrame(H2_FRAME_GOAWAY, 0, 0, rgbPayload, sizeof(rgbPayload));
+        ReleaseSRWLockExclusive(&m_srwSendLock);
+
+        return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+    }
+
+    //
+    // The connection is done: every open stream that has not received its
+    // whole response fails, new ones are not opened.
+    //
+    VOID
+    Fail(
+        HRESULT     hr
+    )
+    {
+        AcquireSRWLockExclusive(&m_srwLock);
+
+        if (SUCCEEDED(m_hrFailure))
+        {
+            m_hrFailure = SUCCEEDED(hr) ? HRESULT_FROM_WIN32(ERROR_CONNECTION_ABORTED) : hr;
+        }
+
+        for (DWORD i = 0; i < STREAM_BUCKETS; i++)
+        {
+            for (LIST_ENTRY *pEntry = m_rgStreamBuckets[i].Flink; pEntry != &m_rgStreamBuckets[i]; pEntry = pEntry->Flink)
+            {
+                H2_STREAM *pStream = CONTAINING_RECORD(pEntry, H2_STREAM, m_hashEntry);
+
+                pStream->m_fReset = TRUE;
+                if (!pStream->m_fEndReceived && SUCCEEDED(pStream->m_hrError))
+                {
+                    pStream->m_hrError = HRESULT_FROM_WIN32(ERROR_CONNECTION_ABORTED);
+                }
+                WakeStream(pStream);
+            }
+        }
+        WakeSendWindow();
+
+        ReleaseSRWLockExclusive(&m_srwLock);
+
+        m_socket.Shutdown();
+    }
+
+    H2_STREAM *
+    FindStream(
+        DWORD       dwStreamId
+    )
+    {
+        LIST_ENTRY *pBucket = &m_rgStreamBuckets[(dwStreamId >> 1) % STREAM_BUCKETS];
+
+        for (LIST_ENTRY *pEntry = pBucket->Flink; pEntry != pBucket; pEntry = pEntry->Flink)
+        {
+            H2_STREAM *pStream = CONTAINING_RECORD(pEntry, H2_STREAM, m_hashEntry);
+
+            if (pStream->m_dwId == dwStreamId)
+            {
+                return pStream;
+            }
+        }
+        return NULL;
+    }
+
+    //
+    // Gives the stream an id and sends its headers, with m_srwSendLock
+    // held so that ids go out in order.
+    //
+    HRESULT
+    SendHeaders(
+        _In_ H2_STREAM *                pStream,
+        _In_reads_(cchHead) PCSTR       pszHead,
+        DWORD                           cchHead,
+        BOOL                            fEndStream
+    )
+    {
+        HRESULT     hr;
+        DWORD       cbBlock;
+        DWORD       cbNeeded = 3 * cchHead + 256;
+        DWORD       ibBlock;
+        BYTE        type = H2_FRAME_HEADERS;
+
+        AcquireSRWLockExclusive(&m_srwSendLock);
+
+        AcquireSRWLockExclusive(&m_srwLock);
+        if (FAILED(m_hrFailure) || m_fGoingAway || m_dwNextStreamId > MAX_STREAM_ID)
+        {
+            //
+            // Nothing went out, the request can go on another connection.
+            //
+            m_fGoingAway = TRUE;
+            pStream->m_fRefused = TRUE;
+            ReleaseSRWLockExclusive(&m_srwLock);
+            ReleaseSRWLockExclusive(&m_srwSendLock);
+            return HRESULT_FROM_WIN32(ERROR_CONNECTION_ABORTED);
+        }
+        ReleaseSRWLockExclusive(&m_srwLock);
+
+        //
+        // Every field of the head takes at most its length again as
+        // integer prefixes once encoded, the lower case copy of the head
+        // goes before the block.
+        //
+        if (m_cbBlock < cchHead + cbNeeded)
+        {
+            delete[] m_pbBlock;
+            m_cbBlock = 0;
+            m_pbBlock = new BYTE[cchHead + cbNeeded];
+            if (m_pbBlock == NULL)
+            {
+                ReleaseSRWLockExclusive(&m_srwSendLock);
+                return E_OUTOFMEMORY;
+            }
+            m_cbBlock = cchHead + cbNeeded;
+        }
+
+        hr = EncodeRequestHead(pszHead, cchHead, reinterpret_cast<CHAR *>(m_pbBlock), m_pbBlock + cchHead, cbNeeded, &cbBlock);
+        if (FAILED(hr))
+        {
+            //
+            // A malformed head fails before the encoder takes any of it, a
+            // partly encoded one would leave the backend's table behind.
+            //
+            if (hr != HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER))
+            {
+                ReleaseSRWLockExclusive(&m_srwSendLock);
+                Fail(hr);
+                return hr;
+            }
+            ReleaseSRWLockExclusive(&m_srwSendLock);
+            return hr;
+        }
+
+        AcquireSRWLockExclusive(&m_srwLock);
+        pStream->m_dwId = m_dwNextStreamId;
+        pStream->m_llSendWindow = m_cbPeerInitialWindow;
+        pStream->m_fEndSent = fEndStream;
+        InsertTailList(&m_rgStreamBuckets[(pStream->m_dwId >> 1) % STREAM_BUCKETS], &pStream->m_hashEntry);
+        pStream->m_fHashed = TRUE;
+        m_dwNextStreamId += 2;
+        ReleaseSRWLockExclusive(&m_srwLock);
+
+        //
+        // A block larger than a frame goes on in CONTINUATION frames,
+        // END_STREAM is a flag of the HEADERS frame.
+        //
+        ibBlock = 0;
+        do
+        {
+            DWORD   cbFrame = min(cbBlock - ibBlock, MAX_FRAME_SIZE);
+            BYTE    flags = 0;
+
+            if (ibBlock + cbFrame == cbBlock)
+            {
+                flags |= FLAG_END_HEADERS;
+            }
+            if (type == H2_FRAME_HEADERS && fEndStream)
+            {
+                flags |= FLAG_END_STREAM;
+            }
+
+            if (FAILED(hr = WriteFrame(type, flags, pStream->m_dwId, m_pbBlock + cchHead + ibBlock, cbFrame)))
+            {
+                break;
+            }
+            ibBlock += cbFrame;
+            type = H2_FRAME_CONTINUATION;
+        } while (ibBlock < cbBlock);
+
+        ReleaseSRWLockExclusive(&m_srwSendLock);
+
+        if (FAILED(hr))
+        {
+            Fail(hr);
+        }
+        return hr;
+    }
+
+    //
+    // "GET /path HTTP/1.1\r\nName: value\r\n...\r\n" becomes :method,
+    // :scheme, :authority from Host and :path, then the other headers with
+    // lower case names. Headers that only mean something to one HTTP/1.1
+    // connection are dropped. pchLower has room for a copy of the head.
+    //
+    HRESULT
+    EncodeRequestHead(
+        _In_reads_(cchHead) PCSTR               pszHead,
+        DWORD                                   cchHead,
+        _Out_writes_(cchHead) CHAR *            pchLower,
+        _Out_writes_bytes_(cbBlock) BYTE *      pbBlock,
+        DWORD                                   cbBlock,
+        _Out_ DWORD *                           pcbBlock
+    )
+    {
+        HRESULT     hr;
+        PCSTR       pszMethod = pchLower;
+        DWORD       cchMethod;
+        PCSTR       pszPath;
+        DWORD       cchPath;
+        PCSTR       pszAuthority = NULL;
+        DWORD       cchAuthority = 0;
+        DWORD       ibLine;
+        DWORD       ibEnd;
+        DWORD       ib = 0;
+
+        *pcbBlock = 0;
+        memcpy(pchLower, pszHead, cchHead);
+
+        //
+        // The request line.
+        //
+        for (cchMethod = 0; cchMethod < cchHead && pchLower[cchMethod] != ' '; cchMethod++)
+        {
+        }
+        pszPath = pchLower + cchMethod + 1;
+        for (cchPath = 0; cchMethod + 1 + cchPath < cchHead && pszPath[cchPath] != ' '; cchPath++)
+        {
+        }
+        ibLine = FindLineEnd(pchLower, cchHead, 0);
+        if (cchMethod == 0 || cchPath == 0 || ibLine >= cchHead || cchMethod + 1 + cchPath >= ibLine)
+        {
+            return HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER);
+        }
+
+        //
+        // Lower case the names and find Host, which must come before the
+        // other headers as :authority.
+        //
+        for (ibLine = ibLine + 1; ibLine < cchHead; ibLine = ibEnd + 1)
+        {
+            PCSTR pszName;
+            DWORD cchName;
+            PCSTR pszValue;
+            DWORD cchValue;
+
+            ibEnd = FindLineEnd(pchLower, cchHead, ibLine);
+            if (ibEnd >= cchHead)
+            {
+                return HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER);
+            }
+            if (!SplitHeaderLine(pchLower + ibLine, ibEnd - ibLine, TRUE, &pszName, &cchName, &pszValue, &cchValue))
+            {
+                if (cchName == 0)
+                {
+                    break;
+                }
+                return HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER);
+            }
+            if (cchName == 4 && memcmp(pszName, "host", 4) == 0)
+            {
+                pszAuthority = pszValue;
+                cchAuthority = cchValue;
+            }
+        }
+
+        if (FAILED(hr = m_encoder.BeginBlock(pbBlock, cbBlock, &ib)) ||
+            FAILED(hr = m_encoder.Encode(":method", 7, pszMethod, cchMethod, pbBlock, cbBlock, &ib)) ||
+            FAILED(hr = m_encoder.Encode(":scheme", 7, "http", 4, pbBlock, cbBlock, &ib)) ||
+            (pszAuthority != NULL &&
+             FAILED(hr = m_encoder.Encode(":authority", 10, pszAuthority, cchAuthority, pbBlock, cbBlock, &ib))) ||
+            FAILED(hr = m_encoder.Encode(":path", 5, pszPath, cchPath, pbBlock, cbBlock, &ib)))
+        {
+            return hr;
+        }
+
+        for (ibLine = FindLineEnd(pchLower, cchHead, 0) + 1; ibLine < cchHead; ibLine = ibEnd + 1)
+        {
+            PCSTR pszName;
+            DWORD cchName;
+            PCSTR pszValue;
+            DWORD cchValue;
+
+            ibEnd = FindLineEnd(pchLower, cchHead, ibLine);
+            if (!SplitHeaderLine(pchLower + ibLine, ibEnd - ibLine, FALSE, &pszName, &cchName, &pszValue, &cchValue))
+            {
+                break;
+            }
+
+            if (IsConnectionHeader(pszName, cchName) ||
+                (cchName == 2 && memcmp(pszName, "te", 2) == 0 && !(cchValue == 8 && _strnicmp(pszValue, "trailers", 8) == 0)))
+            {
+                continue;
+            }
+
+            if (FAILED(hr = m_encoder.Encode(pszName, cchName, pszValue, cchValue, pbBlock, cbBlock, &ib)))
+            {
+                return hr;
+            }
+        }
+
+        *pcbBlock = ib;
+        return S_OK;
+    }
+
+    //
+    // The index of the LF that ends the line at ib, cch when there is none.
+    //
+    static
+    DWORD
+    FindLineEnd(
+        _In_reads_(cch) PCSTR       pch,
+        DWORD                       cch,
+        DWORD                       ib
+    )
+    {
+        PCSTR pchEnd = (ib < cch) ? static_cast<PCSTR>(memchr(pch + ib, '\n', cch - ib)) : NULL;
+
+        return (pchEnd != NULL) ? static_cast<DWORD>(pchEnd - pch) : cch;
+    }
+
+    //
+    // Splits "Name: value\r" with the value trimmed. FALSE with *pcchName 0
+    // for the empty line, FALSE with a name for a line without a colon.
+    //
+    static
+    BOOL
+    SplitHeaderLine(
+        _In_reads_(cchLine) CHAR *      pchLine,
+        DWORD                           cchLine,
+        BOOL                            fLowerCase,
+        _Out_ PCSTR *                   ppszName,
+        _Out_ DWORD *                   pcchName,
+        _Out_ PCSTR *                   ppszValue,
+        _Out_ DWORD *                   pcchValue
+    )
+    {
+        DWORD ibColon;
+        DWORD ibValue;
+
+        if (cchLine != 0 && pchLine[cchLine - 1] == '\r')
+        {
+            cchLine--;
+        }
+
+        *ppszName = pchLine;
+        *pcchName = cchLine;
+        *ppszValue = NULL;
+        *pcchValue = 0;
+        if (cchLine == 0)
+        {
+            return FALSE;
+        }
+
+        for (ibColon = 0; ibColon < cchLine && pchLine[ibColon] != ':'; ibColon++)
+        {
+            if (fLowerCase && pchLine[ibColon] >= 'A' && pchLine[ibColon] <= 'Z')
+            {
+                pchLine[ibColon] += 'a' - 'A';
+            }
+        }
+        if (ibColon == 0 || ibColon == cchLine)
+        {
+            return FALSE;
+        }
+
+        for (ibValue = ibColon + 1; ibValue < cchLine && (pchLine[ibValue] == ' ' || pchLine[ibValue] == '\t'); ibValue++)
+        {
+        }
+        while (cchLine > ibValue && (pchLine[cchLine - 1] == ' ' || pchLine[cchLine - 1] == '\t'))
+        {
+            cchLine--;
+        }
+
+        *pcchName = ibColon;
+        *ppszValue = pchLine + ibValue;
+        *pcchValue = cchLine - ibValue;
+        return TRUE;
+    }
+
+    static
+    BOOL
+    IsConnectionHeader(
+        _In_reads_(cchName) PCSTR   pszName,
+        DWORD                       cchName
+    )
+    {
+        static const struct
+        {
+            PCSTR   pszName;
+            DWORD   cchName;
+        } s_rgHeaders[] =
+        {
+            { "host", 4 },
+            { "connection", 10 },
+            { "keep-alive", 10 },
+            { "proxy-connection", 16 },
+            { "transfer-encoding", 17 },
+            { "upgrade", 7 },
+        };
+
+        for (DWORD i = 0; i < _countof(s_rgHeaders); i++)
+        {
+            if (cchName == s_rgHeaders[i].cchName && memcmp(pszName, s_rgHeaders[i].pszName, cchName) == 0)
+            {
+                return TRUE;
+            }
+        }
+        return FALSE;
+    }
+
+    //
+    // Wakes the stream, with m_srwLock held.
+    //
+    VOID
+    WakeStream(
+        _In_ H2_STREAM *    pStream
+    )
+    {
+        WakeConditionVariable(&pStream->m_cvEvent);
+        pStream->Notify();
+    }
+
+    //
+    // Wakes every stream waiting for the send windows, with m_srwLock held.
+    //
+    VOID
+    WakeSendWindow()
+    {
+        WakeAllConditionVariable(&m_cvSendWindow);
+        while (!IsListEmpty(&m_sendWaitList))
+        {
+            CONTAINING_RECORD(m_sendWaitList.Flink, H2_STREAM, m_sendWaitEntry)->Notify();
+        }
+    }
+
+    //
+    // Takes up to cbData of both send windows for one DATA frame.
+    //
+    HRESULT
+    ReserveSendWindow(
+        _In_ H2_STREAM *    pStream,
+        DWORD               cbData,
+        _Out_ DWORD *       pcbReserved
+    )
+    {
+        HRESULT     hr = S_OK;
+        LONGLONG    llWindow;
+
+        *pcbReserved = 0;
+
+        AcquireSRWLockExclusive(&m_srwLock);
+        for (;;)
+        {
+            if (pStream->m_fReset || FAILED(pStream->m_hrError))
+            {
+                hr = FAILED(pStream->m_hrError) ? pStream->m_hrError : HRESULT_FROM_WIN32(ERROR_CONNECTION_ABORTED);
+                break;
+            }
+
+            llWindow = min(m_llSendWindow, pStream->m_llSendWindow);
+            if (cbData == 0 || llWindow > 0)
+            {
+                *pcbReserved = static_cast<DWORD>(min(static_cast<LONGLONG>(min(cbData, MAX_FRAME_SIZE)), max(llWindow, 0LL)));
+                m_llSendWindow -= *pcbReserved;
+                pStream->m_llSendWindow -= *pcbReserved;
+                break;
+            }
+
+            if (FAILED(hr = pStream->Wait(&m_cvSendWindow)))
+            {
+                break;
+            }
+        }
+        ReleaseSRWLockExclusive(&m_srwLock);
+        return hr;
+    }
+
+    HRESULT
+    WriteWindowUpdate(
+        DWORD       dwStreamId,
+        DWORD       cbIncrement
+    )
+    {
+        HRESULT hr;
+        BYTE    rgbPayload[4];
+
+        WriteUInt32(rgbPayload, cbIncrement);
+        AcquireSRWLockExclusive(&m_srwSendLock);
+        hr = WriteFrame(H2_FRAME_WINDOW_UPDATE, 0, dwStreamId, rgbPayload, sizeof(rgbPayload));
+        ReleaseSRWLockExclusive(&m_srwSendLock);
+        return hr;
+    }
+
+    //
+    // Sends one frame in one send, with m_srwSendLock held.
+    //
+    HRESULT
+    WriteFrame(
+        BYTE                                    type,
+        BYTE                                    flags,
+        DWORD                                   dwStreamId,
+        _In_reads_bytes_(cbPayload) const VOID * pvPayload,
+        DWORD                                   cbPayload
+    )
+    {
+        DBG_ASSERT(cbPayload <= MAX_FRAME_SIZE);
+
+        WriteFrameHeader(m_pbSend, cbPayload, type, flags, dwStreamId);
+        if (cbPayload != 0)
+        {
+            memcpy(m_pbSend + FRAME_HEADER_SIZE, pvPayload, cbPayload);
+        }
+        return m_socket.Send(m_pbSend, FRAME_HEADER_SIZE + cbPayload);
+    }
+
+    static
+    BYTE *
+    WriteFrameHeader(
+        _Out_ BYTE *    pb,
+        DWORD           cbLength,
+        BYTE            type,
+        BYTE            flags,
+        DWORD           dwStreamId
+    )
+    {
+        pb[0] = static_cast<BYTE>(cbLength >> 16);
+        pb[1] = static_cast<BYTE>(cbLength >> 8);
+        pb[2] = static_cast<BYTE>(cbLength);
+        pb[3] = type;
+        pb[4] = flags;
+        WriteUInt32(pb + 5, dwStreamId);
+        return pb + FRAME_HEADER_SIZE;
+    }
+
+    static
+    BYTE *
+    WriteSetting(
+        _Out_ BYTE *    pb,
+        WORD            wId,
+        DWORD           dwValue
+    )
+    {
+        pb[0] = static_cast<BYTE>(wId >> 8);
+        pb[1] = static_cast<BYTE>(wId);
+        WriteUInt32(pb + 2, dwValue);
+        return pb + 6;
+    }
+
+    static
+    VOID
+    WriteUInt32(
+        _Out_ BYTE *    pb,
+        DWORD           dwValue
+    )
+    {
+        pb[0] = static_cast<BYTE>(dwValue >> 24);
+        pb[1] = static_cast<BYTE>(dwValue >> 16);
+        pb[2] = static_cast<BYTE>(dwValue >> 8);
+        pb[3] = static_cast<BYTE>(dwValue);
+    }
+
+    static
+    DWORD
+    ReadUInt32(
+        _In_ const BYTE *   pb
+    )
+    {
+        return (static_cast<DWORD>(pb[0]) << 24) | (pb[1] << 16) | (pb[2] << 8) | pb[3];
+    }
+
+    LONG                    m_cRefs;
+    LOCAL_SOCKET            m_socket;
+
+    //
+    // Guarded by m_srwLock.
+    //
+    SRWLOCK                 m_srwLock;
+    CONDITION_VARIABLE      m_cvSendWindow;
+    LIST_ENTRY              m_sendWaitList;
+    LIST_ENTRY              m_rgStreamBuckets[STREAM_BUCKETS];
+    DWORD                   m_cStreams;
+    DWORD                   m_cPeerMaxStreams;
+    DWORD                   m_dwNextStreamId;
+    LONGLONG                m_llSendWindow;
+    DWORD                   m_cbPeerInitialWindow;
+    DWORD                   m_cbReceiveUnacked;
+    BOOL                    m_fGoingAway;
+    HRESULT                 m_hrFailure;
+
+    //
+    // Guarded by m_srwSendLock.
+    //
+    SRWLOCK                 m_srwSendLock;
+    HPACK_ENCODER           m_encoder;
+    BYTE *                  m_pbSend;
+    BYTE *                  m_pbBlock;
+    DWORD                   m_cbBlock;
+
+    //
+    // The reader thread's own.
+    //
+    HANDLE                  m_hReaderThread;
+    DWORD                   m_cbMaxHead;
+    BYTE *                  m_pbRead;
+    DWORD                   m_ibRead;
+    DWORD                   m_cbRead;
+    HPACK_DECODER           m_decoder;
+    BYTE *                  m_pbHeaderBlock;
+    DWORD                   m_cbHeaderBlock;
+    DWORD                   m_dwHeaderStreamId;
+    BYTE                    m_bHeaderFlags;
+    CHAR *                  m_pchResponseHead;
+    DWORD                   m_cchResponseHead;
+    USHORT                  m_uResponseStatus;
+    BOOL                    m_fResponseHeadTooLarge;
+};
+
+inline
+H2_STREAM::H2_STREAM(
+    H2_CONNECTION *     pConnection
+) :
+    m_pConnection(pConnection),
+    m_dwId(0),
+    m_dwTimeoutMs(INFINITE),
+    m_llSendWindow(0),
+    m_llReceiveWindow(H2_CONNECTION::STREAM_WINDOW_SIZE),
+    m_cbUnacked(0),
+    m_pfnEvent(NULL),
+    m_pvEvent(NULL),
+    m_fWaiting(FALSE),
+    m_fSendWaitListed(FALSE),
+    m_pchHead(NULL),
+    m_cchHead(0),
+    m_uStatus(0),
+    m_fHashed(FALSE),
+    m_fHeadReceived(FALSE),
+    m_fEndReceived(FALSE),
+    m_fEndSent(FALSE),
+    m_fReset(FALSE),
+    m_fRefused(FALSE),
+    m_hrError(S_OK)
+{
+    InitializeConditionVariable(&m_cvEvent);
+    InitializeListHead(&m_dataList);
+    InitializeListHead(&m_sendWaitEntry);
+}
+
+inline
+H2_STREAM::~H2_STREAM()
+{
+    while (!IsListEmpty(&m_dataList))
+    {
+        delete[] reinterpret_cast<BYTE *>(CONTAINING_RECORD(RemoveHeadList(&m_dataList), H2_DATA_CHUNK, listEntry));
+    }
+    delete[] m_pchHead;
+}
+
+//
+// Waits on pCondition with the lock of the connection held exclusive, or
+// with an event callback sets the stream waiting and returns pending.
+//
+inline
+HRESULT
+H2_STREAM::Wait(
+    CONDITION_VARIABLE *    pCondition
+)
+{
+    if (m_pfnEvent != NULL)
+    {
+        DBG_ASSERT(!m_fWaiting);
+
+        m_fWaiting = TRUE;
+        if (pCondition == &m_pConnection->m_cvSendWindow)
+        {
+            InsertTailList(&m_pConnection->m_sendWaitList, &m_sendWaitEntry);
+            m_fSendWaitListed = TRUE;
+        }
+        return HRESULT_FROM_WIN32(ERROR_IO_PENDING);
+    }
+
+    if (!SleepConditionVariableSRW(pCondition, &m_pConnection->m_srwLock, m_dwTimeoutMs, 0))
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+    return S_OK;
+}
+
+//
+// Calls back the pending call, with the lock of the connection held.
+//
+inline
+VOID
+H2_STREAM::Notify()
+{
+    if (m_fWaiting)
+    {
+        m_fWaiting = FALSE;
+        UnlistSendWait();
+        m_pfnEvent(m_pvEvent);
+    }
+}
+
+inline
+VOID
+H2_STREAM::UnlistSendWait()
+{
+    if (m_fSendWaitListed)
+    {
+        RemoveEntryList(&m_sendWaitEntry);
+        InitializeListHead(&m_sendWaitEntry);
+        m_fSendWaitListed = FALSE;
+    }
+}
+
+inline
+BOOL
+H2_STREAM::CancelWait()
+{
+    BOOL fWaiting;
+
+    AcquireSRWLockExclusive(&m_pConnection->m_srwLock);
+    fWaiting = m_fWaiting;
+    m_fWaiting = FALSE;
+    UnlistSendWait();
+    ReleaseSRWLockExclusive(&m_pConnection->m_srwLock);
+
+    return fWaiting;
+}
+
+inline
+HRESULT
+H2_STREAM::SendHead(
+    _In_reads_(cchHead) PCSTR       pszHead,
+    DWORD                           cchHead,
+    BOOL                            fEndStream
+)
+{
+    return m_pConnection->SendHeaders(this, pszHead, cchHead, fEndStream);
+}
+
+inline
+HRESULT
+H2_STREAM::SendBody(
+    _In_reads_bytes_(cbData) const VOID *   pvData,
+    DWORD                                   cbData,
+    BOOL                                    fEndStream,
+    _Out_ DWORD *                           pcbSent
+)
+{
+    HRESULT         hr;
+    const BYTE *    pbData = static_cast<const BYTE *>(pvData);
+    DWORD           cbFrame;
+    BOOL            fLast;
+
+    *pcbSent = 0;
+
+    do
+    {
+        if (FAILED(hr = m_pConnection->ReserveSendWindow(this, cbData, &cbFrame)))
+        {
+            return hr;
+        }
+
+        fLast = fEndStream && cbFrame == cbData;
+
+        AcquireSRWLockExclusive(&m_pConnection->m_srwSendLock);
+        hr = m_pConnection->WriteFrame(H2_FRAME_DATA, fLast ? H2_CONNECTION::FLAG_END_STREAM : 0, m_dwId, pbData, cbFrame);
+        ReleaseSRWLockExclusive(&m_pConnection->m_srwSendLock);
+        if (FAILED(hr))
+        {
+            m_pConnection->Fail(hr);
+            return hr;
+        }
+
+        pbData += cbFrame;
+        cbData -= cbFrame;
+        *pcbSent += cbFrame;
+    } while (cbData != 0);
+
+    if (fLast)
+    {
+        AcquireSRWLockExclusive(&m_pConnection->m_srwLock);
+        m_fEndSent = TRUE;
+        ReleaseSRWLockExclusive(&m_pConnection->m_srwLock);
+    }
+    return S_OK;
+}
+
+inline
+HRESULT
+H2_STREAM::ReceiveResponseHead(
+    BOOL                fNoBody,
+    _Outptr_ PSTR *     ppszHead,
+    _Out_ DWORD *       pcchHead,
+    _Out_ USHORT *      puStatus
+)
+{
+    HRESULT hr = S_OK;
+
+    UNREFERENCED_PARAMETER(fNoBody);
+
+    *ppszHead = NULL;
+    *pcchHead = 0;
+    *puStatus = 0;
+
+    AcquireSRWLockExclusive(&m_pConnection->m_srwLock);
+    while (!m_fHeadReceived)
+    {
+        if (FAILED(m_hrError))
+        {
+            hr = m_hrError;
+            break;
+        }
+        if (m_fEndReceived)
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+            break;
+        }
+        if (FAILED(hr = Wait(&m_cvEvent)))
+        {
+            break;
+        }
+    }
+    ReleaseSRWLockExclusive(&m_pConnection->m_srwLock);
+
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    *ppszHead = m_pchHead;
+    *pcchHead = m_cchHead;
+    *puStatus = m_uStatus;
+    return S_OK;
+}
+
+inline
+HRESULT
+H2_STREAM::ReadBody(
+    _Out_writes_bytes_(cbBuffer) VOID *     pvBuffer,
+    DWORD                                   cbBuffer,
+    _Out_ DWORD *                           pcbRead
+)
+{
+    HRESULT hr = S_OK;
+    BYTE *  pbBuffer = static_cast<BYTE *>(pvBuffer);
+    DWORD   cbRead = 0;
+    DWORD   cbCredit = 0;
+
+    *pcbRead = 0;
+
+    AcquireSRWLockExclusive(&m_pConnection->m_srwLock);
+    while (IsListEmpty(&m_dataList) && !m_fEndReceived)
+    {
+        if (FAILED(m_hrError))
+        {
+            hr = m_hrError;
+            break;
+        }
+        if (FAILED(hr = Wait(&m_cvEvent)))
+        {
+            break;
+        }
+    }
+
+    while (!IsListEmpty(&m_dataList) && cbRead < cbBuffer)
+    {
+        H2_DATA_CHUNK * pChunk = CONTAINING_RECORD(m_dataList.Flink, H2_DATA_CHUNK, listEntry);
+        DWORD           cbCopy = min(cbBuffer - cbRead, pChunk->cbData - pChunk->ibData);
+
+        memcpy(pbBuffer + cbRead, reinterpret_cast<BYTE *>(pChunk + 1) + pChunk->ibData, cbCopy);
+        pChunk->ibData += cbCopy;
+        cbRead += cbCopy;
+
+        if (pChunk->ibData == pChunk->cbData)
+        {
+            RemoveEntryList(&pChunk->listEntry);
+            delete[] reinterpret_cast<BYTE *>(pChunk);
+        }
+    }
+
+    //
+    // The backend may send more once half the window has been read.
+    //
+    m_cbUnacked += cbRead;
+    if (m_cbUnacked >= H2_CONNECTION::STREAM_WINDOW_SIZE / 2 && !m_fEndReceived)
+    {
+        cbCredit = m_cbUnacked;
+        m_llReceiveWindow += cbCredit;
+        m_cbUnacked = 0;
+    }
+    ReleaseSRWLockExclusive(&m_pConnection->m_srwLock);
+
+    if (cbRead == 0)
+    {
+        return hr;
+    }
+
+    if (cbCredit != 0)
+    {
+        m_pConnection->WriteWindowUpdate(m_dwId, cbCredit);
+    }
+
+    *pcbRead = cbRead;
+    return S_OK;
+}
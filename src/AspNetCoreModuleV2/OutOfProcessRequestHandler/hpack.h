@@ -0,0 +1,1165 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#pragma once
+
+//
+// HPACK (RFC 7541) header compression for the h2c backend channel, see
+// H2_CONNECTION. A connection encodes the request headers it sends with an
+// HPACK_ENCODER and decodes the response headers it receives with an
+// HPACK_DECODER. Each keeps its dynamic table for the life of the
+// connection and both ends must see every header block in order, so
+// neither is thread safe: the encoder is used under the send lock of the
+// connection and the decoder only on its reader thread.
+//
+
+//
+// Called for each header field of a decoded block. The strings are not
+// terminated and are only valid during the call.
+//
+typedef
+HRESULT
+(*PFN_HPACK_HEADER)(
+    PVOID       pvContext,
+    PCSTR       pszName,
+    DWORD       cchName,
+    PCSTR       pszValue,
+    DWORD       cchValue
+);
+
+struct HPACK_STATIC_ENTRY
+{
+    PCSTR       pszName;
+    DWORD       cchName;
+    PCSTR       pszValue;
+    DWORD       cchValue;
+};
+
+//
+// The static table, integers, string literals and the Huffman code.
+//
+class HPACK_UTILITY
+{
+public:
+
+    static const DWORD      STATIC_TABLE_SIZE = 61;
+
+    //
+    // Each entry of a dynamic table counts its name and value plus 32.
+    //
+    static const DWORD      ENTRY_OVERHEAD = 32;
+
+    //
+    // The default SETTINGS_HEADER_TABLE_SIZE, which neither end of a
+    // channel changes.
+    //
+    static const DWORD      DEFAULT_TABLE_SIZE = 4096;
+
+    //
+    // Entry 1 to 61.
+    //
+    static
+    const HPACK_STATIC_ENTRY *
+    QueryStaticEntry(
+        DWORD       dwIndex
+    )
+    {
+        static const HPACK_STATIC_ENTRY s_rgStaticTable[STATIC_TABLE_SIZE] =
+        {
+        { ":authority", 10, "", 0 },
+        { ":method", 7, "GET", 3 },
+        { ":method", 7, "POST", 4 },
+        { ":path", 5, "/", 1 },
+        { ":path", 5, "/index.html", 11 },
+        { ":scheme", 7, "http", 4 },
+        { ":scheme", 7, "https", 5 },
+        { ":status", 7, "200", 3 },
+        { ":status", 7, "204", 3 },
+        { ":status", 7, "206", 3 },
+        { ":status", 7, "304", 3 },
+        { ":status", 7, "400", 3 },
+        { ":status", 7, "404", 3 },
+        { ":status", 7, "500", 3 },
+        { "accept-charset", 14, "", 0 },
+        { "accept-encoding", 15, "gzip, deflate", 13 },
+        { "accept-language", 15, "", 0 },
+        { "accept-ranges", 13, "", 0 },
+        { "accept", 6, "", 0 },
+        { "access-control-allow-origin", 27, "", 0 },
+        { "age", 3, "", 0 },
+        { "allow", 5, "", 0 },
+        { "authorization", 13, "", 0 },
+        { "cache-control", 13, "", 0 },
+        { "content-disposition", 19, "", 0 },
+        { "content-encoding", 16, "", 0 },
+        { "content-language", 16, "", 0 },
+        { "content-length", 14, "", 0 },
+        { "content-location", 16, "", 0 },
+        { "content-range", 13, "", 0 },
+        { "content-type", 12, "", 0 },
+        { "cookie", 6, "", 0 },
+        { "date", 4, "", 0 },
+        { "etag", 4, "", 0 },
+        { "expect", 6, "", 0 },
+        { "expires", 7, "", 0 },
+        { "from", 4, "", 0 },
+        { "host", 4, "", 0 },
+        { "if-match", 8, "", 0 },
+        { "if-modified-since", 17, "", 0 },
+        { "if-none-match", 13, "", 0 },
+        { "if-range", 8, "", 0 },
+        { "if-unmodified-since", 19, "", 0 },
+        { "last-modified", 13, "", 0 },
+        { "link", 4, "", 0 },
+        { "location", 8, "", 0 },
+        { "max-forwards", 12, "", 0 },
+        { "proxy-authenticate", 18, "", 0 },
+        { "proxy-authorization", 19, "", 0 },
+        { "range", 5, "", 0 },
+        { "referer", 7, "", 0 },
+        { "refresh", 7, "", 0 },
+        { "retry-after", 11, "", 0 },
+        { "server", 6, "", 0 },
+        { "set-cookie", 10, "", 0 },
+        { "strict-transport-security", 25, "", 0 },
+        { "transfer-encoding", 17, "", 0 },
+        { "user-agent", 10, "", 0 },
+        { "vary", 4, "", 0 },
+        { "via", 3, "", 0 },
+        { "www-authenticate", 16, "", 0 },
+        };
+
+        DBG_ASSERT(dwIndex >= 1 && dwIndex <= STATIC_TABLE_SIZE);
+        return &s_rgStaticTable[dwIndex - 1];
+    }
+
+    //
+    // Reads an integer with an cPrefixBits prefix at *pib, the bits above
+    // the prefix are the caller's. Values past a DWORD are invalid.
+    //
+    static
+    HRESULT
+    DecodeInteger(
+        _In_reads_bytes_(cbBlock) const BYTE *  pbBlock,
+        DWORD                                   cbBlock,
+        _Inout_ DWORD *                         pib,
+        DWORD                                   cPrefixBits,
+        _Out_ DWORD *                           pdwValue
+    )
+    {
+        DWORD       dwMask = (1 << cPrefixBits) - 1;
+        ULONGLONG   ullValue;
+        BYTE        b;
+
+        *pdwValue = 0;
+        if (*pib >= cbBlock)
+        {
+            return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+        }
+
+        ullValue = pbBlock[(*pib)++] & dwMask;
+        if (ullValue == dwMask)
+        {
+            for (DWORD cShift = 0; ; cShift += 7)
+            {
+                if (*pib >= cbBlock || cShift > 28)
+                {
+                    return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+                }
+
+                b = pbBlock[(*pib)++];
+                ullValue += static_cast<ULONGLONG>(b & 0x7f) << cShift;
+                if (ullValue > MAXDWORD)
+                {
+                    return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+                }
+
+                if ((b & 0x80) == 0)
+                {
+                    break;
+                }
+            }
+        }
+
+        *pdwValue = static_cast<DWORD>(ullValue);
+        return S_OK;
+    }
+
+    //
+    // Writes dwValue with an cPrefixBits prefix, bFlags fills the bits
+    // above it.
+    //
+    static
+    HRESULT
+    EncodeInteger(
+        DWORD                                   dwValue,
+        DWORD                                   cPrefixBits,
+        BYTE                                    bFlags,
+        _Out_writes_bytes_(cbBlock) BYTE *      pbBlock,
+        DWORD                                   cbBlock,
+        _Inout_ DWORD *                         pib
+    )
+    {
+        DWORD dwMask = (1 << cPrefixBits) - 1;
+
+        if (*pib >= cbBlock)
+        {
+            return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+        }
+
+        if (dwValue < dwMask)
+        {
+            pbBlock[(*pib)++] = static_cast<BYTE>(bFlags | dwValue);
+            return S_OK;
+        }
+
+        pbBlock[(*pib)++] = static_cast<BYTE>(bFlags | dwMask);
+        dwValue -= dwMask;
+        do
+        {
+            if (*pib >= cbBlock)
+            {
+                return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+            }
+            pbBlock[(*pib)++] = static_cast<BYTE>((dwValue & 0x7f) | (dwValue >= 0x80 ? 0x80 : 0));
+            dwValue >>= 7;
+        } while (dwValue != 0);
+
+        return S_OK;
+    }
+
+    //
+    // Writes a string literal, Huffman coded when that is shorter.
+    //
+    static
+    HRESULT
+    EncodeString(
+        _In_reads_(cchString) PCSTR             pszString,
+        DWORD                                   cchString,
+        _Out_writes_bytes_(cbBlock) BYTE *      pbBlock,
+        DWORD                                   cbBlock,
+        _Inout_ DWORD *                         pib
+    )
+    {
+        HRESULT hr;
+        DWORD   cbHuffman = HuffmanEncodedLength(pszString, cchString);
+
+        if (cbHuffman < cchString)
+        {
+            if (FAILED(hr = EncodeInteger(cbHuffman, 7, 0x80, pbBlock, cbBlock, pib)))
+            {
+                return hr;
+            }
+            if (cbBlock - *pib < cbHuffman)
+            {
+                return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+            }
+            HuffmanEncode(pszString, cchString, pbBlock + *pib);
+            *pib += cbHuffman;
+            return S_OK;
+        }
+
+        if (FAILED(hr = EncodeInteger(cchString, 7, 0, pbBlock, cbBlock, pib)))
+        {
+            return hr;
+        }
+        if (cbBlock - *pib < cchString)
+        {
+            return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+        }
+        memcpy(pbBlock + *pib, pszString, cchString);
+        *pib += cchString;
+        return S_OK;
+    }
+
+    static
+    DWORD
+    HuffmanEncodedLength(
+        _In_reads_(cchString) PCSTR     pszString,
+        DWORD                           cchString
+    )
+    {
+        ULONGLONG cBits = 0;
+
+        for (DWORD i = 0; i < cchString; i++)
+        {
+            cBits += QueryHuffmanCode(static_cast<BYTE>(pszString[i]))->cBits;
+        }
+        return static_cast<DWORD>((cBits + 7) / 8);
+    }
+
+    //
+    // pbOut holds HuffmanEncodedLength bytes. The last byte is padded with
+    // the most significant bits of EOS, all ones.
+    //
+    static
+    VOID
+    HuffmanEncode(
+        _In_reads_(cchString) PCSTR     pszString,
+        DWORD                           cchString,
+        _Out_ BYTE *                    pbOut
+    )
+    {
+        ULONGLONG   ullBits = 0;
+        DWORD       cBits = 0;
+
+        for (DWORD i = 0; i < cchString; i++)
+        {
+            const HPACK_HUFFMAN_CODE *pCode = QueryHuffmanCode(static_cast<BYTE>(pszString[i]));
+
+            ullBits = (ullBits << pCode->cBits) | pCode->dwCode;
+            cBits += pCode->cBits;
+            while (cBits >= 8)
+            {
+                cBits -= 8;
+                *pbOut++ = static_cast<BYTE>(ullBits >> cBits);
+            }
+        }
+
+        if (cBits != 0)
+        {
+            *pbOut = static_cast<BYTE>((ullBits << (8 - cBits)) | (0xff >> cBits));
+        }
+    }
+
+    //
+    // Decodes into pchOut, which holds up to cchOut characters. Padding
+    // longer than 7 bits, padding that is not a prefix of EOS and EOS
+    // itself are invalid.
+    //
+    static
+    HRESULT
+    HuffmanDecode(
+        _In_reads_bytes_(cbString) const BYTE * pbString,
+        DWORD                                   cbString,
+        _Out_writes_(cchOut) CHAR *             pchOut,
+        DWORD                                   cchOut,
+        _Out_ DWORD *                           pcchDecoded
+    )
+    {
+        const HPACK_HUFFMAN_DECODE_TABLE *  pTable = QueryHuffmanDecodeTable();
+        DWORD                               dwCode = 0;
+        DWORD                               cBits = 0;
+        DWORD                               cchDecoded = 0;
+
+        *pcchDecoded = 0;
+
+        for (DWORD ib = 0; ib < cbString; ib++)
+        {
+            for (int iBit = 7; iBit >= 0; iBit--)
+            {
+                DWORD dwOffset;
+
+                dwCode = (dwCode << 1) | ((pbString[ib] >> iBit) & 1);
+                cBits++;
+
+                //
+                // The code is canonical: the codes of one length are
+                // consecutive and follow those of the shorter lengths.
+                //
+                dwOffset = dwCode - pTable->rgdwFirstCode[cBits];
+                if (dwOffset < pTable->rgcCodes[cBits])
+                {
+                    WORD wSymbol = pTable->rgwSymbols[pTable->rgiFirstSymbol[cBits] + dwOffset];
+
+                    if (wSymbol == HUFFMAN_EOS || cchDecoded == cchOut)
+                    {
+                        return HRESULT_FROM_WIN32(wSymbol == HUFFMAN_EOS ? ERROR_INVALID_DATA : ERROR_INSUFFICIENT_BUFFER);
+                    }
+                    pchOut[cchDecoded++] = static_cast<CHAR>(wSymbol);
+                    dwCode = 0;
+                    cBits = 0;
+                }
+                else if (cBits == HUFFMAN_MAX_BITS)
+                {
+                    return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+                }
+            }
+        }
+
+        if (cBits > 7 || dwCode != (1u << cBits) - 1)
+        {
+            return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+        }
+
+        *pcchDecoded = cchDecoded;
+        return S_OK;
+    }
+
+private:
+
+    static const DWORD      HUFFMAN_MAX_BITS = 30;
+    static const WORD       HUFFMAN_EOS = 256;
+
+    struct HPACK_HUFFMAN_CODE
+    {
+        DWORD       dwCode;
+        DWORD       cBits;
+    };
+
+    //
+    // The codes of each length, for decoding bit by bit.
+    //
+    struct HPACK_HUFFMAN_DECODE_TABLE
+    {
+        DWORD       rgdwFirstCode[HUFFMAN_MAX_BITS + 1];
+        DWORD       rgcCodes[HUFFMAN_MAX_BITS + 1];
+        DWORD       rgiFirstSymbol[HUFFMAN_MAX_BITS + 1];
+        WORD        rgwSymbols[HUFFMAN_EOS + 1];
+
+        HPACK_HUFFMAN_DECODE_TABLE()
+        {
+            DWORD iSymbol = 0;
+            DWORD dwCode = 0;
+
+            for (DWORD cBits = 1; cBits <= HUFFMAN_MAX_BITS; cBits++)
+            {
+                rgdwFirstCode[cBits] = dwCode;
+                rgcCodes[cBits] = 0;
+                rgiFirstSymbol[cBits] = iSymbol;
+
+                for (WORD wSymbol = 0; wSymbol <= HUFFMAN_EOS; wSymbol++)
+                {
+                    if (QueryHuffmanCode(wSymbol)->cBits == cBits)
+                    {
+                        rgwSymbols[iSymbol++] = wSymbol;
+                        rgcCodes[cBits]++;
+                    }
+                }
+                dwCode = (dwCode + rgcCodes[cBits]) << 1;
+            }
+        }
+    };
+
+    //
+    // Appendix B of RFC 7541, the last entry is EOS.
+    //
+    static
+    const HPACK_HUFFMAN_CODE *
+    QueryHuffmanCode(
+        DWORD       dwSymbol
+    )
+    {
+        static const HPACK_HUFFMAN_CODE s_rgCodes[HUFFMAN_EOS + 1] =
+        {
+            { 0x00001ff8, 13 }, { 0x007fffd8, 23 }, { 0x0fffffe2, 28 }, { 0x0fffffe3, 28 },
+            { 0x0fffffe4, 28 }, { 0x0fffffe5, 28 }, { 0x0fffffe6, 28 }, { 0x0fffffe7, 28 },
+            { 0x0fffffe8, 28 }, { 0x00ffffea, 24 }, { 0x3ffffffc, 30 }, { 0x0fffffe9, 28 },
+            { 0x0fffffea, 28 }, { 0x3ffffffd, 30 }, { 0x0fffffeb, 28 }, { 0x0fffffec, 28 },
+            { 0x0fffffed, 28 }, { 0x0fffffee, 28 }, { 0x0fffffef, 28 }, { 0x0ffffff0, 28 },
+            { 0x0ffffff1, 28 }, { 0x0ffffff2, 28 }, { 0x3ffffffe, 30 }, { 0x0ffffff3, 28 },
+            { 0x0ffffff4, 28 }, { 0x0ffffff5, 28 }, { 0x0ffffff6, 28 }, { 0x0ffffff7, 28 },
+            { 0x0ffffff8, 28 }, { 0x0ffffff9, 28 }, { 0x0ffffffa, 28 }, { 0x0ffffffb, 28 },
+            { 0x00000014,  6 }, { 0x000003f8, 10 }, { 0x000003f9, 10 }, { 0x00000ffa, 12 },
+            { 0x00001ff9, 13 }, { 0x00000015,  6 }, { 0x000000f8,  8 }, { 0x000007fa, 11 },
+            { 0x000003fa, 10 }, { 0x000003fb, 10 }, { 0x000000f9,  8 }, { 0x000007fb, 11 },
+            { 0x000000fa,  8 }, { 0x00000016,  6 }, { 0x00000017,  6 }, { 0x00000018,  6 },
+            { 0x00000000,  5 }, { 0x00000001,  5 }, { 0x00000002,  5 }, { 0x00000019,  6 },
+            { 0x0000001a,  6 }, { 0x0000001b,  6 }, { 0x0000001c,  6 }, { 0x0000001d,  6 },
+            { 0x0000001e,  6 }, { 0x0000001f,  6 }, { 0x0000005c,  7 }, { 0x000000fb,  8 },
+            { 0x00007ffc, 15 }, { 0x00000020,  6 }, { 0x00000ffb, 12 }, { 0x000003fc, 10 },
+            { 0x00001ffa, 13 }, { 0x00000021,  6 }, { 0x0000005d,  7 }, { 0x0000005e,  7 },
+            { 0x0000005f,  7 }, { 0x00000060,  7 }, { 0x00000061,  7 }, { 0x00000062,  7 },
+            { 0x00000063,  7 }, { 0x00000064,  7 }, { 0x00000065,  7 }, { 0x00000066,  7 },
+            { 0x00000067,  7 }, { 0x00000068,  7 }, { 0x00000069,  7 }, { 0x0000006a,  7 },
+            { 0x0000006b,  7 }, { 0x0000006c,  7 }, { 0x0000006d,  7 }, { 0x0000006e,  7 },
+            { 0x0000006f,  7 }, { 0x00000070,  7 }, { 0x00000071,  7 }, { 0x00000072,  7 },
+            { 0x000000fc,  8 }, { 0x00000073,  7 }, { 0x000000fd,  8 }, { 0x00001ffb, 13 },
+            { 0x0007fff0, 19 }, { 0x00001ffc, 13 }, { 0x00003ffc, 14 }, { 0x00000022,  6 },
+            { 0x00007ffd, 15 }, { 0x00000003,  5 }, { 0x00000023,  6 }, { 0x00000004,  5 },
+            { 0x00000024,  6 }, { 0x00000005,  5 }, { 0x00000025,  6 }, { 0x00000026,  6 },
+            { 0x00000027,  6 }, { 0x00000006,  5 }, { 0x00000074,  7 }, { 0x00000075,  7 },
+            { 0x00000028,  6 }, { 0x00000029,  6 }, { 0x0000002a,  6 }, { 0x00000007,  5 },
+            { 0x0000002b,  6 }, { 0x00000076,  7 }, { 0x0000002c,  6 }, { 0x00000008,  5 },
+            { 0x00000009,  5 }, { 0x0000002d,  6 }, { 0x00000077,  7 }, { 0x00000078,  7 },
+            { 0x00000079,  7 }, { 0x0000007a,  7 }, { 0x0000007b,  7 }, { 0x00007ffe, 15 },
+            { 0x000007fc, 11 }, { 0x00003ffd, 14 }, { 0x00001ffd, 13 }, { 0x0ffffffc, 28 },
+            { 0x000fffe6, 20 }, { 0x003fffd2, 22 }, { 0x000fffe7, 20 }, { 0x000fffe8, 20 },
+            { 0x003fffd3, 22 }, { 0x003fffd4, 22 }, { 0x003fffd5, 22 }, { 0x007fffd9, 23 },
+            { 0x003fffd6, 22 }, { 0x007fffda, 23 }, { 0x007fffdb, 23 }, { 0x007fffdc, 23 },
+            { 0x007fffdd, 23 }, { 0x007fffde, 23 }, { 0x00ffffeb, 24 }, { 0x007fffdf, 23 },
+            { 0x00ffffec, 24 }, { 0x00ffffed, 24 }, { 0x003fffd7, 22 }, { 0x007fffe0, 23 },
+            { 0x00ffffee, 24 }, { 0x007fffe1, 23 }, { 0x007fffe2, 23 }, { 0x007fffe3, 23 },
+            { 0x007fffe4, 23 }, { 0x001fffdc, 21 }, { 0x003fffd8, 22 }, { 0x007fffe5, 23 },
+            { 0x003fffd9, 22 }, { 0x007fffe6, 23 }, { 0x007fffe7, 23 }, { 0x00ffffef, 24 },
+            { 0x003fffda, 22 }, { 0x001fffdd, 21 }, { 0x000fffe9, 20 }, { 0x003fffdb, 22 },
+            { 0x003fffdc, 22 }, { 0x007fffe8, 23 }, { 0x007fffe9, 23 }, { 0x001fffde, 21 },
+            { 0x007fffea, 23 }, { 0x003fffdd, 22 }, { 0x003fffde, 22 }, { 0x00fffff0, 24 },
+            { 0x001fffdf, 21 }, { 0x003fffdf, 22 }, { 0x007fffeb, 23 }, { 0x007fffec, 23 },
+            { 0x001fffe0, 21 }, { 0x001fffe1, 21 }, { 0x003fffe0, 22 }, { 0x001fffe2, 21 },
+            { 0x007fffed, 23 }, { 0x003fffe1, 22 }, { 0x007fffee, 23 }, { 0x007fffef, 23 },
+            { 0x000fffea, 20 }, { 0x003fffe2, 22 }, { 0x003fffe3, 22 }, { 0x003fffe4, 22 },
+            { 0x007ffff0, 23 }, { 0x003fffe5, 22 }, { 0x003fffe6, 22 }, { 0x007ffff1, 23 },
+            { 0x03ffffe0, 26 }, { 0x03ffffe1, 26 }, { 0x000fffeb, 20 }, { 0x0007fff1, 19 },
+            { 0x003fffe7, 22 }, { 0x007ffff2, 23 }, { 0x003fffe8, 22 }, { 0x01ffffec, 25 },
+            { 0x03ffffe2, 26 }, { 0x03ffffe3, 26 }, { 0x03ffffe4, 26 }, { 0x07ffffde, 27 },
+            { 0x07ffffdf, 27 }, { 0x03ffffe5, 26 }, { 0x00fffff1, 24 }, { 0x01ffffed, 25 },
+            { 0x0007fff2, 19 }, { 0x001fffe3, 21 }, { 0x03ffffe6, 26 }, { 0x07ffffe0, 27 },
+            { 0x07ffffe1, 27 }, { 0x03ffffe7, 26 }, { 0x07ffffe2, 27 }, { 0x00fffff2, 24 },
+            { 0x001fffe4, 21 }, { 0x001fffe5, 21 }, { 0x03ffffe8, 26 }, { 0x03ffffe9, 26 },
+            { 0x0ffffffd, 28 }, { 0x07ffffe3, 27 }, { 0x07ffffe4, 27 }, { 0x07ffffe5, 27 },
+            { 0x000fffec, 20 }, { 0x00fffff3, 24 }, { 0x000fffed, 20 }, { 0x001fffe6, 21 },
+            { 0x003fffe9, 22 }, { 0x001fffe7, 21 }, { 0x001fffe8, 21 }, { 0x007ffff3, 23 },
+            { 0x003fffea, 22 }, { 0x003fffeb, 22 }, { 0x01ffffee, 25 }, { 0x01ffffef, 25 },
+            { 0x00fffff4, 24 }, { 0x00fffff5, 24 }, { 0x03ffffea, 26 }, { 0x007ffff4, 23 },
+            { 0x03ffffeb, 26 }, { 0x07ffffe6, 27 }, { 0x03ffffec, 26 }, { 0x03ffffed, 26 },
+            { 0x07ffffe7, 27 }, { 0x07ffffe8, 27 }, { 0x07ffffe9, 27 }, { 0x07ffffea, 27 },
+            { 0x07ffffeb, 27 }, { 0x0ffffffe, 28 }, { 0x07ffffec, 27 }, { 0x07ffffed, 27 },
+            { 0x07ffffee, 27 }, { 0x07ffffef, 27 }, { 0x07fffff0, 27 }, { 0x03ffffee, 26 },
+            { 0x3fffffff, 30 },
+        };
+
+        return &s_rgCodes[dwSymbol];
+    }
+
+    static
+    const HPACK_HUFFMAN_DECODE_TABLE *
+    QueryHuffmanDecodeTable()
+    {
+        static const HPACK_HUFFMAN_DECODE_TABLE s_table;
+
+        return &s_table;
+    }
+};
+
+//
+// The header fields both ends have seen, newest first. Entries are
+// evicted from the oldest end to stay within the maximum size.
+//
+class HPACK_DYNAMIC_TABLE
+{
+public:
+
+    HPACK_DYNAMIC_TABLE() :
+        m_pEntries(NULL),
+        m_cEntriesMax(0),
+        m_iNewest(0),
+        m_cEntries(0),
+        m_cbSize(0),
+        m_cbMaxSize(0)
+    {
+    }
+
+    ~HPACK_DYNAMIC_TABLE()
+    {
+        while (m_cEntries != 0)
+        {
+            EvictOldest();
+        }
+        delete[] m_pEntries;
+    }
+
+    //
+    // cbLimit is the most the size can be set to.
+    //
+    HRESULT
+    Initialize(
+        DWORD       cbLimit
+    )
+    {
+        m_cEntriesMax = cbLimit / HPACK_UTILITY::ENTRY_OVERHEAD + 1;
+        m_pEntries = new HPACK_DYNAMIC_ENTRY[m_cEntriesMax];
+        if (m_pEntries == NULL)
+        {
+            return E_OUTOFMEMORY;
+        }
+        m_cbMaxSize = cbLimit;
+        return S_OK;
+    }
+
+    DWORD
+    QueryCount() const
+    {
+        return m_cEntries;
+    }
+
+    DWORD
+    QueryMaxSize() const
+    {
+        return m_cbMaxSize;
+    }
+
+    //
+    // Entry 0 is the newest, dynamic index 62 of the address space.
+    //
+    VOID
+    QueryEntry(
+        DWORD               iEntry,
+        _Out_ PCSTR *       ppszName,
+        _Out_ DWORD *       pcchName,
+        _Out_ PCSTR *       ppszValue,
+        _Out_ DWORD *       pcchValue
+    ) const
+    {
+        const HPACK_DYNAMIC_ENTRY *pEntry;
+
+        DBG_ASSERT(iEntry < m_cEntries);
+
+        pEntry = &m_pEntries[(m_iNewest + m_cEntriesMax - iEntry) % m_cEntriesMax];
+        *ppszName = pEntry->pchField;
+        *pcchName = pEntry->cchName;
+        *ppszValue = pEntry->pchField + pEntry->cchName;
+        *pcchValue = pEntry->cchValue;
+    }
+
+    //
+    // The field is copied before anything is evicted, so it may come from
+    // the table itself. One larger than the table empties it.
+    //
+    HRESULT
+    Insert(
+        _In_reads_(cchName) PCSTR       pszName,
+        DWORD                           cchName,
+        _In_reads_(cchValue) PCSTR      pszValue,
+        DWORD                           cchValue
+    )
+    {
+        ULONGLONG   cbEntry = static_cast<ULONGLONG>(cchName) + cchValue + HPACK_UTILITY::ENTRY_OVERHEAD;
+        CHAR *      pchField;
+
+        if (cbEntry > m_cbMaxSize)
+        {
+            while (m_cEntries != 0)
+            {
+                EvictOldest();
+            }
+            return S_OK;
+        }
+
+        pchField = new CHAR[cchName + cchValue + 1];
+        if (pchField == NULL)
+        {
+            return E_OUTOFMEMORY;
+        }
+        memcpy(pchField, pszName, cchName);
+        memcpy(pchField + cchName, pszValue, cchValue);
+
+        while (m_cbSize + cbEntry > m_cbMaxSize)
+        {
+            EvictOldest();
+        }
+
+        m_iNewest = (m_iNewest + 1) % m_cEntriesMax;
+        m_pEntries[m_iNewest].pchField = pchField;
+        m_pEntries[m_iNewest].cchName = cchName;
+        m_pEntries[m_iNewest].cchValue = cchValue;
+        m_cEntries++;
+        m_cbSize += static_cast<DWORD>(cbEntry);
+        return S_OK;
+    }
+
+    VOID
+    SetMaxSize(
+        DWORD       cbMaxSize
+    )
+    {
+        DBG_ASSERT(cbMaxSize / HPACK_UTILITY::ENTRY_OVERHEAD + 1 <= m_cEntriesMax);
+
+        m_cbMaxSize = cbMaxSize;
+        while (m_cbSize > m_cbMaxSize)
+        {
+            EvictOldest();
+        }
+    }
+
+private:
+
+    struct HPACK_DYNAMIC_ENTRY
+    {
+        CHAR *      pchField;
+        DWORD       cchName;
+        DWORD       cchValue;
+    };
+
+    VOID
+    EvictOldest()
+    {
+        HPACK_DYNAMIC_ENTRY *pEntry = &m_pEntries[(m_iNewest + m_cEntriesMax - (m_cEntries - 1)) % m_cEntriesMax];
+
+        m_cbSize -= pEntry->cchName + pEntry->cchValue + HPACK_UTILITY::ENTRY_OVERHEAD;
+        delete[] pEntry->pchField;
+        pEntry->pchField = NULL;
+        m_cEntries--;
+    }
+
+    HPACK_DYNAMIC_ENTRY *   m_pEntries;
+    DWORD                   m_cEntriesMax;
+    DWORD                   m_iNewest;
+    DWORD                   m_cEntries;
+    DWORD                   m_cbSize;
+    DWORD                   m_cbMaxSize;
+};
+
+class HPACK_DECODER
+{
+public:
+
+    HPACK_DECODER() :
+        m_pchScratch(NULL),
+        m_cchScratch(0),
+        m_cbTableLimit(0)
+    {
+    }
+
+    ~HPACK_DECODER()
+    {
+        delete[] m_pchScratch;
+    }
+
+    //
+    // cbTableLimit is the SETTINGS_HEADER_TABLE_SIZE announced to the
+    // encoder. cchMaxStrings bounds the Huffman coded name and value of a
+    // field once decoded.
+    //
+    HRESULT
+    Initialize(
+        DWORD       cbTableLimit,
+        DWORD       cchMaxStrings
+    )
+    {
+        HRESULT hr;
+
+        if (FAILED(hr = m_table.Initialize(cbTableLimit)))
+        {
+            return hr;
+        }
+
+        m_pchScratch = new CHAR[cchMaxStrings];
+        if (m_pchScratch == NULL)
+        {
+            return E_OUTOFMEMORY;
+        }
+        m_cchScratch = cchMaxStrings;
+        m_cbTableLimit = cbTableLimit;
+        return S_OK;
+    }
+
+    //
+    // Decodes a complete header block, HEADERS and any CONTINUATION
+    // payloads put together. Any failure leaves the table out of step
+    // with the encoder, the connection cannot go on after one.
+    //
+    HRESULT
+    Decode(
+        _In_reads_bytes_(cbBlock) const BYTE *  pbBlock,
+        DWORD                                   cbBlock,
+        PFN_HPACK_HEADER                        pfnHeader,
+        PVOID                                   pvContext
+    )
+    {
+        HRESULT hr;
+        DWORD   ib = 0;
+        BOOL    fFieldSeen = FALSE;
+
+        while (ib < cbBlock)
+        {
+            BYTE    b = pbBlock[ib];
+            DWORD   dwIndex;
+            PCSTR   pszName;
+            DWORD   cchName;
+            PCSTR   pszValue;
+            DWORD   cchValue;
+            DWORD   cchScratchUsed = 0;
+            BOOL    fIndex;
+
+            if (b & 0x80)
+            {
+                //
+                // Indexed field.
+                //
+                if (FAILED(hr = HPACK_UTILITY::DecodeInteger(pbBlock, cbBlock, &ib, 7, &dwIndex)) ||
+                    FAILED(hr = LookUp(dwIndex, &pszName, &cchName, &pszValue, &cchValue)) ||
+                    FAILED(hr = pfnHeader(pvContext, pszName, cchName, pszValue, cchValue)))
+                {
+                    return hr;
+                }
+                fFieldSeen = TRUE;
+                continue;
+            }
+
+            if ((b & 0xe0) == 0x20)
+            {
+                //
+                // Dynamic table size update, only ahead of the first field.
+                //
+                if (fFieldSeen)
+                {
+                    return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+                }
+                if (FAILED(hr = HPACK_UTILITY::DecodeInteger(pbBlock, cbBlock, &ib, 5, &dwIndex)))
+                {
+                    return hr;
+                }
+                if (dwIndex > m_cbTableLimit)
+                {
+                    return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+                }
+                m_table.SetMaxSize(dwIndex);
+                continue;
+            }
+
+            //
+            // A literal field with incremental indexing, or one without
+            // indexing or never indexed, which are the same to a decoder
+            // that does not pass fields on.
+            //
+            fIndex = (b & 0xc0) == 0x40;
+            if (FAILED(hr = HPACK_UTILITY::DecodeInteger(pbBlock, cbBlock, &ib, fIndex ? 6 : 4, &dwIndex)))
+            {
+                return hr;
+            }
+
+            if (dwIndex != 0)
+            {
+                if (FAILED(hr = LookUp(dwIndex, &pszName, &cchName, &pszValue, &cchValue)))
+                {
+                    return hr;
+                }
+            }
+            else if (FAILED(hr = DecodeString(pbBlock, cbBlock, &ib, &cchScratchUsed, &pszName, &cchName)))
+            {
+                return hr;
+            }
+
+            if (FAILED(hr = DecodeString(pbBlock, cbBlock, &ib, &cchScratchUsed, &pszValue, &cchValue)))
+            {
+                return hr;
+            }
+
+            //
+            // Passed on before it is indexed, the name may be that of an
+            // entry the insert evicts.
+            //
+            if (FAILED(hr = pfnHeader(pvContext, pszName, cchName, pszValue, cchValue)))
+            {
+                return hr;
+            }
+            fFieldSeen = TRUE;
+
+            if (fIndex && FAILED(hr = m_table.Insert(pszName, cchName, pszValue, cchValue)))
+            {
+                return hr;
+            }
+        }
+
+        return S_OK;
+    }
+
+private:
+
+    HRESULT
+    LookUp(
+        DWORD               dwIndex,
+        _Out_ PCSTR *       ppszName,
+        _Out_ DWORD *       pcchName,
+        _Out_ PCSTR *       ppszValue,
+        _Out_ DWORD *       pcchValue
+    ) const
+    {
+        if (dwIndex == 0)
+        {
+            return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+        }
+
+        if (dwIndex <= HPACK_UTILITY::STATIC_TABLE_SIZE)
+        {
+            const HPACK_STATIC_ENTRY *pEntry = HPACK_UTILITY::QueryStaticEntry(dwIndex);
+
+            *ppszName = pEntry->pszName;
+            *pcchName = pEntry->cchName;
+            *ppszValue = pEntry->pszValue;
+            *pcchValue = pEntry->cchValue;
+            return S_OK;
+        }
+
+        dwIndex -= HPACK_UTILITY::STATIC_TABLE_SIZE + 1;
+        if (dwIndex >= m_table.QueryCount())
+        {
+            return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+        }
+
+        m_table.QueryEntry(dwIndex, ppszName, pcchName, ppszValue, pcchValue);
+        return S_OK;
+    }
+
+    //
+    // A plain literal is returned in place, a Huffman coded one is decoded
+    // into the scratch buffer after *pcchScratchUsed.
+    //
+    HRESULT
+    DecodeString(
+        _In_reads_bytes_(cbBlock) const BYTE *  pbBlock,
+        DWORD                                   cbBlock,
+        _Inout_ DWORD *                         pib,
+        _Inout_ DWORD *                         pcchScratchUsed,
+        _Out_ PCSTR *                           ppszString,
+        _Out_ DWORD *                           pcchString
+    )
+    {
+        HRESULT hr;
+        BOOL    fHuffman;
+        DWORD   cbString;
+        DWORD   cchDecoded;
+
+        if (*pib >= cbBlock)
+        {
+            return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+        }
+
+        fHuffman = (pbBlock[*pib] & 0x80) != 0;
+        if (FAILED(hr = HPACK_UTILITY::DecodeInteger(pbBlock, cbBlock, pib, 7, &cbString)))
+        {
+            return hr;
+        }
+        if (cbString > cbBlock - *pib)
+        {
+            return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+        }
+
+        if (!fHuffman)
+        {
+            *ppszString = reinterpret_cast<PCSTR>(pbBlock + *pib);
+            *pcchString = cbString;
+            *pib += cbString;
+            return S_OK;
+        }
+
+        if (FAILED(hr = HPACK_UTILITY::HuffmanDecode(pbBlock + *pib,
+                                                     cbString,
+                                                     m_pchScratch + *pcchScratchUsed,
+                                                     m_cchScratch - *pcchScratchUsed,
+                                                     &cchDecoded)))
+        {
+            return hr;
+        }
+
+        *ppszString = m_pchScratch + *pcchScratchUsed;
+        *pcchString = cchDecoded;
+        *pcchScratchUsed += cchDecoded;
+        *pib += cbString;
+        return S_OK;
+    }
+
+    HPACK_DYNAMIC_TABLE     m_table;
+    CHAR *                  m_pchScratch;
+    DWORD                   m_cchScratch;
+    DWORD                   m_cbTableLimit;
+};
+
+//
+// Encodes header fields one at a time into a block. Fields that repeat
+// from request to request go into the dynamic table, so a request after
+// the first mostly takes one byte per header. The path and the length
+// change every time and would only push those out, credentials are never
+// indexed by either end or any intermediary.
+//
+class HPACK_ENCODER
+{
+public:
+
+    HPACK_ENCODER() :
+        m_fSizeUpdatePending(FALSE)
+    {
+    }
+
+    HRESULT
+    Initialize(
+        DWORD       cbTableLimit
+    )
+    {
+        return m_table.Initialize(cbTableLimit);
+    }
+
+    //
+    // From the SETTINGS_HEADER_TABLE_SIZE of the decoder, applied and
+    // announced with the next block.
+    //
+    VOID
+    SetMaxTableSize(
+        DWORD       cbMaxSize
+    )
+    {
+        cbMaxSize = min(cbMaxSize, HPACK_UTILITY::DEFAULT_TABLE_SIZE);
+        if (cbMaxSize != m_table.QueryMaxSize())
+        {
+            m_table.SetMaxSize(cbMaxSize);
+            m_fSizeUpdatePending = TRUE;
+        }
+    }
+
+    //
+    // Starts a block at pbBlock + *pib.
+    //
+    HRESULT
+    BeginBlock(
+        _Out_writes_bytes_(cbBlock) BYTE *      pbBlock,
+        DWORD                                   cbBlock,
+        _Inout_ DWORD *                         pib
+    )
+    {
+        HRESULT hr;
+
+        if (m_fSizeUpdatePending)
+        {
+            if (FAILED(hr = HPACK_UTILITY::EncodeInteger(m_table.QueryMaxSize(), 5, 0x20, pbBlock, cbBlock, pib)))
+            {
+                return hr;
+            }
+            m_fSizeUpdatePending = FALSE;
+        }
+        return S_OK;
+    }
+
+    //
+    // Appends a field, the name in lower case. The table only changes once
+    // the field is written, but a block that is not sent after all leaves
+    // it out of step with the decoder.
+    //
+    HRESULT
+    Encode(
+        _In_reads_(cchName) PCSTR               pszName,
+        DWORD                                   cchName,
+        _In_reads_(cchValue) PCSTR              pszValue,
+        DWORD                                   cchValue,
+        _Out_writes_bytes_(cbBlock) BYTE *      pbBlock,
+        DWORD                                   cbBlock,
+        _Inout_ DWORD *                         pib
+    )
+    {
+        HRESULT     hr;
+        DWORD       dwNameIndex = 0;
+        DWORD       dwIndex = FindField(pszName, cchName, pszValue, cchValue, &dwNameIndex);
+        DWORD       ib = *pib;
+        BYTE        bFlags;
+        DWORD       cPrefixBits;
+        BOOL        fIndex = FALSE;
+
+        if (dwIndex != 0)
+        {
+            return HPACK_UTILITY::EncodeInteger(dwIndex, 7, 0x80, pbBlock, cbBlock, pib);
+        }
+
+        if (IsSensitive(pszName, cchName))
+        {
+            bFlags = 0x10;
+            cPrefixBits = 4;
+        }
+        else if (IsVolatile(pszName, cchName) ||
+                 static_cast<ULONGLONG>(cchName) + cchValue + HPACK_UTILITY::ENTRY_OVERHEAD > m_table.QueryMaxSize() / 2)
+        {
+            bFlags = 0x00;
+            cPrefixBits = 4;
+        }
+        else
+        {
+            bFlags = 0x40;
+            cPrefixBits = 6;
+            fIndex = TRUE;
+        }
+
+        if (FAILED(hr = HPACK_UTILITY::EncodeInteger(dwNameIndex, cPrefixBits, bFlags, pbBlock, cbBlock, &ib)))
+        {
+            return hr;
+        }
+        if (dwNameIndex == 0 &&
+            FAILED(hr = HPACK_UTILITY::EncodeString(pszName, cchName, pbBlock, cbBlock, &ib)))
+        {
+            return hr;
+        }
+        if (FAILED(hr = HPACK_UTILITY::EncodeString(pszValue, cchValue, pbBlock, cbBlock, &ib)))
+        {
+            return hr;
+        }
+
+        if (fIndex && FAILED(hr = m_table.Insert(pszName, cchName, pszValue, cchValue)))
+        {
+            return hr;
+        }
+
+        *pib = ib;
+        return S_OK;
+    }
+
+private:
+
+    //
+    // The index of the field, or 0 with the lowest index of its name in
+    // *pdwNameIndex, 0 too when the name is new.
+    //
+    DWORD
+    FindField(
+        _In_reads_(cchName) PCSTR       pszName,
+        DWORD                           cchName,
+        _In_reads_(cchValue) PCSTR      pszValue,
+        DWORD                           cchValue,
+        _Out_ DWORD *                   pdwNameIndex
+    ) const
+    {
+        *pdwNameIndex = 0;
+
+        for (DWORD i = 1; i <= HPACK_UTILITY::STATIC_TABLE_SIZE; i++)
+        {
+            const HPACK_STATIC_ENTRY *pEntry = HPACK_UTILITY::QueryStaticEntry(i);
+
+            if (pEntry->cchName == cchName && memcmp(pEntry->pszName, pszName, cchName) == 0)
+            {
+                if (pEntry->cchValue == cchValue && memcmp(pEntry->pszValue, pszValue, cchValue) == 0)
+                {
+                    return i;
+                }
+                if (*pdwNameIndex == 0)
+                {
+                    *pdwNameIndex = i;
+                }
+            }
+        }
+
+        for (DWORD i = 0; i < m_table.QueryCount(); i++)
+        {
+            PCSTR pszEntryName;
+            DWORD cchEntryName;
+            PCSTR pszEntryValue;
+            DWORD cchEntryValue;
+
+            m_table.QueryEntry(i, &pszEntryName, &cchEntryName, &pszEntryValue, &cchEntryValue);
+            if (cchEntryName == cchName && memcmp(pszEntryName, pszName, cchName) == 0)
+            {
+                if (cchEntryValue == cchValue && memcmp(pszEntryValue, pszValue, cchValue) == 0)
+                {
+                    return HPACK_UTILITY::STATIC_TABLE_SIZE + 1 + i;
+                }
+                if (*pdwNameIndex == 0)
+                {
+                    *pdwNameIndex = HPACK_UTILITY::STATIC_TABLE_SIZE + 1 + i;
+                }
+            }
+        }
+
+        return 0;
+    }
+
+    static
+    BOOL
+    IsSensitive(
+        _In_reads_(cchName) PCSTR       pszName,
+        DWORD                           cchName
+    )
+    {
+        return (cchName == 13 && memcmp(pszName, "authorization", 13) == 0) ||
+               (cchName == 19 && memcmp(pszName, "proxy-authorization", 19) == 0);
+    }
+
+    static
+    BOOL
+    IsVolatile(
+        _In_reads_(cchName) PCSTR       pszName,
+        DWORD                           cchName
+    )
+    {
+        return (cchName == 5 && memcmp(pszName, ":path", 5) == 0) ||
+               (cchName == 14 && memcmp(pszName, "content-length", 14) == 0);
+    }
+
+    HPACK_DYNAMIC_TABLE     m_table;
+    BOOL                    m_fSizeUpdatePending;
+};
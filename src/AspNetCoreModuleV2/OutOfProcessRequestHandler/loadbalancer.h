@@ -0,0 +1,104 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#pragma once
+
+//
+// LOAD_BALANCER picks the backend slot a request is routed to when
+// processesPerApplication > 1.
+//
+// Every policy starts from the round robin slot. A slot whose process is
+// missing or not ready is returned as is, so that cold slots are started at
+// the round robin rate and a slot that keeps failing to start does not
+// attract every request. Among ready slots:
+//
+//  LOAD_BALANCING_LEAST_OUTSTANDING     picks the slot with the fewest
+//                                       requests in flight, ties go to the
+//                                       round robin slot.
+//
+//  LOAD_BALANCING_POWER_OF_TWO_CHOICES  compares the round robin slot with
+//                                       one other pseudo-random slot and
+//                                       picks the less loaded one.
+//
+// The load function returns the number of requests in flight on a slot or
+// SLOT_NOT_READY. Loads are read without synchronization, a stale value
+// only costs one less than optimal pick.
+//
+
+class LOAD_BALANCER
+{
+public:
+
+    static const LONG       SLOT_NOT_READY = -1;
+
+    template<typename FunctionQueryLoad>
+    static
+    DWORD
+    SelectSlot(
+        LOAD_BALANCING_POLICY   policy,
+        DWORD                   cSlots,
+        volatile LONG *         plRouteIndex,
+        FunctionQueryLoad       QueryLoad
+    )
+    {
+        DWORD dwRoute = static_cast<DWORD>(InterlockedIncrement(plRouteIndex));
+        DWORD dwFirst = dwRoute % cSlots;
+
+        if (policy == LOAD_BALANCING_ROUND_ROBIN || cSlots == 1)
+        {
+            return dwFirst;
+        }
+
+        LONG lBestLoad = QueryLoad(dwFirst);
+        if (lBestLoad == SLOT_NOT_READY)
+        {
+            return dwFirst;
+        }
+
+        DWORD dwBest = dwFirst;
+
+        if (policy == LOAD_BALANCING_POWER_OF_TWO_CHOICES)
+        {
+            //
+            // Any slot other than the first one, scrambled so that
+            // consecutive requests do not pair up the same neighbours.
+            //
+            DWORD dwOther = (dwFirst + 1 + Scramble(dwRoute) % (cSlots - 1)) % cSlots;
+            LONG lOtherLoad = QueryLoad(dwOther);
+
+            if (lOtherLoad != SLOT_NOT_READY && lOtherLoad < lBestLoad)
+            {
+                dwBest = dwOther;
+            }
+            return dwBest;
+        }
+
+        for (DWORD i = 1; i < cSlots && lBestLoad > 0; i++)
+        {
+            DWORD dwSlot = (dwFirst + i) % cSlots;
+            LONG lLoad = QueryLoad(dwSlot);
+
+            if (lLoad != SLOT_NOT_READY && lLoad < lBestLoad)
+            {
+                dwBest = dwSlot;
+                lBestLoad = lLoad;
+            }
+        }
+
+        return dwBest;
+    }
+
+private:
+
+    static
+    DWORD
+    Scramble(
+        DWORD       dwValue
+    )
+    {
+        //
+        // Multiplicative hash, the high bits are the well mixed ones.
+        //
+        return (dwValue * 2654435761UL) >> 16;
+    }
+};
@@ -0,0 +1,1275 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#pragma once
+
+//
+// LOCAL_HTTP_CONNECTION is an HTTP/1.1 client connection to a backend on
+// this machine, over an AF_UNIX socket or over loopback TCP. FORWARDING_HANDLER
+// uses it in place of WinHTTP when the backend listens on a Unix domain
+// socket or connections to it are pooled, see BACKEND_CONNECTION_POOL.
+//
+// A connection blocks unless it is made non-blocking with SetNonBlocking.
+// Its calls then fail with ERROR_IO_PENDING instead of waiting and keep
+// where they were, the same call goes on from there once LOCAL_SOCKET_POLLER
+// says the socket is ready.
+//
+// Only BSD socket calls are used, so the connection builds on Linux as
+// well and the two transports can be compared against any stand-in
+// server. Windows has AF_UNIX stream sockets since 10 1803.
+//
+
+#ifdef _WIN32
+
+#include <ws2tcpip.h>
+#include <afunix.h>
+
+#define LOCAL_SOCKET_ERROR_CODE()       WSAGetLastError()
+#define LOCAL_SOCKET_IS_RESET(error)    ((error) == WSAECONNRESET || (error) == WSAECONNABORTED)
+#define LOCAL_SOCKET_IS_PENDING(error)  ((error) == WSAEWOULDBLOCK)
+#define LOCAL_SOCKET_SEND_FLAGS         0
+#define LOCAL_SOCKET_SHUTDOWN_BOTH      SD_BOTH
+
+#else
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <strings.h>
+
+typedef int SOCKET;
+typedef pollfd WSAPOLLFD;
+
+#define INVALID_SOCKET                  (-1)
+#define SOCKET_ERROR                    (-1)
+#define closesocket                     close
+#define _strnicmp                       strncasecmp
+#define WSAPoll                         poll
+#define LOCAL_SOCKET_ERROR_CODE()       errno
+#define LOCAL_SOCKET_IS_RESET(error)    ((error) == ECONNRESET || (error) == EPIPE)
+#define LOCAL_SOCKET_IS_PENDING(error)  ((error) == EAGAIN || (error) == EWOULDBLOCK)
+#define LOCAL_SOCKET_SEND_FLAGS         MSG_NOSIGNAL
+#define LOCAL_SOCKET_SHUTDOWN_BOTH      SHUT_RDWR
+
+#endif
+
+enum LOCAL_TRANSPORT
+{
+    LOCAL_TRANSPORT_TCP,
+    LOCAL_TRANSPORT_UNIX_SOCKET
+};
+
+//
+// A stream socket to a local endpoint, closed when it goes away.
+//
+class LOCAL_SOCKET
+{
+public:
+
+    LOCAL_SOCKET() :
+        m_socket(INVALID_SOCKET)
+    {
+    }
+
+    ~LOCAL_SOCKET()
+    {
+        Close();
+    }
+
+    BOOL
+    IsOpen() const
+    {
+        return m_socket != INVALID_SOCKET;
+    }
+
+    SOCKET
+    QuerySocket() const
+    {
+        return m_socket;
+    }
+
+    HRESULT
+    Connect(
+        LOCAL_TRANSPORT     transport,
+        _In_opt_ PCSTR      pszPath,
+        USHORT              usPort
+    )
+    {
+        HRESULT             hr;
+        sockaddr_un         unixAddress;
+        sockaddr_in         tcpAddress;
+        const sockaddr *    pAddress;
+        int                 cbAddress;
+
+        if (transport == LOCAL_TRANSPORT_UNIX_SOCKET)
+        {
+            if (FAILED(hr = FillUnixAddress(pszPath, &unixAddress)))
+            {
+                return hr;
+            }
+            pAddress = reinterpret_cast<const sockaddr *>(&unixAddress);
+            cbAddress = sizeof(unixAddress);
+        }
+        else
+        {
+            FillLoopbackAddress(usPort, &tcpAddress);
+            pAddress = reinterpret_cast<const sockaddr *>(&tcpAddress);
+            cbAddress = sizeof(tcpAddress);
+        }
+
+        if (FAILED(hr = Open(transport)))
+        {
+            return hr;
+        }
+
+        if (connect(m_socket, pAddress, cbAddress) == SOCKET_ERROR)
+        {
+            hr = LastError();
+            Close();
+            return hr;
+        }
+        return S_OK;
+    }
+
+    //
+    // Listens on pszPath, or on a loopback port which is returned in
+    // *pusPort when it is 0. For stand-in servers.
+    //
+    HRESULT
+    Listen(
+        LOCAL_TRANSPORT     transport,
+        _In_opt_ PCSTR      pszPath,
+        _Inout_ USHORT *    pusPort
+    )
+    {
+        HRESULT             hr;
+        sockaddr_un         unixAddress;
+        sockaddr_in         tcpAddress;
+        const sockaddr *    pAddress;
+        int                 cbAddress;
+
+        if (transport == LOCAL_TRANSPORT_UNIX_SOCKET)
+        {
+            if (FAILED(hr = FillUnixAddress(pszPath, &unixAddress)))
+            {
+                return hr;
+            }
+            pAddress = reinterpret_cast<const sockaddr *>(&unixAddress);
+            cbAddress = sizeof(unixAddress);
+        }
+        else
+        {
+            FillLoopbackAddress(*pusPort, &tcpAddress);
+            pAddress = reinterpret_cast<const sockaddr *>(&tcpAddress);
+            cbAddress = sizeof(tcpAddress);
+        }
+
+        if (FAILED(hr = Open(transport)))
+        {
+            return hr;
+        }
+
+        if (bind(m_socket, pAddress, cbAddress) == SOCKET_ERROR ||
+            listen(m_socket, SOMAXCONN) == SOCKET_ERROR)
+        {
+            hr = LastError();
+            Close();
+            return hr;
+        }
+
+        if (transport == LOCAL_TRANSPORT_TCP)
+        {
+            socklen_t cbBound = sizeof(tcpAddress);
+            if (getsockname(m_socket, reinterpret_cast<sockaddr *>(&tcpAddress), &cbBound) == SOCKET_ERROR)
+            {
+                hr = LastError();
+                Close();
+                return hr;
+            }
+            *pusPort = ntohs(tcpAddress.sin_port);
+        }
+        return S_OK;
+    }
+
+    HRESULT
+    Accept(
+        _Out_ LOCAL_SOCKET *    pClient
+    )
+    {
+        SOCKET socket = accept(m_socket, NULL, NULL);
+        if (socket == INVALID_SOCKET)
+        {
+            return LastError();
+        }
+
+        pClient->Close();
+        pClient->m_socket = socket;
+        return S_OK;
+    }
+
+    //
+    // A non-blocking loopback datagram socket connected to itself, what
+    // is sent on it can be received on it. LOCAL_SOCKET_POLLER wakes its
+    // thread with one.
+    //
+    HRESULT
+    OpenLoopback()
+    {
+        HRESULT     hr;
+        sockaddr_in address;
+        socklen_t   cbAddress = sizeof(address);
+
+        Close();
+
+        m_socket = socket(AF_INET, SOCK_DGRAM, 0);
+        if (m_socket == INVALID_SOCKET)
+        {
+            return LastError();
+        }
+
+        FillLoopbackAddress(0, &address);
+        if (bind(m_socket, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) == SOCKET_ERROR ||
+            getsockname(m_socket, reinterpret_cast<sockaddr *>(&address), &cbAddress) == SOCKET_ERROR ||
+            connect(m_socket, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) == SOCKET_ERROR)
+        {
+            hr = LastError();
+            Close();
+            return hr;
+        }
+
+        if (FAILED(hr = SetNonBlocking()))
+        {
+            Close();
+            return hr;
+        }
+        return S_OK;
+    }
+
+    //
+    // Sends and receives fail with ERROR_IO_PENDING instead of waiting.
+    //
+    HRESULT
+    SetNonBlocking()
+    {
+#ifdef _WIN32
+        u_long fNonBlocking = 1;
+
+        if (ioctlsocket(m_socket, FIONBIO, &fNonBlocking) == SOCKET_ERROR)
+        {
+            return LastError();
+        }
+#else
+        int flags = fcntl(m_socket, F_GETFL, 0);
+
+        if (flags == -1 || fcntl(m_socket, F_SETFL, flags | O_NONBLOCK) == -1)
+        {
+            return LastError();
+        }
+#endif
+        return S_OK;
+    }
+
+    //
+    // Sends and receives fail once they take longer than dwTimeoutMs, 0
+    // waits forever.
+    //
+    HRESULT
+    SetTimeout(
+        DWORD       dwTimeoutMs
+    )
+    {
+#ifdef _WIN32
+        DWORD timeout = dwTimeoutMs;
+#else
+        timeval timeout;
+        timeout.tv_sec = dwTimeoutMs / 1000;
+        timeout.tv_usec = (dwTimeoutMs % 1000) * 1000;
+#endif
+        if (setsockopt(m_socket, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char *>(&timeout), sizeof(timeout)) == SOCKET_ERROR ||
+            setsockopt(m_socket, SOL_SOCKET, SO_SNDTIMEO, reinterpret_cast<const char *>(&timeout), sizeof(timeout)) == SOCKET_ERROR)
+        {
+            return LastError();
+        }
+        return S_OK;
+    }
+
+    //
+    // Sends all of pvData.
+    //
+    HRESULT
+    Send(
+        _In_reads_bytes_(cbData) const VOID *   pvData,
+        DWORD                                   cbData
+    )
+    {
+        DWORD cbSent;
+
+        return Send(pvData, cbData, &cbSent);
+    }
+
+    //
+    // *pcbSent is how much of pvData went before a failure, a non-blocking
+    // socket that takes no more fails with ERROR_IO_PENDING.
+    //
+    HRESULT
+    Send(
+        _In_reads_bytes_(cbData) const VOID *   pvData,
+        DWORD                                   cbData,
+        _Out_ DWORD *                           pcbSent
+    )
+    {
+        const char *pch = static_cast<const char *>(pvData);
+
+        *pcbSent = 0;
+
+        while (cbData != 0)
+        {
+            int cbSent = send(m_socket, pch, static_cast<int>(min(cbData, static_cast<DWORD>(INT_MAX))), LOCAL_SOCKET_SEND_FLAGS);
+            if (cbSent == SOCKET_ERROR)
+            {
+                return LastError();
+            }
+            pch += cbSent;
+            cbData -= cbSent;
+            *pcbSent += cbSent;
+        }
+        return S_OK;
+    }
+
+    //
+    // *pcbReceived is 0 once the other end has closed the connection.
+    //
+    HRESULT
+    Receive(
+        _Out_writes_bytes_(cbBuffer) VOID *     pvBuffer,
+        DWORD                                   cbBuffer,
+        _Out_ DWORD *                           pcbReceived
+    )
+    {
+        int cbReceived = recv(m_socket, static_cast<char *>(pvBuffer), static_cast<int>(min(cbBuffer, static_cast<DWORD>(INT_MAX))), 0);
+
+        if (cbReceived == SOCKET_ERROR)
+        {
+            *pcbReceived = 0;
+            return LastError();
+        }
+        *pcbReceived = cbReceived;
+        return S_OK;
+    }
+
+    //
+    // Whether data, or the end of the connection, is waiting to be
+    // received.
+    //
+    BOOL
+    IsReadable() const
+    {
+        WSAPOLLFD pollFd;
+
+        pollFd.fd = m_socket;
+        pollFd.events = POLLIN;
+        pollFd.revents = 0;
+        return WSAPoll(&pollFd, 1, 0) != 0;
+    }
+
+    VOID
+    Close()
+    {
+        if (m_socket != INVALID_SOCKET)
+        {
+            closesocket(m_socket);
+            m_socket = INVALID_SOCKET;
+        }
+    }
+
+    //
+    // Ends the connection in both directions without closing the socket,
+    // so that a call blocked on it in another thread returns.
+    //
+    VOID
+    Shutdown()
+    {
+        if (m_socket != INVALID_SOCKET)
+        {
+            shutdown(m_socket, LOCAL_SOCKET_SHUTDOWN_BOTH);
+        }
+    }
+
+    //
+    // The error of the last failed call. A connection reset by the other
+    // end is ERROR_CONNECTION_ABORTED, the same as one it closed, and a
+    // call that would block is ERROR_IO_PENDING.
+    //
+    static
+    HRESULT
+    LastError()
+    {
+        int error = LOCAL_SOCKET_ERROR_CODE();
+
+        if (LOCAL_SOCKET_IS_PENDING(error))
+        {
+            return HRESULT_FROM_WIN32(ERROR_IO_PENDING);
+        }
+        return HRESULT_FROM_WIN32(LOCAL_SOCKET_IS_RESET(error) ? ERROR_CONNECTION_ABORTED : error);
+    }
+
+private:
+
+    HRESULT
+    Open(
+        LOCAL_TRANSPORT     transport
+    )
+    {
+        Close();
+
+        m_socket = socket(transport == LOCAL_TRANSPORT_UNIX_SOCKET ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
+        if (m_socket == INVALID_SOCKET)
+        {
+            return LastError();
+        }
+
+        if (transport == LOCAL_TRANSPORT_TCP)
+        {
+            //
+            // Requests go out in one send and responses are read whole, do
+            // not hold small writes back.
+            //
+            int fNoDelay = 1;
+            setsockopt(m_socket, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char *>(&fNoDelay), sizeof(fNoDelay));
+        }
+        return S_OK;
+    }
+
+    static
+    HRESULT
+    FillUnixAddress(
+        _In_ PCSTR          pszPath,
+        _Out_ sockaddr_un * pAddress
+    )
+    {
+        size_t cchPath = (pszPath != NULL) ? strlen(pszPath) : 0;
+
+        ZeroMemory(pAddress, sizeof(*pAddress));
+        if (cchPath == 0 || cchPath >= sizeof(pAddress->sun_path))
+        {
+            return HRESULT_FROM_WIN32(ERROR_BAD_PATHNAME);
+        }
+
+        pAddress->sun_family = AF_UNIX;
+        memcpy(pAddress->sun_path, pszPath, cchPath);
+        return S_OK;
+    }
+
+    static
+    VOID
+    FillLoopbackAddress(
+        USHORT              usPort,
+        _Out_ sockaddr_in * pAddress
+    )
+    {
+        ZeroMemory(pAddress, sizeof(*pAddress));
+        pAddress->sin_family = AF_INET;
+        pAddress->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        pAddress->sin_port = htons(usPort);
+    }
+
+    SOCKET      m_socket;
+};
+
+//
+// One request at a time: the caller sends the request head and body with
+// Send, then reads the response with ReceiveResponseHead and ReadBody. The
+// body is returned without its framing, a chunked body is decoded. The
+// connection may carry the next request when IsReusable says so.
+//
+// The response is parsed as it comes in: the head read so far and a
+// partial line of chunk framing are kept on the connection, so that a
+// non-blocking read can stop anywhere.
+//
+class LOCAL_HTTP_CONNECTION
+{
+public:
+
+    static const DWORD      BUFFER_SIZE = 16 * 1024;
+    static const DWORD      MAX_LINE_SIZE = 256;
+
+    LOCAL_HTTP_CONNECTION() :
+        m_pchHead(NULL),
+        m_cbMaxHead(0),
+        m_ibBuffer(0),
+        m_cbBuffer(0),
+        m_fReadingHead(FALSE),
+        m_cchHead(0),
+        m_ichLine(0),
+        m_cchLine(0),
+        m_body(BODY_DONE),
+        m_cbBodyRemaining(0),
+        m_fChunkEnd(FALSE),
+        m_fKeepAlive(FALSE),
+        m_fResponseStarted(FALSE),
+        m_dwTimeoutMs(0)
+    {
+    }
+
+    ~LOCAL_HTTP_CONNECTION()
+    {
+        delete[] m_pchHead;
+    }
+
+    //
+    // cbMaxHead caps the response status line and headers.
+    //
+    HRESULT
+    Connect(
+        LOCAL_TRANSPORT     transport,
+        _In_opt_ PCSTR      pszPath,
+        USHORT              usPort,
+        DWORD               dwTimeoutMs,
+        DWORD               cbMaxHead
+    )
+    {
+        HRESULT hr;
+
+        if (m_pchHead == NULL || m_cbMaxHead != cbMaxHead)
+        {
+            delete[] m_pchHead;
+            m_pchHead = new CHAR[cbMaxHead + 1];
+            if (m_pchHead == NULL)
+            {
+                return E_OUTOFMEMORY;
+            }
+            m_cbMaxHead = cbMaxHead;
+        }
+
+        Reset();
+        m_dwTimeoutMs = 0;
+
+        if (FAILED(hr = m_socket.Connect(transport, pszPath, usPort)))
+        {
+            return hr;
+        }
+
+        if (FAILED(hr = SetTimeout(dwTimeoutMs)))
+        {
+            m_socket.Close();
+            return hr;
+        }
+
+        //
+        // A new connection can carry a request until a response says
+        // otherwise.
+        //
+        m_fKeepAlive = TRUE;
+        return S_OK;
+    }
+
+    //
+    // Bounds each send and receive, 0 and INFINITE wait forever. A pooled
+    // connection gets the timeout of each request it carries.
+    //
+    HRESULT
+    SetTimeout(
+        DWORD       dwTimeoutMs
+    )
+    {
+        HRESULT hr;
+
+        if (dwTimeoutMs == INFINITE)
+        {
+            dwTimeoutMs = 0;
+        }
+
+        if (dwTimeoutMs != m_dwTimeoutMs)
+        {
+            if (FAILED(hr = m_socket.SetTimeout(dwTimeoutMs)))
+            {
+                return hr;
+            }
+            m_dwTimeoutMs = dwTimeoutMs;
+        }
+        return S_OK;
+    }
+
+    //
+    // For a connection that is waited on with LOCAL_SOCKET_POLLER.
+    //
+    HRESULT
+    SetNonBlocking()
+    {
+        return m_socket.SetNonBlocking();
+    }
+
+    const LOCAL_SOCKET *
+    QuerySocket() const
+    {
+        return &m_socket;
+    }
+
+    HRESULT
+    Send(
+        _In_reads_bytes_(cbData) const VOID *   pvData,
+        DWORD                                   cbData
+    )
+    {
+        return m_socket.Send(pvData, cbData);
+    }
+
+    //
+    // A non-blocking send that fails with ERROR_IO_PENDING has sent
+    // *pcbSent of pvData, the rest goes with the next call.
+    //
+    HRESULT
+    Send(
+        _In_reads_bytes_(cbData) const VOID *   pvData,
+        DWORD                                   cbData,
+        _Out_ DWORD *                           pcbSent
+    )
+    {
+        return m_socket.Send(pvData, cbData, pcbSent);
+    }
+
+    //
+    // Reads the status line and headers of the response into a buffer of
+    // the connection, which stays valid until the next response. Interim
+    // 1xx responses other than 101 are skipped. fNoBody is set for a
+    // response to HEAD.
+    //
+    HRESULT
+    ReceiveResponseHead(
+        BOOL                fNoBody,
+        _Outptr_ PSTR *     ppszHead,
+        _Out_ DWORD *       pcchHead,
+        _Out_ USHORT *      puStatus
+    )
+    {
+        HRESULT hr;
+        DWORD   cchHead;
+        USHORT  uStatus;
+
+        *ppszHead = NULL;
+        *pcchHead = 0;
+        *puStatus = 0;
+
+        if (!m_fReadingHead)
+        {
+            m_fReadingHead = TRUE;
+            m_fResponseStarted = FALSE;
+            m_cchHead = 0;
+            m_ichLine = 0;
+        }
+
+        do
+        {
+            hr = ReadHead();
+            if (hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING))
+            {
+                return hr;
+            }
+
+            cchHead = m_cchHead;
+            m_cchHead = 0;
+            m_ichLine = 0;
+
+            if (FAILED(hr) ||
+                FAILED(hr = ParseHead(cchHead, fNoBody, &uStatus)))
+            {
+                m_fReadingHead = FALSE;
+                m_fKeepAlive = FALSE;
+                return hr;
+            }
+        } while (uStatus >= 100 && uStatus < 200 && uStatus != 101);
+
+        m_fReadingHead = FALSE;
+
+        *ppszHead = m_pchHead;
+        *pcchHead = cchHead;
+        *puStatus = uStatus;
+        return S_OK;
+    }
+
+    //
+    // Reads up to cbBuffer bytes of the response body, *pcbRead is 0 at
+    // its end.
+    //
+    HRESULT
+    ReadBody(
+        _Out_writes_bytes_(cbBuffer) BYTE *     pbBuffer,
+        DWORD                                   cbBuffer,
+        _Out_ DWORD *                           pcbRead
+    )
+    {
+        HRESULT hr = S_OK;
+        DWORD   cchLine;
+
+        *pcbRead = 0;
+
+        for (;;)
+        {
+            switch (m_body)
+            {
+            case BODY_DONE:
+                return S_OK;
+
+            case BODY_UNTIL_CLOSE:
+                if (FAILED(hr = ReadRaw(pbBuffer, cbBuffer, pcbRead)))
+                {
+                    break;
+                }
+                if (*pcbRead == 0)
+                {
+                    m_body = BODY_DONE;
+                }
+                return S_OK;
+
+            case BODY_LENGTH:
+            case BODY_CHUNK_DATA:
+                if (m_cbBodyRemaining == 0)
+                {
+                    m_body = (m_body == BODY_LENGTH) ? BODY_DONE : BODY_CHUNK_SIZE;
+                    m_fChunkEnd = (m_body == BODY_CHUNK_SIZE);
+                    continue;
+                }
+                if (FAILED(hr = ReadRaw(pbBuffer,
+                                        static_cast<DWORD>(min(static_cast<ULONGLONG>(cbBuffer), m_cbBodyRemaining)),
+                                        pcbRead)))
+                {
+                    break;
+                }
+                if (*pcbRead == 0)
+                {
+                    hr = HRESULT_FROM_WIN32(ERROR_CONNECTION_ABORTED);
+                    break;
+                }
+                m_cbBodyRemaining -= *pcbRead;
+                return S_OK;
+
+            case BODY_CHUNK_SIZE:
+                if (FAILED(hr = ReadLine(&cchLine)))
+                {
+                    break;
+                }
+                if (m_fChunkEnd)
+                {
+                    //
+                    // The CRLF after the data of the previous chunk.
+                    //
+                    if (cchLine != 0)
+                    {
+                        hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+                        break;
+                    }
+                    m_fChunkEnd = FALSE;
+                    continue;
+                }
+                if (FAILED(hr = ParseChunkSize(m_rgchLine, cchLine, &m_cbBodyRemaining)))
+                {
+                    break;
+                }
+                m_body = (m_cbBodyRemaining == 0) ? BODY_TRAILERS : BODY_CHUNK_DATA;
+                continue;
+
+            case BODY_TRAILERS:
+                if (FAILED(hr = ReadLine(&cchLine)))
+                {
+                    break;
+                }
+                if (cchLine == 0)
+                {
+                    m_body = BODY_DONE;
+                }
+                continue;
+            }
+
+            //
+            // Only failures get here, a read that would block goes on
+            // from where it is.
+            //
+            if (hr == HRESULT_FROM_WIN32(ERROR_IO_PENDING))
+            {
+                return hr;
+            }
+            m_fKeepAlive = FALSE;
+            m_body = BODY_DONE;
+            return hr;
+        }
+    }
+
+    //
+    // The connection is new, or the response has been read to its end and
+    // the backend keeps the connection open.
+    //
+    BOOL
+    IsReusable() const
+    {
+        return m_socket.IsOpen() && m_fKeepAlive && !m_fReadingHead && m_body == BODY_DONE;
+    }
+
+    //
+    // Whether any of the response has come in. A reused connection that
+    // fails before that was most likely closed by the backend while idle.
+    //
+    BOOL
+    IsResponseStarted() const
+    {
+        return m_fResponseStarted;
+    }
+
+    //
+    // An idle connection the backend has not closed: nothing is waiting to
+    // be read on it.
+    //
+    BOOL
+    IsIdleAlive() const
+    {
+        return IsReusable() && !m_socket.IsReadable();
+    }
+
+    VOID
+    Close()
+    {
+        m_socket.Close();
+        Reset();
+    }
+
+    //
+    // "1a;ext=1" is 26, the size must fit in 15 hex digits.
+    //
+    static
+    HRESULT
+    ParseChunkSize(
+        _In_reads_(cchLine) PCSTR   pszLine,
+        DWORD                       cchLine,
+        _Out_ ULONGLONG *           pcbChunk
+    )
+    {
+        ULONGLONG   cbChunk = 0;
+        DWORD       i;
+
+        for (i = 0; i < cchLine && i < 15; i++)
+        {
+            CHAR ch = pszLine[i];
+            if (ch >= '0' && ch <= '9')
+            {
+                cbChunk = cbChunk * 16 + (ch - '0');
+            }
+            else if ((ch | 0x20) >= 'a' && (ch | 0x20) <= 'f')
+            {
+                cbChunk = cbChunk * 16 + ((ch | 0x20) - 'a' + 10);
+            }
+            else
+            {
+                break;
+            }
+        }
+
+        if (i == 0 ||
+            (i < cchLine && pszLine[i] != ';' && pszLine[i] != ' ' && pszLine[i] != '\t'))
+        {
+            return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+        }
+
+        *pcbChunk = cbChunk;
+        return S_OK;
+    }
+
+private:
+
+    enum BODY_STATE
+    {
+        BODY_DONE,
+        BODY_LENGTH,
+        BODY_UNTIL_CLOSE,
+        BODY_CHUNK_SIZE,
+        BODY_CHUNK_DATA,
+        BODY_TRAILERS
+    };
+
+    VOID
+    Reset()
+    {
+        m_ibBuffer = 0;
+        m_cbBuffer = 0;
+        m_fReadingHead = FALSE;
+        m_cchHead = 0;
+        m_ichLine = 0;
+        m_cchLine = 0;
+        m_body = BODY_DONE;
+        m_cbBodyRemaining = 0;
+        m_fChunkEnd = FALSE;
+        m_fKeepAlive = FALSE;
+        m_fResponseStarted = FALSE;
+    }
+
+    HRESULT
+    Fill()
+    {
+        HRESULT hr;
+        DWORD   cbReceived;
+
+        if (FAILED(hr = m_socket.Receive(m_rgbBuffer, BUFFER_SIZE, &cbReceived)))
+        {
+            return hr;
+        }
+        if (cbReceived == 0)
+        {
+            return HRESULT_FROM_WIN32(ERROR_CONNECTION_ABORTED);
+        }
+
+        m_ibBuffer = 0;
+        m_cbBuffer = cbReceived;
+        return S_OK;
+    }
+
+    //
+    // Buffered bytes first, large reads of an empty buffer go straight to
+    // the caller.
+    //
+    HRESULT
+    ReadRaw(
+        _Out_writes_bytes_(cbBuffer) BYTE *     pbBuffer,
+        DWORD                                   cbBuffer,
+        _Out_ DWORD *                           pcbRead
+    )
+    {
+        HRESULT hr;
+        DWORD   cbCopy;
+
+        *pcbRead = 0;
+
+        if (m_ibBuffer == m_cbBuffer)
+        {
+            if (cbBuffer >= BUFFER_SIZE / 2)
+            {
+                return m_socket.Receive(pbBuffer, cbBuffer, pcbRead);
+            }
+
+            if (FAILED(hr = Fill()))
+            {
+                //
+                // The end of the connection is the end of the data.
+                //
+                return hr == HRESULT_FROM_WIN32(ERROR_CONNECTION_ABORTED) ? S_OK : hr;
+            }
+        }
+
+        cbCopy = min(cbBuffer, m_cbBuffer - m_ibBuffer);
+        memcpy(pbBuffer, m_rgbBuffer + m_ibBuffer, cbCopy);
+        m_ibBuffer += cbCopy;
+        *pcbRead = cbCopy;
+        return S_OK;
+    }
+
+    //
+    // Reads a line up to LF into m_rgchLine without its CRLF, *pcchLine is
+    // its full length while only MAX_LINE_SIZE - 1 characters of it are
+    // kept.
+    //
+    HRESULT
+    ReadLine(
+        _Out_ DWORD *               pcchLine
+    )
+    {
+        HRESULT hr;
+        DWORD   cchLine;
+
+        for (;;)
+        {
+            if (m_ibBuffer == m_cbBuffer && FAILED(hr = Fill()))
+            {
+                return hr;
+            }
+
+            CHAR ch = static_cast<CHAR>(m_rgbBuffer[m_ibBuffer++]);
+            if (ch == '\n')
+            {
+                break;
+            }
+            if (m_cchLine < MAX_LINE_SIZE - 1)
+            {
+                m_rgchLine[m_cchLine] = ch;
+            }
+            m_cchLine++;
+        }
+
+        cchLine = m_cchLine;
+        m_cchLine = 0;
+
+        if (cchLine != 0 && cchLine <= MAX_LINE_SIZE - 1 && m_rgchLine[cchLine - 1] == '\r')
+        {
+            cchLine--;
+        }
+        else if (cchLine > MAX_LINE_SIZE - 1)
+        {
+            //
+            // Too long to have been a size line, and a long trailer line
+            // is not empty either way.
+            //
+            cchLine--;
+        }
+
+        m_rgchLine[min(cchLine, MAX_LINE_SIZE - 1)] = '\0';
+        *pcchLine = cchLine;
+        return S_OK;
+    }
+
+    //
+    // Copies lines into the head buffer until the empty line, m_cchHead is
+    // then the length of the head.
+    //
+    HRESULT
+    ReadHead()
+    {
+        HRESULT hr;
+
+        for (;;)
+        {
+            if (m_ibBuffer == m_cbBuffer && FAILED(hr = Fill()))
+            {
+                return hr;
+            }
+
+            const BYTE *pbStart = m_rgbBuffer + m_ibBuffer;
+            const BYTE *pbNewline = static_cast<const BYTE *>(memchr(pbStart, '\n', m_cbBuffer - m_ibBuffer));
+            DWORD cbCopy = (pbNewline != NULL) ?
+                static_cast<DWORD>(pbNewline - pbStart) + 1 :
+                m_cbBuffer - m_ibBuffer;
+
+            if (cbCopy > m_cbMaxHead - m_cchHead)
+            {
+                return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+            }
+
+            memcpy(m_pchHead + m_cchHead, pbStart, cbCopy);
+            m_fResponseStarted = TRUE;
+            m_cchHead += cbCopy;
+            m_ibBuffer += cbCopy;
+
+            if (pbNewline == NULL)
+            {
+                continue;
+            }
+
+            //
+            // An empty line, "\r\n" or "\n", ends the head. Leading empty
+            // lines are not part of it.
+            //
+            DWORD cchLine = m_cchHead - m_ichLine;
+            if (cchLine == 1 || (cchLine == 2 && m_pchHead[m_ichLine] == '\r'))
+            {
+                if (m_ichLine != 0)
+                {
+                    break;
+                }
+                m_cchHead = 0;
+            }
+            m_ichLine = m_cchHead;
+        }
+
+        m_pchHead[m_cchHead] = '\0';
+        return S_OK;
+    }
+
+    //
+    // Reads the status and the headers that frame the body, without
+    // touching the head.
+    //
+    HRESULT
+    ParseHead(
+        DWORD               cchHead,
+        BOOL                fNoBody,
+        _Out_ USHORT *      puStatus
+    )
+    {
+        PCSTR       pszLine = m_pchHead;
+        PCSTR       pszEnd = m_pchHead + cchHead;
+        PCSTR       pszNext;
+        USHORT      uStatus = 0;
+        BOOL        fChunked = FALSE;
+        BOOL        fContentLength = FALSE;
+        ULONGLONG   cbContentLength = 0;
+
+        //
+        // "HTTP/1.1 200 OK"
+        //
+        if (cchHead < 12 || _strnicmp(pszLine, "HTTP/1.", 7) != 0 || pszLine[8] != ' ')
+        {
+            return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+        }
+        for (DWORD i = 9; i < 12; i++)
+        {
+            if (pszLine[i] < '0' || pszLine[i] > '9')
+            {
+                return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+            }
+            uStatus = static_cast<USHORT>(uStatus * 10 + (pszLine[i] - '0'));
+        }
+
+        m_fKeepAlive = (pszLine[7] != '0');
+
+        for (pszLine = NextLine(pszLine, pszEnd); pszLine < pszEnd; pszLine = pszNext)
+        {
+            pszNext = NextLine(pszLine, pszEnd);
+
+            if (HeaderIs(pszLine, pszNext, "Content-Length"))
+            {
+                PCSTR pszValue = HeaderValue(pszLine, pszNext);
+                if (*pszValue < '0' || *pszValue > '9')
+                {
+                    return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+                }
+                cbContentLength = _strtoui64(pszValue, NULL, 10);
+                fContentLength = TRUE;
+            }
+            else if (HeaderIs(pszLine, pszNext, "Transfer-Encoding"))
+            {
+                fChunked = ValueEndsWith(pszLine, pszNext, "chunked");
+            }
+            else if (HeaderIs(pszLine, pszNext, "Connection"))
+            {
+                if (ValueEndsWith(pszLine, pszNext, "close"))
+                {
+                    m_fKeepAlive = FALSE;
+                }
+                else if (ValueEndsWith(pszLine, pszNext, "keep-alive"))
+                {
+                    m_fKeepAlive = TRUE;
+                }
+            }
+        }
+
+        m_cbBodyRemaining = 0;
+        m_fChunkEnd = FALSE;
+
+        if (fNoBody || (uStatus >= 100 && uStatus < 200) || uStatus == 204 || uStatus == 304)
+        {
+            m_body = BODY_DONE;
+            if (uStatus == 101)
+            {
+                //
+                // Whatever follows belongs to another protocol.
+                //
+                m_fKeepAlive = FALSE;
+            }
+        }
+        else if (fChunked)
+        {
+            m_body = BODY_CHUNK_SIZE;
+        }
+        else if (fContentLength)
+        {
+            m_body = BODY_LENGTH;
+            m_cbBodyRemaining = cbContentLength;
+        }
+        else
+        {
+            m_body = BODY_UNTIL_CLOSE;
+            m_fKeepAlive = FALSE;
+        }
+
+        *puStatus = uStatus;
+        return S_OK;
+    }
+
+    static
+    PCSTR
+    NextLine(
+        PCSTR       pszLine,
+        PCSTR       pszEnd
+    )
+    {
+        PCSTR pszNewline = static_cast<PCSTR>(memchr(pszLine, '\n', pszEnd - pszLine));
+        return (pszNewline != NULL) ? pszNewline + 1 : pszEnd;
+    }
+
+    static
+    BOOL
+    HeaderIs(
+        PCSTR       pszLine,
+        PCSTR       pszNext,
+        PCSTR       pszName
+    )
+    {
+        size_t cchName = strlen(pszName);
+
+        return static_cast<size_t>(pszNext - pszLine) > cchName &&
+               pszLine[cchName] == ':' &&
+               _strnicmp(pszLine, pszName, cchName) == 0;
+    }
+
+    static
+    PCSTR
+    HeaderValue(
+        PCSTR       pszLine,
+        PCSTR       pszNext
+    )
+    {
+        PCSTR pszValue = static_cast<PCSTR>(memchr(pszLine, ':', pszNext - pszLine)) + 1;
+
+        while (pszValue < pszNext && (*pszValue == ' ' || *pszValue == '\t'))
+        {
+            pszValue++;
+        }
+        return pszValue;
+    }
+
+    //
+    // Whether the last token of a list value is pszToken, "gzip, chunked"
+    // is chunked.
+    //
+    static
+    BOOL
+    ValueEndsWith(
+        PCSTR       pszLine,
+        PCSTR       pszNext,
+        PCSTR       pszToken
+    )
+    {
+        PCSTR   pszValue = HeaderValue(pszLine, pszNext);
+        PCSTR   pszValueEnd = pszNext;
+        size_t  cchToken = strlen(pszToken);
+
+        while (pszValueEnd > pszValue &&
+               (pszValueEnd[-1] == '\r' || pszValueEnd[-1] == '\n' ||
+                pszValueEnd[-1] == ' ' || pszValueEnd[-1] == '\t'))
+        {
+            pszValueEnd--;
+        }
+
+        return static_cast<size_t>(pszValueEnd - pszValue) >= cchToken &&
+               _strnicmp(pszValueEnd - cchToken, pszToken, cchToken) == 0 &&
+               (pszValueEnd - cchToken == pszValue ||
+                pszValueEnd[-static_cast<ptrdiff_t>(cchToken) - 1] == ',' ||
+                pszValueEnd[-static_cast<ptrdiff_t>(cchToken) - 1] == ' ');
+    }
+
+    LOCAL_SOCKET    m_socket;
+    CHAR *          m_pchHead;
+    DWORD           m_cbMaxHead;
+
+    BYTE            m_rgbBuffer[BUFFER_SIZE];
+    DWORD           m_ibBuffer;
+    DWORD           m_cbBuffer;
+
+    //
+    // The head read so far and where its last line starts, and the chunk
+    // framing line read so far.
+    //
+    BOOL            m_fReadingHead;
+    DWORD           m_cchHead;
+    DWORD           m_ichLine;
+    CHAR            m_rgchLine[MAX_LINE_SIZE];
+    DWORD           m_cchLine;
+
+    BODY_STATE      m_body;
+    ULONGLONG       m_cbBodyRemaining;
+    BOOL            m_fChunkEnd;
+    BOOL            m_fKeepAlive;
+    BOOL            m_fResponseStarted;
+    DWORD           m_dwTimeoutMs;
+};
@@ -0,0 +1,377 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#pragma once
+
+#include "localhttpconnection.h"
+
+//
+// LOCAL_SOCKET_POLLER waits for non-blocking local sockets on one thread,
+// so that a request whose backend connection is not ready holds no thread
+// while it waits. A wait is one-shot: Wait queues it, and its callback is
+// called once, on the poller thread, when the socket can be read or
+// written, has failed, or the poller shuts down. Cancel takes back a wait
+// whose callback has not been called. Once the poller has shut down Wait
+// fails and nothing is called back.
+//
+// The thread polls the sockets of all the waits at once. A wait queued
+// while it polls wakes it with a datagram on a loopback socket connected
+// to itself, and is polled in the next round. Callbacks run on the thread
+// and hold up every other wait, they are to post the work and return.
+//
+
+typedef
+VOID
+(*PFN_LOCAL_SOCKET_READY)(
+    PVOID       pvContext
+);
+
+//
+// Kept by the owner of the socket, on the list of the poller while queued.
+// dwRound and iPollFd say where the socket is in the array being polled.
+//
+struct LOCAL_SOCKET_WAIT
+{
+    LIST_ENTRY                  listEntry;
+    SOCKET                      socket;
+    SHORT                       events;
+    PFN_LOCAL_SOCKET_READY      pfnReady;
+    PVOID                       pvContext;
+    DWORD                       dwRound;
+    DWORD                       iPollFd;
+    BOOL                        fQueued;
+};
+
+class LOCAL_SOCKET_POLLER
+{
+public:
+
+    LOCAL_SOCKET_POLLER() :
+        m_hThread(NULL),
+        m_fShutdown(FALSE),
+        m_fWakePending(FALSE),
+        m_cWaits(0),
+        m_dwRound(0),
+        m_rgPollFds(NULL),
+        m_cPollFds(0)
+    {
+        InitializeSRWLock(&m_srwLock);
+        InitializeListHead(&m_waitList);
+    }
+
+    ~LOCAL_SOCKET_POLLER()
+    {
+        Shutdown();
+        delete[] m_rgPollFds;
+    }
+
+    HRESULT
+    Initialize()
+    {
+        HRESULT hr;
+
+        if (FAILED(hr = m_wakeSocket.OpenLoopback()))
+        {
+            return hr;
+        }
+
+        m_hThread = CreateThread(NULL, 0, PollerThreadProc, this, 0, NULL);
+        if (m_hThread == NULL)
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            m_wakeSocket.Close();
+            return hr;
+        }
+        return S_OK;
+    }
+
+    static
+    VOID
+    InitializeWait(
+        _Out_ LOCAL_SOCKET_WAIT *   pWait,
+        PFN_LOCAL_SOCKET_READY      pfnReady,
+        PVOID                       pvContext
+    )
+    {
+        InitializeListHead(&pWait->listEntry);
+        pWait->socket = INVALID_SOCKET;
+        pWait->events = 0;
+        pWait->pfnReady = pfnReady;
+        pWait->pvContext = pvContext;
+        pWait->dwRound = 0;
+        pWait->iPollFd = 0;
+        pWait->fQueued = FALSE;
+    }
+
+    //
+    // Calls pWait back once pSocket can be read, or written with fWrite.
+    // Fails with ERROR_OPERATION_ABORTED after Shutdown.
+    //
+    HRESULT
+    Wait(
+        _In_ LOCAL_SOCKET_WAIT *    pWait,
+        _In_ const LOCAL_SOCKET *   pSocket,
+        BOOL                        fWrite
+    )
+    {
+        BOOL fWake;
+
+        DBG_ASSERT(!pWait->fQueued);
+
+        pWait->socket = pSocket->QuerySocket();
+        pWait->events = fWrite ? POLLOUT : POLLIN;
+        pWait->dwRound = 0;
+
+        AcquireSRWLockExclusive(&m_srwLock);
+
+        if (m_fShutdown)
+        {
+            ReleaseSRWLockExclusive(&m_srwLock);
+            return HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED);
+        }
+
+        InsertTailList(&m_waitList, &pWait->listEntry);
+        pWait->fQueued = TRUE;
+        m_cWaits++;
+
+        fWake = !m_fWakePending;
+        m_fWakePending = TRUE;
+
+        ReleaseSRWLockExclusive(&m_srwLock);
+
+        if (fWake)
+        {
+            Wake();
+        }
+        return S_OK;
+    }
+
+    //
+    // TRUE when pWait was still queued and is not called back. Otherwise
+    // its callback has been called or is about to be.
+    //
+    BOOL
+    Cancel(
+        _In_ LOCAL_SOCKET_WAIT *    pWait
+    )
+    {
+        BOOL fQueued;
+
+        AcquireSRWLockExclusive(&m_srwLock);
+
+        fQueued = pWait->fQueued;
+        if (fQueued)
+        {
+            RemoveEntryList(&pWait->listEntry);
+            pWait->fQueued = FALSE;
+            m_cWaits--;
+        }
+
+        ReleaseSRWLockExclusive(&m_srwLock);
+
+        return fQueued;
+    }
+
+    //
+    // Stops the thread, the waits still queued are called back on it before
+    // it ends.
+    //
+    VOID
+    Shutdown()
+    {
+        AcquireSRWLockExclusive(&m_srwLock);
+        m_fShutdown = TRUE;
+        ReleaseSRWLockExclusive(&m_srwLock);
+
+        if (m_hThread != NULL)
+        {
+            Wake();
+            WaitForSingleObject(m_hThread, INFINITE);
+            CloseHandle(m_hThread);
+            m_hThread = NULL;
+        }
+        m_wakeSocket.Close();
+    }
+
+private:
+
+    VOID
+    Wake()
+    {
+        BYTE b = 0;
+
+        //
+        // A full buffer of the wake socket already wakes the thread.
+        //
+        m_wakeSocket.Send(&b, sizeof(b));
+    }
+
+    static
+    DWORD
+    WINAPI
+    PollerThreadProc(
+        LPVOID      pvContext
+    )
+    {
+        static_cast<LOCAL_SOCKET_POLLER *>(pvContext)->Poll();
+        return 0;
+    }
+
+    VOID
+    Poll()
+    {
+        LIST_ENTRY          readyList;
+        LOCAL_SOCKET_WAIT * pWait;
+        DWORD               cPollFds;
+        DWORD               dwRound;
+        BOOL                fFailed;
+
+        for (;;)
+        {
+            InitializeListHead(&readyList);
+
+            AcquireSRWLockExclusive(&m_srwLock);
+
+            if (m_fShutdown)
+            {
+                while (!IsListEmpty(&m_waitList))
+                {
+                    pWait = CONTAINING_RECORD(RemoveHeadList(&m_waitList), LOCAL_SOCKET_WAIT, listEntry);
+                    pWait->fQueued = FALSE;
+                    InsertTailList(&readyList, &pWait->listEntry);
+                }
+                m_cWaits = 0;
+
+                ReleaseSRWLockExclusive(&m_srwLock);
+
+                CallReady(&readyList);
+                return;
+            }
+
+            if (m_cWaits + 1 > m_cPollFds)
+            {
+                //
+                // Grow without the lock and take the snapshot again.
+                //
+                DWORD cNeeded = max(m_cWaits + 1, m_cPollFds * 2);
+
+                ReleaseSRWLockExclusive(&m_srwLock);
+
+                WSAPOLLFD *rgPollFds = new WSAPOLLFD[cNeeded];
+                if (rgPollFds == NULL)
+                {
+                    Sleep(10);
+                    continue;
+                }
+                delete[] m_rgPollFds;
+                m_rgPollFds = rgPollFds;
+                m_cPollFds = cNeeded;
+                continue;
+            }
+
+            //
+            // A wait queued from here on wakes the thread again.
+            //
+            m_fWakePending = FALSE;
+
+            dwRound = ++m_dwRound;
+            if (dwRound == 0)
+            {
+                dwRound = m_dwRound = 1;
+            }
+
+            m_rgPollFds[0].fd = m_wakeSocket.QuerySocket();
+            m_rgPollFds[0].events = POLLIN;
+            m_rgPollFds[0].revents = 0;
+            cPollFds = 1;
+
+            for (LIST_ENTRY *pEntry = m_waitList.Flink; pEntry != &m_waitList; pEntry = pEntry->Flink)
+            {
+                pWait = CONTAINING_RECORD(pEntry, LOCAL_SOCKET_WAIT, listEntry);
+                pWait->dwRound = dwRound;
+                pWait->iPollFd = cPollFds;
+                m_rgPollFds[cPollFds].fd = pWait->socket;
+                m_rgPollFds[cPollFds].events = pWait->events;
+                m_rgPollFds[cPollFds].revents = 0;
+                cPollFds++;
+            }
+
+            ReleaseSRWLockExclusive(&m_srwLock);
+
+            //
+            // Should the poll itself fail, every wait is called back and
+            // its owner finds out from the socket.
+            //
+            fFailed = WSAPoll(m_rgPollFds, cPollFds, -1) == SOCKET_ERROR;
+
+            if (m_rgPollFds[0].revents != 0)
+            {
+                BYTE    rgbDrain[64];
+                DWORD   cbReceived;
+
+                while (SUCCEEDED(m_wakeSocket.Receive(rgbDrain, sizeof(rgbDrain), &cbReceived)) && cbReceived != 0)
+                {
+                }
+            }
+
+            //
+            // Only the waits still on the list are looked at, one that was
+            // cancelled while the thread polled is gone from it.
+            //
+            AcquireSRWLockExclusive(&m_srwLock);
+
+            for (LIST_ENTRY *pEntry = m_waitList.Flink; pEntry != &m_waitList; )
+            {
+                pWait = CONTAINING_RECORD(pEntry, LOCAL_SOCKET_WAIT, listEntry);
+                pEntry = pEntry->Flink;
+
+                if (pWait->dwRound == dwRound &&
+                    (fFailed || m_rgPollFds[pWait->iPollFd].revents != 0))
+                {
+                    RemoveEntryList(&pWait->listEntry);
+                    pWait->fQueued = FALSE;
+                    m_cWaits--;
+                    InsertTailList(&readyList, &pWait->listEntry);
+                }
+            }
+
+            ReleaseSRWLockExclusive(&m_srwLock);
+
+            CallReady(&readyList);
+        }
+    }
+
+    //
+    // A callback may queue its wait again, take each off the list first.
+    //
+    static
+    VOID
+    CallReady(
+        _In_ LIST_ENTRY *   pReadyList
+    )
+    {
+        while (!IsListEmpty(pReadyList))
+        {
+            LOCAL_SOCKET_WAIT *pWait = CONTAINING_RECORD(RemoveHeadList(pReadyList), LOCAL_SOCKET_WAIT, listEntry);
+
+            InitializeListHead(&pWait->listEntry);
+            pWait->pfnReady(pWait->pvContext);
+        }
+    }
+
+    HANDLE              m_hThread;
+    LOCAL_SOCKET        m_wakeSocket;
+
+    SRWLOCK             m_srwLock;
+    LIST_ENTRY          m_waitList;
+    BOOL                m_fShutdown;
+    BOOL                m_fWakePending;
+    DWORD               m_cWaits;
+    DWORD               m_dwRound;
+
+    //
+    // Used by the thread only.
+    //
+    WSAPOLLFD *         m_rgPollFds;
+    DWORD               m_cPollFds;
+};
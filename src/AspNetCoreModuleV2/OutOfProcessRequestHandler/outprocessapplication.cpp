@@ -14,6 +14,9 @@ OUT_OF_PROCESS_APPLICATION::OUT_OF_PROCESS_APPLICATION(
     m_pConfig(std::move(pConfig))
 {
     m_pProcessManager = NULL;
+    m_pResponseCache = NULL;
+    m_pRequestCoalescer = NULL;
+    m_pAdmissionLimiter = NULL;
 }
 
 OUT_OF_PROCESS_APPLICATION::~OUT_OF_PROCESS_APPLICATION()
@@ -25,6 +28,28 @@ OUT_OF_PROCESS_APPLICATION::~OUT_OF_PROCESS_APPLICATION()
         m_pProcessManager->DereferenceProcessManager();
         m_pProcessManager = NULL;
     }
+
+    if (m_pAdmissionLimiter != NULL)
+    {
+        m_pAdmissionLimiter->Dump();
+        delete m_pAdmissionLimiter;
+        m_pAdmissionLimiter = NULL;
+    }
+
+    if (m_pRequestCoalescer != NULL)
+    {
+        m_pRequestCoalescer->Dump();
+        delete m_pRequestCoalescer;
+        m_pRequestCoalescer = NULL;
+    }
+
+    if (m_pResponseCache != NULL)
+    {
+        m_pResponseCache->Dump();
+        m_pResponseCache->Shutdown();
+        m_pResponseCache->DereferenceResponseCache();
+        m_pResponseCache = NULL;
+    }
 }
 
 HRESULT
@@ -36,6 +61,49 @@ OUT_OF_PROCESS_APPLICATION::Initialize(
         m_pProcessManager = new PROCESS_MANAGER();
         RETURN_IF_FAILED(m_pProcessManager->Initialize());
     }
+
+    if (m_pResponseCache == NULL && m_pConfig->QueryResponseCacheSize() != 0)
+    {
+        RESPONSE_CACHE *pResponseCache = new RESPONSE_CACHE();
+        HRESULT hr = pResponseCache->Initialize(m_pConfig->QueryResponseCacheSize());
+        if (FAILED_LOG(hr))
+        {
+            pResponseCache->DereferenceResponseCache();
+            return hr;
+        }
+        m_pResponseCache = pResponseCache;
+    }
+
+    if (m_pRequestCoalescer == NULL &&
+        m_pResponseCache != NULL &&
+        m_pConfig->QueryRequestCoalescingTimeoutInMS() != 0)
+    {
+        m_pRequestCoalescer = new REQUEST_COALESCER();
+        HRESULT hr = m_pRequestCoalescer->Initialize(m_pConfig->QueryRequestCoalescingTimeoutInMS(),
+                                                     REQUEST_COALESCER::DEFAULT_MAX_FLIGHTS,
+                                                     g_pTimerWheel);
+        if (FAILED_LOG(hr))
+        {
+            delete m_pRequestCoalescer;
+            m_pRequestCoalescer = NULL;
+            return hr;
+        }
+    }
+
+    if (m_pAdmissionLimiter == NULL && m_pConfig->QueryMaxConcurrentRequests() != 0)
+    {
+        m_pAdmissionLimiter = new ADMISSION_LIMITER();
+        HRESULT hr = m_pAdmissionLimiter->Initialize(m_pConfig->QueryMaxConcurrentRequests(),
+                                                     m_pConfig->QueryMaxQueuedRequests(),
+                                                     m_pConfig->QueryRequestQueueTimeoutInMS(),
+                                                     g_pTimerWheel);
+        if (FAILED_LOG(hr))
+        {
+            delete m_pAdmissionLimiter;
+            m_pAdmissionLimiter = NULL;
+            return hr;
+        }
+    }
     return S_OK;
 }
 
@@ -51,11 +51,39 @@ public:
         return m_pConfig.get();
     }
 
+    //
+    // NULL unless the responseCacheSizeInMB handler setting is set.
+    //
+    RESPONSE_CACHE* QueryResponseCache()
+    {
+        return m_pResponseCache;
+    }
+
+    //
+    // NULL unless requestCoalescingTimeoutInMS is set along with the
+    // response cache.
+    //
+    REQUEST_COALESCER* QueryRequestCoalescer()
+    {
+        return m_pRequestCoalescer;
+    }
+
+    //
+    // NULL unless the maxConcurrentRequests handler setting is set.
+    //
+    ADMISSION_LIMITER* QueryAdmissionLimiter()
+    {
+        return m_pAdmissionLimiter;
+    }
+
 private:
 
     VOID SetWebsocketStatus(IHttpContext *pHttpContext);
 
     PROCESS_MANAGER * m_pProcessManager;
+    RESPONSE_CACHE   *m_pResponseCache;
+    REQUEST_COALESCER *m_pRequestCoalescer;
+    ADMISSION_LIMITER *m_pAdmissionLimiter;
     IHttpServer      *m_pHttpServer;
 
     WEBSOCKET_STATUS              m_fWebSocketSupported;
@@ -0,0 +1,461 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#pragma once
+
+#include "percpu.h"
+
+//
+// The phases a forwarded request goes through, each timed on its own:
+//
+// QUEUE         waiting in the admission queue
+// CONNECT       getting a backend connection or h2c stream
+// SEND          sending the request head and body
+// FIRST_BYTE    from the end of the request to the response headers
+// BODY          from the response headers to the end of the response
+// CLIENT_WRITE  flushing the response to the client, all flushes of a
+//               request together, they overlap BODY
+//
+enum REQUEST_PHASE
+{
+    REQUEST_PHASE_QUEUE,
+    REQUEST_PHASE_CONNECT,
+    REQUEST_PHASE_SEND,
+    REQUEST_PHASE_FIRST_BYTE,
+    REQUEST_PHASE_BODY,
+    REQUEST_PHASE_CLIENT_WRITE,
+    REQUEST_PHASE_COUNT
+};
+
+//
+// One phase, in microseconds. The percentiles and the maximum are the top
+// of the histogram bucket they fall in, at most 1/8 above the real value.
+//
+struct REQUEST_PHASE_STATS
+{
+    ULONGLONG   cSamples;
+    ULONGLONG   ullMeanUs;
+    ULONGLONG   ullP50Us;
+    ULONGLONG   ullP90Us;
+    ULONGLONG   ullP99Us;
+    ULONGLONG   ullMaxUs;
+};
+
+struct REQUEST_PHASE_LATENCY_COUNTERS
+{
+    REQUEST_PHASE_STATS rgPhases[REQUEST_PHASE_COUNT];
+};
+
+//
+// REQUEST_PHASE_LATENCY keeps a histogram of the time of every phase, in
+// QueryPerformanceCounter ticks. Recording touches only the cache lines of
+// the current processor: one interlocked increment of a bucket and one
+// interlocked add to the total, no locks. QueryCounters adds up the
+// processors and turns ticks into microseconds.
+//
+// The buckets are log-linear, as in HdrHistogram: values below 16 ticks
+// have one bucket each, every power of two above has 8, up to 2^36 ticks
+// (nearly two hours at 10MHz). Longer times go in the last bucket.
+//
+class REQUEST_PHASE_LATENCY
+{
+public:
+
+    static const DWORD      SUB_BUCKET_BITS = 4;
+    static const DWORD      SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const DWORD      HALF_SUB_BUCKETS = SUB_BUCKETS / 2;
+    static const DWORD      MAX_VALUE_BITS = 36;
+    static const DWORD      BUCKETS = (MAX_VALUE_BITS - SUB_BUCKET_BITS + 2) * HALF_SUB_BUCKETS;
+
+    REQUEST_PHASE_LATENCY() :
+        m_pHistograms(NULL)
+    {
+    }
+
+    ~REQUEST_PHASE_LATENCY()
+    {
+        if (m_pHistograms != NULL)
+        {
+            m_pHistograms->Dispose();
+            m_pHistograms = NULL;
+        }
+    }
+
+    HRESULT
+    Initialize()
+    {
+        //
+        // Read once here, the frequency does not change after boot.
+        //
+        QueryFrequency();
+
+        return PER_CPU<PHASE_HISTOGRAMS>::Create(
+                    [] (PHASE_HISTOGRAMS * pHistograms)
+                    {
+                        ZeroMemory(pHistograms, sizeof(*pHistograms));
+                    },
+                    &m_pHistograms);
+    }
+
+    static
+    LONGLONG
+    QueryTimestamp()
+    {
+        LARGE_INTEGER liNow;
+
+        QueryPerformanceCounter(&liNow);
+        return liNow.QuadPart;
+    }
+
+    static
+    ULONGLONG
+    TicksToMicroseconds(
+        ULONGLONG   ullTicks
+    )
+    {
+        return ullTicks * 1000000 / QueryFrequency();
+    }
+
+    VOID
+    Record(
+        REQUEST_PHASE   phase,
+        LONGLONG        llTicks
+    )
+    {
+        PHASE_HISTOGRAM *pHistogram = &m_pHistograms->GetLocal()->rgPhases[phase];
+
+        //
+        // The counter may go back a little between processors.
+        //
+        if (llTicks < 0)
+        {
+            llTicks = 0;
+        }
+
+        InterlockedIncrement64(&pHistogram->rgcBuckets[QueryBucket(llTicks)]);
+        InterlockedExchangeAdd64(&pHistogram->llTotalTicks, llTicks);
+    }
+
+    VOID
+    QueryCounters(
+        _Out_ REQUEST_PHASE_LATENCY_COUNTERS *  pCounters
+    )
+    {
+        for (DWORD phase = 0; phase < REQUEST_PHASE_COUNT; phase++)
+        {
+            ULONGLONG rgcBuckets[BUCKETS] = {};
+            ULONGLONG ullTotalTicks = 0;
+            ULONGLONG cSamples = 0;
+
+            m_pHistograms->ForEach(
+                [phase, &rgcBuckets, &ullTotalTicks] (PHASE_HISTOGRAMS * pHistograms)
+                {
+                    PHASE_HISTOGRAM *pHistogram = &pHistograms->rgPhases[phase];
+
+                    for (DWORD i = 0; i < BUCKETS; i++)
+                    {
+                        rgcBuckets[i] += pHistogram->rgcBuckets[i];
+                    }
+                    ullTotalTicks += pHistogram->llTotalTicks;
+                });
+
+            for (DWORD i = 0; i < BUCKETS; i++)
+            {
+                cSamples += rgcBuckets[i];
+            }
+
+            REQUEST_PHASE_STATS *pStats = &pCounters->rgPhases[phase];
+
+            ZeroMemory(pStats, sizeof(*pStats));
+            pStats->cSamples = cSamples;
+            if (cSamples == 0)
+            {
+                continue;
+            }
+
+            pStats->ullMeanUs = TicksToMicroseconds(ullTotalTicks / cSamples);
+            pStats->ullP50Us = TicksToMicroseconds(QueryPercentile(rgcBuckets, cSamples, 50));
+            pStats->ullP90Us = TicksToMicroseconds(QueryPercentile(rgcBuckets, cSamples, 90));
+            pStats->ullP99Us = TicksToMicroseconds(QueryPercentile(rgcBuckets, cSamples, 99));
+            pStats->ullMaxUs = TicksToMicroseconds(QueryPercentile(rgcBuckets, cSamples, 100));
+        }
+    }
+
+    //
+    // Writes the counters to the debug log.
+    //
+    VOID
+    Dump()
+    {
+        REQUEST_PHASE_LATENCY_COUNTERS counters;
+
+        QueryCounters(&counters);
+
+        for (DWORD phase = 0; phase < REQUEST_PHASE_COUNT; phase++)
+        {
+            const REQUEST_PHASE_STATS *pStats = &counters.rgPhases[phase];
+
+            DebugPrintf(ASPNETCORE_DEBUG_FLAG_INFO,
+                "REQUEST_PHASE_LATENCY %s: %I64u samples, mean %I64uus, p50 %I64uus, p90 %I64uus, p99 %I64uus, max %I64uus",
+                QueryPhaseName(static_cast<REQUEST_PHASE>(phase)),
+                pStats->cSamples,
+                pStats->ullMeanUs,
+                pStats->ullP50Us,
+                pStats->ullP90Us,
+                pStats->ullP99Us,
+                pStats->ullMaxUs);
+        }
+    }
+
+    static
+    PCSTR
+    QueryPhaseName(
+        REQUEST_PHASE   phase
+    )
+    {
+        switch (phase)
+        {
+        case REQUEST_PHASE_QUEUE:           return "queue";
+        case REQUEST_PHASE_CONNECT:         return "connect";
+        case REQUEST_PHASE_SEND:            return "send";
+        case REQUEST_PHASE_FIRST_BYTE:      return "first-byte";
+        case REQUEST_PHASE_BODY:            return "body";
+        case REQUEST_PHASE_CLIENT_WRITE:    return "client-write";
+        default:                            return "unknown";
+        }
+    }
+
+    static
+    DWORD
+    QueryBucket(
+        ULONGLONG   ullTicks
+    )
+    {
+        DWORD iHighBit;
+
+        if (ullTicks < SUB_BUCKETS)
+        {
+            return static_cast<DWORD>(ullTicks);
+        }
+
+        if ((ullTicks >> MAX_VALUE_BITS) != 0)
+        {
+            return BUCKETS - 1;
+        }
+
+        //
+        // The top SUB_BUCKET_BITS bits pick the bucket within the power of
+        // two, their first one is always set.
+        //
+        _BitScanReverse64(&iHighBit, ullTicks);
+
+        DWORD dwShift = iHighBit - (SUB_BUCKET_BITS - 1);
+        return dwShift * HALF_SUB_BUCKETS + static_cast<DWORD>(ullTicks >> dwShift);
+    }
+
+    //
+    // The largest value that goes in bucket i.
+    //
+    static
+    ULONGLONG
+    QueryBucketLimit(
+        DWORD       i
+    )
+    {
+        if (i < SUB_BUCKETS)
+        {
+            return i;
+        }
+
+        DWORD dwShift = i / HALF_SUB_BUCKETS - 1;
+        ULONGLONG ullTop = i % HALF_SUB_BUCKETS + HALF_SUB_BUCKETS;
+        return ((ullTop + 1) << dwShift) - 1;
+    }
+
+private:
+
+    struct PHASE_HISTOGRAM
+    {
+        volatile LONGLONG   llTotalTicks;
+        volatile LONGLONG   rgcBuckets[BUCKETS];
+    };
+
+    struct PHASE_HISTOGRAMS
+    {
+        PHASE_HISTOGRAM     rgPhases[REQUEST_PHASE_COUNT];
+    };
+
+    REQUEST_PHASE_LATENCY(const REQUEST_PHASE_LATENCY &);
+    void operator=(const REQUEST_PHASE_LATENCY &);
+
+    static
+    LONGLONG
+    QueryFrequency()
+    {
+        static LONGLONG s_llFrequency = 0;
+
+        if (s_llFrequency == 0)
+        {
+            LARGE_INTEGER liFrequency;
+
+            QueryPerformanceFrequency(&liFrequency);
+            s_llFrequency = liFrequency.QuadPart;
+        }
+        return s_llFrequency;
+    }
+
+    static
+    ULONGLONG
+    QueryPercentile(
+        const ULONGLONG *   rgcBuckets,
+        ULONGLONG           cSamples,
+        DWORD               dwPercentile
+    )
+    {
+        ULONGLONG cRank = (cSamples * dwPercentile + 99) / 100;
+        ULONGLONG cSeen = 0;
+
+        if (cRank == 0)
+        {
+            cRank = 1;
+        }
+
+        for (DWORD i = 0; i < BUCKETS; i++)
+        {
+            cSeen += rgcBuckets[i];
+            if (cSeen >= cRank)
+            {
+                return QueryBucketLimit(i);
+            }
+        }
+        return QueryBucketLimit(BUCKETS - 1);
+    }
+
+    PER_CPU<PHASE_HISTOGRAMS> *     m_pHistograms;
+};
+
+//
+// The phase times of one request, kept by its FORWARDING_HANDLER. A phase
+// is recorded when it stops, one that was never started or was cut short
+// by a failure is not. The client writes of a request are added up and
+// recorded together by Complete.
+//
+class REQUEST_PHASE_CLOCK
+{
+public:
+
+    REQUEST_PHASE_CLOCK(
+        _In_opt_ REQUEST_PHASE_LATENCY *    pLatency
+    ) : m_pLatency(pLatency),
+        m_llClientWriteStart(0),
+        m_fClientWritten(FALSE)
+    {
+        ZeroMemory(m_rgllStart, sizeof(m_rgllStart));
+        ZeroMemory(m_rgllTicks, sizeof(m_rgllTicks));
+    }
+
+    VOID
+    Start(
+        REQUEST_PHASE   phase
+    )
+    {
+        m_rgllStart[phase] = REQUEST_PHASE_LATENCY::QueryTimestamp();
+    }
+
+    VOID
+    Stop(
+        REQUEST_PHASE   phase
+    )
+    {
+        if (m_rgllStart[phase] != 0)
+        {
+            StopAt(phase, REQUEST_PHASE_LATENCY::QueryTimestamp());
+        }
+    }
+
+    //
+    // Stops one phase and starts the next with the same timestamp.
+    //
+    VOID
+    Next(
+        REQUEST_PHASE   phaseStop,
+        REQUEST_PHASE   phaseStart
+    )
+    {
+        LONGLONG llNow = REQUEST_PHASE_LATENCY::QueryTimestamp();
+
+        if (m_rgllStart[phaseStop] != 0)
+        {
+            StopAt(phaseStop, llNow);
+        }
+        m_rgllStart[phaseStart] = llNow;
+    }
+
+    VOID
+    StartClientWrite()
+    {
+        m_llClientWriteStart = REQUEST_PHASE_LATENCY::QueryTimestamp();
+    }
+
+    //
+    // Does nothing when no write is in progress, so it can be called on
+    // every completion.
+    //
+    VOID
+    StopClientWrite()
+    {
+        if (m_llClientWriteStart != 0)
+        {
+            m_rgllTicks[REQUEST_PHASE_CLIENT_WRITE] += REQUEST_PHASE_LATENCY::QueryTimestamp() - m_llClientWriteStart;
+            m_llClientWriteStart = 0;
+            m_fClientWritten = TRUE;
+        }
+    }
+
+    VOID
+    Complete()
+    {
+        if (m_fClientWritten && m_pLatency != NULL)
+        {
+            m_pLatency->Record(REQUEST_PHASE_CLIENT_WRITE, m_rgllTicks[REQUEST_PHASE_CLIENT_WRITE]);
+        }
+        m_fClientWritten = FALSE;
+    }
+
+    //
+    // The time of a stopped phase of this request, 0 for one that was not.
+    //
+    DWORD
+    QueryMicroseconds(
+        REQUEST_PHASE   phase
+    ) const
+    {
+        ULONGLONG ullUs = REQUEST_PHASE_LATENCY::TicksToMicroseconds(m_rgllTicks[phase]);
+
+        return ullUs > MAXDWORD ? MAXDWORD : static_cast<DWORD>(ullUs);
+    }
+
+private:
+
+    VOID
+    StopAt(
+        REQUEST_PHASE   phase,
+        LONGLONG        llNow
+    )
+    {
+        LONGLONG llTicks = llNow - m_rgllStart[phase];
+
+        m_rgllStart[phase] = 0;
+        m_rgllTicks[phase] = llTicks > 0 ? llTicks : 0;
+        if (m_pLatency != NULL)
+        {
+            m_pLatency->Record(phase, llTicks);
+        }
+    }
+
+    REQUEST_PHASE_LATENCY *     m_pLatency;
+    LONGLONG                    m_rgllStart[REQUEST_PHASE_COUNT];
+    LONGLONG                    m_rgllTicks[REQUEST_PHASE_COUNT];
+    LONGLONG                    m_llClientWriteStart;
+    BOOL                        m_fClientWritten;
+};
@@ -54,6 +54,17 @@ PROCESS_MANAGER::Initialize(
 
 PROCESS_MANAGER::~PROCESS_MANAGER()
 {
+    delete[] m_ppServerProcessList;
+    m_ppServerProcessList = NULL;
+
+    delete[] m_pProcessStartLocks;
+    m_pProcessStartLocks = NULL;
+
+    if (m_pStandbyWork != NULL)
+    {
+        CloseThreadpoolWork(m_pStandbyWork);
+        m_pStandbyWork = NULL;
+    }
 }
 
 HRESULT
@@ -64,7 +75,7 @@ PROCESS_MANAGER::GetProcess(
 )
 {
     DWORD            dwProcessIndex = 0;
-    std::unique_ptr<SERVER_PROCESS>  pSelectedServerProcess;
+    SERVER_PROCESS  *pServerProcess = NULL;
 
     if (InterlockedCompareExchange(&m_lStopping, 1L, 1L) == 1L)
     {
@@ -78,103 +89,376 @@ PROCESS_MANAGER::GetProcess(
         if (!m_fServerProcessListReady)
         {
             m_dwProcessesPerApplication = pConfig->QueryProcessesPerApplication();
+            m_loadBalancingPolicy = pConfig->QueryLoadBalancingPolicy();
+            m_fParallelProcessStartup = pConfig->QueryParallelProcessStartup();
+            m_fHotStandbyProcess = pConfig->QueryHotStandbyProcess();
             m_ppServerProcessList = new SERVER_PROCESS*[m_dwProcessesPerApplication];
+            m_pProcessStartLocks = new SRWLOCK[m_dwProcessesPerApplication];
 
             for (DWORD i = 0; i < m_dwProcessesPerApplication; ++i)
             {
                 m_ppServerProcessList[i] = NULL;
+                InitializeSRWLock(&m_pProcessStartLocks[i]);
+            }
+
+            if (m_fHotStandbyProcess)
+            {
+                m_pStandbyWork = CreateThreadpoolWork(StandbyProcessCallback, this, NULL);
+                if (m_pStandbyWork == NULL)
+                {
+                    // run without a standby process.
+                    LOG_LAST_ERROR();
+                    m_fHotStandbyProcess = FALSE;
+                }
             }
         }
         m_fServerProcessListReady = TRUE;
     }
 
+    //
+    // The first request brings every backend up at once instead of leaving
+    // the other slots to start one by one on the requests routed to them.
+    //
+    if (m_fParallelProcessStartup &&
+        m_dwProcessesPerApplication > 1 &&
+        InterlockedCompareExchange(&m_lParallelStartupDone, 1L, 0L) == 0L)
+    {
+        StartAllProcesses(pConfig, fWebsocketSupported);
+    }
+
     {
         auto lock = SRWSharedLock(m_srwLock);
 
         //
-        // round robin through to the next available process.
+        // pick the next process according to the balancing policy.
         //
-        dwProcessIndex = (DWORD)InterlockedIncrement64((LONGLONG*)&m_dwRouteToProcessIndex);
-        dwProcessIndex = dwProcessIndex % m_dwProcessesPerApplication;
+        dwProcessIndex = LOAD_BALANCER::SelectSlot(
+            m_loadBalancingPolicy,
+            m_dwProcessesPerApplication,
+            &m_lRouteToProcessIndex,
+            [this](DWORD dwSlot)
+            {
+                SERVER_PROCESS *pServerProcess = m_ppServerProcessList[dwSlot];
+                if (pServerProcess == NULL || !pServerProcess->IsReady())
+                {
+                    return LOAD_BALANCER::SLOT_NOT_READY;
+                }
+                return pServerProcess->QueryOutstandingRequests();
+            });
 
         if (m_ppServerProcessList[dwProcessIndex] != NULL &&
             m_ppServerProcessList[dwProcessIndex]->IsReady())
         {
-            *ppServerProcess = m_ppServerProcessList[dwProcessIndex];
-            return S_OK;
+            pServerProcess = m_ppServerProcessList[dwProcessIndex];
         }
     }
 
-    // should make the lock per process so that we can start processes simultaneously ?
-    if (m_ppServerProcessList[dwProcessIndex] == NULL ||
-        !m_ppServerProcessList[dwProcessIndex]->IsReady())
+    if (pServerProcess == NULL)
+    {
+        RETURN_IF_FAILED(StartProcessInSlot(pConfig, fWebsocketSupported, dwProcessIndex, &pServerProcess));
+    }
+
+    //
+    // Replace a standby process that was promoted (or start the first one)
+    // once this request has a backend, so it never competes with a start
+    // the request waits for.
+    //
+    if (m_fHotStandbyProcess &&
+        m_pStandbyProcess == NULL &&
+        InterlockedCompareExchange(&m_lStandbyStarting, 1L, 0L) == 0L)
+    {
+        StartStandbyProcess(pConfig, fWebsocketSupported);
+    }
+
+    *ppServerProcess = pServerProcess;
+    return S_OK;
+}
+
+HRESULT
+PROCESS_MANAGER::InitializeServerProcess(
+    _In_    REQUESTHANDLER_CONFIG      *pConfig,
+    _In_    BOOL                        fWebsocketSupported,
+    _In_    SERVER_PROCESS             *pServerProcess
+)
+{
+    return pServerProcess->Initialize(
+            this,                                   //ProcessManager
+            pConfig->QueryProcessPath(),            //
+            pConfig->QueryArguments(),              //
+            pConfig->QueryStartupTimeLimitInMS(),
+            pConfig->QueryShutdownTimeLimitInMS(),
+            pConfig->QueryWindowsAuthEnabled(),
+            pConfig->QueryBasicAuthEnabled(),
+            pConfig->QueryAnonymousAuthEnabled(),
+            pConfig->QueryEnvironmentVariables(),
+            pConfig->QueryStdoutLogEnabled(),
+            fWebsocketSupported,
+            pConfig->QueryBackendTransport(),
+            pConfig->QueryRequestTimeoutInMS(),
+            pConfig->QueryMaxBackendConnections(),
+            pConfig->QueryMinIdleBackendConnections(),
+            pConfig->QueryBackendConnectionIdleTimeoutInMS(),
+            pConfig->QueryBackendProtocol(),
+            pConfig->QueryH2cConnections(),
+            pConfig->QueryStdoutLogFile(),
+            pConfig->QueryApplicationPhysicalPath(),   // physical path
+            pConfig->QueryApplicationPath(),           // app path
+            pConfig->QueryApplicationVirtualPath()     // App relative virtual path
+    );
+}
+
+HRESULT
+PROCESS_MANAGER::StartProcessInSlot(
+    _In_    REQUESTHANDLER_CONFIG      *pConfig,
+    _In_    BOOL                        fWebsocketSupported,
+    _In_    DWORD                       dwProcessIndex,
+    _Out_   SERVER_PROCESS            **ppServerProcess
+)
+{
+    std::unique_ptr<SERVER_PROCESS>  pSelectedServerProcess;
+    SERVER_PROCESS                  *pServerProcess = NULL;
+
+    //
+    // Requests routed to a slot whose process is starting wait here, while
+    // the other slots keep serving or start their own process.
+    //
+    auto startLock = SRWExclusiveLock(m_pProcessStartLocks[dwProcessIndex]);
+
     {
         auto lock = SRWExclusiveLock(m_srwLock);
 
-        if (m_ppServerProcessList[dwProcessIndex] != NULL)
+        if (m_ppServerProcessList[dwProcessIndex] != NULL &&
+            !m_ppServerProcessList[dwProcessIndex]->IsReady())
         {
-            if (!m_ppServerProcessList[dwProcessIndex]->IsReady())
-            {
-                //
-                // terminate existing process that is not ready
-                // before creating new one.
-                //
-                ShutdownProcessNoLock( m_ppServerProcessList[dwProcessIndex] );
-            }
-            else
-            {
-                // server is already up and ready to serve requests.
-                //m_ppServerProcessList[dwProcessIndex]->ReferenceServerProcess();
-                *ppServerProcess = m_ppServerProcessList[dwProcessIndex];
-                return S_OK;
-            }
+            //
+            // terminate existing process that is not ready
+            // before creating new one.
+            //
+            ShutdownProcessNoLock( m_ppServerProcessList[dwProcessIndex] );
+        }
+
+        if (m_ppServerProcessList[dwProcessIndex] == NULL)
+        {
+            PromoteStandbyProcessNoLock(dwProcessIndex);
         }
 
-        if (RapidFailsPerMinuteExceeded(pConfig->QueryRapidFailsPerMinute()))
+        if (m_ppServerProcessList[dwProcessIndex] != NULL)
         {
             //
-            // rapid fails per minute exceeded, do not create new process.
+            // server was started while this request waited for the start
+            // lock, or the standby process took over the slot.
             //
-            EventLog::Info(
-                ASPNETCORE_EVENT_RAPID_FAIL_COUNT_EXCEEDED,
-                ASPNETCORE_EVENT_RAPID_FAIL_COUNT_EXCEEDED_MSG,
-                pConfig->QueryRapidFailsPerMinute());
-
-            RETURN_HR(HRESULT_FROM_WIN32(ERROR_SERVER_DISABLED));
+            *ppServerProcess = m_ppServerProcessList[dwProcessIndex];
+            return S_OK;
         }
+    }
 
-        if (m_ppServerProcessList[dwProcessIndex] == NULL)
+    if (RapidFailsPerMinuteExceeded(pConfig->QueryRapidFailsPerMinute()))
+    {
+        //
+        // rapid fails per minute exceeded, do not create new process.
+        //
+        EventLog::Info(
+            ASPNETCORE_EVENT_RAPID_FAIL_COUNT_EXCEEDED,
+            ASPNETCORE_EVENT_RAPID_FAIL_COUNT_EXCEEDED_MSG,
+            pConfig->QueryRapidFailsPerMinute());
+
+        RETURN_HR(HRESULT_FROM_WIN32(ERROR_SERVER_DISABLED));
+    }
+
+    pSelectedServerProcess = std::make_unique<SERVER_PROCESS>();
+    RETURN_IF_FAILED(InitializeServerProcess(pConfig, fWebsocketSupported, pSelectedServerProcess.get()));
+    RETURN_IF_FAILED(pSelectedServerProcess->StartProcess());
+
+    if (!pSelectedServerProcess->IsReady())
+    {
+        RETURN_HR(HRESULT_FROM_WIN32(ERROR_CREATE_FAILED));
+    }
+
+    {
+        auto lock = SRWExclusiveLock(m_srwLock);
+
+        pServerProcess = pSelectedServerProcess.release();
+
+        if (InterlockedCompareExchange(&m_lStopping, 1L, 1L) == 1L)
         {
+            //
+            // shutdown ran while the process was starting and could not see it.
+            //
+            pServerProcess->SendSignal();
+            pServerProcess->DereferenceServerProcess();
+            RETURN_IF_FAILED(E_APPLICATION_EXITING);
+        }
+
+        m_ppServerProcessList[dwProcessIndex] = pServerProcess;
+    }
+    *ppServerProcess = pServerProcess;
+
+    return S_OK;
+}
+
+VOID
+PROCESS_MANAGER::StartStandbyProcess(
+    _In_    REQUESTHANDLER_CONFIG      *pConfig,
+    _In_    BOOL                        fWebsocketSupported
+)
+{
+    std::unique_ptr<SERVER_PROCESS>  pStandbyProcess;
+
+    //
+    // Do not add to a rapid fail storm, the next request tries again.
+    //
+    if (RapidFailsPerMinuteExceeded(pConfig->QueryRapidFailsPerMinute()))
+    {
+        InterlockedExchange(&m_lStandbyStarting, 0L);
+        return;
+    }
+
+    //
+    // The configuration is only read here, on the request thread, the
+    // process is started on the thread pool.
+    //
+    pStandbyProcess = std::make_unique<SERVER_PROCESS>();
+    if (FAILED_LOG(InitializeServerProcess(pConfig, fWebsocketSupported, pStandbyProcess.get())))
+    {
+        InterlockedExchange(&m_lStandbyStarting, 0L);
+        return;
+    }
+
+    // released by the callback.
+    ReferenceProcessManager();
 
-            pSelectedServerProcess = std::make_unique<SERVER_PROCESS>();
-            RETURN_IF_FAILED(pSelectedServerProcess->Initialize(
-                    this,                                   //ProcessManager
-                    pConfig->QueryProcessPath(),            //
-                    pConfig->QueryArguments(),              //
-                    pConfig->QueryStartupTimeLimitInMS(),
-                    pConfig->QueryShutdownTimeLimitInMS(),
-                    pConfig->QueryWindowsAuthEnabled(),
-                    pConfig->QueryBasicAuthEnabled(),
-                    pConfig->QueryAnonymousAuthEnabled(),
-                    pConfig->QueryEnvironmentVariables(),
-                    pConfig->QueryStdoutLogEnabled(),
-                    fWebsocketSupported,
-                    pConfig->QueryStdoutLogFile(),
-                    pConfig->QueryApplicationPhysicalPath(),   // physical path
-                    pConfig->QueryApplicationPath(),           // app path
-                    pConfig->QueryApplicationVirtualPath()     // App relative virtual path
-            ));
-            RETURN_IF_FAILED(pSelectedServerProcess->StartProcess());
+    m_pPendingStandbyProcess = pStandbyProcess.release();
+    SubmitThreadpoolWork(m_pStandbyWork);
+}
+
+// static
+VOID
+CALLBACK
+PROCESS_MANAGER::StandbyProcessCallback(
+    _Inout_     PTP_CALLBACK_INSTANCE   pInstance,
+    _Inout_opt_ PVOID                   pvContext,
+    _Inout_     PTP_WORK                pWork
+)
+{
+    PROCESS_MANAGER                 *pProcessManager = static_cast<PROCESS_MANAGER*>(pvContext);
+    std::unique_ptr<SERVER_PROCESS>  pStandbyProcess;
+    SERVER_PROCESS                  *pServerProcess = NULL;
+    BOOL                             fStarting = FALSE;
+
+    UNREFERENCED_PARAMETER(pInstance);
+    UNREFERENCED_PARAMETER(pWork);
+
+    pStandbyProcess.reset(static_cast<SERVER_PROCESS*>(
+        InterlockedExchangePointer(reinterpret_cast<PVOID volatile *>(&pProcessManager->m_pPendingStandbyProcess), NULL)));
+
+    if (pStandbyProcess != NULL)
+    {
+        //
+        // Shutdown sets m_lStopping before it looks for a start to cancel.
+        //
+        auto lock = SRWExclusiveLock(pProcessManager->m_srwLock);
+
+        if (InterlockedCompareExchange(&pProcessManager->m_lStopping, 1L, 1L) != 1L)
+        {
+            pProcessManager->m_pStartingStandbyProcess = pStandbyProcess.get();
+            fStarting = TRUE;
         }
+    }
+
+    if (fStarting)
+    {
+        BOOL fStarted = SUCCEEDED_LOG(pStandbyProcess->StartProcess()) &&
+                        pStandbyProcess->IsReady();
+
+        auto lock = SRWExclusiveLock(pProcessManager->m_srwLock);
+
+        pProcessManager->m_pStartingStandbyProcess = NULL;
 
-        if (!pSelectedServerProcess->IsReady())
+        if (fStarted)
         {
-            RETURN_HR(HRESULT_FROM_WIN32(ERROR_CREATE_FAILED));
+            pServerProcess = pStandbyProcess.release();
+
+            if (InterlockedCompareExchange(&pProcessManager->m_lStopping, 1L, 1L) == 1L ||
+                pProcessManager->m_pStandbyProcess != NULL)
+            {
+                pServerProcess->SendSignal();
+                pServerProcess->DereferenceServerProcess();
+            }
+            else
+            {
+                pProcessManager->m_pStandbyProcess = pServerProcess;
+            }
         }
+    }
+
+    InterlockedExchange(&pProcessManager->m_lStandbyStarting, 0L);
+    pProcessManager->DereferenceProcessManager();
+}
+
+VOID
+PROCESS_MANAGER::StartAllProcesses(
+    _In_    REQUESTHANDLER_CONFIG      *pConfig,
+    _In_    BOOL                        fWebsocketSupported
+)
+{
+    PROCESS_STARTUP_CONTEXT  context;
+    PTP_WORK                 pWork = NULL;
+
+    context.pProcessManager = this;
+    context.pConfig = pConfig;
+    context.fWebsocketSupported = fWebsocketSupported;
+    context.lNextProcessIndex = -1;
 
-        m_ppServerProcessList[dwProcessIndex] = pSelectedServerProcess.release();
+    pWork = CreateThreadpoolWork(StartProcessCallback, &context, NULL);
+    if (pWork == NULL)
+    {
+        //
+        // slots are still started on demand.
+        //
+        LOG_LAST_ERROR();
+        return;
     }
-    *ppServerProcess = m_ppServerProcessList[dwProcessIndex];
 
-    return S_OK;
+    for (DWORD i = 1; i < m_dwProcessesPerApplication; ++i)
+    {
+        SubmitThreadpoolWork(pWork);
+    }
+
+    //
+    // The calling thread starts one slot itself and waits for the others,
+    // so that the request sees every backend ready after one startup time.
+    // The wait also keeps pConfig alive for the callbacks.
+    //
+    StartProcessCallback(NULL, &context, pWork);
+
+    WaitForThreadpoolWorkCallbacks(pWork, FALSE);
+    CloseThreadpoolWork(pWork);
+}
+
+// static
+VOID
+CALLBACK
+PROCESS_MANAGER::StartProcessCallback(
+    _Inout_     PTP_CALLBACK_INSTANCE   pInstance,
+    _Inout_opt_ PVOID                   pvContext,
+    _Inout_     PTP_WORK                pWork
+)
+{
+    PROCESS_STARTUP_CONTEXT *pContext = static_cast<PROCESS_STARTUP_CONTEXT*>(pvContext);
+    SERVER_PROCESS          *pServerProcess = NULL;
+    DWORD                    dwProcessIndex;
+
+    UNREFERENCED_PARAMETER(pInstance);
+    UNREFERENCED_PARAMETER(pWork);
+
+    dwProcessIndex = static_cast<DWORD>(InterlockedIncrement(&pContext->lNextProcessIndex));
+
+    //
+    // failures are logged, the slot is retried by the next request routed to it.
+    //
+    LOG_IF_FAILED(pContext->pProcessManager->StartProcessInSlot(pContext->pConfig,
+                                                                pContext->fWebsocketSupported,
+                                                                dwProcessIndex,
+                                                                &pServerProcess));
 }
@@ -62,6 +62,13 @@ public:
             }
         }
 
+        if( m_pStandbyProcess != NULL )
+        {
+            m_pStandbyProcess->SendSignal();
+            m_pStandbyProcess->DereferenceServerProcess();
+            m_pStandbyProcess = NULL;
+        }
+
         ReleaseSRWLockExclusive( &m_srwLock );
     }
 
@@ -96,6 +103,25 @@ public:
         {
             ShutdownAllProcesses();
         }
+
+        //
+        // a standby process still starting uses the configuration of the
+        // application. Cancel its start, which terminates the process, then
+        // wait for the callback before the application goes away.
+        //
+        AcquireSRWLockExclusive( &m_srwLock );
+
+        if( m_pStartingStandbyProcess != NULL )
+        {
+            m_pStartingStandbyProcess->CancelStart();
+        }
+
+        ReleaseSRWLockExclusive( &m_srwLock );
+
+        if (m_pStandbyWork != NULL)
+        {
+            WaitForThreadpoolWorkCallbacks(m_pStandbyWork, FALSE);
+        }
     }
 
     VOID 
@@ -111,7 +137,17 @@ public:
         m_hNULHandle( NULL ),
         m_cRapidFailCount( 0 ),
         m_dwProcessesPerApplication( 1 ),
-        m_dwRouteToProcessIndex( 0 ),
+        m_lRouteToProcessIndex( 0 ),
+        m_loadBalancingPolicy( LOAD_BALANCING_ROUND_ROBIN ),
+        m_pProcessStartLocks( NULL ),
+        m_fParallelProcessStartup( FALSE ),
+        m_lParallelStartupDone( 0 ),
+        m_fHotStandbyProcess( FALSE ),
+        m_pStandbyProcess( NULL ),
+        m_pPendingStandbyProcess( NULL ),
+        m_pStartingStandbyProcess( NULL ),
+        m_lStandbyStarting( 0 ),
+        m_pStandbyWork( NULL ),
         m_fServerProcessListReady(FALSE),
         m_lStopping(0),
         m_cRefs( 1 )
@@ -123,22 +159,103 @@ public:
 
 private:
 
+    //
+    // Shared by the thread pool callbacks that start every slot at once
+    // when parallelProcessStartup is set.
+    //
+    struct PROCESS_STARTUP_CONTEXT
+    {
+        PROCESS_MANAGER            *pProcessManager;
+        REQUESTHANDLER_CONFIG      *pConfig;
+        BOOL                        fWebsocketSupported;
+        volatile LONG               lNextProcessIndex;
+    };
+
+    HRESULT
+    InitializeServerProcess(
+        _In_    REQUESTHANDLER_CONFIG      *pConfig,
+        _In_    BOOL                        fWebsocketSupported,
+        _In_    SERVER_PROCESS             *pServerProcess
+    );
+
+    HRESULT
+    StartProcessInSlot(
+        _In_    REQUESTHANDLER_CONFIG      *pConfig,
+        _In_    BOOL                        fWebsocketSupported,
+        _In_    DWORD                       dwProcessIndex,
+        _Out_   SERVER_PROCESS            **ppServerProcess
+    );
+
+    VOID
+    StartAllProcesses(
+        _In_    REQUESTHANDLER_CONFIG      *pConfig,
+        _In_    BOOL                        fWebsocketSupported
+    );
+
+    VOID
+    StartStandbyProcess(
+        _In_    REQUESTHANDLER_CONFIG      *pConfig,
+        _In_    BOOL                        fWebsocketSupported
+    );
+
+    static
+    VOID
+    CALLBACK
+    StandbyProcessCallback(
+        _Inout_     PTP_CALLBACK_INSTANCE   pInstance,
+        _Inout_opt_ PVOID                   pvContext,
+        _Inout_     PTP_WORK                pWork
+    );
+
+    BOOL
+    PromoteStandbyProcessNoLock(
+        DWORD dwProcessIndex
+    )
+    {
+        if( m_pStandbyProcess == NULL || !m_pStandbyProcess->IsReady() )
+        {
+            return FALSE;
+        }
+
+        m_ppServerProcessList[dwProcessIndex] = m_pStandbyProcess;
+        m_pStandbyProcess = NULL;
+        return TRUE;
+    }
+
+    static
+    VOID
+    CALLBACK
+    StartProcessCallback(
+        _Inout_     PTP_CALLBACK_INSTANCE   pInstance,
+        _Inout_opt_ PVOID                   pvContext,
+        _Inout_     PTP_WORK                pWork
+    );
+
+    //
+    // Called without m_srwLock, from concurrent process starts and from
+    // the standby start.
+    //
     BOOL 
     RapidFailsPerMinuteExceeded(
         LONG dwRapidFailsPerMinute
     )
     {
         DWORD dwCurrentTickCount = GetTickCount();
-
-        if( (dwCurrentTickCount - m_dwRapidFailTickStart)
-             >= ONE_MINUTE_IN_MILLISECONDS )
+        DWORD dwRapidFailTickStart = m_dwRapidFailTickStart;
+
+        if( (dwCurrentTickCount - dwRapidFailTickStart)
+             >= ONE_MINUTE_IN_MILLISECONDS &&
+            static_cast<DWORD>(InterlockedCompareExchange(
+                reinterpret_cast<volatile LONG *>(&m_dwRapidFailTickStart),
+                static_cast<LONG>(dwCurrentTickCount),
+                static_cast<LONG>(dwRapidFailTickStart))) == dwRapidFailTickStart )
         {
             //
-            // reset counters every minute.
+            // reset counters every minute, only the caller that moved the
+            // start of the minute does.
             //
 
             InterlockedExchange(&m_cRapidFailCount, 0);
-            m_dwRapidFailTickStart = dwCurrentTickCount;
         }
 
         return m_cRapidFailCount > dwRapidFailsPerMinute;
@@ -149,18 +266,34 @@ private:
         SERVER_PROCESS* pServerProcess
     )
     {
+        //
+        // Match on the object rather than the port, processes listening on
+        // a Unix domain socket all have port 0. The caller holds a
+        // reference, so pServerProcess stays valid below.
+        //
         for(DWORD i = 0; i < m_dwProcessesPerApplication; ++i )
         {
             if( m_ppServerProcessList != NULL && 
                 m_ppServerProcessList[i] != NULL && 
-                m_ppServerProcessList[i]->GetPort() == pServerProcess->GetPort() )
+                m_ppServerProcessList[i] == pServerProcess )
             {
                 // shutdown pServerProcess if not already shutdown.
                 m_ppServerProcessList[i]->StopProcess();
                 m_ppServerProcessList[i]->DereferenceServerProcess();
                 m_ppServerProcessList[i] = NULL;
+
+                // the standby process takes over the slot right away.
+                PromoteStandbyProcessNoLock(i);
             }
         }
+
+        if( m_pStandbyProcess != NULL &&
+            m_pStandbyProcess == pServerProcess )
+        {
+            m_pStandbyProcess->StopProcess();
+            m_pStandbyProcess->DereferenceServerProcess();
+            m_pStandbyProcess = NULL;
+        }
     }
 
     VOID 
@@ -179,16 +312,48 @@ private:
                 m_ppServerProcessList[i] = NULL;
             }
         }
+
+        if( m_pStandbyProcess != NULL )
+        {
+            m_pStandbyProcess->SendSignal();
+            m_pStandbyProcess->DereferenceServerProcess();
+            m_pStandbyProcess = NULL;
+        }
     }
 
     volatile LONG                     m_cRapidFailCount;
-    DWORD                             m_dwRapidFailTickStart;
+    volatile DWORD                    m_dwRapidFailTickStart;
     DWORD                             m_dwProcessesPerApplication;
-    volatile DWORD                    m_dwRouteToProcessIndex;
+    volatile LONG                     m_lRouteToProcessIndex;
+    LOAD_BALANCING_POLICY             m_loadBalancingPolicy;
 
     SRWLOCK                           m_srwLock;
     SERVER_PROCESS                  **m_ppServerProcessList;
 
+    //
+    // One lock per slot serializes the startup of the process of that slot
+    // only; m_srwLock is held just long enough to read or publish a slot.
+    //
+    SRWLOCK                          *m_pProcessStartLocks;
+    BOOL                              m_fParallelProcessStartup;
+    volatile LONG                     m_lParallelStartupDone;
+
+    //
+    // With hotStandbyProcess one extra process is kept started and health
+    // checked. It replaces a slot whose process died and a new standby is
+    // started in the background on the next request.
+    //
+    BOOL                              m_fHotStandbyProcess;
+    SERVER_PROCESS                   *m_pStandbyProcess;
+    SERVER_PROCESS * volatile         m_pPendingStandbyProcess;
+    //
+    // the standby process while StandbyProcessCallback starts it, under
+    // m_srwLock, for Shutdown to cancel.
+    //
+    SERVER_PROCESS                   *m_pStartingStandbyProcess;
+    volatile LONG                     m_lStandbyStarting;
+    PTP_WORK                          m_pStandbyWork;
+
     //
     // m_hNULHandle is used to redirect stdout/stderr to NUL.
     // If Createprocess is called to launch a batch file for example,
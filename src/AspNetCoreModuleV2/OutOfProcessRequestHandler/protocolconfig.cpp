@@ -19,7 +19,7 @@ PROTOCOL_CONFIG::Initialize()
     m_fIncludePortInXForwardedFor = TRUE;
     m_dwMinResponseBuffer = 0; // no response buffering
     m_dwResponseBufferLimit = 4096*1024;
-    m_dwMaxResponseHeaderSize = 65536;
+    m_dwMaxResponseHeaderSize = DEFAULT_MAX_RESPONSE_HEADER_SIZE;
     return S_OK;
 }
 
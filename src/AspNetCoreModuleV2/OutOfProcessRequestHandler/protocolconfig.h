@@ -7,6 +7,12 @@ class PROTOCOL_CONFIG
 {
  public:
 
+    //
+    // Also sizes the head buffers of pooled backend connections, which are
+    // opened before any request.
+    //
+    static const DWORD DEFAULT_MAX_RESPONSE_HEADER_SIZE = 65536;
+
     PROTOCOL_CONFIG()
     {
     }
@@ -0,0 +1,163 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#pragma once
+
+#include "exceptions.h"
+
+#define ASPNETCORE_READY_EVENT_ENV_STR              L"ASPNETCORE_READY_EVENT="
+
+//
+// READINESS_EVENT lets a backend process tell ANCM that it is listening
+// instead of ANCM polling the TCP table for its port.
+//
+// ANCM creates a named auto reset event per process start and passes its
+// name in ASPNETCORE_READY_EVENT. A backend that knows about it opens the
+// event and sets it once it listens on ASPNETCORE_PORT. ANCM waits on the
+// event and the process handle between its readiness checks, so a backend
+// that never signals is detected by polling exactly as before.
+//
+// The event is only a hint: ANCM still verifies the listening port once
+// the event is set, so a spurious signal costs one extra check.
+//
+
+class READINESS_EVENT
+{
+public:
+
+    READINESS_EVENT() :
+        m_hEvent(NULL)
+    {
+    }
+
+    ~READINESS_EVENT()
+    {
+        Close();
+    }
+
+    HRESULT
+    Create(
+        DWORD       dwPort
+    )
+    {
+        static volatile LONG s_lSequence = 0;
+
+        Close();
+
+        RETURN_IF_FAILED(m_struName.SafeSnwprintf(L"Local\\ASPNETCORE_READY_%u_%u_%u",
+                                                  GetCurrentProcessId(),
+                                                  dwPort,
+                                                  static_cast<DWORD>(InterlockedIncrement(&s_lSequence))));
+
+        m_hEvent = CreateEventW(NULL, FALSE, FALSE, m_struName.QueryStr());
+        if (m_hEvent == NULL)
+        {
+            RETURN_LAST_ERROR();
+        }
+
+        if (GetLastError() == ERROR_ALREADY_EXISTS)
+        {
+            //
+            // somebody else owns that name, do not trust it.
+            //
+            Close();
+            RETURN_HR(HRESULT_FROM_WIN32(ERROR_ALREADY_EXISTS));
+        }
+
+        return S_OK;
+    }
+
+    VOID
+    Close()
+    {
+        if (m_hEvent != NULL)
+        {
+            CloseHandle(m_hEvent);
+            m_hEvent = NULL;
+        }
+        m_struName.Reset();
+    }
+
+    PCWSTR
+    QueryName() const
+    {
+        return m_struName.QueryStr();
+    }
+
+    BOOL
+    IsCreated() const
+    {
+        return m_hEvent != NULL;
+    }
+
+    //
+    // Waits up to dwMilliseconds for the backend to signal or for
+    // hProcess to exit. Returns WAIT_OBJECT_0 when signalled,
+    // WAIT_OBJECT_0 + 1 when the process exited and WAIT_TIMEOUT
+    // otherwise. Without an event it just sleeps, which is the polling
+    // fallback. Setting hCancel ends the wait early as well, the caller
+    // checks it itself.
+    //
+    DWORD
+    Wait(
+        HANDLE      hProcess,
+        DWORD       dwMilliseconds,
+        HANDLE      hCancel = NULL
+    ) const
+    {
+        HANDLE rgHandles[3];
+        DWORD  cHandles = 0;
+
+        if (m_hEvent == NULL)
+        {
+            if (hCancel == NULL)
+            {
+                Sleep(dwMilliseconds);
+            }
+            else
+            {
+                WaitForSingleObject(hCancel, dwMilliseconds);
+            }
+            return WAIT_TIMEOUT;
+        }
+
+        rgHandles[cHandles++] = m_hEvent;
+        if (hProcess != NULL && hProcess != INVALID_HANDLE_VALUE)
+        {
+            rgHandles[cHandles++] = hProcess;
+        }
+        if (hCancel != NULL)
+        {
+            rgHandles[cHandles++] = hCancel;
+        }
+
+        return WaitForMultipleObjects(cHandles, rgHandles, FALSE, dwMilliseconds);
+    }
+
+    //
+    // What a backend does once it listens, pszName is the value of
+    // ASPNETCORE_READY_EVENT.
+    //
+    static
+    HRESULT
+    Signal(
+        PCWSTR      pszName
+    )
+    {
+        HANDLE hEvent = OpenEventW(EVENT_MODIFY_STATE, FALSE, pszName);
+        if (hEvent == NULL)
+        {
+            RETURN_LAST_ERROR();
+        }
+
+        HRESULT hr = SetEvent(hEvent) ? S_OK : HRESULT_FROM_WIN32(GetLastError());
+        CloseHandle(hEvent);
+
+        RETURN_HR(hr);
+    }
+
+private:
+
+    HANDLE      m_hEvent;
+    STRU        m_struName;
+};
@@ -0,0 +1,161 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#pragma once
+
+//
+// REQUEST_BODY_BATCH is the buffer FORWARDING_HANDLER reads the request
+// body into from http.sys and sends to the backend from with a single
+// WinHttpWriteData. A batch is as large as what http.sys has ready, up to
+// DATA_SIZE, so a fast upload takes one write and one WinHTTP completion
+// per 64KB instead of per 8KB, while a slow one is never held back waiting
+// for more.
+//
+// The buffer has room before the data for the largest chunk size line and
+// after it for the chunk CRLF and the last-chunk, so a chunked body is
+// re-framed in place: the batch becomes one chunk of any size and the
+// terminating "0\r\n\r\n" rides along with the last batch.
+//
+//   [ prefix | data ............ | suffix ]
+//        ^ "<hex>\r\n"            ^ "\r\n" [ "0\r\n\r\n" ]
+//
+class REQUEST_BODY_BATCH
+{
+public:
+
+    // up to 8 hex digits and CRLF
+    static const DWORD      PREFIX_SIZE = 10;
+    // CRLF and "0\r\n\r\n"
+    static const DWORD      SUFFIX_SIZE = 7;
+
+    static const DWORD      DATA_SIZE = 65536;
+    static const DWORD      BUFFER_SIZE = PREFIX_SIZE + DATA_SIZE + SUFFIX_SIZE;
+
+    REQUEST_BODY_BATCH() :
+        m_pBuffer(NULL),
+        m_cbCapacity(0),
+        m_cbData(0),
+        m_fChunked(FALSE)
+    {
+    }
+
+    //
+    // pBuffer holds PREFIX_SIZE + cbCapacity + SUFFIX_SIZE bytes.
+    //
+    VOID
+    Initialize(
+        BYTE *      pBuffer,
+        DWORD       cbCapacity,
+        BOOL        fChunked
+    )
+    {
+        m_pBuffer = pBuffer;
+        m_cbCapacity = cbCapacity;
+        m_cbData = 0;
+        m_fChunked = fChunked;
+    }
+
+    BYTE *
+    QueryBuffer() const
+    {
+        return m_pBuffer;
+    }
+
+    BOOL
+    IsEmpty() const
+    {
+        return m_cbData == 0;
+    }
+
+    //
+    // Where the next read goes and how much of cbRemaining (INFINITE for a
+    // chunked body) it asks for.
+    //
+    VOID
+    BeginRead(
+        DWORD       cbRemaining,
+        BYTE **     ppbRead,
+        DWORD *     pcbRead
+    )
+    {
+        *ppbRead = m_pBuffer + PREFIX_SIZE + m_cbData;
+        *pcbRead = min(m_cbCapacity - m_cbData, cbRemaining);
+    }
+
+    VOID
+    OnRead(
+        DWORD       cbRead
+    )
+    {
+        DBG_ASSERT(cbRead <= m_cbCapacity - m_cbData);
+
+        m_cbData += cbRead;
+    }
+
+    //
+    // Frames the batch for one write and resets it. fLast appends the
+    // last-chunk of a chunked body, which may then be the whole write.
+    //
+    VOID
+    Frame(
+        BOOL        fLast,
+        BYTE **     ppbWrite,
+        DWORD *     pcbWrite
+    )
+    {
+        BYTE *pbData = m_pBuffer + PREFIX_SIZE;
+        BYTE *pbStart = pbData;
+        BYTE *pbEnd = pbData + m_cbData;
+
+        if (m_fChunked)
+        {
+            if (m_cbData != 0)
+            {
+                pbStart = WriteChunkSize(pbData, m_cbData);
+                *pbEnd++ = '\r';
+                *pbEnd++ = '\n';
+            }
+
+            if (fLast)
+            {
+                memcpy(pbEnd, "0\r\n\r\n", 5);
+                pbEnd += 5;
+            }
+        }
+
+        *ppbWrite = pbStart;
+        *pcbWrite = static_cast<DWORD>(pbEnd - pbStart);
+        m_cbData = 0;
+    }
+
+    //
+    // Writes "<hex>\r\n" so that it ends at pbData and returns its start.
+    //
+    static
+    BYTE *
+    WriteChunkSize(
+        BYTE *      pbData,
+        DWORD       cbChunk
+    )
+    {
+        static const CHAR s_rgHexDigits[] = "0123456789abcdef";
+        BYTE *pb = pbData;
+
+        *--pb = '\n';
+        *--pb = '\r';
+        do
+        {
+            *--pb = s_rgHexDigits[cbChunk & 0xf];
+            cbChunk >>= 4;
+        } while (cbChunk != 0);
+
+        return pb;
+    }
+
+private:
+
+    BYTE *      m_pBuffer;
+    DWORD       m_cbCapacity;
+    DWORD       m_cbData;
+    BOOL        m_fChunked;
+};
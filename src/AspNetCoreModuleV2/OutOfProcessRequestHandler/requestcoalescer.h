@@ -0,0 +1,421 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#pragma once
+
+#include <new>
+#include "hashfn.h"
+#include "timerwheel.h"
+
+//
+// REQUEST_COALESCER lets identical concurrent GETs share one trip to the
+// backend (single flight). The first request for a key leads a flight and
+// is forwarded, the ones that arrive while it is in the air park on it as
+// waiters. When the leader has its whole response it completes the flight
+// with a RESPONSE_CACHE_ENTRY of it, and every waiter is called back with
+// a reference to that entry. A flight completed without an entry (the
+// response may not be shared, or the leader failed) and a flight that has
+// been in the air longer than the timeout release their waiters with no
+// entry, and those are forwarded on their own.
+//
+// The table is striped over a fixed number of locks and holds at most
+// cMaxFlights flights, requests beyond that are not coalesced. Each flight
+// times out on its own entry of a TIMER_WHEEL.
+//
+
+class REQUEST_FLIGHT;
+class REQUEST_COALESCER;
+
+typedef
+VOID
+(*PFN_FLIGHT_COMPLETION)(
+    PVOID       pvContext
+);
+
+//
+// Kept by a parked request. pEntry is set, referenced, before
+// pfnCompletion is called if the leader's response may be used.
+//
+struct FLIGHT_WAITER
+{
+    LIST_ENTRY              listEntry;
+    PFN_FLIGHT_COMPLETION   pfnCompletion;
+    PVOID                   pvContext;
+    RESPONSE_CACHE_ENTRY *  pEntry;
+};
+
+enum FLIGHT_ROLE
+{
+    FLIGHT_LEAD,
+    FLIGHT_WAIT,
+    FLIGHT_BYPASS
+};
+
+struct REQUEST_COALESCER_COUNTERS
+{
+    //
+    // Flights started, requests parked on one, parked requests released
+    // without a response because it timed out or could not be shared, and
+    // requests forwarded on their own because the table was full.
+    //
+    ULONGLONG   cFlights;
+    ULONGLONG   cCoalesced;
+    ULONGLONG   cReleased;
+    ULONGLONG   cBypassed;
+
+    DWORD       cActiveFlights;
+};
+
+class REQUEST_FLIGHT
+{
+    friend class REQUEST_COALESCER;
+
+private:
+
+    REQUEST_FLIGHT(
+        REQUEST_COALESCER * pCoalescer
+    ) :
+        m_pNextInBucket(NULL),
+        m_pCoalescer(pCoalescer),
+        m_fExpired(FALSE)
+    {
+        InitializeListHead(&m_waiters);
+    }
+
+    ~REQUEST_FLIGHT()
+    {
+        DBG_ASSERT(IsListEmpty(&m_waiters));
+    }
+
+    REQUEST_FLIGHT *        m_pNextInBucket;
+    REQUEST_COALESCER *     m_pCoalescer;
+    DWORD                   m_dwHash;
+    TIMER_WHEEL_ENTRY       m_timeoutEntry;
+    //
+    // Set once the waiters have been released for the timeout, or the
+    // flight has completed, later arrivals do not park on the flight any
+    // more.
+    //
+    BOOL                    m_fExpired;
+    LIST_ENTRY              m_waiters;
+    DWORD                   m_cchKey;
+    CHAR                    m_rgchKey[1];
+};
+
+class REQUEST_COALESCER
+{
+public:
+
+    static const DWORD      LOCK_STRIPES = 64;
+    static const DWORD      BUCKETS_PER_STRIPE = 16;
+    static const DWORD      DEFAULT_MAX_FLIGHTS = 4096;
+
+    REQUEST_COALESCER() :
+        m_dwTimeoutMs(0),
+        m_pTimerWheel(NULL),
+        m_cMaxFlights(0),
+        m_cActiveFlights(0),
+        m_cFlights(0),
+        m_cCoalesced(0),
+        m_cReleased(0),
+        m_cBypassed(0)
+    {
+        for (DWORD i = 0; i < LOCK_STRIPES; i++)
+        {
+            InitializeSRWLock(&m_rgStripes[i].srwLock);
+            ZeroMemory(m_rgStripes[i].rgpBuckets, sizeof(m_rgStripes[i].rgpBuckets));
+        }
+    }
+
+    ~REQUEST_COALESCER()
+    {
+        DBG_ASSERT(m_cActiveFlights == 0);
+    }
+
+    //
+    // pTimerWheel times the flights, without one waiters stay parked until
+    // the leader completes.
+    //
+    HRESULT
+    Initialize(
+        DWORD       dwTimeoutMs,
+        DWORD       cMaxFlights,
+        _In_opt_ TIMER_WHEEL * pTimerWheel
+    )
+    {
+        m_dwTimeoutMs = dwTimeoutMs;
+        m_cMaxFlights = cMaxFlights;
+        m_pTimerWheel = pTimerWheel;
+        return S_OK;
+    }
+
+    //
+    // Leads a new flight for the key and returns it in ppFlight, or parks
+    // pWaiter on the flight already in the air. FLIGHT_BYPASS means the
+    // request is forwarded on its own.
+    //
+    FLIGHT_ROLE
+    Join(
+        PCSTR               pszKey,
+        DWORD               cchKey,
+        FLIGHT_WAITER *     pWaiter,
+        ULONGLONG           ullNow,
+        REQUEST_FLIGHT **   ppFlight
+    )
+    {
+        DWORD               dwHash = HashScramble(HashBlob(pszKey, cchKey));
+        STRIPE *            pStripe = &m_rgStripes[dwHash % LOCK_STRIPES];
+        REQUEST_FLIGHT **   ppBucket = &pStripe->rgpBuckets[(dwHash / LOCK_STRIPES) % BUCKETS_PER_STRIPE];
+        REQUEST_FLIGHT *    pFlight;
+        FLIGHT_ROLE         role = FLIGHT_BYPASS;
+
+        *ppFlight = NULL;
+
+        AcquireSRWLockExclusive(&pStripe->srwLock);
+
+        for (pFlight = *ppBucket; pFlight != NULL; pFlight = pFlight->m_pNextInBucket)
+        {
+            if (pFlight->m_dwHash == dwHash &&
+                pFlight->m_cchKey == cchKey &&
+                memcmp(pFlight->m_rgchKey, pszKey, cchKey) == 0)
+            {
+                break;
+            }
+        }
+
+        if (pFlight != NULL)
+        {
+            if (!pFlight->m_fExpired)
+            {
+                pWaiter->pEntry = NULL;
+                InsertTailList(&pFlight->m_waiters, &pWaiter->listEntry);
+                InterlockedIncrement64(reinterpret_cast<LONGLONG *>(&m_cCoalesced));
+                role = FLIGHT_WAIT;
+            }
+        }
+        else if (static_cast<DWORD>(InterlockedIncrement(&m_cActiveFlights)) > m_cMaxFlights)
+        {
+            InterlockedDecrement(&m_cActiveFlights);
+        }
+        else
+        {
+            pFlight = new (::operator new(sizeof(REQUEST_FLIGHT) + cchKey, std::nothrow)) REQUEST_FLIGHT(this);
+            if (pFlight == NULL)
+            {
+                InterlockedDecrement(&m_cActiveFlights);
+            }
+            else
+            {
+                pFlight->m_dwHash = dwHash;
+                pFlight->m_cchKey = cchKey;
+                memcpy(pFlight->m_rgchKey, pszKey, cchKey);
+                pFlight->m_pNextInBucket = *ppBucket;
+                *ppBucket = pFlight;
+
+                TIMER_WHEEL::InitializeEntry(&pFlight->m_timeoutEntry, FlightTimeoutCallback, pFlight);
+                if (m_pTimerWheel != NULL && m_dwTimeoutMs != 0)
+                {
+                    m_pTimerWheel->Arm(&pFlight->m_timeoutEntry, m_dwTimeoutMs, ullNow);
+                }
+
+                InterlockedIncrement64(reinterpret_cast<LONGLONG *>(&m_cFlights));
+                *ppFlight = pFlight;
+                role = FLIGHT_LEAD;
+            }
+        }
+
+        ReleaseSRWLockExclusive(&pStripe->srwLock);
+
+        if (role == FLIGHT_BYPASS)
+        {
+            InterlockedIncrement64(reinterpret_cast<LONGLONG *>(&m_cBypassed));
+        }
+
+        return role;
+    }
+
+    //
+    // Called once by the leader. The flight is gone afterwards and every
+    // waiter gets its own reference to pEntry, which may be NULL.
+    //
+    VOID
+    Complete(
+        REQUEST_FLIGHT *        pFlight,
+        RESPONSE_CACHE_ENTRY *  pEntry
+    )
+    {
+        STRIPE *            pStripe = &m_rgStripes[pFlight->m_dwHash % LOCK_STRIPES];
+        REQUEST_FLIGHT **   ppLink = &pStripe->rgpBuckets[(pFlight->m_dwHash / LOCK_STRIPES) % BUCKETS_PER_STRIPE];
+        LIST_ENTRY          waiters;
+
+        AcquireSRWLockExclusive(&pStripe->srwLock);
+
+        while (*ppLink != pFlight)
+        {
+            ppLink = &(*ppLink)->m_pNextInBucket;
+        }
+        *ppLink = pFlight->m_pNextInBucket;
+
+        pFlight->m_fExpired = TRUE;
+        TakeWaiters(pFlight, &waiters);
+
+        ReleaseSRWLockExclusive(&pStripe->srwLock);
+
+        //
+        // A timeout that is firing already finds the flight expired. The
+        // leader may complete from another callback of the wheel when its
+        // last reference goes with a request timeout, callbacks run one at a
+        // time so that never waits on itself.
+        //
+        if (m_pTimerWheel != NULL)
+        {
+            m_pTimerWheel->CancelAndWait(&pFlight->m_timeoutEntry);
+        }
+
+        InterlockedDecrement(&m_cActiveFlights);
+        pFlight->~REQUEST_FLIGHT();
+        ::operator delete(pFlight);
+
+        ReleaseWaiters(&waiters, pEntry);
+    }
+
+    VOID
+    QueryCounters(
+        _Out_ REQUEST_COALESCER_COUNTERS *  pCounters
+    ) const
+    {
+        pCounters->cFlights = m_cFlights;
+        pCounters->cCoalesced = m_cCoalesced;
+        pCounters->cReleased = m_cReleased;
+        pCounters->cBypassed = m_cBypassed;
+        pCounters->cActiveFlights = m_cActiveFlights;
+    }
+
+    //
+    // Writes the counters to the debug log.
+    //
+    VOID
+    Dump() const
+    {
+        REQUEST_COALESCER_COUNTERS counters;
+
+        QueryCounters(&counters);
+
+        DebugPrintf(ASPNETCORE_DEBUG_FLAG_INFO,
+            "REQUEST_COALESCER: %I64u flights, %I64u coalesced, %I64u released, %I64u bypassed, %u active flights",
+            counters.cFlights,
+            counters.cCoalesced,
+            counters.cReleased,
+            counters.cBypassed,
+            counters.cActiveFlights);
+    }
+
+private:
+
+    struct STRIPE
+    {
+        SRWLOCK             srwLock;
+        REQUEST_FLIGHT *    rgpBuckets[BUCKETS_PER_STRIPE];
+    };
+
+    static
+    VOID
+    TakeWaiters(
+        REQUEST_FLIGHT *    pFlight,
+        LIST_ENTRY *        pWaiters
+    )
+    {
+        InitializeListHead(pWaiters);
+        AppendList(pWaiters, &pFlight->m_waiters);
+    }
+
+    //
+    // Moves all of pSource to the end of pTarget.
+    //
+    static
+    VOID
+    AppendList(
+        LIST_ENTRY *    pTarget,
+        LIST_ENTRY *    pSource
+    )
+    {
+        if (IsListEmpty(pSource))
+        {
+            return;
+        }
+
+        pSource->Flink->Blink = pTarget->Blink;
+        pSource->Blink->Flink = pTarget;
+        pTarget->Blink->Flink = pSource->Flink;
+        pTarget->Blink = pSource->Blink;
+        InitializeListHead(pSource);
+    }
+
+    VOID
+    ReleaseWaiters(
+        LIST_ENTRY *            pWaiters,
+        RESPONSE_CACHE_ENTRY *  pEntry
+    )
+    {
+        while (!IsListEmpty(pWaiters))
+        {
+            FLIGHT_WAITER *pWaiter = CONTAINING_RECORD(RemoveHeadList(pWaiters), FLIGHT_WAITER, listEntry);
+
+            if (pEntry != NULL)
+            {
+                pEntry->ReferenceCacheEntry();
+                pWaiter->pEntry = pEntry;
+            }
+            else
+            {
+                InterlockedIncrement64(reinterpret_cast<LONGLONG *>(&m_cReleased));
+            }
+
+            //
+            // The waiter may be gone once it has been called.
+            //
+            pWaiter->pfnCompletion(pWaiter->pvContext);
+        }
+    }
+
+    //
+    // Releases, without a response, the waiters of a flight that has been
+    // in the air for the timeout.
+    //
+    static
+    VOID
+    FlightTimeoutCallback(
+        PVOID       pvContext
+    )
+    {
+        REQUEST_FLIGHT *    pFlight = static_cast<REQUEST_FLIGHT *>(pvContext);
+        REQUEST_COALESCER * pCoalescer = pFlight->m_pCoalescer;
+        STRIPE *            pStripe = &pCoalescer->m_rgStripes[pFlight->m_dwHash % LOCK_STRIPES];
+        LIST_ENTRY          waiters;
+
+        InitializeListHead(&waiters);
+
+        AcquireSRWLockExclusive(&pStripe->srwLock);
+
+        if (!pFlight->m_fExpired)
+        {
+            pFlight->m_fExpired = TRUE;
+            TakeWaiters(pFlight, &waiters);
+        }
+
+        ReleaseSRWLockExclusive(&pStripe->srwLock);
+
+        pCoalescer->ReleaseWaiters(&waiters, NULL);
+    }
+
+    DWORD                   m_dwTimeoutMs;
+    TIMER_WHEEL *           m_pTimerWheel;
+    DWORD                   m_cMaxFlights;
+    volatile LONG           m_cActiveFlights;
+    STRIPE                  m_rgStripes[LOCK_STRIPES];
+
+    ULONGLONG               m_cFlights;
+    ULONGLONG               m_cCoalesced;
+    ULONGLONG               m_cReleased;
+    ULONGLONG               m_cBypassed;
+};
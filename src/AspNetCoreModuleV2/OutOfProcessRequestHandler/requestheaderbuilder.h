@@ -0,0 +1,492 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#pragma once
+
+#include "buffer.h"
+#include "base64.h"
+
+//
+// Characters the forwarded headers of a typical browser request take.
+// FORWARDING_HANDLER keeps less than this inline and spills the rest.
+//
+#define FORWARDED_HEADERS_BUFFER_CCH                2048
+
+#define ASPNETCORE_HEADER_PREFIX                    "MS-ASPNETCORE"
+#define ASPNETCORE_TOKEN_HEADER                     "MS-ASPNETCORE-TOKEN"
+#define ASPNETCORE_WINAUTHTOKEN_HEADER              "MS-ASPNETCORE-WINAUTHTOKEN"
+
+//
+// What FORWARDING_HANDLER changes in the request headers it forwards.
+// Strings point into the request, the handler or the configuration and are
+// only read while the headers are built.
+//
+struct FORWARDED_HEADER_VALUES
+{
+    // replaces the Host header, NULL keeps it
+    PCWSTR          pszHost;
+    DWORD           cchHost;
+
+    // MS-ASPNETCORE-TOKEN and MS-ASPNETCORE-WINAUTHTOKEN, NULL if not sent
+    PCSTR           pszToken;
+    PCSTR           pszWinAuthToken;
+
+    // X-Forwarded-For, NULL or empty name if not sent
+    PCSTR           pszXForwardedForName;
+    PCSTR           pszRemoteAddress;
+    DWORD           cchRemoteAddress;
+    BOOL            fRemoteAddressIPv6;
+    PCSTR           pszRemotePort;          // NULL leaves the port out
+    DWORD           cchRemotePort;
+
+    // X-Forwarded-Proto, NULL or empty name if not sent
+    PCSTR           pszSslHeaderName;
+    PCSTR           pszScheme;
+
+    // MS-ASPNETCORE-CLIENTCERT, removed from the request if there is no
+    // certificate
+    PCSTR           pszClientCertName;
+    const BYTE *    pbClientCert;
+    DWORD           cbClientCert;
+
+    BOOL            fRemoveConnection;
+};
+
+//
+// REQUEST_HEADER_BUILDER writes the header block WinHttpSendRequest gets
+// for a forwarded request in a single pass over HTTP_REQUEST_HEADERS.
+//
+// The result is what ALL_RAW returned after FORWARDING_HANDLER edited the
+// request with SetHeader and DeleteHeader, without editing the request:
+// MS-ASPNETCORE* headers coming from the client are dropped, Host is
+// replaced, the forwarded headers are appended to the first value the
+// client sent, and Connection is dropped unless websockets are enabled.
+//
+// Everything is written into the caller's buffer, which only goes to the
+// heap when the headers do not fit inline. Header bytes are widened one to
+// one, WinHTTP narrows them back the same way.
+//
+class REQUEST_HEADER_BUILDER
+{
+public:
+
+    template<DWORD LENGTH>
+    static
+    HRESULT
+    Build(
+        _In_    const HTTP_REQUEST_HEADERS *    pHeaders,
+        _In_    const FORWARDED_HEADER_VALUES & values,
+        _Inout_ BUFFER_T<WCHAR, LENGTH> *       pBuffer,
+        _Out_   DWORD *                         pcchHeaders
+    )
+    {
+        HRESULT         hr = S_OK;
+        WRITER<LENGTH>  writer(pBuffer);
+        PCSTR           pszXForwardedFor = NULL;
+        USHORT          cchXForwardedFor = 0;
+        PCSTR           pszSslHeader = NULL;
+        USHORT          cchSslHeader = 0;
+        BOOL            fHostWritten = FALSE;
+        BOOL            fXForwardedFor = values.pszXForwardedForName != NULL && values.pszXForwardedForName[0] != '\0';
+        BOOL            fSslHeader = values.pszSslHeaderName != NULL && values.pszSslHeaderName[0] != '\0';
+        BOOL            fClientCert = values.pszClientCertName != NULL && values.pszClientCertName[0] != '\0';
+
+        *pcchHeaders = 0;
+
+        for (DWORD i = 0; i < HttpHeaderRequestMaximum; i++)
+        {
+            const HTTP_KNOWN_HEADER & header = pHeaders->KnownHeaders[i];
+            PCSTR pszName = QueryKnownHeaderName(i);
+            DWORD cchName = static_cast<DWORD>(strlen(pszName));
+
+            if (header.pRawValue == NULL)
+            {
+                continue;
+            }
+
+            if (i == HttpHeaderHost && values.pszHost != NULL)
+            {
+                if (FAILED(hr = writer.AppendHeader(pszName, cchName, values.pszHost, values.cchHost)))
+                {
+                    return hr;
+                }
+                fHostWritten = TRUE;
+                continue;
+            }
+
+            if (i == HttpHeaderConnection && values.fRemoveConnection)
+            {
+                continue;
+            }
+
+            if (FAILED(hr = WriteHeader(&writer, values, pszName, cchName, header.pRawValue, header.RawValueLength,
+                                        &pszXForwardedFor, &cchXForwardedFor, &pszSslHeader, &cchSslHeader)))
+            {
+                return hr;
+            }
+        }
+
+        for (DWORD i = 0; i < pHeaders->UnknownHeaderCount; i++)
+        {
+            const HTTP_UNKNOWN_HEADER & header = pHeaders->pUnknownHeaders[i];
+
+            //
+            // MS-ASPNETCORE* headers are ours, never trust the client's.
+            //
+            if (header.NameLength >= sizeof(ASPNETCORE_HEADER_PREFIX) - 1 &&
+                _strnicmp(header.pName, ASPNETCORE_HEADER_PREFIX, sizeof(ASPNETCORE_HEADER_PREFIX) - 1) == 0)
+            {
+                continue;
+            }
+
+            if (FAILED(hr = WriteHeader(&writer, values, header.pName, header.NameLength, header.pRawValue, header.RawValueLength,
+                                        &pszXForwardedFor, &cchXForwardedFor, &pszSslHeader, &cchSslHeader)))
+            {
+                return hr;
+            }
+        }
+
+        if (values.pszHost != NULL && !fHostWritten)
+        {
+            if (FAILED(hr = writer.AppendHeader("Host", 4, values.pszHost, values.cchHost)))
+            {
+                return hr;
+            }
+        }
+
+        if (values.pszToken != NULL)
+        {
+            if (FAILED(hr = writer.AppendHeader(ASPNETCORE_TOKEN_HEADER, sizeof(ASPNETCORE_TOKEN_HEADER) - 1,
+                                                values.pszToken, static_cast<DWORD>(strlen(values.pszToken)))))
+            {
+                return hr;
+            }
+        }
+
+        if (values.pszWinAuthToken != NULL)
+        {
+            if (FAILED(hr = writer.AppendHeader(ASPNETCORE_WINAUTHTOKEN_HEADER, sizeof(ASPNETCORE_WINAUTHTOKEN_HEADER) - 1,
+                                                values.pszWinAuthToken, static_cast<DWORD>(strlen(values.pszWinAuthToken)))))
+            {
+                return hr;
+            }
+        }
+
+        if (fXForwardedFor)
+        {
+            if (FAILED(hr = writer.AppendName(values.pszXForwardedForName, static_cast<DWORD>(strlen(values.pszXForwardedForName)))) ||
+                (pszXForwardedFor != NULL &&
+                 (FAILED(hr = writer.Append(pszXForwardedFor, cchXForwardedFor)) ||
+                  FAILED(hr = writer.Append(", ", 2)))) ||
+                (values.fRemoteAddressIPv6 && FAILED(hr = writer.Append("[", 1))) ||
+                FAILED(hr = writer.Append(values.pszRemoteAddress, values.cchRemoteAddress)) ||
+                (values.fRemoteAddressIPv6 && FAILED(hr = writer.Append("]", 1))) ||
+                (values.pszRemotePort != NULL &&
+                 (FAILED(hr = writer.Append(":", 1)) ||
+                  FAILED(hr = writer.Append(values.pszRemotePort, values.cchRemotePort)))) ||
+                FAILED(hr = writer.Append("\r\n", 2)))
+            {
+                return hr;
+            }
+        }
+
+        if (fSslHeader)
+        {
+            if (FAILED(hr = writer.AppendName(values.pszSslHeaderName, static_cast<DWORD>(strlen(values.pszSslHeaderName)))) ||
+                (pszSslHeader != NULL &&
+                 (FAILED(hr = writer.Append(pszSslHeader, cchSslHeader)) ||
+                  FAILED(hr = writer.Append(", ", 2)))) ||
+                FAILED(hr = writer.Append(values.pszScheme, static_cast<DWORD>(strlen(values.pszScheme)))) ||
+                FAILED(hr = writer.Append("\r\n", 2)))
+            {
+                return hr;
+            }
+        }
+
+        if (fClientCert && values.pbClientCert != NULL)
+        {
+            if (FAILED(hr = writer.AppendName(values.pszClientCertName, static_cast<DWORD>(strlen(values.pszClientCertName)))) ||
+                FAILED(hr = writer.AppendBase64(values.pbClientCert, values.cbClientCert)) ||
+                FAILED(hr = writer.Append("\r\n", 2)))
+            {
+                return hr;
+            }
+        }
+
+        return writer.Finish(pcchHeaders);
+    }
+
+    static
+    PCSTR
+    QueryKnownHeaderName(
+        DWORD       dwHeaderId
+    )
+    {
+        //
+        // Indexed by HTTP_HEADER_ID, request headers only.
+        //
+        static const PCSTR s_rgKnownHeaderNames[HttpHeaderRequestMaximum] =
+        {
+            "Cache-Control",
+            "Connection",
+            "Date",
+            "Keep-Alive",
+            "Pragma",
+            "Trailer",
+            "Transfer-Encoding",
+            "Upgrade",
+            "Via",
+            "Warning",
+            "Allow",
+            "Content-Length",
+            "Content-Type",
+            "Content-Encoding",
+            "Content-Language",
+            "Content-Location",
+            "Content-MD5",
+            "Content-Range",
+            "Expires",
+            "Last-Modified",
+            "Accept",
+            "Accept-Charset",
+            "Accept-Encoding",
+            "Accept-Language",
+            "Authorization",
+            "Cookie",
+            "Expect",
+            "From",
+            "Host",
+            "If-Match",
+            "If-Modified-Since",
+            "If-None-Match",
+            "If-Range",
+            "If-Unmodified-Since",
+            "Max-Forwards",
+            "Proxy-Authorization",
+            "Referer",
+            "Range",
+            "TE",
+            "Translate",
+            "User-Agent",
+        };
+
+        return s_rgKnownHeaderNames[dwHeaderId];
+    }
+
+private:
+
+    template<DWORD LENGTH>
+    class WRITER
+    {
+    public:
+
+        WRITER(
+            BUFFER_T<WCHAR, LENGTH> *   pBuffer
+        ) : m_pBuffer(pBuffer),
+            m_cch(0)
+        {
+        }
+
+        HRESULT
+        Append(
+            PCSTR       pszValue,
+            DWORD       cchValue
+        )
+        {
+            HRESULT hr;
+            if (FAILED(hr = Reserve(cchValue)))
+            {
+                return hr;
+            }
+
+            WCHAR *pch = m_pBuffer->QueryPtr() + m_cch;
+            for (DWORD i = 0; i < cchValue; i++)
+            {
+                pch[i] = static_cast<WCHAR>(static_cast<BYTE>(pszValue[i]));
+            }
+            m_cch += cchValue;
+            return S_OK;
+        }
+
+        HRESULT
+        Append(
+            PCWSTR      pszValue,
+            DWORD       cchValue
+        )
+        {
+            HRESULT hr;
+            if (FAILED(hr = Reserve(cchValue)))
+            {
+                return hr;
+            }
+
+            memcpy(m_pBuffer->QueryPtr() + m_cch, pszValue, cchValue * sizeof(WCHAR));
+            m_cch += cchValue;
+            return S_OK;
+        }
+
+        HRESULT
+        AppendName(
+            PCSTR       pszName,
+            DWORD       cchName
+        )
+        {
+            HRESULT hr;
+            if (FAILED(hr = Append(pszName, cchName)) ||
+                FAILED(hr = Append(": ", 2)))
+            {
+                return hr;
+            }
+            return S_OK;
+        }
+
+        template<typename TValue>
+        HRESULT
+        AppendHeader(
+            PCSTR       pszName,
+            DWORD       cchName,
+            TValue      pszValue,
+            DWORD       cchValue
+        )
+        {
+            HRESULT hr;
+            if (FAILED(hr = AppendName(pszName, cchName)) ||
+                FAILED(hr = Append(pszValue, cchValue)) ||
+                FAILED(hr = Append("\r\n", 2)))
+            {
+                return hr;
+            }
+            return S_OK;
+        }
+
+        HRESULT
+        AppendBase64(
+            const BYTE *    pbValue,
+            DWORD           cbValue
+        )
+        {
+            HRESULT hr;
+            DWORD   cchEncoded = 1 + (cbValue + 2) / 3 * 4;
+            DWORD   dwError;
+
+            if (FAILED(hr = Reserve(cchEncoded)))
+            {
+                return hr;
+            }
+
+            dwError = Base64Encode(const_cast<BYTE *>(pbValue),
+                                   cbValue,
+                                   m_pBuffer->QueryPtr() + m_cch,
+                                   cchEncoded,
+                                   &cchEncoded);
+            if (dwError != ERROR_SUCCESS)
+            {
+                return HRESULT_FROM_WIN32(dwError);
+            }
+
+            // cchEncoded counts the terminating null
+            m_cch += cchEncoded - 1;
+            return S_OK;
+        }
+
+        HRESULT
+        Finish(
+            DWORD *     pcchHeaders
+        )
+        {
+            HRESULT hr;
+            if (FAILED(hr = Reserve(0)))
+            {
+                return hr;
+            }
+
+            m_pBuffer->QueryPtr()[m_cch] = L'\0';
+            *pcchHeaders = m_cch;
+            return S_OK;
+        }
+
+    private:
+
+        HRESULT
+        Reserve(
+            DWORD       cchExtra
+        )
+        {
+            //
+            // always keep room for the terminating null.
+            //
+            SIZE_T cbNeeded = (static_cast<SIZE_T>(m_cch) + cchExtra + 1) * sizeof(WCHAR);
+
+            if (cbNeeded > m_pBuffer->QuerySize())
+            {
+                return ResizeBufferByTwo(*m_pBuffer, cbNeeded);
+            }
+            return S_OK;
+        }
+
+        BUFFER_T<WCHAR, LENGTH> *   m_pBuffer;
+        DWORD                       m_cch;
+    };
+
+    template<DWORD LENGTH>
+    static
+    HRESULT
+    WriteHeader(
+        WRITER<LENGTH> *                pWriter,
+        const FORWARDED_HEADER_VALUES & values,
+        PCSTR                           pszName,
+        DWORD                           cchName,
+        PCSTR                           pszValue,
+        USHORT                          cchValue,
+        PCSTR *                         ppszXForwardedFor,
+        USHORT *                        pcchXForwardedFor,
+        PCSTR *                         ppszSslHeader,
+        USHORT *                        pcchSslHeader
+    )
+    {
+        //
+        // Headers ANCM rewrites are held back and written once, at the end,
+        // with the first value the client sent.
+        //
+        if (IsHeader(pszName, cchName, values.pszXForwardedForName))
+        {
+            if (*ppszXForwardedFor == NULL)
+            {
+                *ppszXForwardedFor = pszValue;
+                *pcchXForwardedFor = cchValue;
+            }
+            return S_OK;
+        }
+
+        if (IsHeader(pszName, cchName, values.pszSslHeaderName))
+        {
+            if (*ppszSslHeader == NULL)
+            {
+                *ppszSslHeader = pszValue;
+                *pcchSslHeader = cchValue;
+            }
+            return S_OK;
+        }
+
+        if (IsHeader(pszName, cchName, values.pszClientCertName))
+        {
+            return S_OK;
+        }
+
+        return pWriter->AppendHeader(pszName, cchName, pszValue, cchValue);
+    }
+
+    static
+    BOOL
+    IsHeader(
+        PCSTR       pszName,
+        DWORD       cchName,
+        PCSTR       pszTarget
+    )
+    {
+        return pszTarget != NULL &&
+               pszTarget[0] != '\0' &&
+               _strnicmp(pszName, pszTarget, cchName) == 0 &&
+               pszTarget[cchName] == '\0';
+    }
+};
@@ -0,0 +1,1312 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#pragma once
+
+#include <new>
+#include "hashfn.h"
+
+//
+// RESPONSE_CACHE is an opt-in in-memory cache of backend responses for
+// OUT_OF_PROCESS_APPLICATION, so that hot GET endpoints are answered by
+// FORWARDING_HANDLER without a WinHTTP round trip.
+//
+// - A response is stored only if it is a 200 with a positive s-maxage or
+//   max-age, without no-store, no-cache, private, Set-Cookie or Vary: *.
+// - Entries are keyed on the primary key the handler builds (method, host
+//   and URL) and on the request values of the headers named by Vary.
+// - Bodies are kept in fixed-size blocks from an ALLOC_CACHE_HANDLER, and
+//   every entry is charged its blocks and headers against a byte budget.
+//   Entries are on an LRU list and the least recently used ones go first.
+// - Entries are reference counted, a hit holds its entry until the
+//   response has been sent and eviction only unlinks it.
+//
+
+class RESPONSE_CACHE;
+class RESPONSE_CACHE_WRITER;
+
+struct RESPONSE_CACHE_COUNTERS
+{
+    //
+    // Lookups answered from the cache and lookups that were not, the hit
+    // ratio is cHits / (cHits + cMisses).
+    //
+    ULONGLONG   cHits;
+    ULONGLONG   cMisses;
+
+    //
+    // Responses stored, entries dropped to stay within the budget and
+    // entries dropped because they were found stale.
+    //
+    ULONGLONG   cInserts;
+    ULONGLONG   cEvictions;
+    ULONGLONG   cExpirations;
+
+    DWORD       cEntries;
+    ULONGLONG   cbInUse;
+};
+
+//
+// Returns the value of a request header or NULL, used to match Vary.
+//
+typedef
+PCSTR
+(*PFN_GET_REQUEST_HEADER)(
+    PVOID       pvContext,
+    PCSTR       pszName,
+    USHORT *    pcchValue
+);
+
+//
+// Cache-Control directives that matter to a shared cache, possibly merged
+// from several header lines.
+//
+class CACHE_CONTROL
+{
+public:
+
+    CACHE_CONTROL() :
+        m_fNoStore(FALSE),
+        m_fNoCache(FALSE),
+        m_fPrivate(FALSE),
+        m_fPublic(FALSE),
+        m_dwMaxAge(INFINITE),
+        m_dwSharedMaxAge(INFINITE)
+    {
+    }
+
+    VOID
+    Parse(
+        PCSTR       pszValue
+    )
+    {
+        PCSTR pszDirective = pszValue;
+
+        while (*pszDirective != '\0')
+        {
+            PCSTR pszEnd;
+            PCSTR pszArgument = NULL;
+            DWORD cchName;
+
+            while (*pszDirective == ' ' || *pszDirective == '\t' || *pszDirective == ',')
+            {
+                pszDirective++;
+            }
+
+            for (pszEnd = pszDirective;
+                 *pszEnd != '\0' && *pszEnd != ',' && *pszEnd != '=';
+                 pszEnd++)
+            {
+            }
+
+            cchName = static_cast<DWORD>(pszEnd - pszDirective);
+            while (cchName > 0 &&
+                   (pszDirective[cchName - 1] == ' ' || pszDirective[cchName - 1] == '\t'))
+            {
+                cchName--;
+            }
+
+            if (*pszEnd == '=')
+            {
+                pszArgument = ++pszEnd;
+                if (*pszEnd == '"')
+                {
+                    //
+                    // skip a quoted argument, it may hold commas
+                    //
+                    for (pszEnd++; *pszEnd != '\0' && *pszEnd != '"'; pszEnd++)
+                    {
+                    }
+                }
+                while (*pszEnd != '\0' && *pszEnd != ',')
+                {
+                    pszEnd++;
+                }
+            }
+
+            if (IsDirective(pszDirective, cchName, "no-store"))
+            {
+                m_fNoStore = TRUE;
+            }
+            else if (IsDirective(pszDirective, cchName, "no-cache"))
+            {
+                m_fNoCache = TRUE;
+            }
+            else if (IsDirective(pszDirective, cchName, "private"))
+            {
+                m_fPrivate = TRUE;
+            }
+            else if (IsDirective(pszDirective, cchName, "public"))
+            {
+                m_fPublic = TRUE;
+            }
+            else if (IsDirective(pszDirective, cchName, "max-age"))
+            {
+                m_dwMaxAge = ParseSeconds(pszArgument);
+            }
+            else if (IsDirective(pszDirective, cchName, "s-maxage"))
+            {
+                m_dwSharedMaxAge = ParseSeconds(pszArgument);
+            }
+
+            pszDirective = pszEnd;
+        }
+    }
+
+    //
+    // A Pragma header, of which only no-cache is known, the way HTTP/1.0
+    // clients ask for Cache-Control: no-cache.
+    //
+    VOID
+    ParsePragma(
+        PCSTR       pszValue
+    )
+    {
+        CACHE_CONTROL pragma;
+
+        pragma.Parse(pszValue);
+        m_fNoCache = m_fNoCache || pragma.m_fNoCache;
+    }
+
+    //
+    // Seconds a shared cache may serve the response for, 0 if it may not
+    // store it at all. s-maxage takes precedence over max-age.
+    //
+    DWORD
+    QuerySharedLifetime() const
+    {
+        if (m_fNoStore || m_fNoCache || m_fPrivate)
+        {
+            return 0;
+        }
+
+        if (m_dwSharedMaxAge != INFINITE)
+        {
+            return m_dwSharedMaxAge;
+        }
+
+        return m_dwMaxAge == INFINITE ? 0 : m_dwMaxAge;
+    }
+
+    //
+    // Whether the response may be handed to requests of other clients at
+    // all, even if it may not be stored.
+    //
+    BOOL
+    IsShareable() const
+    {
+        return !m_fNoStore && !m_fPrivate;
+    }
+
+    //
+    // Whether a response to an authenticated request may be stored and
+    // served to other requests, RFC 7234 section 3.2.
+    //
+    BOOL
+    IsSharedWhenAuthenticated() const
+    {
+        return m_fPublic || m_dwSharedMaxAge != INFINITE;
+    }
+
+    //
+    // A request that asks not to be served from a cache.
+    //
+    BOOL
+    IsRequestBypass() const
+    {
+        return m_fNoStore || m_fNoCache || m_dwMaxAge == 0;
+    }
+
+private:
+
+    static
+    BOOL
+    IsDirective(
+        PCSTR       pszDirective,
+        DWORD       cchDirective,
+        PCSTR       pszName
+    )
+    {
+        return strlen(pszName) == cchDirective &&
+               _strnicmp(pszDirective, pszName, cchDirective) == 0;
+    }
+
+    static
+    DWORD
+    ParseSeconds(
+        PCSTR       pszArgument
+    )
+    {
+        ULONGLONG ullSeconds = 0;
+
+        if (pszArgument == NULL)
+        {
+            return 0;
+        }
+
+        if (*pszArgument == '"')
+        {
+            pszArgument++;
+        }
+
+        if (*pszArgument < '0' || *pszArgument > '9')
+        {
+            return 0;
+        }
+
+        for (; *pszArgument >= '0' && *pszArgument <= '9'; pszArgument++)
+        {
+            ullSeconds = ullSeconds * 10 + (*pszArgument - '0');
+            if (ullSeconds >= INFINITE)
+            {
+                return INFINITE - 1;
+            }
+        }
+
+        return static_cast<DWORD>(ullSeconds);
+    }
+
+    BOOL        m_fNoStore;
+    BOOL        m_fNoCache;
+    BOOL        m_fPrivate;
+    BOOL        m_fPublic;
+    DWORD       m_dwMaxAge;
+    DWORD       m_dwSharedMaxAge;
+};
+
+struct CACHED_HEADER
+{
+    PCSTR       pszName;
+    PCSTR       pszValue;
+    USHORT      cchValue;
+};
+
+class RESPONSE_CACHE_ENTRY
+{
+    friend class RESPONSE_CACHE;
+
+public:
+
+    VOID
+    ReferenceCacheEntry()
+    {
+        InterlockedIncrement(&m_cRefs);
+    }
+
+    VOID
+    DereferenceCacheEntry();
+
+    USHORT
+    QueryStatus() const
+    {
+        return m_uStatus;
+    }
+
+    PCSTR
+    QueryReason() const
+    {
+        return m_pszReason;
+    }
+
+    DWORD
+    QueryHeaderCount() const
+    {
+        return m_cHeaders;
+    }
+
+    const CACHED_HEADER *
+    QueryHeader(
+        DWORD       dwIndex
+    ) const
+    {
+        DBG_ASSERT(dwIndex < m_cHeaders);
+        return &m_pHeaders[dwIndex];
+    }
+
+    DWORD
+    QueryBlockCount() const
+    {
+        return m_cBlocks;
+    }
+
+    //
+    // Every block but the last one is full.
+    //
+    BYTE *
+    QueryBlock(
+        DWORD       dwIndex,
+        DWORD *     pcbBlock
+    ) const;
+
+    ULONGLONG
+    QueryBodySize() const
+    {
+        return m_cbBody;
+    }
+
+    //
+    // Whether a request has the values of the headers named by Vary that
+    // the response was captured for.
+    //
+    BOOL
+    MatchesVary(
+        PFN_GET_REQUEST_HEADER  pfnGetHeader,
+        PVOID                   pvContext
+    ) const;
+
+    //
+    // Seconds since the response was stored, for the Age header.
+    //
+    DWORD
+    QueryAge(
+        ULONGLONG   ullNow
+    ) const
+    {
+        return static_cast<DWORD>((ullNow - m_ullStored) / 1000);
+    }
+
+private:
+
+    RESPONSE_CACHE_ENTRY() :
+        m_pNextInBucket(NULL),
+        m_cRefs(1),
+        m_pCache(NULL)
+    {
+        InitializeListHead(&m_lruEntry);
+    }
+
+    BOOL
+    IsSameVariant(
+        const RESPONSE_CACHE_ENTRY *    pOther
+    ) const;
+
+    LIST_ENTRY              m_lruEntry;
+    RESPONSE_CACHE_ENTRY *  m_pNextInBucket;
+    DWORD                   m_dwHash;
+    LONG                    m_cRefs;
+    RESPONSE_CACHE *        m_pCache;
+
+    ULONGLONG               m_ullStored;
+    ULONGLONG               m_ullExpires;
+    ULONGLONG               m_cbCharged;
+
+    PCSTR                   m_pszKey;
+    DWORD                   m_cchKey;
+    USHORT                  m_uStatus;
+    //
+    // Whether the response may answer authenticated requests.
+    //
+    BOOL                    m_fAuthenticatedOk;
+    PCSTR                   m_pszReason;
+    CACHED_HEADER *         m_pHeaders;
+    DWORD                   m_cHeaders;
+    //
+    // Headers named by Vary with the request values the response was
+    // stored for.
+    //
+    CACHED_HEADER *         m_pVary;
+    DWORD                   m_cVary;
+    BYTE **                 m_ppBlocks;
+    DWORD                   m_cBlocks;
+    ULONGLONG               m_cbBody;
+};
+
+class RESPONSE_CACHE
+{
+    friend class RESPONSE_CACHE_ENTRY;
+    friend class RESPONSE_CACHE_WRITER;
+
+public:
+
+    static const DWORD      BLOCK_SIZE = 8192;
+
+    RESPONSE_CACHE() :
+        m_cRefs(1),
+        m_cbBudget(0),
+        m_ppBuckets(NULL),
+        m_nBuckets(0),
+        m_cEntries(0),
+        m_cbInUse(0),
+        m_cHits(0),
+        m_cMisses(0),
+        m_cInserts(0),
+        m_cEvictions(0),
+        m_cExpirations(0)
+    {
+        InitializeSRWLock(&m_srwLock);
+        InitializeListHead(&m_lruHead);
+    }
+
+    HRESULT
+    Initialize(
+        ULONGLONG   cbBudget
+    )
+    {
+        HRESULT hr;
+        DWORD   nBuckets = 16;
+
+        m_cbBudget = cbBudget;
+
+        while (nBuckets < 65536 && nBuckets * BLOCK_SIZE < cbBudget)
+        {
+            nBuckets *= 2;
+        }
+
+        m_ppBuckets = new (std::nothrow) RESPONSE_CACHE_ENTRY*[nBuckets]();
+        if (m_ppBuckets == NULL)
+        {
+            return E_OUTOFMEMORY;
+        }
+        m_nBuckets = nBuckets;
+
+        hr = m_blockAlloc.Initialize(BLOCK_SIZE,
+                                     64); // nThreshold
+        return hr;
+    }
+
+    VOID
+    ReferenceResponseCache() const
+    {
+        InterlockedIncrement(&m_cRefs);
+    }
+
+    VOID
+    DereferenceResponseCache() const
+    {
+        if (InterlockedDecrement(&m_cRefs) == 0)
+        {
+            delete this;
+        }
+    }
+
+    //
+    // Drops every entry, the cache goes away once the entries in use and
+    // the writers have been released.
+    //
+    VOID
+    Shutdown()
+    {
+        AcquireSRWLockExclusive(&m_srwLock);
+        while (!IsListEmpty(&m_lruHead))
+        {
+            RemoveEntryLocked(CONTAINING_RECORD(m_lruHead.Flink, RESPONSE_CACHE_ENTRY, m_lruEntry));
+        }
+        ReleaseSRWLockExclusive(&m_srwLock);
+    }
+
+    //
+    // Returns a referenced fresh entry for the key and the request headers
+    // its Vary names, or NULL. An authenticated request is only answered
+    // with a response that allows it.
+    //
+    RESPONSE_CACHE_ENTRY *
+    Lookup(
+        PCSTR                   pszKey,
+        DWORD                   cchKey,
+        PFN_GET_REQUEST_HEADER  pfnGetHeader,
+        PVOID                   pvContext,
+        ULONGLONG               ullNow,
+        BOOL                    fAuthenticated = FALSE
+    )
+    {
+        DWORD                   dwHash = HashKey(pszKey, cchKey);
+        RESPONSE_CACHE_ENTRY *  pEntry;
+        RESPONSE_CACHE_ENTRY *  pNext;
+
+        //
+        // Exclusive since a hit moves the entry to the front of the LRU
+        // list, the lock is held for a bucket walk.
+        //
+        AcquireSRWLockExclusive(&m_srwLock);
+
+        for (pEntry = m_ppBuckets[dwHash & (m_nBuckets - 1)]; pEntry != NULL; pEntry = pNext)
+        {
+            pNext = pEntry->m_pNextInBucket;
+
+            if (pEntry->m_dwHash != dwHash ||
+                pEntry->m_cchKey != cchKey ||
+                memcmp(pEntry->m_pszKey, pszKey, cchKey) != 0)
+            {
+                continue;
+            }
+
+            if (ullNow >= pEntry->m_ullExpires)
+            {
+                m_cExpirations++;
+                RemoveEntryLocked(pEntry);
+                continue;
+            }
+
+            if ((!fAuthenticated || pEntry->m_fAuthenticatedOk) &&
+                pEntry->MatchesVary(pfnGetHeader, pvContext))
+            {
+                RemoveEntryList(&pEntry->m_lruEntry);
+                InsertHeadList(&m_lruHead, &pEntry->m_lruEntry);
+                pEntry->ReferenceCacheEntry();
+                break;
+            }
+        }
+
+        if (pEntry != NULL)
+        {
+            m_cHits++;
+        }
+        else
+        {
+            m_cMisses++;
+        }
+
+        ReleaseSRWLockExclusive(&m_srwLock);
+
+        return pEntry;
+    }
+
+    //
+    // Builds an unlinked entry from the response captured by pWriter,
+    // which is left empty.
+    //
+    HRESULT
+    CreateEntry(
+        RESPONSE_CACHE_WRITER *     pWriter,
+        ULONGLONG                   ullNow,
+        RESPONSE_CACHE_ENTRY **     ppEntry
+    );
+
+    //
+    // Stores an entry from CreateEntry, the cache takes its own reference.
+    //
+    VOID
+    Insert(
+        RESPONSE_CACHE_ENTRY *      pEntry
+    );
+
+    VOID
+    QueryCounters(
+        _Out_ RESPONSE_CACHE_COUNTERS * pCounters
+    )
+    {
+        AcquireSRWLockShared(&m_srwLock);
+        pCounters->cHits = m_cHits;
+        pCounters->cMisses = m_cMisses;
+        pCounters->cInserts = m_cInserts;
+        pCounters->cEvictions = m_cEvictions;
+        pCounters->cExpirations = m_cExpirations;
+        pCounters->cEntries = m_cEntries;
+        pCounters->cbInUse = m_cbInUse;
+        ReleaseSRWLockShared(&m_srwLock);
+    }
+
+    //
+    // Writes the counters to the debug log.
+    //
+    VOID
+    Dump()
+    {
+        RESPONSE_CACHE_COUNTERS counters;
+
+        QueryCounters(&counters);
+
+        DebugPrintf(ASPNETCORE_DEBUG_FLAG_INFO,
+            "RESPONSE_CACHE: %I64u hits, %I64u misses, %I64u inserts, %I64u evictions, %I64u expirations, %u entries, %I64u bytes",
+            counters.cHits,
+            counters.cMisses,
+            counters.cInserts,
+            counters.cEvictions,
+            counters.cExpirations,
+            counters.cEntries,
+            counters.cbInUse);
+    }
+
+    //
+    // One response may take up to an eighth of the budget.
+    //
+    ULONGLONG
+    QueryMaxEntrySize() const
+    {
+        return m_cbBudget / 8;
+    }
+
+private:
+
+    ~RESPONSE_CACHE()
+    {
+        DBG_ASSERT(IsListEmpty(&m_lruHead));
+        delete[] m_ppBuckets;
+    }
+
+    static
+    DWORD
+    HashKey(
+        PCSTR       pszKey,
+        DWORD       cchKey
+    )
+    {
+        return HashScramble(HashBlob(pszKey, cchKey));
+    }
+
+    VOID
+    RemoveEntryLocked(
+        RESPONSE_CACHE_ENTRY *  pEntry
+    )
+    {
+        RESPONSE_CACHE_ENTRY ** ppLink = &m_ppBuckets[pEntry->m_dwHash & (m_nBuckets - 1)];
+
+        while (*ppLink != pEntry)
+        {
+            ppLink = &(*ppLink)->m_pNextInBucket;
+        }
+        *ppLink = pEntry->m_pNextInBucket;
+        pEntry->m_pNextInBucket = NULL;
+
+        RemoveEntryList(&pEntry->m_lruEntry);
+        InitializeListHead(&pEntry->m_lruEntry);
+
+        m_cEntries--;
+        m_cbInUse -= pEntry->m_cbCharged;
+
+        pEntry->DereferenceCacheEntry();
+    }
+
+    mutable LONG            m_cRefs;
+    ULONGLONG               m_cbBudget;
+    ALLOC_CACHE_HANDLER     m_blockAlloc;
+
+    //
+    // Guards the buckets, the LRU list and the counters.
+    //
+    SRWLOCK                 m_srwLock;
+    RESPONSE_CACHE_ENTRY ** m_ppBuckets;
+    DWORD                   m_nBuckets;
+    //
+    // Most recently used first.
+    //
+    LIST_ENTRY              m_lruHead;
+    DWORD                   m_cEntries;
+    ULONGLONG               m_cbInUse;
+
+    ULONGLONG               m_cHits;
+    ULONGLONG               m_cMisses;
+    ULONGLONG               m_cInserts;
+    ULONGLONG               m_cEvictions;
+    ULONGLONG               m_cExpirations;
+};
+
+//
+// Captures one response while FORWARDING_HANDLER passes it to the client:
+// Initialize with the key of the request, SetStatus and AddHeader for the
+// response head, EndHeaders to learn if it may be stored, AppendBody for
+// each read and Commit once the whole response has been received.
+//
+class RESPONSE_CACHE_WRITER
+{
+    friend class RESPONSE_CACHE;
+
+public:
+
+    RESPONSE_CACHE_WRITER(
+        RESPONSE_CACHE *        pCache
+    ) : m_pCache(pCache),
+        m_pfnGetHeader(NULL),
+        m_pvContext(NULL),
+        m_uStatus(0),
+        m_cchKey(0),
+        m_cbStrings(0),
+        m_cHeaders(0),
+        m_cbVary(0),
+        m_cVary(0),
+        m_fVaryAll(FALSE),
+        m_fSetCookie(FALSE),
+        m_fAuthenticated(FALSE),
+        m_dwLifetime(0),
+        m_cBlocks(0),
+        m_cbBody(0)
+    {
+        m_pCache->ReferenceResponseCache();
+    }
+
+    ~RESPONSE_CACHE_WRITER()
+    {
+        ReleaseBlocks();
+        m_pCache->DereferenceResponseCache();
+    }
+
+    //
+    // The response to an authenticated request is only passed on or stored
+    // if it allows that.
+    //
+    HRESULT
+    Initialize(
+        PCSTR                   pszKey,
+        DWORD                   cchKey,
+        BOOL                    fAuthenticated = FALSE
+    )
+    {
+        HRESULT hr;
+
+        if (FAILED(hr = AppendString(pszKey, cchKey)))
+        {
+            return hr;
+        }
+
+        m_cchKey = cchKey;
+        m_fAuthenticated = fAuthenticated;
+        return S_OK;
+    }
+
+    //
+    // pfnGetHeader is only used until EndHeaders.
+    //
+    HRESULT
+    SetStatus(
+        USHORT                  uStatus,
+        PCSTR                   pszReason,
+        PFN_GET_REQUEST_HEADER  pfnGetHeader,
+        PVOID                   pvContext
+    )
+    {
+        m_uStatus = uStatus;
+        m_pfnGetHeader = pfnGetHeader;
+        m_pvContext = pvContext;
+
+        return AppendString(pszReason, static_cast<DWORD>(strlen(pszReason)));
+    }
+
+    HRESULT
+    AddHeader(
+        PCSTR       pszName,
+        DWORD       cchName,
+        PCSTR       pszValue,
+        DWORD       cchValue
+    )
+    {
+        HRESULT hr;
+
+        if (cchName == 13 && _strnicmp(pszName, "Cache-Control", 13) == 0)
+        {
+            m_cacheControl.Parse(pszValue);
+        }
+        else if (cchName == 10 && _strnicmp(pszName, "Set-Cookie", 10) == 0)
+        {
+            m_fSetCookie = TRUE;
+        }
+        else if (cchName == 4 && _strnicmp(pszName, "Vary", 4) == 0)
+        {
+            if (FAILED(hr = AddVary(pszValue)))
+            {
+                return hr;
+            }
+        }
+
+        if (FAILED(hr = AppendString(pszName, cchName)) ||
+            FAILED(hr = AppendString(pszValue, cchValue)))
+        {
+            return hr;
+        }
+
+        m_cHeaders++;
+        return S_OK;
+    }
+
+    //
+    // Returns FALSE if the response may not be passed to any other
+    // request. A response that may is only stored if IsCacheable.
+    //
+    BOOL
+    EndHeaders()
+    {
+        m_pfnGetHeader = NULL;
+        m_pvContext = NULL;
+
+        if (m_fAuthenticated && !m_cacheControl.IsSharedWhenAuthenticated())
+        {
+            return FALSE;
+        }
+
+        m_dwLifetime = m_cacheControl.QuerySharedLifetime();
+
+        return m_uStatus == 200 &&
+               m_cacheControl.IsShareable() &&
+               !m_fSetCookie &&
+               !m_fVaryAll;
+    }
+
+    BOOL
+    IsCacheable() const
+    {
+        return m_dwLifetime != 0;
+    }
+
+    //
+    // Returns FALSE once the body is larger than an entry may be or a
+    // block could not be allocated, the writer should be dropped then.
+    //
+    BOOL
+    AppendBody(
+        const BYTE *    pbData,
+        DWORD           cbData
+    )
+    {
+        if (m_cbBody + cbData > m_pCache->QueryMaxEntrySize())
+        {
+            return FALSE;
+        }
+
+        while (cbData > 0)
+        {
+            DWORD cbUsed = static_cast<DWORD>(m_cbBody % RESPONSE_CACHE::BLOCK_SIZE);
+            DWORD cbCopy;
+
+            if (cbUsed == 0 && m_cbBody == static_cast<ULONGLONG>(m_cBlocks) * RESPONSE_CACHE::BLOCK_SIZE)
+            {
+                BYTE *pBlock;
+
+                if (FAILED(ResizeBufferByTwo(m_bufBlocks, (m_cBlocks + 1) * sizeof(BYTE *))))
+                {
+                    return FALSE;
+                }
+
+                pBlock = static_cast<BYTE *>(m_pCache->m_blockAlloc.Alloc());
+                if (pBlock == NULL)
+                {
+                    return FALSE;
+                }
+                m_bufBlocks.QueryPtr()[m_cBlocks++] = pBlock;
+            }
+
+            cbCopy = min(cbData, RESPONSE_CACHE::BLOCK_SIZE - cbUsed);
+            memcpy(m_bufBlocks.QueryPtr()[m_cBlocks - 1] + cbUsed, pbData, cbCopy);
+
+            pbData += cbCopy;
+            cbData -= cbCopy;
+            m_cbBody += cbCopy;
+        }
+
+        return TRUE;
+    }
+
+    //
+    // Stores the response if it is cacheable, and returns a referenced
+    // entry for it in ppEntry if asked to.
+    //
+    HRESULT
+    Commit(
+        ULONGLONG                   ullNow,
+        RESPONSE_CACHE_ENTRY **     ppEntry = NULL
+    )
+    {
+        HRESULT                 hr;
+        RESPONSE_CACHE_ENTRY *  pEntry;
+
+        if (FAILED(hr = m_pCache->CreateEntry(this, ullNow, &pEntry)))
+        {
+            return hr;
+        }
+
+        if (IsCacheable())
+        {
+            m_pCache->Insert(pEntry);
+        }
+
+        if (ppEntry != NULL)
+        {
+            *ppEntry = pEntry;
+        }
+        else
+        {
+            pEntry->DereferenceCacheEntry();
+        }
+
+        return S_OK;
+    }
+
+private:
+
+    HRESULT
+    AppendString(
+        PCSTR       psz,
+        DWORD       cch
+    )
+    {
+        HRESULT hr;
+
+        if (FAILED(hr = ResizeBufferByTwo(m_bufStrings, m_cbStrings + cch + 1)))
+        {
+            return hr;
+        }
+
+        memcpy(m_bufStrings.QueryPtr() + m_cbStrings, psz, cch);
+        m_bufStrings.QueryPtr()[m_cbStrings + cch] = '\0';
+        m_cbStrings += cch + 1;
+        return S_OK;
+    }
+
+    //
+    // Records the request value of every header a Vary value names.
+    //
+    HRESULT
+    AddVary(
+        PCSTR       pszValue
+    )
+    {
+        HRESULT hr;
+
+        while (*pszValue != '\0')
+        {
+            PCSTR   pszEnd;
+            DWORD   cchName;
+            CHAR    szName[256];
+            PCSTR   pszRequestValue = NULL;
+            USHORT  cchRequestValue = 0;
+
+            while (*pszValue == ' ' || *pszValue == '\t' || *pszValue == ',')
+            {
+                pszValue++;
+            }
+
+            for (pszEnd = pszValue; *pszEnd != '\0' && *pszEnd != ','; pszEnd++)
+            {
+            }
+
+            cchName = static_cast<DWORD>(pszEnd - pszValue);
+            while (cchName > 0 && (pszValue[cchName - 1] == ' ' || pszValue[cchName - 1] == '\t'))
+            {
+                cchName--;
+            }
+
+            if (cchName == 1 && pszValue[0] == '*')
+            {
+                m_fVaryAll = TRUE;
+            }
+            else if (cchName >= sizeof(szName))
+            {
+                m_fVaryAll = TRUE;
+            }
+            else if (cchName != 0)
+            {
+                memcpy(szName, pszValue, cchName);
+                szName[cchName] = '\0';
+
+                if (m_pfnGetHeader != NULL)
+                {
+                    pszRequestValue = m_pfnGetHeader(m_pvContext, szName, &cchRequestValue);
+                }
+                if (pszRequestValue == NULL)
+                {
+                    pszRequestValue = "";
+                    cchRequestValue = 0;
+                }
+
+                if (FAILED(hr = AppendVary(szName, cchName)) ||
+                    FAILED(hr = AppendVary(pszRequestValue, cchRequestValue)))
+                {
+                    return hr;
+                }
+                m_cVary++;
+            }
+
+            pszValue = pszEnd;
+        }
+
+        return S_OK;
+    }
+
+    HRESULT
+    AppendVary(
+        PCSTR       psz,
+        DWORD       cch
+    )
+    {
+        HRESULT hr;
+
+        if (FAILED(hr = ResizeBufferByTwo(m_bufVary, m_cbVary + cch + 1)))
+        {
+            return hr;
+        }
+
+        memcpy(m_bufVary.QueryPtr() + m_cbVary, psz, cch);
+        m_bufVary.QueryPtr()[m_cbVary + cch] = '\0';
+        m_cbVary += cch + 1;
+        return S_OK;
+    }
+
+    VOID
+    ReleaseBlocks()
+    {
+        for (DWORD i = 0; i < m_cBlocks; i++)
+        {
+            m_pCache->m_blockAlloc.Free(m_bufBlocks.QueryPtr()[i]);
+        }
+        m_cBlocks = 0;
+        m_cbBody = 0;
+    }
+
+    RESPONSE_CACHE *        m_pCache;
+    PFN_GET_REQUEST_HEADER  m_pfnGetHeader;
+    PVOID                   m_pvContext;
+
+    USHORT                  m_uStatus;
+    DWORD                   m_cchKey;
+    //
+    // The key, the reason phrase and then name and value of every header,
+    // each null terminated.
+    //
+    BUFFER_T<CHAR, 1024>    m_bufStrings;
+    DWORD                   m_cbStrings;
+    DWORD                   m_cHeaders;
+    //
+    // Name and request value of every header named by Vary.
+    //
+    BUFFER_T<CHAR, 64>      m_bufVary;
+    DWORD                   m_cbVary;
+    DWORD                   m_cVary;
+    BOOL                    m_fVaryAll;
+    BOOL                    m_fSetCookie;
+    BOOL                    m_fAuthenticated;
+    CACHE_CONTROL           m_cacheControl;
+    DWORD                   m_dwLifetime;
+
+    BUFFER_T<BYTE *, 16>    m_bufBlocks;
+    DWORD                   m_cBlocks;
+    ULONGLONG               m_cbBody;
+};
+
+inline
+VOID
+RESPONSE_CACHE_ENTRY::DereferenceCacheEntry()
+{
+    if (InterlockedDecrement(&m_cRefs) == 0)
+    {
+        RESPONSE_CACHE *pCache = m_pCache;
+
+        for (DWORD i = 0; i < m_cBlocks; i++)
+        {
+            pCache->m_blockAlloc.Free(m_ppBlocks[i]);
+        }
+
+        this->~RESPONSE_CACHE_ENTRY();
+        ::operator delete(this);
+
+        pCache->DereferenceResponseCache();
+    }
+}
+
+inline
+BYTE *
+RESPONSE_CACHE_ENTRY::QueryBlock(
+    DWORD       dwIndex,
+    DWORD *     pcbBlock
+) const
+{
+    DBG_ASSERT(dwIndex < m_cBlocks);
+
+    if (dwIndex + 1 < m_cBlocks || m_cbBody % RESPONSE_CACHE::BLOCK_SIZE == 0)
+    {
+        *pcbBlock = RESPONSE_CACHE::BLOCK_SIZE;
+    }
+    else
+    {
+        *pcbBlock = static_cast<DWORD>(m_cbBody % RESPONSE_CACHE::BLOCK_SIZE);
+    }
+
+    return m_ppBlocks[dwIndex];
+}
+
+inline
+BOOL
+RESPONSE_CACHE_ENTRY::MatchesVary(
+    PFN_GET_REQUEST_HEADER  pfnGetHeader,
+    PVOID                   pvContext
+) const
+{
+    for (DWORD i = 0; i < m_cVary; i++)
+    {
+        USHORT cchValue = 0;
+        PCSTR pszValue = pfnGetHeader(pvContext, m_pVary[i].pszName, &cchValue);
+
+        if (pszValue == NULL)
+        {
+            pszValue = "";
+            cchValue = 0;
+        }
+
+        if (cchValue != m_pVary[i].cchValue ||
+            memcmp(pszValue, m_pVary[i].pszValue, cchValue) != 0)
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+inline
+BOOL
+RESPONSE_CACHE_ENTRY::IsSameVariant(
+    const RESPONSE_CACHE_ENTRY *    pOther
+) const
+{
+    if (m_cVary != pOther->m_cVary)
+    {
+        return FALSE;
+    }
+
+    for (DWORD i = 0; i < m_cVary; i++)
+    {
+        if (_stricmp(m_pVary[i].pszName, pOther->m_pVary[i].pszName) != 0 ||
+            m_pVary[i].cchValue != pOther->m_pVary[i].cchValue ||
+            memcmp(m_pVary[i].pszValue, pOther->m_pVary[i].pszValue, m_pVary[i].cchValue) != 0)
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+inline
+HRESULT
+RESPONSE_CACHE::CreateEntry(
+    RESPONSE_CACHE_WRITER *     pWriter,
+    ULONGLONG                   ullNow,
+    RESPONSE_CACHE_ENTRY **     ppEntry
+)
+{
+    RESPONSE_CACHE_ENTRY *  pEntry;
+    SIZE_T                  cbEntry;
+    BYTE *                  pbNext;
+    PCSTR                   pszString;
+
+    DBG_ASSERT(pWriter->m_pCache == this);
+
+    //
+    // The entry, its block and header tables and its strings are one
+    // allocation.
+    //
+    cbEntry = sizeof(RESPONSE_CACHE_ENTRY) +
+              pWriter->m_cBlocks * sizeof(BYTE *) +
+              (pWriter->m_cHeaders + pWriter->m_cVary) * sizeof(CACHED_HEADER) +
+              pWriter->m_cbStrings +
+              pWriter->m_cbVary;
+
+    pbNext = static_cast<BYTE *>(::operator new(cbEntry, std::nothrow));
+    if (pbNext == NULL)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    pEntry = new (pbNext) RESPONSE_CACHE_ENTRY();
+    pbNext += sizeof(RESPONSE_CACHE_ENTRY);
+
+    pEntry->m_ppBlocks = reinterpret_cast<BYTE **>(pbNext);
+    pbNext += pWriter->m_cBlocks * sizeof(BYTE *);
+    pEntry->m_pHeaders = reinterpret_cast<CACHED_HEADER *>(pbNext);
+    pbNext += pWriter->m_cHeaders * sizeof(CACHED_HEADER);
+    pEntry->m_pVary = reinterpret_cast<CACHED_HEADER *>(pbNext);
+    pbNext += pWriter->m_cVary * sizeof(CACHED_HEADER);
+
+    memcpy(pbNext, pWriter->m_bufStrings.QueryPtr(), pWriter->m_cbStrings);
+    pszString = reinterpret_cast<PCSTR>(pbNext);
+    pbNext += pWriter->m_cbStrings;
+
+    pEntry->m_pszKey = pszString;
+    pEntry->m_cchKey = pWriter->m_cchKey;
+    pszString += pWriter->m_cchKey + 1;
+    pEntry->m_pszReason = pszString;
+    pszString += strlen(pszString) + 1;
+
+    for (DWORD i = 0; i < pWriter->m_cHeaders; i++)
+    {
+        CACHED_HEADER *pHeader = &pEntry->m_pHeaders[i];
+
+        pHeader->pszName = pszString;
+        pszString += strlen(pszString) + 1;
+        pHeader->pszValue = pszString;
+        pHeader->cchValue = static_cast<USHORT>(strlen(pszString));
+        pszString += pHeader->cchValue + 1;
+    }
+
+    memcpy(pbNext, pWriter->m_bufVary.QueryPtr(), pWriter->m_cbVary);
+    pszString = reinterpret_cast<PCSTR>(pbNext);
+
+    for (DWORD i = 0; i < pWriter->m_cVary; i++)
+    {
+        CACHED_HEADER *pVary = &pEntry->m_pVary[i];
+
+        pVary->pszName = pszString;
+        pszString += strlen(pszString) + 1;
+        pVary->pszValue = pszString;
+        pVary->cchValue = static_cast<USHORT>(strlen(pszString));
+        pszString += pVary->cchValue + 1;
+    }
+
+    //
+    // The blocks move to the entry.
+    //
+    memcpy(pEntry->m_ppBlocks, pWriter->m_bufBlocks.QueryPtr(), pWriter->m_cBlocks * sizeof(BYTE *));
+
+    pEntry->m_pCache = this;
+    ReferenceResponseCache();
+    pEntry->m_dwHash = HashKey(pEntry->m_pszKey, pEntry->m_cchKey);
+    pEntry->m_uStatus = pWriter->m_uStatus;
+    pEntry->m_fAuthenticatedOk = pWriter->m_cacheControl.IsSharedWhenAuthenticated();
+    pEntry->m_cHeaders = pWriter->m_cHeaders;
+    pEntry->m_cVary = pWriter->m_cVary;
+    pEntry->m_cBlocks = pWriter->m_cBlocks;
+    pEntry->m_cbBody = pWriter->m_cbBody;
+    pEntry->m_ullStored = ullNow;
+    pEntry->m_ullExpires = ullNow + pWriter->m_dwLifetime * 1000ULL;
+    pEntry->m_cbCharged = cbEntry + pWriter->m_cBlocks * static_cast<ULONGLONG>(BLOCK_SIZE);
+
+    pWriter->m_cBlocks = 0;
+    pWriter->m_cbBody = 0;
+
+    *ppEntry = pEntry;
+    return S_OK;
+}
+
+inline
+VOID
+RESPONSE_CACHE::Insert(
+    RESPONSE_CACHE_ENTRY *      pEntry
+)
+{
+    RESPONSE_CACHE_ENTRY ** ppBucket;
+
+    DBG_ASSERT(pEntry->m_pCache == this);
+
+    pEntry->ReferenceCacheEntry();
+
+    AcquireSRWLockExclusive(&m_srwLock);
+
+    //
+    // A newer copy of the same variant replaces the old one.
+    //
+    ppBucket = &m_ppBuckets[pEntry->m_dwHash & (m_nBuckets - 1)];
+    for (RESPONSE_CACHE_ENTRY *pOld = *ppBucket, *pNext; pOld != NULL; pOld = pNext)
+    {
+        pNext = pOld->m_pNextInBucket;
+
+        if (pOld->m_dwHash == pEntry->m_dwHash &&
+            pOld->m_cchKey == pEntry->m_cchKey &&
+            memcmp(pOld->m_pszKey, pEntry->m_pszKey, pEntry->m_cchKey) == 0 &&
+            pOld->IsSameVariant(pEntry))
+        {
+            RemoveEntryLocked(pOld);
+        }
+    }
+
+    pEntry->m_pNextInBucket = *ppBucket;
+    *ppBucket = pEntry;
+    InsertHeadList(&m_lruHead, &pEntry->m_lruEntry);
+    m_cEntries++;
+    m_cbInUse += pEntry->m_cbCharged;
+    m_cInserts++;
+
+    while (m_cbInUse > m_cbBudget && m_lruHead.Blink != &pEntry->m_lruEntry)
+    {
+        m_cEvictions++;
+        RemoveEntryLocked(CONTAINING_RECORD(m_lruHead.Blink, RESPONSE_CACHE_ENTRY, m_lruEntry));
+    }
+
+    ReleaseSRWLockExclusive(&m_srwLock);
+}
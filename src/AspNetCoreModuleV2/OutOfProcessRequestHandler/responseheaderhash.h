@@ -4,105 +4,197 @@
 #pragma once
 
 //
-// *_HEADER_HASH maps strings to UlHeader* values
+// RESPONSE_HEADER_HASH maps response header names to UlHeader* values
+//
+// The set of known headers never changes, so the lookup table is built at
+// compile time: a perfect hash of the length and the first and last
+// characters picks the only possible candidate, which is then compared
+// case-insensitively in place. No virtual calls, no full-string hash and no
+// lock on the per-header path.
 //
 
 #define UNKNOWN_INDEX           (0xFFFFFFFF)
 
 struct HEADER_RECORD
 {
+    template<size_t cchName>
+    constexpr
+    HEADER_RECORD(
+        const CHAR (&szName)[cchName],
+        ULONG       ulHeaderIndex
+    ) : _pszName(szName),
+        _cchName(cchName - 1),
+        _ulHeaderIndex(ulHeaderIndex)
+    {}
+
     PCSTR   _pszName;
+    DWORD   _cchName;
     ULONG   _ulHeaderIndex;
 };
 
-class RESPONSE_HEADER_HASH: public HASH_TABLE<HEADER_RECORD, PCSTR>
+class RESPONSE_HEADER_SLOTS
 {
 public:
-    RESPONSE_HEADER_HASH() 
-    {}
-    
-    VOID
-    ReferenceRecord(
-        HEADER_RECORD *
-    )
-    {}
 
-    VOID
-    DereferenceRecord(
-        HEADER_RECORD *
-    )
-    {}
+    //
+    // Hash parameters, the table below fails to compile if two known
+    // headers land in the same slot. Pick new multipliers if that happens
+    // after adding a header.
+    //
+    static const DWORD      SLOT_COUNT = 64;
+    static const DWORD      FIRST_CHAR_MULTIPLIER = 4;
+    static const DWORD      LAST_CHAR_MULTIPLIER = 24;
+    static const BYTE       EMPTY_SLOT = 0xFF;
 
-    PCSTR
-    ExtractKey(
-        HEADER_RECORD * pRecord
+    static
+    constexpr
+    CHAR
+    FoldCase(
+        CHAR        ch
     )
     {
-        return pRecord->_pszName;
+        //
+        // Only letters are folded, "Cache\rControl" must not match.
+        //
+        return (ch >= 'A' && ch <= 'Z') ? static_cast<CHAR>(ch | 0x20) : ch;
     }
 
+    static
+    constexpr
     DWORD
-    CalcKeyHash(
-        PCSTR   key
+    Hash(
+        PCSTR       pszName,
+        DWORD       cchName
     )
     {
-        return HashStringNoCase(key);
+        return (static_cast<BYTE>(FoldCase(pszName[0])) * FIRST_CHAR_MULTIPLIER +
+                static_cast<BYTE>(FoldCase(pszName[cchName - 1])) * LAST_CHAR_MULTIPLIER +
+                cchName) & (SLOT_COUNT - 1);
     }
 
-    BOOL
-    EqualKeys(
-        PCSTR   key1,
-        PCSTR   key2
+    template<size_t cHeaders>
+    static
+    constexpr
+    RESPONSE_HEADER_SLOTS
+    Build(
+        const HEADER_RECORD (&rgHeaders)[cHeaders]
     )
     {
-        return (_stricmp(key1, key2) == 0);
+        static_assert(cHeaders < EMPTY_SLOT, "Too many headers for a BYTE slot");
+
+        RESPONSE_HEADER_SLOTS slots = {};
+        slots._fPerfect = TRUE;
+
+        for (DWORD i = 0; i < SLOT_COUNT; i++)
+        {
+            slots._rgbSlots[i] = EMPTY_SLOT;
+        }
+
+        for (DWORD i = 0; i < cHeaders; i++)
+        {
+            DWORD dwSlot = Hash(rgHeaders[i]._pszName, rgHeaders[i]._cchName);
+            if (slots._rgbSlots[dwSlot] != EMPTY_SLOT)
+            {
+                slots._fPerfect = FALSE;
+            }
+            slots._rgbSlots[dwSlot] = static_cast<BYTE>(i);
+        }
+
+        return slots;
     }
 
-    HRESULT
-    Initialize(
-        VOID
-    );
-    
-    VOID
-    Terminate(
-        VOID
-    );
-    
+    BYTE        _rgbSlots[SLOT_COUNT];
+    BOOL        _fPerfect;
+};
+
+class RESPONSE_HEADER_HASH
+{
+public:
+
+    static
     DWORD
     GetIndex(
-        PCSTR             pszName
+        PCSTR               pszName,
+        DWORD               cchName
     )
     {
-        HEADER_RECORD *       pRecord = NULL;
+        if (cchName == 0)
+        {
+            return UNKNOWN_INDEX;
+        }
 
-        FindKey(pszName, &pRecord);
-        if (pRecord != NULL)
+        BYTE bSlot = sm_slots._rgbSlots[RESPONSE_HEADER_SLOTS::Hash(pszName, cchName)];
+        if (bSlot == RESPONSE_HEADER_SLOTS::EMPTY_SLOT)
         {
-            return pRecord->_ulHeaderIndex;
+            return UNKNOWN_INDEX;
         }
 
-        return UNKNOWN_INDEX;
+        const HEADER_RECORD & record = sm_rgHeaders[bSlot];
+        if (record._cchName != cchName)
+        {
+            return UNKNOWN_INDEX;
+        }
+
+        for (DWORD i = 0; i < cchName; i++)
+        {
+            if (RESPONSE_HEADER_SLOTS::FoldCase(pszName[i]) !=
+                RESPONSE_HEADER_SLOTS::FoldCase(record._pszName[i]))
+            {
+                return UNKNOWN_INDEX;
+            }
+        }
+
+        return record._ulHeaderIndex;
     }
-    
+
     static
-    PCSTR
-    GetString(
-        ULONG               ulIndex
+    DWORD
+    GetIndex(
+        PCSTR               pszName
     )
     {
-        if (ulIndex < HttpHeaderResponseMaximum)
-        {
-            DBG_ASSERT(sm_rgHeaders[ulIndex]._ulHeaderIndex == ulIndex);
-            return sm_rgHeaders[ulIndex]._pszName;
-        }
-
-        return NULL;
+        return GetIndex(pszName, static_cast<DWORD>(strlen(pszName)));
     }
-    
+
 private:
 
-    static HEADER_RECORD         sm_rgHeaders[];
+    //
+    // Set-Cookie and WWW-Authenticate are left out on purpose so that they
+    // are passed along as unknown headers.
+    //
+    static constexpr HEADER_RECORD  sm_rgHeaders[] =
+    {
+        { "Cache-Control",       HttpHeaderCacheControl       },
+        { "Connection",          HttpHeaderConnection         },
+        { "Date",                HttpHeaderDate               },
+        { "Keep-Alive",          HttpHeaderKeepAlive          },
+        { "Pragma",              HttpHeaderPragma             },
+        { "Trailer",             HttpHeaderTrailer            },
+        { "Transfer-Encoding",   HttpHeaderTransferEncoding   },
+        { "Upgrade",             HttpHeaderUpgrade            },
+        { "Via",                 HttpHeaderVia                },
+        { "Warning",             HttpHeaderWarning            },
+        { "Allow",               HttpHeaderAllow              },
+        { "Content-Length",      HttpHeaderContentLength      },
+        { "Content-Type",        HttpHeaderContentType        },
+        { "Content-Encoding",    HttpHeaderContentEncoding    },
+        { "Content-Language",    HttpHeaderContentLanguage    },
+        { "Content-Location",    HttpHeaderContentLocation    },
+        { "Content-MD5",         HttpHeaderContentMd5         },
+        { "Content-Range",       HttpHeaderContentRange       },
+        { "Expires",             HttpHeaderExpires            },
+        { "Last-Modified",       HttpHeaderLastModified       },
+        { "Accept-Ranges",       HttpHeaderAcceptRanges       },
+        { "Age",                 HttpHeaderAge                },
+        { "ETag",                HttpHeaderEtag               },
+        { "Location",            HttpHeaderLocation           },
+        { "Proxy-Authenticate",  HttpHeaderProxyAuthenticate  },
+        { "Retry-After",         HttpHeaderRetryAfter         },
+        { "Server",              HttpHeaderServer             },
+        { "Vary",                HttpHeaderVary               },
+    };
+
+    static constexpr RESPONSE_HEADER_SLOTS sm_slots = RESPONSE_HEADER_SLOTS::Build(sm_rgHeaders);
 
-    RESPONSE_HEADER_HASH(const RESPONSE_HEADER_HASH &);
-    void operator=(const RESPONSE_HEADER_HASH &);
+    static_assert(sm_slots._fPerfect, "Response header names collide, update the RESPONSE_HEADER_SLOTS multipliers");
 };
@@ -0,0 +1,415 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#pragma once
+
+#include <intrin.h>
+
+#if defined(_M_IX86) || defined(_M_X64)
+#include <immintrin.h>
+#define BYTE_SCANNER_HAS_SIMD
+#endif
+
+enum BYTE_SCANNER_KIND
+{
+    BYTE_SCANNER_SCALAR,
+    BYTE_SCANNER_SSE2,
+    BYTE_SCANNER_AVX2,
+};
+
+//
+// BYTE_SCANNER finds the first of two delimiters in a counted byte range,
+// 16 or 32 bytes at a time when the CPU allows it. All variants return the
+// same result, the vector loops hand the tail that does not fill a whole
+// vector to the scalar loop so that nothing past the range is read.
+//
+class BYTE_SCANNER
+{
+public:
+
+    //
+    // Returns the offset of the first ch1 or ch2 in pch[0, cch), cch if
+    // there is none.
+    //
+    static
+    DWORD
+    Find(
+        BYTE_SCANNER_KIND   kind,
+        PCSTR               pch,
+        DWORD               cch,
+        CHAR                ch1,
+        CHAR                ch2
+    )
+    {
+#ifdef BYTE_SCANNER_HAS_SIMD
+        if (kind == BYTE_SCANNER_AVX2)
+        {
+            return FindAvx2(pch, cch, ch1, ch2);
+        }
+        if (kind == BYTE_SCANNER_SSE2)
+        {
+            return FindSse2(pch, cch, ch1, ch2);
+        }
+#else
+        UNREFERENCED_PARAMETER(kind);
+#endif
+        return FindScalar(pch, cch, ch1, ch2);
+    }
+
+    static
+    DWORD
+    FindScalar(
+        PCSTR               pch,
+        DWORD               cch,
+        CHAR                ch1,
+        CHAR                ch2
+    )
+    {
+        for (DWORD i = 0; i < cch; i++)
+        {
+            if (pch[i] == ch1 || pch[i] == ch2)
+            {
+                return i;
+            }
+        }
+        return cch;
+    }
+
+#ifdef BYTE_SCANNER_HAS_SIMD
+
+    static
+    DWORD
+    FindSse2(
+        PCSTR               pch,
+        DWORD               cch,
+        CHAR                ch1,
+        CHAR                ch2
+    )
+    {
+        const __m128i   v1 = _mm_set1_epi8(ch1);
+        const __m128i   v2 = _mm_set1_epi8(ch2);
+        DWORD           i = 0;
+
+        for (; cch - i >= sizeof(__m128i); i += sizeof(__m128i))
+        {
+            __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pch + i));
+            int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(data, v1),
+                                                      _mm_cmpeq_epi8(data, v2)));
+            if (mask != 0)
+            {
+                unsigned long bit;
+                _BitScanForward(&bit, static_cast<unsigned long>(mask));
+                return i + bit;
+            }
+        }
+
+        return i + FindScalar(pch + i, cch - i, ch1, ch2);
+    }
+
+    static
+    DWORD
+    FindAvx2(
+        PCSTR               pch,
+        DWORD               cch,
+        CHAR                ch1,
+        CHAR                ch2
+    )
+    {
+        const __m256i   v1 = _mm256_set1_epi8(ch1);
+        const __m256i   v2 = _mm256_set1_epi8(ch2);
+        DWORD           i = 0;
+
+        for (; cch - i >= sizeof(__m256i); i += sizeof(__m256i))
+        {
+            __m256i data = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pch + i));
+            int mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(data, v1),
+                                                            _mm256_cmpeq_epi8(data, v2)));
+            if (mask != 0)
+            {
+                unsigned long bit;
+                _BitScanForward(&bit, static_cast<unsigned long>(mask));
+                return i + bit;
+            }
+        }
+
+        //
+        // at most 31 bytes left, one more SSE2 step before going scalar.
+        //
+        return i + FindSse2(pch + i, cch - i, ch1, ch2);
+    }
+
+#endif
+
+    //
+    // The widest variant this CPU and OS support, computed once.
+    //
+    static
+    BYTE_SCANNER_KIND
+    QueryBestKind()
+    {
+        static const BYTE_SCANNER_KIND s_kind = DetectKind();
+        return s_kind;
+    }
+
+private:
+
+    static
+    BYTE_SCANNER_KIND
+    DetectKind()
+    {
+#ifdef BYTE_SCANNER_HAS_SIMD
+        int rgRegisters[4];
+
+        __cpuid(rgRegisters, 0);
+        int cLeaves = rgRegisters[0];
+
+        __cpuid(rgRegisters, 1);
+        BOOL fSse2 = (rgRegisters[3] & (1 << 26)) != 0;
+        BOOL fOsSavesYmm = (rgRegisters[2] & (1 << 27)) != 0 &&     // OSXSAVE
+                           (rgRegisters[2] & (1 << 28)) != 0 &&     // AVX
+                           (_xgetbv(0) & 0x6) == 0x6;               // XMM and YMM state
+
+        if (fOsSavesYmm && cLeaves >= 7)
+        {
+            __cpuidex(rgRegisters, 7, 0);
+            if ((rgRegisters[1] & (1 << 5)) != 0)                   // AVX2
+            {
+                return BYTE_SCANNER_AVX2;
+            }
+        }
+
+        if (fSse2)
+        {
+            return BYTE_SCANNER_SSE2;
+        }
+#endif
+        return BYTE_SCANNER_SCALAR;
+    }
+};
+
+//
+// RESPONSE_HEADER_TOKENIZER splits the status line and header block that
+// WinHttpQueryHeaders(WINHTTP_QUERY_RAW_HEADERS_CRLF) returns in a single
+// forward pass, without copying.
+//
+// Names, values and the reason phrase are returned as spans into the
+// caller's buffer and are also null terminated in place, the byte after
+// each span is a delimiter that has already been consumed. obs-fold line
+// continuations are unfolded in place by turning the CR LF into spaces, as
+// RFC 7230 3.2.4 asks a proxy to do. The buffer must stay alive and
+// untouched while the spans are used.
+//
+class RESPONSE_HEADER_TOKENIZER
+{
+public:
+
+    RESPONSE_HEADER_TOKENIZER(
+        _Inout_updates_(cchHeaders) PSTR    pszHeaders,
+        DWORD                               cchHeaders,
+        BYTE_SCANNER_KIND                   kind = BYTE_SCANNER::QueryBestKind()
+    ) : m_pszHeaders(pszHeaders),
+        m_cchHeaders(cchHeaders),
+        m_index(0),
+        m_kind(kind)
+    {
+    }
+
+    //
+    // "HTTP/1.1 200 OK". The status code must be three digits, the reason
+    // phrase may be empty or missing.
+    //
+    HRESULT
+    ParseStatusLine(
+        _Out_ USHORT *      puStatus,
+        _Out_ PCSTR *       ppszReason,
+        _Out_ DWORD *       pcchReason
+    )
+    {
+        DWORD   dwNewline;
+        DWORD   index;
+        DWORD   dwEnd;
+        USHORT  uStatus = 0;
+
+        *puStatus = 0;
+        *ppszReason = NULL;
+        *pcchReason = 0;
+
+        dwNewline = FindFrom(0, '\n', '\n');
+        if (dwNewline == m_cchHeaders)
+        {
+            return HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER);
+        }
+
+        index = FindFrom(0, ' ', '\n');
+        if (index >= dwNewline)
+        {
+            return HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER);
+        }
+        index = SkipSpaces(index, dwNewline);
+
+        for (DWORD i = 0; i < 3; i++, index++)
+        {
+            if (index >= dwNewline ||
+                m_pszHeaders[index] < '0' || m_pszHeaders[index] > '9')
+            {
+                return HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER);
+            }
+            uStatus = static_cast<USHORT>(uStatus * 10 + (m_pszHeaders[index] - '0'));
+        }
+
+        if (m_pszHeaders[index] != ' ' && m_pszHeaders[index] != '\r' && index != dwNewline)
+        {
+            return HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER);
+        }
+
+        index = SkipSpaces(index, dwNewline);
+        dwEnd = TrimEnd(index, dwNewline);
+
+        m_index = dwNewline + 1;
+        m_pszHeaders[dwEnd] = '\0';
+
+        *puStatus = uStatus;
+        *ppszReason = m_pszHeaders + index;
+        *pcchReason = dwEnd - index;
+        return S_OK;
+    }
+
+    //
+    // Returns S_OK with the next header, S_FALSE at the empty line that
+    // ends the block (or at the end of the buffer) and
+    // ERROR_INVALID_PARAMETER for a line without ':' or without '\n'.
+    //
+    HRESULT
+    NextHeader(
+        _Out_ PCSTR *       ppszName,
+        _Out_ DWORD *       pcchName,
+        _Out_ PCSTR *       ppszValue,
+        _Out_ DWORD *       pcchValue
+    )
+    {
+        DWORD   dwStart = m_index;
+        DWORD   dwColon;
+        DWORD   dwNewline;
+        DWORD   dwNameEnd;
+        DWORD   dwValueStart;
+        DWORD   dwValueEnd;
+
+        *ppszName = NULL;
+        *pcchName = 0;
+        *ppszValue = NULL;
+        *pcchValue = 0;
+
+        if (dwStart >= m_cchHeaders ||
+            m_pszHeaders[dwStart] == '\r' ||
+            m_pszHeaders[dwStart] == '\n' ||
+            m_pszHeaders[dwStart] == '\0')
+        {
+            return S_FALSE;
+        }
+
+        dwColon = FindFrom(dwStart, ':', '\n');
+        if (dwColon == m_cchHeaders || m_pszHeaders[dwColon] != ':')
+        {
+            return HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER);
+        }
+
+        dwNewline = FindFrom(dwColon + 1, '\n', '\n');
+        if (dwNewline == m_cchHeaders)
+        {
+            return HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER);
+        }
+
+        //
+        // Take care of header continuation
+        //
+        while (dwNewline + 1 < m_cchHeaders &&
+               (m_pszHeaders[dwNewline + 1] == ' ' || m_pszHeaders[dwNewline + 1] == '\t'))
+        {
+            if (m_pszHeaders[dwNewline - 1] == '\r')
+            {
+                m_pszHeaders[dwNewline - 1] = ' ';
+            }
+            m_pszHeaders[dwNewline] = ' ';
+
+            dwNewline = FindFrom(dwNewline + 1, '\n', '\n');
+            if (dwNewline == m_cchHeaders)
+            {
+                return HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER);
+            }
+        }
+
+        //
+        // Skip over any spaces before the ':'
+        //
+        for (dwNameEnd = dwColon; dwNameEnd > dwStart && m_pszHeaders[dwNameEnd - 1] == ' '; dwNameEnd--)
+        {
+        }
+
+        if (dwNameEnd == dwStart)
+        {
+            return HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER);
+        }
+
+        dwValueStart = SkipSpaces(dwColon + 1, dwNewline);
+        dwValueEnd = TrimEnd(dwValueStart, dwNewline);
+
+        m_index = dwNewline + 1;
+        m_pszHeaders[dwNameEnd] = '\0';
+        m_pszHeaders[dwValueEnd] = '\0';
+
+        *ppszName = m_pszHeaders + dwStart;
+        *pcchName = dwNameEnd - dwStart;
+        *ppszValue = m_pszHeaders + dwValueStart;
+        *pcchValue = dwValueEnd - dwValueStart;
+        return S_OK;
+    }
+
+private:
+
+    DWORD
+    FindFrom(
+        DWORD       index,
+        CHAR        ch1,
+        CHAR        ch2
+    ) const
+    {
+        return index + BYTE_SCANNER::Find(m_kind, m_pszHeaders + index, m_cchHeaders - index, ch1, ch2);
+    }
+
+    DWORD
+    SkipSpaces(
+        DWORD       index,
+        DWORD       dwEnd
+    ) const
+    {
+        while (index < dwEnd && (m_pszHeaders[index] == ' ' || m_pszHeaders[index] == '\t'))
+        {
+            index++;
+        }
+        return index;
+    }
+
+    //
+    // Returns the end of [dwStart, dwEnd) without trailing whitespace and CR.
+    //
+    DWORD
+    TrimEnd(
+        DWORD       dwStart,
+        DWORD       dwEnd
+    ) const
+    {
+        while (dwEnd > dwStart &&
+               (m_pszHeaders[dwEnd - 1] == ' ' ||
+                m_pszHeaders[dwEnd - 1] == '\t' ||
+                m_pszHeaders[dwEnd - 1] == '\r'))
+        {
+            dwEnd--;
+        }
+        return dwEnd;
+    }
+
+    PSTR                m_pszHeaders;
+    DWORD               m_cchHeaders;
+    DWORD               m_index;
+    BYTE_SCANNER_KIND   m_kind;
+};
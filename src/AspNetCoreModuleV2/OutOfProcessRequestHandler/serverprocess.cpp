@@ -27,6 +27,13 @@ SERVER_PROCESS::Initialize(
     ENVIRONMENT_VAR_HASH *pEnvironmentVariables,
     BOOL                  fStdoutLogEnabled,
     BOOL                  fWebSocketSupported,
+    BACKEND_TRANSPORT     backendTransport,
+    DWORD                 dwRequestTimeoutInMS,
+    DWORD                 dwMaxBackendConnections,
+    DWORD                 dwMinIdleBackendConnections,
+    DWORD                 dwBackendConnectionIdleTimeoutInMS,
+    BACKEND_PROTOCOL      backendProtocol,
+    DWORD                 dwH2cConnections,
     STRU                  *pstruStdoutLogFile,
     STRU                  *pszAppPhysicalPath,
     STRU                  *pszAppPath,
@@ -40,6 +47,13 @@ SERVER_PROCESS::Initialize(
     m_dwShutdownTimeLimitInMS = dwShtudownTimeLimitInMS;
     m_fStdoutLogEnabled = fStdoutLogEnabled;
     m_fWebSocketSupported = fWebSocketSupported;
+    m_backendTransport = backendTransport;
+    m_dwRequestTimeoutInMS = dwRequestTimeoutInMS;
+    m_dwMaxBackendConnections = dwMaxBackendConnections;
+    m_dwMinIdleBackendConnections = dwMinIdleBackendConnections;
+    m_dwBackendConnectionIdleTimeoutInMS = dwBackendConnectionIdleTimeoutInMS;
+    m_backendProtocol = backendProtocol;
+    m_dwH2cConnections = dwH2cConnections;
     m_fWindowsAuthEnabled = fWindowsAuthEnabled;
     m_fBasicAuthEnabled = fBasicAuthEnabled;
     m_fAnonymousAuthEnabled = fAnonymousAuthEnabled;
@@ -57,6 +71,13 @@ SERVER_PROCESS::Initialize(
         goto Finished;
     }
 
+    m_hStartCancelEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (m_hStartCancelEvent == NULL)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        goto Finished;
+    }
+
     m_pEnvironmentVarTable = pEnvironmentVariables;
 
 Finished:
@@ -153,6 +174,11 @@ SERVER_PROCESS::SetupListenPort(
     ENVIRONMENT_VAR_ENTRY *pEntry = NULL;
     *pfCriticalError = FALSE;
 
+    if (m_backendTransport == BACKEND_TRANSPORT_UNIX_SOCKET)
+    {
+        return SetupListenSocket(pEnvironmentVarTable);
+    }
+
     pEnvironmentVarTable->FindKey(ASPNETCORE_PORT_ENV_STR, &pEntry);
     if (pEntry != NULL)
     {
@@ -229,6 +255,117 @@ Finished:
     return hr;
 }
 
+HRESULT
+SERVER_PROCESS::SetupListenSocket(
+    ENVIRONMENT_VAR_HASH    *pEnvironmentVarTable
+)
+/*++
+
+Description:
+
+    Points the backend at a new Unix domain socket in the temp directory
+    through ASPNETCORE_UNIX_SOCKET, which IIS integration listens on in
+    place of ASPNETCORE_PORT. ASPNETCORE_PORT is removed, as the backend
+    would listen on that port instead.
+
+--*/
+{
+    HRESULT                 hr = S_OK;
+    ENVIRONMENT_VAR_ENTRY  *pEntry = NULL;
+    WCHAR                   rgchTempPath[MAX_PATH + 1];
+    DWORD                   cchTempPath;
+
+    m_dwPort = 0;
+
+    pEnvironmentVarTable->FindKey(ASPNETCORE_PORT_ENV_STR, &pEntry);
+    if (pEntry != NULL)
+    {
+        pEnvironmentVarTable->DeleteKey(ASPNETCORE_PORT_ENV_STR);
+        pEntry->Dereference();
+        pEntry = NULL;
+    }
+
+    pEnvironmentVarTable->FindKey(ASPNETCORE_UNIX_SOCKET_ENV_STR, &pEntry);
+    if (pEntry != NULL)
+    {
+        pEnvironmentVarTable->DeleteKey(ASPNETCORE_UNIX_SOCKET_ENV_STR);
+        pEntry->Dereference();
+        pEntry = NULL;
+    }
+
+    cchTempPath = GetTempPathW(_countof(rgchTempPath), rgchTempPath);
+    if (cchTempPath == 0 || cchTempPath >= _countof(rgchTempPath))
+    {
+        hr = HRESULT_FROM_WIN32(cchTempPath == 0 ? GetLastError() : ERROR_BUFFER_OVERFLOW);
+        goto Finished;
+    }
+
+    //
+    // Kestrel takes the socket as http://unix:/<path> and ends the path at
+    // the first ':', so IIS integration passes it on without its drive. It
+    // then resolves against the drive of the backend's current directory,
+    // the application's, which has to be the drive of the temp directory.
+    //
+    if (cchTempPath < 2 ||
+        rgchTempPath[1] != L':' ||
+        m_struPhysicalPath.QueryCCH() < 2 ||
+        towupper(rgchTempPath[0]) != towupper(m_struPhysicalPath.QueryStr()[0]))
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_NOT_SAME_DEVICE);
+        goto Finished;
+    }
+
+    if (FAILED_LOG(hr = m_struUnixSocketPath.SafeSnwprintf(L"%sancm-%u-%08x.sock",
+                                                           rgchTempPath,
+                                                           GetCurrentProcessId(),
+                                                           static_cast<DWORD>(m_randomGenerator()))) ||
+        FAILED_LOG(hr = m_straUnixSocketPath.CopyW(m_struUnixSocketPath.QueryStr())))
+    {
+        goto Finished;
+    }
+
+    //
+    // The path has to fit in sockaddr_un.
+    //
+    if (m_straUnixSocketPath.QueryCCH() >= sizeof(((sockaddr_un *)NULL)->sun_path))
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_BAD_PATHNAME);
+        goto Finished;
+    }
+
+    //
+    // A socket file left behind by an earlier process would fail the bind.
+    //
+    DeleteFileW(m_struUnixSocketPath.QueryStr());
+
+    pEntry = new ENVIRONMENT_VAR_ENTRY();
+    if (pEntry == NULL)
+    {
+        hr = E_OUTOFMEMORY;
+        goto Finished;
+    }
+
+    if (FAILED_LOG(hr = pEntry->Initialize(ASPNETCORE_UNIX_SOCKET_ENV_STR, m_struUnixSocketPath.QueryStr())) ||
+        FAILED_LOG(hr = pEnvironmentVarTable->InsertRecord(pEntry)))
+    {
+        goto Finished;
+    }
+
+Finished:
+    if (pEntry != NULL)
+    {
+        pEntry->Dereference();
+        pEntry = NULL;
+    }
+
+    if (FAILED(hr))
+    {
+        m_struUnixSocketPath.Reset();
+        m_straUnixSocketPath.Reset();
+    }
+    return hr;
+}
+
 HRESULT
 SERVER_PROCESS::SetupAppPath(
     ENVIRONMENT_VAR_HASH*    pEnvironmentVarTable
@@ -268,6 +405,53 @@ Finished:
     return hr;
 }
 
+HRESULT
+SERVER_PROCESS::SetupReadyEvent(
+    ENVIRONMENT_VAR_HASH*    pEnvironmentVarTable
+)
+{
+    HRESULT      hr = S_OK;
+    ENVIRONMENT_VAR_ENTRY*  pEntry = NULL;
+
+    pEnvironmentVarTable->FindKey(ASPNETCORE_READY_EVENT_ENV_STR, &pEntry);
+    if (pEntry != NULL)
+    {
+        // user should not set this environment variable in configuration
+        pEnvironmentVarTable->DeleteKey(ASPNETCORE_READY_EVENT_ENV_STR);
+        pEntry->Dereference();
+        pEntry = NULL;
+    }
+
+    if (FAILED_LOG(m_readinessEvent.Create(m_dwPort)))
+    {
+        //
+        // not fatal, readiness is polled as before.
+        //
+        goto Finished;
+    }
+
+    pEntry = new ENVIRONMENT_VAR_ENTRY();
+    if (pEntry == NULL)
+    {
+        hr = E_OUTOFMEMORY;
+        goto Finished;
+    }
+
+    if (FAILED_LOG(hr = pEntry->Initialize(ASPNETCORE_READY_EVENT_ENV_STR, m_readinessEvent.QueryName())) ||
+        FAILED_LOG(hr = pEnvironmentVarTable->InsertRecord(pEntry)))
+    {
+        goto Finished;
+    }
+
+Finished:
+    if (pEntry != NULL)
+    {
+        pEntry->Dereference();
+        pEntry = NULL;
+    }
+    return hr;
+}
+
 HRESULT
 SERVER_PROCESS::SetupAppToken(
     ENVIRONMENT_VAR_HASH    *pEnvironmentVarTable
@@ -553,13 +737,24 @@ SERVER_PROCESS::PostStartCheck(
 
         if (!fReady)
         {
-            Sleep(250);
+            //
+            // returns early when the backend signals or exits, sleeps when
+            // there is no readiness event.
+            //
+            m_readinessEvent.Wait(m_hProcessHandle, 250, m_hStartCancelEvent);
         }
 
         dwTimeDifference = (GetTickCount() - dwTickCount);
     } while (fReady == FALSE &&
+        !IsStartCancelled() &&
         ((dwTimeDifference < m_dwStartupTimeLimitInMS) || fDebuggerAttached));
 
+    if (IsStartCancelled())
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED);
+        goto Finished;
+    }
+
     if (!fReady)
     {
         hr = E_APPLICATION_ACTIVATION_TIMED_OUT;
@@ -696,7 +891,8 @@ SERVER_PROCESS::PostStartCheck(
     // ready to mark the server process ready but before this,
     // create and initialize the FORWARDER_CONNECTION
     //
-    if (m_pForwarderConnection == NULL)
+    if (m_pForwarderConnection == NULL &&
+        m_backendTransport == BACKEND_TRANSPORT_TCP)
     {
         m_pForwarderConnection = new FORWARDER_CONNECTION();
         if (m_pForwarderConnection == NULL)
@@ -712,6 +908,75 @@ SERVER_PROCESS::PostStartCheck(
         }
     }
 
+    //
+    // With h2c, requests are multiplexed over a few connections. A backend
+    // that does not take h2c is sent HTTP/1.1 as if h2c had not been
+    // configured.
+    //
+    if (m_pH2Channel == NULL && m_backendProtocol == BACKEND_PROTOCOL_H2C)
+    {
+        m_pH2Channel = new H2_CHANNEL();
+        if (m_pH2Channel == NULL)
+        {
+            hr = E_OUTOFMEMORY;
+            goto Finished;
+        }
+
+        hr = m_pH2Channel->Initialize(
+            m_backendTransport == BACKEND_TRANSPORT_UNIX_SOCKET ? LOCAL_TRANSPORT_UNIX_SOCKET : LOCAL_TRANSPORT_TCP,
+            QueryUnixSocketPath(),
+            static_cast<USHORT>(m_dwPort),
+            m_dwRequestTimeoutInMS,
+            PROTOCOL_CONFIG::DEFAULT_MAX_RESPONSE_HEADER_SIZE,
+            m_dwH2cConnections);
+        if (FAILED_LOG(hr))
+        {
+            goto Finished;
+        }
+
+        if (m_pH2Channel->Probe() == HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED))
+        {
+            DebugPrintf(ASPNETCORE_DEBUG_FLAG_INFO,
+                "SERVER_PROCESS::PostStartCheck, backend on port %d does not take h2c, sending HTTP/1.1",
+                m_dwPort);
+            m_pH2Channel->Shutdown();
+            m_pH2Channel->DereferenceChannel();
+            m_pH2Channel = NULL;
+        }
+    }
+
+    //
+    // Requests to a unix socket always go through the pool, over TCP only
+    // when pooling is configured. Requests that find every h2c connection
+    // at its stream limit go through it as well. WebSockets stay on
+    // WinHTTP.
+    //
+    if (m_pConnectionPool == NULL &&
+        (m_backendTransport == BACKEND_TRANSPORT_UNIX_SOCKET || m_dwMaxBackendConnections != 0 || m_pH2Channel != NULL))
+    {
+        m_pConnectionPool = new BACKEND_CONNECTION_POOL();
+        if (m_pConnectionPool == NULL)
+        {
+            hr = E_OUTOFMEMORY;
+            goto Finished;
+        }
+
+        hr = m_pConnectionPool->Initialize(
+            m_backendTransport == BACKEND_TRANSPORT_UNIX_SOCKET ? LOCAL_TRANSPORT_UNIX_SOCKET : LOCAL_TRANSPORT_TCP,
+            QueryUnixSocketPath(),
+            static_cast<USHORT>(m_dwPort),
+            m_dwRequestTimeoutInMS,
+            PROTOCOL_CONFIG::DEFAULT_MAX_RESPONSE_HEADER_SIZE,
+            m_dwMinIdleBackendConnections,
+            m_dwMaxBackendConnections,
+            m_dwBackendConnectionIdleTimeoutInMS,
+            g_pTimerWheel);
+        if (FAILED_LOG(hr))
+        {
+            goto Finished;
+        }
+    }
+
     if (!g_fNsiApiNotSupported)
     {
         m_hListeningProcessHandle = OpenProcess(SYNCHRONIZE | PROCESS_TERMINATE | PROCESS_DUP_HANDLE,
@@ -726,6 +991,7 @@ SERVER_PROCESS::PostStartCheck(
 
 Finished:
     m_fDebuggerAttached = fDebuggerAttached;
+    m_readinessEvent.Close();
 
     if (FAILED_LOG(hr))
     {
@@ -735,6 +1001,20 @@ Finished:
             m_pForwarderConnection = NULL;
         }
 
+        if (m_pConnectionPool != NULL)
+        {
+            m_pConnectionPool->Shutdown();
+            m_pConnectionPool->DereferenceConnectionPool();
+            m_pConnectionPool = NULL;
+        }
+
+        if (m_pH2Channel != NULL)
+        {
+            m_pH2Channel->Shutdown();
+            m_pH2Channel->DereferenceChannel();
+            m_pH2Channel = NULL;
+        }
+
         if (!strEventMsg.IsEmpty())
         {
             EventLog::Warn(
@@ -828,6 +1108,15 @@ SERVER_PROCESS::StartProcess(
             goto Failure;
         }
 
+        //
+        // let the backend signal when it listens, polling is the fallback
+        //
+        if (FAILED_LOG(hr = SetupReadyEvent(pHashTable)))
+        {
+            pStrStage = L"SetupReadyEvent";
+            goto Failure;
+        }
+
         //
         // setup environment variables for new process
         //
@@ -900,6 +1189,15 @@ SERVER_PROCESS::StartProcess(
         // Backend process starts successfully. Set retry counter to 0
         dwRetryCount = 0;
 
+        //
+        // Open the pooled connections now rather than on the first
+        // requests.
+        //
+        if (m_pConnectionPool != NULL)
+        {
+            m_pConnectionPool->StartWarmup();
+        }
+
         EventLog::Info(
             ASPNETCORE_EVENT_PROCESS_START_SUCCESS,
             ASPNETCORE_EVENT_PROCESS_START_SUCCESS_MSG,
@@ -911,7 +1209,7 @@ SERVER_PROCESS::StartProcess(
         goto Finished;
 
     Failure:
-        if (fCriticalError)
+        if (fCriticalError || IsStartCancelled())
         {
             // Critical error, no retry need to avoid wasting resource and polluting log
             dwRetryCount = 0;
@@ -961,13 +1259,19 @@ Finished:
             m_Timer.CancelTimer();
         }
 
-        EventLog::Error(
-            ASPNETCORE_EVENT_PROCESS_START_FAILURE,
-            ASPNETCORE_EVENT_PROCESS_START_FAILURE_MSG,
-            m_struAppFullPath.QueryStr(),
-            m_struPhysicalPath.QueryStr(),
-            m_struCommandLine.QueryStr(),
-            m_dwPort);
+        //
+        // a cancelled start is the application going away, not a failure.
+        //
+        if (!IsStartCancelled())
+        {
+            EventLog::Error(
+                ASPNETCORE_EVENT_PROCESS_START_FAILURE,
+                ASPNETCORE_EVENT_PROCESS_START_FAILURE_MSG,
+                m_struAppFullPath.QueryStr(),
+                m_struPhysicalPath.QueryStr(),
+                m_struCommandLine.QueryStr(),
+                m_dwPort);
+        }
     }
     return hr;
 }
@@ -1134,6 +1438,11 @@ SERVER_PROCESS::CheckIfServerIsUp(
     //
     *pdwProcessId = 0;
 
+    if (!m_straUnixSocketPath.IsEmpty())
+    {
+        return CheckIfSocketIsUp(pdwProcessId, pfReady);
+    }
+
     if (!g_fNsiApiNotSupported)
     {
         while (dwResult == ERROR_INSUFFICIENT_BUFFER)
@@ -1244,6 +1553,30 @@ Finished:
     return hr;
 }
 
+HRESULT
+SERVER_PROCESS::CheckIfSocketIsUp(
+    _Out_ DWORD     * pdwProcessId,
+    _Out_ BOOL      * pfReady
+)
+/*++
+
+Description:
+
+    The backend is up once its Unix domain socket accepts a connection.
+    There is no table of socket owners to look the listening process up
+    in, the process this object created is taken to be the listener.
+
+--*/
+{
+    LOCAL_SOCKET    socketCheck;
+
+    *pfReady = SUCCEEDED(socketCheck.Connect(LOCAL_TRANSPORT_UNIX_SOCKET,
+                                             m_straUnixSocketPath.QueryStr(),
+                                             0));
+    *pdwProcessId = *pfReady ? m_dwProcessId : 0;
+    return S_OK;
+}
+
 // send signal to the process to let it gracefully shutdown
 // if the process cannot shutdown within given time, terminate it
 VOID
@@ -1691,6 +2024,7 @@ Finished:
 
 SERVER_PROCESS::SERVER_PROCESS() :
     m_cRefs(1),
+    m_cOutstandingRequests(0),
     m_hProcessHandle(NULL),
     m_hProcessWaitHandle(NULL),
     m_dwProcessId(0),
@@ -1701,9 +2035,19 @@ SERVER_PROCESS::SERVER_PROCESS() :
     m_fStdoutLogEnabled(FALSE),
     m_hJobObject(NULL),
     m_pForwarderConnection(NULL),
+    m_pConnectionPool(NULL),
+    m_dwRequestTimeoutInMS(0),
+    m_dwMaxBackendConnections(0),
+    m_dwMinIdleBackendConnections(0),
+    m_dwBackendConnectionIdleTimeoutInMS(0),
+    m_pH2Channel(NULL),
+    m_backendProtocol(BACKEND_PROTOCOL_HTTP1),
+    m_dwH2cConnections(0),
+    m_backendTransport(BACKEND_TRANSPORT_TCP),
     m_dwListeningProcessId(0),
     m_hListeningProcessHandle(NULL),
     m_hShutdownHandle(NULL),
+    m_hStartCancelEvent(NULL),
     m_randomGenerator(std::random_device()())
 {
     //InterlockedIncrement(&g_dwActiveServerProcesses);
@@ -1719,6 +2063,8 @@ SERVER_PROCESS::SERVER_PROCESS() :
 VOID
 SERVER_PROCESS::CleanUp()
 {
+    m_readinessEvent.Close();
+
     if (m_hProcessWaitHandle != NULL)
     {
         UnregisterWait(m_hProcessWaitHandle);
@@ -1782,6 +2128,26 @@ SERVER_PROCESS::CleanUp()
         m_pForwarderConnection = NULL;
     }
 
+    if (m_pConnectionPool != NULL)
+    {
+        m_pConnectionPool->Dump();
+        m_pConnectionPool->Shutdown();
+        m_pConnectionPool->DereferenceConnectionPool();
+        m_pConnectionPool = NULL;
+    }
+
+    if (m_pH2Channel != NULL)
+    {
+        m_pH2Channel->Dump();
+        m_pH2Channel->Shutdown();
+        m_pH2Channel->DereferenceChannel();
+        m_pH2Channel = NULL;
+    }
+
+    if (!m_struUnixSocketPath.IsEmpty())
+    {
+        DeleteFileW(m_struUnixSocketPath.QueryStr());
+    }
 }
 
 SERVER_PROCESS::~SERVER_PROCESS()
@@ -1800,6 +2166,12 @@ SERVER_PROCESS::~SERVER_PROCESS()
         m_pProcessManager = NULL;
     }
 
+    if (m_hStartCancelEvent != NULL)
+    {
+        CloseHandle(m_hStartCancelEvent);
+        m_hStartCancelEvent = NULL;
+    }
+
     if (m_hStdoutHandle != NULL)
     {
         if (m_hStdoutHandle != INVALID_HANDLE_VALUE)
@@ -1925,6 +2297,15 @@ SERVER_PROCESS::SendShutdownHttpMessage( VOID )
     DWORD      dwStatusCode = 0;
     DWORD      dwSize = sizeof(dwStatusCode);
 
+    if (m_backendTransport == BACKEND_TRANSPORT_UNIX_SOCKET)
+    {
+        if (FAILED_LOG(hr = SendShutdownSocketMessage(&dwStatusCode)))
+        {
+            goto Finished;
+        }
+        goto Received;
+    }
+
     hSession = WinHttpOpen(L"",
         WINHTTP_ACCESS_TYPE_DEFAULT_PROXY,
         WINHTTP_NO_PROXY_NAME,
@@ -2019,6 +2400,7 @@ SERVER_PROCESS::SendShutdownHttpMessage( VOID )
         goto Finished;
     }
 
+Received:
     if (dwStatusCode != 202)
     {
         // not expected http status
@@ -2051,6 +2433,70 @@ Finished:
     return hr;
 }
 
+HRESULT
+SERVER_PROCESS::SendShutdownSocketMessage(
+    _Out_ DWORD *   pdwStatusCode
+)
+/*++
+
+Description:
+
+    Sends the shutdown request of SendShutdownHttpMessage to a backend that
+    listens on a Unix domain socket, WinHTTP only speaks TCP.
+
+--*/
+{
+    HRESULT                 hr = S_OK;
+    LOCAL_HTTP_CONNECTION   connection;
+    STACK_STRA(strRequest, 256);
+    PSTR                    pszHead;
+    DWORD                   cchHead;
+    USHORT                  uStatus;
+
+    *pdwStatusCode = 0;
+
+    if (FAILED_LOG(hr = strRequest.Copy("POST ")))
+    {
+        goto Finished;
+    }
+
+    if (m_struAppVirtualPath.QueryCCH() > 1)
+    {
+        // app path size is 1 means site root, i.e., "/"
+        if (FAILED_LOG(hr = strRequest.AppendW(m_struAppVirtualPath.QueryStr())))
+        {
+            goto Finished;
+        }
+    }
+
+    if (FAILED_LOG(hr = strRequest.Append("/iisintegration HTTP/1.1\r\n"
+                                          "Host: localhost\r\n"
+                                          "Content-Length: 0\r\n"
+                                          "MS-ASPNETCORE-EVENT: shutdown\r\n"
+                                          "MS-ASPNETCORE-TOKEN: ")) ||
+        FAILED_LOG(hr = strRequest.Append(m_straGuid)) ||
+        FAILED_LOG(hr = strRequest.Append("\r\n\r\n")))
+    {
+        goto Finished;
+    }
+
+    if (FAILED_LOG(hr = connection.Connect(LOCAL_TRANSPORT_UNIX_SOCKET,
+                                           m_straUnixSocketPath.QueryStr(),
+                                           0,
+                                           m_dwShutdownTimeLimitInMS,
+                                           LOCAL_HTTP_CONNECTION::BUFFER_SIZE)) ||
+        FAILED_LOG(hr = connection.Send(strRequest.QueryStr(), strRequest.QueryCCH())) ||
+        FAILED_LOG(hr = connection.ReceiveResponseHead(FALSE, &pszHead, &cchHead, &uStatus)))
+    {
+        goto Finished;
+    }
+
+    *pdwStatusCode = uStatus;
+
+Finished:
+    return hr;
+}
+
 //static
 VOID
 SERVER_PROCESS::SendShutDownSignal(
@@ -13,6 +13,7 @@
 #define ASPNETCORE_PORT_STR                         L"ASPNETCORE_PORT"
 #define ASPNETCORE_PORT_ENV_STR                     L"ASPNETCORE_PORT="
 #define ASPNETCORE_APP_PATH_ENV_STR                 L"ASPNETCORE_APPL_PATH="
+#define ASPNETCORE_UNIX_SOCKET_ENV_STR              L"ASPNETCORE_UNIX_SOCKET="
 #define ASPNETCORE_APP_TOKEN_ENV_STR                L"ASPNETCORE_TOKEN="
 #define ASPNETCORE_APP_PATH_ENV_STR                 L"ASPNETCORE_APPL_PATH="
 
@@ -36,6 +37,13 @@ public:
         _In_ ENVIRONMENT_VAR_HASH* pEnvironmentVariables,
         _In_ BOOL                  fStdoutLogEnabled,
         _In_ BOOL                  fWebSocketSupported,
+        _In_ BACKEND_TRANSPORT     backendTransport,
+        _In_ DWORD                 dwRequestTimeoutInMS,
+        _In_ DWORD                 dwMaxBackendConnections,
+        _In_ DWORD                 dwMinIdleBackendConnections,
+        _In_ DWORD                 dwBackendConnectionIdleTimeoutInMS,
+        _In_ BACKEND_PROTOCOL      backendProtocol,
+        _In_ DWORD                 dwH2cConnections,
         _In_ STRU                 *pstruStdoutLogFile,
         _In_ STRU                 *pszAppPhysicalPath,
         _In_ STRU                 *pszAppPath,
@@ -45,6 +53,21 @@ public:
     HRESULT
     StartProcess( VOID );
 
+    //
+    // Makes a StartProcess under way on another thread give up: the
+    // process it started is terminated and no further attempt is made.
+    //
+    VOID
+    CancelStart(
+        VOID
+    )
+    {
+        if (m_hStartCancelEvent != NULL)
+        {
+            SetEvent(m_hStartCancelEvent);
+        }
+    }
+
     HRESULT
     SetWindowsAuthToken(
         _In_ HANDLE hToken,
@@ -78,6 +101,34 @@ public:
         return m_dwPort;
     }
 
+    //
+    // Requests forwarded to this process that have not completed yet,
+    // maintained by FORWARDING_HANDLER for load balancing.
+    //
+    VOID
+    IncrementOutstandingRequests(
+        VOID
+    )
+    {
+        InterlockedIncrement(&m_cOutstandingRequests);
+    }
+
+    VOID
+    DecrementOutstandingRequests(
+        VOID
+    )
+    {
+        InterlockedDecrement(&m_cOutstandingRequests);
+    }
+
+    LONG
+    QueryOutstandingRequests(
+        VOID
+    )
+    {
+        return m_cOutstandingRequests;
+    }
+
     VOID
     ReferenceServerProcess(
         VOID
@@ -128,6 +179,40 @@ public:
         return m_straGuid.QueryStr();
     };
 
+    //
+    // The connections requests are forwarded on in place of WinHTTP, NULL
+    // when the backend is reached over TCP without pooling.
+    //
+    BACKEND_CONNECTION_POOL*
+    QueryConnectionPool(
+        VOID
+    )
+    {
+        return m_pConnectionPool;
+    }
+
+    //
+    // The h2c connections requests are multiplexed over, NULL unless h2c
+    // is configured and the backend took it.
+    //
+    H2_CHANNEL*
+    QueryH2Channel(
+        VOID
+    )
+    {
+        return m_pH2Channel;
+    }
+
+    //
+    // The Unix domain socket the backend listens on, NULL when it listens
+    // on m_dwPort.
+    //
+    LPCSTR
+    QueryUnixSocketPath()
+    {
+        return m_straUnixSocketPath.IsEmpty() ? NULL : m_straUnixSocketPath.QueryStr();
+    }
+
     VOID
     SendSignal( 
         VOID
@@ -181,6 +266,17 @@ private:
         BOOL                    *pfCriticalError
     );
 
+    HRESULT
+    SetupListenSocket(
+        ENVIRONMENT_VAR_HASH    *pEnvironmentVarTable
+    );
+
+    HRESULT
+    CheckIfSocketIsUp(
+        _Out_ DWORD     * pdwProcessId,
+        _Out_ BOOL      * pfReady
+    );
+
     HRESULT
     SetupAppPath(
         ENVIRONMENT_VAR_HASH*   pEnvironmentVarTable
@@ -191,6 +287,11 @@ private:
         ENVIRONMENT_VAR_HASH*   pEnvironmentVarTable
     );
 
+    HRESULT
+    SetupReadyEvent(
+        ENVIRONMENT_VAR_HASH*   pEnvironmentVarTable
+    );
+
     HRESULT
     OutputEnvironmentVariables(
         MULTISZ*                pmszOutput,
@@ -207,6 +308,15 @@ private:
         VOID
     );
 
+    BOOL
+    IsStartCancelled(
+        VOID
+    )
+    {
+        return m_hStartCancelEvent != NULL &&
+               WaitForSingleObject(m_hStartCancelEvent, 0) == WAIT_OBJECT_0;
+    }
+
     HRESULT
     GetRandomPort(
         DWORD*    pdwPickedPort,
@@ -229,12 +339,25 @@ private:
         VOID
     );
 
+    HRESULT
+    SendShutdownSocketMessage(
+        _Out_ DWORD *   pdwStatusCode
+    );
+
     VOID
     TerminateBackendProcess(
         VOID
     );
 
     FORWARDER_CONNECTION   *m_pForwarderConnection;
+    BACKEND_CONNECTION_POOL *m_pConnectionPool;
+    DWORD                   m_dwRequestTimeoutInMS;
+    DWORD                   m_dwMaxBackendConnections;
+    DWORD                   m_dwMinIdleBackendConnections;
+    DWORD                   m_dwBackendConnectionIdleTimeoutInMS;
+    H2_CHANNEL             *m_pH2Channel;
+    BACKEND_PROTOCOL        m_backendProtocol;
+    DWORD                   m_dwH2cConnections;
     BOOL                    m_fStdoutLogEnabled;
     BOOL                    m_fWebSocketSupported;
     BOOL                    m_fWindowsAuthEnabled;
@@ -254,10 +377,18 @@ private:
     STRU                    m_struPhysicalPath;    // e.g., c:/test/mysite
     STRU                    m_struPort;
     STRU                    m_struCommandLine;
+    //
+    // Set when the backend listens on a Unix domain socket rather than on
+    // m_dwPort, the socket file is removed in CleanUp.
+    //
+    BACKEND_TRANSPORT       m_backendTransport;
+    STRU                    m_struUnixSocketPath;
+    STRA                    m_straUnixSocketPath;
 
     volatile LONG           m_lStopping;
     volatile BOOL           m_fReady;
     mutable LONG            m_cRefs;
+    volatile LONG           m_cOutstandingRequests;
 
     std::mt19937            m_randomGenerator;
 
@@ -281,6 +412,14 @@ private:
     HANDLE                  m_hProcessWaitHandle;
     HANDLE                  m_hShutdownHandle;
     //
+    // signalled by the backend once it listens, only alive while starting.
+    //
+    READINESS_EVENT         m_readinessEvent;
+    //
+    // set by CancelStart, manual reset.
+    //
+    HANDLE                  m_hStartCancelEvent;
+    //
     // m_hChildProcessHandle is the handle to process created by 
     // m_hProcessHandle process if it does.
     //
@@ -47,10 +47,12 @@
 
 // IIS Lib
 #include "acache.h"
+#include "sizecache.h"
 #include "multisz.h"
 #include "multisza.h"
 #include "base64.h"
 #include "listentry.h"
+#include "shardedlist.h"
 #include "debugutil.h"
 
 // Common lib
@@ -63,12 +65,30 @@
 #include "requesthandler_config.h"
 
 #include "sttimer.h"
+#include "timerwheel.h"
+#include "websocketbuffer.h"
+#include "websocketpipeline.h"
 #include "websockethandler.h"
 #include "responseheaderhash.h"
+#include "responseheadertokenizer.h"
+#include "requestheaderbuilder.h"
+#include "requestbodybatch.h"
+#include "responsecache.h"
+#include "requestcoalescer.h"
+#include "admissionlimiter.h"
 #include "protocolconfig.h"
+#include "localhttpconnection.h"
+#include "localsocketpoller.h"
+#include "backendconnectionpool.h"
+#include "hpack.h"
+#include "h2connection.h"
+#include "h2channel.h"
 #include "forwarderconnection.h"
+#include "readinessevent.h"
 #include "serverprocess.h"
+#include "loadbalancer.h"
 #include "processmanager.h"
+#include "phaselatency.h"
 #include "forwardinghandler.h"
 #include "outprocessapplication.h"
 #include "winhttphelper.h"
@@ -119,3 +139,4 @@ extern SRWLOCK    g_srwLockRH;
 extern HINTERNET  g_hWinhttpSession;
 extern DWORD      g_dwTlsIndex;
 extern HANDLE     g_hEventLog;
+extern TIMER_WHEEL * g_pTimerWheel;
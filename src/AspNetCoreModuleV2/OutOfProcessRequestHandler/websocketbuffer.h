@@ -0,0 +1,424 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#pragma once
+
+//
+// What the buffer pool has handed out, per size class, for tests and
+// diagnostics.
+//
+struct WEBSOCKET_BUFFER_COUNTERS
+{
+    ALLOC_CACHE_COUNTERS    rgClasses[5];
+};
+
+//
+// WEBSOCKET_BUFFER_POOL holds the relay buffers of every websocket
+// connection, one per-CPU ALLOC_CACHE_HANDLER per size class from 1KB to
+// 256KB in steps of four. A read cannot be issued without a buffer, so an
+// idle connection holds the smallest class for each direction; the larger
+// classes are only used for large messages and are cached shallowly.
+//
+class WEBSOCKET_BUFFER_POOL
+{
+public:
+
+    static const DWORD      SIZE_CLASSES = 5;
+    static const DWORD      MIN_BUFFER_SIZE = 1024;
+    static const DWORD      MAX_BUFFER_SIZE = MIN_BUFFER_SIZE << (2 * (SIZE_CLASSES - 1));
+
+    WEBSOCKET_BUFFER_POOL()
+    {
+        ZeroMemory(m_rgpClasses, sizeof(m_rgpClasses));
+    }
+
+    ~WEBSOCKET_BUFFER_POOL()
+    {
+        for (DWORD i = 0; i < SIZE_CLASSES; i++)
+        {
+            delete m_rgpClasses[i];
+            m_rgpClasses[i] = NULL;
+        }
+    }
+
+    HRESULT
+    Initialize()
+    {
+        static const LONG rgnThreshold[SIZE_CLASSES] = { 128, 64, 16, 4, 1 };
+        HRESULT hr = S_OK;
+
+        for (DWORD i = 0; i < SIZE_CLASSES; i++)
+        {
+            m_rgpClasses[i] = new ALLOC_CACHE_HANDLER;
+            if (m_rgpClasses[i] == NULL)
+            {
+                return E_OUTOFMEMORY;
+            }
+
+            hr = m_rgpClasses[i]->Initialize(QueryClassSize(i), rgnThreshold[i]);
+            if (FAILED(hr))
+            {
+                return hr;
+            }
+        }
+
+        return S_OK;
+    }
+
+    static
+    DWORD
+    QueryClassSize(
+        DWORD       iClass
+    )
+    {
+        return MIN_BUFFER_SIZE << (2 * iClass);
+    }
+
+    //
+    // The smallest class that holds cbSize bytes, the largest class for
+    // anything above it.
+    //
+    static
+    DWORD
+    QueryClass(
+        DWORD       cbSize
+    )
+    {
+        DWORD iClass = 0;
+
+        while (iClass < SIZE_CLASSES - 1 && QueryClassSize(iClass) < cbSize)
+        {
+            iClass++;
+        }
+        return iClass;
+    }
+
+    BYTE *
+    Alloc(
+        DWORD       iClass
+    )
+    {
+        return static_cast<BYTE *>(m_rgpClasses[iClass]->Alloc());
+    }
+
+    VOID
+    Free(
+        _In_ BYTE * pbBuffer,
+        DWORD       iClass
+    )
+    {
+        m_rgpClasses[iClass]->Free(pbBuffer);
+    }
+
+    VOID
+    QueryCounters(
+        _Out_ WEBSOCKET_BUFFER_COUNTERS *   pCounters
+    )
+    {
+        static_assert(_countof(pCounters->rgClasses) == SIZE_CLASSES, "one counter per class");
+
+        for (DWORD i = 0; i < SIZE_CLASSES; i++)
+        {
+            m_rgpClasses[i]->QueryCounters(&pCounters->rgClasses[i]);
+        }
+    }
+
+private:
+
+    WEBSOCKET_BUFFER_POOL(const WEBSOCKET_BUFFER_POOL &);
+    void operator=(const WEBSOCKET_BUFFER_POOL &);
+
+    ALLOC_CACHE_HANDLER *   m_rgpClasses[SIZE_CLASSES];
+};
+
+//
+// WEBSOCKET_RELAY_BUFFER is what one direction of a websocket connection
+// reads into and sends from. The buffer is borrowed from the pool when a
+// read starts and goes back once the data has been sent, so a connection
+// holds no memory of its own between the two.
+//
+// Fragments of one message are coalesced: a read that does not end the
+// message and leaves room in the buffer is followed by a read into the
+// rest of it, and the other side gets one send for all of them. A message
+// that fills the buffer makes the next one four times larger, up to the
+// configured maximum, and a run of small messages brings it back down.
+//
+//   [ data read so far .. | next read ...... ]
+//   ^ QueryData()         ^ BeginRead()
+//
+// A hibernating buffer waits for the next message with a read into a few
+// bytes of its own instead of a pooled buffer, so an idle connection holds
+// no memory from the pool. The read completes with the start of the
+// message; the rest of it is read into a pooled buffer the probe bytes are
+// copied to, and a message that fits the probe is sent from it.
+//
+class WEBSOCKET_RELAY_BUFFER
+{
+public:
+
+    //
+    // How many small messages in a row take the buffer down a class.
+    //
+    static const DWORD      SHRINK_AFTER = 8;
+
+    //
+    // What a hibernating buffer reads the start of a message into.
+    //
+    static const DWORD      PROBE_SIZE = 16;
+
+    WEBSOCKET_RELAY_BUFFER() :
+        m_pPool(NULL),
+        m_pbBuffer(NULL),
+        m_iClass(0),
+        m_iMaxClass(0),
+        m_cbData(0),
+        m_cSmall(0),
+        m_fUtf8(FALSE),
+        m_fFinal(FALSE),
+        m_fContinued(FALSE),
+        m_fClosePending(FALSE),
+        m_fHibernating(FALSE),
+        m_fProbing(FALSE)
+    {
+    }
+
+    ~WEBSOCKET_RELAY_BUFFER()
+    {
+        Release();
+    }
+
+    VOID
+    Initialize(
+        _In_ WEBSOCKET_BUFFER_POOL *    pPool,
+        DWORD                           cbMaxBuffer
+    )
+    {
+        m_pPool = pPool;
+        m_iClass = 0;
+        m_iMaxClass = WEBSOCKET_BUFFER_POOL::QueryClass(cbMaxBuffer);
+        if (m_iMaxClass > 0 && WEBSOCKET_BUFFER_POOL::QueryClassSize(m_iMaxClass) > cbMaxBuffer)
+        {
+            m_iMaxClass--;
+        }
+    }
+
+    //
+    // Where the next read goes and how much room it has, borrowing a
+    // buffer of the current size when none is held. A hibernating buffer
+    // waits for a new message in the probe.
+    //
+    HRESULT
+    BeginRead(
+        _Out_ BYTE **   ppbRead,
+        _Out_ DWORD *   pcbRead
+    )
+    {
+        if (m_pbBuffer == NULL)
+        {
+            if (m_fHibernating && m_cbData == 0)
+            {
+                m_fProbing = TRUE;
+                *ppbRead = m_rgbProbe;
+                *pcbRead = PROBE_SIZE;
+                return S_OK;
+            }
+
+            m_pbBuffer = m_pPool->Alloc(m_iClass);
+            if (m_pbBuffer == NULL)
+            {
+                return E_OUTOFMEMORY;
+            }
+
+            if (m_fProbing)
+            {
+                memcpy(m_pbBuffer, m_rgbProbe, m_cbData);
+                m_fProbing = FALSE;
+            }
+        }
+
+        *ppbRead = m_pbBuffer + m_cbData;
+        *pcbRead = QueryBufferSize() - m_cbData;
+        return S_OK;
+    }
+
+    //
+    // A read of cbRead bytes completed. TRUE when the data is to be sent,
+    // FALSE when the message goes on and there is room to read more of it.
+    //
+    BOOL
+    CompleteRead(
+        DWORD       cbRead,
+        BOOL        fUtf8,
+        BOOL        fFinal
+    )
+    {
+        m_cbData += cbRead;
+        m_fUtf8 = fUtf8;
+        m_fFinal = fFinal;
+        return fFinal || (!m_fProbing && m_cbData == QueryBufferSize());
+    }
+
+    BYTE *
+    QueryData()
+    {
+        return m_fProbing ? m_rgbProbe : m_pbBuffer;
+    }
+
+    DWORD
+    QueryDataSize() const
+    {
+        return m_cbData;
+    }
+
+    BOOL
+    IsEmpty() const
+    {
+        return m_cbData == 0;
+    }
+
+    BOOL
+    IsUtf8() const
+    {
+        return m_fUtf8;
+    }
+
+    //
+    // Whether the data ends its message. Data held when a close arrives
+    // does not, it goes out as a fragment ahead of the close.
+    //
+    BOOL
+    IsFinal() const
+    {
+        return m_fFinal;
+    }
+
+    //
+    // A close was read while data was held, it is sent once the data is.
+    // CompleteSend clears it.
+    //
+    VOID
+    SetClosePending()
+    {
+        m_fClosePending = TRUE;
+    }
+
+    BOOL
+    IsClosePending() const
+    {
+        return m_fClosePending;
+    }
+
+    //
+    // Whether the reads waiting for a new message go into the probe. Takes
+    // effect from the next message on.
+    //
+    VOID
+    SetHibernating(
+        BOOL        fHibernating
+    )
+    {
+        m_fHibernating = fHibernating;
+    }
+
+    BOOL
+    IsHibernating() const
+    {
+        return m_fHibernating;
+    }
+
+    //
+    // Whether the last read went into the probe and the data is in it.
+    //
+    BOOL
+    IsProbing() const
+    {
+        return m_fProbing;
+    }
+
+    //
+    // The data has been sent. The buffer goes back to the pool and the
+    // size of the next one follows the message: larger when it did not
+    // fit, smaller after a run of messages that used a quarter of it.
+    //
+    VOID
+    CompleteSend()
+    {
+        BOOL fFull = !m_fFinal && m_cbData == QueryBufferSize();
+        BOOL fSmall = m_fFinal && !m_fContinued && m_cbData <= QueryBufferSize() / 4;
+
+        Release();
+        m_fContinued = !m_fFinal;
+        m_fClosePending = FALSE;
+
+        if (fFull)
+        {
+            if (m_iClass < m_iMaxClass)
+            {
+                m_iClass++;
+            }
+            m_cSmall = 0;
+        }
+        else if (fSmall)
+        {
+            if (m_iClass > 0 && ++m_cSmall >= SHRINK_AFTER)
+            {
+                m_iClass--;
+                m_cSmall = 0;
+            }
+        }
+        else
+        {
+            m_cSmall = 0;
+        }
+    }
+
+    //
+    // Returns the buffer to the pool, dropping any data still in it.
+    //
+    VOID
+    Release()
+    {
+        if (m_pbBuffer != NULL)
+        {
+            m_pPool->Free(m_pbBuffer, m_iClass);
+            m_pbBuffer = NULL;
+        }
+        m_cbData = 0;
+        m_fProbing = FALSE;
+    }
+
+    DWORD
+    QueryBufferSize() const
+    {
+        return WEBSOCKET_BUFFER_POOL::QueryClassSize(m_iClass);
+    }
+
+    //
+    // What is borrowed from the pool right now, 0 between messages and
+    // while waiting in the probe.
+    //
+    DWORD
+    QueryHeldSize() const
+    {
+        return m_pbBuffer == NULL ? 0 : QueryBufferSize();
+    }
+
+private:
+
+    WEBSOCKET_RELAY_BUFFER(const WEBSOCKET_RELAY_BUFFER &);
+    void operator=(const WEBSOCKET_RELAY_BUFFER &);
+
+    WEBSOCKET_BUFFER_POOL * m_pPool;
+    BYTE *                  m_pbBuffer;
+    DWORD                   m_iClass;
+    DWORD                   m_iMaxClass;
+    DWORD                   m_cbData;
+    DWORD                   m_cSmall;
+    BOOL                    m_fUtf8;
+    BOOL                    m_fFinal;
+    BOOL                    m_fContinued;
+    BOOL                    m_fClosePending;
+    BOOL                    m_fHibernating;
+    BOOL                    m_fProbing;
+    BYTE                    m_rgbProbe[PROBE_SIZE];
+};
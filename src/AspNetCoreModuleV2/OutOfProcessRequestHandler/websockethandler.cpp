@@ -25,31 +25,55 @@ indicates the API completion from HTTP, and not necessarily over the network.
 
 This prevents the need for data buffering at the Asp.Net Core Module level.
 
+The read buffers are borrowed from a shared pool when a read is issued and
+returned when its data has been sent, see WEBSOCKET_RELAY_BUFFER. A read
+that ends in the middle of a message with room left in the buffer is followed
+by another read into the rest of it, so the fragments of a message go out in
+as few sends as the buffer allows. A close read while a partial message is held
+is sent after that data.
+
+-----------------
+Pipelines
+-----------------
+Each direction is a read loop of its own, client to backend and backend to
+client, see WEBSOCKET_PIPELINE. Only one operation of a direction is ever
+outstanding, so a direction needs no lock and the two run at the same time.
+What they share is the shutdown: a completion enters the connection's
+WEBSOCKET_SHUTDOWN before issuing the next operation and leaves after, and
+Cleanup cancels the endpoints once no completion is inside, so nothing is
+issued after the cancel.
+
+-----------------
+Hibernation
+-----------------
+With webSocketHibernation set, a direction reads the start of every new
+message into a few bytes of the pipeline instead of a pooled buffer. An
+idle connection then holds no relay buffer at all, even right after a busy
+spell; the rest of a longer message goes through the pool, and the buffer
+goes back to it once the message is sent.
+
 --*/
 
 #include "websockethandler.h"
 #include "exceptions.h"
 
-SRWLOCK WEBSOCKET_HANDLER::sm_RequestsListLock;
-
-LIST_ENTRY WEBSOCKET_HANDLER::sm_RequestsListHead;
+SHARDED_LIST * WEBSOCKET_HANDLER::sm_pRequestsList;
 
 TRACE_LOG * WEBSOCKET_HANDLER::sm_pTraceLog;
 
+WEBSOCKET_BUFFER_POOL * WEBSOCKET_HANDLER::sm_pBufferPool;
+
 WEBSOCKET_HANDLER::WEBSOCKET_HANDLER() :
     _pHttpContext(NULL),
     _pWebSocketContext(NULL),
     _hWebSocketRequest(NULL),
     _pHandler(NULL),
     _dwOutstandingIo(0),
-    _fCleanupInProgress(FALSE),
     _fIndicateCompletionToIis(FALSE),
-    _fHandleClosed(FALSE),
-    _fReceivedCloseMsg(FALSE)
+    _fHandleClosed(FALSE)
 {
     DebugPrintf (ASPNETCORE_DEBUG_FLAG_INFO, "WEBSOCKET_HANDLER::WEBSOCKET_HANDLER");
 
-    InitializeCriticalSectionAndSpinCount(&_RequestLock, 1000);
     InsertRequest();
 }
 
@@ -62,7 +86,12 @@ WEBSOCKET_HANDLER::Terminate(
     if (!_fHandleClosed)
     {
     RemoveRequest();
-    _fCleanupInProgress = TRUE;
+
+    //
+    // No pipeline issues anything after this, the endpoints are
+    // cancelled and closed right here.
+    //
+    _Shutdown.Shutdown(ServerStateUnavailable);
 
     if (_pHttpContext != NULL)
     {
@@ -76,7 +105,6 @@ WEBSOCKET_HANDLER::Terminate(
     }
 
     _pWebSocketContext = NULL;
-    DeleteCriticalSection(&_RequestLock);
 
     delete this;
     }
@@ -91,27 +119,55 @@ WEBSOCKET_HANDLER::StaticInitialize(
 
     Routine Description:
 
-    Initialize structures required for idle connection cleanup.
+    Initialize structures required for idle connection cleanup,
+    and the pool of relay buffers.
 
 --*/
 {
+    HRESULT hr = S_OK;
+
     if (!g_fWebSocketStaticInitialize)
     {
         return S_OK;
     }
 
+    sm_pBufferPool = new WEBSOCKET_BUFFER_POOL;
+    if (sm_pBufferPool == NULL)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    hr = sm_pBufferPool->Initialize();
+    if (FAILED_LOG(hr))
+    {
+        delete sm_pBufferPool;
+        sm_pBufferPool = NULL;
+        return hr;
+    }
+
     if (fEnableReferenceCountTracing)
     {
         //
         // If tracing is enabled, keep track of all websocket requests
         // for debugging purposes.
         //
-        InitializeListHead (&sm_RequestsListHead);
+        sm_pRequestsList = new SHARDED_LIST;
+        if (sm_pRequestsList == NULL)
+        {
+            return E_OUTOFMEMORY;
+        }
+
+        hr = sm_pRequestsList->Initialize();
+        if (FAILED_LOG(hr))
+        {
+            delete sm_pRequestsList;
+            sm_pRequestsList = NULL;
+            return hr;
+        }
+
         sm_pTraceLog = CreateRefTraceLog( 10000, 0 );
     }
 
-    InitializeSRWLock(&sm_RequestsListLock);
-
     return S_OK;
 }
 
@@ -126,11 +182,57 @@ WEBSOCKET_HANDLER::StaticTerminate(
         return;
     }
 
+    if (sm_pRequestsList != NULL)
+    {
+        LONGLONG cActive = 0;
+
+        sm_pRequestsList->ForEach(
+            [&cActive] (SHARDED_LIST_ENTRY * pEntry)
+            {
+                DebugPrintf(ASPNETCORE_DEBUG_FLAG_INFO,
+                    "WEBSOCKET_HANDLER::StaticTerminate %p still active",
+                    CONTAINING_RECORD(pEntry, WEBSOCKET_HANDLER, _listEntry));
+                cActive++;
+            });
+
+        //
+        // Requests still active remove themselves from the list when
+        // they terminate, it stays for them.
+        //
+        if (cActive == 0)
+        {
+            delete sm_pRequestsList;
+            sm_pRequestsList = NULL;
+        }
+    }
+
     if (sm_pTraceLog)
     {
         DestroyRefTraceLog(sm_pTraceLog);
         sm_pTraceLog = NULL;
     }
+
+    if (sm_pBufferPool != NULL)
+    {
+        delete sm_pBufferPool;
+        sm_pBufferPool = NULL;
+    }
+}
+
+//static
+VOID
+WEBSOCKET_HANDLER::QueryBufferCounters(
+    _Out_ WEBSOCKET_BUFFER_COUNTERS * pCounters
+    )
+{
+    if (sm_pBufferPool != NULL)
+    {
+        sm_pBufferPool->QueryCounters(pCounters);
+    }
+    else
+    {
+        ZeroMemory(pCounters, sizeof(*pCounters));
+    }
 }
 
 VOID
@@ -138,11 +240,9 @@ WEBSOCKET_HANDLER::InsertRequest(
     VOID
     )
 {
-    if (g_fEnableReferenceCountTracing)
+    if (sm_pRequestsList != NULL)
     {
-        AcquireSRWLockExclusive(&sm_RequestsListLock);
-        InsertTailList(&sm_RequestsListHead, &_listEntry);
-        ReleaseSRWLockExclusive( &sm_RequestsListLock);
+        sm_pRequestsList->Insert(&_listEntry);
     }
 }
 
@@ -152,11 +252,9 @@ WEBSOCKET_HANDLER::RemoveRequest(
     VOID
     )
 {
-    if (g_fEnableReferenceCountTracing)
+    if (sm_pRequestsList != NULL)
     {
-        AcquireSRWLockExclusive(&sm_RequestsListLock);
-        RemoveEntryList(&_listEntry);
-        ReleaseSRWLockExclusive( &sm_RequestsListLock);
+        sm_pRequestsList->Remove(&_listEntry);
     }
 }
 
@@ -238,6 +336,8 @@ WEBSOCKET_HANDLER::ProcessRequest(
     FORWARDING_HANDLER *pHandler,
     IHttpContext *pHttpContext,
     HINTERNET     hRequest,
+    DWORD         cbMaxBuffer,
+    BOOL          fHibernate,
     BOOL*         pfHandleCreated
 )
 /*++
@@ -250,21 +350,36 @@ Routine Description:
     the client.
     This routine get's a websocket handle to winhttp,
     websocket handle to IIS's websocket context, and initiates IO
-    in these two endpoints.
+    in these two endpoints. Relay buffers grow up to cbMaxBuffer,
+    directions hibernate between messages when fHibernate is set.
 
 
 --*/
 {
     HRESULT hr = S_OK;
+    BOOL    fEntered = FALSE;
     //DWORD dwBuffSize = RECEIVE_BUFFER_SIZE;
 
     *pfHandleCreated = FALSE;
     _pHandler = pHandler;
 
-    EnterCriticalSection(&_RequestLock);
+    _ClientPipeline.Initialize(sm_pBufferPool, cbMaxBuffer, fHibernate);
+    _ServerPipeline.Initialize(sm_pBufferPool, cbMaxBuffer, fHibernate);
+
     DebugPrintf(ASPNETCORE_DEBUG_FLAG_INFO,
         "WEBSOCKET_HANDLER::ProcessRequest");
 
+    //
+    // Completions of the first reads may come in before both are
+    // issued; a shutdown they start waits for this to leave.
+    //
+    fEntered = EnterPipeline();
+    if (!fEntered)
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED);
+        goto Finished;
+    }
+
     //
     // Cache the points to IHttpContext3
     //
@@ -355,7 +470,10 @@ Routine Description:
     }
 
 Finished:
-    LeaveCriticalSection(&_RequestLock);
+    if (fEntered)
+    {
+        LeavePipeline();
+    }
 
     if (FAILED_LOG(hr))
     {
@@ -374,13 +492,15 @@ WEBSOCKET_HANDLER::DoIisWebSocketReceive(
 
 Routine Description:
 
-    Initiates a websocket receive on the IIS Websocket Context.
+    Initiates a websocket receive on the IIS Websocket Context,
+    into what is left of the relay buffer.
 
 
 --*/
 {
     HRESULT hr = S_OK;
-    DWORD   dwBufferSize = RECEIVE_BUFFER_SIZE;
+    BYTE *  pbBuffer;
+    DWORD   dwBufferSize;
     BOOL    fUtf8Encoded;
     BOOL    fFinalFragment;
     BOOL    fClose;
@@ -388,10 +508,16 @@ Routine Description:
     DebugPrintf(ASPNETCORE_DEBUG_FLAG_INFO,
         "WEBSOCKET_HANDLER::DoIisWebSocketReceive");
 
+    hr = _ClientPipeline.BeginRead(&pbBuffer, &dwBufferSize);
+    if (FAILED_LOG(hr))
+    {
+        return hr;
+    }
+
     IncrementOutstandingIo();
 
     hr = _pWebSocketContext->ReadFragment(
-            &_IisReceiveBuffer,
+            pbBuffer,
             &dwBufferSize,
             TRUE,
             &fUtf8Encoded,
@@ -418,23 +544,32 @@ WEBSOCKET_HANDLER::DoWinHttpWebSocketReceive(
 
 Routine Description:
 
-    Initiates a websocket receive on WinHttp
+    Initiates a websocket receive on WinHttp, into what is left
+    of the relay buffer.
 
 
 --*/
 {
     HRESULT hr = S_OK;
     DWORD   dwError = NO_ERROR;
+    BYTE *  pbBuffer;
+    DWORD   dwBufferSize;
 
     DebugPrintf(ASPNETCORE_DEBUG_FLAG_INFO,
         "WEBSOCKET_HANDLER::DoWinHttpWebSocketReceive");
 
+    hr = _ServerPipeline.BeginRead(&pbBuffer, &dwBufferSize);
+    if (FAILED_LOG(hr))
+    {
+        return hr;
+    }
+
     IncrementOutstandingIo();
 
     dwError = WINHTTP_HELPER::sm_pfnWinHttpWebSocketReceive(
                 _hWebSocketRequest,
-                &_WinHttpReceiveBuffer,
-                RECEIVE_BUFFER_SIZE,
+                pbBuffer,
+                dwBufferSize,
                 NULL,
                 NULL);
 
@@ -451,18 +586,19 @@ Routine Description:
 
 HRESULT
 WEBSOCKET_HANDLER::DoIisWebSocketSend(
-    DWORD cbData,
     WINHTTP_WEB_SOCKET_BUFFER_TYPE  eBufferType
 )
 /*++
 
 Routine Description:
 
-    Initiates a websocket send on IIS
+    Initiates a websocket send on IIS of the data in the
+    relay buffer, or of the close from the backend.
 
 --*/
 {
     HRESULT hr = S_OK;
+    DWORD   cbData = _ServerPipeline.QueryBuffer()->QueryDataSize();
     BOOL    fUtf8Encoded = FALSE;
     BOOL    fFinalFragment = FALSE;
     BOOL    fClose = FALSE;
@@ -479,13 +615,14 @@ Routine Description:
         DWORD dwError = NO_ERROR;
         USHORT uStatus;
         DWORD  dwReceived = 0;
+        BYTE   rgbCloseReason[WINHTTP_WEB_SOCKET_MAX_CLOSE_REASON_LENGTH];
         STACK_STRU(strCloseReason, 128);
 
         dwError = WINHTTP_HELPER::sm_pfnWinHttpWebSocketQueryCloseStatus(
                     _hWebSocketRequest,
                     &uStatus,
-                    &_WinHttpReceiveBuffer,
-                    RECEIVE_BUFFER_SIZE,
+                    rgbCloseReason,
+                    sizeof(rgbCloseReason),
                     &dwReceived);
 
         if (dwError != NO_ERROR)
@@ -497,7 +634,7 @@ Routine Description:
         //
         // Convert close reason to WCHAR
         //
-        hr = strCloseReason.CopyA((PCSTR)&_WinHttpReceiveBuffer,
+        hr = strCloseReason.CopyA((PCSTR)rgbCloseReason,
             dwReceived);
         if (FAILED_LOG(hr))
         {
@@ -509,7 +646,7 @@ Routine Description:
         // Backend end may start close hand shake first
         // Need to indicate no more receive should be called on WinHttp connection
         //
-        _fReceivedCloseMsg = TRUE;
+        _ServerPipeline.Close();
         _fIndicateCompletionToIis = TRUE;
 
         //
@@ -535,12 +672,13 @@ Routine Description:
             &fClose);
 
         IncrementOutstandingIo();
+        _ServerPipeline.BeginSend();
 
         //
         // Do the Send.
         //
         hr = _pWebSocketContext->WriteFragment(
-                &_WinHttpReceiveBuffer,
+                _ServerPipeline.QueryBuffer()->QueryData(),
                 &cbData,
                 TRUE,
                 fUtf8Encoded,
@@ -567,17 +705,18 @@ Finished:
 
 HRESULT
 WEBSOCKET_HANDLER::DoWinHttpWebSocketSend(
-    DWORD cbData,
     WINHTTP_WEB_SOCKET_BUFFER_TYPE  eBufferType
 )
 /*++
 
 Routine Description:
 
-    Initiates a websocket send on WinHttp
+    Initiates a websocket send on WinHttp of the data in the
+    relay buffer, or of the close from the client.
 
 --*/
 {
+    DWORD       cbData = _ClientPipeline.QueryBuffer()->QueryDataSize();
     DWORD       dwError = NO_ERROR;
     HRESULT     hr = S_OK;
 
@@ -612,6 +751,11 @@ Routine Description:
 
         IncrementOutstandingIo();
 
+        //
+        // Nothing more is read from the client after its close.
+        //
+        _ClientPipeline.Close();
+
         //
         // Send Close.
         //
@@ -647,11 +791,12 @@ Routine Description:
     else
     {
         IncrementOutstandingIo();
+        _ClientPipeline.BeginSend();
 
         dwError = WINHTTP_HELPER::sm_pfnWinHttpWebSocketSend(
                         _hWebSocketRequest,
                         eBufferType,
-                        cbData == 0 ? NULL : &_IisReceiveBuffer,
+                        cbData == 0 ? NULL : _ClientPipeline.QueryBuffer()->QueryData(),
                         cbData
                         );
     }
@@ -752,40 +897,47 @@ Routine Description:
 ++*/
 {
     HRESULT                 hr = S_OK;
-    BOOL                    fLocked = FALSE;
+    BOOL                    fEntered = FALSE;
+    BOOL                    fClosePending;
     CleanupReason           cleanupReason = CleanupReasonUnknown;
 
     DebugPrintf(ASPNETCORE_DEBUG_FLAG_INFO,
         "WEBSOCKET_HANDLER::OnWinHttpSendComplete");
 
-    if (_fCleanupInProgress)
+    //
+    // Nothing more is issued once the connection is shutting down.
+    //
+    fEntered = EnterPipeline();
+    if (!fEntered)
     {
         goto Finished;
     }
 
-    EnterCriticalSection (&_RequestLock);
-
-    fLocked = TRUE;
-
-    if (_fCleanupInProgress)
-    {
-        goto Finished;
-    }
     //
-    // Data was successfully sent to backend.
-    // Initiate next receive from IIS.
+    // Data was successfully sent to backend, its buffer goes back
+    // to the pool. Send the close the client sent after it, or
+    // initiate next receive from IIS.
     //
+    fClosePending = _ClientPipeline.QueryBuffer()->IsClosePending();
+    _ClientPipeline.QueryBuffer()->CompleteSend();
 
-    hr = DoIisWebSocketReceive();
+    if (fClosePending)
+    {
+        hr = DoWinHttpWebSocketSend(WINHTTP_WEB_SOCKET_CLOSE_BUFFER_TYPE);
+    }
+    else
+    {
+        hr = DoIisWebSocketReceive();
+    }
     if (FAILED_LOG(hr))
     {
         goto Finished;
     }
 
 Finished:
-    if (fLocked)
+    if (fEntered)
     {
-        LeaveCriticalSection(&_RequestLock);
+        LeavePipeline();
     }
 
     if (FAILED_LOG(hr))
@@ -847,7 +999,8 @@ Routine Description:
     on the backend server winhttp endpoint.
 
     Issue send on the Client(IIS) if the receive was
-    successful.
+    successful and ended the message or filled the buffer,
+    otherwise read more of the message into the buffer.
 
     If the receive completed with zero bytes, that
     indicates that the server has disconnected the connection.
@@ -855,29 +1008,60 @@ Routine Description:
 --*/
 {
     HRESULT  hr = S_OK;
-    BOOL     fLocked = FALSE;
+    BOOL     fEntered = FALSE;
+    BOOL     fUtf8Encoded;
+    BOOL     fFinalFragment;
+    BOOL     fClose;
     CleanupReason cleanupReason = CleanupReasonUnknown;
+    WINHTTP_WEB_SOCKET_BUFFER_TYPE  BufferType;
 
     DebugPrintf(ASPNETCORE_DEBUG_FLAG_INFO,
         "WEBSOCKET_HANDLER::OnWinHttpReceiveComplete --%p", _pHandler);
 
-    if (_fCleanupInProgress)
+    //
+    // Nothing more is issued once the connection is shutting down.
+    //
+    fEntered = EnterPipeline();
+    if (!fEntered)
     {
         goto Finished;
     }
 
-    EnterCriticalSection(&_RequestLock);
+    BufferType = pCompletionStatus->eBufferType;
+
+    WINHTTP_HELPER::GetFlagsFromBufferType(BufferType,
+        &fUtf8Encoded,
+        &fFinalFragment,
+        &fClose);
 
-    fLocked = TRUE;
-    if (_fCleanupInProgress)
+    if (fClose && !_ServerPipeline.QueryBuffer()->IsEmpty())
     {
+        //
+        // Send the part of the message read so far, then the close.
+        //
+        _ServerPipeline.QueryBuffer()->SetClosePending();
+        WINHTTP_HELPER::GetBufferTypeFromFlags(_ServerPipeline.QueryBuffer()->IsUtf8(),
+            FALSE,
+            FALSE,
+            &BufferType);
+    }
+    else if (!fClose &&
+             !_ServerPipeline.CompleteRead(pCompletionStatus->dwBytesTransferred,
+                fUtf8Encoded,
+                fFinalFragment))
+    {
+        //
+        // The message goes on and there is room for more of it.
+        //
+        hr = DoWinHttpWebSocketReceive();
+        if (FAILED_LOG(hr))
+        {
+            cleanupReason = ServerDisconnect;
+        }
         goto Finished;
     }
-    hr = DoIisWebSocketSend(
-            pCompletionStatus->dwBytesTransferred,
-            pCompletionStatus->eBufferType
-            );
 
+    hr = DoIisWebSocketSend(BufferType);
     if (FAILED_LOG(hr))
     {
         cleanupReason = ClientDisconnect;
@@ -885,9 +1069,9 @@ Routine Description:
     }
 
 Finished:
-    if (fLocked)
+    if (fEntered)
     {
-        LeaveCriticalSection(&_RequestLock);
+        LeavePipeline();
     }
     if (FAILED_LOG(hr))
     {
@@ -924,7 +1108,8 @@ Routine Description:
 --*/
 {
     HRESULT         hr = S_OK;
-    BOOL            fLocked = FALSE;
+    BOOL            fEntered = FALSE;
+    BOOL            fClosePending;
     CleanupReason   cleanupReason = CleanupReasonUnknown;
 
     UNREFERENCED_PARAMETER(cbIo);
@@ -938,13 +1123,11 @@ Routine Description:
         goto Finished;
     }
 
-    if (_fCleanupInProgress)
-    {
-        goto Finished;
-    }
-    EnterCriticalSection(&_RequestLock);
-    fLocked = TRUE;
-    if (_fCleanupInProgress)
+    //
+    // Nothing more is issued once the connection is shutting down.
+    //
+    fEntered = EnterPipeline();
+    if (!fEntered)
     {
         goto Finished;
     }
@@ -952,23 +1135,41 @@ Routine Description:
     //
     // Only call read if no close hand shake was received from backend
     //
-    if (!_fReceivedCloseMsg)
+    if (!_ServerPipeline.IsClosed())
     {
-        //
-        // Write Completed, initiate next read from backend server.
-        //
-        hr = DoWinHttpWebSocketReceive();
-        if (FAILED_LOG(hr))
+        fClosePending = _ServerPipeline.QueryBuffer()->IsClosePending();
+        _ServerPipeline.QueryBuffer()->CompleteSend();
+
+        if (fClosePending)
         {
-            cleanupReason = ServerDisconnect;
-            goto Finished;
+            //
+            // The data ahead of the backend's close is out, send the close.
+            //
+            hr = DoIisWebSocketSend(WINHTTP_WEB_SOCKET_CLOSE_BUFFER_TYPE);
+            if (FAILED_LOG(hr))
+            {
+                cleanupReason = ClientDisconnect;
+                goto Finished;
+            }
+        }
+        else
+        {
+            //
+            // Write Completed, initiate next read from backend server.
+            //
+            hr = DoWinHttpWebSocketReceive();
+            if (FAILED_LOG(hr))
+            {
+                cleanupReason = ServerDisconnect;
+                goto Finished;
+            }
         }
     }
 
 Finished:
-    if (fLocked)
+    if (fEntered)
     {
-        LeaveCriticalSection(&_RequestLock);
+        LeavePipeline();
     }
     if (FAILED_LOG(hr))
     {
@@ -1002,15 +1203,16 @@ Routine Description:
     Completion routine executed when a receive completes
     from the client (IIS endpoint).
 
-    If the receive was successful, initiate a send on
-    the backend server (winhttp) endpoint.
+    If the receive was successful and ended the message or
+    filled the buffer, initiate a send on the backend server
+    (winhttp) endpoint, otherwise read more of the message.
 
     If the receive failed, initiate cleanup.
 
 --*/
 {
     HRESULT    hr = S_OK;
-    BOOL       fLocked = FALSE;
+    BOOL       fEntered = FALSE;
     CleanupReason cleanupReason = CleanupReasonUnknown;
     WINHTTP_WEB_SOCKET_BUFFER_TYPE  BufferType;
 
@@ -1024,32 +1226,57 @@ Routine Description:
         goto Finished;
     }
 
-    if (_fCleanupInProgress)
+    //
+    // Nothing more is issued once the connection is shutting down.
+    //
+    fEntered = EnterPipeline();
+    if (!fEntered)
     {
         goto Finished;
     }
 
-    EnterCriticalSection(&_RequestLock);
-
-    fLocked = TRUE;
-    if (_fCleanupInProgress)
+    if (fClose && !_ClientPipeline.QueryBuffer()->IsEmpty())
     {
-        goto Finished;
+        //
+        // Send the part of the message read so far, then the close.
+        //
+        _ClientPipeline.QueryBuffer()->SetClosePending();
+        WINHTTP_HELPER::GetBufferTypeFromFlags(_ClientPipeline.QueryBuffer()->IsUtf8(),
+            FALSE,
+            FALSE,
+            &BufferType);
     }
-    //
-    // Get Buffer Type from flags.
-    //
+    else
+    {
+        if (!fClose &&
+            !_ClientPipeline.CompleteRead(cbIO, fUTF8Encoded, fFinalFragment))
+        {
+            //
+            // The message goes on and there is room for more of it.
+            //
+            hr = DoIisWebSocketReceive();
+            if (FAILED_LOG(hr))
+            {
+                cleanupReason = ClientDisconnect;
+            }
+            goto Finished;
+        }
 
-    WINHTTP_HELPER::GetBufferTypeFromFlags(fUTF8Encoded,
-        fFinalFragment,
-        fClose,
-        &BufferType);
+        //
+        // Get Buffer Type from flags.
+        //
+
+        WINHTTP_HELPER::GetBufferTypeFromFlags(fUTF8Encoded,
+            fFinalFragment,
+            fClose,
+            &BufferType);
+    }
 
     //
     // Initiate Send.
     //
 
-    hr =  DoWinHttpWebSocketSend(cbIO, BufferType);
+    hr =  DoWinHttpWebSocketSend(BufferType);
     if (FAILED_LOG(hr))
     {
         cleanupReason = ServerDisconnect;
@@ -1057,9 +1284,9 @@ Routine Description:
     }
 
 Finished:
-    if (fLocked)
+    if (fEntered)
     {
-        LeaveCriticalSection(&_RequestLock);
+        LeavePipeline();
     }
     if (FAILED_LOG(hr))
     {
@@ -1089,38 +1316,71 @@ Routine Description:
 
     Cleanup function for the websocket handler.
 
-    Initiates cancelIo on the two IO endpoints:
-    IIS, WinHttp client.
+    Starts the shutdown of the connection, only the first
+    cleanup counts. The endpoints are shut down here, or by
+    the pipeline that is issuing an operation right now, once
+    it has.
 
 Arguments:
     CleanupReason
 --*/
 {
-    BOOL    fLocked = FALSE;
     DebugPrintf(ASPNETCORE_DEBUG_FLAG_INFO,
         "WEBSOCKET_HANDLER::Cleanup Initiated with reason %d", reason);
 
-    if (_fCleanupInProgress)
+    _fIndicateCompletionToIis = TRUE;
+
+    if (_Shutdown.Shutdown(reason))
     {
-        goto Finished;
+        ShutdownEndpoints(reason);
     }
+}
 
-    EnterCriticalSection(&_RequestLock);
+VOID
+WEBSOCKET_HANDLER::LeavePipeline(
+    VOID
+)
+/*++
+
+Routine Description:
 
-    fLocked = TRUE;
-    if (_fCleanupInProgress)
+    A pipeline is done issuing its operation. The last one out
+    after a cleanup started shuts the endpoints down.
+
+--*/
+{
+    if (_Shutdown.Leave())
     {
-        goto Finished;
+        ShutdownEndpoints(static_cast<CleanupReason>(_Shutdown.QueryReason()));
     }
+}
+
+VOID
+WEBSOCKET_HANDLER::ShutdownEndpoints(
+    CleanupReason reason
+)
+/*++
 
-    _fCleanupInProgress = TRUE;
+Routine Description:
 
-    _fIndicateCompletionToIis = TRUE;
+    Initiates cancelIo on the two IO endpoints:
+    IIS, WinHttp client.
+
+    Runs once per connection, when no pipeline can issue
+    anything any more.
+
+Arguments:
+    CleanupReason
+--*/
+{
+    DebugPrintf(ASPNETCORE_DEBUG_FLAG_INFO,
+        "WEBSOCKET_HANDLER::ShutdownEndpoints with reason %d", reason);
 
     //
     // TODO:: Raise FREB event with cleanup reason.
     //
-    if (reason == ClientDisconnect || reason == ServerStateUnavailable)
+    if ((reason == ClientDisconnect || reason == ServerStateUnavailable) &&
+        _hWebSocketRequest != NULL)
     {
         //
         // Calling shutdown to notify the backend about disonnect
@@ -1134,7 +1394,8 @@ Arguments:
 
     }
 
-    if (reason == ServerDisconnect || reason == ServerStateUnavailable)
+    if ((reason == ServerDisconnect || reason == ServerStateUnavailable) &&
+        _pHttpContext != NULL)
     {
         _pHttpContext->CancelIo();
         //
@@ -1143,10 +1404,4 @@ Arguments:
         //
         _pHttpContext->GetResponse()->ResetConnection();
     }
-
-Finished:
-    if (fLocked)
-    {
-        LeaveCriticalSection(&_RequestLock);
-    }
 }
@@ -23,6 +23,12 @@ public:
         VOID
         );
 
+    static
+    VOID
+    QueryBufferCounters(
+        _Out_ WEBSOCKET_BUFFER_COUNTERS * pCounters
+        );
+
     VOID
     Terminate(
         VOID
@@ -41,6 +47,8 @@ public:
         FORWARDING_HANDLER *pHandler,
         IHttpContext * pHttpContext,
         HINTERNET      hRequest,
+        DWORD          cbMaxBuffer,
+        BOOL           fHibernate,
         BOOL*          pfHandleCreated
         );
 
@@ -128,6 +136,24 @@ private:
         CleanupReason  reason
         );
 
+    VOID
+    ShutdownEndpoints(
+        CleanupReason  reason
+        );
+
+    BOOL
+    EnterPipeline(
+        VOID
+        )
+    {
+        return _Shutdown.TryEnter();
+    }
+
+    VOID
+    LeavePipeline(
+        VOID
+        );
+
     HRESULT
     DoIisWebSocketReceive(
         VOID
@@ -140,13 +166,11 @@ private:
 
     HRESULT
     DoIisWebSocketSend(
-        DWORD cbData,
         WINHTTP_WEB_SOCKET_BUFFER_TYPE  eBufferType
     );
 
     HRESULT
     DoWinHttpWebSocketSend(
-        DWORD cbData,
         WINHTTP_WEB_SOCKET_BUFFER_TYPE  eBufferType
     );
 
@@ -181,10 +205,7 @@ private:
     );
 
 private:
-    static const
-    DWORD               RECEIVE_BUFFER_SIZE = 4*1024;
-
-    LIST_ENTRY          _listEntry;
+    SHARDED_LIST_ENTRY  _listEntry;
 
     IHttpContext3 *     _pHttpContext;
 
@@ -194,32 +215,34 @@ private:
 
     HINTERNET           _hWebSocketRequest;
 
-    BYTE                _WinHttpReceiveBuffer[RECEIVE_BUFFER_SIZE];
+    //
+    // Client to backend (IIS reads, WinHttp sends) and backend to client
+    // (WinHttp reads, IIS sends). The two run at the same time and share
+    // nothing but the shutdown, see WEBSOCKET_PIPELINE.
+    //
+    WEBSOCKET_PIPELINE  _ClientPipeline;
 
-    BYTE                _IisReceiveBuffer[RECEIVE_BUFFER_SIZE];
+    WEBSOCKET_PIPELINE  _ServerPipeline;
 
-    CRITICAL_SECTION    _RequestLock;
+    WEBSOCKET_SHUTDOWN  _Shutdown;
 
     LONG                _dwOutstandingIo;
 
-    volatile
-    BOOL                _fCleanupInProgress;
-
     volatile
     BOOL                _fIndicateCompletionToIis;
 
     volatile
     BOOL                _fHandleClosed;
 
-    volatile
-    BOOL                _fReceivedCloseMsg;
-
+    //
+    // Every websocket request, when tracing is enabled.
+    //
     static
-    LIST_ENTRY          sm_RequestsListHead;
+    SHARDED_LIST *      sm_pRequestsList;
 
     static
-    SRWLOCK             sm_RequestsListLock;
+    TRACE_LOG *         sm_pTraceLog;
 
     static
-    TRACE_LOG *         sm_pTraceLog;
+    WEBSOCKET_BUFFER_POOL * sm_pBufferPool;
 };
@@ -0,0 +1,286 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#pragma once
+
+enum WEBSOCKET_PIPELINE_STATE
+{
+    WEBSOCKET_PIPELINE_IDLE,
+    WEBSOCKET_PIPELINE_READING,
+    WEBSOCKET_PIPELINE_SENDING,
+    WEBSOCKET_PIPELINE_CLOSED
+};
+
+//
+// What one direction of a websocket connection has relayed.
+//
+struct WEBSOCKET_PIPELINE_COUNTERS
+{
+    ULONGLONG   cReads;
+    ULONGLONG   cProbeReads;
+    ULONGLONG   cSends;
+    ULONGLONG   cbSent;
+};
+
+//
+// WEBSOCKET_PIPELINE is one direction of a websocket connection: reads
+// from one endpoint and sends to the other, one after the other. A
+// direction only has one operation outstanding, and its completion is what
+// issues the next, so the buffer and the counters belong to whichever
+// thread runs the direction at the time and take no lock. The two
+// directions of a connection run at the same time without touching each
+// other.
+//
+// The state is there for asserting the order of the operations and for
+// the close, which ends the direction; it is set with interlocked
+// exchanges so that another thread may look at it.
+//
+// A hibernating direction waits for every new message in the probe of its
+// buffer and holds nothing from the pool between messages, see
+// WEBSOCKET_RELAY_BUFFER. A read into a pooled buffer cannot be moved to
+// the probe once it is issued, so a direction that stayed awake after a
+// busy spell would hold its buffer for as long as the connection then
+// stays idle.
+//
+class WEBSOCKET_PIPELINE
+{
+public:
+
+    WEBSOCKET_PIPELINE() :
+        m_state(WEBSOCKET_PIPELINE_IDLE),
+        m_cReads(0),
+        m_cProbeReads(0),
+        m_cSends(0),
+        m_cbSent(0)
+    {
+    }
+
+    //
+    // fHibernate has the direction hibernate between messages, it stays
+    // awake otherwise.
+    //
+    VOID
+    Initialize(
+        _In_ WEBSOCKET_BUFFER_POOL *    pPool,
+        DWORD                           cbMaxBuffer,
+        BOOL                            fHibernate
+    )
+    {
+        m_buffer.Initialize(pPool, cbMaxBuffer);
+        m_buffer.SetHibernating(fHibernate);
+    }
+
+    WEBSOCKET_RELAY_BUFFER *
+    QueryBuffer()
+    {
+        return &m_buffer;
+    }
+
+    WEBSOCKET_PIPELINE_STATE
+    QueryState() const
+    {
+        return static_cast<WEBSOCKET_PIPELINE_STATE>(m_state);
+    }
+
+    BOOL
+    IsClosed() const
+    {
+        return QueryState() == WEBSOCKET_PIPELINE_CLOSED;
+    }
+
+    //
+    // A read is being issued, after the previous send or, when coalescing,
+    // after the previous read. Where it goes and how much room it has.
+    //
+    HRESULT
+    BeginRead(
+        _Out_ BYTE **   ppbRead,
+        _Out_ DWORD *   pcbRead
+    )
+    {
+        HRESULT hr = m_buffer.BeginRead(ppbRead, pcbRead);
+
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+
+        LONG previous = InterlockedExchange(&m_state, WEBSOCKET_PIPELINE_READING);
+
+        DBG_ASSERT(previous != WEBSOCKET_PIPELINE_CLOSED);
+        UNREFERENCED_PARAMETER(previous);
+
+        if (m_buffer.IsProbing())
+        {
+            m_cProbeReads++;
+        }
+        m_cReads++;
+        return S_OK;
+    }
+
+    //
+    // The read completed, see WEBSOCKET_RELAY_BUFFER::CompleteRead.
+    //
+    BOOL
+    CompleteRead(
+        DWORD       cbRead,
+        BOOL        fUtf8,
+        BOOL        fFinal
+    )
+    {
+        return m_buffer.CompleteRead(cbRead, fUtf8, fFinal);
+    }
+
+    //
+    // The data read so far is being sent.
+    //
+    VOID
+    BeginSend()
+    {
+        LONG previous = InterlockedCompareExchange(&m_state,
+                                                   WEBSOCKET_PIPELINE_SENDING,
+                                                   WEBSOCKET_PIPELINE_READING);
+
+        DBG_ASSERT(previous == WEBSOCKET_PIPELINE_READING);
+        UNREFERENCED_PARAMETER(previous);
+        m_cSends++;
+        m_cbSent += m_buffer.QueryDataSize();
+    }
+
+    //
+    // The close is being sent to the other endpoint, nothing is read from
+    // this one any more. FALSE if the close had already been sent.
+    //
+    BOOL
+    Close()
+    {
+        return InterlockedExchange(&m_state, WEBSOCKET_PIPELINE_CLOSED) != WEBSOCKET_PIPELINE_CLOSED;
+    }
+
+    //
+    // Read by other threads, the values are hints while the direction runs.
+    //
+    VOID
+    QueryCounters(
+        _Out_ WEBSOCKET_PIPELINE_COUNTERS * pCounters
+    ) const
+    {
+        pCounters->cReads = m_cReads;
+        pCounters->cProbeReads = m_cProbeReads;
+        pCounters->cSends = m_cSends;
+        pCounters->cbSent = m_cbSent;
+    }
+
+private:
+
+    WEBSOCKET_PIPELINE(const WEBSOCKET_PIPELINE &);
+    void operator=(const WEBSOCKET_PIPELINE &);
+
+    volatile LONG           m_state;
+    WEBSOCKET_RELAY_BUFFER  m_buffer;
+    ULONGLONG               m_cReads;
+    ULONGLONG               m_cProbeReads;
+    ULONGLONG               m_cSends;
+    ULONGLONG               m_cbSent;
+};
+
+//
+// WEBSOCKET_SHUTDOWN coordinates the shutdown of a connection with the two
+// pipelines without a lock. A pipeline enters before it issues its next
+// operation and leaves once it has, and enters no more once the shutdown
+// has started. The shutdown itself, cancelling what is outstanding on the
+// two endpoints, runs exactly once and only when no pipeline is between
+// entering and leaving, so no operation is issued after it: either the
+// caller of Shutdown runs it, or the pipeline that leaves last does.
+//
+// The state is one LONG, the count of pipelines inside and the shutdown
+// bit, changed with interlocked operations.
+//
+class WEBSOCKET_SHUTDOWN
+{
+public:
+
+    static const LONG       NO_REASON = -1;
+
+    WEBSOCKET_SHUTDOWN() :
+        m_lState(0),
+        m_lReason(NO_REASON)
+    {
+    }
+
+    //
+    // FALSE once the shutdown has started, no operation is to be issued.
+    //
+    BOOL
+    TryEnter()
+    {
+        LONG lState = m_lState;
+
+        for (;;)
+        {
+            if (lState & SHUTDOWN_BIT)
+            {
+                return FALSE;
+            }
+
+            LONG lPrevious = InterlockedCompareExchange(&m_lState, lState + 1, lState);
+            if (lPrevious == lState)
+            {
+                return TRUE;
+            }
+            lState = lPrevious;
+        }
+    }
+
+    //
+    // TRUE when the shutdown started while this pipeline was inside and it
+    // is the last one out, the caller runs the shutdown.
+    //
+    BOOL
+    Leave()
+    {
+        return InterlockedDecrement(&m_lState) == SHUTDOWN_BIT;
+    }
+
+    //
+    // Starts the shutdown for lReason. TRUE when the caller runs it now;
+    // FALSE when it had already started or a pipeline inside runs it when
+    // leaving.
+    //
+    BOOL
+    Shutdown(
+        LONG        lReason
+    )
+    {
+        DBG_ASSERT(lReason != NO_REASON);
+
+        if (InterlockedCompareExchange(&m_lReason, lReason, NO_REASON) != NO_REASON)
+        {
+            return FALSE;
+        }
+
+        return InterlockedOr(&m_lState, SHUTDOWN_BIT) == 0;
+    }
+
+    BOOL
+    IsShutdown() const
+    {
+        return (m_lState & SHUTDOWN_BIT) != 0;
+    }
+
+    //
+    // Why the shutdown started, NO_REASON before.
+    //
+    LONG
+    QueryReason() const
+    {
+        return m_lReason;
+    }
+
+private:
+
+    static const LONG       SHUTDOWN_BIT = 0x40000000;
+
+    volatile LONG           m_lState;
+    volatile LONG           m_lReason;
+};
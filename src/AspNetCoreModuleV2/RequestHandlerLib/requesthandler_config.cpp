@@ -91,6 +91,22 @@ REQUESTHANDLER_CONFIG::Populate(
 )
 {
     STACK_STRU(strHostingModel, 300);
+    STACK_STRU(strLoadBalancingPolicy, 32);
+    STACK_STRU(strParallelProcessStartup, 8);
+    STACK_STRU(strHotStandbyProcess, 8);
+    STACK_STRU(strResponseCacheSize, 16);
+    STACK_STRU(strRequestCoalescingTimeout, 16);
+    STACK_STRU(strMaxConcurrentRequests, 16);
+    STACK_STRU(strMaxQueuedRequests, 16);
+    STACK_STRU(strRequestQueueTimeout, 16);
+    STACK_STRU(strBackendTransport, 16);
+    STACK_STRU(strMaxBackendConnections, 16);
+    STACK_STRU(strMinIdleBackendConnections, 16);
+    STACK_STRU(strBackendConnectionIdleTimeout, 16);
+    STACK_STRU(strBackendProtocol, 16);
+    STACK_STRU(strH2cConnections, 16);
+    STACK_STRU(strWebSocketMaxBufferSize, 16);
+    STACK_STRU(strWebSocketHibernation, 16);
     HRESULT                         hr = S_OK;
     STRU                            strEnvName;
     STRU                            strEnvValue;
@@ -319,6 +335,336 @@ REQUESTHANDLER_CONFIG::Populate(
         goto Finished;
     }
 
+    hr = ConfigUtility::FindLoadBalancingPolicy(pAspNetCoreElement, strLoadBalancingPolicy);
+    if (FAILED(hr))
+    {
+        goto Finished;
+    }
+
+    if (strLoadBalancingPolicy.IsEmpty() || strLoadBalancingPolicy.Equals(L"roundRobin", TRUE))
+    {
+        m_loadBalancingPolicy = LOAD_BALANCING_ROUND_ROBIN;
+    }
+    else if (strLoadBalancingPolicy.Equals(L"leastOutstanding", TRUE))
+    {
+        m_loadBalancingPolicy = LOAD_BALANCING_LEAST_OUTSTANDING;
+    }
+    else if (strLoadBalancingPolicy.Equals(L"powerOfTwoChoices", TRUE))
+    {
+        m_loadBalancingPolicy = LOAD_BALANCING_POWER_OF_TWO_CHOICES;
+    }
+    else
+    {
+        // block unknown policy
+        hr = HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED);
+        goto Finished;
+    }
+
+    hr = ConfigUtility::FindParallelProcessStartup(pAspNetCoreElement, strParallelProcessStartup);
+    if (FAILED(hr))
+    {
+        goto Finished;
+    }
+
+    if (strParallelProcessStartup.IsEmpty() || strParallelProcessStartup.Equals(L"false", TRUE))
+    {
+        m_fParallelProcessStartup = FALSE;
+    }
+    else if (strParallelProcessStartup.Equals(L"true", TRUE))
+    {
+        m_fParallelProcessStartup = TRUE;
+    }
+    else
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED);
+        goto Finished;
+    }
+
+    hr = ConfigUtility::FindHotStandbyProcess(pAspNetCoreElement, strHotStandbyProcess);
+    if (FAILED(hr))
+    {
+        goto Finished;
+    }
+
+    if (strHotStandbyProcess.IsEmpty() || strHotStandbyProcess.Equals(L"false", TRUE))
+    {
+        m_fHotStandbyProcess = FALSE;
+    }
+    else if (strHotStandbyProcess.Equals(L"true", TRUE))
+    {
+        m_fHotStandbyProcess = TRUE;
+    }
+    else
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED);
+        goto Finished;
+    }
+
+    hr = ConfigUtility::FindResponseCacheSize(pAspNetCoreElement, strResponseCacheSize);
+    if (FAILED(hr))
+    {
+        goto Finished;
+    }
+
+    if (!strResponseCacheSize.IsEmpty())
+    {
+        PWSTR pszEnd;
+        ULONG cMB = wcstoul(strResponseCacheSize.QueryStr(), &pszEnd, 10);
+
+        if (*pszEnd != L'\0' || cMB > 64 * 1024)
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED);
+            goto Finished;
+        }
+        m_cbResponseCache = static_cast<ULONGLONG>(cMB) * 1024 * 1024;
+    }
+
+    hr = ConfigUtility::FindRequestCoalescingTimeout(pAspNetCoreElement, strRequestCoalescingTimeout);
+    if (FAILED(hr))
+    {
+        goto Finished;
+    }
+
+    if (!strRequestCoalescingTimeout.IsEmpty())
+    {
+        PWSTR pszEnd;
+        ULONG dwTimeout = wcstoul(strRequestCoalescingTimeout.QueryStr(), &pszEnd, 10);
+
+        //
+        // Coalesced requests are answered from a captured response, so
+        // this only applies along with the response cache.
+        //
+        if (*pszEnd != L'\0' || dwTimeout > 60 * 1000)
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED);
+            goto Finished;
+        }
+        m_dwRequestCoalescingTimeoutInMS = dwTimeout;
+    }
+
+    hr = ConfigUtility::FindMaxConcurrentRequests(pAspNetCoreElement, strMaxConcurrentRequests);
+    if (FAILED(hr))
+    {
+        goto Finished;
+    }
+
+    if (!strMaxConcurrentRequests.IsEmpty())
+    {
+        PWSTR pszEnd;
+        ULONG cRequests = wcstoul(strMaxConcurrentRequests.QueryStr(), &pszEnd, 10);
+
+        if (*pszEnd != L'\0' || cRequests > 100000)
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED);
+            goto Finished;
+        }
+        m_dwMaxConcurrentRequests = cRequests;
+    }
+
+    hr = ConfigUtility::FindMaxQueuedRequests(pAspNetCoreElement, strMaxQueuedRequests);
+    if (FAILED(hr))
+    {
+        goto Finished;
+    }
+
+    if (!strMaxQueuedRequests.IsEmpty())
+    {
+        PWSTR pszEnd;
+        ULONG cRequests = wcstoul(strMaxQueuedRequests.QueryStr(), &pszEnd, 10);
+
+        if (*pszEnd != L'\0' || cRequests > 100000)
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED);
+            goto Finished;
+        }
+        m_dwMaxQueuedRequests = cRequests;
+    }
+
+    hr = ConfigUtility::FindRequestQueueTimeout(pAspNetCoreElement, strRequestQueueTimeout);
+    if (FAILED(hr))
+    {
+        goto Finished;
+    }
+
+    if (!strRequestQueueTimeout.IsEmpty())
+    {
+        PWSTR pszEnd;
+        ULONG dwTimeout = wcstoul(strRequestQueueTimeout.QueryStr(), &pszEnd, 10);
+
+        //
+        // 0 lets queued requests wait until they are admitted.
+        //
+        if (*pszEnd != L'\0' || dwTimeout > 10 * 60 * 1000)
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED);
+            goto Finished;
+        }
+        m_dwRequestQueueTimeoutInMS = dwTimeout;
+    }
+
+    hr = ConfigUtility::FindBackendTransport(pAspNetCoreElement, strBackendTransport);
+    if (FAILED(hr))
+    {
+        goto Finished;
+    }
+
+    if (strBackendTransport.IsEmpty() || strBackendTransport.Equals(L"tcp", TRUE))
+    {
+        m_backendTransport = BACKEND_TRANSPORT_TCP;
+    }
+    else if (strBackendTransport.Equals(L"unixSocket", TRUE))
+    {
+        m_backendTransport = BACKEND_TRANSPORT_UNIX_SOCKET;
+    }
+    else
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED);
+        goto Finished;
+    }
+
+    hr = ConfigUtility::FindMaxBackendConnections(pAspNetCoreElement, strMaxBackendConnections);
+    if (FAILED(hr))
+    {
+        goto Finished;
+    }
+
+    if (!strMaxBackendConnections.IsEmpty())
+    {
+        PWSTR pszEnd;
+        ULONG cConnections = wcstoul(strMaxBackendConnections.QueryStr(), &pszEnd, 10);
+
+        if (*pszEnd != L'\0' || cConnections > 10000)
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED);
+            goto Finished;
+        }
+        m_dwMaxBackendConnections = cConnections;
+    }
+
+    hr = ConfigUtility::FindMinIdleBackendConnections(pAspNetCoreElement, strMinIdleBackendConnections);
+    if (FAILED(hr))
+    {
+        goto Finished;
+    }
+
+    if (!strMinIdleBackendConnections.IsEmpty())
+    {
+        PWSTR pszEnd;
+        ULONG cConnections = wcstoul(strMinIdleBackendConnections.QueryStr(), &pszEnd, 10);
+
+        //
+        // Connections kept warm must fit under the cap, when there is one.
+        //
+        if (*pszEnd != L'\0' || cConnections > 10000 ||
+            (m_dwMaxBackendConnections != 0 && cConnections > m_dwMaxBackendConnections))
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED);
+            goto Finished;
+        }
+        m_dwMinIdleBackendConnections = cConnections;
+    }
+
+    hr = ConfigUtility::FindBackendConnectionIdleTimeout(pAspNetCoreElement, strBackendConnectionIdleTimeout);
+    if (FAILED(hr))
+    {
+        goto Finished;
+    }
+
+    if (!strBackendConnectionIdleTimeout.IsEmpty())
+    {
+        PWSTR pszEnd;
+        ULONG dwTimeout = wcstoul(strBackendConnectionIdleTimeout.QueryStr(), &pszEnd, 10);
+
+        if (*pszEnd != L'\0' || dwTimeout < 1000 || dwTimeout > 60 * 60 * 1000)
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED);
+            goto Finished;
+        }
+        m_dwBackendConnectionIdleTimeoutInMS = dwTimeout;
+    }
+
+    hr = ConfigUtility::FindBackendProtocol(pAspNetCoreElement, strBackendProtocol);
+    if (FAILED(hr))
+    {
+        goto Finished;
+    }
+
+    if (strBackendProtocol.IsEmpty() || strBackendProtocol.Equals(L"http1", TRUE))
+    {
+        m_backendProtocol = BACKEND_PROTOCOL_HTTP1;
+    }
+    else if (strBackendProtocol.Equals(L"h2c", TRUE))
+    {
+        m_backendProtocol = BACKEND_PROTOCOL_H2C;
+    }
+    else
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED);
+        goto Finished;
+    }
+
+    hr = ConfigUtility::FindH2cConnections(pAspNetCoreElement, strH2cConnections);
+    if (FAILED(hr))
+    {
+        goto Finished;
+    }
+
+    if (!strH2cConnections.IsEmpty())
+    {
+        PWSTR pszEnd;
+        ULONG cConnections = wcstoul(strH2cConnections.QueryStr(), &pszEnd, 10);
+
+        if (*pszEnd != L'\0' || cConnections < 1 || cConnections > 16)
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED);
+            goto Finished;
+        }
+        m_dwH2cConnections = cConnections;
+    }
+
+    hr = ConfigUtility::FindWebSocketMaxBufferSize(pAspNetCoreElement, strWebSocketMaxBufferSize);
+    if (FAILED(hr))
+    {
+        goto Finished;
+    }
+
+    if (!strWebSocketMaxBufferSize.IsEmpty())
+    {
+        PWSTR pszEnd;
+        ULONG cbBuffer = wcstoul(strWebSocketMaxBufferSize.QueryStr(), &pszEnd, 10);
+
+        //
+        // Between the smallest and the largest relay buffer class,
+        // 1KB to 256KB.
+        //
+        if (*pszEnd != L'\0' || cbBuffer < 1024 || cbBuffer > 256 * 1024)
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED);
+            goto Finished;
+        }
+        m_cbWebSocketMaxBuffer = cbBuffer;
+    }
+
+    hr = ConfigUtility::FindWebSocketHibernation(pAspNetCoreElement, strWebSocketHibernation);
+    if (FAILED(hr))
+    {
+        goto Finished;
+    }
+
+    if (strWebSocketHibernation.IsEmpty() || strWebSocketHibernation.Equals(L"false", TRUE))
+    {
+        m_fWebSocketHibernation = FALSE;
+    }
+    else if (strWebSocketHibernation.Equals(L"true", TRUE))
+    {
+        m_fWebSocketHibernation = TRUE;
+    }
+    else
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED);
+        goto Finished;
+    }
+
     hr = GetElementDWORDProperty(
         pAspNetCoreElement,
         CS_ASPNETCORE_PROCESS_STARTUP_TIME_LIMIT,
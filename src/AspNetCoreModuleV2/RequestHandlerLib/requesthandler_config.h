@@ -51,6 +51,37 @@ enum APP_HOSTING_MODEL
     HOSTING_OUT_PROCESS
 };
 
+//
+// How requests are spread over processesPerApplication backends, set with
+// the loadBalancingPolicy handler setting.
+//
+enum LOAD_BALANCING_POLICY
+{
+    LOAD_BALANCING_ROUND_ROBIN = 0,
+    LOAD_BALANCING_LEAST_OUTSTANDING,
+    LOAD_BALANCING_POWER_OF_TWO_CHOICES
+};
+
+//
+// How requests reach the backend, set with the backendTransport handler
+// setting.
+//
+enum BACKEND_TRANSPORT
+{
+    BACKEND_TRANSPORT_TCP = 0,
+    BACKEND_TRANSPORT_UNIX_SOCKET
+};
+
+//
+// What requests to the backend are sent as, set with the backendProtocol
+// handler setting.
+//
+enum BACKEND_PROTOCOL
+{
+    BACKEND_PROTOCOL_HTTP1 = 0,
+    BACKEND_PROTOCOL_H2C
+};
+
 class REQUESTHANDLER_CONFIG
 {
 public:
@@ -106,6 +137,180 @@ public:
         return m_dwProcessesPerApplication;
     }
 
+    LOAD_BALANCING_POLICY
+    QueryLoadBalancingPolicy(
+        VOID
+    )
+    {
+        return m_loadBalancingPolicy;
+    }
+
+    BACKEND_TRANSPORT
+    QueryBackendTransport(
+        VOID
+    )
+    {
+        return m_backendTransport;
+    }
+
+    //
+    // How many connections to a backend process are pooled, 0 when
+    // requests over TCP are left to WinHTTP. Over a unix socket 0 means a
+    // new connection per request.
+    //
+    DWORD
+    QueryMaxBackendConnections(
+        VOID
+    )
+    {
+        return m_dwMaxBackendConnections;
+    }
+
+    //
+    // How many idle connections the pool keeps open and warm.
+    //
+    DWORD
+    QueryMinIdleBackendConnections(
+        VOID
+    )
+    {
+        return m_dwMinIdleBackendConnections;
+    }
+
+    //
+    // How long a pooled connection stays idle before it is closed, below
+    // the keep-alive timeout of Kestrel.
+    //
+    DWORD
+    QueryBackendConnectionIdleTimeoutInMS(
+        VOID
+    )
+    {
+        return m_dwBackendConnectionIdleTimeoutInMS;
+    }
+
+    //
+    // h2c multiplexes requests over a few connections to the backend and
+    // falls back to pooled HTTP/1.1 when the backend does not take it.
+    //
+    BACKEND_PROTOCOL
+    QueryBackendProtocol(
+        VOID
+    )
+    {
+        return m_backendProtocol;
+    }
+
+    //
+    // How many h2c connections a backend process gets at most.
+    //
+    DWORD
+    QueryH2cConnections(
+        VOID
+    )
+    {
+        return m_dwH2cConnections;
+    }
+
+    //
+    // How large the relay buffers of a websocket connection may grow for
+    // large messages, in bytes.
+    //
+    DWORD
+    QueryWebSocketMaxBufferSize(
+        VOID
+    )
+    {
+        return m_cbWebSocketMaxBuffer;
+    }
+
+    //
+    // Whether the directions of a websocket connection wait for each new
+    // message in a few bytes of their own and hold no relay buffer between
+    // messages. Off by default, every message then costs a probe read.
+    //
+    BOOL
+    QueryWebSocketHibernation(
+        VOID
+    )
+    {
+        return m_fWebSocketHibernation;
+    }
+
+    BOOL
+    QueryParallelProcessStartup(
+        VOID
+    )
+    {
+        return m_fParallelProcessStartup;
+    }
+
+    BOOL
+    QueryHotStandbyProcess(
+        VOID
+    )
+    {
+        return m_fHotStandbyProcess;
+    }
+
+    //
+    // Byte budget of the response cache, 0 when it is off.
+    //
+    ULONGLONG
+    QueryResponseCacheSize(
+        VOID
+    )
+    {
+        return m_cbResponseCache;
+    }
+
+    //
+    // How long identical GETs wait on the one forwarded for them before
+    // they are forwarded on their own, 0 when coalescing is off.
+    //
+    DWORD
+    QueryRequestCoalescingTimeoutInMS(
+        VOID
+    )
+    {
+        return m_dwRequestCoalescingTimeoutInMS;
+    }
+
+    //
+    // How many requests of the application may be forwarded at once, 0
+    // when there is no limit.
+    //
+    DWORD
+    QueryMaxConcurrentRequests(
+        VOID
+    )
+    {
+        return m_dwMaxConcurrentRequests;
+    }
+
+    //
+    // How many requests past maxConcurrentRequests wait for their turn,
+    // the ones past that get a 503.
+    //
+    DWORD
+    QueryMaxQueuedRequests(
+        VOID
+    )
+    {
+        return m_dwMaxQueuedRequests;
+    }
+
+    //
+    // How long a queued request waits before it gets a 503.
+    //
+    DWORD
+    QueryRequestQueueTimeoutInMS(
+        VOID
+    )
+    {
+        return m_dwRequestQueueTimeoutInMS;
+    }
+
     DWORD
     QueryRequestTimeoutInMS(
         VOID
@@ -219,6 +424,22 @@ protected:
         m_fStdoutLogEnabled(FALSE),
         m_pEnvironmentVariables(NULL),
         m_hostingModel(HOSTING_UNKNOWN),
+        m_loadBalancingPolicy(LOAD_BALANCING_ROUND_ROBIN),
+        m_backendTransport(BACKEND_TRANSPORT_TCP),
+        m_fParallelProcessStartup(FALSE),
+        m_fHotStandbyProcess(FALSE),
+        m_cbResponseCache(0),
+        m_dwRequestCoalescingTimeoutInMS(0),
+        m_dwMaxConcurrentRequests(0),
+        m_dwMaxQueuedRequests(0),
+        m_dwRequestQueueTimeoutInMS(10 * 1000),
+        m_dwMaxBackendConnections(0),
+        m_dwMinIdleBackendConnections(0),
+        m_dwBackendConnectionIdleTimeoutInMS(60 * 1000),
+        m_backendProtocol(BACKEND_PROTOCOL_HTTP1),
+        m_dwH2cConnections(2),
+        m_cbWebSocketMaxBuffer(64 * 1024),
+        m_fWebSocketHibernation(FALSE),
         m_ppStrArguments(NULL)
     {
     }
@@ -248,6 +469,22 @@ protected:
     BOOL                   m_fBasicAuthEnabled;
     BOOL                   m_fAnonymousAuthEnabled;
     APP_HOSTING_MODEL      m_hostingModel;
+    LOAD_BALANCING_POLICY  m_loadBalancingPolicy;
+    BACKEND_TRANSPORT      m_backendTransport;
+    BOOL                   m_fParallelProcessStartup;
+    BOOL                   m_fHotStandbyProcess;
+    ULONGLONG              m_cbResponseCache;
+    DWORD                  m_dwRequestCoalescingTimeoutInMS;
+    DWORD                  m_dwMaxConcurrentRequests;
+    DWORD                  m_dwMaxQueuedRequests;
+    DWORD                  m_dwRequestQueueTimeoutInMS;
+    DWORD                  m_dwMaxBackendConnections;
+    DWORD                  m_dwMinIdleBackendConnections;
+    DWORD                  m_dwBackendConnectionIdleTimeoutInMS;
+    BACKEND_PROTOCOL       m_backendProtocol;
+    DWORD                  m_dwH2cConnections;
+    DWORD                  m_cbWebSocketMaxBuffer;
+    BOOL                   m_fWebSocketHibernation;
     ENVIRONMENT_VAR_HASH*  m_pEnvironmentVariables;
     STRU                   m_struHostFxrLocation;
     PWSTR*                 m_ppStrArguments;
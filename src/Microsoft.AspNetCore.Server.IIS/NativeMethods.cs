@@ -97,6 +97,15 @@ public enum REQUEST_NOTIFICATION_STATUS
             [MarshalAs(UnmanagedType.LPStr)] string variableName,
             [MarshalAs(UnmanagedType.BStr)] out string value);
 
+        [DllImport(AspNetCoreModuleDll)]
+        private static extern unsafe int http_get_request_snapshot(
+            IntPtr pInProcessHandler,
+            [MarshalAs(UnmanagedType.LPArray, ArraySubType = UnmanagedType.LPStr)] string[] serverVariableNames,
+            int cServerVariables,
+            byte* pbBuffer,
+            int cbBuffer,
+            out int cbSnapshot);
+
         [DllImport(AspNetCoreModuleDll)]
         private static extern unsafe int http_websockets_read_bytes(
             IntPtr pInProcessHandler,
@@ -166,6 +175,11 @@ public static int HttpFlushResponseBytes(IntPtr pInProcessHandler, out bool fCom
             return http_get_raw_request(pInProcessHandler);
         }
 
+        public static unsafe int HttpGetRequestSnapshot(IntPtr pInProcessHandler, string[] serverVariableNames, byte* pbBuffer, int cbBuffer, out int cbSnapshot)
+        {
+            return http_get_request_snapshot(pInProcessHandler, serverVariableNames, serverVariableNames?.Length ?? 0, pbBuffer, cbBuffer, out cbSnapshot);
+        }
+
         public static void HttpStopCallsIntoManaged(IntPtr pInProcessApplication)
         {
             Validate(http_stop_calls_into_managed(pInProcessApplication));
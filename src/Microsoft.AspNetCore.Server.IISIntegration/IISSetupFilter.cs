@@ -2,9 +2,11 @@
 // Licensed under the Apache License, Version 2.0. See License.txt in the project root for license information.
 
 using System;
+using System.Threading;
 using Microsoft.AspNetCore.Builder;
 using Microsoft.AspNetCore.Hosting;
 using Microsoft.AspNetCore.Http;
+using Microsoft.Extensions.DependencyInjection;
 
 namespace Microsoft.AspNetCore.Server.IISIntegration
 {
@@ -13,23 +15,55 @@ internal class IISSetupFilter : IStartupFilter
         private readonly string _pairingToken;
         private readonly PathString _pathBase;
         private readonly bool _isWebsocketsSupported;
+        private readonly string _readyEvent;
 
-        internal IISSetupFilter(string pairingToken, PathString pathBase, bool isWebsocketsSupported)
+        internal IISSetupFilter(string pairingToken, PathString pathBase, bool isWebsocketsSupported, string readyEvent)
         {
             _pairingToken = pairingToken;
             _pathBase = pathBase;
             _isWebsocketsSupported = isWebsocketsSupported;
+            _readyEvent = readyEvent;
         }
 
         public Action<IApplicationBuilder> Configure(Action<IApplicationBuilder> next)
         {
             return app =>
             {
+                if (!string.IsNullOrEmpty(_readyEvent))
+                {
+                    var applicationLifetime = app.ApplicationServices.GetRequiredService<IApplicationLifetime>();
+                    applicationLifetime.ApplicationStarted.Register(() => SignalReadyEvent(_readyEvent));
+                }
+
                 app.UsePathBase(_pathBase);
                 app.UseForwardedHeaders();
                 app.UseMiddleware<IISMiddleware>(_pairingToken, _isWebsocketsSupported);
                 next(app);
             };
         }
+
+        // ANCM creates the event and waits on it instead of polling for the port.
+        // ApplicationStarted fires once the server listens, which is what ANCM
+        // waits for. The event is only a hint, ANCM still checks the port itself,
+        // so failing to open it is not an error.
+        private static void SignalReadyEvent(string name)
+        {
+            try
+            {
+                using (var readyEvent = EventWaitHandle.OpenExisting(name))
+                {
+                    readyEvent.Set();
+                }
+            }
+            catch (WaitHandleCannotBeOpenedException)
+            {
+            }
+            catch (UnauthorizedAccessException)
+            {
+            }
+            catch (PlatformNotSupportedException)
+            {
+            }
+        }
     }
 }
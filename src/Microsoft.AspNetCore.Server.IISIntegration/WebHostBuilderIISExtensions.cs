@@ -16,10 +16,12 @@ public static class WebHostBuilderIISExtensions
     {
         // These are defined as ASPNETCORE_ environment variables by IIS's AspNetCoreModule.
         private static readonly string ServerPort = "PORT";
+        private static readonly string ServerUnixSocket = "UNIX_SOCKET";
         private static readonly string ServerPath = "APPL_PATH";
         private static readonly string PairingToken = "TOKEN";
         private static readonly string IISAuth = "IIS_HTTPAUTH";
         private static readonly string IISWebSockets = "IIS_WEBSOCKETS_SUPPORTED";
+        private static readonly string ReadyEvent = "READY_EVENT";
 
         /// <summary>
         /// Configures the port and base path the server should listen on when running behind AspNetCoreModule.
@@ -41,10 +43,12 @@ public static IWebHostBuilder UseIISIntegration(this IWebHostBuilder hostBuilder
             }
 
             var port = hostBuilder.GetSetting(ServerPort) ?? Environment.GetEnvironmentVariable($"ASPNETCORE_{ServerPort}");
+            var unixSocket = hostBuilder.GetSetting(ServerUnixSocket) ?? Environment.GetEnvironmentVariable($"ASPNETCORE_{ServerUnixSocket}");
             var path = hostBuilder.GetSetting(ServerPath) ?? Environment.GetEnvironmentVariable($"ASPNETCORE_{ServerPath}");
             var pairingToken = hostBuilder.GetSetting(PairingToken) ?? Environment.GetEnvironmentVariable($"ASPNETCORE_{PairingToken}");
             var iisAuth = hostBuilder.GetSetting(IISAuth) ?? Environment.GetEnvironmentVariable($"ASPNETCORE_{IISAuth}");
             var websocketsSupported = hostBuilder.GetSetting(IISWebSockets) ?? Environment.GetEnvironmentVariable($"ASPNETCORE_{IISWebSockets}");
+            var readyEvent = hostBuilder.GetSetting(ReadyEvent) ?? Environment.GetEnvironmentVariable($"ASPNETCORE_{ReadyEvent}");
 
             bool isWebSocketsSupported;
             if (!bool.TryParse(websocketsSupported, out isWebSocketsSupported))
@@ -53,7 +57,7 @@ public static IWebHostBuilder UseIISIntegration(this IWebHostBuilder hostBuilder
                 isWebSocketsSupported = (Environment.OSVersion.Version >= new Version(6, 2));
             }
 
-            if (!string.IsNullOrEmpty(port) && !string.IsNullOrEmpty(path) && !string.IsNullOrEmpty(pairingToken))
+            if ((!string.IsNullOrEmpty(port) || !string.IsNullOrEmpty(unixSocket)) && !string.IsNullOrEmpty(path) && !string.IsNullOrEmpty(pairingToken))
             {
                 // Set flag to prevent double service configuration
                 hostBuilder.UseSetting(nameof(UseIISIntegration), true.ToString());
@@ -77,7 +81,7 @@ public static IWebHostBuilder UseIISIntegration(this IWebHostBuilder hostBuilder
                     }
                 }
 
-                var address = "http://127.0.0.1:" + port;
+                var address = string.IsNullOrEmpty(unixSocket) ? "http://127.0.0.1:" + port : GetUnixSocketAddress(unixSocket);
                 hostBuilder.CaptureStartupErrors(true);
 
                 hostBuilder.ConfigureServices(services =>
@@ -85,7 +89,7 @@ public static IWebHostBuilder UseIISIntegration(this IWebHostBuilder hostBuilder
                     // Delay register the url so users don't accidently overwrite it.
                     hostBuilder.UseSetting(WebHostDefaults.ServerUrlsKey, address);
                     hostBuilder.PreferHostingUrls(true);
-                    services.AddSingleton<IStartupFilter>(new IISSetupFilter(pairingToken, new PathString(path), isWebSocketsSupported));
+                    services.AddSingleton<IStartupFilter>(new IISSetupFilter(pairingToken, new PathString(path), isWebSocketsSupported, readyEvent));
                     services.Configure<ForwardedHeadersOptions>(options =>
                     {
                         options.ForwardedHeaders = ForwardedHeaders.XForwardedFor | ForwardedHeaders.XForwardedProto;
@@ -100,5 +104,22 @@ public static IWebHostBuilder UseIISIntegration(this IWebHostBuilder hostBuilder
 
             return hostBuilder;
         }
+
+        // Kestrel takes a socket as http://unix:/<path> and ends the path at the first ':', so the drive
+        // of a Windows path is left out. ANCM puts the socket on the drive of the application directory,
+        // the current directory of the process, which is where the path then resolves.
+        internal static string GetUnixSocketAddress(string unixSocket)
+        {
+            var socketPath = unixSocket.Replace('\\', '/');
+            if (socketPath.Length >= 2 && socketPath[1] == ':')
+            {
+                socketPath = socketPath.Substring(2);
+            }
+            if (!socketPath.StartsWith("/", StringComparison.Ordinal))
+            {
+                socketPath = "/" + socketPath;
+            }
+            return "http://unix:" + socketPath;
+        }
     }
 }
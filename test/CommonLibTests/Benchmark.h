@@ -0,0 +1,89 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#pragma once
+
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <vector>
+
+//
+// Micro-benchmarks are regular gtest tests prefixed with DISABLED_ so they
+// are skipped by the Test target. Run them with
+//
+//   CommonLibTests.exe --gtest_also_run_disabled_tests --gtest_filter=*Benchmark*
+//
+// against a Release build.
+//
+class Benchmark
+{
+public:
+
+    //
+    // Runs function(threadIndex) on dwThreads threads released at the
+    // same time and returns the elapsed wall time in nanoseconds.
+    //
+    template<typename Function>
+    static
+    double
+    RunConcurrently(
+        DWORD       dwThreads,
+        Function    function
+    )
+    {
+        std::vector<std::thread> threads;
+        std::atomic<DWORD> ready(0);
+        std::atomic<bool> go(false);
+
+        for (DWORD i = 0; i < dwThreads; i++)
+        {
+            threads.emplace_back([&, i]()
+            {
+                ready++;
+                while (!go)
+                {
+                    std::this_thread::yield();
+                }
+                function(i);
+            });
+        }
+
+        while (ready != dwThreads)
+        {
+            std::this_thread::yield();
+        }
+
+        auto start = std::chrono::high_resolution_clock::now();
+        go = true;
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+
+        return static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+    }
+
+    static
+    DWORD
+    QueryThreadCount()
+    {
+        DWORD dwThreads = std::thread::hardware_concurrency();
+        return dwThreads == 0 ? 4 : dwThreads;
+    }
+
+    static
+    VOID
+    Report(
+        PCSTR       pszName,
+        double      nanoseconds,
+        ULONGLONG   operations
+    )
+    {
+        printf("%-48s %12.1f ns/op %14.0f ops/s\n",
+            pszName,
+            nanoseconds / operations,
+            operations / (nanoseconds / 1e9));
+    }
+};
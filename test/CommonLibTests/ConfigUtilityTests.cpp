@@ -74,6 +74,150 @@ namespace ConfigUtilityTests
         TestHandlerVersion(L"debugLEVEL", L"value", L"value", func);
     }
 
+    TEST_F(ConfigUtilityTest, CheckLoadBalancingPolicy)
+    {
+        auto func = ConfigUtility::FindLoadBalancingPolicy;
+
+        TestHandlerVersion(L"loadBalancingPolicy", L"leastOutstanding", L"leastOutstanding", func);
+        TestHandlerVersion(L"LOADBALANCINGPOLICY", L"value", L"value", func);
+        TestHandlerVersion(L"handlerVersion", L"value", L"", func);
+    }
+
+    TEST_F(ConfigUtilityTest, CheckParallelProcessStartup)
+    {
+        auto func = ConfigUtility::FindParallelProcessStartup;
+
+        TestHandlerVersion(L"parallelProcessStartup", L"true", L"true", func);
+        TestHandlerVersion(L"PARALLELPROCESSSTARTUP", L"value", L"value", func);
+        TestHandlerVersion(L"loadBalancingPolicy", L"true", L"", func);
+    }
+
+    TEST_F(ConfigUtilityTest, CheckHotStandbyProcess)
+    {
+        auto func = ConfigUtility::FindHotStandbyProcess;
+
+        TestHandlerVersion(L"hotStandbyProcess", L"true", L"true", func);
+        TestHandlerVersion(L"HOTSTANDBYPROCESS", L"value", L"value", func);
+        TestHandlerVersion(L"parallelProcessStartup", L"true", L"", func);
+    }
+
+    TEST_F(ConfigUtilityTest, CheckResponseCacheSize)
+    {
+        auto func = ConfigUtility::FindResponseCacheSize;
+
+        TestHandlerVersion(L"responseCacheSizeInMB", L"64", L"64", func);
+        TestHandlerVersion(L"RESPONSECACHESIZEINMB", L"value", L"value", func);
+        TestHandlerVersion(L"hotStandbyProcess", L"64", L"", func);
+    }
+
+    TEST_F(ConfigUtilityTest, CheckRequestCoalescingTimeout)
+    {
+        auto func = ConfigUtility::FindRequestCoalescingTimeout;
+
+        TestHandlerVersion(L"requestCoalescingTimeoutInMS", L"2000", L"2000", func);
+        TestHandlerVersion(L"REQUESTCOALESCINGTIMEOUTINMS", L"value", L"value", func);
+        TestHandlerVersion(L"responseCacheSizeInMB", L"2000", L"", func);
+    }
+
+    TEST_F(ConfigUtilityTest, CheckMaxConcurrentRequests)
+    {
+        auto func = ConfigUtility::FindMaxConcurrentRequests;
+
+        TestHandlerVersion(L"maxConcurrentRequests", L"100", L"100", func);
+        TestHandlerVersion(L"MAXCONCURRENTREQUESTS", L"value", L"value", func);
+        TestHandlerVersion(L"maxQueuedRequests", L"100", L"", func);
+    }
+
+    TEST_F(ConfigUtilityTest, CheckMaxQueuedRequests)
+    {
+        auto func = ConfigUtility::FindMaxQueuedRequests;
+
+        TestHandlerVersion(L"maxQueuedRequests", L"500", L"500", func);
+        TestHandlerVersion(L"MAXQUEUEDREQUESTS", L"value", L"value", func);
+        TestHandlerVersion(L"maxConcurrentRequests", L"500", L"", func);
+    }
+
+    TEST_F(ConfigUtilityTest, CheckRequestQueueTimeout)
+    {
+        auto func = ConfigUtility::FindRequestQueueTimeout;
+
+        TestHandlerVersion(L"requestQueueTimeoutInMS", L"5000", L"5000", func);
+        TestHandlerVersion(L"REQUESTQUEUETIMEOUTINMS", L"value", L"value", func);
+        TestHandlerVersion(L"requestCoalescingTimeoutInMS", L"5000", L"", func);
+    }
+
+    TEST_F(ConfigUtilityTest, CheckBackendTransport)
+    {
+        auto func = ConfigUtility::FindBackendTransport;
+
+        TestHandlerVersion(L"backendTransport", L"unixSocket", L"unixSocket", func);
+        TestHandlerVersion(L"BACKENDTRANSPORT", L"value", L"value", func);
+        TestHandlerVersion(L"loadBalancingPolicy", L"unixSocket", L"", func);
+    }
+
+    TEST_F(ConfigUtilityTest, CheckMaxBackendConnections)
+    {
+        auto func = ConfigUtility::FindMaxBackendConnections;
+
+        TestHandlerVersion(L"maxBackendConnections", L"64", L"64", func);
+        TestHandlerVersion(L"MAXBACKENDCONNECTIONS", L"value", L"value", func);
+        TestHandlerVersion(L"minIdleBackendConnections", L"64", L"", func);
+    }
+
+    TEST_F(ConfigUtilityTest, CheckMinIdleBackendConnections)
+    {
+        auto func = ConfigUtility::FindMinIdleBackendConnections;
+
+        TestHandlerVersion(L"minIdleBackendConnections", L"4", L"4", func);
+        TestHandlerVersion(L"MINIDLEBACKENDCONNECTIONS", L"value", L"value", func);
+        TestHandlerVersion(L"maxBackendConnections", L"4", L"", func);
+    }
+
+    TEST_F(ConfigUtilityTest, CheckBackendConnectionIdleTimeout)
+    {
+        auto func = ConfigUtility::FindBackendConnectionIdleTimeout;
+
+        TestHandlerVersion(L"backendConnectionIdleTimeoutInMS", L"30000", L"30000", func);
+        TestHandlerVersion(L"BACKENDCONNECTIONIDLETIMEOUTINMS", L"value", L"value", func);
+        TestHandlerVersion(L"requestQueueTimeoutInMS", L"30000", L"", func);
+    }
+
+    TEST_F(ConfigUtilityTest, CheckBackendProtocol)
+    {
+        auto func = ConfigUtility::FindBackendProtocol;
+
+        TestHandlerVersion(L"backendProtocol", L"h2c", L"h2c", func);
+        TestHandlerVersion(L"BACKENDPROTOCOL", L"value", L"value", func);
+        TestHandlerVersion(L"backendTransport", L"h2c", L"", func);
+    }
+
+    TEST_F(ConfigUtilityTest, CheckH2cConnections)
+    {
+        auto func = ConfigUtility::FindH2cConnections;
+
+        TestHandlerVersion(L"h2cConnections", L"4", L"4", func);
+        TestHandlerVersion(L"H2CCONNECTIONS", L"value", L"value", func);
+        TestHandlerVersion(L"maxBackendConnections", L"4", L"", func);
+    }
+
+    TEST_F(ConfigUtilityTest, CheckWebSocketMaxBufferSize)
+    {
+        auto func = ConfigUtility::FindWebSocketMaxBufferSize;
+
+        TestHandlerVersion(L"webSocketMaxBufferSize", L"262144", L"262144", func);
+        TestHandlerVersion(L"WEBSOCKETMAXBUFFERSIZE", L"value", L"value", func);
+        TestHandlerVersion(L"h2cConnections", L"4", L"", func);
+    }
+
+    TEST_F(ConfigUtilityTest, CheckWebSocketHibernation)
+    {
+        auto func = ConfigUtility::FindWebSocketHibernation;
+
+        TestHandlerVersion(L"webSocketHibernation", L"true", L"true", func);
+        TestHandlerVersion(L"WEBSOCKETHIBERNATION", L"value", L"value", func);
+        TestHandlerVersion(L"webSocketMaxBufferSize", L"true", L"", func);
+    }
+
     TEST(ConfigUtilityTestSingle, MultipleElements)
     {
         IAppHostElement* retElement = NULL;
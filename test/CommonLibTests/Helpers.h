@@ -26,3 +26,12 @@ public:
 private:
     std::filesystem::path m_path;
 };
+
+//
+// Entry point of the stub backend process, see readinessevent_tests.cpp.
+//
+int
+ReadinessStubMain(
+    int         argc,
+    wchar_t*    argv[]
+);
@@ -0,0 +1,78 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#include "stdafx.h"
+
+namespace AllocCacheTests
+{
+    class AllocCacheTest : public ::testing::Test
+    {
+    protected:
+        void SetUp() override
+        {
+            ALLOC_CACHE_HANDLER::StaticInitialize();
+
+            //
+            // Keep the thread on one processor so that it always sees the
+            // same free list.
+            //
+            _dwOldMask = SetThreadAffinityMask(GetCurrentThread(),
+                                               static_cast<DWORD_PTR>(1) << GetCurrentProcessorNumber());
+        }
+
+        void TearDown() override
+        {
+            SetThreadAffinityMask(GetCurrentThread(), _dwOldMask);
+        }
+
+        DWORD_PTR   _dwOldMask;
+    };
+
+    TEST_F(AllocCacheTest, CountsHitsMissesAndReleases)
+    {
+        ALLOC_CACHE_HANDLER cache;
+        ALLOC_CACHE_COUNTERS counters;
+        LPVOID rgBlocks[6];
+
+        ASSERT_EQ(S_OK, cache.Initialize(8200, 4));
+        if (ALLOC_CACHE_HANDLER::IsPageheapEnabled())
+        {
+            return;
+        }
+
+        for (LPVOID & pBlock : rgBlocks)
+        {
+            pBlock = cache.Alloc();
+            ASSERT_NE(nullptr, pBlock);
+        }
+        for (LPVOID pBlock : rgBlocks)
+        {
+            cache.Free(pBlock);
+        }
+
+        cache.QueryCounters(&counters);
+        EXPECT_EQ(0, counters.cHits);
+        EXPECT_EQ(6, counters.cMisses);
+        EXPECT_EQ(2, counters.cReleased);
+
+        //
+        // Steady state: the same working set never reaches the heap.
+        //
+        for (DWORD dwRound = 0; dwRound < 10; dwRound++)
+        {
+            for (DWORD i = 0; i < 4; i++)
+            {
+                rgBlocks[i] = cache.Alloc();
+            }
+            for (DWORD i = 0; i < 4; i++)
+            {
+                cache.Free(rgBlocks[i]);
+            }
+        }
+
+        cache.QueryCounters(&counters);
+        EXPECT_EQ(40, counters.cHits);
+        EXPECT_EQ(6, counters.cMisses);
+        EXPECT_EQ(2, counters.cReleased);
+    }
+}
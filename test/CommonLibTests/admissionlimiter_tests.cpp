@@ -0,0 +1,319 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#include "stdafx.h"
+#include "timerwheel.h"
+#include "admissionlimiter.h"
+#include "Benchmark.h"
+
+namespace AdmissionLimiterTests
+{
+    //
+    // A queued request, records how it was let go.
+    //
+    class FAKE_REQUEST
+    {
+    public:
+
+        FAKE_REQUEST()
+        {
+            ADMISSION_LIMITER::InitializeWaiter(&waiter, OnCompletion, this);
+        }
+
+        static
+        VOID
+        OnCompletion(
+            PVOID   pvContext,
+            BOOL    fAdmitted
+        )
+        {
+            FAKE_REQUEST *pRequest = static_cast<FAKE_REQUEST *>(pvContext);
+
+            pRequest->fAdmitted = fAdmitted;
+            if (pRequest->pcOrder != NULL)
+            {
+                pRequest->dwOrder = (*pRequest->pcOrder)++;
+            }
+            pRequest->cCompletions++;
+        }
+
+        ADMISSION_WAITER    waiter;
+        std::atomic<LONG>   cCompletions { 0 };
+        BOOL                fAdmitted = FALSE;
+        DWORD               dwOrder = 0;
+        DWORD *             pcOrder = NULL;
+    };
+
+    class AdmissionLimiterTest : public ::testing::Test
+    {
+    protected:
+
+        void SetUp() override
+        {
+            ASSERT_EQ(S_OK, _wheel.Initialize(FALSE));
+        }
+
+        void Initialize(DWORD cMaxInFlight, DWORD cMaxQueued)
+        {
+            ASSERT_EQ(S_OK, _limiter.Initialize(cMaxInFlight, cMaxQueued, TIMEOUT_MS, &_wheel));
+        }
+
+        ADMISSION_RESULT Enter(FAKE_REQUEST * pRequest)
+        {
+            return _limiter.Enter(&pRequest->waiter, _ullNow);
+        }
+
+        void AdvanceTo(ULONGLONG ullNow)
+        {
+            _ullNow = ullNow;
+            _wheel.Advance(ullNow);
+        }
+
+        ADMISSION_COUNTERS Counters()
+        {
+            ADMISSION_COUNTERS counters;
+            _limiter.QueryCounters(&counters);
+            return counters;
+        }
+
+        static const DWORD      TIMEOUT_MS = 1000;
+
+        TIMER_WHEEL             _wheel;
+        ADMISSION_LIMITER       _limiter;
+        ULONGLONG               _ullNow = 1000000;
+    };
+
+    TEST_F(AdmissionLimiterTest, AdmitsUpToTheLimit)
+    {
+        FAKE_REQUEST requests[3];
+
+        Initialize(2, 0);
+
+        EXPECT_EQ(ADMISSION_ADMITTED, Enter(&requests[0]));
+        EXPECT_EQ(ADMISSION_ADMITTED, Enter(&requests[1]));
+        EXPECT_EQ(ADMISSION_REJECTED, Enter(&requests[2]));
+
+        _limiter.Leave(_ullNow);
+        EXPECT_EQ(ADMISSION_ADMITTED, Enter(&requests[2]));
+
+        _limiter.Leave(_ullNow);
+        _limiter.Leave(_ullNow);
+
+        ADMISSION_COUNTERS counters = Counters();
+        EXPECT_EQ(3u, counters.cAdmitted);
+        EXPECT_EQ(1u, counters.cRejected);
+        EXPECT_EQ(0u, counters.cInFlight);
+        EXPECT_EQ(0, requests[0].cCompletions.load());
+    }
+
+    TEST_F(AdmissionLimiterTest, QueuedRequestsTakeFreedSlots)
+    {
+        FAKE_REQUEST running, first, second, shed;
+        DWORD cOrder = 0;
+
+        Initialize(1, 2);
+
+        ASSERT_EQ(ADMISSION_ADMITTED, Enter(&running));
+        for (FAKE_REQUEST *pRequest : { &first, &second })
+        {
+            pRequest->pcOrder = &cOrder;
+            ASSERT_EQ(ADMISSION_QUEUED, Enter(pRequest));
+        }
+        EXPECT_EQ(ADMISSION_REJECTED, Enter(&shed));
+        EXPECT_EQ(2u, Counters().cWaiting);
+
+        //
+        // a slot goes to the oldest request while the queue moves.
+        //
+        _limiter.Leave(_ullNow);
+        EXPECT_EQ(1, first.cCompletions.load());
+        EXPECT_TRUE(first.fAdmitted);
+        EXPECT_EQ(0, second.cCompletions.load());
+
+        _limiter.Leave(_ullNow);
+        EXPECT_EQ(1, second.cCompletions.load());
+        EXPECT_TRUE(second.fAdmitted);
+        EXPECT_EQ(1u, second.dwOrder);
+
+        _limiter.Leave(_ullNow);
+
+        ADMISSION_COUNTERS counters = Counters();
+        EXPECT_EQ(2u, counters.cQueued);
+        EXPECT_EQ(2u, counters.cDequeued);
+        EXPECT_EQ(0u, counters.cLifo);
+        EXPECT_EQ(1u, counters.cRejected);
+        EXPECT_EQ(0u, counters.cWaiting);
+        EXPECT_EQ(0u, counters.cInFlight);
+
+        //
+        // the admitted requests' timeouts are gone.
+        //
+        AdvanceTo(_ullNow + TIMEOUT_MS * 2);
+        EXPECT_EQ(1, first.cCompletions.load());
+        EXPECT_EQ(0u, Counters().cTimedOut);
+    }
+
+    TEST_F(AdmissionLimiterTest, QueueTimeoutSheds)
+    {
+        FAKE_REQUEST running, waiting;
+        ULONGLONG ullQueued = _ullNow;
+
+        Initialize(1, 1);
+
+        ASSERT_EQ(ADMISSION_ADMITTED, Enter(&running));
+        ASSERT_EQ(ADMISSION_QUEUED, Enter(&waiting));
+
+        AdvanceTo(ullQueued + TIMEOUT_MS - TIMER_WHEEL::TICK_MS);
+        EXPECT_EQ(0, waiting.cCompletions.load());
+
+        AdvanceTo(ullQueued + TIMEOUT_MS);
+        EXPECT_EQ(1, waiting.cCompletions.load());
+        EXPECT_FALSE(waiting.fAdmitted);
+
+        //
+        // the slot freed later goes to nobody.
+        //
+        _limiter.Leave(_ullNow);
+        EXPECT_EQ(1, waiting.cCompletions.load());
+
+        ADMISSION_COUNTERS counters = Counters();
+        EXPECT_EQ(1u, counters.cTimedOut);
+        EXPECT_EQ(0u, counters.cDequeued);
+        EXPECT_EQ(0u, counters.cWaiting);
+        EXPECT_EQ(0u, counters.cInFlight);
+    }
+
+    TEST_F(AdmissionLimiterTest, BackedUpQueueServesNewestFirst)
+    {
+        FAKE_REQUEST running, oldest, newest;
+
+        Initialize(1, 4);
+
+        ASSERT_EQ(ADMISSION_ADMITTED, Enter(&running));
+        ASSERT_EQ(ADMISSION_QUEUED, Enter(&oldest));
+        _ullNow += TIMEOUT_MS / 4;
+        ASSERT_EQ(ADMISSION_QUEUED, Enter(&newest));
+
+        //
+        // the oldest has waited past half the timeout.
+        //
+        _ullNow += TIMEOUT_MS / 2;
+        _limiter.Leave(_ullNow);
+        EXPECT_EQ(1, newest.cCompletions.load());
+        EXPECT_TRUE(newest.fAdmitted);
+        EXPECT_EQ(0, oldest.cCompletions.load());
+        EXPECT_EQ(1u, Counters().cLifo);
+
+        AdvanceTo(_ullNow + TIMEOUT_MS);
+        EXPECT_EQ(1, oldest.cCompletions.load());
+        EXPECT_FALSE(oldest.fAdmitted);
+        EXPECT_EQ(1, newest.cCompletions.load());
+
+        _limiter.Leave(_ullNow);
+    }
+
+    TEST_F(AdmissionLimiterTest, HistogramsCountDepthAndWait)
+    {
+        FAKE_REQUEST running, requests[5];
+
+        EXPECT_EQ(0u, ADMISSION_LIMITER::HistogramBucket(0));
+        EXPECT_EQ(1u, ADMISSION_LIMITER::HistogramBucket(1));
+        EXPECT_EQ(2u, ADMISSION_LIMITER::HistogramBucket(2));
+        EXPECT_EQ(2u, ADMISSION_LIMITER::HistogramBucket(3));
+        EXPECT_EQ(11u, ADMISSION_LIMITER::HistogramBucket(1024));
+        EXPECT_EQ(ADMISSION_HISTOGRAM_BUCKETS - 1u, ADMISSION_LIMITER::HistogramBucket(MAXULONGLONG));
+
+        Initialize(1, 4);
+
+        ASSERT_EQ(ADMISSION_ADMITTED, Enter(&running));
+        for (FAKE_REQUEST &request : requests)
+        {
+            Enter(&request);
+        }
+
+        //
+        // the running request and the first queued found nobody waiting,
+        // the fifth found four and was shed.
+        //
+        ADMISSION_COUNTERS counters = Counters();
+        EXPECT_EQ(2u, counters.rgQueueDepth[0]);
+        EXPECT_EQ(1u, counters.rgQueueDepth[1]);
+        EXPECT_EQ(2u, counters.rgQueueDepth[2]);
+        EXPECT_EQ(1u, counters.rgQueueDepth[3]);
+
+        _ullNow += 100;
+        for (int i = 0; i < 4; i++)
+        {
+            _limiter.Leave(_ullNow);
+        }
+        _limiter.Leave(_ullNow);
+
+        counters = Counters();
+        EXPECT_EQ(4u, counters.rgWaitTimeMs[ADMISSION_LIMITER::HistogramBucket(100)]);
+        EXPECT_EQ(0u, counters.cInFlight);
+    }
+
+    TEST_F(AdmissionLimiterTest, ConcurrentRequestsStayUnderTheLimit)
+    {
+        const DWORD cThreads = 16;
+        const DWORD cRequests = 2000;
+        const LONG cMaxInFlight = 4;
+        ADMISSION_LIMITER limiter;
+        std::atomic<LONG> cInFlight(0);
+        std::atomic<LONG> cPeak(0);
+        std::atomic<DWORD> cServed(0);
+        std::atomic<DWORD> cShed(0);
+
+        //
+        // no timer, a queued request waits until it gets a slot.
+        //
+        ASSERT_EQ(S_OK, limiter.Initialize(cMaxInFlight, cThreads / 2, 0, NULL));
+
+        Benchmark::RunConcurrently(cThreads, [&](DWORD)
+        {
+            for (DWORD i = 0; i < cRequests; i++)
+            {
+                FAKE_REQUEST request;
+
+                switch (limiter.Enter(&request.waiter, GetTickCount64()))
+                {
+                case ADMISSION_QUEUED:
+                    while (request.cCompletions == 0)
+                    {
+                        std::this_thread::yield();
+                    }
+                    ASSERT_TRUE(request.fAdmitted);
+                    // fall through
+
+                case ADMISSION_ADMITTED:
+                {
+                    LONG cNow = ++cInFlight;
+                    LONG cSeen = cPeak;
+                    while (cNow > cSeen && !cPeak.compare_exchange_weak(cSeen, cNow))
+                    {
+                    }
+                    std::this_thread::yield();
+                    cInFlight--;
+                    cServed++;
+                    limiter.Leave(GetTickCount64());
+                    break;
+                }
+
+                default:
+                    cShed++;
+                    break;
+                }
+            }
+        });
+
+        ADMISSION_COUNTERS counters;
+        limiter.QueryCounters(&counters);
+
+        EXPECT_LE(cPeak.load(), cMaxInFlight);
+        EXPECT_EQ(cThreads * cRequests, cServed.load() + cShed.load());
+        EXPECT_EQ(static_cast<ULONGLONG>(cServed.load()), counters.cAdmitted + counters.cDequeued);
+        EXPECT_EQ(static_cast<ULONGLONG>(cShed.load()), counters.cRejected);
+        EXPECT_EQ(0u, counters.cInFlight);
+        EXPECT_EQ(0u, counters.cWaiting);
+    }
+}
@@ -0,0 +1,816 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#include "stdafx.h"
+#include "backendconnectionpool.h"
+
+#include <functional>
+#include <memory>
+#include <string>
+
+namespace BackendConnectionPoolTests
+{
+    //
+    // Stands in for the backend: echoes the body of every request, serves
+    // each connection on its own thread and counts them. Like Kestrel it
+    // closes a connection that stays idle for the keep-alive timeout, and
+    // one whose request asks for it.
+    //
+    class ECHO_SERVER
+    {
+    public:
+
+        ECHO_SERVER() :
+            m_transport(LOCAL_TRANSPORT_TCP),
+            m_usPort(0),
+            m_dwKeepAliveMs(0),
+            m_fStopping(false),
+            m_cAccepted(0)
+        {
+        }
+
+        ~ECHO_SERVER()
+        {
+            Stop();
+        }
+
+        HRESULT
+        Start(
+            LOCAL_TRANSPORT     transport,
+            DWORD               dwKeepAliveMs = 0
+        )
+        {
+            static std::atomic<DWORD> s_cServers(0);
+            HRESULT hr;
+
+            m_transport = transport;
+            m_dwKeepAliveMs = dwKeepAliveMs;
+
+            if (transport == LOCAL_TRANSPORT_UNIX_SOCKET)
+            {
+                m_strPath = (std::filesystem::temp_directory_path() /
+                             ("ancm-pool-test-" + std::to_string(GetCurrentProcessId()) + "-" + std::to_string(s_cServers++) + ".sock")).string();
+                std::error_code error;
+                std::filesystem::remove(m_strPath, error);
+            }
+
+            if (FAILED(hr = m_listener.Listen(transport, QueryPath(), &m_usPort)))
+            {
+                return hr;
+            }
+
+            m_acceptThread = std::thread([this]() { AcceptLoop(); });
+            return S_OK;
+        }
+
+        VOID
+        Stop()
+        {
+            if (!m_acceptThread.joinable())
+            {
+                return;
+            }
+
+            //
+            // Wake the accept up with a connection of our own, the ones
+            // being served end when their clients close them or go idle.
+            //
+            m_fStopping = true;
+            LOCAL_SOCKET wake;
+            wake.Connect(m_transport, QueryPath(), m_usPort);
+            m_acceptThread.join();
+            wake.Close();
+
+            for (auto& thread : m_connectionThreads)
+            {
+                thread.join();
+            }
+            m_connectionThreads.clear();
+            m_listener.Close();
+
+            if (!m_strPath.empty())
+            {
+                std::error_code error;
+                std::filesystem::remove(m_strPath, error);
+            }
+        }
+
+        PCSTR
+        QueryPath() const
+        {
+            return m_strPath.empty() ? NULL : m_strPath.c_str();
+        }
+
+        USHORT
+        QueryPort() const
+        {
+            return m_usPort;
+        }
+
+        //
+        // Connections accepted so far, polled since accepting runs on its
+        // own thread.
+        //
+        DWORD
+        WaitForAccepted(
+            DWORD   cExpected
+        ) const
+        {
+            for (DWORD i = 0; i < 200 && m_cAccepted < cExpected; i++)
+            {
+                Sleep(5);
+            }
+            return m_cAccepted;
+        }
+
+    private:
+
+        VOID
+        AcceptLoop()
+        {
+            for (;;)
+            {
+                std::shared_ptr<LOCAL_SOCKET> client = std::make_shared<LOCAL_SOCKET>();
+
+                if (FAILED(m_listener.Accept(client.get())) || m_fStopping)
+                {
+                    return;
+                }
+
+                m_cAccepted++;
+                m_connectionThreads.emplace_back([this, client]() { Serve(client.get()); });
+            }
+        }
+
+        VOID
+        Serve(
+            LOCAL_SOCKET *  pClient
+        )
+        {
+            std::string pending;
+            CHAR        rgchBuffer[4096];
+            DWORD       cbReceived;
+
+            //
+            // An idle connection closes when a receive times out.
+            //
+            pClient->SetTimeout(m_dwKeepAliveMs != 0 ? m_dwKeepAliveMs : 10000);
+
+            for (;;)
+            {
+                size_t cchHead;
+                while ((cchHead = pending.find("\r\n\r\n")) == std::string::npos)
+                {
+                    if (FAILED(pClient->Receive(rgchBuffer, sizeof(rgchBuffer), &cbReceived)) || cbReceived == 0)
+                    {
+                        return;
+                    }
+                    pending.append(rgchBuffer, cbReceived);
+                }
+
+                std::string head = pending.substr(0, cchHead + 4);
+                pending.erase(0, cchHead + 4);
+
+                for (auto& ch : head)
+                {
+                    ch = static_cast<CHAR>(tolower(ch));
+                }
+
+                size_t cbBody = 0;
+                size_t ichLength = head.find("\ncontent-length:");
+                if (ichLength != std::string::npos)
+                {
+                    cbBody = strtoul(head.c_str() + ichLength + 16, NULL, 10);
+                }
+
+                while (pending.size() < cbBody)
+                {
+                    if (FAILED(pClient->Receive(rgchBuffer, sizeof(rgchBuffer), &cbReceived)) || cbReceived == 0)
+                    {
+                        return;
+                    }
+                    pending.append(rgchBuffer, cbReceived);
+                }
+
+                std::string body = pending.substr(0, cbBody);
+                pending.erase(0, cbBody);
+
+                bool fClose = head.find("\nconnection: close") != std::string::npos;
+                std::string response = "HTTP/1.1 200 OK\r\nContent-Length: " + std::to_string(body.size()) +
+                                       (fClose ? "\r\nConnection: close" : "") + "\r\n\r\n" + body;
+                if (FAILED(pClient->Send(response.data(), static_cast<DWORD>(response.size()))) || fClose)
+                {
+                    return;
+                }
+            }
+        }
+
+        LOCAL_TRANSPORT             m_transport;
+        std::string                 m_strPath;
+        USHORT                      m_usPort;
+        DWORD                       m_dwKeepAliveMs;
+        LOCAL_SOCKET                m_listener;
+        std::atomic<bool>           m_fStopping;
+        std::atomic<DWORD>          m_cAccepted;
+        std::thread                 m_acceptThread;
+        std::vector<std::thread>    m_connectionThreads;
+    };
+
+    class BackendConnectionPoolTest : public testing::Test
+    {
+    protected:
+
+        static
+        VOID
+        SetUpTestCase()
+        {
+            WSADATA wsaData;
+            WSAStartup(MAKEWORD(2, 2), &wsaData);
+        }
+
+        void TearDown() override
+        {
+            if (_pPool != NULL)
+            {
+                _pPool->Shutdown();
+                _pPool->DereferenceConnectionPool();
+                _pPool = NULL;
+            }
+            _server.Stop();
+        }
+
+        void StartPool(
+            DWORD           cMinIdle,
+            DWORD           cMaxConnections,
+            DWORD           dwIdleTimeoutMs = 60000,
+            DWORD           dwTimeoutMs = 10000,
+            TIMER_WHEEL *   pTimerWheel = NULL,
+            DWORD           dwKeepAliveMs = 0
+        )
+        {
+            ASSERT_EQ(S_OK, _server.Start(LOCAL_TRANSPORT_UNIX_SOCKET, dwKeepAliveMs));
+
+            _pPool = new BACKEND_CONNECTION_POOL();
+            ASSERT_EQ(S_OK, _pPool->Initialize(LOCAL_TRANSPORT_UNIX_SOCKET,
+                                               _server.QueryPath(),
+                                               0,
+                                               dwTimeoutMs,
+                                               16 * 1024,
+                                               cMinIdle,
+                                               cMaxConnections,
+                                               dwIdleTimeoutMs,
+                                               pTimerWheel));
+        }
+
+        //
+        // One request with body on pConnection, the response is read to
+        // its end.
+        //
+        static
+        HRESULT
+        Echo(
+            POOLED_CONNECTION *     pConnection,
+            const std::string &     body,
+            _Out_ std::string *     pResponseBody,
+            bool                    fClose = false
+        )
+        {
+            HRESULT hr;
+            PSTR    pszHead;
+            DWORD   cchHead;
+            USHORT  uStatus;
+            BYTE    rgbBuffer[4096];
+            DWORD   cbRead;
+
+            std::string request = "POST /echo HTTP/1.1\r\nHost: localhost\r\nContent-Length: " + std::to_string(body.size()) +
+                                  (fClose ? "\r\nConnection: close" : "") + "\r\n\r\n" + body;
+
+            pResponseBody->clear();
+
+            if (FAILED(hr = pConnection->connection.Send(request.data(), static_cast<DWORD>(request.size()))) ||
+                FAILED(hr = pConnection->connection.ReceiveResponseHead(FALSE, &pszHead, &cchHead, &uStatus)))
+            {
+                return hr;
+            }
+
+            do
+            {
+                if (FAILED(hr = pConnection->connection.ReadBody(rgbBuffer, sizeof(rgbBuffer), &cbRead)))
+                {
+                    return hr;
+                }
+                pResponseBody->append(reinterpret_cast<PCSTR>(rgbBuffer), cbRead);
+            } while (cbRead != 0);
+
+            return uStatus == 200 ? S_OK : E_FAIL;
+        }
+
+        BACKEND_POOL_COUNTERS Counters()
+        {
+            BACKEND_POOL_COUNTERS counters;
+            _pPool->QueryCounters(&counters);
+            return counters;
+        }
+
+        ECHO_SERVER                 _server;
+        BACKEND_CONNECTION_POOL *   _pPool = NULL;
+    };
+
+    TEST_F(BackendConnectionPoolTest, ReusesReleasedConnection)
+    {
+        POOLED_CONNECTION * pFirst;
+        POOLED_CONNECTION * pSecond;
+        BOOL                fReused;
+        std::string         response;
+
+        StartPool(0, 4);
+
+        ASSERT_EQ(S_OK, _pPool->Acquire(&pFirst, &fReused));
+        EXPECT_FALSE(fReused);
+        ASSERT_EQ(S_OK, Echo(pFirst, "hello", &response));
+        EXPECT_EQ("hello", response);
+        _pPool->Release(pFirst, TRUE, GetTickCount64());
+
+        ASSERT_EQ(S_OK, _pPool->Acquire(&pSecond, &fReused));
+        EXPECT_TRUE(fReused);
+        EXPECT_EQ(pFirst, pSecond);
+        ASSERT_EQ(S_OK, Echo(pSecond, "again", &response));
+        EXPECT_EQ("again", response);
+        _pPool->Release(pSecond, TRUE, GetTickCount64());
+
+        BACKEND_POOL_COUNTERS counters = Counters();
+        EXPECT_EQ(1, counters.cConnects);
+        EXPECT_EQ(1, counters.cReused);
+        EXPECT_EQ(1, counters.cIdle);
+        EXPECT_EQ(0, counters.cActive);
+        EXPECT_EQ(1, _server.WaitForAccepted(1));
+    }
+
+    TEST_F(BackendConnectionPoolTest, HandsOutMostRecentlyUsedFirst)
+    {
+        POOLED_CONNECTION * pFirst;
+        POOLED_CONNECTION * pSecond;
+        POOLED_CONNECTION * pConnection;
+        BOOL                fReused;
+
+        StartPool(0, 4);
+
+        ASSERT_EQ(S_OK, _pPool->Acquire(&pFirst, &fReused));
+        ASSERT_EQ(S_OK, _pPool->Acquire(&pSecond, &fReused));
+        _pPool->Release(pFirst, TRUE, GetTickCount64());
+        _pPool->Release(pSecond, TRUE, GetTickCount64());
+
+        ASSERT_EQ(S_OK, _pPool->Acquire(&pConnection, &fReused));
+        EXPECT_EQ(pSecond, pConnection);
+        _pPool->Release(pConnection, TRUE, GetTickCount64());
+    }
+
+    TEST_F(BackendConnectionPoolTest, WarmupOpensMinIdleConnections)
+    {
+        POOLED_CONNECTION * pConnection;
+        BOOL                fReused;
+
+        StartPool(3, 8);
+
+        EXPECT_EQ(3, _pPool->Warmup());
+        EXPECT_EQ(0, _pPool->Warmup());
+        EXPECT_EQ(3, _server.WaitForAccepted(3));
+
+        BACKEND_POOL_COUNTERS counters = Counters();
+        EXPECT_EQ(3, counters.cWarmed);
+        EXPECT_EQ(3, counters.cIdle);
+
+        //
+        // The first request pays no connect.
+        //
+        ASSERT_EQ(S_OK, _pPool->Acquire(&pConnection, &fReused));
+        EXPECT_TRUE(fReused);
+        _pPool->Release(pConnection, TRUE, GetTickCount64());
+        EXPECT_EQ(3, Counters().cConnects);
+    }
+
+    TEST_F(BackendConnectionPoolTest, WarmupStaysUnderTheCap)
+    {
+        POOLED_CONNECTION * rgConnections[3];
+        BOOL                fReused;
+
+        StartPool(2, 4);
+
+        for (auto& pConnection : rgConnections)
+        {
+            ASSERT_EQ(S_OK, _pPool->Acquire(&pConnection, &fReused));
+        }
+
+        EXPECT_EQ(1, _pPool->Warmup());
+
+        for (auto pConnection : rgConnections)
+        {
+            _pPool->Release(pConnection, TRUE, GetTickCount64());
+        }
+        EXPECT_EQ(4, Counters().cIdle);
+    }
+
+    TEST_F(BackendConnectionPoolTest, EvictsIdleConnectionsDownToMinIdle)
+    {
+        POOLED_CONNECTION * rgConnections[3];
+        BOOL                fReused;
+        ULONGLONG           ullNow = GetTickCount64();
+
+        StartPool(1, 8, 1000);
+
+        for (auto& pConnection : rgConnections)
+        {
+            ASSERT_EQ(S_OK, _pPool->Acquire(&pConnection, &fReused));
+        }
+        for (auto pConnection : rgConnections)
+        {
+            _pPool->Release(pConnection, TRUE, ullNow);
+        }
+
+        EXPECT_EQ(0, _pPool->EvictIdle(ullNow + 999));
+        EXPECT_EQ(2, _pPool->EvictIdle(ullNow + 1000));
+        EXPECT_EQ(0, _pPool->EvictIdle(ullNow + 5000));
+
+        BACKEND_POOL_COUNTERS counters = Counters();
+        EXPECT_EQ(2, counters.cEvicted);
+        EXPECT_EQ(1, counters.cIdle);
+    }
+
+    TEST_F(BackendConnectionPoolTest, EvictsLeastRecentlyUsedFirst)
+    {
+        POOLED_CONNECTION * pOld;
+        POOLED_CONNECTION * pRecent;
+        POOLED_CONNECTION * pConnection;
+        BOOL                fReused;
+        ULONGLONG           ullNow = GetTickCount64();
+
+        StartPool(0, 8, 1000);
+
+        ASSERT_EQ(S_OK, _pPool->Acquire(&pOld, &fReused));
+        ASSERT_EQ(S_OK, _pPool->Acquire(&pRecent, &fReused));
+        _pPool->Release(pOld, TRUE, ullNow);
+        _pPool->Release(pRecent, TRUE, ullNow + 600);
+
+        EXPECT_EQ(1, _pPool->EvictIdle(ullNow + 1000));
+
+        ASSERT_EQ(S_OK, _pPool->Acquire(&pConnection, &fReused));
+        EXPECT_EQ(pRecent, pConnection);
+        _pPool->Release(pConnection, TRUE, ullNow + 1000);
+    }
+
+    TEST_F(BackendConnectionPoolTest, WaitsForAReleasedConnectionAtTheCap)
+    {
+        POOLED_CONNECTION *             pConnection;
+        std::atomic<POOLED_CONNECTION *> pWaited(NULL);
+        BOOL                            fReused;
+
+        StartPool(0, 1);
+
+        ASSERT_EQ(S_OK, _pPool->Acquire(&pConnection, &fReused));
+
+        std::thread waiter([&]()
+        {
+            POOLED_CONNECTION * p;
+            BOOL                f;
+            if (SUCCEEDED(_pPool->Acquire(&p, &f)))
+            {
+                pWaited = p;
+            }
+        });
+
+        Sleep(50);
+        EXPECT_EQ(NULL, pWaited.load());
+        _pPool->Release(pConnection, TRUE, GetTickCount64());
+        waiter.join();
+
+        EXPECT_EQ(pConnection, pWaited.load());
+        _pPool->Release(pWaited, TRUE, GetTickCount64());
+
+        BACKEND_POOL_COUNTERS counters = Counters();
+        EXPECT_EQ(1, counters.cWaits);
+        EXPECT_EQ(0, counters.cWaitTimeouts);
+        EXPECT_EQ(1, counters.cConnects);
+    }
+
+    TEST_F(BackendConnectionPoolTest, FailsBusyWhenTheCapHoldsForTheTimeout)
+    {
+        POOLED_CONNECTION * pConnection;
+        POOLED_CONNECTION * pOther;
+        BOOL                fReused;
+
+        StartPool(0, 1, 60000, 100);
+
+        ASSERT_EQ(S_OK, _pPool->Acquire(&pConnection, &fReused));
+
+        ULONGLONG ullStart = GetTickCount64();
+        EXPECT_EQ(HRESULT_FROM_WIN32(ERROR_BUSY), _pPool->Acquire(&pOther, &fReused));
+        EXPECT_LE(90, GetTickCount64() - ullStart);
+        EXPECT_EQ(NULL, pOther);
+
+        _pPool->Release(pConnection, TRUE, GetTickCount64());
+
+        BACKEND_POOL_COUNTERS counters = Counters();
+        EXPECT_EQ(1, counters.cWaits);
+        EXPECT_EQ(1, counters.cWaitTimeouts);
+    }
+
+    //
+    // Counts the callbacks of a POOL_WAITER.
+    //
+    static
+    VOID
+    CountCallback(
+        PVOID       pvContext
+    )
+    {
+        (*static_cast<std::atomic<int> *>(pvContext))++;
+    }
+
+    TEST_F(BackendConnectionPoolTest, AcquireAsyncHandsAReleasedConnectionToTheQueue)
+    {
+        POOLED_CONNECTION * pConnection;
+        POOLED_CONNECTION * pOther;
+        POOL_WAITER         waiter;
+        std::atomic<int>    cCallbacks(0);
+        BOOL                fReused;
+
+        StartPool(0, 1);
+        BACKEND_CONNECTION_POOL::InitializeWaiter(&waiter, CountCallback, &cCallbacks);
+
+        ASSERT_EQ(S_OK, _pPool->AcquireAsync(&waiter, &pConnection, &fReused));
+        EXPECT_FALSE(fReused);
+
+        EXPECT_EQ(HRESULT_FROM_WIN32(ERROR_IO_PENDING), _pPool->AcquireAsync(&waiter, &pOther, &fReused));
+        EXPECT_EQ(NULL, pOther);
+        EXPECT_EQ(0, cCallbacks.load());
+
+        _pPool->Release(pConnection, TRUE, GetTickCount64());
+        EXPECT_EQ(1, cCallbacks.load());
+
+        ASSERT_EQ(S_OK, _pPool->CompleteWait(&waiter, &pOther, &fReused));
+        EXPECT_EQ(pConnection, pOther);
+        EXPECT_TRUE(fReused);
+        _pPool->Release(pOther, TRUE, GetTickCount64());
+
+        BACKEND_POOL_COUNTERS counters = Counters();
+        EXPECT_EQ(1, counters.cWaits);
+        EXPECT_EQ(1, counters.cConnects);
+        EXPECT_EQ(1, counters.cIdle);
+        EXPECT_EQ(0, counters.cActive);
+    }
+
+    TEST_F(BackendConnectionPoolTest, AcquireAsyncHandsTheSlotOfADiscardedConnection)
+    {
+        POOLED_CONNECTION * pConnection;
+        POOLED_CONNECTION * pOther;
+        POOL_WAITER         waiter;
+        std::atomic<int>    cCallbacks(0);
+        BOOL                fReused;
+        std::string         response;
+
+        StartPool(0, 1);
+        BACKEND_CONNECTION_POOL::InitializeWaiter(&waiter, CountCallback, &cCallbacks);
+
+        ASSERT_EQ(S_OK, _pPool->Acquire(&pConnection, &fReused));
+        EXPECT_EQ(HRESULT_FROM_WIN32(ERROR_IO_PENDING), _pPool->AcquireAsync(&waiter, &pOther, &fReused));
+
+        _pPool->Release(pConnection, FALSE, GetTickCount64());
+        EXPECT_EQ(1, cCallbacks.load());
+        EXPECT_EQ(1, Counters().cActive);
+
+        ASSERT_EQ(S_OK, _pPool->CompleteWait(&waiter, &pOther, &fReused));
+        EXPECT_FALSE(fReused);
+        ASSERT_EQ(S_OK, Echo(pOther, "slot", &response));
+        EXPECT_EQ("slot", response);
+        _pPool->Release(pOther, TRUE, GetTickCount64());
+
+        BACKEND_POOL_COUNTERS counters = Counters();
+        EXPECT_EQ(2, counters.cConnects);
+        EXPECT_EQ(1, counters.cDiscarded);
+        EXPECT_EQ(0, counters.cActive);
+    }
+
+    TEST_F(BackendConnectionPoolTest, CancelWaitTakesTheWaiterBack)
+    {
+        POOLED_CONNECTION * pConnection;
+        POOLED_CONNECTION * pOther;
+        POOL_WAITER         waiter;
+        std::atomic<int>    cCallbacks(0);
+        BOOL                fReused;
+
+        StartPool(0, 1);
+        BACKEND_CONNECTION_POOL::InitializeWaiter(&waiter, CountCallback, &cCallbacks);
+
+        ASSERT_EQ(S_OK, _pPool->Acquire(&pConnection, &fReused));
+        EXPECT_EQ(HRESULT_FROM_WIN32(ERROR_IO_PENDING), _pPool->AcquireAsync(&waiter, &pOther, &fReused));
+
+        EXPECT_TRUE(_pPool->CancelWait(&waiter));
+        EXPECT_FALSE(_pPool->CancelWait(&waiter));
+
+        _pPool->Release(pConnection, TRUE, GetTickCount64());
+        EXPECT_EQ(0, cCallbacks.load());
+
+        BACKEND_POOL_COUNTERS counters = Counters();
+        EXPECT_EQ(1, counters.cWaitTimeouts);
+        EXPECT_EQ(1, counters.cIdle);
+        EXPECT_EQ(0, counters.cActive);
+    }
+
+    TEST_F(BackendConnectionPoolTest, ShutdownFailsQueuedWaiters)
+    {
+        POOLED_CONNECTION * pConnection;
+        POOLED_CONNECTION * pOther;
+        POOL_WAITER         waiter;
+        std::atomic<int>    cCallbacks(0);
+        BOOL                fReused;
+
+        StartPool(0, 1);
+        BACKEND_CONNECTION_POOL::InitializeWaiter(&waiter, CountCallback, &cCallbacks);
+
+        ASSERT_EQ(S_OK, _pPool->Acquire(&pConnection, &fReused));
+        EXPECT_EQ(HRESULT_FROM_WIN32(ERROR_IO_PENDING), _pPool->AcquireAsync(&waiter, &pOther, &fReused));
+
+        _pPool->Shutdown();
+        EXPECT_EQ(1, cCallbacks.load());
+        EXPECT_EQ(HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED), _pPool->CompleteWait(&waiter, &pOther, &fReused));
+
+        _pPool->Release(pConnection, TRUE, GetTickCount64());
+        EXPECT_EQ(0, Counters().cActive);
+    }
+
+    TEST_F(BackendConnectionPoolTest, DiscardsConnectionsThatCannotBeReused)
+    {
+        POOLED_CONNECTION * pConnection;
+        BOOL                fReused;
+        std::string         response;
+
+        StartPool(0, 4);
+
+        //
+        // The backend closes it after the response.
+        //
+        ASSERT_EQ(S_OK, _pPool->Acquire(&pConnection, &fReused));
+        ASSERT_EQ(S_OK, Echo(pConnection, "bye", &response, true));
+        EXPECT_FALSE(pConnection->connection.IsReusable());
+        _pPool->Release(pConnection, TRUE, GetTickCount64());
+
+        //
+        // The request failed.
+        //
+        ASSERT_EQ(S_OK, _pPool->Acquire(&pConnection, &fReused));
+        EXPECT_FALSE(fReused);
+        _pPool->Release(pConnection, FALSE, GetTickCount64());
+
+        BACKEND_POOL_COUNTERS counters = Counters();
+        EXPECT_EQ(2, counters.cDiscarded);
+        EXPECT_EQ(0, counters.cIdle);
+        EXPECT_EQ(0, counters.cActive);
+    }
+
+    TEST_F(BackendConnectionPoolTest, DropsIdleConnectionsClosedByTheBackend)
+    {
+        POOLED_CONNECTION * pConnection;
+        BOOL                fReused;
+        std::string         response;
+
+        StartPool(0, 4, 60000, 10000, NULL, 100);
+
+        ASSERT_EQ(S_OK, _pPool->Acquire(&pConnection, &fReused));
+        ASSERT_EQ(S_OK, Echo(pConnection, "one", &response));
+        _pPool->Release(pConnection, TRUE, GetTickCount64());
+
+        //
+        // Past the keep-alive timeout of the backend.
+        //
+        Sleep(300);
+
+        ASSERT_EQ(S_OK, _pPool->Acquire(&pConnection, &fReused));
+        EXPECT_FALSE(fReused);
+        ASSERT_EQ(S_OK, Echo(pConnection, "two", &response));
+        EXPECT_EQ("two", response);
+        _pPool->Release(pConnection, TRUE, GetTickCount64());
+
+        BACKEND_POOL_COUNTERS counters = Counters();
+        EXPECT_EQ(1, counters.cStale);
+        EXPECT_EQ(2, counters.cConnects);
+    }
+
+    TEST_F(BackendConnectionPoolTest, UnpooledOpensAConnectionPerRequest)
+    {
+        POOLED_CONNECTION * pConnection;
+        BOOL                fReused;
+        std::string         response;
+
+        StartPool(0, 0);
+
+        for (int i = 0; i < 3; i++)
+        {
+            ASSERT_EQ(S_OK, _pPool->Acquire(&pConnection, &fReused));
+            EXPECT_FALSE(fReused);
+            ASSERT_EQ(S_OK, Echo(pConnection, "x", &response));
+            _pPool->Release(pConnection, TRUE, GetTickCount64());
+        }
+
+        EXPECT_EQ(0, _pPool->Warmup());
+
+        BACKEND_POOL_COUNTERS counters = Counters();
+        EXPECT_EQ(3, counters.cConnects);
+        EXPECT_EQ(0, counters.cReused);
+        EXPECT_EQ(0, counters.cIdle);
+        EXPECT_EQ(0, counters.cDiscarded);
+    }
+
+    TEST_F(BackendConnectionPoolTest, ShutdownClosesIdleConnections)
+    {
+        POOLED_CONNECTION * pIdle;
+        POOLED_CONNECTION * pHeld;
+        POOLED_CONNECTION * pConnection;
+        BOOL                fReused;
+
+        StartPool(0, 4);
+
+        ASSERT_EQ(S_OK, _pPool->Acquire(&pIdle, &fReused));
+        ASSERT_EQ(S_OK, _pPool->Acquire(&pHeld, &fReused));
+        _pPool->Release(pIdle, TRUE, GetTickCount64());
+
+        _pPool->Shutdown();
+        EXPECT_EQ(0, Counters().cIdle);
+
+        EXPECT_EQ(HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED), _pPool->Acquire(&pConnection, &fReused));
+
+        //
+        // A connection held across the shutdown is closed when it comes
+        // back.
+        //
+        _pPool->Release(pHeld, TRUE, GetTickCount64());
+        EXPECT_EQ(0, Counters().cIdle);
+        EXPECT_EQ(0, Counters().cActive);
+    }
+
+    TEST_F(BackendConnectionPoolTest, FailsToConnectWithoutABackend)
+    {
+        POOLED_CONNECTION * pConnection;
+        BOOL                fReused;
+
+        StartPool(0, 4);
+        _server.Stop();
+
+        EXPECT_TRUE(FAILED(_pPool->Acquire(&pConnection, &fReused)));
+
+        BACKEND_POOL_COUNTERS counters = Counters();
+        EXPECT_EQ(1, counters.cConnectFailures);
+        EXPECT_EQ(0, counters.cActive);
+    }
+
+    TEST_F(BackendConnectionPoolTest, TimerEvictsAndRefillsToMinIdle)
+    {
+        TIMER_WHEEL         wheel;
+        POOLED_CONNECTION * rgConnections[4];
+        BOOL                fReused;
+
+        ASSERT_EQ(S_OK, wheel.Initialize(FALSE));
+        StartPool(2, 4, 100, 10000, &wheel);
+
+        for (auto& pConnection : rgConnections)
+        {
+            ASSERT_EQ(S_OK, _pPool->Acquire(&pConnection, &fReused));
+        }
+        for (auto pConnection : rgConnections)
+        {
+            _pPool->Release(pConnection, TRUE, GetTickCount64());
+        }
+
+        //
+        // The idle timeout passes, two are kept.
+        //
+        Sleep(150);
+        wheel.Advance(GetTickCount64());
+        EXPECT_EQ(2, Counters().cEvicted);
+        EXPECT_EQ(2, Counters().cIdle);
+
+        //
+        // Requests take the idle ones, the next tick opens two more.
+        //
+        ASSERT_EQ(S_OK, _pPool->Acquire(&rgConnections[0], &fReused));
+        ASSERT_EQ(S_OK, _pPool->Acquire(&rgConnections[1], &fReused));
+        Sleep(60);
+        wheel.Advance(GetTickCount64());
+
+        for (int i = 0; i < 200 && Counters().cIdle < 2; i++)
+        {
+            Sleep(5);
+        }
+        EXPECT_EQ(2, Counters().cIdle);
+        EXPECT_EQ(2, Counters().cWarmed);
+
+        _pPool->Release(rgConnections[0], TRUE, GetTickCount64());
+        _pPool->Release(rgConnections[1], TRUE, GetTickCount64());
+
+        //
+        // The pool takes the entry off the wheel before the wheel goes.
+        //
+        _pPool->Shutdown();
+        _pPool->DereferenceConnectionPool();
+        _pPool = NULL;
+    }
+}
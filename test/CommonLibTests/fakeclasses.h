@@ -188,3 +188,56 @@ public:
     }
 };
 
+
+//
+// Stands in for IHttpContext where code only needs the raw request and
+// the server variables, and takes the context as a template argument.
+//
+class FakeHttpRequest
+{
+public:
+    FakeHttpRequest()
+    {
+        ZeroMemory(&m_request, sizeof(m_request));
+    }
+
+    HTTP_REQUEST * GetRawHttpRequest()
+    {
+        return &m_request;
+    }
+
+private:
+    HTTP_REQUEST m_request;
+};
+
+class FakeHttpContext
+{
+public:
+    FakeHttpRequest * GetRequest()
+    {
+        return &m_request;
+    }
+
+    VOID SetServerVariable(PCSTR pszName, PCWSTR pszValue)
+    {
+        m_serverVariables.emplace_back(pszName, pszValue);
+    }
+
+    HRESULT GetServerVariable(PCSTR pszName, PCWSTR * ppszValue, DWORD * pcchValue)
+    {
+        for (auto &variable : m_serverVariables)
+        {
+            if (variable.first == pszName)
+            {
+                *ppszValue = variable.second.c_str();
+                *pcchValue = static_cast<DWORD>(variable.second.size());
+                return S_OK;
+            }
+        }
+        return HRESULT_FROM_WIN32(ERROR_INVALID_INDEX);
+    }
+
+private:
+    FakeHttpRequest m_request;
+    std::vector<std::pair<std::string, std::wstring>> m_serverVariables;
+};
@@ -0,0 +1,1090 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#include "stdafx.h"
+#include "h2channel.h"
+
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+
+namespace H2ConnectionTests
+{
+    struct TEST_REQUEST
+    {
+        std::vector<std::pair<std::string, std::string>> headers;
+        std::string body;
+
+        std::string
+        Header(
+            const std::string & name
+        ) const
+        {
+            for (auto& header : headers)
+            {
+                if (header.first == name)
+                {
+                    return header.second;
+                }
+            }
+            return "<none>";
+        }
+    };
+
+    struct TEST_RESPONSE
+    {
+        std::string status = "200";
+        std::vector<std::pair<std::string, std::string>> headers;
+        std::string body;
+        bool fInterim = false;
+        bool fTrailers = false;
+        bool fRefuse = false;
+        bool fGoAway = false;
+        DWORD dwDelayMs = 0;
+    };
+
+    //
+    // Stands in for an h2c backend: takes the connection preface, answers
+    // every stream from its own thread with what the responder returns for
+    // it, and keeps to the flow control windows of the client. As an
+    // HTTP/1.1 server it answers the preface with 400 instead.
+    //
+    class STAND_IN_H2_SERVER
+    {
+    public:
+
+        typedef std::function<VOID(const TEST_REQUEST & request, TEST_RESPONSE * pResponse)> RESPONDER;
+
+        STAND_IN_H2_SERVER() :
+            m_usPort(0),
+            m_cMaxStreams(0),
+            m_cbInitialWindow(0),
+            m_fHttp1(false),
+            m_fStopping(false),
+            m_cConnections(0)
+        {
+        }
+
+        ~STAND_IN_H2_SERVER()
+        {
+            Stop();
+        }
+
+        HRESULT
+        Start(
+            RESPONDER       responder,
+            DWORD           cMaxStreams = 0,
+            DWORD           cbInitialWindow = 0,
+            bool            fHttp1 = false
+        )
+        {
+            HRESULT hr;
+
+            m_responder = responder;
+            m_cMaxStreams = cMaxStreams;
+            m_cbInitialWindow = cbInitialWindow;
+            m_fHttp1 = fHttp1;
+
+            if (FAILED(hr = m_listener.Listen(LOCAL_TRANSPORT_TCP, NULL, &m_usPort)))
+            {
+                return hr;
+            }
+
+            m_acceptThread = std::thread([this]() { AcceptLoop(); });
+            return S_OK;
+        }
+
+        VOID
+        Stop()
+        {
+            if (!m_acceptThread.joinable())
+            {
+                return;
+            }
+
+            m_fStopping = true;
+            LOCAL_SOCKET wake;
+            wake.Connect(LOCAL_TRANSPORT_TCP, NULL, m_usPort);
+            m_acceptThread.join();
+            wake.Close();
+
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                for (auto& client : m_clients)
+                {
+                    client->Shutdown();
+                }
+            }
+            for (auto& thread : m_connectionThreads)
+            {
+                thread.join();
+            }
+            m_connectionThreads.clear();
+            m_listener.Close();
+        }
+
+        USHORT
+        QueryPort() const
+        {
+            return m_usPort;
+        }
+
+        DWORD
+        QueryConnectionCount() const
+        {
+            return m_cConnections;
+        }
+
+        //
+        // The error codes of the RST_STREAM frames received, by stream.
+        //
+        std::map<DWORD, DWORD>
+        QueryResets()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_resets;
+        }
+
+    private:
+
+        struct STREAM
+        {
+            TEST_REQUEST    request;
+            LONGLONG        llSendWindow = 0;
+            bool            fCancelled = false;
+        };
+
+        struct CONNECTION
+        {
+            LOCAL_SOCKET *                          pClient;
+            std::mutex                              sendMutex;
+            HPACK_ENCODER                           encoder;
+            std::mutex                              mutex;
+            std::condition_variable                 cvWindow;
+            LONGLONG                                llSendWindow = 65535;
+            LONGLONG                                llInitialWindow = 65535;
+            std::map<DWORD, std::shared_ptr<STREAM>> streams;
+            bool                                    fClosed = false;
+        };
+
+        VOID
+        AcceptLoop()
+        {
+            for (;;)
+            {
+                std::shared_ptr<LOCAL_SOCKET> client = std::make_shared<LOCAL_SOCKET>();
+
+                if (FAILED(m_listener.Accept(client.get())) || m_fStopping)
+                {
+                    return;
+                }
+
+                m_cConnections++;
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_clients.push_back(client);
+                }
+                m_connectionThreads.emplace_back([this, client]() { Serve(client.get()); });
+            }
+        }
+
+        static
+        bool
+        ReceiveExact(
+            LOCAL_SOCKET *  pClient,
+            BYTE *          pb,
+            DWORD           cb
+        )
+        {
+            DWORD cbReceived;
+
+            while (cb != 0)
+            {
+                if (FAILED(pClient->Receive(pb, cb, &cbReceived)) || cbReceived == 0)
+                {
+                    return false;
+                }
+                pb += cbReceived;
+                cb -= cbReceived;
+            }
+            return true;
+        }
+
+        static
+        VOID
+        WriteFrame(
+            CONNECTION *        pConnection,
+            BYTE                type,
+            BYTE                flags,
+            DWORD               dwStreamId,
+            const VOID *        pvPayload,
+            DWORD               cbPayload
+        )
+        {
+            std::string frame(9, '\0');
+
+            frame[0] = static_cast<CHAR>(cbPayload >> 16);
+            frame[1] = static_cast<CHAR>(cbPayload >> 8);
+            frame[2] = static_cast<CHAR>(cbPayload);
+            frame[3] = static_cast<CHAR>(type);
+            frame[4] = static_cast<CHAR>(flags);
+            frame[5] = static_cast<CHAR>(dwStreamId >> 24);
+            frame[6] = static_cast<CHAR>(dwStreamId >> 16);
+            frame[7] = static_cast<CHAR>(dwStreamId >> 8);
+            frame[8] = static_cast<CHAR>(dwStreamId);
+            if (cbPayload != 0)
+            {
+                frame.append(static_cast<const CHAR *>(pvPayload), cbPayload);
+            }
+            pConnection->pClient->Send(frame.data(), static_cast<DWORD>(frame.size()));
+        }
+
+        static
+        std::string
+        UInt32(
+            DWORD       dwValue
+        )
+        {
+            std::string bytes(4, '\0');
+
+            bytes[0] = static_cast<CHAR>(dwValue >> 24);
+            bytes[1] = static_cast<CHAR>(dwValue >> 16);
+            bytes[2] = static_cast<CHAR>(dwValue >> 8);
+            bytes[3] = static_cast<CHAR>(dwValue);
+            return bytes;
+        }
+
+        static
+        HRESULT
+        AddRequestHeader(
+            PVOID       pvContext,
+            PCSTR       pszName,
+            DWORD       cchName,
+            PCSTR       pszValue,
+            DWORD       cchValue
+        )
+        {
+            static_cast<TEST_REQUEST *>(pvContext)->headers.emplace_back(std::string(pszName, cchName), std::string(pszValue, cchValue));
+            return S_OK;
+        }
+
+        VOID
+        Serve(
+            LOCAL_SOCKET *  pClient
+        )
+        {
+            static const CHAR   s_szPreface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+            BYTE                rgbPreface[sizeof(s_szPreface) - 1];
+            CONNECTION          connection;
+            HPACK_DECODER       decoder;
+            std::vector<std::thread> streamThreads;
+            std::string         settings;
+            std::string         headerBlock;
+            DWORD               dwHeaderStreamId = 0;
+            BYTE                bHeaderFlags = 0;
+
+            connection.pClient = pClient;
+            connection.encoder.Initialize(HPACK_UTILITY::DEFAULT_TABLE_SIZE);
+            decoder.Initialize(HPACK_UTILITY::DEFAULT_TABLE_SIZE, 64 * 1024);
+
+            if (!ReceiveExact(pClient, rgbPreface, sizeof(rgbPreface)))
+            {
+                return;
+            }
+
+            if (m_fHttp1)
+            {
+                static const CHAR s_szResponse[] = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+                pClient->Send(s_szResponse, sizeof(s_szResponse) - 1);
+                pClient->Shutdown();
+                return;
+            }
+
+            if (memcmp(rgbPreface, s_szPreface, sizeof(rgbPreface)) != 0)
+            {
+                return;
+            }
+
+            if (m_cMaxStreams != 0)
+            {
+                settings += std::string("\0\x3", 2) + UInt32(m_cMaxStreams);
+            }
+            if (m_cbInitialWindow != 0)
+            {
+                settings += std::string("\0\x4", 2) + UInt32(m_cbInitialWindow);
+            }
+            WriteFrame(&connection, H2_FRAME_SETTINGS, 0, 0, settings.data(), static_cast<DWORD>(settings.size()));
+
+            for (;;)
+            {
+                BYTE rgbHeader[9];
+
+                if (!ReceiveExact(pClient, rgbHeader, sizeof(rgbHeader)))
+                {
+                    break;
+                }
+
+                DWORD cbLength = (rgbHeader[0] << 16) | (rgbHeader[1] << 8) | rgbHeader[2];
+                BYTE type = rgbHeader[3];
+                BYTE flags = rgbHeader[4];
+                DWORD dwStreamId = ((rgbHeader[5] & 0x7f) << 24) | (rgbHeader[6] << 16) | (rgbHeader[7] << 8) | rgbHeader[8];
+                std::vector<BYTE> payload(cbLength);
+
+                if (!ReceiveExact(pClient, payload.data(), cbLength))
+                {
+                    break;
+                }
+
+                if (type == H2_FRAME_SETTINGS && (flags & H2_CONNECTION::FLAG_ACK) == 0)
+                {
+                    for (DWORD ib = 0; ib + 6 <= cbLength; ib += 6)
+                    {
+                        if (payload[ib] == 0 && payload[ib + 1] == H2_CONNECTION::SETTINGS_INITIAL_WINDOW_SIZE)
+                        {
+                            std::lock_guard<std::mutex> lock(connection.mutex);
+                            connection.llInitialWindow = (payload[ib + 2] << 24) | (payload[ib + 3] << 16) | (payload[ib + 4] << 8) | payload[ib + 5];
+                        }
+                    }
+                    std::lock_guard<std::mutex> lock(connection.sendMutex);
+                    WriteFrame(&connection, H2_FRAME_SETTINGS, H2_CONNECTION::FLAG_ACK, 0, NULL, 0);
+                }
+                else if (type == H2_FRAME_WINDOW_UPDATE)
+                {
+                    DWORD cbIncrement = (payload[0] << 24) | (payload[1] << 16) | (payload[2] << 8) | payload[3];
+                    std::lock_guard<std::mutex> lock(connection.mutex);
+                    if (dwStreamId == 0)
+                    {
+                        connection.llSendWindow += cbIncrement;
+                    }
+                    else if (connection.streams.count(dwStreamId) != 0)
+                    {
+                        connection.streams[dwStreamId]->llSendWindow += cbIncrement;
+                    }
+                    connection.cvWindow.notify_all();
+                }
+                else if (type == H2_FRAME_RST_STREAM)
+                {
+                    std::lock_guard<std::mutex> lock(connection.mutex);
+                    if (connection.streams.count(dwStreamId) != 0)
+                    {
+                        connection.streams[dwStreamId]->fCancelled = true;
+                    }
+                    connection.cvWindow.notify_all();
+
+                    std::lock_guard<std::mutex> resetLock(m_mutex);
+                    m_resets[dwStreamId] = (payload[0] << 24) | (payload[1] << 16) | (payload[2] << 8) | payload[3];
+                }
+                else if (type == H2_FRAME_HEADERS || type == H2_FRAME_CONTINUATION)
+                {
+                    if (type == H2_FRAME_HEADERS)
+                    {
+                        std::shared_ptr<STREAM> stream = std::make_shared<STREAM>();
+                        std::lock_guard<std::mutex> lock(connection.mutex);
+
+                        stream->llSendWindow = connection.llInitialWindow;
+                        connection.streams[dwStreamId] = stream;
+                        headerBlock.clear();
+                        dwHeaderStreamId = dwStreamId;
+                        bHeaderFlags = flags;
+                    }
+                    headerBlock.append(reinterpret_cast<CHAR *>(payload.data()), cbLength);
+
+                    if (flags & H2_CONNECTION::FLAG_END_HEADERS)
+                    {
+                        std::shared_ptr<STREAM> stream;
+                        {
+                            std::lock_guard<std::mutex> lock(connection.mutex);
+                            stream = connection.streams[dwHeaderStreamId];
+                        }
+                        if (FAILED(decoder.Decode(reinterpret_cast<const BYTE *>(headerBlock.data()),
+                                                  static_cast<DWORD>(headerBlock.size()),
+                                                  AddRequestHeader,
+                                                  &stream->request)))
+                        {
+                            break;
+                        }
+                        if (bHeaderFlags & H2_CONNECTION::FLAG_END_STREAM)
+                        {
+                            streamThreads.emplace_back([this, &connection, stream, dwHeaderStreamId]() { Respond(&connection, dwHeaderStreamId, stream); });
+                        }
+                    }
+                }
+                else if (type == H2_FRAME_DATA)
+                {
+                    std::shared_ptr<STREAM> stream;
+                    {
+                        std::lock_guard<std::mutex> lock(connection.mutex);
+                        stream = connection.streams[dwStreamId];
+                    }
+                    stream->request.body.append(reinterpret_cast<CHAR *>(payload.data()), cbLength);
+
+                    if (cbLength != 0)
+                    {
+                        std::string increment = UInt32(cbLength);
+                        std::lock_guard<std::mutex> lock(connection.sendMutex);
+                        WriteFrame(&connection, H2_FRAME_WINDOW_UPDATE, 0, 0, increment.data(), 4);
+                        WriteFrame(&connection, H2_FRAME_WINDOW_UPDATE, 0, dwStreamId, increment.data(), 4);
+                    }
+                    if (flags & H2_CONNECTION::FLAG_END_STREAM)
+                    {
+                        streamThreads.emplace_back([this, &connection, stream, dwStreamId]() { Respond(&connection, dwStreamId, stream); });
+                    }
+                }
+                else if (type == H2_FRAME_GOAWAY)
+                {
+                    break;
+                }
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(connection.mutex);
+                connection.fClosed = true;
+                connection.cvWindow.notify_all();
+            }
+            for (auto& thread : streamThreads)
+            {
+                thread.join();
+            }
+            pClient->Shutdown();
+        }
+
+        VOID
+        WriteHeaders(
+            CONNECTION *    pConnection,
+            DWORD           dwStreamId,
+            const std::string & status,
+            const std::vector<std::pair<std::string, std::string>> & headers,
+            bool            fEndStream
+        )
+        {
+            std::vector<BYTE>   block(64 * 1024);
+            DWORD               ib = 0;
+
+            pConnection->encoder.BeginBlock(block.data(), static_cast<DWORD>(block.size()), &ib);
+            if (!status.empty())
+            {
+                pConnection->encoder.Encode(":status", 7, status.data(), static_cast<DWORD>(status.size()), block.data(), static_cast<DWORD>(block.size()), &ib);
+            }
+            for (auto& header : headers)
+            {
+                pConnection->encoder.Encode(header.first.data(), static_cast<DWORD>(header.first.size()),
+                                            header.second.data(), static_cast<DWORD>(header.second.size()),
+                                            block.data(), static_cast<DWORD>(block.size()), &ib);
+            }
+
+            //
+            // Split in two so that CONTINUATION is exercised.
+            //
+            DWORD cbFirst = ib / 2;
+            WriteFrame(pConnection, H2_FRAME_HEADERS, fEndStream ? H2_CONNECTION::FLAG_END_STREAM : 0, dwStreamId, block.data(), cbFirst);
+            WriteFrame(pConnection, H2_FRAME_CONTINUATION, H2_CONNECTION::FLAG_END_HEADERS, dwStreamId, block.data() + cbFirst, ib - cbFirst);
+        }
+
+        VOID
+        Respond(
+            CONNECTION *                pConnection,
+            DWORD                       dwStreamId,
+            std::shared_ptr<STREAM>     stream
+        )
+        {
+            TEST_RESPONSE response;
+
+            m_responder(stream->request, &response);
+            if (response.dwDelayMs != 0)
+            {
+                Sleep(response.dwDelayMs);
+            }
+
+            if (response.fRefuse)
+            {
+                std::string code = UInt32(H2_REFUSED_STREAM);
+                std::lock_guard<std::mutex> lock(pConnection->sendMutex);
+                WriteFrame(pConnection, H2_FRAME_RST_STREAM, 0, dwStreamId, code.data(), 4);
+                return;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(pConnection->sendMutex);
+
+                //
+                // The streams up to this one still complete.
+                //
+                if (response.fGoAway)
+                {
+                    std::string payload = UInt32(dwStreamId) + UInt32(H2_NO_ERROR);
+                    WriteFrame(pConnection, H2_FRAME_GOAWAY, 0, 0, payload.data(), 8);
+                }
+                if (response.fInterim)
+                {
+                    WriteHeaders(pConnection, dwStreamId, "103", { { "link", "</style.css>; rel=preload" } }, false);
+                }
+                WriteHeaders(pConnection, dwStreamId, response.status, response.headers, response.body.empty() && !response.fTrailers);
+            }
+
+            size_t ib = 0;
+            while (ib < response.body.size())
+            {
+                DWORD cbFrame;
+                {
+                    std::unique_lock<std::mutex> lock(pConnection->mutex);
+                    pConnection->cvWindow.wait(lock, [&]() {
+                        return pConnection->fClosed || stream->fCancelled ||
+                               (pConnection->llSendWindow > 0 && stream->llSendWindow > 0);
+                    });
+                    if (pConnection->fClosed || stream->fCancelled)
+                    {
+                        return;
+                    }
+                    cbFrame = static_cast<DWORD>(min(min(static_cast<LONGLONG>(response.body.size() - ib), static_cast<LONGLONG>(H2_CONNECTION::MAX_FRAME_SIZE)),
+                                                     min(pConnection->llSendWindow, stream->llSendWindow)));
+                    pConnection->llSendWindow -= cbFrame;
+                    stream->llSendWindow -= cbFrame;
+                }
+
+                bool fLast = ib + cbFrame == response.body.size() && !response.fTrailers;
+                std::lock_guard<std::mutex> lock(pConnection->sendMutex);
+                WriteFrame(pConnection, H2_FRAME_DATA, fLast ? H2_CONNECTION::FLAG_END_STREAM : 0, dwStreamId, response.body.data() + ib, cbFrame);
+                ib += cbFrame;
+            }
+
+            std::lock_guard<std::mutex> lock(pConnection->sendMutex);
+            if (response.fTrailers)
+            {
+                WriteHeaders(pConnection, dwStreamId, "", { { "grpc-status", "0" } }, true);
+            }
+        }
+
+        RESPONDER                                   m_responder;
+        USHORT                                      m_usPort;
+        DWORD                                       m_cMaxStreams;
+        DWORD                                       m_cbInitialWindow;
+        bool                                        m_fHttp1;
+        LOCAL_SOCKET                                m_listener;
+        std::atomic<bool>                           m_fStopping;
+        std::atomic<DWORD>                          m_cConnections;
+        std::thread                                 m_acceptThread;
+        std::vector<std::thread>                    m_connectionThreads;
+        std::mutex                                  m_mutex;
+        std::vector<std::shared_ptr<LOCAL_SOCKET>>  m_clients;
+        std::map<DWORD, DWORD>                      m_resets;
+    };
+
+    const CHAR GET_REQUEST[] = "GET /items?id=7 HTTP/1.1\r\n"
+                               "Host: localhost:5000\r\n"
+                               "Accept: text/plain\r\n"
+                               "Connection: keep-alive\r\n"
+                               "X-Custom:  padded value \r\n"
+                               "\r\n";
+
+    //
+    // The HTTP/1.1 response head a stream returns, then the body.
+    //
+    HRESULT
+    Exchange(
+        H2_STREAM *         pStream,
+        const std::string & head,
+        const std::string & body,
+        std::string *       pResponseHead,
+        std::string *       pResponseBody,
+        USHORT *            puStatus = NULL
+    )
+    {
+        HRESULT hr;
+        PSTR    pszHead;
+        DWORD   cchHead;
+        USHORT  uStatus;
+        CHAR    rgchBuffer[5000];
+        DWORD   cbRead;
+        DWORD   cbSent;
+
+        if (FAILED(hr = pStream->SendHead(head.data(), static_cast<DWORD>(head.size()), body.empty())) ||
+            (!body.empty() && FAILED(hr = pStream->SendBody(body.data(), static_cast<DWORD>(body.size()), TRUE, &cbSent))) ||
+            FAILED(hr = pStream->ReceiveResponseHead(FALSE, &pszHead, &cchHead, &uStatus)))
+        {
+            return hr;
+        }
+
+        pResponseHead->assign(pszHead, cchHead);
+        if (puStatus != NULL)
+        {
+            *puStatus = uStatus;
+        }
+
+        pResponseBody->clear();
+        do
+        {
+            if (FAILED(hr = pStream->ReadBody(rgchBuffer, sizeof(rgchBuffer), &cbRead)))
+            {
+                return hr;
+            }
+            pResponseBody->append(rgchBuffer, cbRead);
+        } while (cbRead != 0);
+
+        return S_OK;
+    }
+
+    HRESULT
+    Connect(
+        STAND_IN_H2_SERVER *    pServer,
+        H2_CONNECTION **        ppConnection
+    )
+    {
+        return H2_CONNECTION::Create(LOCAL_TRANSPORT_TCP, NULL, pServer->QueryPort(), 10000, 16 * 1024, ppConnection);
+    }
+
+    TEST(H2Connection, TranslatesTheRequestAndResponseHeads)
+    {
+        STAND_IN_H2_SERVER  server;
+        H2_CONNECTION *     pConnection;
+        H2_STREAM *         pStream;
+        TEST_REQUEST        seen;
+        std::string         head;
+        std::string         body;
+        USHORT              uStatus = 0;
+
+        ASSERT_EQ(S_OK, server.Start([&](const TEST_REQUEST & request, TEST_RESPONSE * pResponse) {
+            seen = request;
+            pResponse->status = "404";
+            pResponse->headers = { { "content-type", "text/plain" }, { "x-request", request.Header(":path") } };
+            pResponse->body = "not here";
+        }));
+        ASSERT_EQ(S_OK, Connect(&server, &pConnection));
+        ASSERT_EQ(S_OK, pConnection->OpenStream(&pStream));
+
+        EXPECT_EQ(S_OK, Exchange(pStream, GET_REQUEST, "", &head, &body, &uStatus));
+        EXPECT_EQ(404, uStatus);
+        EXPECT_EQ("HTTP/1.1 404 Not Found\r\ncontent-type: text/plain\r\nx-request: /items?id=7\r\n\r\n", head);
+        EXPECT_EQ("not here", body);
+
+        ASSERT_EQ(6u, seen.headers.size());
+        EXPECT_EQ(":method", seen.headers[0].first);
+        EXPECT_EQ("GET", seen.headers[0].second);
+        EXPECT_EQ(":scheme", seen.headers[1].first);
+        EXPECT_EQ("http", seen.headers[1].second);
+        EXPECT_EQ(":authority", seen.headers[2].first);
+        EXPECT_EQ("localhost:5000", seen.headers[2].second);
+        EXPECT_EQ(":path", seen.headers[3].first);
+        EXPECT_EQ("/items?id=7", seen.headers[3].second);
+        EXPECT_EQ("accept", seen.headers[4].first);
+        EXPECT_EQ("text/plain", seen.headers[4].second);
+        EXPECT_EQ("x-custom", seen.headers[5].first);
+        EXPECT_EQ("padded value", seen.headers[5].second);
+
+        pConnection->CloseStream(pStream);
+        pConnection->Shutdown();
+        pConnection->DereferenceConnection();
+    }
+
+    TEST(H2Connection, KeepsToTheFlowControlWindowsBothWays)
+    {
+        STAND_IN_H2_SERVER  server;
+        H2_CONNECTION *     pConnection;
+        H2_STREAM *         pStream;
+        std::string         request(300 * 1024, 'q');
+        std::string         head;
+        std::string         body;
+
+        for (size_t i = 0; i < request.size(); i++)
+        {
+            request[i] = static_cast<CHAR>('a' + i % 26);
+        }
+
+        //
+        // The backend lets 1000 bytes of the request body out at a time,
+        // and sends more of the response than fits in a stream window.
+        //
+        ASSERT_EQ(S_OK, server.Start([&](const TEST_REQUEST & seen, TEST_RESPONSE * pResponse) {
+            pResponse->body = seen.body + seen.body + seen.body;
+        }, 0, 1000));
+        ASSERT_EQ(S_OK, Connect(&server, &pConnection));
+        ASSERT_EQ(S_OK, pConnection->OpenStream(&pStream));
+
+        std::string post = "POST /upload HTTP/1.1\r\nHost: localhost\r\nContent-Length: " + std::to_string(request.size()) + "\r\n\r\n";
+        EXPECT_EQ(S_OK, Exchange(pStream, post, request, &head, &body));
+        EXPECT_TRUE(body == request + request + request);
+
+        pConnection->CloseStream(pStream);
+        pConnection->Shutdown();
+        pConnection->DereferenceConnection();
+    }
+
+    TEST(H2Connection, MultiplexesConcurrentStreams)
+    {
+        STAND_IN_H2_SERVER  server;
+        H2_CONNECTION *     pConnection;
+        std::atomic<DWORD>  cFailures(0);
+        std::vector<std::thread> threads;
+
+        ASSERT_EQ(S_OK, server.Start([&](const TEST_REQUEST & request, TEST_RESPONSE * pResponse) {
+            pResponse->body = std::string(1000 + request.Header(":path").size() * 500, request.Header(":path").back());
+        }));
+        ASSERT_EQ(S_OK, Connect(&server, &pConnection));
+
+        for (DWORD i = 0; i < 16; i++)
+        {
+            threads.emplace_back([&, i]() {
+                for (DWORD j = 0; j < 20; j++)
+                {
+                    H2_STREAM * pStream;
+                    std::string path = "/" + std::string(i + j, 'p') + static_cast<CHAR>('a' + i);
+                    std::string head;
+                    std::string body;
+
+                    if (FAILED(pConnection->OpenStream(&pStream)))
+                    {
+                        cFailures++;
+                        continue;
+                    }
+                    if (FAILED(Exchange(pStream, "GET " + path + " HTTP/1.1\r\nHost: localhost\r\n\r\n", "", &head, &body)) ||
+                        body != std::string(1000 + path.size() * 500, path.back()))
+                    {
+                        cFailures++;
+                    }
+                    pConnection->CloseStream(pStream);
+                }
+            });
+        }
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+
+        EXPECT_EQ(0u, cFailures.load());
+        EXPECT_EQ(1u, server.QueryConnectionCount());
+
+        pConnection->Shutdown();
+        pConnection->DereferenceConnection();
+    }
+
+    TEST(H2Connection, SkipsInterimResponsesAndDropsTrailers)
+    {
+        STAND_IN_H2_SERVER  server;
+        H2_CONNECTION *     pConnection;
+        H2_STREAM *         pStream;
+        std::string         head;
+        std::string         body;
+
+        ASSERT_EQ(S_OK, server.Start([&](const TEST_REQUEST &, TEST_RESPONSE * pResponse) {
+            pResponse->fInterim = true;
+            pResponse->fTrailers = true;
+            pResponse->body = "payload";
+        }));
+        ASSERT_EQ(S_OK, Connect(&server, &pConnection));
+        ASSERT_EQ(S_OK, pConnection->OpenStream(&pStream));
+
+        EXPECT_EQ(S_OK, Exchange(pStream, GET_REQUEST, "", &head, &body));
+        EXPECT_EQ("HTTP/1.1 200 OK\r\n\r\n", head);
+        EXPECT_EQ("payload", body);
+
+        pConnection->CloseStream(pStream);
+        pConnection->Shutdown();
+        pConnection->DereferenceConnection();
+    }
+
+    TEST(H2Connection, RefusedStreamCanBeRetried)
+    {
+        STAND_IN_H2_SERVER  server;
+        H2_CONNECTION *     pConnection;
+        H2_STREAM *         pStream;
+        std::string         head;
+        std::string         body;
+
+        ASSERT_EQ(S_OK, server.Start([&](const TEST_REQUEST &, TEST_RESPONSE * pResponse) {
+            pResponse->fRefuse = true;
+        }));
+        ASSERT_EQ(S_OK, Connect(&server, &pConnection));
+        ASSERT_EQ(S_OK, pConnection->OpenStream(&pStream));
+
+        EXPECT_EQ(HRESULT_FROM_WIN32(ERROR_CONNECTION_ABORTED), Exchange(pStream, GET_REQUEST, "", &head, &body));
+        EXPECT_TRUE(pStream->IsRefused());
+        EXPECT_TRUE(pConnection->IsUsable());
+
+        pConnection->CloseStream(pStream);
+        pConnection->Shutdown();
+        pConnection->DereferenceConnection();
+    }
+
+    TEST(H2Connection, ClosingAnUnfinishedStreamCancelsIt)
+    {
+        STAND_IN_H2_SERVER  server;
+        H2_CONNECTION *     pConnection;
+        H2_STREAM *         pStream;
+        PSTR                pszHead;
+        DWORD               cchHead;
+        USHORT              uStatus;
+        DWORD               dwId;
+
+        ASSERT_EQ(S_OK, server.Start([&](const TEST_REQUEST &, TEST_RESPONSE * pResponse) {
+            pResponse->body.assign(4 * 1024 * 1024, 'x');
+        }));
+        ASSERT_EQ(S_OK, Connect(&server, &pConnection));
+        ASSERT_EQ(S_OK, pConnection->OpenStream(&pStream));
+
+        EXPECT_EQ(S_OK, pStream->SendHead(GET_REQUEST, sizeof(GET_REQUEST) - 1, TRUE));
+        EXPECT_EQ(S_OK, pStream->ReceiveResponseHead(FALSE, &pszHead, &cchHead, &uStatus));
+        dwId = pStream->QueryId();
+        pConnection->CloseStream(pStream);
+
+        for (DWORD i = 0; i < 500 && server.QueryResets().count(dwId) == 0; i++)
+        {
+            Sleep(10);
+        }
+        EXPECT_EQ(static_cast<DWORD>(H2_CANCEL), server.QueryResets()[dwId]);
+        EXPECT_EQ(0u, pConnection->QueryStreamCount());
+
+        pConnection->Shutdown();
+        pConnection->DereferenceConnection();
+    }
+
+    TEST(H2Connection, ReceiveTimesOut)
+    {
+        STAND_IN_H2_SERVER  server;
+        H2_CONNECTION *     pConnection;
+        H2_STREAM *         pStream;
+        PSTR                pszHead;
+        DWORD               cchHead;
+        USHORT              uStatus;
+
+        ASSERT_EQ(S_OK, server.Start([&](const TEST_REQUEST &, TEST_RESPONSE * pResponse) {
+            pResponse->dwDelayMs = 1000;
+        }));
+        ASSERT_EQ(S_OK, Connect(&server, &pConnection));
+        ASSERT_EQ(S_OK, pConnection->OpenStream(&pStream));
+
+        pStream->SetTimeout(100);
+        EXPECT_EQ(S_OK, pStream->SendHead(GET_REQUEST, sizeof(GET_REQUEST) - 1, TRUE));
+        EXPECT_EQ(HRESULT_FROM_WIN32(ERROR_TIMEOUT), pStream->ReceiveResponseHead(FALSE, &pszHead, &cchHead, &uStatus));
+
+        pConnection->CloseStream(pStream);
+        pConnection->Shutdown();
+        pConnection->DereferenceConnection();
+    }
+
+    VOID
+    CountEvent(
+        PVOID   pvContext
+    )
+    {
+        (*static_cast<std::atomic<DWORD> *>(pvContext))++;
+    }
+
+    //
+    // Waits for the event callback to be called once more than cSeen times.
+    //
+    bool
+    WaitForEvent(
+        std::atomic<DWORD> *    pcEvents,
+        DWORD                   cSeen
+    )
+    {
+        for (DWORD i = 0; i < 1000 && *pcEvents == cSeen; i++)
+        {
+            Sleep(10);
+        }
+        return *pcEvents == cSeen + 1;
+    }
+
+    TEST(H2Connection, EventCallbackResumesPendingCalls)
+    {
+        STAND_IN_H2_SERVER  server;
+        H2_CONNECTION *     pConnection;
+        H2_STREAM *         pStream;
+        std::atomic<DWORD>  cEvents(0);
+        DWORD               cPending = 0;
+        std::string         request(5000, 'r');
+        std::string         post = "POST /upload HTTP/1.1\r\nHost: localhost\r\nContent-Length: 5000\r\n\r\n";
+        std::string         body;
+        PSTR                pszHead;
+        DWORD               cchHead;
+        USHORT              uStatus;
+        CHAR                rgchBuffer[1000];
+        DWORD               cb;
+        DWORD               ib = 0;
+        HRESULT             hr;
+
+        //
+        // The request body waits for the 1000 byte window of the backend,
+        // and the response for its delay.
+        //
+        ASSERT_EQ(S_OK, server.Start([&](const TEST_REQUEST & seen, TEST_RESPONSE * pResponse) {
+            pResponse->body = seen.body + seen.body;
+            pResponse->dwDelayMs = 100;
+        }, 0, 1000));
+        ASSERT_EQ(S_OK, Connect(&server, &pConnection));
+        ASSERT_EQ(S_OK, pConnection->OpenStream(&pStream));
+        pStream->SetEventCallback(CountEvent, &cEvents);
+
+        ASSERT_EQ(S_OK, pStream->SendHead(post.data(), static_cast<DWORD>(post.size()), FALSE));
+        while ((hr = pStream->SendBody(request.data() + ib, static_cast<DWORD>(request.size()) - ib, TRUE, &cb)) == HRESULT_FROM_WIN32(ERROR_IO_PENDING))
+        {
+            ib += cb;
+            ASSERT_TRUE(WaitForEvent(&cEvents, cPending++));
+        }
+        EXPECT_EQ(S_OK, hr);
+        EXPECT_EQ(request.size(), ib + cb);
+        EXPECT_LT(0u, cPending);
+
+        while ((hr = pStream->ReceiveResponseHead(FALSE, &pszHead, &cchHead, &uStatus)) == HRESULT_FROM_WIN32(ERROR_IO_PENDING))
+        {
+            ASSERT_TRUE(WaitForEvent(&cEvents, cPending++));
+        }
+        EXPECT_EQ(S_OK, hr);
+        EXPECT_EQ(200, uStatus);
+
+        do
+        {
+            while ((hr = pStream->ReadBody(rgchBuffer, sizeof(rgchBuffer), &cb)) == HRESULT_FROM_WIN32(ERROR_IO_PENDING))
+            {
+                ASSERT_TRUE(WaitForEvent(&cEvents, cPending++));
+            }
+            ASSERT_EQ(S_OK, hr);
+            body.append(rgchBuffer, cb);
+        } while (cb != 0);
+
+        EXPECT_TRUE(body == request + request);
+        EXPECT_EQ(cPending, cEvents);
+
+        pConnection->CloseStream(pStream);
+        pConnection->Shutdown();
+        pConnection->DereferenceConnection();
+    }
+
+    TEST(H2Connection, CancelWaitTakesBackAPendingCall)
+    {
+        STAND_IN_H2_SERVER  server;
+        H2_CONNECTION *     pConnection;
+        H2_STREAM *         pStream;
+        std::atomic<DWORD>  cEvents(0);
+        PSTR                pszHead;
+        DWORD               cchHead;
+        USHORT              uStatus;
+
+        ASSERT_EQ(S_OK, server.Start([&](const TEST_REQUEST &, TEST_RESPONSE * pResponse) {
+            pResponse->dwDelayMs = 200;
+        }));
+        ASSERT_EQ(S_OK, Connect(&server, &pConnection));
+        ASSERT_EQ(S_OK, pConnection->OpenStream(&pStream));
+        pStream->SetEventCallback(CountEvent, &cEvents);
+
+        EXPECT_EQ(S_OK, pStream->SendHead(GET_REQUEST, sizeof(GET_REQUEST) - 1, TRUE));
+        EXPECT_EQ(HRESULT_FROM_WIN32(ERROR_IO_PENDING), pStream->ReceiveResponseHead(FALSE, &pszHead, &cchHead, &uStatus));
+        EXPECT_TRUE(pStream->CancelWait());
+        EXPECT_FALSE(pStream->CancelWait());
+
+        //
+        // The response still comes in, but nothing is waiting for it.
+        //
+        Sleep(400);
+        EXPECT_EQ(0u, cEvents);
+        EXPECT_EQ(S_OK, pStream->ReceiveResponseHead(FALSE, &pszHead, &cchHead, &uStatus));
+
+        pConnection->CloseStream(pStream);
+        pConnection->Shutdown();
+        pConnection->DereferenceConnection();
+    }
+
+    TEST(H2Connection, Http1BackendDeclines)
+    {
+        STAND_IN_H2_SERVER  server;
+        H2_CONNECTION *     pConnection;
+
+        ASSERT_EQ(S_OK, server.Start([&](const TEST_REQUEST &, TEST_RESPONSE *) {}, 0, 0, true));
+
+        EXPECT_EQ(HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED), Connect(&server, &pConnection));
+        EXPECT_TRUE(pConnection == NULL);
+    }
+
+    TEST(H2Channel, DeclinedByAnHttp1Backend)
+    {
+        STAND_IN_H2_SERVER  server;
+        H2_CHANNEL *        pChannel = new H2_CHANNEL();
+        H2_STREAM *         pStream;
+
+        ASSERT_EQ(S_OK, server.Start([&](const TEST_REQUEST &, TEST_RESPONSE *) {}, 0, 0, true));
+        ASSERT_EQ(S_OK, pChannel->Initialize(LOCAL_TRANSPORT_TCP, NULL, server.QueryPort(), 10000, 16 * 1024, 2));
+
+        EXPECT_EQ(HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED), pChannel->Probe());
+        EXPECT_TRUE(pChannel->IsDeclined());
+        EXPECT_EQ(HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED), pChannel->OpenStream(&pStream));
+        EXPECT_EQ(1u, server.QueryConnectionCount());
+
+        pChannel->Shutdown();
+        pChannel->DereferenceChannel();
+    }
+
+    TEST(H2Channel, SpreadsStreamsThenSpillsAtTheLimit)
+    {
+        STAND_IN_H2_SERVER  server;
+        H2_CHANNEL *        pChannel = new H2_CHANNEL();
+        H2_STREAM *         rgpStreams[4];
+        H2_STREAM *         pSpilled;
+        H2_CHANNEL_COUNTERS counters;
+
+        ASSERT_EQ(S_OK, server.Start([&](const TEST_REQUEST &, TEST_RESPONSE *) {}, 2));
+        ASSERT_EQ(S_OK, pChannel->Initialize(LOCAL_TRANSPORT_TCP, NULL, server.QueryPort(), 10000, 16 * 1024, 2));
+        ASSERT_EQ(S_OK, pChannel->Probe());
+
+        //
+        // The peer SETTINGS arrive with the handshake, the limit of two
+        // streams a connection holds from the first stream on.
+        //
+        for (DWORD i = 0; i < 4; i++)
+        {
+            ASSERT_EQ(S_OK, pChannel->OpenStream(&rgpStreams[i]));
+        }
+        EXPECT_EQ(HRESULT_FROM_WIN32(ERROR_BUSY), pChannel->OpenStream(&pSpilled));
+
+        pChannel->QueryCounters(&counters);
+        EXPECT_EQ(2u, counters.cConnects);
+        EXPECT_EQ(2u, counters.cConnections);
+        EXPECT_EQ(4u, counters.cActiveStreams);
+        EXPECT_EQ(4u, counters.cStreams);
+        EXPECT_EQ(1u, counters.cSpilled);
+
+        for (DWORD i = 0; i < 4; i++)
+        {
+            pChannel->CloseStream(rgpStreams[i]);
+        }
+        pChannel->Shutdown();
+        pChannel->DereferenceChannel();
+    }
+
+    TEST(H2Channel, ReplacesAConnectionTheBackendEnds)
+    {
+        STAND_IN_H2_SERVER  server;
+        H2_CHANNEL *        pChannel = new H2_CHANNEL();
+        H2_CHANNEL_COUNTERS counters;
+        std::string         head;
+        std::string         body;
+
+        ASSERT_EQ(S_OK, server.Start([&](const TEST_REQUEST &, TEST_RESPONSE * pResponse) {
+            pResponse->body = "bye";
+            pResponse->fGoAway = true;
+        }));
+        ASSERT_EQ(S_OK, pChannel->Initialize(LOCAL_TRANSPORT_TCP, NULL, server.QueryPort(), 10000, 16 * 1024, 1));
+
+        for (DWORD i = 0; i < 3; i++)
+        {
+            H2_STREAM *pStream;
+
+            ASSERT_EQ(S_OK, pChannel->OpenStream(&pStream));
+            EXPECT_EQ(S_OK, Exchange(pStream, GET_REQUEST, "", &head, &body));
+            EXPECT_EQ("bye", body);
+            pChannel->CloseStream(pStream);
+        }
+
+        //
+        // The GOAWAY came ahead of each response, so every request found
+        // the connection going away and opened the next.
+        //
+        pChannel->QueryCounters(&counters);
+        EXPECT_EQ(3u, counters.cConnects);
+        EXPECT_EQ(0u, counters.cConnectFailures);
+        EXPECT_EQ(3u, server.QueryConnectionCount());
+
+        pChannel->Shutdown();
+        pChannel->DereferenceChannel();
+    }
+}
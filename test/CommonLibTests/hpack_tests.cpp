@@ -0,0 +1,426 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#include "stdafx.h"
+#include "hpack.h"
+
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace HpackTests
+{
+    typedef std::vector<std::pair<std::string, std::string>> HEADER_LIST;
+
+    static
+    std::vector<BYTE>
+    FromHex(
+        PCSTR       pszHex
+    )
+    {
+        std::vector<BYTE> bytes;
+
+        for (; pszHex[0] != '\0' && pszHex[1] != '\0'; pszHex += 2)
+        {
+            bytes.push_back(static_cast<BYTE>(std::stoul(std::string(pszHex, 2), nullptr, 16)));
+        }
+        return bytes;
+    }
+
+    static
+    std::string
+    ToHex(
+        const BYTE *    pb,
+        DWORD           cb
+    )
+    {
+        static const CHAR s_rgHexDigits[] = "0123456789abcdef";
+        std::string hex;
+
+        for (DWORD i = 0; i < cb; i++)
+        {
+            hex += s_rgHexDigits[pb[i] >> 4];
+            hex += s_rgHexDigits[pb[i] & 0xf];
+        }
+        return hex;
+    }
+
+    static
+    HRESULT
+    AddHeader(
+        PVOID       pvContext,
+        PCSTR       pszName,
+        DWORD       cchName,
+        PCSTR       pszValue,
+        DWORD       cchValue
+    )
+    {
+        static_cast<HEADER_LIST *>(pvContext)->emplace_back(std::string(pszName, cchName), std::string(pszValue, cchValue));
+        return S_OK;
+    }
+
+    static
+    HRESULT
+    Decode(
+        HPACK_DECODER *     pDecoder,
+        PCSTR               pszHex,
+        HEADER_LIST *       pHeaders
+    )
+    {
+        std::vector<BYTE> block = FromHex(pszHex);
+
+        pHeaders->clear();
+        return pDecoder->Decode(block.data(), static_cast<DWORD>(block.size()), AddHeader, pHeaders);
+    }
+
+    static
+    std::string
+    Encode(
+        HPACK_ENCODER *         pEncoder,
+        const HEADER_LIST &     headers
+    )
+    {
+        BYTE    rgbBlock[4096];
+        DWORD   ib = 0;
+
+        EXPECT_EQ(S_OK, pEncoder->BeginBlock(rgbBlock, sizeof(rgbBlock), &ib));
+        for (const auto & header : headers)
+        {
+            EXPECT_EQ(S_OK, pEncoder->Encode(header.first.data(),
+                                             static_cast<DWORD>(header.first.size()),
+                                             header.second.data(),
+                                             static_cast<DWORD>(header.second.size()),
+                                             rgbBlock,
+                                             sizeof(rgbBlock),
+                                             &ib));
+        }
+        return ToHex(rgbBlock, ib);
+    }
+
+    static
+    std::string
+    HuffmanEncode(
+        const std::string &     value
+    )
+    {
+        std::vector<BYTE> encoded(HPACK_UTILITY::HuffmanEncodedLength(value.data(), static_cast<DWORD>(value.size())));
+
+        HPACK_UTILITY::HuffmanEncode(value.data(), static_cast<DWORD>(value.size()), encoded.data());
+        return ToHex(encoded.data(), static_cast<DWORD>(encoded.size()));
+    }
+
+    static
+    HRESULT
+    HuffmanDecode(
+        PCSTR           pszHex,
+        std::string *   pValue
+    )
+    {
+        std::vector<BYTE>   encoded = FromHex(pszHex);
+        CHAR                rgchDecoded[256];
+        DWORD               cchDecoded;
+        HRESULT             hr;
+
+        hr = HPACK_UTILITY::HuffmanDecode(encoded.data(), static_cast<DWORD>(encoded.size()), rgchDecoded, sizeof(rgchDecoded), &cchDecoded);
+        pValue->assign(rgchDecoded, SUCCEEDED(hr) ? cchDecoded : 0);
+        return hr;
+    }
+
+    TEST(Hpack, IntegersFollowRfcExamples)
+    {
+        BYTE    rgbBlock[8];
+        DWORD   ib;
+        DWORD   dwValue;
+
+        // C.1.1 to C.1.3
+        ib = 0;
+        EXPECT_EQ(S_OK, HPACK_UTILITY::EncodeInteger(10, 5, 0xe0, rgbBlock, sizeof(rgbBlock), &ib));
+        EXPECT_EQ("ea", ToHex(rgbBlock, ib));
+        ib = 0;
+        EXPECT_EQ(S_OK, HPACK_UTILITY::EncodeInteger(1337, 5, 0, rgbBlock, sizeof(rgbBlock), &ib));
+        EXPECT_EQ("1f9a0a", ToHex(rgbBlock, ib));
+        ib = 0;
+        EXPECT_EQ(S_OK, HPACK_UTILITY::EncodeInteger(42, 8, 0, rgbBlock, sizeof(rgbBlock), &ib));
+        EXPECT_EQ("2a", ToHex(rgbBlock, ib));
+
+        ib = 0;
+        EXPECT_EQ(S_OK, HPACK_UTILITY::DecodeInteger(FromHex("ff9a0a").data(), 3, &ib, 5, &dwValue));
+        EXPECT_EQ(1337u, dwValue);
+        EXPECT_EQ(3u, ib);
+
+        for (DWORD dwExpected : { 0u, 30u, 31u, 127u, 128u, 16383u, 16384u, 0xffffffffu })
+        {
+            ib = 0;
+            EXPECT_EQ(S_OK, HPACK_UTILITY::EncodeInteger(dwExpected, 5, 0, rgbBlock, sizeof(rgbBlock), &ib));
+            DWORD cb = ib;
+            ib = 0;
+            EXPECT_EQ(S_OK, HPACK_UTILITY::DecodeInteger(rgbBlock, cb, &ib, 5, &dwValue));
+            EXPECT_EQ(dwExpected, dwValue);
+            EXPECT_EQ(cb, ib);
+        }
+    }
+
+    TEST(Hpack, IntegersPastADwordOrTheBlockAreInvalid)
+    {
+        DWORD ib;
+        DWORD dwValue;
+
+        ib = 0;
+        EXPECT_EQ(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), HPACK_UTILITY::DecodeInteger(FromHex("1fffffffff0f").data(), 6, &ib, 5, &dwValue));
+        ib = 0;
+        EXPECT_EQ(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), HPACK_UTILITY::DecodeInteger(FromHex("1fffffffffffff00").data(), 8, &ib, 5, &dwValue));
+        ib = 0;
+        EXPECT_EQ(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), HPACK_UTILITY::DecodeInteger(FromHex("1f9a").data(), 2, &ib, 5, &dwValue));
+    }
+
+    TEST(Hpack, HuffmanFollowsRfcExamples)
+    {
+        std::string value;
+
+        EXPECT_EQ("f1e3c2e5f23a6ba0ab90f4ff", HuffmanEncode("www.example.com"));
+        EXPECT_EQ("a8eb10649cbf", HuffmanEncode("no-cache"));
+        EXPECT_EQ("25a849e95ba97d7f", HuffmanEncode("custom-key"));
+        EXPECT_EQ("9d29ad171863c78f0b97c8e9ae82ae43d3", HuffmanEncode("https://www.example.com"));
+
+        EXPECT_EQ(S_OK, HuffmanDecode("f1e3c2e5f23a6ba0ab90f4ff", &value));
+        EXPECT_EQ("www.example.com", value);
+        EXPECT_EQ(S_OK, HuffmanDecode("", &value));
+        EXPECT_EQ("", value);
+    }
+
+    TEST(Hpack, HuffmanRoundTripsEveryByte)
+    {
+        std::mt19937 random(7);
+
+        for (int i = 0; i < 200; i++)
+        {
+            std::string value(random() % 200, '\0');
+            for (auto & ch : value)
+            {
+                ch = static_cast<CHAR>(random() % 256);
+            }
+
+            std::string decoded;
+            EXPECT_EQ(S_OK, HuffmanDecode(HuffmanEncode(value).c_str(), &decoded));
+            EXPECT_EQ(value, decoded);
+        }
+    }
+
+    TEST(Hpack, HuffmanRejectsBadPaddingAndEos)
+    {
+        std::string value;
+
+        // "a" is 00011, padded with zeros instead of ones.
+        EXPECT_EQ(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), HuffmanDecode("18", &value));
+        // "a" and a whole byte of padding.
+        EXPECT_EQ(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), HuffmanDecode("1fff", &value));
+        // EOS.
+        EXPECT_EQ(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), HuffmanDecode("ffffffff", &value));
+        EXPECT_EQ(S_OK, HuffmanDecode("1f", &value));
+        EXPECT_EQ("a", value);
+    }
+
+    TEST(Hpack, DecodesRfcRequestsWithoutHuffman)
+    {
+        HPACK_DECODER   decoder;
+        HEADER_LIST     headers;
+
+        ASSERT_EQ(S_OK, decoder.Initialize(HPACK_UTILITY::DEFAULT_TABLE_SIZE, 1024));
+
+        // C.3.1 to C.3.3
+        EXPECT_EQ(S_OK, Decode(&decoder, "828684410f7777772e6578616d706c652e636f6d", &headers));
+        EXPECT_EQ((HEADER_LIST { { ":method", "GET" }, { ":scheme", "http" }, { ":path", "/" }, { ":authority", "www.example.com" } }), headers);
+
+        EXPECT_EQ(S_OK, Decode(&decoder, "828684be58086e6f2d6361636865", &headers));
+        EXPECT_EQ((HEADER_LIST { { ":method", "GET" }, { ":scheme", "http" }, { ":path", "/" }, { ":authority", "www.example.com" }, { "cache-control", "no-cache" } }), headers);
+
+        EXPECT_EQ(S_OK, Decode(&decoder, "828785bf400a637573746f6d2d6b65790c637573746f6d2d76616c7565", &headers));
+        EXPECT_EQ((HEADER_LIST { { ":method", "GET" }, { ":scheme", "https" }, { ":path", "/index.html" }, { ":authority", "www.example.com" }, { "custom-key", "custom-value" } }), headers);
+    }
+
+    TEST(Hpack, DecodesRfcRequestsWithHuffman)
+    {
+        HPACK_DECODER   decoder;
+        HEADER_LIST     headers;
+
+        ASSERT_EQ(S_OK, decoder.Initialize(HPACK_UTILITY::DEFAULT_TABLE_SIZE, 1024));
+
+        // C.4.1 to C.4.3
+        EXPECT_EQ(S_OK, Decode(&decoder, "828684418cf1e3c2e5f23a6ba0ab90f4ff", &headers));
+        EXPECT_EQ((HEADER_LIST { { ":method", "GET" }, { ":scheme", "http" }, { ":path", "/" }, { ":authority", "www.example.com" } }), headers);
+
+        EXPECT_EQ(S_OK, Decode(&decoder, "828684be5886a8eb10649cbf", &headers));
+        EXPECT_EQ((HEADER_LIST { { ":method", "GET" }, { ":scheme", "http" }, { ":path", "/" }, { ":authority", "www.example.com" }, { "cache-control", "no-cache" } }), headers);
+
+        EXPECT_EQ(S_OK, Decode(&decoder, "828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf", &headers));
+        EXPECT_EQ((HEADER_LIST { { ":method", "GET" }, { ":scheme", "https" }, { ":path", "/index.html" }, { ":authority", "www.example.com" }, { "custom-key", "custom-value" } }), headers);
+    }
+
+    TEST(Hpack, DecodesRfcResponsesWithEviction)
+    {
+        HPACK_DECODER   decoder;
+        HEADER_LIST     headers;
+
+        // C.6 uses a 256 byte table, so entries are evicted.
+        ASSERT_EQ(S_OK, decoder.Initialize(256, 1024));
+
+        EXPECT_EQ(S_OK, Decode(&decoder, "488264025885aec3771a4b6196d07abe941054d444a8200595040b8166e082a62d1bff6e919d29ad171863c78f0b97c8e9ae82ae43d3", &headers));
+        EXPECT_EQ((HEADER_LIST { { ":status", "302" }, { "cache-control", "private" }, { "date", "Mon, 21 Oct 2013 20:13:21 GMT" }, { "location", "https://www.example.com" } }), headers);
+
+        EXPECT_EQ(S_OK, Decode(&decoder, "4883640effc1c0bf", &headers));
+        EXPECT_EQ((HEADER_LIST { { ":status", "307" }, { "cache-control", "private" }, { "date", "Mon, 21 Oct 2013 20:13:21 GMT" }, { "location", "https://www.example.com" } }), headers);
+
+        EXPECT_EQ(S_OK, Decode(&decoder, "88c16196d07abe941054d444a8200595040b8166e084a62d1bffc05a839bd9ab77ad94e7821dd7f2e6c7b335dfdfcd5b3960d5af27087f3672c1ab270fb5291f9587316065c003ed4ee5b1063d5007", &headers));
+        EXPECT_EQ((HEADER_LIST {
+            { ":status", "200" },
+            { "cache-control", "private" },
+            { "date", "Mon, 21 Oct 2013 20:13:22 GMT" },
+            { "location", "https://www.example.com" },
+            { "content-encoding", "gzip" },
+            { "set-cookie", "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1" } }), headers);
+
+        // Only the last three fields are left, 65 is past the table.
+        EXPECT_EQ(S_OK, Decode(&decoder, "bebfc0", &headers));
+        EXPECT_EQ(3u, headers.size());
+        EXPECT_EQ(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), Decode(&decoder, "c1", &headers));
+    }
+
+    TEST(Hpack, DecoderRejectsBadIndexesAndSizeUpdates)
+    {
+        HPACK_DECODER   decoder;
+        HEADER_LIST     headers;
+
+        ASSERT_EQ(S_OK, decoder.Initialize(HPACK_UTILITY::DEFAULT_TABLE_SIZE, 1024));
+
+        EXPECT_EQ(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), Decode(&decoder, "80", &headers));
+        EXPECT_EQ(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), Decode(&decoder, "be", &headers));
+        // A size update past the announced limit, and one after a field.
+        EXPECT_EQ(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), Decode(&decoder, "3fe21f", &headers));
+        EXPECT_EQ(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), Decode(&decoder, "8220", &headers));
+        // A literal longer than the block.
+        EXPECT_EQ(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), Decode(&decoder, "400a6375", &headers));
+
+        EXPECT_EQ(S_OK, Decode(&decoder, "203fe11f82", &headers));
+        EXPECT_EQ((HEADER_LIST { { ":method", "GET" } }), headers);
+    }
+
+    TEST(Hpack, DecoderBoundsHuffmanStrings)
+    {
+        HPACK_DECODER   decoder;
+        HEADER_LIST     headers;
+
+        // "www.example.com" does not fit in 8 characters.
+        ASSERT_EQ(S_OK, decoder.Initialize(HPACK_UTILITY::DEFAULT_TABLE_SIZE, 8));
+        EXPECT_EQ(HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER), Decode(&decoder, "418cf1e3c2e5f23a6ba0ab90f4ff", &headers));
+    }
+
+    TEST(Hpack, EncoderMatchesRfcRequests)
+    {
+        HPACK_ENCODER encoder;
+
+        ASSERT_EQ(S_OK, encoder.Initialize(HPACK_UTILITY::DEFAULT_TABLE_SIZE));
+
+        EXPECT_EQ("828684418cf1e3c2e5f23a6ba0ab90f4ff",
+                  Encode(&encoder, { { ":method", "GET" }, { ":scheme", "http" }, { ":path", "/" }, { ":authority", "www.example.com" } }));
+        EXPECT_EQ("828684be5886a8eb10649cbf",
+                  Encode(&encoder, { { ":method", "GET" }, { ":scheme", "http" }, { ":path", "/" }, { ":authority", "www.example.com" }, { "cache-control", "no-cache" } }));
+        EXPECT_EQ("828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf",
+                  Encode(&encoder, { { ":method", "GET" }, { ":scheme", "https" }, { ":path", "/index.html" }, { ":authority", "www.example.com" }, { "custom-key", "custom-value" } }));
+    }
+
+    TEST(Hpack, EncoderKeepsPathsAndCredentialsOutOfTheTable)
+    {
+        HPACK_ENCODER encoder;
+
+        ASSERT_EQ(S_OK, encoder.Initialize(HPACK_UTILITY::DEFAULT_TABLE_SIZE));
+
+        //
+        // Never indexed with the static name, the same bytes every time.
+        //
+        std::string authorization = Encode(&encoder, { { "authorization", "Basic YQ==" } });
+        EXPECT_EQ("1f08", authorization.substr(0, 4));
+        EXPECT_EQ(authorization, Encode(&encoder, { { "authorization", "Basic YQ==" } }));
+
+        //
+        // Without indexing, and the name is not indexed either.
+        //
+        std::string path = Encode(&encoder, { { ":path", "/api/values" } });
+        EXPECT_EQ("04", path.substr(0, 2));
+        EXPECT_EQ(path, Encode(&encoder, { { ":path", "/api/values" } }));
+
+        //
+        // Anything else is indexed once and then takes a byte.
+        //
+        EXPECT_EQ("7a", Encode(&encoder, { { "user-agent", "test" } }).substr(0, 2));
+        EXPECT_EQ("be", Encode(&encoder, { { "user-agent", "test" } }));
+    }
+
+    TEST(Hpack, EncoderAnnouncesASmallerTable)
+    {
+        HPACK_ENCODER   encoder;
+        HPACK_DECODER   decoder;
+        HEADER_LIST     headers;
+
+        ASSERT_EQ(S_OK, encoder.Initialize(HPACK_UTILITY::DEFAULT_TABLE_SIZE));
+        ASSERT_EQ(S_OK, decoder.Initialize(HPACK_UTILITY::DEFAULT_TABLE_SIZE, 1024));
+
+        EXPECT_EQ(S_OK, Decode(&decoder, Encode(&encoder, { { "user-agent", "test" } }).c_str(), &headers));
+
+        encoder.SetMaxTableSize(0);
+        std::string block = Encode(&encoder, { { "user-agent", "test" } });
+        EXPECT_EQ("20", block.substr(0, 2));
+        EXPECT_EQ(S_OK, Decode(&decoder, block.c_str(), &headers));
+        EXPECT_EQ((HEADER_LIST { { "user-agent", "test" } }), headers);
+
+        // Nothing is indexed any more, and the update went out once.
+        EXPECT_EQ(block.substr(2), Encode(&encoder, { { "user-agent", "test" } }));
+    }
+
+    TEST(Hpack, EncoderAndDecoderStayInStep)
+    {
+        HPACK_ENCODER   encoder;
+        HPACK_DECODER   decoder;
+        HEADER_LIST     headers;
+        std::mt19937    random(11);
+
+        ASSERT_EQ(S_OK, encoder.Initialize(HPACK_UTILITY::DEFAULT_TABLE_SIZE));
+        ASSERT_EQ(S_OK, decoder.Initialize(HPACK_UTILITY::DEFAULT_TABLE_SIZE, 4096));
+
+        //
+        // Enough distinct fields that the table keeps evicting.
+        //
+        for (int i = 0; i < 500; i++)
+        {
+            HEADER_LIST expected;
+
+            expected.emplace_back(":method", random() % 2 ? "GET" : "POST");
+            expected.emplace_back(":path", "/item/" + std::to_string(random() % 1000));
+            for (int j = random() % 8; j > 0; j--)
+            {
+                expected.emplace_back("x-header-" + std::to_string(random() % 40),
+                                      std::string(random() % 300, static_cast<CHAR>('a' + random() % 26)));
+            }
+
+            EXPECT_EQ(S_OK, Decode(&decoder, Encode(&encoder, expected).c_str(), &headers));
+            EXPECT_EQ(expected, headers);
+        }
+    }
+
+    TEST(Hpack, EncoderNeedsRoomForTheWholeField)
+    {
+        HPACK_ENCODER   encoder;
+        BYTE            rgbBlock[8];
+        DWORD           ib = 0;
+
+        ASSERT_EQ(S_OK, encoder.Initialize(HPACK_UTILITY::DEFAULT_TABLE_SIZE));
+
+        EXPECT_EQ(HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER),
+                  encoder.Encode("x-long", 6, "0123456789", 10, rgbBlock, sizeof(rgbBlock), &ib));
+        EXPECT_EQ(0u, ib);
+
+        // The failed field was not indexed.
+        EXPECT_EQ(S_OK, encoder.Encode(":method", 7, "GET", 3, rgbBlock, sizeof(rgbBlock), &ib));
+        EXPECT_EQ("82", ToHex(rgbBlock, ib));
+    }
+}
@@ -0,0 +1,274 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#include "stdafx.h"
+#include "loadbalancer.h"
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <queue>
+#include <random>
+
+namespace LoadBalancerTests
+{
+    static
+    DWORD
+    Select(
+        LOAD_BALANCING_POLICY       policy,
+        const std::vector<LONG> &   loads,
+        volatile LONG *             plRoute
+    )
+    {
+        return LOAD_BALANCER::SelectSlot(policy,
+                                         static_cast<DWORD>(loads.size()),
+                                         plRoute,
+                                         [&loads](DWORD dwSlot) { return loads[dwSlot]; });
+    }
+
+    TEST(LoadBalancer, RoundRobinIgnoresLoad)
+    {
+        std::vector<LONG> loads = { 100, 0, 0 };
+        volatile LONG lRoute = -1;
+
+        EXPECT_EQ(0, Select(LOAD_BALANCING_ROUND_ROBIN, loads, &lRoute));
+        EXPECT_EQ(1, Select(LOAD_BALANCING_ROUND_ROBIN, loads, &lRoute));
+        EXPECT_EQ(2, Select(LOAD_BALANCING_ROUND_ROBIN, loads, &lRoute));
+        EXPECT_EQ(0, Select(LOAD_BALANCING_ROUND_ROBIN, loads, &lRoute));
+    }
+
+    TEST(LoadBalancer, LeastOutstandingPicksIdlestReadySlot)
+    {
+        std::vector<LONG> loads = { 5, LOAD_BALANCER::SLOT_NOT_READY, 2, 3 };
+        volatile LONG lRoute = -1;
+
+        //
+        // Starting at slot 0 and 2 the idlest is 2, starting at the not
+        // ready slot 1 the slot is returned so that its process gets started.
+        //
+        EXPECT_EQ(2, Select(LOAD_BALANCING_LEAST_OUTSTANDING, loads, &lRoute));
+        EXPECT_EQ(1, Select(LOAD_BALANCING_LEAST_OUTSTANDING, loads, &lRoute));
+        EXPECT_EQ(2, Select(LOAD_BALANCING_LEAST_OUTSTANDING, loads, &lRoute));
+        EXPECT_EQ(2, Select(LOAD_BALANCING_LEAST_OUTSTANDING, loads, &lRoute));
+
+        //
+        // Ties rotate with the round robin cursor.
+        //
+        loads = { 1, 1, 1, 1 };
+        EXPECT_EQ(0, Select(LOAD_BALANCING_LEAST_OUTSTANDING, loads, &lRoute));
+        EXPECT_EQ(1, Select(LOAD_BALANCING_LEAST_OUTSTANDING, loads, &lRoute));
+    }
+
+    TEST(LoadBalancer, PowerOfTwoChoicesNeverPicksTheBusierSlot)
+    {
+        std::vector<LONG> loads = { 9, 1, 4, 7, 2 };
+        volatile LONG lRoute = -1;
+
+        for (DWORD i = 0; i < 1000; i++)
+        {
+            DWORD dwFirst = static_cast<DWORD>(lRoute + 1) % loads.size();
+            DWORD dwSlot = Select(LOAD_BALANCING_POWER_OF_TWO_CHOICES, loads, &lRoute);
+
+            ASSERT_LT(dwSlot, loads.size());
+            EXPECT_LE(loads[dwSlot], loads[dwFirst]);
+        }
+
+        //
+        // A single slot and a not ready first slot short-circuit.
+        //
+        std::vector<LONG> single = { 3 };
+        EXPECT_EQ(0, Select(LOAD_BALANCING_POWER_OF_TWO_CHOICES, single, &lRoute));
+
+        loads = { LOAD_BALANCER::SLOT_NOT_READY, 0 };
+        lRoute = -1;
+        EXPECT_EQ(0, Select(LOAD_BALANCING_POWER_OF_TWO_CHOICES, loads, &lRoute));
+    }
+
+    //
+    // Discrete event simulation of ANCM in front of several Kestrel
+    // processes. Each fake process serves cWorkers requests at a time and
+    // queues the rest; the balancer sees the same outstanding counts that
+    // FORWARDING_HANDLER maintains on SERVER_PROCESS.
+    //
+    struct SIM_SCENARIO
+    {
+        PCSTR       pszName;
+        DWORD       cProcesses;
+        DWORD       cWorkers;
+        double      dLoad;              // fraction of total capacity
+        double      dSlowProcessFactor; // service time multiplier of process 0
+        double      dStallPeriodMs;     // process 0 stalls periodically if not 0
+        double      dStallMs;
+        double      dStallFactor;
+        DWORD       cRequests;
+    };
+
+    struct SIM_RESULT
+    {
+        double      dP50Ms;
+        double      dP99Ms;
+        double      dP999Ms;
+        double      dMaxMs;
+    };
+
+    class LOAD_BALANCER_SIMULATION
+    {
+    public:
+
+        static
+        SIM_RESULT
+        Run(
+            const SIM_SCENARIO &    scenario,
+            LOAD_BALANCING_POLICY   policy
+        )
+        {
+            const double dMeanServiceMs = 1.0;
+            std::mt19937 generator(12345);
+            std::exponential_distribution<double> service(1.0 / dMeanServiceMs);
+            std::vector<SIM_PROCESS> processes(scenario.cProcesses);
+            std::priority_queue<SIM_COMPLETION, std::vector<SIM_COMPLETION>, std::greater<SIM_COMPLETION>> completions;
+            std::vector<double> latencies;
+            volatile LONG lRoute = -1;
+
+            double dCapacity = scenario.cWorkers / (dMeanServiceMs * scenario.dSlowProcessFactor) +
+                               (scenario.cProcesses - 1) * scenario.cWorkers / dMeanServiceMs;
+            std::exponential_distribution<double> arrivals(scenario.dLoad * dCapacity);
+
+            auto ServiceTime = [&](DWORD dwProcess, double dNow)
+            {
+                double dTime = service(generator);
+                if (dwProcess == 0)
+                {
+                    dTime *= scenario.dSlowProcessFactor;
+                    if (scenario.dStallPeriodMs != 0 &&
+                        fmod(dNow, scenario.dStallPeriodMs) < scenario.dStallMs)
+                    {
+                        dTime *= scenario.dStallFactor;
+                    }
+                }
+                return dTime;
+            };
+
+            double dNextArrival = arrivals(generator);
+            DWORD cArrived = 0;
+
+            latencies.reserve(scenario.cRequests);
+
+            while (latencies.size() < scenario.cRequests)
+            {
+                if (cArrived < scenario.cRequests &&
+                    (completions.empty() || dNextArrival < completions.top().dTime))
+                {
+                    double dNow = dNextArrival;
+                    DWORD dwProcess = LOAD_BALANCER::SelectSlot(
+                        policy,
+                        scenario.cProcesses,
+                        &lRoute,
+                        [&processes](DWORD dwSlot) { return processes[dwSlot].cOutstanding; });
+                    SIM_PROCESS & process = processes[dwProcess];
+
+                    process.cOutstanding++;
+                    if (process.cBusy < scenario.cWorkers)
+                    {
+                        process.cBusy++;
+                        completions.push({ dNow + ServiceTime(dwProcess, dNow), dNow, dwProcess });
+                    }
+                    else
+                    {
+                        process.queue.push_back(dNow);
+                    }
+
+                    cArrived++;
+                    dNextArrival = dNow + arrivals(generator);
+                    continue;
+                }
+
+                SIM_COMPLETION completion = completions.top();
+                SIM_PROCESS & process = processes[completion.dwProcess];
+                completions.pop();
+
+                latencies.push_back(completion.dTime - completion.dArrival);
+                process.cOutstanding--;
+                process.cBusy--;
+
+                if (!process.queue.empty())
+                {
+                    double dArrival = process.queue.front();
+                    process.queue.pop_front();
+                    process.cBusy++;
+                    completions.push({ completion.dTime + ServiceTime(completion.dwProcess, completion.dTime),
+                                       dArrival,
+                                       completion.dwProcess });
+                }
+            }
+
+            std::sort(latencies.begin(), latencies.end());
+
+            SIM_RESULT result;
+            result.dP50Ms = Percentile(latencies, 0.5);
+            result.dP99Ms = Percentile(latencies, 0.99);
+            result.dP999Ms = Percentile(latencies, 0.999);
+            result.dMaxMs = latencies.back();
+            return result;
+        }
+
+    private:
+
+        struct SIM_PROCESS
+        {
+            SIM_PROCESS() : cOutstanding(0), cBusy(0)
+            {}
+
+            LONG                cOutstanding;
+            DWORD               cBusy;
+            std::deque<double>  queue;
+        };
+
+        struct SIM_COMPLETION
+        {
+            double      dTime;
+            double      dArrival;
+            DWORD       dwProcess;
+
+            bool operator>(const SIM_COMPLETION & other) const
+            {
+                return dTime > other.dTime;
+            }
+        };
+
+        static
+        double
+        Percentile(
+            const std::vector<double> & sorted,
+            double                      dFraction
+        )
+        {
+            size_t index = static_cast<size_t>(dFraction * (sorted.size() - 1));
+            return sorted[index];
+        }
+    };
+
+    static const SIM_SCENARIO s_rgScenarios[] =
+    {
+        // name                       procs workers load  slow  stall period/len/factor  requests
+        { "uniform",                  4,    4,      0.7,  1.0,  0,    0,   1,             200000 },
+        { "one slow process",         4,    4,      0.7,  4.0,  0,    0,   1,             200000 },
+        { "periodic GC stalls",       4,    4,      0.6,  1.0,  500,  50,  20,            200000 },
+        { "slow process, 16 procs",   16,   2,      0.8,  3.0,  0,    0,   1,             400000 },
+    };
+
+    TEST(LoadBalancer, LoadAwarePoliciesCutTailLatencyWithSkewedService)
+    {
+        SIM_SCENARIO scenario = s_rgScenarios[1];
+        scenario.cRequests = 50000;
+
+        SIM_RESULT roundRobin = LOAD_BALANCER_SIMULATION::Run(scenario, LOAD_BALANCING_ROUND_ROBIN);
+        SIM_RESULT leastOutstanding = LOAD_BALANCER_SIMULATION::Run(scenario, LOAD_BALANCING_LEAST_OUTSTANDING);
+        SIM_RESULT powerOfTwo = LOAD_BALANCER_SIMULATION::Run(scenario, LOAD_BALANCING_POWER_OF_TWO_CHOICES);
+
+        //
+        // Round robin overloads the slow process, its queue keeps growing.
+        //
+        EXPECT_LT(leastOutstanding.dP99Ms * 4, roundRobin.dP99Ms);
+        EXPECT_LT(powerOfTwo.dP99Ms * 4, roundRobin.dP99Ms);
+    }
+}
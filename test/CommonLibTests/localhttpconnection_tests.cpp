@@ -0,0 +1,768 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#include "stdafx.h"
+#include "localhttpconnection.h"
+#include "localsocketpoller.h"
+#include "Benchmark.h"
+
+#include <functional>
+#include <memory>
+#include <string>
+
+namespace LocalHttpConnectionTests
+{
+    //
+    // Stands in for the backend: serves every connection on its own thread,
+    // answering each request with what the responder returns for it. A
+    // trickling server sends the answer a few bytes at a time.
+    //
+    class STAND_IN_SERVER
+    {
+    public:
+
+        typedef std::function<std::string(const std::string & head, const std::string & body, bool * pfClose)> RESPONDER;
+
+        STAND_IN_SERVER() :
+            m_transport(LOCAL_TRANSPORT_TCP),
+            m_usPort(0),
+            m_fTrickle(false),
+            m_fStopping(false)
+        {
+        }
+
+        ~STAND_IN_SERVER()
+        {
+            Stop();
+        }
+
+        HRESULT
+        Start(
+            LOCAL_TRANSPORT     transport,
+            RESPONDER           responder,
+            bool                fTrickle = false
+        )
+        {
+            static std::atomic<DWORD> s_cServers(0);
+            HRESULT hr;
+
+            m_transport = transport;
+            m_responder = responder;
+            m_fTrickle = fTrickle;
+
+            if (transport == LOCAL_TRANSPORT_UNIX_SOCKET)
+            {
+                m_strPath = (std::filesystem::temp_directory_path() /
+                             ("ancm-test-" + std::to_string(GetCurrentProcessId()) + "-" + std::to_string(s_cServers++) + ".sock")).string();
+                std::error_code error;
+                std::filesystem::remove(m_strPath, error);
+            }
+
+            if (FAILED(hr = m_listener.Listen(transport, QueryPath(), &m_usPort)))
+            {
+                return hr;
+            }
+
+            m_acceptThread = std::thread([this]() { AcceptLoop(); });
+            return S_OK;
+        }
+
+        VOID
+        Stop()
+        {
+            if (!m_acceptThread.joinable())
+            {
+                return;
+            }
+
+            //
+            // Wake the accept up with a connection of our own.
+            //
+            m_fStopping = true;
+            LOCAL_SOCKET wake;
+            wake.Connect(m_transport, QueryPath(), m_usPort);
+            m_acceptThread.join();
+            wake.Close();
+
+            for (auto& thread : m_connectionThreads)
+            {
+                thread.join();
+            }
+            m_connectionThreads.clear();
+            m_listener.Close();
+
+            if (!m_strPath.empty())
+            {
+                std::error_code error;
+                std::filesystem::remove(m_strPath, error);
+            }
+        }
+
+        HRESULT
+        Connect(
+            LOCAL_HTTP_CONNECTION * pConnection,
+            DWORD                   cbMaxHead = 16 * 1024
+        )
+        {
+            return pConnection->Connect(m_transport, QueryPath(), m_usPort, 10000, cbMaxHead);
+        }
+
+    private:
+
+        PCSTR
+        QueryPath() const
+        {
+            return m_strPath.empty() ? NULL : m_strPath.c_str();
+        }
+
+        VOID
+        AcceptLoop()
+        {
+            for (;;)
+            {
+                std::shared_ptr<LOCAL_SOCKET> client = std::make_shared<LOCAL_SOCKET>();
+
+                if (FAILED(m_listener.Accept(client.get())) || m_fStopping)
+                {
+                    return;
+                }
+
+                m_connectionThreads.emplace_back([this, client]() { Serve(client.get()); });
+            }
+        }
+
+        VOID
+        Serve(
+            LOCAL_SOCKET *  pClient
+        )
+        {
+            std::string pending;
+            CHAR        rgchBuffer[4096];
+            DWORD       cbReceived;
+
+            for (;;)
+            {
+                size_t cchHead;
+                while ((cchHead = pending.find("\r\n\r\n")) == std::string::npos)
+                {
+                    if (FAILED(pClient->Receive(rgchBuffer, sizeof(rgchBuffer), &cbReceived)) || cbReceived == 0)
+                    {
+                        return;
+                    }
+                    pending.append(rgchBuffer, cbReceived);
+                }
+
+                std::string head = pending.substr(0, cchHead + 4);
+                pending.erase(0, cchHead + 4);
+
+                size_t cbBody = 0;
+                std::string lowerHead = head;
+                for (auto& ch : lowerHead)
+                {
+                    ch = static_cast<CHAR>(tolower(ch));
+                }
+                size_t ichLength = lowerHead.find("\ncontent-length:");
+                if (ichLength != std::string::npos)
+                {
+                    cbBody = strtoul(head.c_str() + ichLength + 16, NULL, 10);
+                }
+
+                while (pending.size() < cbBody)
+                {
+                    if (FAILED(pClient->Receive(rgchBuffer, sizeof(rgchBuffer), &cbReceived)) || cbReceived == 0)
+                    {
+                        return;
+                    }
+                    pending.append(rgchBuffer, cbReceived);
+                }
+
+                std::string body = pending.substr(0, cbBody);
+                pending.erase(0, cbBody);
+
+                bool fClose = false;
+                std::string response = m_responder(head, body, &fClose);
+                if (FAILED(Send(pClient, response)) || fClose)
+                {
+                    return;
+                }
+            }
+        }
+
+        HRESULT
+        Send(
+            LOCAL_SOCKET *          pClient,
+            const std::string &     response
+        )
+        {
+            HRESULT hr;
+
+            if (!m_fTrickle)
+            {
+                return pClient->Send(response.data(), static_cast<DWORD>(response.size()));
+            }
+
+            for (size_t ich = 0; ich < response.size(); ich += 3)
+            {
+                if (FAILED(hr = pClient->Send(response.data() + ich, static_cast<DWORD>(min(response.size() - ich, static_cast<size_t>(3))))))
+                {
+                    return hr;
+                }
+                Sleep(1);
+            }
+            return S_OK;
+        }
+
+        LOCAL_TRANSPORT             m_transport;
+        RESPONDER                   m_responder;
+        std::string                 m_strPath;
+        USHORT                      m_usPort;
+        bool                        m_fTrickle;
+        LOCAL_SOCKET                m_listener;
+        std::atomic<bool>           m_fStopping;
+        std::thread                 m_acceptThread;
+        std::vector<std::thread>    m_connectionThreads;
+    };
+
+    const CHAR GET_REQUEST[] = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+    class LocalHttpConnectionTest : public testing::Test
+    {
+    protected:
+
+        static
+        VOID
+        SetUpTestCase()
+        {
+            WSADATA wsaData;
+            WSAStartup(MAKEWORD(2, 2), &wsaData);
+        }
+
+        //
+        // Sends request and reads the whole response in small pieces.
+        //
+        static
+        HRESULT
+        Exchange(
+            LOCAL_HTTP_CONNECTION * pConnection,
+            const std::string &     request,
+            _Out_ USHORT *          puStatus,
+            _Out_ std::string *     pBody,
+            BOOL                    fNoBody = FALSE
+        )
+        {
+            HRESULT hr;
+            PSTR    pszHead;
+            DWORD   cchHead;
+            BYTE    rgbBuffer[7];
+            DWORD   cbRead;
+
+            pBody->clear();
+
+            if (FAILED(hr = pConnection->Send(request.data(), static_cast<DWORD>(request.size()))) ||
+                FAILED(hr = pConnection->ReceiveResponseHead(fNoBody, &pszHead, &cchHead, puStatus)))
+            {
+                return hr;
+            }
+
+            do
+            {
+                if (FAILED(hr = pConnection->ReadBody(rgbBuffer, sizeof(rgbBuffer), &cbRead)))
+                {
+                    return hr;
+                }
+                pBody->append(reinterpret_cast<PCSTR>(rgbBuffer), cbRead);
+            } while (cbRead != 0);
+
+            return S_OK;
+        }
+
+        //
+        // Runs test against a stand-in server on either transport.
+        //
+        static
+        VOID
+        ForEachTransport(
+            STAND_IN_SERVER::RESPONDER                  responder,
+            std::function<void(STAND_IN_SERVER &)>      test,
+            bool                                        fTrickle = false
+        )
+        {
+            for (LOCAL_TRANSPORT transport : { LOCAL_TRANSPORT_UNIX_SOCKET, LOCAL_TRANSPORT_TCP })
+            {
+                STAND_IN_SERVER server;
+                ASSERT_EQ(S_OK, server.Start(transport, responder, fTrickle));
+                test(server);
+            }
+        }
+    };
+
+    TEST_F(LocalHttpConnectionTest, ReadsContentLengthBody)
+    {
+        ForEachTransport(
+            [](const std::string &, const std::string &, bool *)
+            {
+                return std::string("HTTP/1.1 200 OK\r\nContent-Length: 11\r\nX-Test: a\r\n\r\nhello world");
+            },
+            [](STAND_IN_SERVER & server)
+            {
+                LOCAL_HTTP_CONNECTION connection;
+                USHORT uStatus;
+                std::string body;
+
+                ASSERT_EQ(S_OK, server.Connect(&connection));
+                ASSERT_EQ(S_OK, Exchange(&connection, GET_REQUEST, &uStatus, &body));
+                EXPECT_EQ(200, uStatus);
+                EXPECT_EQ("hello world", body);
+                EXPECT_TRUE(connection.IsReusable());
+            });
+    }
+
+    TEST_F(LocalHttpConnectionTest, ReturnsTheHeadAsReceived)
+    {
+        ForEachTransport(
+            [](const std::string &, const std::string &, bool *)
+            {
+                return std::string("\r\nHTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+            },
+            [](STAND_IN_SERVER & server)
+            {
+                LOCAL_HTTP_CONNECTION connection;
+                PSTR pszHead;
+                DWORD cchHead;
+                USHORT uStatus;
+
+                ASSERT_EQ(S_OK, server.Connect(&connection));
+                ASSERT_EQ(S_OK, connection.Send(GET_REQUEST, sizeof(GET_REQUEST) - 1));
+                ASSERT_EQ(S_OK, connection.ReceiveResponseHead(FALSE, &pszHead, &cchHead, &uStatus));
+                EXPECT_EQ(404, uStatus);
+                EXPECT_EQ(std::string("HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n"), std::string(pszHead, cchHead));
+                EXPECT_EQ('\0', pszHead[cchHead]);
+            });
+    }
+
+    TEST_F(LocalHttpConnectionTest, DecodesChunkedBody)
+    {
+        ForEachTransport(
+            [](const std::string &, const std::string &, bool *)
+            {
+                return std::string("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+                                   "5\r\nhello\r\n"
+                                   "6;name=value\r\n world\r\n"
+                                   "0\r\nX-Trailer: 1\r\n\r\n");
+            },
+            [](STAND_IN_SERVER & server)
+            {
+                LOCAL_HTTP_CONNECTION connection;
+                USHORT uStatus;
+                std::string body;
+
+                ASSERT_EQ(S_OK, server.Connect(&connection));
+                ASSERT_EQ(S_OK, Exchange(&connection, GET_REQUEST, &uStatus, &body));
+                EXPECT_EQ("hello world", body);
+                EXPECT_TRUE(connection.IsReusable());
+            });
+    }
+
+    TEST_F(LocalHttpConnectionTest, ReadsBodyUntilClose)
+    {
+        ForEachTransport(
+            [](const std::string &, const std::string &, bool * pfClose)
+            {
+                *pfClose = true;
+                return std::string("HTTP/1.1 200 OK\r\n\r\nuntil the end");
+            },
+            [](STAND_IN_SERVER & server)
+            {
+                LOCAL_HTTP_CONNECTION connection;
+                USHORT uStatus;
+                std::string body;
+
+                ASSERT_EQ(S_OK, server.Connect(&connection));
+                ASSERT_EQ(S_OK, Exchange(&connection, GET_REQUEST, &uStatus, &body));
+                EXPECT_EQ("until the end", body);
+                EXPECT_FALSE(connection.IsReusable());
+            });
+    }
+
+    TEST_F(LocalHttpConnectionTest, SkipsInterimResponses)
+    {
+        ForEachTransport(
+            [](const std::string &, const std::string &, bool *)
+            {
+                return std::string("HTTP/1.1 100 Continue\r\n\r\n"
+                                   "HTTP/1.1 102 Processing\r\n\r\n"
+                                   "HTTP/1.1 204 No Content\r\n\r\n");
+            },
+            [](STAND_IN_SERVER & server)
+            {
+                LOCAL_HTTP_CONNECTION connection;
+                USHORT uStatus;
+                std::string body;
+
+                ASSERT_EQ(S_OK, server.Connect(&connection));
+                ASSERT_EQ(S_OK, Exchange(&connection, GET_REQUEST, &uStatus, &body));
+                EXPECT_EQ(204, uStatus);
+                EXPECT_TRUE(body.empty());
+                EXPECT_TRUE(connection.IsReusable());
+            });
+    }
+
+    TEST_F(LocalHttpConnectionTest, HeadResponseHasNoBody)
+    {
+        ForEachTransport(
+            [](const std::string &, const std::string &, bool *)
+            {
+                return std::string("HTTP/1.1 200 OK\r\nContent-Length: 100\r\n\r\n");
+            },
+            [](STAND_IN_SERVER & server)
+            {
+                LOCAL_HTTP_CONNECTION connection;
+                USHORT uStatus;
+                std::string body;
+
+                ASSERT_EQ(S_OK, server.Connect(&connection));
+                ASSERT_EQ(S_OK, Exchange(&connection, "HEAD / HTTP/1.1\r\nHost: localhost\r\n\r\n", &uStatus, &body, TRUE));
+                EXPECT_EQ(200, uStatus);
+                EXPECT_TRUE(body.empty());
+                EXPECT_TRUE(connection.IsReusable());
+            });
+    }
+
+    TEST_F(LocalHttpConnectionTest, KeepsTheConnectionForTheNextRequest)
+    {
+        ForEachTransport(
+            [](const std::string &, const std::string & body, bool *)
+            {
+                return "HTTP/1.1 200 OK\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+            },
+            [](STAND_IN_SERVER & server)
+            {
+                LOCAL_HTTP_CONNECTION connection;
+                USHORT uStatus;
+                std::string body;
+
+                ASSERT_EQ(S_OK, server.Connect(&connection));
+                for (int i = 0; i < 3; i++)
+                {
+                    std::string payload(1000 + i * 40000, static_cast<CHAR>('a' + i));
+
+                    ASSERT_EQ(S_OK, Exchange(&connection,
+                                             "POST / HTTP/1.1\r\nHost: localhost\r\nContent-Length: " + std::to_string(payload.size()) + "\r\n\r\n" + payload,
+                                             &uStatus,
+                                             &body));
+                    EXPECT_EQ(payload, body);
+                    EXPECT_TRUE(connection.IsReusable());
+                }
+            });
+    }
+
+    TEST_F(LocalHttpConnectionTest, ConnectionCloseIsNotReusable)
+    {
+        ForEachTransport(
+            [](const std::string &, const std::string &, bool * pfClose)
+            {
+                *pfClose = true;
+                return std::string("HTTP/1.1 200 OK\r\nContent-Length: 2\r\nConnection: close\r\n\r\nok");
+            },
+            [](STAND_IN_SERVER & server)
+            {
+                LOCAL_HTTP_CONNECTION connection;
+                USHORT uStatus;
+                std::string body;
+
+                ASSERT_EQ(S_OK, server.Connect(&connection));
+                ASSERT_EQ(S_OK, Exchange(&connection, GET_REQUEST, &uStatus, &body));
+                EXPECT_EQ("ok", body);
+                EXPECT_FALSE(connection.IsReusable());
+            });
+    }
+
+    TEST_F(LocalHttpConnectionTest, FailsOnOversizedHead)
+    {
+        ForEachTransport(
+            [](const std::string &, const std::string &, bool *)
+            {
+                return "HTTP/1.1 200 OK\r\nX-Large: " + std::string(200, 'x') + "\r\nContent-Length: 0\r\n\r\n";
+            },
+            [](STAND_IN_SERVER & server)
+            {
+                LOCAL_HTTP_CONNECTION connection;
+                USHORT uStatus;
+                std::string body;
+
+                ASSERT_EQ(S_OK, server.Connect(&connection, 128));
+                EXPECT_EQ(HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER), Exchange(&connection, GET_REQUEST, &uStatus, &body));
+                EXPECT_FALSE(connection.IsReusable());
+            });
+    }
+
+    TEST_F(LocalHttpConnectionTest, FailsOnTruncatedBody)
+    {
+        ForEachTransport(
+            [](const std::string &, const std::string &, bool * pfClose)
+            {
+                *pfClose = true;
+                return std::string("HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\nshort");
+            },
+            [](STAND_IN_SERVER & server)
+            {
+                LOCAL_HTTP_CONNECTION connection;
+                USHORT uStatus;
+                std::string body;
+
+                ASSERT_EQ(S_OK, server.Connect(&connection));
+                EXPECT_EQ(HRESULT_FROM_WIN32(ERROR_CONNECTION_ABORTED), Exchange(&connection, GET_REQUEST, &uStatus, &body));
+                EXPECT_FALSE(connection.IsReusable());
+            });
+    }
+
+    TEST_F(LocalHttpConnectionTest, FailsOnMalformedStatusLine)
+    {
+        ForEachTransport(
+            [](const std::string &, const std::string &, bool *)
+            {
+                return std::string("ICY 200 OK\r\n\r\n");
+            },
+            [](STAND_IN_SERVER & server)
+            {
+                LOCAL_HTTP_CONNECTION connection;
+                USHORT uStatus;
+                std::string body;
+
+                ASSERT_EQ(S_OK, server.Connect(&connection));
+                EXPECT_EQ(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), Exchange(&connection, GET_REQUEST, &uStatus, &body));
+            });
+    }
+
+    static
+    VOID
+    SignalReady(
+        PVOID       pvContext
+    )
+    {
+        SetEvent(static_cast<HANDLE>(pvContext));
+    }
+
+    TEST_F(LocalHttpConnectionTest, ResumesNonBlockingCallsOnThePoller)
+    {
+        ForEachTransport(
+            [](const std::string &, const std::string &, bool *)
+            {
+                return std::string("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\nX-Test: a\r\n\r\n"
+                                   "5\r\nhello\r\n"
+                                   "6;name=value\r\n world\r\n"
+                                   "0\r\nX-Trailer: 1\r\n\r\n");
+            },
+            [](STAND_IN_SERVER & server)
+            {
+                LOCAL_SOCKET_POLLER poller;
+                LOCAL_HTTP_CONNECTION connection;
+                LOCAL_SOCKET_WAIT wait;
+                HANDLE hReady = CreateEvent(NULL, FALSE, FALSE, NULL);
+                DWORD cPending = 0;
+                HRESULT hr;
+                PSTR pszHead;
+                DWORD cchHead;
+                USHORT uStatus;
+                BYTE rgbBuffer[4];
+                DWORD cbRead;
+                DWORD cbSent;
+                std::string body;
+
+                //
+                // Waits for the socket when the call would have blocked.
+                //
+                auto pending = [&](HRESULT hrCall, BOOL fWrite)
+                {
+                    if (hrCall != HRESULT_FROM_WIN32(ERROR_IO_PENDING))
+                    {
+                        return false;
+                    }
+                    cPending++;
+                    EXPECT_EQ(S_OK, poller.Wait(&wait, connection.QuerySocket(), fWrite));
+                    WaitForSingleObject(hReady, INFINITE);
+                    return true;
+                };
+
+                ASSERT_EQ(S_OK, poller.Initialize());
+                LOCAL_SOCKET_POLLER::InitializeWait(&wait, SignalReady, hReady);
+
+                ASSERT_EQ(S_OK, server.Connect(&connection));
+                ASSERT_EQ(S_OK, connection.SetNonBlocking());
+
+                for (DWORD cbDone = 0; cbDone < sizeof(GET_REQUEST) - 1; cbDone += cbSent)
+                {
+                    hr = connection.Send(GET_REQUEST + cbDone, sizeof(GET_REQUEST) - 1 - cbDone, &cbSent);
+                    if (!pending(hr, TRUE))
+                    {
+                        ASSERT_EQ(S_OK, hr);
+                    }
+                }
+
+                while (pending(hr = connection.ReceiveResponseHead(FALSE, &pszHead, &cchHead, &uStatus), FALSE))
+                {
+                }
+                ASSERT_EQ(S_OK, hr);
+                EXPECT_EQ(200, uStatus);
+                EXPECT_EQ(std::string("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\nX-Test: a\r\n\r\n"), std::string(pszHead, cchHead));
+
+                do
+                {
+                    while (pending(hr = connection.ReadBody(rgbBuffer, sizeof(rgbBuffer), &cbRead), FALSE))
+                    {
+                    }
+                    ASSERT_EQ(S_OK, hr);
+                    body.append(reinterpret_cast<PCSTR>(rgbBuffer), cbRead);
+                } while (cbRead != 0);
+
+                EXPECT_EQ("hello world", body);
+                EXPECT_TRUE(connection.IsReusable());
+                EXPECT_LT(0u, cPending);
+
+                poller.Shutdown();
+                CloseHandle(hReady);
+            },
+            true);
+    }
+
+    static
+    VOID
+    CountReady(
+        PVOID       pvContext
+    )
+    {
+        (*static_cast<std::atomic<int> *>(pvContext))++;
+    }
+
+    TEST(LocalSocketPoller, CancelsQueuedWaitsAndCallsBackTheRestAtShutdown)
+    {
+        LOCAL_SOCKET_POLLER poller;
+        LOCAL_SOCKET        socket;
+        LOCAL_SOCKET_WAIT   wait;
+        std::atomic<int>    cReady(0);
+        WSADATA             wsaData;
+        CHAR                ch;
+        DWORD               cbReceived;
+
+        WSAStartup(MAKEWORD(2, 2), &wsaData);
+        ASSERT_EQ(S_OK, poller.Initialize());
+        ASSERT_EQ(S_OK, socket.OpenLoopback());
+        LOCAL_SOCKET_POLLER::InitializeWait(&wait, CountReady, &cReady);
+
+        //
+        // Nothing to read yet.
+        //
+        ASSERT_EQ(S_OK, poller.Wait(&wait, &socket, FALSE));
+        Sleep(20);
+        EXPECT_TRUE(poller.Cancel(&wait));
+        EXPECT_FALSE(poller.Cancel(&wait));
+        EXPECT_EQ(0, cReady.load());
+
+        ASSERT_EQ(S_OK, poller.Wait(&wait, &socket, FALSE));
+        ASSERT_EQ(S_OK, socket.Send("x", 1));
+        for (int i = 0; i < 1000 && cReady.load() == 0; i++)
+        {
+            Sleep(1);
+        }
+        EXPECT_EQ(1, cReady.load());
+        EXPECT_FALSE(poller.Cancel(&wait));
+        ASSERT_EQ(S_OK, socket.Receive(&ch, 1, &cbReceived));
+
+        ASSERT_EQ(S_OK, poller.Wait(&wait, &socket, FALSE));
+        poller.Shutdown();
+        EXPECT_EQ(2, cReady.load());
+
+        EXPECT_EQ(HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED), poller.Wait(&wait, &socket, FALSE));
+        EXPECT_EQ(2, cReady.load());
+    }
+
+    TEST(LocalHttpConnection, ParsesChunkSizes)
+    {
+        ULONGLONG cbChunk;
+
+        EXPECT_EQ(S_OK, LOCAL_HTTP_CONNECTION::ParseChunkSize("1a", 2, &cbChunk));
+        EXPECT_EQ(26u, cbChunk);
+        EXPECT_EQ(S_OK, LOCAL_HTTP_CONNECTION::ParseChunkSize("FFff;x=1", 8, &cbChunk));
+        EXPECT_EQ(65535u, cbChunk);
+        EXPECT_EQ(S_OK, LOCAL_HTTP_CONNECTION::ParseChunkSize("0 ", 2, &cbChunk));
+        EXPECT_EQ(0u, cbChunk);
+
+        EXPECT_EQ(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), LOCAL_HTTP_CONNECTION::ParseChunkSize("", 0, &cbChunk));
+        EXPECT_EQ(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), LOCAL_HTTP_CONNECTION::ParseChunkSize("zz", 2, &cbChunk));
+        EXPECT_EQ(HRESULT_FROM_WIN32(ERROR_INVALID_DATA), LOCAL_HTTP_CONNECTION::ParseChunkSize("1000000000000000", 16, &cbChunk));
+    }
+
+    //
+    // Request latency and response throughput over a Unix domain socket
+    // against loopback TCP, on one connection per thread.
+    //
+    TEST(LocalHttpConnectionBenchmark, DISABLED_UnixSocketAgainstTcp)
+    {
+        WSADATA wsaData;
+        WSAStartup(MAKEWORD(2, 2), &wsaData);
+
+        const DWORD rgcbResponse[] = { 64, 64 * 1024 };
+        DWORD dwMaxThreads = Benchmark::QueryThreadCount();
+
+        for (DWORD cbResponse : rgcbResponse)
+        {
+            std::string response = "HTTP/1.1 200 OK\r\nContent-Length: " + std::to_string(cbResponse) + "\r\n\r\n" + std::string(cbResponse, 'x');
+
+            for (LOCAL_TRANSPORT transport : { LOCAL_TRANSPORT_UNIX_SOCKET, LOCAL_TRANSPORT_TCP })
+            {
+                for (DWORD dwThreads = 1; dwThreads <= dwMaxThreads; dwThreads *= 4)
+                {
+                    const DWORD dwRequests = (cbResponse > 1024) ? 5000 : 20000;
+                    STAND_IN_SERVER server;
+                    std::vector<std::unique_ptr<LOCAL_HTTP_CONNECTION>> connections;
+                    std::atomic<DWORD> cFailures(0);
+                    char szName[128];
+
+                    ASSERT_EQ(S_OK, server.Start(transport, [&](const std::string &, const std::string &, bool *) { return response; }));
+                    for (DWORD i = 0; i < dwThreads; i++)
+                    {
+                        connections.emplace_back(new LOCAL_HTTP_CONNECTION());
+                        ASSERT_EQ(S_OK, server.Connect(connections.back().get()));
+                    }
+
+                    double ns = Benchmark::RunConcurrently(dwThreads, [&](DWORD dwThread)
+                    {
+                        LOCAL_HTTP_CONNECTION *pConnection = connections[dwThread].get();
+                        std::vector<BYTE> buffer(64 * 1024);
+                        PSTR pszHead;
+                        DWORD cchHead;
+                        USHORT uStatus;
+                        DWORD cbRead;
+
+                        for (DWORD i = 0; i < dwRequests; i++)
+                        {
+                            if (FAILED(pConnection->Send(GET_REQUEST, sizeof(GET_REQUEST) - 1)) ||
+                                FAILED(pConnection->ReceiveResponseHead(FALSE, &pszHead, &cchHead, &uStatus)))
+                            {
+                                cFailures++;
+                                return;
+                            }
+                            do
+                            {
+                                if (FAILED(pConnection->ReadBody(buffer.data(), static_cast<DWORD>(buffer.size()), &cbRead)))
+                                {
+                                    cFailures++;
+                                    return;
+                                }
+                            } while (cbRead != 0);
+                        }
+                    });
+
+                    connections.clear();
+                    EXPECT_EQ(0u, cFailures.load());
+
+                    sprintf_s(szName, "%s %uB threads=%u",
+                              transport == LOCAL_TRANSPORT_UNIX_SOCKET ? "unix socket" : "tcp loopback",
+                              cbResponse,
+                              dwThreads);
+                    Benchmark::Report(szName, ns, static_cast<ULONGLONG>(dwThreads) * dwRequests);
+                }
+            }
+        }
+    }
+}
@@ -7,6 +7,14 @@ DECLARE_DEBUG_PRINT_OBJECT2("tests", ASPNETCORE_DEBUG_FLAG_INFO | ASPNETCORE_DEB
 
 int wmain(int argc, wchar_t* argv[])
 {
+    //
+    // the test binary doubles as the stub backend of the readiness benchmark.
+    //
+    if (argc > 1 && wcscmp(argv[1], L"--readiness-stub") == 0)
+    {
+        return ReadinessStubMain(argc, argv);
+    }
+
     ::testing::InitGoogleTest(&argc, argv);
     RUN_ALL_TESTS();
 }
@@ -0,0 +1,220 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#include "stdafx.h"
+#include "phaselatency.h"
+#include "Benchmark.h"
+
+namespace PhaseLatencyTests
+{
+    TEST(PhaseLatency, BucketsCoverEveryValueInOrder)
+    {
+        DWORD iLast = 0;
+
+        for (ULONGLONG ullTicks = 0; ullTicks < (1 << 20); ullTicks++)
+        {
+            DWORD i = REQUEST_PHASE_LATENCY::QueryBucket(ullTicks);
+
+            ASSERT_TRUE(i == iLast || i == iLast + 1) << ullTicks;
+            ASSERT_LE(ullTicks, REQUEST_PHASE_LATENCY::QueryBucketLimit(i)) << ullTicks;
+            if (i > 0)
+            {
+                ASSERT_GT(ullTicks, REQUEST_PHASE_LATENCY::QueryBucketLimit(i - 1)) << ullTicks;
+            }
+            iLast = i;
+        }
+    }
+
+    TEST(PhaseLatency, BucketsAreWithinAnEighth)
+    {
+        for (ULONGLONG ullTicks = 16; ullTicks >> REQUEST_PHASE_LATENCY::MAX_VALUE_BITS == 0; ullTicks = ullTicks * 3 / 2 + 1)
+        {
+            ULONGLONG ullLimit = REQUEST_PHASE_LATENCY::QueryBucketLimit(REQUEST_PHASE_LATENCY::QueryBucket(ullTicks));
+
+            EXPECT_GE(ullLimit, ullTicks);
+            EXPECT_LE(ullLimit - ullTicks, ullTicks / 8) << ullTicks;
+        }
+    }
+
+    TEST(PhaseLatency, LongTimesGoInTheLastBucket)
+    {
+        const ULONGLONG ullTop = 1ULL << REQUEST_PHASE_LATENCY::MAX_VALUE_BITS;
+
+        EXPECT_EQ(REQUEST_PHASE_LATENCY::BUCKETS - 1, REQUEST_PHASE_LATENCY::QueryBucket(ullTop - 1));
+        EXPECT_EQ(REQUEST_PHASE_LATENCY::BUCKETS - 1, REQUEST_PHASE_LATENCY::QueryBucket(ullTop));
+        EXPECT_EQ(REQUEST_PHASE_LATENCY::BUCKETS - 1, REQUEST_PHASE_LATENCY::QueryBucket(MAXULONGLONG));
+        EXPECT_EQ(ullTop - 1, REQUEST_PHASE_LATENCY::QueryBucketLimit(REQUEST_PHASE_LATENCY::BUCKETS - 1));
+    }
+
+    TEST(PhaseLatency, CountersGivePercentilesOfEachPhase)
+    {
+        REQUEST_PHASE_LATENCY latency;
+        REQUEST_PHASE_LATENCY_COUNTERS counters;
+
+        ASSERT_EQ(S_OK, latency.Initialize());
+
+        //
+        // 1 to 100 times 1000 ticks for SEND, nothing for the others.
+        //
+        for (LONGLONG i = 1; i <= 100; i++)
+        {
+            latency.Record(REQUEST_PHASE_SEND, i * 1000);
+        }
+
+        latency.QueryCounters(&counters);
+
+        for (DWORD phase = 0; phase < REQUEST_PHASE_COUNT; phase++)
+        {
+            if (phase != REQUEST_PHASE_SEND)
+            {
+                EXPECT_EQ(0, counters.rgPhases[phase].cSamples);
+                EXPECT_EQ(0, counters.rgPhases[phase].ullMaxUs);
+            }
+        }
+
+        const REQUEST_PHASE_STATS &stats = counters.rgPhases[REQUEST_PHASE_SEND];
+        auto Bucketed = [](ULONGLONG ullTicks)
+        {
+            return REQUEST_PHASE_LATENCY::TicksToMicroseconds(
+                REQUEST_PHASE_LATENCY::QueryBucketLimit(REQUEST_PHASE_LATENCY::QueryBucket(ullTicks)));
+        };
+
+        EXPECT_EQ(100, stats.cSamples);
+        EXPECT_EQ(REQUEST_PHASE_LATENCY::TicksToMicroseconds(50500), stats.ullMeanUs);
+        EXPECT_EQ(Bucketed(50000), stats.ullP50Us);
+        EXPECT_EQ(Bucketed(90000), stats.ullP90Us);
+        EXPECT_EQ(Bucketed(99000), stats.ullP99Us);
+        EXPECT_EQ(Bucketed(100000), stats.ullMaxUs);
+    }
+
+    TEST(PhaseLatency, NegativeTimesCountAsZero)
+    {
+        REQUEST_PHASE_LATENCY latency;
+        REQUEST_PHASE_LATENCY_COUNTERS counters;
+
+        ASSERT_EQ(S_OK, latency.Initialize());
+        latency.Record(REQUEST_PHASE_CONNECT, -5);
+        latency.QueryCounters(&counters);
+
+        EXPECT_EQ(1, counters.rgPhases[REQUEST_PHASE_CONNECT].cSamples);
+        EXPECT_EQ(0, counters.rgPhases[REQUEST_PHASE_CONNECT].ullMaxUs);
+    }
+
+    TEST(PhaseLatency, ClockRecordsOnlyStartedPhases)
+    {
+        REQUEST_PHASE_LATENCY latency;
+        REQUEST_PHASE_LATENCY_COUNTERS counters;
+
+        ASSERT_EQ(S_OK, latency.Initialize());
+
+        REQUEST_PHASE_CLOCK clock(&latency);
+
+        //
+        // A request that was not queued, and whose body never ended.
+        //
+        clock.Stop(REQUEST_PHASE_QUEUE);
+        clock.Start(REQUEST_PHASE_CONNECT);
+        clock.Next(REQUEST_PHASE_CONNECT, REQUEST_PHASE_SEND);
+        clock.Next(REQUEST_PHASE_SEND, REQUEST_PHASE_FIRST_BYTE);
+        Sleep(20);
+        clock.Next(REQUEST_PHASE_FIRST_BYTE, REQUEST_PHASE_BODY);
+
+        //
+        // Stopped once, the second stop is not recorded again.
+        //
+        clock.Stop(REQUEST_PHASE_FIRST_BYTE);
+        clock.Complete();
+
+        latency.QueryCounters(&counters);
+
+        EXPECT_EQ(0, counters.rgPhases[REQUEST_PHASE_QUEUE].cSamples);
+        EXPECT_EQ(1, counters.rgPhases[REQUEST_PHASE_CONNECT].cSamples);
+        EXPECT_EQ(1, counters.rgPhases[REQUEST_PHASE_SEND].cSamples);
+        EXPECT_EQ(1, counters.rgPhases[REQUEST_PHASE_FIRST_BYTE].cSamples);
+        EXPECT_EQ(0, counters.rgPhases[REQUEST_PHASE_BODY].cSamples);
+        EXPECT_EQ(0, counters.rgPhases[REQUEST_PHASE_CLIENT_WRITE].cSamples);
+
+        EXPECT_GE(clock.QueryMicroseconds(REQUEST_PHASE_FIRST_BYTE), 15000u);
+        EXPECT_GE(counters.rgPhases[REQUEST_PHASE_FIRST_BYTE].ullP50Us, 15000u);
+        EXPECT_EQ(0u, clock.QueryMicroseconds(REQUEST_PHASE_BODY));
+    }
+
+    TEST(PhaseLatency, ClientWritesAddUpToOneSample)
+    {
+        REQUEST_PHASE_LATENCY latency;
+        REQUEST_PHASE_LATENCY_COUNTERS counters;
+
+        ASSERT_EQ(S_OK, latency.Initialize());
+
+        REQUEST_PHASE_CLOCK clock(&latency);
+
+        //
+        // A completion with no write in progress is not a write.
+        //
+        clock.StopClientWrite();
+        for (DWORD i = 0; i < 3; i++)
+        {
+            clock.StartClientWrite();
+            Sleep(10);
+            clock.StopClientWrite();
+            clock.StopClientWrite();
+        }
+
+        latency.QueryCounters(&counters);
+        EXPECT_EQ(0, counters.rgPhases[REQUEST_PHASE_CLIENT_WRITE].cSamples);
+
+        clock.Complete();
+        latency.QueryCounters(&counters);
+        EXPECT_EQ(1, counters.rgPhases[REQUEST_PHASE_CLIENT_WRITE].cSamples);
+        EXPECT_GE(clock.QueryMicroseconds(REQUEST_PHASE_CLIENT_WRITE), 25000u);
+
+        //
+        // A request without writes records none.
+        //
+        REQUEST_PHASE_CLOCK other(&latency);
+        other.Complete();
+        latency.QueryCounters(&counters);
+        EXPECT_EQ(1, counters.rgPhases[REQUEST_PHASE_CLIENT_WRITE].cSamples);
+    }
+
+    TEST(PhaseLatency, ClockWithoutHistogramsOnlyTimes)
+    {
+        REQUEST_PHASE_CLOCK clock(NULL);
+
+        clock.Start(REQUEST_PHASE_BODY);
+        Sleep(10);
+        clock.Stop(REQUEST_PHASE_BODY);
+        clock.StartClientWrite();
+        clock.StopClientWrite();
+        clock.Complete();
+
+        EXPECT_GE(clock.QueryMicroseconds(REQUEST_PHASE_BODY), 5000u);
+    }
+
+    TEST(PhaseLatency, ConcurrentRecordsAreAllCounted)
+    {
+        const DWORD dwThreads = 8;
+        const DWORD dwRecords = 100000;
+        REQUEST_PHASE_LATENCY latency;
+        REQUEST_PHASE_LATENCY_COUNTERS counters;
+
+        ASSERT_EQ(S_OK, latency.Initialize());
+
+        Benchmark::RunConcurrently(dwThreads, [&](DWORD dwThread)
+        {
+            for (DWORD i = 0; i < dwRecords; i++)
+            {
+                latency.Record(static_cast<REQUEST_PHASE>((dwThread + i) % REQUEST_PHASE_COUNT), i);
+            }
+        });
+
+        latency.QueryCounters(&counters);
+
+        ULONGLONG cSamples = 0;
+        for (DWORD phase = 0; phase < REQUEST_PHASE_COUNT; phase++)
+        {
+            cSamples += counters.rgPhases[phase].cSamples;
+        }
+        EXPECT_EQ(static_cast<ULONGLONG>(dwThreads) * dwRecords, cSamples);
+    }
+}
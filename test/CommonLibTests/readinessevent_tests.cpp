@@ -0,0 +1,288 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#include "stdafx.h"
+#include <winsock2.h>
+#include <iphlpapi.h>
+#include "readinessevent.h"
+#include "Benchmark.h"
+
+#define READINESS_STUB_PORT_ENV     L"ASPNETCORE_PORT"
+#define READINESS_STUB_EVENT_ENV    L"ASPNETCORE_READY_EVENT"
+
+//
+// Stand-in for a backend: sleeps for the startup time given on the command
+// line, listens on ASPNETCORE_PORT and signals ASPNETCORE_READY_EVENT if
+// it is set. It runs until it is terminated.
+//
+int
+ReadinessStubMain(
+    int         argc,
+    wchar_t*    argv[]
+)
+{
+    WSADATA     wsaData;
+    SOCKADDR_IN address = {};
+    SOCKET      listenSocket;
+    WCHAR       szValue[MAX_PATH];
+
+    if (argc < 3 || WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+    {
+        return 1;
+    }
+
+    Sleep(static_cast<DWORD>(_wtoi(argv[2])));
+
+    if (GetEnvironmentVariableW(READINESS_STUB_PORT_ENV, szValue, _countof(szValue)) == 0)
+    {
+        return 1;
+    }
+
+    address.sin_family = AF_INET;
+    address.sin_port = htons(static_cast<USHORT>(_wtoi(szValue)));
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listenSocket == INVALID_SOCKET ||
+        bind(listenSocket, reinterpret_cast<SOCKADDR*>(&address), sizeof(address)) != 0 ||
+        listen(listenSocket, SOMAXCONN) != 0)
+    {
+        return 1;
+    }
+
+    if (GetEnvironmentVariableW(READINESS_STUB_EVENT_ENV, szValue, _countof(szValue)) != 0)
+    {
+        READINESS_EVENT::Signal(szValue);
+    }
+
+    Sleep(INFINITE);
+    return 0;
+}
+
+namespace ReadinessEventTests
+{
+    TEST(ReadinessEvent, SignalWakesWaiterOnce)
+    {
+        READINESS_EVENT readinessEvent;
+
+        ASSERT_EQ(S_OK, readinessEvent.Create(5000));
+        ASSERT_TRUE(readinessEvent.IsCreated());
+
+        EXPECT_EQ(WAIT_TIMEOUT, readinessEvent.Wait(NULL, 0));
+        EXPECT_EQ(S_OK, READINESS_EVENT::Signal(readinessEvent.QueryName()));
+        EXPECT_EQ(WAIT_OBJECT_0, readinessEvent.Wait(NULL, 0));
+
+        //
+        // auto reset, later waits fall back to the poll interval.
+        //
+        EXPECT_EQ(WAIT_TIMEOUT, readinessEvent.Wait(NULL, 0));
+    }
+
+    TEST(ReadinessEvent, NamesAreUniquePerStart)
+    {
+        READINESS_EVENT first;
+        READINESS_EVENT second;
+
+        ASSERT_EQ(S_OK, first.Create(5000));
+        ASSERT_EQ(S_OK, second.Create(5000));
+        EXPECT_STRNE(first.QueryName(), second.QueryName());
+
+        std::wstring name = first.QueryName();
+        first.Close();
+        EXPECT_FALSE(first.IsCreated());
+        EXPECT_TRUE(FAILED(READINESS_EVENT::Signal(name.c_str())));
+    }
+
+    TEST(ReadinessEvent, ExitedProcessEndsWait)
+    {
+        READINESS_EVENT readinessEvent;
+        HANDLE hThread;
+
+        ASSERT_EQ(S_OK, readinessEvent.Create(5000));
+
+        hThread = CreateThread(NULL, 0, [](LPVOID) -> DWORD { return 0; }, NULL, 0, NULL);
+        ASSERT_NE(nullptr, hThread);
+        WaitForSingleObject(hThread, INFINITE);
+
+        EXPECT_EQ(WAIT_OBJECT_0 + 1, readinessEvent.Wait(hThread, INFINITE));
+        CloseHandle(hThread);
+    }
+
+    TEST(ReadinessEvent, WithoutEventWaitSleeps)
+    {
+        READINESS_EVENT readinessEvent;
+
+        EXPECT_FALSE(readinessEvent.IsCreated());
+        EXPECT_EQ(WAIT_TIMEOUT, readinessEvent.Wait(NULL, 1));
+    }
+
+    //
+    // A cancelled start does not sit out the poll interval, with or
+    // without an event.
+    //
+    TEST(ReadinessEvent, CancelEndsWait)
+    {
+        READINESS_EVENT readinessEvent;
+        HANDLE hCancel = CreateEvent(NULL, TRUE, TRUE, NULL);
+        ULONGLONG ullStart;
+
+        ASSERT_NE(nullptr, hCancel);
+
+        ullStart = GetTickCount64();
+        readinessEvent.Wait(NULL, 60000, hCancel);
+        EXPECT_LT(GetTickCount64() - ullStart, 30000u);
+
+        ASSERT_EQ(S_OK, readinessEvent.Create(5000));
+
+        ullStart = GetTickCount64();
+        EXPECT_EQ(WAIT_OBJECT_0 + 1, readinessEvent.Wait(NULL, 60000, hCancel));
+        EXPECT_LT(GetTickCount64() - ullStart, 30000u);
+
+        CloseHandle(hCancel);
+    }
+
+    //
+    // Same check as SERVER_PROCESS::CheckIfServerIsUp: is anybody listening
+    // on dwPort according to the TCP table.
+    //
+    static
+    BOOL
+    IsListening(
+        DWORD       dwPort
+    )
+    {
+        std::vector<BYTE> buffer(4096);
+        DWORD dwSize = static_cast<DWORD>(buffer.size());
+        DWORD dwResult;
+
+        while ((dwResult = GetExtendedTcpTable(buffer.data(), &dwSize, FALSE, AF_INET,
+                                               TCP_TABLE_OWNER_PID_LISTENER, 0)) == ERROR_INSUFFICIENT_BUFFER)
+        {
+            buffer.resize(dwSize);
+        }
+
+        if (dwResult != NO_ERROR)
+        {
+            return FALSE;
+        }
+
+        auto pTable = reinterpret_cast<MIB_TCPTABLE_OWNER_PID*>(buffer.data());
+        for (DWORD i = 0; i < pTable->dwNumEntries; i++)
+        {
+            if (ntohs(static_cast<USHORT>(pTable->table[i].dwLocalPort)) == dwPort)
+            {
+                return TRUE;
+            }
+        }
+        return FALSE;
+    }
+
+    static
+    DWORD
+    QueryFreePort()
+    {
+        SOCKADDR_IN address = {};
+        int cbAddress = sizeof(address);
+        SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        bind(s, reinterpret_cast<SOCKADDR*>(&address), sizeof(address));
+        getsockname(s, reinterpret_cast<SOCKADDR*>(&address), &cbAddress);
+        closesocket(s);
+
+        return ntohs(address.sin_port);
+    }
+
+    //
+    // Starts the stub and runs the PostStartCheck loop against it, returns
+    // the time from CreateProcess until the loop saw the port listening.
+    //
+    static
+    double
+    MeasureStartup(
+        DWORD       dwStartupMs,
+        BOOL        fUseEvent
+    )
+    {
+        READINESS_EVENT readinessEvent;
+        STARTUPINFOW startupInfo = { sizeof(startupInfo) };
+        PROCESS_INFORMATION processInformation = {};
+        WCHAR szExePath[MAX_PATH];
+        DWORD dwPort = QueryFreePort();
+
+        GetModuleFileNameW(NULL, szExePath, _countof(szExePath));
+        std::wstring commandLine = L"\"" + std::wstring(szExePath) + L"\" --readiness-stub " + std::to_wstring(dwStartupMs);
+
+        SetEnvironmentVariableW(READINESS_STUB_PORT_ENV, std::to_wstring(dwPort).c_str());
+        if (fUseEvent && SUCCEEDED(readinessEvent.Create(dwPort)))
+        {
+            SetEnvironmentVariableW(READINESS_STUB_EVENT_ENV, readinessEvent.QueryName());
+        }
+
+        auto start = std::chrono::high_resolution_clock::now();
+
+        BOOL fCreated = CreateProcessW(NULL, &commandLine[0], NULL, NULL, FALSE, CREATE_NO_WINDOW,
+                                       NULL, NULL, &startupInfo, &processInformation);
+
+        SetEnvironmentVariableW(READINESS_STUB_PORT_ENV, NULL);
+        SetEnvironmentVariableW(READINESS_STUB_EVENT_ENV, NULL);
+
+        if (!fCreated)
+        {
+            return -1;
+        }
+
+        while (!IsListening(dwPort) &&
+               WaitForSingleObject(processInformation.hProcess, 0) == WAIT_TIMEOUT)
+        {
+            readinessEvent.Wait(processInformation.hProcess, 250);
+        }
+
+        auto end = std::chrono::high_resolution_clock::now();
+
+        TerminateProcess(processInformation.hProcess, 0);
+        CloseHandle(processInformation.hThread);
+        CloseHandle(processInformation.hProcess);
+
+        return std::chrono::duration<double, std::milli>(end - start).count();
+    }
+
+    TEST(ReadinessEventBenchmark, DISABLED_StartupLatency)
+    {
+        const DWORD cIterations = 10;
+        WSADATA wsaData;
+
+        ASSERT_EQ(0, WSAStartup(MAKEWORD(2, 2), &wsaData));
+
+        for (DWORD dwStartupMs : { 100, 500, 1000 })
+        {
+            for (BOOL fUseEvent : { FALSE, TRUE })
+            {
+                double dTotalMs = 0;
+                double dMaxMs = 0;
+
+                for (DWORD i = 0; i < cIterations; i++)
+                {
+                    double dMs = MeasureStartup(dwStartupMs, fUseEvent);
+                    ASSERT_GE(dMs, 0);
+
+                    dTotalMs += dMs;
+                    if (dMs > dMaxMs)
+                    {
+                        dMaxMs = dMs;
+                    }
+                }
+
+                printf("startup %4u ms  %-8s  mean %8.1f ms  max %8.1f ms  (overhead %6.1f ms)\n",
+                    dwStartupMs,
+                    fUseEvent ? "event" : "polling",
+                    dTotalMs / cIterations,
+                    dMaxMs,
+                    dTotalMs / cIterations - dwStartupMs);
+            }
+        }
+
+        WSACleanup();
+    }
+}
@@ -0,0 +1,342 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#include "stdafx.h"
+#include "requestbodybatch.h"
+#include <random>
+
+namespace RequestBodyBatchTests
+{
+    static
+    std::string
+    ChunkSizeLine(
+        DWORD       cbChunk
+    )
+    {
+        BYTE rgbBuffer[REQUEST_BODY_BATCH::PREFIX_SIZE];
+        BYTE *pbEnd = rgbBuffer + sizeof(rgbBuffer);
+        BYTE *pbStart = REQUEST_BODY_BATCH::WriteChunkSize(pbEnd, cbChunk);
+
+        EXPECT_GE(pbStart, rgbBuffer);
+        return std::string(reinterpret_cast<PCSTR>(pbStart), pbEnd - pbStart);
+    }
+
+    TEST(RequestBodyBatch, ChunkSizeHasNoLimit)
+    {
+        EXPECT_EQ("1\r\n", ChunkSizeLine(0x1));
+        EXPECT_EQ("f\r\n", ChunkSizeLine(0xf));
+        EXPECT_EQ("10\r\n", ChunkSizeLine(0x10));
+        EXPECT_EQ("2000\r\n", ChunkSizeLine(0x2000));
+        EXPECT_EQ("ffff\r\n", ChunkSizeLine(0xffff));
+        EXPECT_EQ("10000\r\n", ChunkSizeLine(0x10000));
+        EXPECT_EQ("ffffffff\r\n", ChunkSizeLine(0xffffffff));
+    }
+
+    class RequestBodyBatchTest : public ::testing::Test
+    {
+    protected:
+
+        void Initialize(DWORD cbCapacity, BOOL fChunked)
+        {
+            _buffer.assign(REQUEST_BODY_BATCH::PREFIX_SIZE + cbCapacity + REQUEST_BODY_BATCH::SUFFIX_SIZE, 0);
+            _batch.Initialize(_buffer.data(), cbCapacity, fChunked);
+        }
+
+        DWORD Read(const std::string & data, DWORD cbRemaining)
+        {
+            BYTE *pbRead;
+            DWORD cbRead;
+
+            _batch.BeginRead(cbRemaining, &pbRead, &cbRead);
+            EXPECT_LE(data.size(), cbRead);
+            memcpy(pbRead, data.data(), data.size());
+            _batch.OnRead(static_cast<DWORD>(data.size()));
+            return cbRead;
+        }
+
+        std::string Frame(BOOL fLast)
+        {
+            BYTE *pbWrite;
+            DWORD cbWrite;
+
+            _batch.Frame(fLast, &pbWrite, &cbWrite);
+            EXPECT_GE(pbWrite, _buffer.data());
+            EXPECT_LE(pbWrite + cbWrite, _buffer.data() + _buffer.size());
+            return std::string(reinterpret_cast<PCSTR>(pbWrite), cbWrite);
+        }
+
+        std::vector<BYTE>       _buffer;
+        REQUEST_BODY_BATCH      _batch;
+    };
+
+    TEST_F(RequestBodyBatchTest, ReadsAreFramedAsOneChunk)
+    {
+        Initialize(16, TRUE);
+
+        EXPECT_EQ(16u, Read("hello", INFINITE));
+        EXPECT_EQ(11u, Read("world!!", INFINITE));
+        EXPECT_FALSE(_batch.IsEmpty());
+
+        EXPECT_EQ("c\r\nhelloworld!!\r\n", Frame(FALSE));
+        EXPECT_TRUE(_batch.IsEmpty());
+
+        //
+        // the next batch starts over at the front of the buffer.
+        //
+        EXPECT_EQ(16u, Read("12345678", INFINITE));
+        EXPECT_EQ("8\r\n12345678\r\n", Frame(FALSE));
+    }
+
+    TEST_F(RequestBodyBatchTest, LastChunkRidesAlong)
+    {
+        Initialize(16, TRUE);
+
+        Read("data", INFINITE);
+        EXPECT_EQ("4\r\ndata\r\n0\r\n\r\n", Frame(TRUE));
+
+        //
+        // body ended right after a write.
+        //
+        EXPECT_EQ("0\r\n\r\n", Frame(TRUE));
+    }
+
+    TEST_F(RequestBodyBatchTest, ContentLengthBodyIsNotFramed)
+    {
+        Initialize(16, FALSE);
+
+        EXPECT_EQ(7u, Read("abc", 7)); // never more than remains
+        EXPECT_EQ(4u, Read("defg", 4));
+        EXPECT_EQ("abcdefg", Frame(FALSE));
+    }
+
+    //
+    // Drives a batch the way FORWARDING_HANDLER does against a fake
+    // http.sys that has the body arrive in pieces: a read returns what has
+    // arrived, up to the requested size, and waits for the next piece only
+    // when nothing is there. cbCapacity of 8K gives the old one write per
+    // 8K read.
+    //
+    class UPLOAD_SIMULATION
+    {
+    public:
+
+        UPLOAD_SIMULATION(
+            const std::string &         body,
+            const std::vector<DWORD> &  arrivals
+        ) : m_body(body),
+            m_arrivals(arrivals),
+            m_iArrival(0),
+            m_cbArrived(0),
+            m_cbRead(0),
+            cReads(0),
+            cWrites(0)
+        {
+        }
+
+        VOID
+        Run(
+            DWORD       cbCapacity,
+            BOOL        fChunked
+        )
+        {
+            std::vector<BYTE> buffer(REQUEST_BODY_BATCH::PREFIX_SIZE + cbCapacity + REQUEST_BODY_BATCH::SUFFIX_SIZE);
+            REQUEST_BODY_BATCH batch;
+            DWORD cbRemaining = fChunked ? INFINITE : static_cast<DWORD>(m_body.size());
+
+            batch.Initialize(buffer.data(), cbCapacity, fChunked);
+
+            while (cbRemaining > 0)
+            {
+                BOOL fEndOfBody = FALSE;
+                BOOL fLastChunk = FALSE;
+                BYTE *pbRead;
+                DWORD cbRead;
+
+                batch.BeginRead(cbRemaining, &pbRead, &cbRead);
+                if (!Read(pbRead, &cbRead))
+                {
+                    fEndOfBody = TRUE;
+                }
+                else
+                {
+                    if (cbRemaining != INFINITE)
+                    {
+                        cbRemaining -= cbRead;
+                    }
+                    batch.OnRead(cbRead);
+                }
+
+                if (fEndOfBody)
+                {
+                    fLastChunk = (cbRemaining == INFINITE);
+                    cbRemaining = 0;
+                }
+
+                if (!batch.IsEmpty() || fLastChunk)
+                {
+                    BYTE *pbWrite;
+                    DWORD cbWrite;
+
+                    batch.Frame(fLastChunk, &pbWrite, &cbWrite);
+                    wire.append(reinterpret_cast<PCSTR>(pbWrite), cbWrite);
+                    cWrites++;
+                }
+            }
+        }
+
+        std::string     wire;
+        DWORD           cReads;
+        DWORD           cWrites;
+
+    private:
+
+        BOOL
+        Read(
+            BYTE *      pbRead,
+            DWORD *     pcbRead
+        )
+        {
+            cReads++;
+
+            if (m_cbArrived == m_cbRead)
+            {
+                if (m_iArrival == m_arrivals.size())
+                {
+                    return FALSE;
+                }
+                m_cbArrived = min(m_cbArrived + m_arrivals[m_iArrival++], static_cast<DWORD>(m_body.size()));
+            }
+
+            *pcbRead = min(*pcbRead, m_cbArrived - m_cbRead);
+            memcpy(pbRead, m_body.data() + m_cbRead, *pcbRead);
+            m_cbRead += *pcbRead;
+            return TRUE;
+        }
+
+        const std::string &         m_body;
+        std::vector<DWORD>          m_arrivals;
+        size_t                      m_iArrival;
+        DWORD                       m_cbArrived;
+        DWORD                       m_cbRead;
+    };
+
+    static
+    BOOL
+    DecodeChunked(
+        const std::string &     wire,
+        std::string *           pBody
+    )
+    {
+        size_t index = 0;
+
+        pBody->clear();
+        for (;;)
+        {
+            size_t crlf = wire.find("\r\n", index);
+            if (crlf == std::string::npos || crlf == index)
+            {
+                return FALSE;
+            }
+
+            size_t cbChunk = std::stoul(wire.substr(index, crlf - index), nullptr, 16);
+            index = crlf + 2;
+            if (cbChunk == 0)
+            {
+                return wire.compare(index, std::string::npos, "\r\n") == 0;
+            }
+
+            if (wire.size() < index + cbChunk + 2 || wire.compare(index + cbChunk, 2, "\r\n") != 0)
+            {
+                return FALSE;
+            }
+            pBody->append(wire, index, cbChunk);
+            index += cbChunk + 2;
+        }
+    }
+
+    static
+    std::string
+    RandomBody(
+        std::mt19937 &  generator,
+        DWORD           cbBody
+    )
+    {
+        std::uniform_int_distribution<int> byte(0, 255);
+        std::string body(cbBody, '\0');
+        for (CHAR & ch : body)
+        {
+            ch = static_cast<CHAR>(byte(generator));
+        }
+        return body;
+    }
+
+    TEST(RequestBodyBatchUpload, FastUploadNeedsFarFewerWrites)
+    {
+        const DWORD cbPerReadBefore = 8192;
+        std::mt19937 generator(12);
+        std::string body = RandomBody(generator, 1024 * 1024 + 1000);
+        std::string decoded;
+
+        //
+        // the whole body is waiting in http.sys, the old code wrote every
+        // 8K read on its own.
+        //
+        UPLOAD_SIMULATION before(body, { static_cast<DWORD>(body.size()) });
+        before.Run(cbPerReadBefore, TRUE);
+
+        UPLOAD_SIMULATION batched(body, { static_cast<DWORD>(body.size()) });
+        batched.Run(REQUEST_BODY_BATCH::DATA_SIZE, TRUE);
+
+        ASSERT_TRUE(DecodeChunked(batched.wire, &decoded));
+        EXPECT_TRUE(decoded == body);
+        EXPECT_NE(std::string::npos, batched.wire.find("10000\r\n"));
+
+        EXPECT_EQ(130u, before.cWrites);
+        EXPECT_EQ(18u, batched.cWrites);
+    }
+
+    TEST(RequestBodyBatchUpload, SlowUploadIsNotHeldBack)
+    {
+        std::mt19937 generator(34);
+        std::string body = RandomBody(generator, 20000);
+        std::vector<DWORD> arrivals(20, 1000);
+
+        UPLOAD_SIMULATION simulation(body, arrivals);
+        simulation.Run(REQUEST_BODY_BATCH::DATA_SIZE, FALSE);
+
+        //
+        // every piece goes out as soon as it has been read.
+        //
+        EXPECT_EQ(20u, simulation.cWrites);
+        EXPECT_TRUE(simulation.wire == body);
+    }
+
+    TEST(RequestBodyBatchUpload, RandomArrivalsRoundTrip)
+    {
+        std::mt19937 generator(56);
+        std::uniform_int_distribution<DWORD> size(0, 300000);
+        std::uniform_int_distribution<DWORD> piece(1, 90000);
+
+        for (DWORD iteration = 0; iteration < 200; iteration++)
+        {
+            std::string body = RandomBody(generator, size(generator));
+            std::vector<DWORD> arrivals;
+            std::string decoded;
+
+            for (DWORD cb = 0; cb < body.size(); )
+            {
+                arrivals.push_back(piece(generator));
+                cb += arrivals.back();
+            }
+
+            UPLOAD_SIMULATION chunked(body, arrivals);
+            chunked.Run(REQUEST_BODY_BATCH::DATA_SIZE, TRUE);
+            ASSERT_TRUE(DecodeChunked(chunked.wire, &decoded));
+            ASSERT_TRUE(decoded == body);
+
+            UPLOAD_SIMULATION contentLength(body, arrivals);
+            contentLength.Run(REQUEST_BODY_BATCH::DATA_SIZE, FALSE);
+            ASSERT_TRUE(contentLength.wire == body);
+        }
+    }
+}
@@ -0,0 +1,351 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#include "stdafx.h"
+#include "responsecache.h"
+#include "requestcoalescer.h"
+#include "Benchmark.h"
+
+namespace RequestCoalescerTests
+{
+    //
+    // A parked request, records how it was released.
+    //
+    class FAKE_WAITER
+    {
+    public:
+
+        FAKE_WAITER()
+        {
+            ZeroMemory(&waiter, sizeof(waiter));
+            waiter.pfnCompletion = OnCompletion;
+            waiter.pvContext = this;
+        }
+
+        ~FAKE_WAITER()
+        {
+            if (waiter.pEntry != NULL)
+            {
+                waiter.pEntry->DereferenceCacheEntry();
+            }
+        }
+
+        static
+        VOID
+        OnCompletion(
+            PVOID   pvContext
+        )
+        {
+            static_cast<FAKE_WAITER *>(pvContext)->cCompletions++;
+        }
+
+        FLIGHT_WAITER       waiter;
+        std::atomic<LONG>   cCompletions { 0 };
+    };
+
+    class RequestCoalescerTest : public ::testing::Test
+    {
+    protected:
+
+        void SetUp() override
+        {
+            ALLOC_CACHE_HANDLER::StaticInitialize();
+
+            _pCache = new RESPONSE_CACHE();
+            ASSERT_EQ(S_OK, _pCache->Initialize(1024 * 1024));
+
+            ASSERT_EQ(S_OK, _wheel.Initialize(FALSE));
+            ASSERT_EQ(S_OK, _coalescer.Initialize(TIMEOUT_MS, 4, &_wheel));
+        }
+
+        void TearDown() override
+        {
+            _pCache->Shutdown();
+            _pCache->DereferenceResponseCache();
+        }
+
+        FLIGHT_ROLE Join(PCSTR pszKey, FAKE_WAITER * pWaiter, REQUEST_FLIGHT ** ppFlight)
+        {
+            return _coalescer.Join(pszKey, static_cast<DWORD>(strlen(pszKey)), &pWaiter->waiter, _ullNow, ppFlight);
+        }
+
+        RESPONSE_CACHE_ENTRY * Capture(PCSTR pszBody)
+        {
+            RESPONSE_CACHE_WRITER writer(_pCache);
+            RESPONSE_CACHE_ENTRY *pEntry = NULL;
+
+            EXPECT_EQ(S_OK, writer.Initialize("GET localhost/a", 15));
+            EXPECT_EQ(S_OK, writer.SetStatus(200, "OK", NULL, NULL));
+            EXPECT_TRUE(writer.EndHeaders());
+            EXPECT_TRUE(writer.AppendBody(reinterpret_cast<const BYTE *>(pszBody), static_cast<DWORD>(strlen(pszBody))));
+            EXPECT_EQ(S_OK, writer.Commit(_ullNow, &pEntry));
+            return pEntry;
+        }
+
+        void AdvanceTo(ULONGLONG ullNow)
+        {
+            _ullNow = ullNow;
+            _wheel.Advance(ullNow);
+        }
+
+        REQUEST_COALESCER_COUNTERS Counters()
+        {
+            REQUEST_COALESCER_COUNTERS counters;
+            _coalescer.QueryCounters(&counters);
+            return counters;
+        }
+
+        static const DWORD      TIMEOUT_MS = 1000;
+
+        RESPONSE_CACHE *        _pCache = NULL;
+        TIMER_WHEEL             _wheel;
+        REQUEST_COALESCER       _coalescer;
+        ULONGLONG               _ullNow = 1000000;
+    };
+
+    TEST_F(RequestCoalescerTest, WaitersGetTheLeadersResponse)
+    {
+        FAKE_WAITER leader, first, second, other;
+        REQUEST_FLIGHT *pFlight = NULL;
+        REQUEST_FLIGHT *pOtherFlight = NULL;
+        REQUEST_FLIGHT *pNoFlight = NULL;
+
+        ASSERT_EQ(FLIGHT_LEAD, Join("GET localhost/a", &leader, &pFlight));
+        ASSERT_NE(nullptr, pFlight);
+        EXPECT_EQ(FLIGHT_WAIT, Join("GET localhost/a", &first, &pNoFlight));
+        EXPECT_EQ(FLIGHT_WAIT, Join("GET localhost/a", &second, &pNoFlight));
+        EXPECT_EQ(nullptr, pNoFlight);
+        ASSERT_EQ(FLIGHT_LEAD, Join("GET localhost/b", &other, &pOtherFlight));
+        EXPECT_EQ(0, first.cCompletions.load());
+
+        RESPONSE_CACHE_ENTRY *pEntry = Capture("shared");
+        _coalescer.Complete(pFlight, pEntry);
+        pEntry->DereferenceCacheEntry();
+
+        for (FAKE_WAITER *pWaiter : { &first, &second })
+        {
+            EXPECT_EQ(1, pWaiter->cCompletions.load());
+            ASSERT_EQ(pEntry, pWaiter->waiter.pEntry);
+        }
+
+        //
+        // each waiter holds its own reference.
+        //
+        first.waiter.pEntry->DereferenceCacheEntry();
+        first.waiter.pEntry = NULL;
+        DWORD cbBlock;
+        EXPECT_EQ(0, memcmp("shared", second.waiter.pEntry->QueryBlock(0, &cbBlock), 6));
+
+        EXPECT_EQ(0, other.cCompletions.load());
+        _coalescer.Complete(pOtherFlight, NULL);
+
+        REQUEST_COALESCER_COUNTERS counters = Counters();
+        EXPECT_EQ(2u, counters.cFlights);
+        EXPECT_EQ(2u, counters.cCoalesced);
+        EXPECT_EQ(0u, counters.cReleased);
+        EXPECT_EQ(0u, counters.cActiveFlights);
+
+        //
+        // the next request for the key starts a new flight.
+        //
+        ASSERT_EQ(FLIGHT_LEAD, Join("GET localhost/a", &leader, &pFlight));
+        _coalescer.Complete(pFlight, NULL);
+    }
+
+    TEST_F(RequestCoalescerTest, UnsharedResponseReleasesWaiters)
+    {
+        FAKE_WAITER leader, waiter;
+        REQUEST_FLIGHT *pFlight = NULL;
+        REQUEST_FLIGHT *pNoFlight = NULL;
+
+        ASSERT_EQ(FLIGHT_LEAD, Join("GET localhost/a", &leader, &pFlight));
+        ASSERT_EQ(FLIGHT_WAIT, Join("GET localhost/a", &waiter, &pNoFlight));
+
+        _coalescer.Complete(pFlight, NULL);
+
+        EXPECT_EQ(1, waiter.cCompletions.load());
+        EXPECT_EQ(nullptr, waiter.waiter.pEntry);
+        EXPECT_EQ(1u, Counters().cReleased);
+    }
+
+    TEST_F(RequestCoalescerTest, TimeoutReleasesWaiters)
+    {
+        FAKE_WAITER leader, early, late;
+        REQUEST_FLIGHT *pFlight = NULL;
+        REQUEST_FLIGHT *pNoFlight = NULL;
+
+        ASSERT_EQ(FLIGHT_LEAD, Join("GET localhost/a", &leader, &pFlight));
+        ASSERT_EQ(FLIGHT_WAIT, Join("GET localhost/a", &early, &pNoFlight));
+
+        ULONGLONG ullStarted = _ullNow;
+
+        AdvanceTo(ullStarted + TIMEOUT_MS - TIMER_WHEEL::TICK_MS);
+        EXPECT_EQ(0, early.cCompletions.load());
+
+        AdvanceTo(ullStarted + TIMEOUT_MS);
+        EXPECT_EQ(1, early.cCompletions.load());
+        EXPECT_EQ(nullptr, early.waiter.pEntry);
+
+        //
+        // the leader is still in the air, later requests do not wait on it.
+        //
+        EXPECT_EQ(FLIGHT_BYPASS, Join("GET localhost/a", &late, &pNoFlight));
+        EXPECT_EQ(1u, Counters().cActiveFlights);
+
+        RESPONSE_CACHE_ENTRY *pEntry = Capture("late");
+        _coalescer.Complete(pFlight, pEntry);
+        pEntry->DereferenceCacheEntry();
+
+        EXPECT_EQ(1, early.cCompletions.load());
+        EXPECT_EQ(nullptr, early.waiter.pEntry);
+
+        REQUEST_COALESCER_COUNTERS counters = Counters();
+        EXPECT_EQ(1u, counters.cReleased);
+        EXPECT_EQ(1u, counters.cBypassed);
+        EXPECT_EQ(0u, counters.cActiveFlights);
+    }
+
+    TEST_F(RequestCoalescerTest, TableIsBounded)
+    {
+        FAKE_WAITER waiters[6];
+        REQUEST_FLIGHT *rgpFlights[6] = {};
+
+        for (int i = 0; i < 4; i++)
+        {
+            std::string key = "GET localhost/" + std::to_string(i);
+            ASSERT_EQ(FLIGHT_LEAD, Join(key.c_str(), &waiters[i], &rgpFlights[i]));
+        }
+
+        EXPECT_EQ(FLIGHT_BYPASS, Join("GET localhost/4", &waiters[4], &rgpFlights[4]));
+        EXPECT_EQ(nullptr, rgpFlights[4]);
+
+        //
+        // waiting on a flight in the air takes no room.
+        //
+        EXPECT_EQ(FLIGHT_WAIT, Join("GET localhost/0", &waiters[5], &rgpFlights[5]));
+
+        for (int i = 0; i < 4; i++)
+        {
+            _coalescer.Complete(rgpFlights[i], NULL);
+        }
+
+        EXPECT_EQ(1, waiters[5].cCompletions.load());
+        EXPECT_EQ(1u, Counters().cBypassed);
+        EXPECT_EQ(0u, Counters().cActiveFlights);
+    }
+
+    TEST_F(RequestCoalescerTest, CompletedFlightDoesNotTimeOut)
+    {
+        FAKE_WAITER leader, waiter;
+        REQUEST_FLIGHT *pFlight = NULL;
+        REQUEST_FLIGHT *pNoFlight = NULL;
+        ULONGLONG ullStarted = _ullNow;
+
+        ASSERT_EQ(FLIGHT_LEAD, Join("GET localhost/a", &leader, &pFlight));
+        ASSERT_EQ(FLIGHT_WAIT, Join("GET localhost/a", &waiter, &pNoFlight));
+
+        _coalescer.Complete(pFlight, NULL);
+        EXPECT_EQ(1, waiter.cCompletions.load());
+
+        TIMER_WHEEL_COUNTERS wheelCounters;
+        _wheel.QueryCounters(&wheelCounters);
+        EXPECT_EQ(0u, wheelCounters.cPending);
+
+        AdvanceTo(ullStarted + 2 * TIMEOUT_MS);
+        EXPECT_EQ(1, waiter.cCompletions.load());
+        EXPECT_EQ(1u, Counters().cReleased);
+    }
+
+    TEST_F(RequestCoalescerTest, TimerReleasesWaiters)
+    {
+        TIMER_WHEEL wheel;
+        REQUEST_COALESCER coalescer;
+        FAKE_WAITER leader, waiter;
+        REQUEST_FLIGHT *pFlight = NULL;
+        REQUEST_FLIGHT *pNoFlight = NULL;
+
+        ASSERT_EQ(S_OK, wheel.Initialize());
+        ASSERT_EQ(S_OK, coalescer.Initialize(50, 4, &wheel));
+        ASSERT_EQ(FLIGHT_LEAD, coalescer.Join("GET localhost/a", 15, &leader.waiter, GetTickCount64(), &pFlight));
+        ASSERT_EQ(FLIGHT_WAIT, coalescer.Join("GET localhost/a", 15, &waiter.waiter, GetTickCount64(), &pNoFlight));
+
+        for (int i = 0; i < 200 && waiter.cCompletions == 0; i++)
+        {
+            Sleep(10);
+        }
+
+        EXPECT_EQ(1, waiter.cCompletions.load());
+        coalescer.Complete(pFlight, NULL);
+    }
+
+    //
+    // A burst of identical requests against a backend that takes a while,
+    // every request either gets the one response or is forwarded.
+    //
+    TEST_F(RequestCoalescerTest, StormReachesBackendOnce)
+    {
+        const DWORD cThreads = 16;
+        const DWORD cRounds = 50;
+        RESPONSE_CACHE_ENTRY *pEntry = Capture("storm");
+        std::atomic<DWORD> cBackendRequests(0);
+        std::atomic<DWORD> cShared(0);
+        std::atomic<DWORD> cBarrier(0);
+
+        Benchmark::RunConcurrently(cThreads, [&](DWORD)
+        {
+            for (DWORD round = 0; round < cRounds; round++)
+            {
+                FAKE_WAITER request;
+                REQUEST_FLIGHT *pFlight = NULL;
+                std::string key = "GET localhost/" + std::to_string(round);
+
+                switch (_coalescer.Join(key.c_str(), static_cast<DWORD>(key.size()), &request.waiter, GetTickCount64(), &pFlight))
+                {
+                case FLIGHT_LEAD:
+                    cBackendRequests++;
+                    //
+                    // the backend answers once everyone has arrived.
+                    //
+                    while (cBarrier < (round + 1) * cThreads - 1)
+                    {
+                        std::this_thread::yield();
+                    }
+                    _coalescer.Complete(pFlight, pEntry);
+                    cBarrier++;
+                    break;
+
+                case FLIGHT_WAIT:
+                    cBarrier++;
+                    while (request.cCompletions == 0)
+                    {
+                        std::this_thread::yield();
+                    }
+                    if (request.waiter.pEntry == pEntry)
+                    {
+                        cShared++;
+                    }
+                    break;
+
+                default:
+                    cBackendRequests++;
+                    cBarrier++;
+                    break;
+                }
+
+                //
+                // nobody starts the next round before the flight is gone.
+                //
+                while (cBarrier < (round + 1) * cThreads)
+                {
+                    std::this_thread::yield();
+                }
+            }
+        });
+
+        pEntry->DereferenceCacheEntry();
+
+        EXPECT_EQ(cRounds, cBackendRequests.load());
+        EXPECT_EQ(cRounds * (cThreads - 1), cShared.load());
+        EXPECT_EQ(0u, Counters().cActiveFlights);
+    }
+}
@@ -0,0 +1,352 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#include "stdafx.h"
+#include "requestheaderbuilder.h"
+
+namespace RequestHeaderBuilderTests
+{
+    //
+    // Counts the spills of the buffers it is handed, and with the debug CRT
+    // every CRT allocation made on any thread while it is alive.
+    //
+    class COUNTING_SPILL_ALLOCATOR : public BUFFER_SPILL_ALLOCATOR
+    {
+    public:
+
+        COUNTING_SPILL_ALLOCATOR() : m_cAllocations(0), m_cFrees(0)
+        {
+#ifdef _DEBUG
+            sm_cCrtAllocations = 0;
+            m_pfnOldHook = _CrtSetAllocHook(CrtAllocHook);
+#endif
+        }
+
+        ~COUNTING_SPILL_ALLOCATOR()
+        {
+#ifdef _DEBUG
+            _CrtSetAllocHook(m_pfnOldHook);
+#endif
+        }
+
+        PVOID
+        Alloc(
+            SIZE_T      cbSize
+        ) override
+        {
+            InterlockedIncrement(&m_cAllocations);
+            return HeapAlloc(GetProcessHeap(), 0, cbSize);
+        }
+
+        PVOID
+        ReAlloc(
+            PVOID       pMemory,
+            SIZE_T      cbOldSize,
+            SIZE_T      cbNewSize,
+            bool        fZeroMemoryBeyondOldSize
+        ) override
+        {
+            UNREFERENCED_PARAMETER(cbOldSize);
+            InterlockedIncrement(&m_cAllocations);
+            return HeapReAlloc(GetProcessHeap(), fZeroMemoryBeyondOldSize ? HEAP_ZERO_MEMORY : 0, pMemory, cbNewSize);
+        }
+
+        VOID
+        Free(
+            PVOID       pMemory
+        ) override
+        {
+            InterlockedIncrement(&m_cFrees);
+            HeapFree(GetProcessHeap(), 0, pMemory);
+        }
+
+        LONG
+        QueryAllocations() const
+        {
+#ifdef _DEBUG
+            return m_cAllocations + sm_cCrtAllocations;
+#else
+            return m_cAllocations;
+#endif
+        }
+
+        LONG
+        QueryFrees() const
+        {
+            return m_cFrees;
+        }
+
+    private:
+
+#ifdef _DEBUG
+        static
+        int
+        __cdecl
+        CrtAllocHook(
+            int                     nAllocType,
+            void *                  pvData,
+            size_t                  nSize,
+            int                     nBlockUse,
+            long                    lRequest,
+            const unsigned char *   szFileName,
+            int                     nLine
+        )
+        {
+            UNREFERENCED_PARAMETER(pvData);
+            UNREFERENCED_PARAMETER(nSize);
+            UNREFERENCED_PARAMETER(nBlockUse);
+            UNREFERENCED_PARAMETER(lRequest);
+            UNREFERENCED_PARAMETER(szFileName);
+            UNREFERENCED_PARAMETER(nLine);
+
+            if (nAllocType == _HOOK_ALLOC || nAllocType == _HOOK_REALLOC)
+            {
+                InterlockedIncrement(&sm_cCrtAllocations);
+            }
+            return TRUE;
+        }
+
+        static volatile LONG    sm_cCrtAllocations;
+        _CRT_ALLOC_HOOK         m_pfnOldHook;
+#endif
+
+        volatile LONG           m_cAllocations;
+        volatile LONG           m_cFrees;
+    };
+
+#ifdef _DEBUG
+    volatile LONG COUNTING_SPILL_ALLOCATOR::sm_cCrtAllocations = 0;
+#endif
+
+    class RequestHeaderBuilderTest : public ::testing::Test
+    {
+    protected:
+
+        void SetUp() override
+        {
+            ZeroMemory(&_headers, sizeof(_headers));
+            ZeroMemory(&_values, sizeof(_values));
+            _cUnknownHeaders = 0;
+            _values.fRemoveConnection = TRUE;
+        }
+
+        void SetKnown(HTTP_HEADER_ID id, PCSTR pszValue)
+        {
+            _headers.KnownHeaders[id].pRawValue = pszValue;
+            _headers.KnownHeaders[id].RawValueLength = static_cast<USHORT>(strlen(pszValue));
+        }
+
+        void AddUnknown(PCSTR pszName, PCSTR pszValue)
+        {
+            HTTP_UNKNOWN_HEADER & header = _rgUnknownHeaders[_cUnknownHeaders++];
+            header.pName = pszName;
+            header.NameLength = static_cast<USHORT>(strlen(pszName));
+            header.pRawValue = pszValue;
+            header.RawValueLength = static_cast<USHORT>(strlen(pszValue));
+
+            _headers.pUnknownHeaders = _rgUnknownHeaders;
+            _headers.UnknownHeaderCount = _cUnknownHeaders;
+        }
+
+        void SetForwardedHeaders()
+        {
+            _values.pszHost = L"localhost:5000";
+            _values.cchHost = static_cast<DWORD>(wcslen(_values.pszHost));
+            _values.pszToken = "5b0dc2c1-6a14-4e52-8d3c-e6e1e3b3b3a1";
+            _values.pszXForwardedForName = "X-Forwarded-For";
+            _values.pszRemoteAddress = "192.168.0.10";
+            _values.cchRemoteAddress = static_cast<DWORD>(strlen(_values.pszRemoteAddress));
+            _values.pszRemotePort = "50312";
+            _values.cchRemotePort = static_cast<DWORD>(strlen(_values.pszRemotePort));
+            _values.pszSslHeaderName = "X-Forwarded-Proto";
+            _values.pszScheme = "https";
+            _values.pszClientCertName = "MS-ASPNETCORE-CLIENTCERT";
+        }
+
+        std::wstring Build(BUFFER_T<WCHAR, FORWARDED_HEADERS_BUFFER_CCH> * pBuffer)
+        {
+            DWORD cchHeaders = 0;
+            EXPECT_EQ(S_OK, REQUEST_HEADER_BUILDER::Build(&_headers, _values, pBuffer, &cchHeaders));
+            EXPECT_EQ(L'\0', pBuffer->QueryPtr()[cchHeaders]);
+            return std::wstring(pBuffer->QueryPtr(), cchHeaders);
+        }
+
+        HTTP_REQUEST_HEADERS        _headers;
+        HTTP_UNKNOWN_HEADER         _rgUnknownHeaders[16];
+        USHORT                      _cUnknownHeaders;
+        FORWARDED_HEADER_VALUES     _values;
+    };
+
+    TEST_F(RequestHeaderBuilderTest, PassesHeadersThrough)
+    {
+        BUFFER_T<WCHAR, FORWARDED_HEADERS_BUFFER_CCH> buffer;
+
+        SetKnown(HttpHeaderAccept, "*/*");
+        SetKnown(HttpHeaderHost, "example.com");
+        AddUnknown("X-Custom", "value");
+
+        _values.fRemoveConnection = FALSE;
+
+        EXPECT_EQ(L"Accept: */*\r\nHost: example.com\r\nX-Custom: value\r\n", Build(&buffer));
+    }
+
+    TEST_F(RequestHeaderBuilderTest, AppliesForwardingRewrites)
+    {
+        BUFFER_T<WCHAR, FORWARDED_HEADERS_BUFFER_CCH> buffer;
+
+        SetKnown(HttpHeaderConnection, "keep-alive");
+        SetKnown(HttpHeaderHost, "example.com");
+        AddUnknown("MS-ASPNETCORE-TOKEN", "spoofed");
+        AddUnknown("ms-aspnetcore-winauthtoken", "spoofed");
+        AddUnknown("x-forwarded-for", "10.0.0.1");
+        AddUnknown("X-Forwarded-For", "10.0.0.2");
+        AddUnknown("X-Forwarded-Proto", "http");
+        AddUnknown("MS-ASPNETCORE-CLIENTCERT", "spoofed");
+        AddUnknown("X-Custom", "value");
+        SetForwardedHeaders();
+
+        EXPECT_EQ(L"Host: localhost:5000\r\n"
+                  L"X-Custom: value\r\n"
+                  L"MS-ASPNETCORE-TOKEN: 5b0dc2c1-6a14-4e52-8d3c-e6e1e3b3b3a1\r\n"
+                  L"X-Forwarded-For: 10.0.0.1, 192.168.0.10:50312\r\n"
+                  L"X-Forwarded-Proto: http, https\r\n",
+                  Build(&buffer));
+    }
+
+    TEST_F(RequestHeaderBuilderTest, AddsHeadersTheClientDidNotSend)
+    {
+        BUFFER_T<WCHAR, FORWARDED_HEADERS_BUFFER_CCH> buffer;
+        BYTE rgbCert[] = { 0x30, 0x82, 0x01, 0x0a, 0xff };
+
+        SetForwardedHeaders();
+        _values.pszWinAuthToken = "1a4";
+        _values.pszRemoteAddress = "::1";
+        _values.cchRemoteAddress = 3;
+        _values.fRemoteAddressIPv6 = TRUE;
+        _values.pszRemotePort = NULL;
+        _values.pbClientCert = rgbCert;
+        _values.cbClientCert = sizeof(rgbCert);
+
+        EXPECT_EQ(L"Host: localhost:5000\r\n"
+                  L"MS-ASPNETCORE-TOKEN: 5b0dc2c1-6a14-4e52-8d3c-e6e1e3b3b3a1\r\n"
+                  L"MS-ASPNETCORE-WINAUTHTOKEN: 1a4\r\n"
+                  L"X-Forwarded-For: [::1]\r\n"
+                  L"X-Forwarded-Proto: https\r\n"
+                  L"MS-ASPNETCORE-CLIENTCERT: MIIBCv8=\r\n",
+                  Build(&buffer));
+    }
+
+    TEST_F(RequestHeaderBuilderTest, WidensHeaderBytesOneToOne)
+    {
+        BUFFER_T<WCHAR, FORWARDED_HEADERS_BUFFER_CCH> buffer;
+
+        AddUnknown("X-Latin1", "caf\xe9");
+
+        EXPECT_EQ(L"X-Latin1: caf\x00e9\r\n", Build(&buffer));
+    }
+
+    TEST_F(RequestHeaderBuilderTest, CommonRequestDoesNotAllocate)
+    {
+        BUFFER_T<WCHAR, FORWARDED_HEADERS_BUFFER_CCH> buffer;
+        DWORD cchHeaders = 0;
+        LONG cAllocations = 0;
+        HRESULT hr;
+
+        SetKnown(HttpHeaderCacheControl, "max-age=0");
+        SetKnown(HttpHeaderConnection, "keep-alive");
+        SetKnown(HttpHeaderAccept, "text/html,application/xhtml+xml,application/xml;q=0.9,image/webp,image/apng,*/*;q=0.8");
+        SetKnown(HttpHeaderAcceptEncoding, "gzip, deflate, br");
+        SetKnown(HttpHeaderAcceptLanguage, "en-US,en;q=0.9,fr;q=0.8");
+        SetKnown(HttpHeaderCookie, ".AspNetCore.Antiforgery.w5W7x28NAIs=CfDJ8Gk3tJm2Q8xKXrZcY7WqGQyYhB2m4W1jR0Dq3T4nV6p8sL9uA0bC1dE2fG3hI4jK5lM6nO7pQ8rS9tU0vW1xY2zA3bC4dE5fG6hI7jK8lM9nO0pQ1rS2tU3vW4xY5zA6bC7dE8fG9hI0jK; ai_user=Qx1Zp|2018-07-20T17:22:31.112Z; ai_session=Rr7ab|1532107351114|1532107365210");
+        SetKnown(HttpHeaderHost, "www.contoso.com");
+        SetKnown(HttpHeaderReferer, "https://www.contoso.com/home/index");
+        SetKnown(HttpHeaderUserAgent, "Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/67.0.3396.99 Safari/537.36");
+        AddUnknown("Upgrade-Insecure-Requests", "1");
+        AddUnknown("DNT", "1");
+        SetForwardedHeaders();
+
+        {
+            COUNTING_SPILL_ALLOCATOR allocator;
+
+            buffer.SetSpillAllocator(&allocator);
+            hr = REQUEST_HEADER_BUILDER::Build(&_headers, _values, &buffer, &cchHeaders);
+            cAllocations = allocator.QueryAllocations();
+            buffer.SetSpillAllocator(NULL);
+        }
+
+        ASSERT_EQ(S_OK, hr);
+        EXPECT_EQ(0, cAllocations);
+
+        std::wstring headers(buffer.QueryPtr(), cchHeaders);
+        EXPECT_EQ(0u, headers.find(L"Cache-Control: max-age=0\r\nAccept: text/html"));
+        EXPECT_EQ(std::wstring::npos, headers.find(L"Connection:"));
+        EXPECT_NE(std::wstring::npos, headers.find(L"\r\nHost: localhost:5000\r\n"));
+        EXPECT_NE(std::wstring::npos, headers.find(L"\r\nX-Forwarded-For: 192.168.0.10:50312\r\nX-Forwarded-Proto: https\r\n"));
+    }
+
+    TEST_F(RequestHeaderBuilderTest, LargeHeadersSpillOnce)
+    {
+        //
+        // the buffer frees its spill into the allocator, which must outlive it.
+        //
+        COUNTING_SPILL_ALLOCATOR allocator;
+        BUFFER_T<WCHAR, FORWARDED_HEADERS_BUFFER_CCH> buffer;
+        std::string cookie(FORWARDED_HEADERS_BUFFER_CCH * 3, 'c');
+        std::string other(FORWARDED_HEADERS_BUFFER_CCH / 2, 'o');
+
+        SetKnown(HttpHeaderCookie, cookie.c_str());
+        AddUnknown("X-Other", other.c_str());
+        buffer.SetSpillAllocator(&allocator);
+
+        DWORD cchHeaders = 0;
+        LONG cAllocations = 0;
+        HRESULT hr;
+
+        hr = REQUEST_HEADER_BUILDER::Build(&_headers, _values, &buffer, &cchHeaders);
+        cAllocations = allocator.QueryAllocations();
+
+        //
+        // the cookie spills the buffer, doubling absorbs the rest.
+        //
+        ASSERT_EQ(S_OK, hr);
+        EXPECT_GE(cAllocations, 1);
+        EXPECT_LE(cAllocations, 2);
+
+        EXPECT_EQ(L"Cookie: " + std::wstring(cookie.begin(), cookie.end()) + L"\r\n" +
+                  L"X-Other: " + std::wstring(other.begin(), other.end()) + L"\r\n",
+                  std::wstring(buffer.QueryPtr(), cchHeaders));
+    }
+
+    TEST_F(RequestHeaderBuilderTest, SpilledHeadersCanBeReleasedEarly)
+    {
+        COUNTING_SPILL_ALLOCATOR allocator;
+        BUFFER_T<WCHAR, 16> buffer;
+        DWORD cchHeaders = 0;
+        HRESULT hr;
+
+        SetKnown(HttpHeaderUserAgent, "Mozilla/5.0 (Windows NT 10.0; Win64; x64)");
+        SetForwardedHeaders();
+        buffer.SetSpillAllocator(&allocator);
+
+        hr = REQUEST_HEADER_BUILDER::Build(&_headers, _values, &buffer, &cchHeaders);
+        ASSERT_EQ(S_OK, hr);
+        EXPECT_GT(buffer.QuerySize(), 16 * sizeof(WCHAR));
+
+        //
+        // the handler gives the spill back once WinHTTP has the headers.
+        //
+        buffer.FreeMemory();
+
+        EXPECT_EQ(1, allocator.QueryFrees());
+        EXPECT_EQ(16 * sizeof(WCHAR), buffer.QuerySize());
+
+        //
+        // the buffer is usable again and spills as before.
+        //
+        hr = REQUEST_HEADER_BUILDER::Build(&_headers, _values, &buffer, &cchHeaders);
+        ASSERT_EQ(S_OK, hr);
+        std::wstring headers(buffer.QueryPtr(), cchHeaders);
+        EXPECT_EQ(0u, headers.find(L"User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64)\r\n"));
+        EXPECT_NE(std::wstring::npos, headers.find(L"\r\nHost: localhost:5000\r\n"));
+    }
+}
@@ -0,0 +1,334 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#include "stdafx.h"
+#include "requestsnapshot.h"
+#include "Benchmark.h"
+
+namespace RequestSnapshotTests
+{
+    //
+    // A snapshot read back the way the managed server walks it.
+    //
+    struct PARSED_SNAPSHOT
+    {
+        REQUEST_SNAPSHOT_HEADER                         header;
+        std::string                                     verb;
+        std::string                                     rawUrl;
+        std::wstring                                    path;
+        std::wstring                                    queryString;
+        std::vector<std::pair<USHORT, std::string>>     knownHeaders;
+        std::vector<std::pair<std::string, std::string>> unknownHeaders;
+        std::vector<std::pair<USHORT, std::wstring>>    serverVariables;
+    };
+
+    class SNAPSHOT_READER
+    {
+    public:
+        SNAPSHOT_READER(const BYTE * pbSnapshot, DWORD cbSnapshot)
+            : m_pbSnapshot(pbSnapshot), m_cbSnapshot(cbSnapshot), m_cbRead(0)
+        {
+        }
+
+        template<typename T>
+        T Read()
+        {
+            T value;
+            ReadBytes(&value, sizeof(value));
+            return value;
+        }
+
+        std::string ReadString(DWORD cb)
+        {
+            std::string value(cb, '\0');
+            ReadBytes(&value[0], cb);
+            return value;
+        }
+
+        std::wstring ReadWideString(DWORD cb)
+        {
+            std::wstring value(cb / sizeof(WCHAR), L'\0');
+            ReadBytes(&value[0], cb);
+            return value;
+        }
+
+        DWORD QueryRead() const
+        {
+            return m_cbRead;
+        }
+
+    private:
+        VOID ReadBytes(VOID * pv, DWORD cb)
+        {
+            ASSERT_LE(m_cbRead + cb, m_cbSnapshot);
+            memcpy(pv, m_pbSnapshot + m_cbRead, cb);
+            m_cbRead += cb;
+        }
+
+        const BYTE *    m_pbSnapshot;
+        DWORD           m_cbSnapshot;
+        DWORD           m_cbRead;
+    };
+
+    PARSED_SNAPSHOT
+    Parse(const BYTE * pbSnapshot, DWORD cbSnapshot)
+    {
+        PARSED_SNAPSHOT snapshot;
+        SNAPSHOT_READER reader(pbSnapshot, cbSnapshot);
+
+        snapshot.header = reader.Read<REQUEST_SNAPSHOT_HEADER>();
+        snapshot.verb = reader.ReadString(reader.Read<USHORT>());
+        snapshot.rawUrl = reader.ReadString(reader.Read<USHORT>());
+        snapshot.path = reader.ReadWideString(reader.Read<USHORT>());
+        snapshot.queryString = reader.ReadWideString(reader.Read<USHORT>());
+
+        for (USHORT i = 0; i < snapshot.header.cKnownHeaders; i++)
+        {
+            USHORT id = reader.Read<USHORT>();
+            snapshot.knownHeaders.emplace_back(id, reader.ReadString(reader.Read<USHORT>()));
+        }
+
+        for (USHORT i = 0; i < snapshot.header.cUnknownHeaders; i++)
+        {
+            std::string name = reader.ReadString(reader.Read<USHORT>());
+            snapshot.unknownHeaders.emplace_back(name, reader.ReadString(reader.Read<USHORT>()));
+        }
+
+        for (USHORT i = 0; i < snapshot.header.cServerVariables; i++)
+        {
+            USHORT index = reader.Read<USHORT>();
+            snapshot.serverVariables.emplace_back(index, reader.ReadWideString(reader.Read<DWORD>()));
+        }
+
+        EXPECT_EQ(cbSnapshot, reader.QueryRead());
+        return snapshot;
+    }
+
+    //
+    // A GET with the headers a browser sends, as http.sys hands it over.
+    //
+    class RequestSnapshotTest : public ::testing::Test
+    {
+    protected:
+        void SetUp() override
+        {
+            HTTP_REQUEST * pRequest = m_context.GetRequest()->GetRawHttpRequest();
+
+            pRequest->Verb = HttpVerbGET;
+            pRequest->pRawUrl = s_szRawUrl;
+            pRequest->RawUrlLength = static_cast<USHORT>(strlen(s_szRawUrl));
+            pRequest->CookedUrl.pAbsPath = s_szAbsPath;
+            pRequest->CookedUrl.AbsPathLength = static_cast<USHORT>(wcschr(s_szAbsPath, L'?') - s_szAbsPath) * sizeof(WCHAR);
+            pRequest->CookedUrl.pQueryString = wcschr(s_szAbsPath, L'?');
+            pRequest->CookedUrl.QueryStringLength = static_cast<USHORT>(wcslen(pRequest->CookedUrl.pQueryString) * sizeof(WCHAR));
+
+            SetKnownHeader(HttpHeaderHost, "localhost:5000");
+            SetKnownHeader(HttpHeaderAccept, "text/html,application/xhtml+xml");
+            SetKnownHeader(HttpHeaderUserAgent, "Mozilla/5.0 (Windows NT 10.0; Win64; x64)");
+            SetKnownHeader(HttpHeaderCookie, ".AspNetCore.Session=CfDJ8Nq1fk");
+
+            m_unknownHeaders[0].pName = "X-Request-Id";
+            m_unknownHeaders[0].NameLength = 12;
+            m_unknownHeaders[0].pRawValue = "4bf92f3577b34da6";
+            m_unknownHeaders[0].RawValueLength = 16;
+            pRequest->Headers.pUnknownHeaders = m_unknownHeaders;
+            pRequest->Headers.UnknownHeaderCount = _countof(m_unknownHeaders);
+
+            m_context.SetServerVariable("REMOTE_ADDR", L"127.0.0.1");
+            m_context.SetServerVariable("SERVER_PORT", L"5000");
+            m_context.SetServerVariable("HTTPS", L"");
+        }
+
+        void SetKnownHeader(HTTP_HEADER_ID id, PCSTR pszValue)
+        {
+            HTTP_KNOWN_HEADER * pHeader = &m_context.GetRequest()->GetRawHttpRequest()->Headers.KnownHeaders[id];
+
+            pHeader->pRawValue = pszValue;
+            pHeader->RawValueLength = static_cast<USHORT>(strlen(pszValue));
+        }
+
+        static PCSTR        s_szRawUrl;
+        static PCWSTR       s_szAbsPath;
+
+        FakeHttpContext     m_context;
+        HTTP_UNKNOWN_HEADER m_unknownHeaders[1] = {};
+    };
+
+    PCSTR RequestSnapshotTest::s_szRawUrl = "/api/values?id=42";
+    PCWSTR RequestSnapshotTest::s_szAbsPath = L"/api/values?id=42";
+
+    TEST_F(RequestSnapshotTest, CarriesTheRequestAndItsHeaders)
+    {
+        PCSTR rgszServerVariables[] = { "REMOTE_ADDR", "SERVER_PORT" };
+        BYTE rgbBuffer[1024];
+        DWORD cbSnapshot;
+
+        REQUEST_SNAPSHOT_WRITER writer(rgbBuffer, sizeof(rgbBuffer));
+        ASSERT_EQ(S_OK, writer.Write(&m_context, rgszServerVariables, _countof(rgszServerVariables), &cbSnapshot));
+
+        PARSED_SNAPSHOT snapshot = Parse(rgbBuffer, cbSnapshot);
+
+        EXPECT_EQ(static_cast<DWORD>(REQUEST_SNAPSHOT_VERSION), snapshot.header.dwVersion);
+        EXPECT_EQ(cbSnapshot, snapshot.header.cbSnapshot);
+        EXPECT_EQ(static_cast<DWORD>(HttpVerbGET), snapshot.header.dwVerb);
+        EXPECT_EQ("", snapshot.verb);
+        EXPECT_EQ("/api/values?id=42", snapshot.rawUrl);
+        EXPECT_EQ(L"/api/values", snapshot.path);
+        EXPECT_EQ(L"?id=42", snapshot.queryString);
+
+        ASSERT_EQ(4u, snapshot.knownHeaders.size());
+        EXPECT_EQ(HttpHeaderAccept, snapshot.knownHeaders[0].first);
+        EXPECT_EQ(HttpHeaderCookie, snapshot.knownHeaders[1].first);
+        EXPECT_EQ(".AspNetCore.Session=CfDJ8Nq1fk", snapshot.knownHeaders[1].second);
+        EXPECT_EQ(HttpHeaderHost, snapshot.knownHeaders[2].first);
+        EXPECT_EQ("localhost:5000", snapshot.knownHeaders[2].second);
+        EXPECT_EQ(HttpHeaderUserAgent, snapshot.knownHeaders[3].first);
+
+        ASSERT_EQ(1u, snapshot.unknownHeaders.size());
+        EXPECT_EQ("X-Request-Id", snapshot.unknownHeaders[0].first);
+        EXPECT_EQ("4bf92f3577b34da6", snapshot.unknownHeaders[0].second);
+
+        ASSERT_EQ(2u, snapshot.serverVariables.size());
+        EXPECT_EQ(0, snapshot.serverVariables[0].first);
+        EXPECT_EQ(L"127.0.0.1", snapshot.serverVariables[0].second);
+        EXPECT_EQ(1, snapshot.serverVariables[1].first);
+        EXPECT_EQ(L"5000", snapshot.serverVariables[1].second);
+    }
+
+    TEST_F(RequestSnapshotTest, CarriesAnUnknownVerb)
+    {
+        HTTP_REQUEST * pRequest = m_context.GetRequest()->GetRawHttpRequest();
+        BYTE rgbBuffer[1024];
+        DWORD cbSnapshot;
+
+        pRequest->Verb = HttpVerbUnknown;
+        pRequest->pUnknownVerb = "PURGE";
+        pRequest->UnknownVerbLength = 5;
+
+        REQUEST_SNAPSHOT_WRITER writer(rgbBuffer, sizeof(rgbBuffer));
+        ASSERT_EQ(S_OK, writer.Write(&m_context, nullptr, 0, &cbSnapshot));
+
+        PARSED_SNAPSHOT snapshot = Parse(rgbBuffer, cbSnapshot);
+
+        EXPECT_EQ(static_cast<DWORD>(HttpVerbUnknown), snapshot.header.dwVerb);
+        EXPECT_EQ("PURGE", snapshot.verb);
+        EXPECT_EQ(0u, snapshot.serverVariables.size());
+    }
+
+    TEST_F(RequestSnapshotTest, LeavesOutVariablesThatAreNotSet)
+    {
+        PCSTR rgszServerVariables[] = { "HTTPS", "NO_SUCH_VARIABLE", "SERVER_PORT" };
+        BYTE rgbBuffer[1024];
+        DWORD cbSnapshot;
+
+        REQUEST_SNAPSHOT_WRITER writer(rgbBuffer, sizeof(rgbBuffer));
+        ASSERT_EQ(S_OK, writer.Write(&m_context, rgszServerVariables, _countof(rgszServerVariables), &cbSnapshot));
+
+        PARSED_SNAPSHOT snapshot = Parse(rgbBuffer, cbSnapshot);
+
+        ASSERT_EQ(1u, snapshot.serverVariables.size());
+        EXPECT_EQ(2, snapshot.serverVariables[0].first);
+        EXPECT_EQ(L"5000", snapshot.serverVariables[0].second);
+    }
+
+    TEST_F(RequestSnapshotTest, ReturnsTheSizeItTakesWhenTheBufferIsTooSmall)
+    {
+        PCSTR rgszServerVariables[] = { "REMOTE_ADDR" };
+        BYTE rgbSmall[64];
+        DWORD cbNeeded;
+        DWORD cbSnapshot;
+
+        REQUEST_SNAPSHOT_WRITER sizeWriter(nullptr, 0);
+        EXPECT_EQ(HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER),
+                  sizeWriter.Write(&m_context, rgszServerVariables, 1, &cbNeeded));
+        EXPECT_LT(sizeof(rgbSmall), cbNeeded);
+
+        REQUEST_SNAPSHOT_WRITER smallWriter(rgbSmall, sizeof(rgbSmall));
+        EXPECT_EQ(HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER),
+                  smallWriter.Write(&m_context, rgszServerVariables, 1, &cbSnapshot));
+        EXPECT_EQ(cbNeeded, cbSnapshot);
+
+        std::vector<BYTE> buffer(cbNeeded);
+        REQUEST_SNAPSHOT_WRITER writer(buffer.data(), cbNeeded);
+        ASSERT_EQ(S_OK, writer.Write(&m_context, rgszServerVariables, 1, &cbSnapshot));
+        EXPECT_EQ(cbNeeded, cbSnapshot);
+
+        PARSED_SNAPSHOT snapshot = Parse(buffer.data(), cbSnapshot);
+        EXPECT_EQ(4u, snapshot.knownHeaders.size());
+        ASSERT_EQ(1u, snapshot.serverVariables.size());
+        EXPECT_EQ(L"127.0.0.1", snapshot.serverVariables[0].second);
+    }
+
+    //
+    // What the managed server pays natively to start on a request: one
+    // server variable call per variable, each allocating a BSTR, and a copy
+    // per header, against one snapshot into a buffer it reuses. The managed
+    // to native transition each call also costs is not in here.
+    //
+    TEST_F(RequestSnapshotTest, DISABLED_SnapshotAgainstPerValueCalls)
+    {
+        const DWORD dwRequests = 1000000;
+        PCSTR rgszServerVariables[] = { "REMOTE_ADDR", "SERVER_PORT", "HTTPS" };
+        DWORD dwMaxThreads = Benchmark::QueryThreadCount();
+
+        for (DWORD dwThreads = 1; dwThreads <= dwMaxThreads; dwThreads *= 2)
+        {
+            char szName[128];
+
+            double ns = Benchmark::RunConcurrently(dwThreads, [&](DWORD)
+            {
+                volatile DWORD dwSink = 0;
+
+                for (DWORD i = 0; i < dwRequests; i++)
+                {
+                    HTTP_REQUEST * pRequest = m_context.GetRequest()->GetRawHttpRequest();
+
+                    for (DWORD id = 0; id < HttpHeaderRequestMaximum; id++)
+                    {
+                        HTTP_KNOWN_HEADER * pHeader = &pRequest->Headers.KnownHeaders[id];
+
+                        if (pHeader->RawValueLength > 0)
+                        {
+                            std::string value(pHeader->pRawValue, pHeader->RawValueLength);
+                            dwSink += static_cast<DWORD>(value.size());
+                        }
+                    }
+
+                    for (PCSTR pszVariable : rgszServerVariables)
+                    {
+                        PCWSTR pszValue;
+                        DWORD cchValue;
+
+                        if (SUCCEEDED(m_context.GetServerVariable(pszVariable, &pszValue, &cchValue)) && cchValue > 0)
+                        {
+                            BSTR bstrValue = SysAllocString(pszValue);
+                            dwSink += SysStringLen(bstrValue);
+                            SysFreeString(bstrValue);
+                        }
+                    }
+                }
+            });
+
+            sprintf_s(szName, "per-value calls threads=%u", dwThreads);
+            Benchmark::Report(szName, ns, static_cast<ULONGLONG>(dwThreads) * dwRequests);
+
+            ns = Benchmark::RunConcurrently(dwThreads, [&](DWORD)
+            {
+                BYTE rgbBuffer[1024];
+                volatile DWORD dwSink = 0;
+
+                for (DWORD i = 0; i < dwRequests; i++)
+                {
+                    DWORD cbSnapshot;
+                    REQUEST_SNAPSHOT_WRITER writer(rgbBuffer, sizeof(rgbBuffer));
+
+                    writer.Write(&m_context, rgszServerVariables, _countof(rgszServerVariables), &cbSnapshot);
+                    dwSink += cbSnapshot;
+                }
+            });
+
+            sprintf_s(szName, "REQUEST_SNAPSHOT_WRITER threads=%u", dwThreads);
+            Benchmark::Report(szName, ns, static_cast<ULONGLONG>(dwThreads) * dwRequests);
+        }
+    }
+}
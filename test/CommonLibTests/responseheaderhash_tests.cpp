@@ -0,0 +1,210 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#include "stdafx.h"
+#include "responseheaderhash.h"
+#include "Benchmark.h"
+
+namespace ResponseHeaderHashTests
+{
+    //
+    // The HASH_TABLE based lookup RESPONSE_HEADER_HASH replaced, kept here
+    // to check the classifier is a drop-in and to compare against.
+    //
+    struct LEGACY_HEADER_RECORD
+    {
+        PCSTR   _pszName;
+        ULONG   _ulHeaderIndex;
+    };
+
+    static LEGACY_HEADER_RECORD s_rgLegacyHeaders[] =
+    {
+        { "Cache-Control",       HttpHeaderCacheControl       },
+        { "Connection",          HttpHeaderConnection         },
+        { "Date",                HttpHeaderDate               },
+        { "Keep-Alive",          HttpHeaderKeepAlive          },
+        { "Pragma",              HttpHeaderPragma             },
+        { "Trailer",             HttpHeaderTrailer            },
+        { "Transfer-Encoding",   HttpHeaderTransferEncoding   },
+        { "Upgrade",             HttpHeaderUpgrade            },
+        { "Via",                 HttpHeaderVia                },
+        { "Warning",             HttpHeaderWarning            },
+        { "Allow",               HttpHeaderAllow              },
+        { "Content-Length",      HttpHeaderContentLength      },
+        { "Content-Type",        HttpHeaderContentType        },
+        { "Content-Encoding",    HttpHeaderContentEncoding    },
+        { "Content-Language",    HttpHeaderContentLanguage    },
+        { "Content-Location",    HttpHeaderContentLocation    },
+        { "Content-MD5",         HttpHeaderContentMd5         },
+        { "Content-Range",       HttpHeaderContentRange       },
+        { "Expires",             HttpHeaderExpires            },
+        { "Last-Modified",       HttpHeaderLastModified       },
+        { "Accept-Ranges",       HttpHeaderAcceptRanges       },
+        { "Age",                 HttpHeaderAge                },
+        { "ETag",                HttpHeaderEtag               },
+        { "Location",            HttpHeaderLocation           },
+        { "Proxy-Authenticate",  HttpHeaderProxyAuthenticate  },
+        { "Retry-After",         HttpHeaderRetryAfter         },
+        { "Server",              HttpHeaderServer             },
+        { "w:w\r\n",             HttpHeaderServer             },
+        { "y:y\r\n",             HttpHeaderSetCookie          },
+        { "Vary",                HttpHeaderVary               },
+        { "z:z\r\n",             HttpHeaderWwwAuthenticate    }
+    };
+
+    class LEGACY_RESPONSE_HEADER_HASH : public HASH_TABLE<LEGACY_HEADER_RECORD, PCSTR>
+    {
+    public:
+        VOID ReferenceRecord(LEGACY_HEADER_RECORD *) override {}
+        VOID DereferenceRecord(LEGACY_HEADER_RECORD *) override {}
+        PCSTR ExtractKey(LEGACY_HEADER_RECORD * pRecord) override { return pRecord->_pszName; }
+        DWORD CalcKeyHash(PCSTR key) override { return HashStringNoCase(key); }
+        BOOL EqualKeys(PCSTR key1, PCSTR key2) override { return _stricmp(key1, key2) == 0; }
+
+        HRESULT
+        Initialize()
+        {
+            HRESULT hr = HASH_TABLE::Initialize(79);
+            for (DWORD i = 0; SUCCEEDED(hr) && i < _countof(s_rgLegacyHeaders); i++)
+            {
+                hr = InsertRecord(&s_rgLegacyHeaders[i]);
+            }
+            return hr;
+        }
+
+        DWORD
+        GetIndex(PCSTR pszName)
+        {
+            LEGACY_HEADER_RECORD * pRecord = NULL;
+            FindKey(pszName, &pRecord);
+            return pRecord != NULL ? pRecord->_ulHeaderIndex : UNKNOWN_INDEX;
+        }
+    };
+
+    //
+    // Header names as they come back from Kestrel and common middleware.
+    //
+    static PCSTR s_rgKestrelHeaders[] =
+    {
+        "Date", "Content-Type", "Server", "Content-Length", "Transfer-Encoding",
+        "Cache-Control", "Pragma", "Expires", "Vary", "Set-Cookie", "Location",
+        "Last-Modified", "Accept-Ranges", "ETag", "Content-Encoding",
+        "X-Powered-By", "Request-Context", "Strict-Transport-Security",
+        "X-Frame-Options", "X-Content-Type-Options", "Content-Security-Policy",
+        "WWW-Authenticate", "Access-Control-Allow-Origin", "Retry-After",
+        "Content-Disposition", "X-Correlation-ID", "Alt-Svc", "Age", "Via",
+    };
+
+    TEST(ResponseHeaderHash, MatchesLegacyHashTable)
+    {
+        LEGACY_RESPONSE_HEADER_HASH legacy;
+        ASSERT_EQ(S_OK, legacy.Initialize());
+
+        for (const auto & header : s_rgLegacyHeaders)
+        {
+            //
+            // The legacy placeholder keys cannot appear in a parsed header
+            // name, which never contains ':'.
+            //
+            if (strchr(header._pszName, ':') == NULL)
+            {
+                EXPECT_EQ(header._ulHeaderIndex, RESPONSE_HEADER_HASH::GetIndex(header._pszName)) << header._pszName;
+            }
+        }
+
+        for (PCSTR pszName : s_rgKestrelHeaders)
+        {
+            EXPECT_EQ(legacy.GetIndex(pszName), RESPONSE_HEADER_HASH::GetIndex(pszName)) << pszName;
+        }
+
+        legacy.Clear();
+    }
+
+    TEST(ResponseHeaderHash, CaseInsensitiveExactMatch)
+    {
+        EXPECT_EQ(HttpHeaderContentLength, RESPONSE_HEADER_HASH::GetIndex("content-length"));
+        EXPECT_EQ(HttpHeaderContentLength, RESPONSE_HEADER_HASH::GetIndex("CONTENT-LENGTH"));
+        EXPECT_EQ(HttpHeaderEtag, RESPONSE_HEADER_HASH::GetIndex("Etag"));
+        EXPECT_EQ(HttpHeaderContentMd5, RESPONSE_HEADER_HASH::GetIndex("Content-Md5"));
+
+        EXPECT_EQ(UNKNOWN_INDEX, RESPONSE_HEADER_HASH::GetIndex(""));
+        EXPECT_EQ(UNKNOWN_INDEX, RESPONSE_HEADER_HASH::GetIndex("Dat"));
+        EXPECT_EQ(UNKNOWN_INDEX, RESPONSE_HEADER_HASH::GetIndex("Dates"));
+        EXPECT_EQ(UNKNOWN_INDEX, RESPONSE_HEADER_HASH::GetIndex("Content-MD4"));
+        EXPECT_EQ(UNKNOWN_INDEX, RESPONSE_HEADER_HASH::GetIndex("Cache\rControl"));
+        EXPECT_EQ(UNKNOWN_INDEX, RESPONSE_HEADER_HASH::GetIndex("Set-Cookie"));
+        EXPECT_EQ(UNKNOWN_INDEX, RESPONSE_HEADER_HASH::GetIndex("WWW-Authenticate"));
+
+        //
+        // Only the first cchName characters take part.
+        //
+        EXPECT_EQ(HttpHeaderAge, RESPONSE_HEADER_HASH::GetIndex("Age: 10", 3));
+    }
+
+    TEST(ResponseHeaderHashBenchmark, DISABLED_KestrelHeaderSets)
+    {
+        const DWORD dwIterations = 1000000;
+        LEGACY_RESPONSE_HEADER_HASH legacy;
+        volatile DWORD dwSink = 0;
+        DWORD rgcchNames[_countof(s_rgKestrelHeaders)];
+
+        ASSERT_EQ(S_OK, legacy.Initialize());
+        for (DWORD i = 0; i < _countof(s_rgKestrelHeaders); i++)
+        {
+            rgcchNames[i] = static_cast<DWORD>(strlen(s_rgKestrelHeaders[i]));
+        }
+
+        ULONGLONG ullOps = static_cast<ULONGLONG>(dwIterations) * _countof(s_rgKestrelHeaders);
+
+        double ns = Benchmark::RunConcurrently(1, [&](DWORD)
+        {
+            for (DWORD n = 0; n < dwIterations; n++)
+            {
+                for (DWORD i = 0; i < _countof(s_rgKestrelHeaders); i++)
+                {
+                    dwSink += legacy.GetIndex(s_rgKestrelHeaders[i]);
+                }
+            }
+        });
+        Benchmark::Report("HASH_TABLE GetIndex", ns, ullOps);
+
+        ns = Benchmark::RunConcurrently(1, [&](DWORD)
+        {
+            for (DWORD n = 0; n < dwIterations; n++)
+            {
+                for (DWORD i = 0; i < _countof(s_rgKestrelHeaders); i++)
+                {
+                    dwSink += RESPONSE_HEADER_HASH::GetIndex(s_rgKestrelHeaders[i], rgcchNames[i]);
+                }
+            }
+        });
+        Benchmark::Report("RESPONSE_HEADER_HASH GetIndex", ns, ullOps);
+
+        DWORD dwThreads = Benchmark::QueryThreadCount();
+        ns = Benchmark::RunConcurrently(dwThreads, [&](DWORD)
+        {
+            for (DWORD n = 0; n < dwIterations; n++)
+            {
+                for (DWORD i = 0; i < _countof(s_rgKestrelHeaders); i++)
+                {
+                    dwSink += legacy.GetIndex(s_rgKestrelHeaders[i]);
+                }
+            }
+        });
+        Benchmark::Report("HASH_TABLE GetIndex (all threads)", ns, ullOps * dwThreads);
+
+        ns = Benchmark::RunConcurrently(dwThreads, [&](DWORD)
+        {
+            for (DWORD n = 0; n < dwIterations; n++)
+            {
+                for (DWORD i = 0; i < _countof(s_rgKestrelHeaders); i++)
+                {
+                    dwSink += RESPONSE_HEADER_HASH::GetIndex(s_rgKestrelHeaders[i], rgcchNames[i]);
+                }
+            }
+        });
+        Benchmark::Report("RESPONSE_HEADER_HASH GetIndex (all threads)", ns, ullOps * dwThreads);
+
+        legacy.Clear();
+    }
+}
@@ -0,0 +1,634 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#include "stdafx.h"
+#include "responseheadertokenizer.h"
+#include "Benchmark.h"
+#include <random>
+
+namespace ResponseHeaderTokenizerTests
+{
+    //
+    // Places cch bytes right in front of a no access page so that reading
+    // past the range faults instead of passing silently.
+    //
+    class GUARDED_BUFFER
+    {
+    public:
+
+        GUARDED_BUFFER(
+            const std::string & content
+        ) : m_cch(static_cast<DWORD>(content.size()))
+        {
+            SYSTEM_INFO systemInfo;
+            DWORD dwOldProtect;
+
+            GetSystemInfo(&systemInfo);
+            m_cbPage = systemInfo.dwPageSize;
+            m_cbRegion = (m_cch + m_cbPage - 1) / m_cbPage * m_cbPage + m_cbPage;
+
+            m_pbRegion = static_cast<BYTE *>(VirtualAlloc(NULL, m_cbRegion, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+            VirtualProtect(m_pbRegion + m_cbRegion - m_cbPage, m_cbPage, PAGE_NOACCESS, &dwOldProtect);
+
+            m_pch = reinterpret_cast<PSTR>(m_pbRegion + m_cbRegion - m_cbPage - m_cch);
+            memcpy(m_pch, content.data(), m_cch);
+        }
+
+        ~GUARDED_BUFFER()
+        {
+            VirtualFree(m_pbRegion, 0, MEM_RELEASE);
+        }
+
+        PSTR
+        QueryPtr() const
+        {
+            return m_pch;
+        }
+
+        DWORD
+        QueryCCH() const
+        {
+            return m_cch;
+        }
+
+    private:
+
+        BYTE *  m_pbRegion;
+        SIZE_T  m_cbRegion;
+        DWORD   m_cbPage;
+        PSTR    m_pch;
+        DWORD   m_cch;
+    };
+
+    struct PARSED_RESPONSE
+    {
+        HRESULT                                             hr;
+        USHORT                                              uStatus;
+        std::string                                         reason;
+        std::vector<std::pair<std::string, std::string>>    headers;
+
+        bool operator==(const PARSED_RESPONSE & other) const
+        {
+            return hr == other.hr &&
+                   uStatus == other.uStatus &&
+                   reason == other.reason &&
+                   headers == other.headers;
+        }
+    };
+
+    static
+    PARSED_RESPONSE
+    Tokenize(
+        const std::string & response,
+        BYTE_SCANNER_KIND   kind
+    )
+    {
+        GUARDED_BUFFER buffer(response);
+        RESPONSE_HEADER_TOKENIZER tokenizer(buffer.QueryPtr(), buffer.QueryCCH(), kind);
+        PARSED_RESPONSE parsed = {};
+        PCSTR pszName;
+        DWORD cchName;
+        PCSTR pszValue;
+        DWORD cchValue;
+
+        parsed.hr = tokenizer.ParseStatusLine(&parsed.uStatus, &pszValue, &cchValue);
+        if (FAILED(parsed.hr))
+        {
+            return parsed;
+        }
+
+        EXPECT_EQ('\0', pszValue[cchValue]);
+        parsed.reason.assign(pszValue, cchValue);
+
+        while ((parsed.hr = tokenizer.NextHeader(&pszName, &cchName, &pszValue, &cchValue)) == S_OK)
+        {
+            EXPECT_EQ('\0', pszName[cchName]);
+            EXPECT_EQ('\0', pszValue[cchValue]);
+            parsed.headers.emplace_back(std::string(pszName, cchName), std::string(pszValue, cchValue));
+        }
+
+        return parsed;
+    }
+
+    //
+    // Straightforward std::string version of the same grammar, the fuzz
+    // tests hold the tokenizer to it.
+    //
+    static
+    PARSED_RESPONSE
+    ReferenceTokenize(
+        std::string         response
+    )
+    {
+        const HRESULT hrInvalid = HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER);
+        PARSED_RESPONSE parsed = {};
+        auto IsSpace = [](CHAR ch) { return ch == ' ' || ch == '\t'; };
+        auto TrimEnd = [&](size_t start, size_t end)
+        {
+            while (end > start && (IsSpace(response[end - 1]) || response[end - 1] == '\r'))
+            {
+                end--;
+            }
+            return end;
+        };
+
+        size_t newline = response.find('\n');
+        size_t index = response.find(' ');
+        if (newline == std::string::npos || index == std::string::npos || index > newline)
+        {
+            parsed.hr = hrInvalid;
+            return parsed;
+        }
+
+        while (index < newline && IsSpace(response[index]))
+        {
+            index++;
+        }
+        if (newline - index < 3 ||
+            !isdigit(static_cast<BYTE>(response[index])) ||
+            !isdigit(static_cast<BYTE>(response[index + 1])) ||
+            !isdigit(static_cast<BYTE>(response[index + 2])) ||
+            (index + 3 != newline && response[index + 3] != ' ' && response[index + 3] != '\r'))
+        {
+            parsed.hr = hrInvalid;
+            return parsed;
+        }
+
+        parsed.uStatus = static_cast<USHORT>(std::stoi(response.substr(index, 3)));
+        index += 3;
+        while (index < newline && IsSpace(response[index]))
+        {
+            index++;
+        }
+        parsed.reason = response.substr(index, TrimEnd(index, newline) - index);
+
+        for (size_t start = newline + 1; ; start = newline + 1)
+        {
+            if (start >= response.size() || response[start] == '\r' || response[start] == '\n' || response[start] == '\0')
+            {
+                parsed.hr = S_FALSE;
+                return parsed;
+            }
+
+            size_t colon = response.find_first_of(":\n", start);
+            if (colon == std::string::npos || response[colon] != ':' ||
+                (newline = response.find('\n', colon)) == std::string::npos)
+            {
+                parsed.hr = hrInvalid;
+                return parsed;
+            }
+
+            while (newline + 1 < response.size() && IsSpace(response[newline + 1]))
+            {
+                if (response[newline - 1] == '\r')
+                {
+                    response[newline - 1] = ' ';
+                }
+                response[newline] = ' ';
+                if ((newline = response.find('\n', newline)) == std::string::npos)
+                {
+                    parsed.hr = hrInvalid;
+                    return parsed;
+                }
+            }
+
+            size_t nameEnd = colon;
+            while (nameEnd > start && response[nameEnd - 1] == ' ')
+            {
+                nameEnd--;
+            }
+            if (nameEnd == start)
+            {
+                parsed.hr = hrInvalid;
+                return parsed;
+            }
+
+            size_t valueStart = colon + 1;
+            while (valueStart < newline && IsSpace(response[valueStart]))
+            {
+                valueStart++;
+            }
+
+            parsed.headers.emplace_back(response.substr(start, nameEnd - start),
+                                        response.substr(valueStart, TrimEnd(valueStart, newline) - valueStart));
+        }
+    }
+
+    static
+    std::vector<BYTE_SCANNER_KIND>
+    QuerySupportedKinds()
+    {
+        std::vector<BYTE_SCANNER_KIND> kinds;
+        for (int kind = BYTE_SCANNER_SCALAR; kind <= BYTE_SCANNER::QueryBestKind(); kind++)
+        {
+            kinds.push_back(static_cast<BYTE_SCANNER_KIND>(kind));
+        }
+        return kinds;
+    }
+
+    TEST(ResponseHeaderTokenizer, TokenizesKestrelResponse)
+    {
+        for (BYTE_SCANNER_KIND kind : QuerySupportedKinds())
+        {
+            PARSED_RESPONSE parsed = Tokenize(
+                "HTTP/1.1 404 Not Found\r\n"
+                "Date: Tue, 24 Jul 2018 17:22:31 GMT\r\n"
+                "Content-Type: text/plain\r\n"
+                "Server: Kestrel\r\n"
+                "Content-Length: 9\r\n"
+                "\r\n", kind);
+
+            EXPECT_EQ(S_FALSE, parsed.hr);
+            EXPECT_EQ(404, parsed.uStatus);
+            EXPECT_EQ("Not Found", parsed.reason);
+            ASSERT_EQ(4u, parsed.headers.size());
+            EXPECT_EQ("Date", parsed.headers[0].first);
+            EXPECT_EQ("Tue, 24 Jul 2018 17:22:31 GMT", parsed.headers[0].second);
+            EXPECT_EQ("Content-Length", parsed.headers[3].first);
+            EXPECT_EQ("9", parsed.headers[3].second);
+        }
+    }
+
+    TEST(ResponseHeaderTokenizer, TrimsWhitespaceAndAllowsEmptyValues)
+    {
+        PARSED_RESPONSE parsed = Tokenize(
+            "HTTP/1.1 200 \r\n"
+            "X-Padded  :  \t value with  spaces \t \r\n"
+            "X-Empty:\r\n"
+            "X-Blank:    \r\n"
+            "X-Bare-Newline:value\n"
+            "X-Colon: a:b\r\n", BYTE_SCANNER::QueryBestKind());
+
+        EXPECT_EQ(S_FALSE, parsed.hr);
+        EXPECT_EQ(200, parsed.uStatus);
+        EXPECT_EQ("", parsed.reason);
+        ASSERT_EQ(5u, parsed.headers.size());
+        EXPECT_EQ(std::make_pair(std::string("X-Padded"), std::string("value with  spaces")), parsed.headers[0]);
+        EXPECT_EQ(std::make_pair(std::string("X-Empty"), std::string()), parsed.headers[1]);
+        EXPECT_EQ(std::make_pair(std::string("X-Blank"), std::string()), parsed.headers[2]);
+        EXPECT_EQ(std::make_pair(std::string("X-Bare-Newline"), std::string("value")), parsed.headers[3]);
+        EXPECT_EQ(std::make_pair(std::string("X-Colon"), std::string("a:b")), parsed.headers[4]);
+    }
+
+    TEST(ResponseHeaderTokenizer, UnfoldsContinuationLines)
+    {
+        PARSED_RESPONSE parsed = Tokenize(
+            "HTTP/1.1 200 OK\r\n"
+            "X-Folded: first\r\n"
+            "   second\r\n"
+            "\tthird\r\n"
+            "X-Next: value\r\n"
+            "\r\n", BYTE_SCANNER::QueryBestKind());
+
+        EXPECT_EQ(S_FALSE, parsed.hr);
+        ASSERT_EQ(2u, parsed.headers.size());
+        EXPECT_EQ("first     second  \tthird", parsed.headers[0].second);
+        EXPECT_EQ("value", parsed.headers[1].second);
+    }
+
+    TEST(ResponseHeaderTokenizer, StatusLineWithoutReason)
+    {
+        PARSED_RESPONSE parsed = Tokenize("HTTP/1.1 204\r\n\r\n", BYTE_SCANNER::QueryBestKind());
+
+        EXPECT_EQ(S_FALSE, parsed.hr);
+        EXPECT_EQ(204, parsed.uStatus);
+        EXPECT_EQ("", parsed.reason);
+        EXPECT_TRUE(parsed.headers.empty());
+    }
+
+    TEST(ResponseHeaderTokenizer, RejectsMalformedInput)
+    {
+        const HRESULT hrInvalid = HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER);
+
+        for (PCSTR pszResponse : {
+                "",
+                "HTTP/1.1 200 OK",                              // no newline
+                "HTTP/1.1\r\n\r\n",                             // no status
+                "HTTP/1.1 20\r\n\r\n",                          // short status
+                "HTTP/1.1 2000 OK\r\n\r\n",                     // long status
+                "HTTP/1.1 200 OK\r\nNoColon\r\n\r\n",
+                "HTTP/1.1 200 OK\r\n: no name\r\n\r\n",
+                "HTTP/1.1 200 OK\r\nX-Truncated: value",
+                "HTTP/1.1 200 OK\r\nX-Folded: value\r\n more",
+            })
+        {
+            EXPECT_EQ(hrInvalid, Tokenize(pszResponse, BYTE_SCANNER::QueryBestKind()).hr) << pszResponse;
+        }
+    }
+
+    TEST(ResponseHeaderTokenizer, StopsAtEndOfBuffer)
+    {
+        //
+        // the caller appends the final CRLF, a block that ends right after
+        // the last header is still complete.
+        //
+        PARSED_RESPONSE parsed = Tokenize("HTTP/1.1 200 OK\r\nX-Last: value\r\n", BYTE_SCANNER::QueryBestKind());
+
+        EXPECT_EQ(S_FALSE, parsed.hr);
+        ASSERT_EQ(1u, parsed.headers.size());
+        EXPECT_EQ("value", parsed.headers[0].second);
+    }
+
+    TEST(ByteScanner, VectorVariantsMatchScalar)
+    {
+        static const CHAR s_rgAlphabet[] = { 'a', 'b', ':', '\n', '\r', ' ', '\x80', '\xff' };
+        std::mt19937 generator(20180724);
+        std::uniform_int_distribution<int> pick(0, _countof(s_rgAlphabet) - 1);
+        std::uniform_int_distribution<int> sparse(0, 63);
+
+        for (DWORD cch = 0; cch <= 200; cch++)
+        {
+            for (DWORD iteration = 0; iteration < 50; iteration++)
+            {
+                std::string content(cch, 'x');
+                for (CHAR & ch : content)
+                {
+                    //
+                    // mostly filler so that the delimiters land in every
+                    // lane and in the scalar tail.
+                    //
+                    if (sparse(generator) == 0)
+                    {
+                        ch = s_rgAlphabet[pick(generator)];
+                    }
+                }
+
+                GUARDED_BUFFER buffer(content);
+                for (CHAR ch2 : { ':', '\n', '\xff' })
+                {
+                    DWORD dwExpected = BYTE_SCANNER::FindScalar(buffer.QueryPtr(), cch, '\n', ch2);
+                    for (BYTE_SCANNER_KIND kind : QuerySupportedKinds())
+                    {
+                        ASSERT_EQ(dwExpected, BYTE_SCANNER::Find(kind, buffer.QueryPtr(), cch, '\n', ch2))
+                            << "kind " << kind << " length " << cch;
+                    }
+                }
+            }
+        }
+    }
+
+    TEST(ResponseHeaderTokenizerFuzz, RandomBytesMatchReference)
+    {
+        static const CHAR s_rgAlphabet[] = { 'a', 'Z', '0', '2', ':', ' ', '\t', '\r', '\n', '\n', '\x80' };
+        std::mt19937 generator(4242);
+        std::uniform_int_distribution<int> pick(0, _countof(s_rgAlphabet) - 1);
+        std::uniform_int_distribution<int> length(0, 160);
+
+        for (DWORD iteration = 0; iteration < 20000; iteration++)
+        {
+            //
+            // half the inputs get a valid status line so that the header
+            // loop is exercised too.
+            //
+            std::string response = (iteration % 2 == 0) ? "HTTP/1.1 200 OK\r\n" : "";
+            for (int i = length(generator); i > 0; i--)
+            {
+                response += s_rgAlphabet[pick(generator)];
+            }
+
+            PARSED_RESPONSE expected = ReferenceTokenize(response);
+            for (BYTE_SCANNER_KIND kind : QuerySupportedKinds())
+            {
+                ASSERT_TRUE(expected == Tokenize(response, kind)) << "kind " << kind << " input " << response;
+            }
+        }
+    }
+
+    TEST(ResponseHeaderTokenizerFuzz, GeneratedHeadersRoundTrip)
+    {
+        std::mt19937 generator(1729);
+        std::uniform_int_distribution<int> count(0, 24);
+        std::uniform_int_distribution<int> length(1, 90);
+        std::uniform_int_distribution<int> coin(0, 3);
+        std::uniform_int_distribution<int> printable('!', '~');
+
+        for (DWORD iteration = 0; iteration < 2000; iteration++)
+        {
+            std::vector<std::pair<std::string, std::string>> headers;
+            std::string response = "HTTP/1.1 302 Found\r\n";
+
+            for (int i = count(generator); i > 0; i--)
+            {
+                std::string name;
+                std::string value;
+                std::string raw;
+
+                for (int j = length(generator) % 24 + 1; j > 0; j--)
+                {
+                    CHAR ch = static_cast<CHAR>(printable(generator));
+                    name += (ch == ':') ? '-' : ch;
+                }
+
+                for (int j = length(generator); j > 0; j--)
+                {
+                    CHAR ch = static_cast<CHAR>(printable(generator));
+                    value += ch;
+                    raw += ch;
+
+                    if (j > 1 && coin(generator) == 0)
+                    {
+                        value += ' ';
+                        raw += ' ';
+                    }
+                    else if (j > 1 && iteration % 7 == 0 && coin(generator) == 0)
+                    {
+                        //
+                        // obs-fold, CR LF becomes two spaces.
+                        //
+                        value += "   ";
+                        raw += "\r\n ";
+                    }
+                }
+
+                response += name + std::string(coin(generator), ' ') + ":" +
+                            std::string(coin(generator), ' ') + raw +
+                            std::string(coin(generator), '\t') + "\r\n";
+                headers.emplace_back(name, value);
+            }
+            response += "\r\n";
+
+            for (BYTE_SCANNER_KIND kind : QuerySupportedKinds())
+            {
+                PARSED_RESPONSE parsed = Tokenize(response, kind);
+
+                ASSERT_EQ(S_FALSE, parsed.hr) << response;
+                ASSERT_EQ(302, parsed.uStatus);
+                ASSERT_EQ("Found", parsed.reason);
+                ASSERT_TRUE(headers == parsed.headers) << response;
+            }
+        }
+    }
+
+    //
+    // Header blocks as WinHTTP hands them over for typical Kestrel
+    // responses.
+    //
+    static const PCSTR s_rgKestrelResponses[] =
+    {
+        // Web API
+        "HTTP/1.1 200 OK\r\n"
+        "Date: Tue, 24 Jul 2018 17:22:31 GMT\r\n"
+        "Content-Type: application/json; charset=utf-8\r\n"
+        "Server: Kestrel\r\n"
+        "Content-Length: 1342\r\n"
+        "\r\n",
+
+        // static file
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Length: 162040\r\n"
+        "Content-Type: text/css\r\n"
+        "Date: Tue, 24 Jul 2018 17:22:31 GMT\r\n"
+        "Server: Kestrel\r\n"
+        "Accept-Ranges: bytes\r\n"
+        "ETag: \"1d41f2b7c6e1b0e\"\r\n"
+        "Last-Modified: Mon, 16 Jul 2018 09:14:05 GMT\r\n"
+        "Cache-Control: public, max-age=604800\r\n"
+        "\r\n",
+
+        // MVC view
+        "HTTP/1.1 200 OK\r\n"
+        "Date: Tue, 24 Jul 2018 17:22:31 GMT\r\n"
+        "Content-Type: text/html; charset=utf-8\r\n"
+        "Server: Kestrel\r\n"
+        "Transfer-Encoding: chunked\r\n"
+        "Cache-Control: no-cache, no-store\r\n"
+        "Pragma: no-cache\r\n"
+        "Set-Cookie: .AspNetCore.Antiforgery.w5W7x28NAIs=CfDJ8Gk3tJm2Q8xKXrZcY7WqGQyYhB2m4W1jR0Dq3T4nV6p8sL9uA0bC1dE2fG3hI4jK5lM6nO7pQ8rS9tU0vW1xY2zA3bC4dE5fG6hI7jK8lM9nO0pQ1rS2tU3vW4xY5zA6bC7dE8fG9hI0jK; path=/; samesite=strict; httponly\r\n"
+        "X-Frame-Options: SAMEORIGIN\r\n"
+        "\r\n",
+
+        // sign in redirect
+        "HTTP/1.1 302 Found\r\n"
+        "Date: Tue, 24 Jul 2018 17:22:31 GMT\r\n"
+        "Server: Kestrel\r\n"
+        "Content-Length: 0\r\n"
+        "Location: https://www.contoso.com/Identity/Account/Manage?returnUrl=%2FHome%2FIndex\r\n"
+        "Cache-Control: no-cache\r\n"
+        "Pragma: no-cache\r\n"
+        "Expires: Thu, 01 Jan 1970 00:00:00 GMT\r\n"
+        "Set-Cookie: .AspNetCore.Identity.Application=CfDJ8Gk3tJm2Q8xKXrZcY7WqGQyYhB2m4W1jR0Dq3T4nV6p8sL9uA0bC1dE2fG3hI4jK5lM6nO7pQ8rS9tU0vW1xY2zA3bC4dE5fG6hI7jK8lM9nO0pQ1rS2tU3vW4xY5zA6bC7dE8fG9hI0jKCfDJ8Gk3tJm2Q8xKXrZcY7WqGQyYhB2m4W1jR0Dq3T4nV6p8sL9uA0bC1dE2fG3hI4jK5lM6nO7pQ8rS9tU0vW1xY2zA3bC4dE5fG6hI7jK8lM9nO0pQ1rS2tU3vW4xY5zA6bC7dE8fG9hI0jKCfDJ8Gk3tJm2Q8xKXrZcY7WqGQyYhB2m4W1jR0Dq3T4nV6p8sL9uA0bC1dE2fG3hI4jK5lM6nO7pQ8rS9tU0vW1xY2zA3bC4dE5fG6hI7jK8lM9nO0pQ1rS2tU3vW4xY5zA6bC7dE8fG9hI0jK; path=/; samesite=lax; httponly\r\n"
+        "Set-Cookie: .AspNetCore.Session=CfDJ8Gk3tJm2Q8xKXrZcY7WqGQyYhB2m4W1jR0Dq3T4nV6p8sL9uA0bC1dE2fG3hI4jK5lM6nO7pQ8rS9tU0; path=/; samesite=lax; httponly\r\n"
+        "\r\n",
+    };
+
+    TEST(ResponseHeaderTokenizer, KestrelResponsesMatchReference)
+    {
+        for (PCSTR pszResponse : s_rgKestrelResponses)
+        {
+            PARSED_RESPONSE expected = ReferenceTokenize(pszResponse);
+            EXPECT_EQ(S_FALSE, expected.hr);
+
+            for (BYTE_SCANNER_KIND kind : QuerySupportedKinds())
+            {
+                EXPECT_TRUE(expected == Tokenize(pszResponse, kind));
+            }
+        }
+    }
+
+    //
+    // What SetStatusAndHeaders did before the tokenizer: strchr for every
+    // delimiter and a copy of every name and value.
+    //
+    static
+    DWORD
+    LegacyTokenize(
+        PCSTR       pszHeaders
+    )
+    {
+        STACK_STRA(strHeaderName, 128);
+        STACK_STRA(strHeaderValue, 2048);
+        DWORD       cchTotal = 0;
+        PCSTR       pchNewline = strchr(pszHeaders, '\n');
+        PCSTR       pchEnd;
+
+        for (DWORD index = static_cast<DWORD>(pchNewline - pszHeaders) + 1;
+            pszHeaders[index] != '\r' && pszHeaders[index] != '\n' && pszHeaders[index] != '\0';
+            index = static_cast<DWORD>(pchNewline - pszHeaders) + 1)
+        {
+            PCSTR pchColon = strchr(pszHeaders + index, ':');
+            pchNewline = strchr(pszHeaders + index, '\n');
+            while (pchNewline[1] == ' ' || pchNewline[1] == '\t')
+            {
+                pchNewline = strchr(pchNewline + 1, '\n');
+            }
+
+            for (pchEnd = pchColon; pchEnd > pszHeaders + index && pchEnd[-1] == ' '; pchEnd--)
+            {
+            }
+            strHeaderName.Copy(pszHeaders + index, static_cast<DWORD>(pchEnd - pszHeaders) - index);
+
+            for (index = static_cast<DWORD>(pchColon - pszHeaders) + 1; pszHeaders[index] == ' '; index++)
+            {
+            }
+            for (pchEnd = pchNewline; pchEnd > pszHeaders + index && (pchEnd[-1] == ' ' || pchEnd[-1] == '\r'); pchEnd--)
+            {
+            }
+            strHeaderValue.Copy(pszHeaders + index, static_cast<DWORD>(pchEnd - pszHeaders) - index);
+
+            cchTotal += strHeaderName.QueryCCH() + strHeaderValue.QueryCCH();
+        }
+
+        return cchTotal;
+    }
+
+    TEST(ResponseHeaderTokenizerBenchmark, DISABLED_KestrelResponses)
+    {
+        const DWORD cIterations = 1000000;
+        static const PCSTR s_rgKindNames[] = { "scalar", "sse2", "avx2" };
+        std::vector<CHAR> work(4096);
+
+        for (PCSTR pszResponse : s_rgKestrelResponses)
+        {
+            DWORD cchResponse = static_cast<DWORD>(strlen(pszResponse));
+            volatile DWORD cchSink = 0;
+            CHAR szName[96];
+
+            printf("%u byte response, status line %.*s\n",
+                cchResponse, static_cast<int>(strchr(pszResponse, '\r') - pszResponse), pszResponse);
+
+            //
+            // every variant pays for the memcpy, the tokenizer writes into
+            // its buffer.
+            //
+            auto start = std::chrono::high_resolution_clock::now();
+            for (DWORD i = 0; i < cIterations; i++)
+            {
+                memcpy(work.data(), pszResponse, cchResponse + 1);
+                cchSink += LegacyTokenize(work.data());
+            }
+            auto end = std::chrono::high_resolution_clock::now();
+            Benchmark::Report("    strchr + copies",
+                static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count()),
+                cIterations);
+
+            for (BYTE_SCANNER_KIND kind : QuerySupportedKinds())
+            {
+                start = std::chrono::high_resolution_clock::now();
+                for (DWORD i = 0; i < cIterations; i++)
+                {
+                    USHORT uStatus;
+                    PCSTR pszName;
+                    DWORD cchName;
+                    PCSTR pszValue;
+                    DWORD cchValue;
+
+                    memcpy(work.data(), pszResponse, cchResponse + 1);
+
+                    RESPONSE_HEADER_TOKENIZER tokenizer(work.data(), cchResponse, kind);
+                    tokenizer.ParseStatusLine(&uStatus, &pszValue, &cchValue);
+                    while (tokenizer.NextHeader(&pszName, &cchName, &pszValue, &cchValue) == S_OK)
+                    {
+                        cchSink += cchName + cchValue;
+                    }
+                }
+                end = std::chrono::high_resolution_clock::now();
+
+                double nanoseconds = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+                sprintf_s(szName, "    tokenizer %s (%.0f MB/s)",
+                    s_rgKindNames[kind],
+                    static_cast<double>(cchResponse) * cIterations / (nanoseconds / 1e9) / (1024 * 1024));
+                Benchmark::Report(szName, nanoseconds, cIterations);
+            }
+        }
+    }
+}
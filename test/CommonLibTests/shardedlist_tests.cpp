@@ -0,0 +1,173 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#include "stdafx.h"
+#include "shardedlist.h"
+#include "Benchmark.h"
+
+namespace ShardedListTests
+{
+    struct TEST_CONNECTION
+    {
+        SHARDED_LIST_ENTRY  listEntry;
+        DWORD               dwValue;
+    };
+
+    TEST(ShardedList, WalkVisitsEveryEntry)
+    {
+        SHARDED_LIST list;
+        TEST_CONNECTION connections[100];
+        DWORD dwSum = 0;
+        DWORD cVisited = 0;
+
+        ASSERT_EQ(S_OK, list.Initialize());
+
+        for (DWORD i = 0; i < _countof(connections); i++)
+        {
+            connections[i].dwValue = i;
+            list.Insert(&connections[i].listEntry);
+        }
+        EXPECT_EQ(100, list.QueryCount());
+
+        list.ForEach([&](SHARDED_LIST_ENTRY * pEntry)
+        {
+            dwSum += CONTAINING_RECORD(pEntry, TEST_CONNECTION, listEntry)->dwValue;
+            cVisited++;
+        });
+        EXPECT_EQ(100u, cVisited);
+        EXPECT_EQ(4950u, dwSum);
+
+        for (DWORD i = 0; i < _countof(connections); i += 2)
+        {
+            list.Remove(&connections[i].listEntry);
+        }
+        EXPECT_EQ(50, list.QueryCount());
+
+        cVisited = 0;
+        list.ForEach([&](SHARDED_LIST_ENTRY * pEntry)
+        {
+            EXPECT_EQ(1u, CONTAINING_RECORD(pEntry, TEST_CONNECTION, listEntry)->dwValue % 2);
+            cVisited++;
+        });
+        EXPECT_EQ(50u, cVisited);
+    }
+
+    //
+    // Connections are removed by other threads than the ones that inserted
+    // them, on other processors.
+    //
+    TEST(ShardedList, RemovesFromTheShardOfTheInsert)
+    {
+        const DWORD dwThreads = 8;
+        const DWORD dwPerThread = 5000;
+        SHARDED_LIST list;
+        std::vector<TEST_CONNECTION> connections(dwThreads * dwPerThread);
+        DWORD cVisited = 0;
+
+        ASSERT_EQ(S_OK, list.Initialize());
+
+        Benchmark::RunConcurrently(dwThreads, [&](DWORD dwThread)
+        {
+            for (DWORD i = 0; i < dwPerThread; i++)
+            {
+                list.Insert(&connections[dwThread * dwPerThread + i].listEntry);
+            }
+        });
+        EXPECT_EQ(static_cast<LONGLONG>(connections.size()), list.QueryCount());
+
+        Benchmark::RunConcurrently(dwThreads, [&](DWORD dwThread)
+        {
+            DWORD dwOther = (dwThread + 1) % dwThreads;
+
+            for (DWORD i = 0; i < dwPerThread; i += 2)
+            {
+                list.Remove(&connections[dwOther * dwPerThread + i].listEntry);
+            }
+        });
+        EXPECT_EQ(static_cast<LONGLONG>(connections.size() / 2), list.QueryCount());
+
+        list.ForEach([&](SHARDED_LIST_ENTRY *)
+        {
+            cVisited++;
+        });
+        EXPECT_EQ(connections.size() / 2, cVisited);
+    }
+
+    //
+    // What a connection coming and going costs in tracking: an insert and
+    // a remove per connection, one locked list against the sharded one.
+    //
+    TEST(ShardedListBenchmark, DISABLED_ConnectionChurn)
+    {
+        const DWORD dwConnections = 1000000;
+        DWORD dwMaxThreads = Benchmark::QueryThreadCount();
+
+        for (DWORD dwThreads = 1; dwThreads <= dwMaxThreads; dwThreads *= 2)
+        {
+            char szName[128];
+            SRWLOCK srwLock;
+            LIST_ENTRY listHead;
+            SHARDED_LIST list;
+
+            InitializeSRWLock(&srwLock);
+            InitializeListHead(&listHead);
+            ASSERT_EQ(S_OK, list.Initialize());
+
+            double ns = Benchmark::RunConcurrently(dwThreads, [&](DWORD)
+            {
+                TEST_CONNECTION connections[16];
+
+                for (DWORD i = 0; i < dwConnections; i++)
+                {
+                    TEST_CONNECTION * pConnection = &connections[i % _countof(connections)];
+
+                    if (i >= _countof(connections))
+                    {
+                        AcquireSRWLockExclusive(&srwLock);
+                        RemoveEntryList(&pConnection->listEntry.ListEntry);
+                        ReleaseSRWLockExclusive(&srwLock);
+                    }
+
+                    AcquireSRWLockExclusive(&srwLock);
+                    InsertTailList(&listHead, &pConnection->listEntry.ListEntry);
+                    ReleaseSRWLockExclusive(&srwLock);
+                }
+
+                AcquireSRWLockExclusive(&srwLock);
+                for (auto &connection : connections)
+                {
+                    RemoveEntryList(&connection.listEntry.ListEntry);
+                }
+                ReleaseSRWLockExclusive(&srwLock);
+            });
+
+            sprintf_s(szName, "locked list churn threads=%u", dwThreads);
+            Benchmark::Report(szName, ns, static_cast<ULONGLONG>(dwThreads) * dwConnections);
+
+            ns = Benchmark::RunConcurrently(dwThreads, [&](DWORD)
+            {
+                TEST_CONNECTION connections[16];
+
+                for (DWORD i = 0; i < dwConnections; i++)
+                {
+                    TEST_CONNECTION * pConnection = &connections[i % _countof(connections)];
+
+                    if (i >= _countof(connections))
+                    {
+                        list.Remove(&pConnection->listEntry);
+                    }
+                    list.Insert(&pConnection->listEntry);
+                }
+
+                for (auto &connection : connections)
+                {
+                    list.Remove(&connection.listEntry);
+                }
+            });
+
+            sprintf_s(szName, "SHARDED_LIST churn threads=%u", dwThreads);
+            Benchmark::Report(szName, ns, static_cast<ULONGLONG>(dwThreads) * dwConnections);
+            EXPECT_EQ(0, list.QueryCount());
+        }
+    }
+}
@@ -0,0 +1,479 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#include "stdafx.h"
+#include "sizecache.h"
+#include "Benchmark.h"
+
+namespace SizeCacheTests
+{
+    //
+    // Keeps the test thread on one processor so that it always sees the
+    // same magazines.
+    //
+    class PIN_TO_PROCESSOR
+    {
+    public:
+        PIN_TO_PROCESSOR()
+        {
+            _dwOldMask = SetThreadAffinityMask(GetCurrentThread(),
+                                               static_cast<DWORD_PTR>(1) << GetCurrentProcessorNumber());
+        }
+
+        ~PIN_TO_PROCESSOR()
+        {
+            SetThreadAffinityMask(GetCurrentThread(), _dwOldMask);
+        }
+
+    private:
+        DWORD_PTR   _dwOldMask;
+    };
+
+    static VOID FillPattern(PVOID pMemory, SIZE_T cbSize, BYTE bSeed)
+    {
+        BYTE * pb = static_cast<BYTE *>(pMemory);
+        for (SIZE_T i = 0; i < cbSize; i++)
+        {
+            pb[i] = static_cast<BYTE>(bSeed + i);
+        }
+    }
+
+    static BOOL CheckPattern(PVOID pMemory, SIZE_T cbSize, BYTE bSeed)
+    {
+        BYTE * pb = static_cast<BYTE *>(pMemory);
+        for (SIZE_T i = 0; i < cbSize; i++)
+        {
+            if (pb[i] != static_cast<BYTE>(bSeed + i))
+            {
+                return FALSE;
+            }
+        }
+        return TRUE;
+    }
+
+    TEST(SizeClassCache, SizeClasses)
+    {
+        EXPECT_EQ(0, SIZE_CLASS_CACHE::QuerySizeClass(1));
+        EXPECT_EQ(0, SIZE_CLASS_CACHE::QuerySizeClass(64));
+        EXPECT_EQ(1, SIZE_CLASS_CACHE::QuerySizeClass(65));
+        EXPECT_EQ(1, SIZE_CLASS_CACHE::QuerySizeClass(128));
+        EXPECT_EQ(7, SIZE_CLASS_CACHE::QuerySizeClass(8192));
+        EXPECT_EQ(8, SIZE_CLASS_CACHE::QuerySizeClass(8193));
+        EXPECT_EQ(8, SIZE_CLASS_CACHE::QuerySizeClass(SIZE_CLASS_CACHE::MAX_CLASS_SIZE));
+
+        for (DWORD i = 0; i < SIZE_CLASS_CACHE::SIZE_CLASSES; i++)
+        {
+            EXPECT_EQ(i, SIZE_CLASS_CACHE::QuerySizeClass(SIZE_CLASS_CACHE::QueryClassSize(i)));
+        }
+    }
+
+    TEST(SizeClassCache, ReusesBlocksFromMagazine)
+    {
+        PIN_TO_PROCESSOR pin;
+        SIZE_CLASS_CACHE cache;
+        SIZE_CLASS_CACHE_COUNTERS counters;
+
+        ASSERT_EQ(S_OK, cache.Initialize(4, 4));
+        if (ALLOC_CACHE_HANDLER::IsPageheapEnabled())
+        {
+            return;
+        }
+
+        PVOID p1 = cache.Alloc(100);
+        ASSERT_NE(nullptr, p1);
+        FillPattern(p1, 100, 1);
+        cache.Free(p1);
+
+        //
+        // Same class, different size.
+        //
+        PVOID p2 = cache.Alloc(128);
+        EXPECT_EQ(p1, p2);
+        cache.Free(p2);
+
+        PVOID p3 = cache.Alloc(8192);
+        ASSERT_NE(nullptr, p3);
+        EXPECT_NE(p1, p3);
+        cache.Free(p3);
+
+        cache.QueryCounters(&counters);
+        EXPECT_EQ(3, counters.cAllocs);
+        EXPECT_EQ(1, counters.cMagazineHits);
+        EXPECT_EQ(0, counters.cDepotHits);
+        EXPECT_EQ(2, counters.cHeapAllocs);
+        EXPECT_EQ(3, counters.cFrees);
+        EXPECT_EQ(0, counters.cHeapFrees);
+    }
+
+    TEST(SizeClassCache, OverflowsToDepotThenHeap)
+    {
+        PIN_TO_PROCESSOR pin;
+        SIZE_CLASS_CACHE cache;
+        SIZE_CLASS_CACHE_COUNTERS counters;
+        PVOID rgBlocks[10];
+
+        ASSERT_EQ(S_OK, cache.Initialize(2, 4));
+        if (ALLOC_CACHE_HANDLER::IsPageheapEnabled())
+        {
+            return;
+        }
+
+        for (PVOID & pBlock : rgBlocks)
+        {
+            pBlock = cache.Alloc(1000);
+            ASSERT_NE(nullptr, pBlock);
+        }
+        for (PVOID pBlock : rgBlocks)
+        {
+            cache.Free(pBlock);
+        }
+
+        cache.QueryCounters(&counters);
+        EXPECT_EQ(4, counters.cDepotFrees);
+        EXPECT_EQ(4, counters.cHeapFrees);
+
+        //
+        // Magazine first, then the depot.
+        //
+        for (PVOID & pBlock : rgBlocks)
+        {
+            pBlock = cache.Alloc(1000);
+            ASSERT_NE(nullptr, pBlock);
+        }
+
+        cache.QueryCounters(&counters);
+        EXPECT_EQ(2, counters.cMagazineHits);
+        EXPECT_EQ(4, counters.cDepotHits);
+        EXPECT_EQ(14, counters.cHeapAllocs);
+
+        for (PVOID pBlock : rgBlocks)
+        {
+            cache.Free(pBlock);
+        }
+    }
+
+    TEST(SizeClassCache, TrimReleasesDepotThenEverythingWhenIdle)
+    {
+        PIN_TO_PROCESSOR pin;
+        SIZE_CLASS_CACHE cache;
+        SIZE_CLASS_CACHE_COUNTERS counters;
+        PVOID rgBlocks[10];
+
+        ASSERT_EQ(S_OK, cache.Initialize(2, 8));
+        if (ALLOC_CACHE_HANDLER::IsPageheapEnabled())
+        {
+            return;
+        }
+
+        for (PVOID & pBlock : rgBlocks)
+        {
+            pBlock = cache.Alloc(300);
+        }
+        for (PVOID pBlock : rgBlocks)
+        {
+            cache.Free(pBlock);
+        }
+
+        //
+        // 2 in the magazine, 8 in the depot. The cache was used since the
+        // last trim, so only half of the depot goes.
+        //
+        cache.Trim();
+        cache.QueryCounters(&counters);
+        EXPECT_EQ(4, counters.cTrimmed);
+
+        cache.Trim();
+        cache.QueryCounters(&counters);
+        EXPECT_EQ(10, counters.cTrimmed);
+
+        PVOID p = cache.Alloc(300);
+        cache.QueryCounters(&counters);
+        EXPECT_EQ(11, counters.cHeapAllocs);
+        cache.Free(p);
+    }
+
+    TEST(SizeClassCache, LargeBlocksAndReAlloc)
+    {
+        SIZE_CLASS_CACHE cache;
+        SIZE_CLASS_CACHE_COUNTERS counters;
+
+        ASSERT_EQ(S_OK, cache.Initialize(4, 4));
+
+        PVOID p = cache.Alloc(10);
+        ASSERT_NE(nullptr, p);
+        FillPattern(p, 10, 7);
+
+        //
+        // In place inside the class.
+        //
+        PVOID pSame = cache.ReAlloc(p, 10, 60, true);
+        ASSERT_EQ(p, pSame);
+        EXPECT_TRUE(CheckPattern(p, 10, 7));
+        for (DWORD i = 10; i < 60; i++)
+        {
+            EXPECT_EQ(0, static_cast<BYTE *>(p)[i]);
+        }
+
+        //
+        // Across classes, into the large path, and within it.
+        //
+        FillPattern(p, 60, 3);
+        p = cache.ReAlloc(p, 60, 5000, false);
+        ASSERT_NE(nullptr, p);
+        EXPECT_TRUE(CheckPattern(p, 60, 3));
+
+        FillPattern(p, 5000, 5);
+        p = cache.ReAlloc(p, 5000, SIZE_CLASS_CACHE::MAX_CLASS_SIZE * 2, true);
+        ASSERT_NE(nullptr, p);
+        EXPECT_TRUE(CheckPattern(p, 5000, 5));
+        EXPECT_EQ(0, static_cast<BYTE *>(p)[SIZE_CLASS_CACHE::MAX_CLASS_SIZE * 2 - 1]);
+
+        p = cache.ReAlloc(p, SIZE_CLASS_CACHE::MAX_CLASS_SIZE * 2, SIZE_CLASS_CACHE::MAX_CLASS_SIZE * 4, false);
+        ASSERT_NE(nullptr, p);
+        EXPECT_TRUE(CheckPattern(p, 5000, 5));
+        cache.Free(p);
+
+        cache.QueryCounters(&counters);
+        EXPECT_EQ(counters.cAllocs, counters.cFrees);
+    }
+
+    TEST(SizeClassCache, BufferSpillOptIn)
+    {
+        SIZE_CLASS_CACHE cache;
+        SIZE_CLASS_CACHE_COUNTERS counters;
+
+        ASSERT_EQ(S_OK, cache.Initialize(4, 4));
+
+        {
+            STRA str;
+            STRU strw;
+            BUFFER_T<BYTE, 16> buff;
+
+            //
+            // Only the buffers that are handed the cache spill to it.
+            //
+            STRA strHeap;
+            ASSERT_EQ(S_OK, strHeap.Copy(std::string(300, 'a').c_str()));
+
+            str.SetSpillAllocator(&cache);
+            strw.SetSpillAllocator(&cache);
+            buff.SetSpillAllocator(&cache);
+
+            ASSERT_EQ(S_OK, str.Copy(std::string(200, 'b').c_str()));
+            ASSERT_EQ(S_OK, str.Append(std::string(2000, 'c').c_str()));
+            ASSERT_EQ(S_OK, strw.Copy(std::wstring(500, L'd').c_str()));
+            ASSERT_TRUE(buff.Resize(20, true));
+            ASSERT_TRUE(buff.Resize(30000, true));
+            EXPECT_EQ(0, buff.QueryPtr()[29999]);
+
+            cache.QueryCounters(&counters);
+            EXPECT_LE(3, counters.cAllocs);
+            ULONGLONG cAllocs = counters.cAllocs;
+
+            ASSERT_EQ(S_OK, str.Append(std::string(20000, 'e').c_str()));
+            ASSERT_EQ(S_OK, strHeap.Append(std::string(2000, 'f').c_str()));
+
+            EXPECT_EQ(22200, str.QueryCCH());
+            EXPECT_EQ('b', str.QueryStr()[199]);
+            EXPECT_EQ('c', str.QueryStr()[2199]);
+            EXPECT_EQ('e', str.QueryStr()[22199]);
+
+            //
+            // The buffer keeps its allocator once it went back inline.
+            //
+            buff.FreeMemory();
+            ASSERT_TRUE(buff.Resize(100));
+
+            cache.QueryCounters(&counters);
+            EXPECT_LT(cAllocs, counters.cAllocs);
+        }
+
+        cache.QueryCounters(&counters);
+        EXPECT_NE(0, counters.cAllocs);
+        EXPECT_EQ(counters.cAllocs, counters.cFrees);
+    }
+
+    TEST(SizeClassCache, CrossThreadFrees)
+    {
+        const DWORD dwThreads = 8;
+        const DWORD dwBlocks = 2000;
+        SIZE_CLASS_CACHE cache;
+        SIZE_CLASS_CACHE_COUNTERS counters;
+        std::vector<std::vector<PVOID>> blocks(dwThreads, std::vector<PVOID>(dwBlocks));
+        std::atomic<DWORD> failures(0);
+
+        ASSERT_EQ(S_OK, cache.Initialize(16, 64));
+
+        for (DWORD dwRound = 0; dwRound < 4; dwRound++)
+        {
+            Benchmark::RunConcurrently(dwThreads, [&](DWORD dwThread)
+            {
+                for (DWORD i = 0; i < dwBlocks; i++)
+                {
+                    SIZE_T cbSize = 16 + (i * 37) % 9000;
+                    PVOID p = cache.Alloc(cbSize);
+                    if (p == NULL)
+                    {
+                        failures++;
+                        continue;
+                    }
+                    FillPattern(p, cbSize, static_cast<BYTE>(dwThread + i));
+                    blocks[dwThread][i] = p;
+                }
+            });
+
+            //
+            // Every thread frees what its neighbour allocated.
+            //
+            Benchmark::RunConcurrently(dwThreads, [&](DWORD dwThread)
+            {
+                DWORD dwOwner = (dwThread + 1) % dwThreads;
+                for (DWORD i = 0; i < dwBlocks; i++)
+                {
+                    SIZE_T cbSize = 16 + (i * 37) % 9000;
+                    PVOID p = blocks[dwOwner][i];
+                    if (p == NULL)
+                    {
+                        continue;
+                    }
+                    if (!CheckPattern(p, cbSize, static_cast<BYTE>(dwOwner + i)))
+                    {
+                        failures++;
+                    }
+                    cache.Free(p);
+                    blocks[dwOwner][i] = NULL;
+                }
+            });
+        }
+
+        EXPECT_EQ(0, failures.load());
+
+        cache.QueryCounters(&counters);
+        EXPECT_GT(counters.cAllocs, 0);
+    }
+
+    //
+    // Allocator under test, one of the process heap, the CRT heap or
+    // SIZE_CLASS_CACHE.
+    //
+    struct HEAP_ALLOCATOR
+    {
+        PVOID Alloc(SIZE_T cbSize) { return HeapAlloc(GetProcessHeap(), 0, cbSize); }
+        VOID Free(PVOID p) { HeapFree(GetProcessHeap(), 0, p); }
+    };
+
+    struct CRT_ALLOCATOR
+    {
+        PVOID Alloc(SIZE_T cbSize) { return malloc(cbSize); }
+        VOID Free(PVOID p) { free(p); }
+    };
+
+    struct CACHE_ALLOCATOR
+    {
+        CACHE_ALLOCATOR() { _cache.Initialize(32, 1024); }
+        PVOID Alloc(SIZE_T cbSize) { return _cache.Alloc(cbSize); }
+        VOID Free(PVOID p) { _cache.Free(p); }
+
+        SIZE_CLASS_CACHE _cache;
+    };
+
+    //
+    // Each thread keeps a window of live buffers of request-path sizes. With
+    // fCrossThread half of the buffers are handed to another thread through
+    // a shared list and freed there, as happens with entity buffers that
+    // are allocated on a WinHTTP callback and freed on an IIS completion.
+    //
+    template<class _Allocator>
+    double
+    RunAllocatorBenchmark(
+        DWORD       dwThreads,
+        DWORD       dwOpsPerThread,
+        BOOL        fCrossThread
+    )
+    {
+        const DWORD dwWindow = 16;
+        static const SIZE_T rgcbSizes[] = { 64, 200, 512, 1024, 4096, 8192, 8192, 16384 };
+        _Allocator allocator;
+        SLIST_HEADER handoff;
+
+        InitializeSListHead(&handoff);
+
+        double ns = Benchmark::RunConcurrently(dwThreads, [&](DWORD dwThread)
+        {
+            PVOID rgLive[dwWindow] = {};
+            DWORD dwSeed = dwThread * 7919 + 1;
+
+            for (DWORD i = 0; i < dwOpsPerThread; i++)
+            {
+                dwSeed = dwSeed * 1103515245 + 12345;
+                DWORD dwSlot = i % dwWindow;
+
+                if (rgLive[dwSlot] != NULL)
+                {
+                    if (fCrossThread && (dwSeed & 0x100000))
+                    {
+                        InterlockedPushEntrySList(&handoff, static_cast<PSLIST_ENTRY>(rgLive[dwSlot]));
+                    }
+                    else
+                    {
+                        allocator.Free(rgLive[dwSlot]);
+                    }
+                }
+
+                if (fCrossThread)
+                {
+                    PSLIST_ENTRY pEntry = InterlockedPopEntrySList(&handoff);
+                    if (pEntry != NULL)
+                    {
+                        allocator.Free(pEntry);
+                    }
+                }
+
+                rgLive[dwSlot] = allocator.Alloc(rgcbSizes[(dwSeed >> 16) % _countof(rgcbSizes)]);
+                static_cast<BYTE *>(rgLive[dwSlot])[0] = 1;
+            }
+
+            for (PVOID p : rgLive)
+            {
+                if (p != NULL)
+                {
+                    allocator.Free(p);
+                }
+            }
+        });
+
+        for (PSLIST_ENTRY pEntry = InterlockedFlushSList(&handoff); pEntry != NULL; )
+        {
+            PSLIST_ENTRY pNext = pEntry->Next;
+            allocator.Free(pEntry);
+            pEntry = pNext;
+        }
+
+        return ns;
+    }
+
+    TEST(SizeClassCacheBenchmark, DISABLED_ContentionVsHeapAlloc)
+    {
+        const DWORD dwOps = 2000000;
+        DWORD dwMaxThreads = Benchmark::QueryThreadCount();
+
+        for (BOOL fCrossThread : { FALSE, TRUE })
+        {
+            for (DWORD dwThreads = 1; dwThreads <= dwMaxThreads; dwThreads *= 2)
+            {
+                char szName[128];
+                ULONGLONG ullOps = static_cast<ULONGLONG>(dwThreads) * dwOps;
+                PCSTR pszMode = fCrossThread ? "cross-thread" : "local";
+
+                sprintf_s(szName, "HeapAlloc %s threads=%u", pszMode, dwThreads);
+                Benchmark::Report(szName, RunAllocatorBenchmark<HEAP_ALLOCATOR>(dwThreads, dwOps, fCrossThread), ullOps);
+
+                sprintf_s(szName, "malloc %s threads=%u", pszMode, dwThreads);
+                Benchmark::Report(szName, RunAllocatorBenchmark<CRT_ALLOCATOR>(dwThreads, dwOps, fCrossThread), ullOps);
+
+                sprintf_s(szName, "SIZE_CLASS_CACHE %s threads=%u", pszMode, dwThreads);
+                Benchmark::Report(szName, RunAllocatorBenchmark<CACHE_ALLOCATOR>(dwThreads, dwOps, fCrossThread), ullOps);
+            }
+        }
+    }
+}
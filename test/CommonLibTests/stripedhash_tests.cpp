@@ -0,0 +1,319 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#include "stdafx.h"
+#include "stripedhash.h"
+#include "Benchmark.h"
+
+namespace StripedHashTests
+{
+    class TEST_RECORD
+    {
+    public:
+        TEST_RECORD(DWORD dwValue) : _cRefs(1), _dwValue(dwValue)
+        {
+            swprintf_s(_szName, L"/LM/W3SVC/1/ROOT/key%u", dwValue);
+        }
+
+        PWSTR QueryName() { return _szName; }
+        DWORD QueryValue() { return _dwValue; }
+        LONG QueryRefs() { return _cRefs; }
+
+        VOID Reference() { InterlockedIncrement(&_cRefs); }
+        VOID Dereference() { InterlockedDecrement(&_cRefs); }
+
+    private:
+        volatile LONG   _cRefs;
+        DWORD           _dwValue;
+        WCHAR           _szName[64];
+    };
+
+    //
+    // Same overrides on top of both table implementations.
+    //
+    template<class _Base>
+    class TEST_RECORD_HASH : public _Base
+    {
+    public:
+        PWSTR ExtractKey(TEST_RECORD * pRecord) override { return pRecord->QueryName(); }
+        DWORD CalcKeyHash(PWSTR pszName) override { return HashStringNoCase(pszName); }
+        BOOL EqualKeys(PWSTR pszName1, PWSTR pszName2) override { return _wcsicmp(pszName1, pszName2) == 0; }
+        VOID ReferenceRecord(TEST_RECORD * pRecord) override { pRecord->Reference(); }
+        VOID DereferenceRecord(TEST_RECORD * pRecord) override { pRecord->Dereference(); }
+    };
+
+    typedef TEST_RECORD_HASH<HASH_TABLE<TEST_RECORD, PWSTR>>            LOCKED_TABLE;
+    typedef TEST_RECORD_HASH<STRIPED_HASH_TABLE<TEST_RECORD, PWSTR>>    STRIPED_TABLE;
+
+    static BOOL DeleteOdd(TEST_RECORD * pRecord, PVOID)
+    {
+        return (pRecord->QueryValue() & 1) != 0;
+    }
+
+    static VOID SumValues(TEST_RECORD * pRecord, PVOID pvContext)
+    {
+        *static_cast<ULONGLONG*>(pvContext) += pRecord->QueryValue();
+    }
+
+    TEST(StripedHashTable, InsertFindDelete)
+    {
+        STRIPED_TABLE table;
+        TEST_RECORD record1(1);
+        TEST_RECORD record2(2);
+        TEST_RECORD * pFound = NULL;
+
+        ASSERT_EQ(S_OK, table.Initialize(16, 4));
+        ASSERT_EQ(S_OK, table.InsertRecord(&record1));
+        ASSERT_EQ(S_OK, table.InsertRecord(&record2));
+        EXPECT_EQ(HRESULT_FROM_WIN32(ERROR_ALREADY_EXISTS), table.InsertRecord(&record1));
+        EXPECT_EQ(2, table.Count());
+        EXPECT_EQ(2, record1.QueryRefs());
+
+        table.FindKey(L"/lm/w3svc/1/root/KEY2", &pFound);
+        ASSERT_EQ(&record2, pFound);
+        pFound->Dereference();
+
+        table.DeleteKey(record2.QueryName());
+        table.FindKey(record2.QueryName(), &pFound);
+        EXPECT_EQ(nullptr, pFound);
+        EXPECT_EQ(1, record2.QueryRefs());
+        EXPECT_EQ(1, table.Count());
+
+        table.Clear();
+        EXPECT_EQ(0, table.Count());
+        EXPECT_EQ(1, record1.QueryRefs());
+    }
+
+    //
+    // A record that looks itself up again when the table lets go of it.
+    //
+    class REENTRANT_TABLE : public STRIPED_TABLE
+    {
+    public:
+        VOID DereferenceRecord(TEST_RECORD * pRecord) override
+        {
+            TEST_RECORD * pFound = NULL;
+
+            FindKey(pRecord->QueryName(), &pFound);
+            if (pFound != NULL)
+            {
+                pFound->Dereference();
+            }
+            pRecord->Dereference();
+        }
+    };
+
+    TEST(StripedHashTable, DeletesOutsideTheStripeLock)
+    {
+        REENTRANT_TABLE table;
+        TEST_RECORD record1(1);
+        TEST_RECORD record2(2);
+
+        ASSERT_EQ(S_OK, table.Initialize(16, 1));
+        ASSERT_EQ(S_OK, table.InsertRecord(&record1));
+        ASSERT_EQ(S_OK, table.InsertRecord(&record2));
+
+        table.DeleteKey(record1.QueryName());
+        EXPECT_EQ(1, record1.QueryRefs());
+
+        table.DeleteIf(DeleteOdd, NULL);
+        EXPECT_EQ(1, table.Count());
+
+        table.Clear();
+        EXPECT_EQ(1, record2.QueryRefs());
+    }
+
+    TEST(StripedHashTable, GrowsIncrementally)
+    {
+        STRIPED_TABLE table;
+        std::vector<std::unique_ptr<TEST_RECORD>> records;
+        BOOL fSawResize = FALSE;
+
+        ASSERT_EQ(S_OK, table.Initialize(4, 4));
+        DWORD nInitialBuckets = table.QueryBucketCount();
+
+        for (DWORD i = 0; i < 4096; i++)
+        {
+            records.push_back(std::make_unique<TEST_RECORD>(i));
+            ASSERT_EQ(S_OK, table.InsertRecord(records.back().get()));
+            fSawResize |= table.IsResizing();
+
+            //
+            // Every record stays reachable while buckets are migrated.
+            //
+            TEST_RECORD * pFound = NULL;
+            DWORD dwProbe = i / 2;
+            table.FindKey(records[dwProbe]->QueryName(), &pFound);
+            ASSERT_EQ(records[dwProbe].get(), pFound);
+            pFound->Dereference();
+        }
+
+        EXPECT_TRUE(fSawResize);
+        EXPECT_GT(table.QueryBucketCount(), nInitialBuckets);
+        EXPECT_EQ(4096, table.Count());
+
+        ULONGLONG ullSum = 0;
+        table.Apply(SumValues, &ullSum);
+        EXPECT_EQ(4095ULL * 4096 / 2, ullSum);
+
+        table.DeleteIf(DeleteOdd, NULL);
+        EXPECT_EQ(2048, table.Count());
+        for (DWORD i = 0; i < 4096; i++)
+        {
+            TEST_RECORD * pFound = NULL;
+            table.FindKey(records[i]->QueryName(), &pFound);
+            if (i & 1)
+            {
+                EXPECT_EQ(nullptr, pFound);
+                EXPECT_EQ(1, records[i]->QueryRefs());
+            }
+            else
+            {
+                ASSERT_EQ(records[i].get(), pFound);
+                pFound->Dereference();
+            }
+        }
+
+        table.Clear();
+    }
+
+    TEST(StripedHashTable, ConcurrentInsertFindDelete)
+    {
+        const DWORD dwThreads = 8;
+        const DWORD dwPerThread = 2000;
+        STRIPED_TABLE table;
+        std::vector<std::unique_ptr<TEST_RECORD>> records;
+        std::atomic<DWORD> failures(0);
+
+        for (DWORD i = 0; i < dwThreads * dwPerThread; i++)
+        {
+            records.push_back(std::make_unique<TEST_RECORD>(i));
+        }
+
+        ASSERT_EQ(S_OK, table.Initialize(8, 8));
+
+        Benchmark::RunConcurrently(dwThreads, [&](DWORD dwThread)
+        {
+            DWORD dwFirst = dwThread * dwPerThread;
+            for (DWORD i = dwFirst; i < dwFirst + dwPerThread; i++)
+            {
+                TEST_RECORD * pFound = NULL;
+                if (FAILED(table.InsertRecord(records[i].get())))
+                {
+                    failures++;
+                }
+                table.FindKey(records[i]->QueryName(), &pFound);
+                if (pFound != records[i].get())
+                {
+                    failures++;
+                }
+                if (pFound != NULL)
+                {
+                    pFound->Dereference();
+                }
+                if (i & 1)
+                {
+                    table.DeleteKey(records[i]->QueryName());
+                }
+            }
+        });
+
+        EXPECT_EQ(0, failures.load());
+        EXPECT_EQ(dwThreads * dwPerThread / 2, table.Count());
+
+        table.Clear();
+        for (auto& record : records)
+        {
+            EXPECT_EQ(1, record->QueryRefs());
+        }
+    }
+
+    template<class _Table>
+    double
+    RunLookupBenchmark(
+        DWORD       dwThreads,
+        DWORD       dwKeys,
+        DWORD       dwLookupsPerThread,
+        DWORD       dwWritePercent
+    )
+    {
+        _Table table;
+        std::vector<std::unique_ptr<TEST_RECORD>> records;
+
+        table.Initialize(dwKeys);
+        for (DWORD i = 0; i < dwKeys * 2; i++)
+        {
+            records.push_back(std::make_unique<TEST_RECORD>(i));
+        }
+        for (DWORD i = 0; i < dwKeys; i++)
+        {
+            table.InsertRecord(records[i].get());
+        }
+
+        double ns = Benchmark::RunConcurrently(dwThreads, [&](DWORD dwThread)
+        {
+            DWORD dwSeed = dwThread * 7919 + 1;
+            for (DWORD i = 0; i < dwLookupsPerThread; i++)
+            {
+                dwSeed = dwSeed * 1103515245 + 12345;
+                DWORD dwKey = (dwSeed >> 8) % dwKeys;
+
+                if (dwWritePercent != 0 && (dwSeed >> 24) % 100 < dwWritePercent)
+                {
+                    //
+                    // Churn the upper half of the records, which the
+                    // lookups never hit.
+                    //
+                    TEST_RECORD * pRecord = records[dwKeys + dwKey].get();
+                    if (FAILED(table.InsertRecord(pRecord)))
+                    {
+                        table.DeleteKey(pRecord->QueryName());
+                    }
+                    continue;
+                }
+
+                TEST_RECORD * pFound = NULL;
+                table.FindKey(records[dwKey]->QueryName(), &pFound);
+                if (pFound != NULL)
+                {
+                    pFound->Dereference();
+                }
+            }
+        });
+
+        table.Clear();
+        return ns;
+    }
+
+    TEST(StripedHashTableBenchmark, DISABLED_LookupThroughputVsHashTable)
+    {
+        const DWORD dwLookups = 1000000;
+        DWORD dwMaxThreads = Benchmark::QueryThreadCount();
+
+        //
+        // 31 keys approximates RESPONSE_HEADER_HASH, 1024 a large
+        // environment block or connection table.
+        //
+        for (DWORD dwKeys : { 31UL, 1024UL })
+        {
+            for (DWORD dwWritePercent : { 0UL, 1UL })
+            {
+                for (DWORD dwThreads = 1; dwThreads <= dwMaxThreads; dwThreads *= 2)
+                {
+                    char szName[128];
+                    ULONGLONG ullOps = static_cast<ULONGLONG>(dwThreads) * dwLookups;
+
+                    sprintf_s(szName, "HASH_TABLE keys=%u writes=%u%% threads=%u", dwKeys, dwWritePercent, dwThreads);
+                    Benchmark::Report(szName,
+                        RunLookupBenchmark<LOCKED_TABLE>(dwThreads, dwKeys, dwLookups, dwWritePercent),
+                        ullOps);
+
+                    sprintf_s(szName, "STRIPED_HASH_TABLE keys=%u writes=%u%% threads=%u", dwKeys, dwWritePercent, dwThreads);
+                    Benchmark::Report(szName,
+                        RunLookupBenchmark<STRIPED_TABLE>(dwThreads, dwKeys, dwLookups, dwWritePercent),
+                        ullOps);
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,520 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#include "stdafx.h"
+#include "timerwheel.h"
+#include "Benchmark.h"
+
+namespace TimerWheelTests
+{
+    //
+    // An object with a timeout, records when it fired.
+    //
+    class FAKE_TIMEOUT
+    {
+    public:
+
+        FAKE_TIMEOUT()
+        {
+            TIMER_WHEEL::InitializeEntry(&entry, OnTimeout, this);
+        }
+
+        static
+        VOID
+        OnTimeout(
+            PVOID   pvContext
+        )
+        {
+            FAKE_TIMEOUT *pTimeout = static_cast<FAKE_TIMEOUT *>(pvContext);
+
+            pTimeout->cFired++;
+            if (pTimeout->pullNow != NULL)
+            {
+                pTimeout->ullFiredAt = *pTimeout->pullNow;
+            }
+            if (pTimeout->pWheel != NULL)
+            {
+                //
+                // periodic, arms itself again.
+                //
+                pTimeout->pWheel->Arm(&pTimeout->entry, pTimeout->dwPeriodMs, *pTimeout->pullNow);
+            }
+        }
+
+        TIMER_WHEEL_ENTRY   entry;
+        std::atomic<LONG>   cFired { 0 };
+        ULONGLONG           ullFiredAt = 0;
+        ULONGLONG *         pullNow = NULL;
+        TIMER_WHEEL *       pWheel = NULL;
+        DWORD               dwPeriodMs = 0;
+    };
+
+    class TimerWheelTest : public ::testing::Test
+    {
+    protected:
+
+        void SetUp() override
+        {
+            //
+            // the tests turn the wheel themselves on a made up clock.
+            //
+            ASSERT_EQ(S_OK, _wheel.Initialize(FALSE));
+        }
+
+        void Arm(FAKE_TIMEOUT * pTimeout, DWORD dwTimeoutMs)
+        {
+            pTimeout->pullNow = &_ullNow;
+            _wheel.Arm(&pTimeout->entry, dwTimeoutMs, _ullNow);
+        }
+
+        void AdvanceTo(ULONGLONG ullNow)
+        {
+            _ullNow = ullNow;
+            _wheel.Advance(ullNow);
+        }
+
+        TIMER_WHEEL_COUNTERS Counters()
+        {
+            TIMER_WHEEL_COUNTERS counters;
+            _wheel.QueryCounters(&counters);
+            return counters;
+        }
+
+        TIMER_WHEEL             _wheel;
+        ULONGLONG               _ullNow = 1000000;
+    };
+
+    TEST_F(TimerWheelTest, FiresOnceAtTheDeadline)
+    {
+        FAKE_TIMEOUT timeout;
+
+        Arm(&timeout, 100);
+
+        AdvanceTo(_ullNow + 99);
+        EXPECT_EQ(0, timeout.cFired.load());
+
+        AdvanceTo(_ullNow + 1);
+        EXPECT_EQ(1, timeout.cFired.load());
+
+        AdvanceTo(_ullNow + 1000);
+        EXPECT_EQ(1, timeout.cFired.load());
+
+        TIMER_WHEEL_COUNTERS counters = Counters();
+        EXPECT_EQ(1u, counters.cArmed);
+        EXPECT_EQ(1u, counters.cFired);
+        EXPECT_EQ(0u, counters.cPending);
+    }
+
+    TEST_F(TimerWheelTest, ShortTimeoutsRoundUpToATick)
+    {
+        FAKE_TIMEOUT zero, one;
+        ULONGLONG ullStart = _ullNow + 3;
+
+        AdvanceTo(ullStart);
+        Arm(&zero, 0);
+        Arm(&one, 1);
+
+        AdvanceTo(ullStart + 1);
+        EXPECT_EQ(0, one.cFired.load());
+
+        //
+        // nothing fires before its deadline, or on the tick it was armed.
+        //
+        AdvanceTo(ullStart + 7);
+        EXPECT_EQ(1, zero.cFired.load());
+        EXPECT_EQ(1, one.cFired.load());
+    }
+
+    TEST_F(TimerWheelTest, CancelledEntryDoesNotFire)
+    {
+        FAKE_TIMEOUT timeout, other;
+
+        EXPECT_FALSE(_wheel.Cancel(&timeout.entry));
+
+        Arm(&timeout, 100);
+        Arm(&other, 100);
+        EXPECT_TRUE(_wheel.Cancel(&timeout.entry));
+        EXPECT_FALSE(_wheel.Cancel(&timeout.entry));
+
+        AdvanceTo(_ullNow + 200);
+        EXPECT_EQ(0, timeout.cFired.load());
+        EXPECT_EQ(1, other.cFired.load());
+
+        //
+        // fired entries are no longer armed.
+        //
+        EXPECT_FALSE(_wheel.Cancel(&other.entry));
+
+        TIMER_WHEEL_COUNTERS counters = Counters();
+        EXPECT_EQ(1u, counters.cCancelled);
+        EXPECT_EQ(0u, counters.cPending);
+    }
+
+    TEST_F(TimerWheelTest, ArmingAgainMovesTheEntry)
+    {
+        FAKE_TIMEOUT timeout;
+        ULONGLONG ullStart = _ullNow;
+
+        Arm(&timeout, 100);
+        EXPECT_TRUE(_wheel.Arm(&timeout.entry, 5000, _ullNow));
+
+        AdvanceTo(ullStart + 4990);
+        EXPECT_EQ(0, timeout.cFired.load());
+
+        AdvanceTo(ullStart + 5000);
+        EXPECT_EQ(1, timeout.cFired.load());
+        EXPECT_EQ(1u, Counters().cFired);
+    }
+
+    //
+    // Deadlines on every level, reached in uneven steps.
+    //
+    TEST_F(TimerWheelTest, CascadeKeepsEveryDeadline)
+    {
+        const DWORD cTimeouts = 2000;
+        const ULONGLONG ullStart = _ullNow + 7;
+        std::vector<FAKE_TIMEOUT> timeouts(cTimeouts);
+        std::vector<DWORD> deadlines(cTimeouts);
+        DWORD dwSeed = 12345;
+
+        AdvanceTo(ullStart);
+
+        for (DWORD i = 0; i < cTimeouts; i++)
+        {
+            dwSeed = dwSeed * 1103515245 + 12345;
+            //
+            // up to about 3 hours, spread over the scales of the levels.
+            //
+            DWORD dwTimeoutMs = (dwSeed >> 8) % (10u << ((i % 5) * 4 + 4));
+            deadlines[i] = dwTimeoutMs;
+            Arm(&timeouts[i], dwTimeoutMs);
+        }
+
+        ULONGLONG ullPrevious = ullStart;
+        while (Counters().cPending != 0)
+        {
+            dwSeed = dwSeed * 1103515245 + 12345;
+            ULONGLONG ullNext = ullPrevious + 1 + (dwSeed >> 8) % 30000;
+
+            AdvanceTo(ullNext);
+
+            for (DWORD i = 0; i < cTimeouts; i++)
+            {
+                //
+                // the deadline rounded up to the tick it is due on.
+                //
+                ULONGLONG ullDue = (ullStart + deadlines[i] + TIMER_WHEEL::TICK_MS - 1) / TIMER_WHEEL::TICK_MS * TIMER_WHEEL::TICK_MS;
+                ullDue = max(ullDue, (ullStart / TIMER_WHEEL::TICK_MS + 1) * TIMER_WHEEL::TICK_MS);
+
+                if (ullDue <= ullNext)
+                {
+                    ASSERT_EQ(1, timeouts[i].cFired.load());
+                    if (ullDue > ullPrevious)
+                    {
+                        EXPECT_EQ(ullNext, timeouts[i].ullFiredAt);
+                    }
+                }
+                else
+                {
+                    ASSERT_EQ(0, timeouts[i].cFired.load());
+                }
+            }
+
+            ullPrevious = ullNext;
+        }
+
+        EXPECT_EQ(static_cast<ULONGLONG>(cTimeouts), Counters().cFired);
+    }
+
+    TEST_F(TimerWheelTest, TimeoutBeyondTheTopLevel)
+    {
+        FAKE_TIMEOUT timeout;
+        const DWORD dwTimeoutMs = 50 * 60 * 60 * 1000;
+        ULONGLONG ullStart = _ullNow;
+
+        Arm(&timeout, dwTimeoutMs);
+
+        AdvanceTo(ullStart + dwTimeoutMs - 10);
+        EXPECT_EQ(0, timeout.cFired.load());
+
+        AdvanceTo(ullStart + dwTimeoutMs);
+        EXPECT_EQ(1, timeout.cFired.load());
+    }
+
+    TEST_F(TimerWheelTest, CallbackCanArmItsEntry)
+    {
+        FAKE_TIMEOUT periodic;
+        ULONGLONG ullStart = _ullNow;
+
+        periodic.pWheel = &_wheel;
+        periodic.dwPeriodMs = 3000;
+        Arm(&periodic, 3000);
+
+        for (ULONGLONG ullNow = ullStart; ullNow <= ullStart + 30000; ullNow += 100)
+        {
+            AdvanceTo(ullNow);
+        }
+
+        EXPECT_EQ(10, periodic.cFired.load());
+        EXPECT_TRUE(_wheel.Cancel(&periodic.entry));
+    }
+
+    TEST(TimerWheel, TimerTurnsTheWheel)
+    {
+        TIMER_WHEEL wheel;
+        FAKE_TIMEOUT timeout, cancelled;
+
+        ASSERT_EQ(S_OK, wheel.Initialize());
+        wheel.Arm(&timeout.entry, 30, GetTickCount64());
+        wheel.Arm(&cancelled.entry, 30, GetTickCount64());
+        wheel.CancelAndWait(&cancelled.entry);
+
+        for (int i = 0; i < 200 && timeout.cFired == 0; i++)
+        {
+            Sleep(10);
+        }
+
+        EXPECT_EQ(1, timeout.cFired.load());
+        EXPECT_EQ(0, cancelled.cFired.load());
+
+        //
+        // the timer stops once the wheel is empty and starts again with
+        // the next entry.
+        //
+        Sleep(50);
+        wheel.Arm(&timeout.entry, 30, GetTickCount64());
+
+        for (int i = 0; i < 200 && timeout.cFired == 1; i++)
+        {
+            Sleep(10);
+        }
+
+        EXPECT_EQ(2, timeout.cFired.load());
+    }
+
+    //
+    // Requests arming and cancelling their timeouts while the wheel turns,
+    // every timeout is either cancelled or fired exactly once.
+    //
+    TEST_F(TimerWheelTest, ConcurrentArmAndCancel)
+    {
+        const DWORD cThreads = 8;
+        const DWORD cTimeoutsPerThread = 2000;
+        std::vector<FAKE_TIMEOUT> timeouts(cThreads * cTimeoutsPerThread);
+        std::atomic<ULONGLONG> ullClock(_ullNow);
+        std::atomic<bool> fStop(false);
+        std::atomic<DWORD> cCancelled(0);
+
+        std::thread ticker([&]()
+        {
+            while (!fStop)
+            {
+                _wheel.Advance(ullClock += TIMER_WHEEL::TICK_MS);
+                std::this_thread::yield();
+            }
+        });
+
+        Benchmark::RunConcurrently(cThreads, [&](DWORD dwThread)
+        {
+            for (DWORD i = 0; i < cTimeoutsPerThread; i++)
+            {
+                FAKE_TIMEOUT *pTimeout = &timeouts[dwThread * cTimeoutsPerThread + i];
+
+                _wheel.Arm(&pTimeout->entry, (i % 7) * 10, ullClock);
+                if ((i % 2) == 0 && _wheel.Cancel(&pTimeout->entry))
+                {
+                    cCancelled++;
+                }
+            }
+        });
+
+        while (Counters().cPending != 0)
+        {
+            std::this_thread::yield();
+        }
+        fStop = true;
+        ticker.join();
+
+        DWORD cFired = 0;
+        for (FAKE_TIMEOUT &timeout : timeouts)
+        {
+            ASSERT_LE(timeout.cFired.load(), 1);
+            cFired += timeout.cFired;
+        }
+
+        EXPECT_EQ(cThreads * cTimeoutsPerThread, cFired + cCancelled);
+
+        TIMER_WHEEL_COUNTERS counters = Counters();
+        EXPECT_EQ(static_cast<ULONGLONG>(cFired), counters.cFired);
+        EXPECT_EQ(static_cast<ULONGLONG>(cCancelled.load()), counters.cCancelled);
+    }
+
+    //
+    // Request timeouts are armed when a request goes to the backend and
+    // cancelled when it completes, on a wheel that holds the timeouts of
+    // the other requests in flight.
+    //
+    static
+    double
+    RunWheelArmCancel(
+        DWORD       dwThreads,
+        DWORD       dwOps
+    )
+    {
+        const DWORD cInFlight = 1024;
+        TIMER_WHEEL wheel;
+        std::vector<FAKE_TIMEOUT> background(100000);
+        ULONGLONG ullNow = GetTickCount64();
+
+        wheel.Initialize(FALSE);
+        for (DWORD i = 0; i < background.size(); i++)
+        {
+            wheel.Arm(&background[i].entry, 1000 + i, ullNow);
+        }
+
+        std::vector<FAKE_TIMEOUT> timeouts(dwThreads * cInFlight);
+
+        double ns = Benchmark::RunConcurrently(dwThreads, [&](DWORD dwThread)
+        {
+            FAKE_TIMEOUT *rgTimeouts = &timeouts[dwThread * cInFlight];
+
+            for (DWORD i = 0; i < dwOps; i++)
+            {
+                TIMER_WHEEL_ENTRY *pEntry = &rgTimeouts[i % cInFlight].entry;
+
+                wheel.Arm(pEntry, 120000, ullNow);
+                wheel.Cancel(pEntry);
+            }
+        });
+
+        for (FAKE_TIMEOUT &timeout : background)
+        {
+            wheel.Cancel(&timeout.entry);
+        }
+
+        return ns;
+    }
+
+    static
+    VOID
+    CALLBACK
+    ThreadpoolTimerCallback(
+        _In_ PTP_CALLBACK_INSTANCE  Instance,
+        _In_ PVOID                  Context,
+        _In_ PTP_TIMER              Timer
+    )
+    {
+        UNREFERENCED_PARAMETER(Instance);
+        UNREFERENCED_PARAMETER(Context);
+        UNREFERENCED_PARAMETER(Timer);
+    }
+
+    //
+    // The same with a threadpool timer per request, set and cancelled the
+    // way STTIMER does it.
+    //
+    static
+    double
+    RunThreadpoolTimerArmCancel(
+        DWORD       dwThreads,
+        DWORD       dwOps
+    )
+    {
+        const DWORD cInFlight = 1024;
+        std::vector<PTP_TIMER> timers(dwThreads * cInFlight);
+
+        for (PTP_TIMER &pTimer : timers)
+        {
+            pTimer = CreateThreadpoolTimer(ThreadpoolTimerCallback, NULL, NULL);
+        }
+
+        double ns = Benchmark::RunConcurrently(dwThreads, [&](DWORD dwThread)
+        {
+            PTP_TIMER *rgTimers = &timers[dwThread * cInFlight];
+            FILETIME ftDueTime;
+            ULARGE_INTEGER ulDueTime;
+
+            //
+            // relative, 120 seconds.
+            //
+            ulDueTime.QuadPart = static_cast<ULONGLONG>(-(120LL * 1000 * 10000));
+            ftDueTime.dwLowDateTime = ulDueTime.LowPart;
+            ftDueTime.dwHighDateTime = ulDueTime.HighPart;
+
+            for (DWORD i = 0; i < dwOps; i++)
+            {
+                PTP_TIMER pTimer = rgTimers[i % cInFlight];
+
+                SetThreadpoolTimer(pTimer, &ftDueTime, 0, 0);
+                SetThreadpoolTimer(pTimer, NULL, 0, 0);
+                WaitForThreadpoolTimerCallbacks(pTimer, TRUE);
+            }
+        });
+
+        for (PTP_TIMER pTimer : timers)
+        {
+            CloseThreadpoolTimer(pTimer);
+        }
+
+        return ns;
+    }
+
+    TEST(TimerWheelBenchmark, DISABLED_ArmAndCancelVsThreadpoolTimers)
+    {
+        const DWORD dwWheelOps = 2000000;
+        const DWORD dwThreadpoolOps = 200000;
+        DWORD dwMaxThreads = Benchmark::QueryThreadCount();
+
+        for (DWORD dwThreads = 1; dwThreads <= dwMaxThreads; dwThreads *= 2)
+        {
+            char szName[128];
+
+            sprintf_s(szName, "threadpool timer arm+cancel threads=%u", dwThreads);
+            Benchmark::Report(szName,
+                              RunThreadpoolTimerArmCancel(dwThreads, dwThreadpoolOps),
+                              static_cast<ULONGLONG>(dwThreads) * dwThreadpoolOps);
+
+            sprintf_s(szName, "TIMER_WHEEL arm+cancel threads=%u", dwThreads);
+            Benchmark::Report(szName,
+                              RunWheelArmCancel(dwThreads, dwWheelOps),
+                              static_cast<ULONGLONG>(dwThreads) * dwWheelOps);
+        }
+    }
+
+    //
+    // A million timeouts spread over ten seconds, fired by turning the
+    // wheel tick by tick.
+    //
+    TEST(TimerWheelBenchmark, DISABLED_ExpireMillions)
+    {
+        const DWORD cTimeouts = 1000000;
+        const DWORD dwSpreadMs = 10000;
+        TIMER_WHEEL wheel;
+        std::vector<FAKE_TIMEOUT> timeouts(cTimeouts);
+        ULONGLONG ullStart = GetTickCount64();
+
+        wheel.Initialize(FALSE);
+
+        double ns = Benchmark::RunConcurrently(1, [&](DWORD)
+        {
+            for (DWORD i = 0; i < cTimeouts; i++)
+            {
+                wheel.Arm(&timeouts[i].entry, (i * 7919) % dwSpreadMs, ullStart);
+            }
+        });
+        Benchmark::Report("TIMER_WHEEL arm, 1M pending", ns, cTimeouts);
+
+        ns = Benchmark::RunConcurrently(1, [&](DWORD)
+        {
+            for (ULONGLONG ullNow = ullStart; ullNow <= ullStart + dwSpreadMs + TIMER_WHEEL::TICK_MS; ullNow += TIMER_WHEEL::TICK_MS)
+            {
+                wheel.Advance(ullNow);
+            }
+        });
+        Benchmark::Report("TIMER_WHEEL expire, 1M pending", ns, cTimeouts);
+
+        TIMER_WHEEL_COUNTERS counters;
+        wheel.QueryCounters(&counters);
+        EXPECT_EQ(static_cast<ULONGLONG>(cTimeouts), counters.cFired);
+    }
+}
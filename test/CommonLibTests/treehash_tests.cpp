@@ -0,0 +1,306 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#include "stdafx.h"
+#include "treehash.h"
+#include "Benchmark.h"
+
+namespace TreeHashTests
+{
+    class TREE_RECORD
+    {
+    public:
+        TREE_RECORD(PCWSTR pszPath) : _cRefs(1), _dwSignature(SIGNATURE)
+        {
+            wcscpy_s(_szPath, pszPath);
+        }
+
+        PCWSTR QueryPath() { return _szPath; }
+        LONG QueryRefs() { return _cRefs; }
+        BOOL CheckSignature() { return _dwSignature == SIGNATURE; }
+
+        VOID Reference() { InterlockedIncrement(&_cRefs); }
+
+        VOID Dereference()
+        {
+            if (InterlockedDecrement(&_cRefs) == 0)
+            {
+                //
+                // A reader that still holds the pointer sees the signature
+                // change (or the debug heap fill) instead of silently working.
+                //
+                _dwSignature = SIGNATURE_FREE;
+                delete this;
+            }
+        }
+
+    private:
+        ~TREE_RECORD() {}
+
+        static const DWORD SIGNATURE = 'ERTT';
+        static const DWORD SIGNATURE_FREE = 'xRTT';
+
+        volatile LONG   _cRefs;
+        volatile DWORD  _dwSignature;
+        WCHAR           _szPath[128];
+    };
+
+    class TEST_TREE_HASH : public TREE_HASH_TABLE<TREE_RECORD>
+    {
+    public:
+        TEST_TREE_HASH() : TREE_HASH_TABLE<TREE_RECORD>(FALSE)
+        {}
+
+        VOID ReferenceRecord(TREE_RECORD * pRecord) override { pRecord->Reference(); }
+        VOID DereferenceRecord(TREE_RECORD * pRecord) override { pRecord->Dereference(); }
+        PCWSTR GetKey(TREE_RECORD * pRecord) override { return pRecord->QueryPath(); }
+    };
+
+    static VOID CountRecords(TREE_RECORD *, PVOID pvContext)
+    {
+        (*static_cast<DWORD*>(pvContext))++;
+    }
+
+    static BOOL DeletePath(TREE_RECORD * pRecord, PVOID pvContext)
+    {
+        return _wcsicmp(pRecord->QueryPath(), static_cast<PCWSTR>(pvContext)) == 0;
+    }
+
+    static
+    HRESULT
+    InsertNewRecord(
+        TEST_TREE_HASH &    table,
+        PCWSTR              pszPath
+    )
+    {
+        TREE_RECORD * pRecord = new TREE_RECORD(pszPath);
+        HRESULT hr = table.InsertRecord(pRecord);
+        pRecord->Dereference();
+        return hr;
+    }
+
+    TEST(TreeHashTable, InsertFindDeleteSubtree)
+    {
+        TEST_TREE_HASH table;
+        TREE_RECORD * pFound = NULL;
+        DWORD dwRecords = 0;
+
+        ASSERT_EQ(S_OK, table.Initialize(3));
+        ASSERT_EQ(S_OK, InsertNewRecord(table, L"/LM/W3SVC/1/ROOT/app"));
+        ASSERT_EQ(S_OK, InsertNewRecord(table, L"/LM/W3SVC/1/ROOT"));
+        EXPECT_EQ(HRESULT_FROM_WIN32(ERROR_ALREADY_EXISTS), InsertNewRecord(table, L"/lm/w3svc/1/root"));
+
+        //
+        // /LM, /LM/W3SVC, /LM/W3SVC/1, /LM/W3SVC/1/ROOT, /LM/W3SVC/1/ROOT/app
+        //
+        EXPECT_EQ(5, table.Count());
+
+        table.FindKey(L"/lm/w3svc/1/root/APP", &pFound);
+        ASSERT_NE(nullptr, pFound);
+        EXPECT_STREQ(L"/LM/W3SVC/1/ROOT/app", pFound->QueryPath());
+        pFound->Dereference();
+
+        table.FindKey(L"/LM/W3SVC", &pFound);
+        EXPECT_EQ(nullptr, pFound);
+
+        table.Apply(CountRecords, &dwRecords);
+        EXPECT_EQ(2, dwRecords);
+
+        table.DeleteKey(L"/LM/W3SVC/1");
+        EXPECT_EQ(2, table.Count());
+        table.FindKey(L"/LM/W3SVC/1/ROOT/app", &pFound);
+        EXPECT_EQ(nullptr, pFound);
+
+        table.Clear();
+        EXPECT_EQ(0, table.Count());
+    }
+
+    TEST(TreeHashTable, DeleteIfKeepsNodesWithChildren)
+    {
+        TEST_TREE_HASH table;
+        TREE_RECORD * pParent = new TREE_RECORD(L"/site");
+        TREE_RECORD * pFound = NULL;
+
+        ASSERT_EQ(S_OK, table.Initialize(3));
+        ASSERT_EQ(S_OK, table.InsertRecord(pParent));
+        ASSERT_EQ(S_OK, InsertNewRecord(table, L"/site/app"));
+        EXPECT_EQ(2, pParent->QueryRefs());
+
+        table.DeleteIf(DeletePath, const_cast<PWSTR>(L"/site"));
+
+        //
+        // The table's reference is dropped once DeleteIf returns, the node
+        // itself stays because /site/app still hangs off it.
+        //
+        EXPECT_EQ(1, pParent->QueryRefs());
+        EXPECT_EQ(2, table.Count());
+
+        table.FindKey(L"/site", &pFound);
+        EXPECT_EQ(nullptr, pFound);
+        table.FindKey(L"/site/app", &pFound);
+        ASSERT_NE(nullptr, pFound);
+        pFound->Dereference();
+
+        pParent->Dereference();
+        table.Clear();
+    }
+
+    TEST(TreeHashTable, ConcurrentReadersAgainstRecyclingWriters)
+    {
+        const DWORD dwStable = 64;
+        const DWORD dwReaders = 6;
+        const DWORD dwWriters = 2;
+        const DWORD dwRounds = 200;
+        TEST_TREE_HASH table;
+        std::atomic<bool> fWritersDone(false);
+        std::atomic<DWORD> misses(0);
+        std::atomic<DWORD> corrupt(0);
+        WCHAR szPath[128];
+
+        //
+        // Few buckets so that the writers force rehashes during the run.
+        //
+        ASSERT_EQ(S_OK, table.Initialize(3));
+
+        for (DWORD i = 0; i < dwStable; i++)
+        {
+            swprintf_s(szPath, L"/LM/W3SVC/1/ROOT/stable%u", i);
+            ASSERT_EQ(S_OK, InsertNewRecord(table, szPath));
+        }
+
+        Benchmark::RunConcurrently(dwReaders + dwWriters, [&](DWORD dwThread)
+        {
+            WCHAR szKey[128];
+
+            if (dwThread < dwWriters)
+            {
+                for (DWORD dwRound = 0; dwRound < dwRounds; dwRound++)
+                {
+                    //
+                    // Grow a subtree, then tear it down either through the
+                    // root of the subtree or through DeleteIf.
+                    //
+                    DWORD dwSize = 8 + dwRound % 64;
+                    for (DWORD i = 0; i < dwSize; i++)
+                    {
+                        swprintf_s(szKey, L"/LM/W3SVC/%u/ROOT/app%u/dir%u", dwThread + 2, dwRound % 3, i);
+                        InsertNewRecord(table, szKey);
+                    }
+
+                    swprintf_s(szKey, L"/LM/W3SVC/%u/ROOT/app%u", dwThread + 2, dwRound % 3);
+                    if (dwRound & 1)
+                    {
+                        table.DeleteKey(szKey);
+                    }
+                    else
+                    {
+                        InsertNewRecord(table, szKey);
+                        table.DeleteIf(DeletePath, szKey);
+                    }
+                }
+
+                fWritersDone = true;
+                return;
+            }
+
+            DWORD dwSeed = dwThread;
+            while (!fWritersDone)
+            {
+                TREE_RECORD * pFound = NULL;
+                dwSeed = dwSeed * 1103515245 + 12345;
+
+                if (dwSeed & 0x10000)
+                {
+                    swprintf_s(szKey, L"/LM/W3SVC/1/ROOT/stable%u", (dwSeed >> 8) % dwStable);
+                    table.FindKey(szKey, &pFound);
+                    if (pFound == NULL)
+                    {
+                        misses++;
+                        continue;
+                    }
+                }
+                else
+                {
+                    swprintf_s(szKey, L"/LM/W3SVC/%u/ROOT/app%u/dir%u",
+                        (dwSeed >> 8) % dwWriters + 2, (dwSeed >> 12) % 3, (dwSeed >> 16) % 72);
+                    table.FindKey(szKey, &pFound);
+                    if (pFound == NULL)
+                    {
+                        continue;
+                    }
+                }
+
+                if (!pFound->CheckSignature() || _wcsicmp(pFound->QueryPath(), szKey) != 0)
+                {
+                    corrupt++;
+                }
+                pFound->Dereference();
+            }
+        });
+
+        EXPECT_EQ(0, misses.load());
+        EXPECT_EQ(0, corrupt.load());
+
+        DWORD dwRecords = 0;
+        table.Apply(CountRecords, &dwRecords);
+        EXPECT_GE(dwRecords, dwStable);
+
+        table.Clear();
+    }
+
+    TEST(TreeHashTable, ApplyDuringRehashSeesEveryRecord)
+    {
+        const DWORD dwStable = 64;
+        const DWORD dwApplies = 4;
+        TEST_TREE_HASH table;
+        std::atomic<bool> fWriterDone(false);
+        std::atomic<DWORD> shortWalks(0);
+        WCHAR szPath[128];
+
+        ASSERT_EQ(S_OK, table.Initialize(3));
+
+        for (DWORD i = 0; i < dwStable; i++)
+        {
+            swprintf_s(szPath, L"/stable%u", i);
+            ASSERT_EQ(S_OK, InsertNewRecord(table, szPath));
+        }
+
+        Benchmark::RunConcurrently(dwApplies + 1, [&](DWORD dwThread)
+        {
+            WCHAR szKey[128];
+
+            if (dwThread == 0)
+            {
+                //
+                // Enough records for the table to rehash several times.
+                //
+                for (DWORD i = 0; i < 20000; i++)
+                {
+                    swprintf_s(szKey, L"/grow%u", i);
+                    InsertNewRecord(table, szKey);
+                }
+
+                fWriterDone = true;
+                return;
+            }
+
+            while (!fWriterDone)
+            {
+                DWORD dwRecords = 0;
+                table.Apply(CountRecords, &dwRecords);
+                if (dwRecords < dwStable)
+                {
+                    shortWalks++;
+                }
+            }
+        });
+
+        EXPECT_EQ(0, shortWalks.load());
+
+        DWORD dwRecords = 0;
+        table.Apply(CountRecords, &dwRecords);
+        EXPECT_EQ(dwStable + 20000, dwRecords);
+
+        table.Clear();
+    }
+}
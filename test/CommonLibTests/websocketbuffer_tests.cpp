@@ -0,0 +1,278 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#include "stdafx.h"
+#include "websocketbuffer.h"
+
+namespace WebSocketBufferTests
+{
+    class WebSocketBufferTest : public ::testing::Test
+    {
+    protected:
+        void SetUp() override
+        {
+            ALLOC_CACHE_HANDLER::StaticInitialize();
+            ASSERT_EQ(S_OK, _pool.Initialize());
+        }
+
+        //
+        // Reads cbMessage bytes as one message, in reads of at most
+        // cbFragment, and sends it. Returns the number of sends.
+        //
+        DWORD
+        Relay(
+            WEBSOCKET_RELAY_BUFFER &    buffer,
+            DWORD                       cbMessage,
+            DWORD                       cbFragment
+        )
+        {
+            DWORD cSends = 0;
+
+            while (cbMessage > 0)
+            {
+                BYTE *pbRead;
+                DWORD cbRead;
+
+                EXPECT_EQ(S_OK, buffer.BeginRead(&pbRead, &cbRead));
+                cbRead = min(cbRead, min(cbFragment, cbMessage));
+                memset(pbRead, 'x', cbRead);
+                cbMessage -= cbRead;
+
+                if (buffer.CompleteRead(cbRead, TRUE, cbMessage == 0))
+                {
+                    cSends++;
+                    buffer.CompleteSend();
+                }
+            }
+            return cSends;
+        }
+
+        WEBSOCKET_BUFFER_POOL   _pool;
+    };
+
+    TEST(WebSocketBufferPool, ClassesGoFromMinToMax)
+    {
+        EXPECT_EQ(WEBSOCKET_BUFFER_POOL::MIN_BUFFER_SIZE, WEBSOCKET_BUFFER_POOL::QueryClassSize(0));
+        EXPECT_EQ(WEBSOCKET_BUFFER_POOL::MAX_BUFFER_SIZE,
+                  WEBSOCKET_BUFFER_POOL::QueryClassSize(WEBSOCKET_BUFFER_POOL::SIZE_CLASSES - 1));
+        EXPECT_EQ(256u * 1024, WEBSOCKET_BUFFER_POOL::MAX_BUFFER_SIZE);
+
+        EXPECT_EQ(0u, WEBSOCKET_BUFFER_POOL::QueryClass(1));
+        EXPECT_EQ(0u, WEBSOCKET_BUFFER_POOL::QueryClass(1024));
+        EXPECT_EQ(1u, WEBSOCKET_BUFFER_POOL::QueryClass(1025));
+        EXPECT_EQ(2u, WEBSOCKET_BUFFER_POOL::QueryClass(16 * 1024));
+        EXPECT_EQ(4u, WEBSOCKET_BUFFER_POOL::QueryClass(256 * 1024));
+        EXPECT_EQ(4u, WEBSOCKET_BUFFER_POOL::QueryClass(MAXDWORD));
+    }
+
+    TEST_F(WebSocketBufferTest, FragmentsAreCoalescedUntilTheMessageEnds)
+    {
+        WEBSOCKET_RELAY_BUFFER buffer;
+        BYTE *pbRead;
+        DWORD cbRead;
+
+        buffer.Initialize(&_pool, 64 * 1024);
+
+        ASSERT_EQ(S_OK, buffer.BeginRead(&pbRead, &cbRead));
+        EXPECT_EQ(1024u, cbRead);
+        memcpy(pbRead, "hello ", 6);
+        EXPECT_FALSE(buffer.CompleteRead(6, TRUE, FALSE));
+
+        //
+        // The next read goes after the data.
+        //
+        ASSERT_EQ(S_OK, buffer.BeginRead(&pbRead, &cbRead));
+        EXPECT_EQ(buffer.QueryData() + 6, pbRead);
+        EXPECT_EQ(1018u, cbRead);
+        memcpy(pbRead, "world", 5);
+        EXPECT_TRUE(buffer.CompleteRead(5, TRUE, TRUE));
+
+        EXPECT_EQ(11u, buffer.QueryDataSize());
+        EXPECT_EQ(0, memcmp(buffer.QueryData(), "hello world", 11));
+        EXPECT_TRUE(buffer.IsUtf8());
+        EXPECT_TRUE(buffer.IsFinal());
+
+        buffer.CompleteSend();
+        EXPECT_TRUE(buffer.IsEmpty());
+        EXPECT_EQ(NULL, buffer.QueryData());
+    }
+
+    TEST_F(WebSocketBufferTest, LargeMessagesGrowTheBufferUpToTheMax)
+    {
+        WEBSOCKET_RELAY_BUFFER buffer;
+
+        buffer.Initialize(&_pool, 16 * 1024);
+
+        //
+        // 1KB, then 4KB, then 16KB at most.
+        //
+        EXPECT_EQ(8u, Relay(buffer, 100 * 1024, 512));
+        EXPECT_EQ(16u * 1024, buffer.QueryBufferSize());
+
+        EXPECT_EQ(7u, Relay(buffer, 100 * 1024, 512));
+        EXPECT_EQ(16u * 1024, buffer.QueryBufferSize());
+    }
+
+    TEST_F(WebSocketBufferTest, MaxBetweenClassesIsRoundedDown)
+    {
+        WEBSOCKET_RELAY_BUFFER buffer;
+
+        buffer.Initialize(&_pool, 20000);
+        Relay(buffer, 1024 * 1024, 1024 * 1024);
+        EXPECT_EQ(16u * 1024, buffer.QueryBufferSize());
+
+        WEBSOCKET_RELAY_BUFFER smallest;
+
+        smallest.Initialize(&_pool, 100);
+        Relay(smallest, 1024 * 1024, 1024 * 1024);
+        EXPECT_EQ(1024u, smallest.QueryBufferSize());
+    }
+
+    TEST_F(WebSocketBufferTest, RunsOfSmallMessagesShrinkTheBuffer)
+    {
+        WEBSOCKET_RELAY_BUFFER buffer;
+
+        buffer.Initialize(&_pool, 64 * 1024);
+        Relay(buffer, 8 * 1024, 8 * 1024);
+        ASSERT_EQ(16u * 1024, buffer.QueryBufferSize());
+
+        //
+        // The 3KB tail of the large message did not count.
+        //
+        for (DWORD i = 1; i < WEBSOCKET_RELAY_BUFFER::SHRINK_AFTER; i++)
+        {
+            EXPECT_EQ(1u, Relay(buffer, 100, 100));
+            EXPECT_EQ(16u * 1024, buffer.QueryBufferSize()) << i;
+        }
+
+        EXPECT_EQ(1u, Relay(buffer, 100, 100));
+        EXPECT_EQ(4u * 1024, buffer.QueryBufferSize());
+
+        //
+        // A larger message in between starts the run over.
+        //
+        for (DWORD i = 1; i < WEBSOCKET_RELAY_BUFFER::SHRINK_AFTER; i++)
+        {
+            Relay(buffer, 100, 100);
+        }
+        Relay(buffer, 2048, 2048);
+        Relay(buffer, 100, 100);
+        EXPECT_EQ(4u * 1024, buffer.QueryBufferSize());
+    }
+
+    TEST_F(WebSocketBufferTest, CloseWaitsForTheDataAheadOfIt)
+    {
+        WEBSOCKET_RELAY_BUFFER buffer;
+        BYTE *pbRead;
+        DWORD cbRead;
+
+        buffer.Initialize(&_pool, 64 * 1024);
+
+        ASSERT_EQ(S_OK, buffer.BeginRead(&pbRead, &cbRead));
+        EXPECT_FALSE(buffer.CompleteRead(10, FALSE, FALSE));
+        EXPECT_FALSE(buffer.IsEmpty());
+
+        buffer.SetClosePending();
+        EXPECT_TRUE(buffer.IsClosePending());
+        EXPECT_FALSE(buffer.IsFinal());
+        EXPECT_EQ(10u, buffer.QueryDataSize());
+
+        buffer.CompleteSend();
+        EXPECT_FALSE(buffer.IsClosePending());
+        EXPECT_TRUE(buffer.IsEmpty());
+    }
+
+    TEST_F(WebSocketBufferTest, BuffersGoBackToThePoolAfterTheSend)
+    {
+        WEBSOCKET_BUFFER_COUNTERS counters;
+        WEBSOCKET_RELAY_BUFFER buffer;
+        BYTE *pbRead;
+        DWORD cbRead;
+
+        if (ALLOC_CACHE_HANDLER::IsPageheapEnabled())
+        {
+            return;
+        }
+
+        //
+        // Stay on one processor so that the buffer comes back from the
+        // free list it went to.
+        //
+        DWORD_PTR dwOldMask = SetThreadAffinityMask(GetCurrentThread(),
+                                                    static_cast<DWORD_PTR>(1) << GetCurrentProcessorNumber());
+
+        buffer.Initialize(&_pool, 64 * 1024);
+        for (DWORD i = 0; i < 10; i++)
+        {
+            ASSERT_EQ(S_OK, buffer.BeginRead(&pbRead, &cbRead));
+            EXPECT_TRUE(buffer.CompleteRead(cbRead, FALSE, TRUE));
+            buffer.CompleteSend();
+        }
+
+        SetThreadAffinityMask(GetCurrentThread(), dwOldMask);
+
+        _pool.QueryCounters(&counters);
+        EXPECT_EQ(1u, counters.rgClasses[0].cMisses);
+        EXPECT_EQ(9u, counters.rgClasses[0].cHits);
+        for (DWORD i = 1; i < WEBSOCKET_BUFFER_POOL::SIZE_CLASSES; i++)
+        {
+            EXPECT_EQ(0u, counters.rgClasses[i].cHits + counters.rgClasses[i].cMisses);
+        }
+    }
+
+    TEST_F(WebSocketBufferTest, HibernatingBufferWaitsInTheProbe)
+    {
+        WEBSOCKET_RELAY_BUFFER buffer;
+        BYTE *pbRead;
+        DWORD cbRead;
+
+        buffer.Initialize(&_pool, 64 * 1024);
+        buffer.SetHibernating(TRUE);
+
+        //
+        // A message that fits the probe goes out from it.
+        //
+        ASSERT_EQ(S_OK, buffer.BeginRead(&pbRead, &cbRead));
+        EXPECT_EQ(WEBSOCKET_RELAY_BUFFER::PROBE_SIZE, cbRead);
+        EXPECT_EQ(0u, buffer.QueryHeldSize());
+        memcpy(pbRead, "ping", 4);
+        EXPECT_TRUE(buffer.CompleteRead(4, TRUE, TRUE));
+        EXPECT_EQ(pbRead, buffer.QueryData());
+        buffer.CompleteSend();
+        EXPECT_EQ(0u, buffer.QueryHeldSize());
+
+        //
+        // A larger one goes on in a pooled buffer, after the probe bytes.
+        //
+        ASSERT_EQ(S_OK, buffer.BeginRead(&pbRead, &cbRead));
+        memcpy(pbRead, "0123456789abcdef", WEBSOCKET_RELAY_BUFFER::PROBE_SIZE);
+        EXPECT_FALSE(buffer.CompleteRead(WEBSOCKET_RELAY_BUFFER::PROBE_SIZE, TRUE, FALSE));
+
+        ASSERT_EQ(S_OK, buffer.BeginRead(&pbRead, &cbRead));
+        EXPECT_FALSE(buffer.IsProbing());
+        EXPECT_EQ(1024u, buffer.QueryHeldSize());
+        EXPECT_EQ(buffer.QueryData() + WEBSOCKET_RELAY_BUFFER::PROBE_SIZE, pbRead);
+        EXPECT_EQ(1024u - WEBSOCKET_RELAY_BUFFER::PROBE_SIZE, cbRead);
+        memcpy(pbRead, "!", 1);
+        EXPECT_TRUE(buffer.CompleteRead(1, TRUE, TRUE));
+        EXPECT_EQ(0, memcmp(buffer.QueryData(), "0123456789abcdef!", 17));
+
+        buffer.CompleteSend();
+        EXPECT_EQ(0u, buffer.QueryHeldSize());
+    }
+
+    TEST_F(WebSocketBufferTest, ReleaseDropsTheData)
+    {
+        WEBSOCKET_RELAY_BUFFER buffer;
+        BYTE *pbRead;
+        DWORD cbRead;
+
+        buffer.Initialize(&_pool, 64 * 1024);
+        ASSERT_EQ(S_OK, buffer.BeginRead(&pbRead, &cbRead));
+        buffer.CompleteRead(100, FALSE, FALSE);
+
+        buffer.Release();
+        EXPECT_TRUE(buffer.IsEmpty());
+        EXPECT_EQ(NULL, buffer.QueryData());
+    }
+}
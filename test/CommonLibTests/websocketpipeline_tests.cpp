@@ -0,0 +1,564 @@
+// Copyright (c) .NET Foundation. All rights reserved.
+// Licensed under the MIT License. See License.txt in the project root for license information.
+
+#include "stdafx.h"
+#include "websocketbuffer.h"
+#include "websocketpipeline.h"
+#include "Benchmark.h"
+#include <deque>
+
+namespace WebSocketPipelineTests
+{
+    TEST(WebSocketShutdown, RunsRightAwayWhenNoPipelineIsInside)
+    {
+        WEBSOCKET_SHUTDOWN shutdown;
+
+        EXPECT_FALSE(shutdown.IsShutdown());
+        EXPECT_EQ(WEBSOCKET_SHUTDOWN::NO_REASON, shutdown.QueryReason());
+
+        EXPECT_TRUE(shutdown.TryEnter());
+        EXPECT_FALSE(shutdown.Leave());
+
+        EXPECT_TRUE(shutdown.Shutdown(3));
+        EXPECT_TRUE(shutdown.IsShutdown());
+        EXPECT_EQ(3, shutdown.QueryReason());
+
+        //
+        // Only the first one counts, and nothing enters after it.
+        //
+        EXPECT_FALSE(shutdown.Shutdown(4));
+        EXPECT_EQ(3, shutdown.QueryReason());
+        EXPECT_FALSE(shutdown.TryEnter());
+    }
+
+    TEST(WebSocketShutdown, LastPipelineOutRunsIt)
+    {
+        WEBSOCKET_SHUTDOWN shutdown;
+
+        ASSERT_TRUE(shutdown.TryEnter());
+        ASSERT_TRUE(shutdown.TryEnter());
+
+        EXPECT_FALSE(shutdown.Shutdown(0));
+        EXPECT_FALSE(shutdown.TryEnter());
+        EXPECT_FALSE(shutdown.Leave());
+        EXPECT_TRUE(shutdown.Leave());
+        EXPECT_EQ(0, shutdown.QueryReason());
+    }
+
+    TEST(WebSocketShutdown, RunsExactlyOnceUnderConcurrency)
+    {
+        const DWORD dwThreads = 8;
+
+        for (DWORD iRound = 0; iRound < 200; iRound++)
+        {
+            WEBSOCKET_SHUTDOWN shutdown;
+            std::atomic<LONG> cRuns(0);
+            std::atomic<LONG> cInsideAfterRun(0);
+
+            Benchmark::RunConcurrently(dwThreads, [&](DWORD dwThread)
+            {
+                for (DWORD i = 0; i < 2000; i++)
+                {
+                    if (dwThread == 0 && i == 1000)
+                    {
+                        if (shutdown.Shutdown(1))
+                        {
+                            cRuns++;
+                        }
+                    }
+
+                    if (shutdown.TryEnter())
+                    {
+                        if (cRuns != 0)
+                        {
+                            cInsideAfterRun++;
+                        }
+                        if (shutdown.Leave())
+                        {
+                            cRuns++;
+                        }
+                    }
+                }
+            });
+
+            ASSERT_EQ(1, cRuns.load()) << iRound;
+            ASSERT_EQ(0, cInsideAfterRun.load()) << iRound;
+        }
+    }
+
+    TEST(WebSocketPipeline, StateFollowsTheOperations)
+    {
+        WEBSOCKET_BUFFER_POOL pool;
+        WEBSOCKET_PIPELINE pipeline;
+        WEBSOCKET_PIPELINE_COUNTERS counters;
+        BYTE *pbRead;
+        DWORD cbRead;
+
+        ALLOC_CACHE_HANDLER::StaticInitialize();
+        ASSERT_EQ(S_OK, pool.Initialize());
+        pipeline.Initialize(&pool, 64 * 1024, FALSE);
+
+        EXPECT_EQ(WEBSOCKET_PIPELINE_IDLE, pipeline.QueryState());
+
+        //
+        // A message in two reads, coalesced into one send.
+        //
+        ASSERT_EQ(S_OK, pipeline.BeginRead(&pbRead, &cbRead));
+        EXPECT_EQ(WEBSOCKET_PIPELINE_READING, pipeline.QueryState());
+        EXPECT_FALSE(pipeline.CompleteRead(100, FALSE, FALSE));
+
+        ASSERT_EQ(S_OK, pipeline.BeginRead(&pbRead, &cbRead));
+        EXPECT_TRUE(pipeline.CompleteRead(50, FALSE, TRUE));
+
+        pipeline.BeginSend();
+        EXPECT_EQ(WEBSOCKET_PIPELINE_SENDING, pipeline.QueryState());
+        pipeline.QueryBuffer()->CompleteSend();
+
+        pipeline.QueryCounters(&counters);
+        EXPECT_EQ(2u, counters.cReads);
+        EXPECT_EQ(0u, counters.cProbeReads);
+        EXPECT_EQ(1u, counters.cSends);
+        EXPECT_EQ(150u, counters.cbSent);
+
+        EXPECT_FALSE(pipeline.IsClosed());
+        EXPECT_TRUE(pipeline.Close());
+        EXPECT_TRUE(pipeline.IsClosed());
+        EXPECT_FALSE(pipeline.Close());
+    }
+
+    TEST(WebSocketPipeline, IdleAfterAQuickMessageHoldsNoBuffer)
+    {
+        WEBSOCKET_BUFFER_POOL pool;
+        WEBSOCKET_PIPELINE pipeline;
+        WEBSOCKET_PIPELINE_COUNTERS counters;
+        BYTE *pbRead;
+        DWORD cbRead;
+
+        ALLOC_CACHE_HANDLER::StaticInitialize();
+        ASSERT_EQ(S_OK, pool.Initialize());
+        pipeline.Initialize(&pool, 64 * 1024, TRUE);
+
+        //
+        // A small message long before the timeout.
+        //
+        ASSERT_EQ(S_OK, pipeline.BeginRead(&pbRead, &cbRead));
+        EXPECT_EQ(WEBSOCKET_RELAY_BUFFER::PROBE_SIZE, cbRead);
+        EXPECT_EQ(0u, pipeline.QueryBuffer()->QueryHeldSize());
+        EXPECT_TRUE(pipeline.CompleteRead(10, FALSE, TRUE));
+        pipeline.BeginSend();
+        pipeline.QueryBuffer()->CompleteSend();
+
+        //
+        // A larger one right after it moves on from the probe to a pooled
+        // buffer, which goes back to the pool once it is sent.
+        //
+        ASSERT_EQ(S_OK, pipeline.BeginRead(&pbRead, &cbRead));
+        EXPECT_EQ(WEBSOCKET_RELAY_BUFFER::PROBE_SIZE, cbRead);
+        EXPECT_FALSE(pipeline.CompleteRead(WEBSOCKET_RELAY_BUFFER::PROBE_SIZE, FALSE, FALSE));
+
+        ASSERT_EQ(S_OK, pipeline.BeginRead(&pbRead, &cbRead));
+        EXPECT_NE(0u, pipeline.QueryBuffer()->QueryHeldSize());
+        EXPECT_TRUE(pipeline.CompleteRead(100, FALSE, TRUE));
+        pipeline.BeginSend();
+        pipeline.QueryBuffer()->CompleteSend();
+
+        //
+        // The connection then goes idle: the wait is in the probe again.
+        //
+        ASSERT_EQ(S_OK, pipeline.BeginRead(&pbRead, &cbRead));
+        EXPECT_EQ(WEBSOCKET_RELAY_BUFFER::PROBE_SIZE, cbRead);
+        EXPECT_EQ(0u, pipeline.QueryBuffer()->QueryHeldSize());
+
+        pipeline.QueryCounters(&counters);
+        EXPECT_EQ(4u, counters.cReads);
+        EXPECT_EQ(3u, counters.cProbeReads);
+        EXPECT_EQ(2u, counters.cSends);
+        EXPECT_EQ(10u + WEBSOCKET_RELAY_BUFFER::PROBE_SIZE + 100u, counters.cbSent);
+    }
+
+    TEST(WebSocketPipeline, StaysAwakeWithoutHibernation)
+    {
+        WEBSOCKET_BUFFER_POOL pool;
+        WEBSOCKET_PIPELINE pipeline;
+        BYTE *pbRead;
+        DWORD cbRead;
+
+        ALLOC_CACHE_HANDLER::StaticInitialize();
+        ASSERT_EQ(S_OK, pool.Initialize());
+        pipeline.Initialize(&pool, 64 * 1024, FALSE);
+
+        ASSERT_EQ(S_OK, pipeline.BeginRead(&pbRead, &cbRead));
+        EXPECT_EQ(1024u, cbRead);
+        EXPECT_FALSE(pipeline.QueryBuffer()->IsHibernating());
+    }
+
+    //
+    // Stand-ins for the load test: a client and an echo server on the two
+    // sides of a relay built the way WEBSOCKET_HANDLER builds it, with two
+    // pipelines and a shutdown per connection. Every operation of the
+    // endpoints completes on the threadpool, as IIS and WinHttp ones do.
+    //
+    typedef
+    VOID
+    (*PFN_STAND_IN_COMPLETION)(
+        PVOID       pvContext,
+        DWORD       cbIo,
+        BOOL        fFinal
+    );
+
+    static volatile LONG    g_cCallbacks = 0;
+
+    struct STAND_IN_COMPLETION
+    {
+        PFN_STAND_IN_COMPLETION pfnCompletion;
+        PVOID                   pvContext;
+        DWORD                   cbIo;
+        BOOL                    fFinal;
+    };
+
+    static
+    VOID
+    CALLBACK
+    StandInCallback(
+        PTP_CALLBACK_INSTANCE,
+        PVOID       pvCompletion
+    )
+    {
+        STAND_IN_COMPLETION *pCompletion = static_cast<STAND_IN_COMPLETION *>(pvCompletion);
+
+        pCompletion->pfnCompletion(pCompletion->pvContext, pCompletion->cbIo, pCompletion->fFinal);
+        delete pCompletion;
+        InterlockedDecrement(&g_cCallbacks);
+    }
+
+    static
+    VOID
+    PostCompletion(
+        PFN_STAND_IN_COMPLETION pfnCompletion,
+        PVOID                   pvContext,
+        DWORD                   cbIo,
+        BOOL                    fFinal
+    )
+    {
+        InterlockedIncrement(&g_cCallbacks);
+        EXPECT_TRUE(TrySubmitThreadpoolCallback(StandInCallback,
+                                                new STAND_IN_COMPLETION { pfnCompletion, pvContext, cbIo, fFinal },
+                                                NULL));
+    }
+
+    //
+    // What one endpoint has written and the relay has not read yet. A read
+    // returns at most what one write has left and what the transport has
+    // ready, SEGMENT_SIZE, and waits when there is nothing.
+    //
+    class STAND_IN_STREAM
+    {
+    public:
+
+        static const DWORD      SEGMENT_SIZE = 4096;
+
+        STAND_IN_STREAM() :
+            m_cbRead(0),
+            m_pfnRead(NULL),
+            m_pvRead(NULL)
+        {
+            InitializeSRWLock(&m_srwLock);
+        }
+
+        VOID
+        Write(
+            DWORD       cbWrite,
+            BOOL        fFinal
+        )
+        {
+            AcquireSRWLockExclusive(&m_srwLock);
+            m_writes.push_back({ cbWrite, fFinal });
+            CompleteRead();
+            ReleaseSRWLockExclusive(&m_srwLock);
+        }
+
+        VOID
+        Read(
+            DWORD                   cbRead,
+            PFN_STAND_IN_COMPLETION pfnRead,
+            PVOID                   pvRead
+        )
+        {
+            AcquireSRWLockExclusive(&m_srwLock);
+            m_cbRead = cbRead;
+            m_pfnRead = pfnRead;
+            m_pvRead = pvRead;
+            CompleteRead();
+            ReleaseSRWLockExclusive(&m_srwLock);
+        }
+
+    private:
+
+        VOID
+        CompleteRead()
+        {
+            if (m_pfnRead == NULL || m_writes.empty())
+            {
+                return;
+            }
+
+            STAND_IN_WRITE &write = m_writes.front();
+            DWORD cbIo = min(min(m_cbRead, SEGMENT_SIZE), write.cbWrite);
+            BOOL fFinal = FALSE;
+
+            write.cbWrite -= cbIo;
+            if (write.cbWrite == 0)
+            {
+                fFinal = write.fFinal;
+                m_writes.pop_front();
+            }
+
+            PostCompletion(m_pfnRead, m_pvRead, cbIo, fFinal);
+            m_pfnRead = NULL;
+        }
+
+        struct STAND_IN_WRITE
+        {
+            DWORD   cbWrite;
+            BOOL    fFinal;
+        };
+
+        SRWLOCK                 m_srwLock;
+        std::deque<STAND_IN_WRITE> m_writes;
+        DWORD                   m_cbRead;
+        PFN_STAND_IN_COMPLETION m_pfnRead;
+        PVOID                   m_pvRead;
+    };
+
+    //
+    // One connection: the client keeps cWindow messages of cbMessage bytes
+    // in flight until cMessages have come back from the echo server.
+    //
+    class STAND_IN_CONNECTION
+    {
+    public:
+
+        STAND_IN_CONNECTION(
+            WEBSOCKET_BUFFER_POOL * pPool,
+            BOOL                    fHibernate,
+            DWORD                   cMessages,
+            DWORD                   cbMessage,
+            volatile LONG *         pcRemaining,
+            HANDLE                  hDone
+        ) : m_cMessages(cMessages),
+            m_cbMessage(cbMessage),
+            m_cSent(0),
+            m_cEchoed(0),
+            m_pcRemaining(pcRemaining),
+            m_hDone(hDone)
+        {
+            m_toServer.pConnection = this;
+            m_toServer.fToServer = TRUE;
+            m_toServer.pipeline.Initialize(pPool, 64 * 1024, fHibernate);
+            m_toClient.pConnection = this;
+            m_toClient.fToServer = FALSE;
+            m_toClient.pipeline.Initialize(pPool, 64 * 1024, fHibernate);
+        }
+
+        VOID
+        Start(
+            DWORD       cWindow
+        )
+        {
+            IssueRead(&m_toServer);
+            IssueRead(&m_toClient);
+
+            for (DWORD i = 0; i < cWindow && i < m_cMessages; i++)
+            {
+                InterlockedIncrement(&m_cSent);
+                m_toServer.source.Write(m_cbMessage, TRUE);
+            }
+        }
+
+        ULONGLONG
+        QueryBytesRelayed() const
+        {
+            WEBSOCKET_PIPELINE_COUNTERS toServer;
+            WEBSOCKET_PIPELINE_COUNTERS toClient;
+
+            m_toServer.pipeline.QueryCounters(&toServer);
+            m_toClient.pipeline.QueryCounters(&toClient);
+            return toServer.cbSent + toClient.cbSent;
+        }
+
+    private:
+
+        struct DIRECTION
+        {
+            STAND_IN_CONNECTION *   pConnection;
+            BOOL                    fToServer;
+            WEBSOCKET_PIPELINE      pipeline;
+            STAND_IN_STREAM         source;
+        };
+
+        static
+        VOID
+        IssueRead(
+            DIRECTION *     pDirection
+        )
+        {
+            BYTE *pbRead;
+            DWORD cbRead;
+
+            if (FAILED(pDirection->pipeline.BeginRead(&pbRead, &cbRead)))
+            {
+                return;
+            }
+            pDirection->source.Read(cbRead, OnReadComplete, pDirection);
+        }
+
+        static
+        VOID
+        OnReadComplete(
+            PVOID       pvDirection,
+            DWORD       cbIo,
+            BOOL        fFinal
+        )
+        {
+            DIRECTION *pDirection = static_cast<DIRECTION *>(pvDirection);
+            STAND_IN_CONNECTION *pConnection = pDirection->pConnection;
+            WEBSOCKET_RELAY_BUFFER *pBuffer = pDirection->pipeline.QueryBuffer();
+
+            if (pConnection->m_shutdown.TryEnter())
+            {
+                if (!pDirection->pipeline.CompleteRead(cbIo, FALSE, fFinal))
+                {
+                    IssueRead(pDirection);
+                }
+                else
+                {
+                    pDirection->pipeline.BeginSend();
+                    PostCompletion(OnSendComplete, pDirection, pBuffer->QueryDataSize(), pBuffer->IsFinal());
+                }
+                pConnection->m_shutdown.Leave();
+            }
+        }
+
+        //
+        // The other endpoint got the data: the echo server writes it back,
+        // the client counts it and sends the next message.
+        //
+        static
+        VOID
+        OnSendComplete(
+            PVOID       pvDirection,
+            DWORD       cbIo,
+            BOOL        fFinal
+        )
+        {
+            DIRECTION *pDirection = static_cast<DIRECTION *>(pvDirection);
+            STAND_IN_CONNECTION *pConnection = pDirection->pConnection;
+
+            if (pConnection->m_shutdown.TryEnter())
+            {
+                pDirection->pipeline.QueryBuffer()->CompleteSend();
+
+                if (pDirection->fToServer)
+                {
+                    pConnection->m_toClient.source.Write(cbIo, fFinal);
+                }
+                else if (fFinal)
+                {
+                    pConnection->OnEcho();
+                }
+
+                if (!pConnection->m_shutdown.IsShutdown())
+                {
+                    IssueRead(pDirection);
+                }
+                pConnection->m_shutdown.Leave();
+            }
+        }
+
+        VOID
+        OnEcho()
+        {
+            LONG cEchoed = InterlockedIncrement(&m_cEchoed);
+
+            if (static_cast<DWORD>(cEchoed) == m_cMessages)
+            {
+                m_shutdown.Shutdown(0);
+                if (InterlockedDecrement(m_pcRemaining) == 0)
+                {
+                    SetEvent(m_hDone);
+                }
+            }
+            else if (static_cast<DWORD>(InterlockedIncrement(&m_cSent)) <= m_cMessages)
+            {
+                m_toServer.source.Write(m_cbMessage, TRUE);
+            }
+        }
+
+        DWORD                   m_cMessages;
+        DWORD                   m_cbMessage;
+        volatile LONG           m_cSent;
+        volatile LONG           m_cEchoed;
+        volatile LONG *         m_pcRemaining;
+        HANDLE                  m_hDone;
+        WEBSOCKET_SHUTDOWN      m_shutdown;
+        DIRECTION               m_toServer;
+        DIRECTION               m_toClient;
+    };
+
+    static
+    VOID
+    RunEchoLoad(
+        WEBSOCKET_BUFFER_POOL * pPool,
+        DWORD                   cConnections,
+        DWORD                   cMessages,
+        DWORD                   cbMessage,
+        DWORD                   cWindow,
+        _Out_ ULONGLONG *       pcbRelayed
+    )
+    {
+        std::vector<STAND_IN_CONNECTION *> connections;
+        volatile LONG cRemaining = static_cast<LONG>(cConnections);
+        HANDLE hDone = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+        ASSERT_NE(static_cast<HANDLE>(NULL), hDone);
+
+        for (DWORD i = 0; i < cConnections; i++)
+        {
+            connections.push_back(new STAND_IN_CONNECTION(pPool, TRUE, cMessages, cbMessage, &cRemaining, hDone));
+        }
+
+        for (auto pConnection : connections)
+        {
+            pConnection->Start(cWindow);
+        }
+        EXPECT_EQ(WAIT_OBJECT_0, WaitForSingleObject(hDone, 5 * 60 * 1000));
+
+        //
+        // The last completions may still be on their way out.
+        //
+        while (g_cCallbacks != 0)
+        {
+            Sleep(1);
+        }
+
+        *pcbRelayed = 0;
+        for (auto pConnection : connections)
+        {
+            *pcbRelayed += pConnection->QueryBytesRelayed();
+            delete pConnection;
+        }
+        CloseHandle(hDone);
+    }
+
+    TEST(WebSocketPipeline, EchoesEveryMessageBothWays)
+    {
+        WEBSOCKET_BUFFER_POOL pool;
+        ULONGLONG cbRelayed;
+
+        ALLOC_CACHE_HANDLER::StaticInitialize();
+        ASSERT_EQ(S_OK, pool.Initialize());
+
+        RunEchoLoad(&pool, 50, 20, 10000, 4, &cbRelayed);
+        EXPECT_EQ(2ULL * 50 * 20 * 10000, cbRelayed);
+    }
+}
@@ -46,6 +46,31 @@ public async Task MiddlewareSkippedIfTokenIsMissing()
             response.EnsureSuccessStatusCode();
         }
 
+        [Fact]
+        public void SignalsReadyEventWhenApplicationStarts()
+        {
+            var eventName = "ASPNETCORE_READY_TEST_" + Guid.NewGuid().ToString("N");
+            using (var readyEvent = new EventWaitHandle(false, EventResetMode.AutoReset, eventName))
+            {
+                var builder = new WebHostBuilder()
+                    .UseSetting("TOKEN", "TestToken")
+                    .UseSetting("PORT", "12345")
+                    .UseSetting("APPL_PATH", "/")
+                    .UseSetting("READY_EVENT", eventName)
+                    .UseIISIntegration()
+                    .Configure(app =>
+                    {
+                        app.Run(context => Task.FromResult(0));
+                    });
+
+                Assert.False(readyEvent.WaitOne(0));
+                using (var server = new TestServer(builder))
+                {
+                    Assert.True(readyEvent.WaitOne(TimeSpan.FromSeconds(5)));
+                }
+            }
+        }
+
         [Fact]
         public async Task MiddlewareRejectsRequestIfTokenHeaderIsMissing()
         {
@@ -74,6 +99,34 @@ public async Task MiddlewareRejectsRequestIfTokenHeaderIsMissing()
             Assert.Equal(HttpStatusCode.BadRequest, response.StatusCode);
         }
 
+        [Fact]
+        public async Task MiddlewareRejectsRequestIfTokenHeaderIsMissingOnUnixSocket()
+        {
+            var assertsExecuted = false;
+
+            var builder = new WebHostBuilder()
+                .UseSetting("TOKEN", "TestToken")
+                .UseSetting("UNIX_SOCKET", @"C:\Windows\Temp\ancm-1-00000001.sock")
+                .UseSetting("APPL_PATH", "/")
+                .UseIISIntegration()
+                .Configure(app =>
+                {
+                    app.Run(context =>
+                    {
+                        assertsExecuted = true;
+                        return Task.FromResult(0);
+                    });
+                });
+            var server = new TestServer(builder);
+
+            Assert.Equal("http://unix:/Windows/Temp/ancm-1-00000001.sock", builder.GetSetting(WebHostDefaults.ServerUrlsKey));
+
+            var req = new HttpRequestMessage(HttpMethod.Get, "");
+            var response = await server.CreateClient().SendAsync(req);
+            Assert.False(assertsExecuted);
+            Assert.Equal(HttpStatusCode.BadRequest, response.StatusCode);
+        }
+
         [Theory]
         [InlineData("/", "/iisintegration", "shutdown")]
         [InlineData("/", "/iisintegration", "Shutdown")]